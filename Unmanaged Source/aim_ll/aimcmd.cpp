@@ -36,6 +36,7 @@
 
 #include "..\aimapi\imdisk.h"
 #include "..\phdskmnt\inc\imdproxy.h"
+#include "..\phdskmnt\inc\imscsitrace.h"
 
 #pragma comment(lib, "shell32.lib")
 #pragma comment(lib, "ntdll.lib")
@@ -107,6 +108,11 @@ ImScsiSyntaxHelp()
         "        Rescans SCSI bus on installed adapter Useful to cleanup virtual disks\n"
         "        where connection to backend storage service is lost.\n"
         "\n"
+        "aim_ll --trace dumpfile\n"
+        "        Saves request trace records kept by driver to a file, for analysis\n"
+        "        with aimtrace. Tracing is enabled with TraceBufferSize driver\n"
+        "        parameter.\n"
+        "\n"
         "Manage virtual disks:\n"
         "aim_ll -a -t type [-n] [-o opt1[,opt2 ...]] [-f|-F file] [-s size] [-b offset]\n"
         "       [-S sectorsize] [-u devicenumber] [-m mountpoint]\n"
@@ -257,6 +263,13 @@ ImScsiSyntaxHelp()
         "        in the -l output for a virtual disk. The 'saved' option is only valid\n"
         "        with the -e parameter.\n"
         "\n"
+        "high, normal, low, bg\n"
+        "        Priority class of requests to the virtual disk, compared to other\n"
+        "        virtual disks. Virtual disks with low or background priority are\n"
+        "        slowed down while virtual disks with higher priority are busy. Default\n"
+        "        is normal. Can be used with the -e parameter to change priority of an\n"
+        "        existing virtual disk.\n"
+        "\n"
         "        Note that virtual floppy or CD/DVD-ROM drives are always read-only and\n"
         "        removable devices and that cannot be changed.\n"
         "\n"
@@ -1543,6 +1556,81 @@ ImScsiCliQueryStatusWriteFilter(HANDLE Device)
     }
 }
 
+// Prints a latency in microseconds with a suitable unit.
+void
+ImScsiCliPrintLatency(ULONGLONG Microseconds)
+{
+    if (Microseconds >= 1000000)
+    {
+        printf("%7.4g s ", Microseconds / 1000000.0);
+    }
+    else if (Microseconds >= 1000)
+    {
+        printf("%7.4g ms", Microseconds / 1000.0);
+    }
+    else
+    {
+        printf("%7I64u us", Microseconds);
+    }
+}
+
+// Prints request counters and non-empty latency histogram buckets.
+void
+ImScsiCliPrintStatistics(const IMSCSI_DEVICE_STATISTICS *Stats)
+{
+    printf("Requests: %I64u read (%I64u bytes), %I64u write (%I64u bytes), "
+        "%I64u unmap, %I64u other, %I64u failed.\n",
+        Stats->ReadRequests,
+        Stats->BytesRead,
+        Stats->WriteRequests,
+        Stats->BytesWritten,
+        Stats->UnmapRequests,
+        Stats->OtherRequests,
+        Stats->Errors);
+
+    printf("Queue depth: %u, max %u.\n",
+        Stats->QueueDepth,
+        Stats->MaxQueueDepth);
+
+    ULONGLONG total = 0;
+
+    for (int i = 0; i < IMSCSI_LATENCY_BUCKETS; i++)
+    {
+        total += Stats->TotalLatency[i];
+    }
+
+    if (total == 0)
+    {
+        return;
+    }
+
+    puts("Latency          Total requests   Image I/O");
+
+    for (int i = 0; i < IMSCSI_LATENCY_BUCKETS; i++)
+    {
+        if (Stats->TotalLatency[i] == 0 && Stats->BackendLatency[i] == 0)
+        {
+            continue;
+        }
+
+        if (i == IMSCSI_LATENCY_BUCKETS - 1)
+        {
+            printf(">= ");
+        }
+        else
+        {
+            printf(" < ");
+        }
+
+        ImScsiCliPrintLatency(i == IMSCSI_LATENCY_BUCKETS - 1 ?
+            1ULL << i : 2ULL << i);
+
+        printf("  %14I64u  %10I64u\n",
+            Stats->TotalLatency[i],
+            Stats->BackendLatency[i]);
+    }
+}
+
 // Prints information about an existing virtual disk device, identified by
 // either a device number or mount point.
 int
@@ -1696,6 +1784,12 @@ ImScsiCliQueryStatusDevice(DEVICE_NUMBER DeviceNumber,
                 return IMSCSI_CLI_ERROR_DEVICE_INACCESSIBLE;
             }
 
+            // Not supported by older drivers
+            IMSCSI_DEVICE_STATISTICS stats = { 0 };
+
+            BOOL have_stats = ImScsiQueryStatistics(adapter,
+                config->DeviceNumber, &stats);
+
             CloseHandle(adapter);
 
             if (config->FileNameLength != 0)
@@ -1749,6 +1843,11 @@ ImScsiCliQueryStatusDevice(DEVICE_NUMBER DeviceNumber,
                     (LPCWSTR)(((PUCHAR)config->FileName) + config->FileNameLength));
             }
 
+            if (have_stats)
+            {
+                ImScsiCliPrintStatistics(&stats);
+            }
+
             flushall();
 
             // Show write filter status
@@ -1944,6 +2043,120 @@ ImScsiCliQueryStatusDriver(BOOL NumericPrint)
     return IMSCSI_CLI_SUCCESS;
 }
 
+// Saves request trace records from all processors to a trace dump file, as
+// defined in imscsitrace.h.
+int
+ImScsiCliSaveTrace(LPCWSTR FileName)
+{
+    HANDLE adapter = ImScsiOpenScsiAdapter();
+
+    if (adapter == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+        {
+            fprintf(stderr, "Arsenal Image Mounter not installed.\n");
+            return IMSCSI_CLI_ERROR_DRIVER_NOT_INSTALLED;
+        }
+        else
+        {
+            PrintLastError(L"Cannot control the Arsenal Image Mounter:");
+            return IMSCSI_CLI_ERROR_DRIVER_INACCESSIBLE;
+        }
+    }
+
+    const ULONG buffer_records = 4096;
+
+    WHeapMem<IMSCSI_TRACE_RECORD> records(
+        buffer_records * sizeof(IMSCSI_TRACE_RECORD),
+        HEAP_GENERATE_EXCEPTIONS);
+
+    IMSCSI_TRACE_QUERY query = { 0 };
+
+    if (!ImScsiQueryTrace(adapter, &query, records, 0))
+    {
+        PrintLastError(L"Cannot read request trace, tracing may be disabled:");
+        NtClose(adapter);
+        return IMSCSI_CLI_ERROR_DRIVER_INACCESSIBLE;
+    }
+
+    HANDLE file = CreateFile(FileName, GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        PrintLastError(FileName);
+        NtClose(adapter);
+        return IMSCSI_CLI_ERROR_FATAL;
+    }
+
+    IMSCSI_TRACE_DUMP_HEADER header = { 0 };
+    header.magic = IMSCSI_TRACE_DUMP_MAGIC;
+    header.version = IMSCSI_TRACE_VERSION;
+    header.record_size = sizeof(IMSCSI_TRACE_RECORD);
+    header.frequency = query.Frequency;
+
+    DWORD dw;
+    BOOL result = WriteFile(file, &header, sizeof(header), &dw, NULL);
+    ULONG processor_count = query.ProcessorCount;
+
+    for (ULONG processor = 0;
+        result && processor < processor_count;
+        processor++)
+    {
+        query.Processor = processor;
+        query.Position = 0;
+
+        // Records are read until driver returns less than buffer holds,
+        // which means that all records up to current position are read.
+        do
+        {
+            result = ImScsiQueryTrace(adapter, &query, records,
+                (DWORD)records.GetSize());
+
+            if (!result)
+            {
+                PrintLastError(L"Cannot read request trace:");
+                break;
+            }
+
+            result = WriteFile(file, records,
+                query.RecordCount * sizeof(IMSCSI_TRACE_RECORD), &dw, NULL);
+
+            if (!result)
+            {
+                PrintLastError(FileName);
+                break;
+            }
+
+            header.record_count += query.RecordCount;
+
+        } while (query.RecordCount == buffer_records);
+    }
+
+    NtClose(adapter);
+
+    // Header with final record count
+    if (result &&
+        (SetFilePointer(file, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+            !WriteFile(file, &header, sizeof(header), &dw, NULL)))
+    {
+        PrintLastError(FileName);
+        result = FALSE;
+    }
+
+    CloseHandle(file);
+
+    if (!result)
+    {
+        return IMSCSI_CLI_ERROR_FATAL;
+    }
+
+    printf("Saved %u trace records from %u processors.\n",
+        header.record_count, processor_count);
+
+    return IMSCSI_CLI_SUCCESS;
+}
+
 // Changes flags for an existing virtual disk. FlagsToChange specifies which
 // flag bits to change,
 // (0=not touch, 1=set to corresponding bit value in Flags parameter).
@@ -2095,6 +2308,11 @@ wmain(int argc, LPWSTR argv[])
         return 0;
     }
 
+    if ((argc == 3) && (_wcsicmp(argv[1], L"--trace") == 0))
+    {
+        return ImScsiCliSaveTrace(argv[2]);
+    }
+
     if ((argc >= 2) &&
         ((_wcsicmp(argv[1], L"--install") == 0) ||
         (_wcsicmp(argv[1], L"--uninstall") == 0) ||
@@ -2265,6 +2483,24 @@ wmain(int argc, LPWSTR argv[])
                             flags_to_change |= IMSCSI_IMAGE_MODIFIED;
                             flags &= ~IMSCSI_IMAGE_MODIFIED;
                         }
+                        else if ((wcscmp(opt, L"high") == 0) ||
+                            (wcscmp(opt, L"normal") == 0) ||
+                            (wcscmp(opt, L"low") == 0) ||
+                            (wcscmp(opt, L"bg") == 0))
+                        {
+                            if (IMSCSI_PRIORITY(flags_to_change))
+                                ImScsiSyntaxHelp();
+
+                            flags_to_change |= IMSCSI_PRIORITY_MASK;
+                            flags &= ~IMSCSI_PRIORITY_MASK;
+
+                            if (wcscmp(opt, L"high") == 0)
+                                flags |= IMSCSI_PRIORITY_HIGH;
+                            else if (wcscmp(opt, L"low") == 0)
+                                flags |= IMSCSI_PRIORITY_LOW;
+                            else if (wcscmp(opt, L"bg") == 0)
+                                flags |= IMSCSI_PRIORITY_BACKGROUND;
+                        }
                         // None of the other options are valid with -e operation mode.
                         else if (op_mode != OP_MODE_CREATE)
                         {
@@ -19,6 +19,7 @@
 #include "..\phdskmnt\inc\ntumapi.h"
 #include "..\phdskmnt\inc\phdskmntver.h"
 #include "..\phdskmnt\inc\imdproxy.h"
+#include "..\phdskmnt\inc\imscsitrace.h"
 #include "imdisk.h"
 
 #include "aimapi.h"
@@ -2097,6 +2098,179 @@ ImScsiExtendDevice(HWND hWnd,
     return TRUE;
 }
 
+AIMAPI_API BOOL
+WINAPI
+ImScsiQueryReadCache(HANDLE Adapter,
+    DEVICE_NUMBER DeviceNumber,
+    PIMSCSI_READ_CACHE_INFO ReadCacheInfo)
+{
+    DWORD dw;
+
+    SRB_IMSCSI_READ_CACHE read_cache = { 0 };
+
+    read_cache.DeviceNumber = DeviceNumber;
+
+    if (!ImScsiDeviceIoControl(Adapter,
+        SMP_IMSCSI_QUERY_READ_CACHE,
+        &read_cache.SrbIoControl,
+        sizeof(read_cache),
+        0, &dw))
+    {
+        return FALSE;
+    }
+
+    *ReadCacheInfo = read_cache.Info;
+
+    return TRUE;
+}
+
+AIMAPI_API BOOL
+WINAPI
+ImScsiSetReadAhead(HWND hWnd,
+    HANDLE Adapter,
+    DEVICE_NUMBER DeviceNumber,
+    DWORD MaxReadAheadSize)
+{
+    DWORD dw;
+
+    ImScsiSetStatusMsg(hWnd, L"Setting read-ahead size...");
+
+    SRB_IMSCSI_READ_CACHE read_cache = { 0 };
+
+    read_cache.DeviceNumber = DeviceNumber;
+    read_cache.Info.MaxReadAheadSize = MaxReadAheadSize;
+
+    if (!ImScsiDeviceIoControl(Adapter,
+        SMP_IMSCSI_SET_READ_CACHE,
+        &read_cache.SrbIoControl,
+        sizeof(read_cache),
+        0, &dw))
+    {
+        ImScsiMsgBoxLastError(hWnd, L"Error setting read-ahead size:");
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+AIMAPI_API BOOL
+WINAPI
+ImScsiQueryQos(HANDLE Adapter,
+    DEVICE_NUMBER DeviceNumber,
+    PIMSCSI_QOS_INFO QosInfo)
+{
+    DWORD dw;
+
+    SRB_IMSCSI_QOS qos = { 0 };
+
+    qos.DeviceNumber = DeviceNumber;
+
+    if (!ImScsiDeviceIoControl(Adapter,
+        SMP_IMSCSI_QUERY_QOS,
+        &qos.SrbIoControl,
+        sizeof(qos),
+        0, &dw))
+    {
+        return FALSE;
+    }
+
+    *QosInfo = qos.Info;
+
+    return TRUE;
+}
+
+AIMAPI_API BOOL
+WINAPI
+ImScsiSetQos(HWND hWnd,
+    HANDLE Adapter,
+    DEVICE_NUMBER DeviceNumber,
+    DWORD MaxIops,
+    ULONGLONG MaxBytesPerSecond,
+    DWORD Priority)
+{
+    DWORD dw;
+
+    ImScsiSetStatusMsg(hWnd, L"Setting request rate limits...");
+
+    SRB_IMSCSI_QOS qos = { 0 };
+
+    qos.DeviceNumber = DeviceNumber;
+    qos.Info.MaxIops = MaxIops;
+    qos.Info.MaxBytesPerSecond = MaxBytesPerSecond;
+    qos.Info.Priority = Priority;
+
+    if (!ImScsiDeviceIoControl(Adapter,
+        SMP_IMSCSI_SET_QOS,
+        &qos.SrbIoControl,
+        sizeof(qos),
+        0, &dw))
+    {
+        ImScsiMsgBoxLastError(hWnd, L"Error setting request rate limits:");
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+AIMAPI_API BOOL
+WINAPI
+ImScsiQueryStatistics(HANDLE Adapter,
+    DEVICE_NUMBER DeviceNumber,
+    PIMSCSI_DEVICE_STATISTICS Statistics)
+{
+    DWORD dw;
+
+    SRB_IMSCSI_STATISTICS stats = { 0 };
+
+    stats.DeviceNumber = DeviceNumber;
+
+    if (!ImScsiDeviceIoControl(Adapter,
+        SMP_IMSCSI_QUERY_STATISTICS,
+        &stats.SrbIoControl,
+        sizeof(stats),
+        0, &dw))
+    {
+        return FALSE;
+    }
+
+    *Statistics = stats.Info;
+
+    return TRUE;
+}
+
+AIMAPI_API BOOL
+WINAPI
+ImScsiQueryTrace(HANDLE Adapter,
+    PIMSCSI_TRACE_QUERY Query,
+    PVOID Records,
+    DWORD RecordsSize)
+{
+    DWORD dw;
+
+    WHeapMem<SRB_IMSCSI_TRACE> trace(sizeof(SRB_IMSCSI_TRACE) + RecordsSize,
+        HEAP_GENERATE_EXCEPTIONS | HEAP_ZERO_MEMORY);
+
+    trace->Info = *Query;
+
+    if (!ImScsiDeviceIoControl(Adapter,
+        SMP_IMSCSI_QUERY_TRACE,
+        &trace->SrbIoControl,
+        (DWORD)trace.GetSize(),
+        0, &dw))
+    {
+        return FALSE;
+    }
+
+    *Query = trace->Info;
+
+    memcpy(Records, trace + 1,
+        Query->RecordCount * sizeof(IMSCSI_TRACE_RECORD));
+
+    return TRUE;
+}
+
 AIMAPI_API BOOL
 WINAPI
 ImScsiSaveRegistrySettings(PIMSCSI_DEVICE_CONFIGURATION Config)
@@ -2106,6 +2280,8 @@ ImScsiSaveRegistrySettings(PIMSCSI_DEVICE_CONFIGURATION Config)
     DWORD load_devices;
     DWORD value_size;
     LPWSTR value_name;
+    DWORD flags;
+    IMSCSI_DEVICE_QOS_LIMITS qos_limits = { 0 };
 
     err_code = RegCreateKey(HKEY_LOCAL_MACHINE,
         L"SYSTEM\\CurrentControlSet\\Services\\phdskmnt"
@@ -2238,14 +2414,17 @@ ImScsiSaveRegistrySettings(PIMSCSI_DEVICE_CONFIGURATION Config)
         return FALSE;
     }
 
-    if (Config->Flags != 0)
+    // QoS limits are saved as separate values below
+    flags = Config->Flags & ~IMSCSI_OPTION_QOS_LIMITS;
+
+    if (flags != 0)
     {
         err_code = RegSetValueEx(hkey,
             value_name,
             0,
             REG_DWORD,
-            (LPBYTE)&Config->Flags,
-            sizeof(Config->Flags));
+            (LPBYTE)&flags,
+            sizeof(flags));
 
         if (err_code != ERROR_SUCCESS)
         {
@@ -2288,6 +2467,69 @@ ImScsiSaveRegistrySettings(PIMSCSI_DEVICE_CONFIGURATION Config)
 
     LocalFree(value_name);
 
+    if (IMSCSI_QOS_LIMITS(Config->Flags))
+        memcpy(&qos_limits,
+            (PUCHAR)Config + IMSCSI_QOS_LIMITS_OFFSET(Config),
+            sizeof(qos_limits));
+
+    value_name = ImScsiAllocPrintF(IMSCSI_CFG_MAX_IOPS_PREFIX L"%1!u!",
+        Config->DeviceNumber);
+    if (value_name == NULL)
+    {
+        RegCloseKey(hkey);
+        return FALSE;
+    }
+
+    if (qos_limits.MaxIops != 0)
+    {
+        err_code = RegSetValueEx(hkey,
+            value_name,
+            0,
+            REG_DWORD,
+            (LPBYTE)&qos_limits.MaxIops,
+            sizeof(qos_limits.MaxIops));
+
+        if (err_code != ERROR_SUCCESS)
+        {
+            RegCloseKey(hkey);
+            SetLastError(err_code);
+            return FALSE;
+        }
+    }
+    else
+        RegDeleteValue(hkey, value_name);
+
+    LocalFree(value_name);
+
+    value_name = ImScsiAllocPrintF(IMSCSI_CFG_MAX_BYTES_PREFIX L"%1!u!",
+        Config->DeviceNumber);
+    if (value_name == NULL)
+    {
+        RegCloseKey(hkey);
+        return FALSE;
+    }
+
+    if (qos_limits.MaxBytesPerSecond != 0)
+    {
+        err_code = RegSetValueEx(hkey,
+            value_name,
+            0,
+            REG_QWORD,
+            (LPBYTE)&qos_limits.MaxBytesPerSecond,
+            sizeof(qos_limits.MaxBytesPerSecond));
+
+        if (err_code != ERROR_SUCCESS)
+        {
+            RegCloseKey(hkey);
+            SetLastError(err_code);
+            return FALSE;
+        }
+    }
+    else
+        RegDeleteValue(hkey, value_name);
+
+    LocalFree(value_name);
+
     RegCloseKey(hkey);
 
     return TRUE;
@@ -2397,6 +2639,30 @@ ImScsiRemoveRegistrySettings(DEVICE_NUMBER DeviceNumber)
 
     LocalFree(value_name);
 
+    value_name = ImScsiAllocPrintF(IMSCSI_CFG_MAX_IOPS_PREFIX L"%1!u!",
+        DeviceNumber);
+    if (value_name == NULL)
+    {
+        RegCloseKey(hkey);
+        return FALSE;
+    }
+
+    RegDeleteValue(hkey, value_name);
+
+    LocalFree(value_name);
+
+    value_name = ImScsiAllocPrintF(IMSCSI_CFG_MAX_BYTES_PREFIX L"%1!u!",
+        DeviceNumber);
+    if (value_name == NULL)
+    {
+        RegCloseKey(hkey);
+        return FALSE;
+    }
+
+    RegDeleteValue(hkey, value_name);
+
+    LocalFree(value_name);
+
     RegCloseKey(hkey);
 
     return TRUE;
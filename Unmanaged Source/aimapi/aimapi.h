@@ -132,7 +132,10 @@ extern "C" {
     Config          Pointer to a sufficiently large
     IMSCSI_DEVICE_CONFIGURATION structure to receive all data including the
     image file, if any. When calling this function, set the DeviceNumber
-    member to the device number to request information about.
+    member to the device number to request information about. If device
+    has QoS limits and there is room for them, Flags member contains
+    IMSCSI_OPTION_QOS_LIMITS and limits follow file names, so that the same
+    configuration can be used to create the device again.
 
     ConfigSize      The size in bytes of the memory the Config parameter
     points to. The function call will fail if the memory is not
@@ -423,6 +426,142 @@ extern "C" {
     */
     AIMAPI_API fImScsiExtendDevice ImScsiExtendDevice;
 
+    typedef BOOL
+        WINAPI
+        fImScsiQueryReadCache(IN HANDLE Adapter,
+            IN DEVICE_NUMBER DeviceNumber,
+            OUT PIMSCSI_READ_CACHE_INFO ReadCacheInfo);
+
+    /**
+    This function returns read cache and read-ahead settings and counters
+    for an existing virtual disk device.
+
+    DeviceNumber    Number of the device to query.
+
+    ReadCacheInfo   Pointer to an IMSCSI_READ_CACHE_INFO structure that
+    receives current settings and counters.
+    */
+    AIMAPI_API fImScsiQueryReadCache ImScsiQueryReadCache;
+
+    typedef BOOL
+        WINAPI
+        fImScsiSetReadAhead(IN HWND hWndStatusText OPTIONAL,
+            IN HANDLE Adapter,
+            IN DEVICE_NUMBER DeviceNumber,
+            IN DWORD MaxReadAheadSize);
+
+    /**
+    This function changes the largest read-ahead window used for each
+    sequential read stream on an existing virtual disk device. The function
+    fails if the device has no read cache.
+
+    hWndStatusText  A handle to a window that can display status message text.
+    The function will send WM_SETTEXT messages to this window.
+    If this parameter is NULL no WM_SETTEXT messages are sent
+    and the function acts non-interactive.
+
+    DeviceNumber    Number of the device to change.
+
+    MaxReadAheadSize    Largest read-ahead window in bytes. Zero disables
+    read-ahead.
+    */
+    AIMAPI_API fImScsiSetReadAhead ImScsiSetReadAhead;
+
+    typedef BOOL
+        WINAPI
+        fImScsiQueryQos(IN HANDLE Adapter,
+            IN DEVICE_NUMBER DeviceNumber,
+            OUT PIMSCSI_QOS_INFO QosInfo);
+
+    /**
+    This function returns request rate limits, priority class and delay
+    counters for an existing virtual disk device.
+
+    DeviceNumber    Number of the device to query.
+
+    QosInfo         Pointer to an IMSCSI_QOS_INFO structure that receives
+    current settings and counters.
+    */
+    AIMAPI_API fImScsiQueryQos ImScsiQueryQos;
+
+    typedef BOOL
+        WINAPI
+        fImScsiSetQos(IN HWND hWndStatusText OPTIONAL,
+            IN HANDLE Adapter,
+            IN DEVICE_NUMBER DeviceNumber,
+            IN DWORD MaxIops,
+            IN ULONGLONG MaxBytesPerSecond,
+            IN DWORD Priority);
+
+    /**
+    This function changes request rate limits and priority class of an
+    existing virtual disk device. Priority class can also be changed with
+    ImScsiChangeFlags.
+
+    hWndStatusText  A handle to a window that can display status message text.
+    The function will send WM_SETTEXT messages to this window.
+    If this parameter is NULL no WM_SETTEXT messages are sent
+    and the function acts non-interactive.
+
+    DeviceNumber    Number of the device to change.
+
+    MaxIops         Largest number of read and write requests per second.
+    Zero for no limit.
+
+    MaxBytesPerSecond   Largest number of bytes read and written per second.
+    Zero for no limit.
+
+    Priority        One of IMSCSI_PRIORITY_xxx values.
+    */
+    AIMAPI_API fImScsiSetQos ImScsiSetQos;
+
+    typedef BOOL
+        WINAPI
+        fImScsiQueryStatistics(IN HANDLE Adapter,
+            IN DEVICE_NUMBER DeviceNumber,
+            OUT PIMSCSI_DEVICE_STATISTICS Statistics);
+
+    /**
+    This function returns request counters, current queue depth and latency
+    histograms for an existing virtual disk device, using an
+    SMP_IMSCSI_QUERY_STATISTICS request.
+
+    Adapter         Handle to SCSI adapter, as returned by
+    ImScsiOpenScsiAdapter.
+
+    DeviceNumber    Number of the device to query.
+
+    Statistics      Pointer to an IMSCSI_DEVICE_STATISTICS structure that
+    receives counters.
+    */
+    AIMAPI_API fImScsiQueryStatistics ImScsiQueryStatistics;
+
+    typedef BOOL
+        WINAPI
+        fImScsiQueryTrace(IN HANDLE Adapter,
+            IN OUT PIMSCSI_TRACE_QUERY Query,
+            OUT PVOID Records,
+            IN DWORD RecordsSize);
+
+    /**
+    This function reads request trace records kept by driver for one
+    processor. Tracing is enabled with TraceBufferSize driver parameter.
+
+    Adapter         Handle to SCSI adapter, as returned by
+    ImScsiOpenScsiAdapter.
+
+    Query           Pointer to an IMSCSI_TRACE_QUERY structure. Processor and
+    Position members select records to read. On return, Position is where
+    to continue in next call, RecordCount is number of records stored at
+    Records and ProcessorCount and Frequency describe trace.
+
+    Records         Buffer that receives IMSCSI_TRACE_RECORD structures, as
+    defined in imscsitrace.h.
+
+    RecordsSize     Size in bytes of buffer at Records.
+    */
+    AIMAPI_API fImScsiQueryTrace ImScsiQueryTrace;
+
     typedef BOOL
         WINAPI
         fImScsiSaveRegistrySettings(PIMSCSI_DEVICE_CONFIGURATION Config);
@@ -435,7 +574,9 @@ extern "C" {
     returned, GetLastError could be used to get actual error code.
 
     Config          Pointer to IMSCSI_DEVICE_CONFIGURATION structure that
-    contains device creation settings to save.
+    contains device creation settings to save. If Flags field contains
+    IMSCSI_OPTION_QOS_LIMITS, QoS limits that follow file names are saved
+    as well, as returned by ImScsiQueryDevice.
 
     */
     AIMAPI_API fImScsiSaveRegistrySettings ImScsiSaveRegistrySettings;
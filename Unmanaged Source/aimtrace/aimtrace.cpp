@@ -0,0 +1,519 @@
+/// aimtrace.cpp
+/// Decoder for request trace dumps saved with aim_ll --trace. Pairs the
+/// stage records of each request and prints latency breakdowns for time
+/// spent queued, preparing, in image I/O and finishing. Optionally writes
+/// the requests as a Chrome trace JSON file, which can be opened in
+/// chrome://tracing or Perfetto.
+///
+/// Only uses standard C++, so it builds on Windows as well as on Linux,
+/// where trace dumps are often analyzed.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdint.h>
+#include <sys/types.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <imscsitrace.h>
+
+// SCSI operation codes for request classes
+#define AIMTRACE_SCSIOP_READ        0x28
+#define AIMTRACE_SCSIOP_WRITE       0x2A
+#define AIMTRACE_SCSIOP_READ16      0x88
+#define AIMTRACE_SCSIOP_WRITE16     0x8A
+#define AIMTRACE_SCSIOP_UNMAP       0x42
+
+// Phases between stages. A phase is only counted for requests where both
+// stages it lies between were recorded.
+enum AimTracePhase
+{
+    AIMTRACE_PHASE_QUEUE,       // Queued until picked up by worker thread
+    AIMTRACE_PHASE_PREPARE,     // Picked up until sent to image
+    AIMTRACE_PHASE_IO,          // Image I/O
+    AIMTRACE_PHASE_FINISH,      // Image I/O done until completed
+    AIMTRACE_PHASE_TOTAL,       // First stage recorded until completed
+    AIMTRACE_PHASES
+};
+
+static const struct
+{
+    const char *name;
+    int from;
+    int to;
+} AimTracePhases[AIMTRACE_PHASES] =
+{
+    { "queue", IMSCSI_TRACE_QUEUED, IMSCSI_TRACE_DISPATCHED },
+    { "prepare", IMSCSI_TRACE_DISPATCHED, IMSCSI_TRACE_IO_START },
+    { "image I/O", IMSCSI_TRACE_IO_START, IMSCSI_TRACE_IO_DONE },
+    { "finish", IMSCSI_TRACE_IO_DONE, IMSCSI_TRACE_COMPLETED },
+    { "total", 0, IMSCSI_TRACE_COMPLETED },
+};
+
+enum AimTraceClass
+{
+    AIMTRACE_CLASS_READ,
+    AIMTRACE_CLASS_WRITE,
+    AIMTRACE_CLASS_UNMAP,
+    AIMTRACE_CLASS_OTHER,
+    AIMTRACE_CLASSES
+};
+
+static const char *AimTraceClassNames[AIMTRACE_CLASSES] =
+{
+    "read", "write", "unmap", "other"
+};
+
+// One request, with timestamps of stages seen for it
+struct AimTraceRequest
+{
+    ULONGLONG timestamps[IMSCSI_TRACE_STAGES];
+    ULONG cpus[IMSCSI_TRACE_STAGES];
+    bool seen[IMSCSI_TRACE_STAGES];
+    LONGLONG offset;
+    ULONG device;
+    ULONG length;
+    UCHAR opcode;
+
+    AimTraceRequest()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+
+    int
+    FirstStage() const
+    {
+        for (int stage = 1; stage < IMSCSI_TRACE_STAGES; stage++)
+        {
+            if (seen[stage])
+            {
+                return stage;
+            }
+        }
+
+        return 0;
+    }
+
+    int
+    LastStage() const
+    {
+        for (int stage = IMSCSI_TRACE_STAGES - 1; stage > 0; stage--)
+        {
+            if (seen[stage])
+            {
+                return stage;
+            }
+        }
+
+        return 0;
+    }
+
+    // Returns false if phase was not recorded for this request
+    bool
+    GetPhase(int Phase, ULONGLONG *Start, ULONGLONG *End, ULONG *Cpu) const
+    {
+        int from = AimTracePhases[Phase].from;
+        int to = AimTracePhases[Phase].to;
+
+        if (from == 0)
+        {
+            from = FirstStage();
+
+            // Only one stage, such as read cache hits
+            if (from == to)
+            {
+                return false;
+            }
+        }
+
+        if (from == 0 || !seen[from] || !seen[to] ||
+            timestamps[to] < timestamps[from])
+        {
+            return false;
+        }
+
+        *Start = timestamps[from];
+        *End = timestamps[to];
+        *Cpu = cpus[from];
+
+        return true;
+    }
+
+    int
+    GetClass() const
+    {
+        switch (opcode)
+        {
+        case AIMTRACE_SCSIOP_READ:
+        case AIMTRACE_SCSIOP_READ16:
+            return AIMTRACE_CLASS_READ;
+
+        case AIMTRACE_SCSIOP_WRITE:
+        case AIMTRACE_SCSIOP_WRITE16:
+            return AIMTRACE_CLASS_WRITE;
+
+        case AIMTRACE_SCSIOP_UNMAP:
+            return AIMTRACE_CLASS_UNMAP;
+
+        default:
+            return AIMTRACE_CLASS_OTHER;
+        }
+    }
+};
+
+static bool
+AimTraceCompareRecords(const IMSCSI_TRACE_RECORD &a,
+    const IMSCSI_TRACE_RECORD &b)
+{
+    if (a.timestamp != b.timestamp)
+    {
+        return a.timestamp < b.timestamp;
+    }
+
+    return a.stage < b.stage;
+}
+
+// Reads header and records from a dump file. Returns false with a message
+// printed if file cannot be used.
+static bool
+AimTraceReadDump(const char *FileName, IMSCSI_TRACE_DUMP_HEADER *Header,
+    std::vector<IMSCSI_TRACE_RECORD> &Records)
+{
+    FILE *file = fopen(FileName, "rb");
+
+    if (file == nullptr)
+    {
+        perror(FileName);
+        return false;
+    }
+
+    if (fread(Header, sizeof(*Header), 1, file) != 1 ||
+        Header->magic != IMSCSI_TRACE_DUMP_MAGIC)
+    {
+        fprintf(stderr, "%s: Not a trace dump file.\n", FileName);
+        fclose(file);
+        return false;
+    }
+
+    if (Header->version != IMSCSI_TRACE_VERSION ||
+        Header->record_size != sizeof(IMSCSI_TRACE_RECORD) ||
+        Header->frequency <= 0)
+    {
+        fprintf(stderr, "%s: Unsupported trace dump version %u, record size %u.\n",
+            FileName, Header->version, Header->record_size);
+        fclose(file);
+        return false;
+    }
+
+    Records.resize(Header->record_count);
+
+    size_t count = Records.empty() ? 0 :
+        fread(&Records[0], sizeof(IMSCSI_TRACE_RECORD), Records.size(), file);
+
+    fclose(file);
+
+    if (count != Records.size())
+    {
+        fprintf(stderr, "%s: File truncated, %u of %u records read.\n",
+            FileName, (unsigned)count, (unsigned)Records.size());
+
+        Records.resize(count);
+    }
+
+    return true;
+}
+
+// Pairs stage records of each request. Request identifiers are reused once
+// a request is completed, so a stage seen again, or an earlier stage, starts
+// a new request.
+static void
+AimTracePairRequests(std::vector<IMSCSI_TRACE_RECORD> &Records,
+    std::vector<AimTraceRequest> &Requests)
+{
+    typedef std::pair<ULONG, ULONGLONG> RequestKey;
+    std::map<RequestKey, AimTraceRequest> open;
+
+    std::stable_sort(Records.begin(), Records.end(), AimTraceCompareRecords);
+
+    for (const IMSCSI_TRACE_RECORD &record : Records)
+    {
+        if (record.stage == 0 || record.stage >= IMSCSI_TRACE_STAGES)
+        {
+            continue;
+        }
+
+        RequestKey key(record.device, record.request);
+        auto it = open.find(key);
+
+        if (it != open.end() && it->second.LastStage() >= record.stage)
+        {
+            // Completion record was lost, keep what there is
+            Requests.push_back(it->second);
+            open.erase(it);
+            it = open.end();
+        }
+
+        if (it == open.end())
+        {
+            it = open.insert(std::make_pair(key, AimTraceRequest())).first;
+            it->second.device = record.device;
+            it->second.offset = record.offset;
+            it->second.length = record.length;
+            it->second.opcode = record.opcode;
+        }
+
+        AimTraceRequest &request = it->second;
+
+        request.timestamps[record.stage] = record.timestamp;
+        request.cpus[record.stage] = record.cpu;
+        request.seen[record.stage] = true;
+
+        if (record.stage == IMSCSI_TRACE_COMPLETED)
+        {
+            Requests.push_back(request);
+            open.erase(it);
+        }
+    }
+
+    // Requests still in progress when dump was saved
+    for (auto &entry : open)
+    {
+        Requests.push_back(entry.second);
+    }
+}
+
+static double
+AimTraceMicroseconds(ULONGLONG Ticks, LONGLONG Frequency)
+{
+    return (double)Ticks * 1000000.0 / (double)Frequency;
+}
+
+static void
+AimTracePrintBreakdown(const std::vector<AimTraceRequest> &Requests,
+    LONGLONG Frequency)
+{
+    printf("%-7s %-10s %10s %10s %10s %10s %10s %10s\n",
+        "Class", "Phase", "Count", "Mean us", "50% us", "90% us", "99% us",
+        "Max us");
+
+    for (int request_class = 0; request_class < AIMTRACE_CLASSES; request_class++)
+    {
+        for (int phase = 0; phase < AIMTRACE_PHASES; phase++)
+        {
+            std::vector<ULONGLONG> durations;
+            ULONGLONG sum = 0;
+
+            for (const AimTraceRequest &request : Requests)
+            {
+                ULONGLONG start;
+                ULONGLONG end;
+                ULONG cpu;
+
+                if (request.GetClass() == request_class &&
+                    request.GetPhase(phase, &start, &end, &cpu))
+                {
+                    durations.push_back(end - start);
+                    sum += end - start;
+                }
+            }
+
+            if (durations.empty())
+            {
+                continue;
+            }
+
+            std::sort(durations.begin(), durations.end());
+
+            size_t count = durations.size();
+
+            printf("%-7s %-10s %10u %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                AimTraceClassNames[request_class],
+                AimTracePhases[phase].name,
+                (unsigned)count,
+                AimTraceMicroseconds(sum, Frequency) / count,
+                AimTraceMicroseconds(durations[count / 2], Frequency),
+                AimTraceMicroseconds(durations[count * 9 / 10], Frequency),
+                AimTraceMicroseconds(durations[count * 99 / 100], Frequency),
+                AimTraceMicroseconds(durations[count - 1], Frequency));
+        }
+    }
+}
+
+// Writes a Chrome trace event file. Each virtual disk is shown as a process
+// and each processor as a thread, with phases of requests as complete
+// events on the processor where each phase started.
+static bool
+AimTraceWriteChromeTrace(const char *FileName,
+    const std::vector<AimTraceRequest> &Requests, LONGLONG Frequency)
+{
+    FILE *file = fopen(FileName, "w");
+
+    if (file == nullptr)
+    {
+        perror(FileName);
+        return false;
+    }
+
+    ULONGLONG base = ~0ULL;
+    std::vector<ULONG> devices;
+
+    for (const AimTraceRequest &request : Requests)
+    {
+        int first = request.FirstStage();
+
+        if (first != 0 && request.timestamps[first] < base)
+        {
+            base = request.timestamps[first];
+        }
+
+        if (std::find(devices.begin(), devices.end(), request.device) ==
+            devices.end())
+        {
+            devices.push_back(request.device);
+        }
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+
+    bool first_event = true;
+
+    for (ULONG device : devices)
+    {
+        fprintf(file, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+            "\"args\":{\"name\":\"Device %.6X\"}}",
+            first_event ? "" : ",\n", device, device);
+
+        first_event = false;
+    }
+
+    for (const AimTraceRequest &request : Requests)
+    {
+        for (int phase = 0; phase < AIMTRACE_PHASES; phase++)
+        {
+            ULONGLONG start;
+            ULONGLONG end;
+            ULONG cpu;
+
+            // Total is shown as sum of other phases
+            if (phase == AIMTRACE_PHASE_TOTAL ||
+                !request.GetPhase(phase, &start, &end, &cpu))
+            {
+                continue;
+            }
+
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"offset\":%lld,\"length\":%u,\"opcode\":%u}}",
+                first_event ? "" : ",\n",
+                AimTracePhases[phase].name,
+                AimTraceClassNames[request.GetClass()],
+                request.device,
+                cpu,
+                AimTraceMicroseconds(start - base, Frequency),
+                AimTraceMicroseconds(end - start, Frequency),
+                (long long)request.offset,
+                request.length,
+                request.opcode);
+
+            first_event = false;
+        }
+    }
+
+    fputs("\n]}\n", file);
+
+    if (fclose(file) != 0)
+    {
+        perror(FileName);
+        return false;
+    }
+
+    return true;
+}
+
+static void
+AimTraceUsage()
+{
+    fputs("Decoder for Arsenal Image Mounter request trace dumps.\n"
+        "\n"
+        "Usage:\n"
+        "aimtrace [-c chrometrace.json] dumpfile\n"
+        "\n"
+        "Prints time spent in each phase of requests in a dump file saved with\n"
+        "aim_ll --trace.\n"
+        "\n"
+        "-c     Also write requests as a Chrome trace event file.\n",
+        stderr);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *chrome_file = nullptr;
+    const char *dump_file = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            chrome_file = argv[++i];
+        }
+        else if (argv[i][0] != '-' && dump_file == nullptr)
+        {
+            dump_file = argv[i];
+        }
+        else
+        {
+            AimTraceUsage();
+            return 1;
+        }
+    }
+
+    if (dump_file == nullptr)
+    {
+        AimTraceUsage();
+        return 1;
+    }
+
+    IMSCSI_TRACE_DUMP_HEADER header;
+    std::vector<IMSCSI_TRACE_RECORD> records;
+
+    if (!AimTraceReadDump(dump_file, &header, records))
+    {
+        return 1;
+    }
+
+    std::vector<AimTraceRequest> requests;
+
+    AimTracePairRequests(records, requests);
+
+    printf("%u records, %u requests.\n\n",
+        (unsigned)records.size(), (unsigned)requests.size());
+
+    AimTracePrintBreakdown(requests, header.frequency);
+
+    if (chrome_file != nullptr &&
+        !AimTraceWriteChromeTrace(chrome_file, requests, header.frequency))
+    {
+        return 1;
+    }
+
+    return 0;
+}
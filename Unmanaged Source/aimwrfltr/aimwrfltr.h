@@ -71,6 +71,32 @@
 
 #define IDLE_TRIM_BLOCKS_INTERVAL               32
 
+//
+// Number of allocation table leaves read from diff device in each request
+// by allocation table prefetch thread
+//
+#define ALLOCATION_TABLE_LEAVES_PER_READ        16
+
+//
+// Largest read, in sectors, where map of sectors found in write queue is
+// kept on stack instead of allocated from pool
+//
+#define READ_QUEUE_BITMAP_SECTORS               2048
+
+//
+// Largest number of queued requests worker thread can have in progress at
+// the same time, each in a pipeline slot with a thread and block buffer of
+// its own. Slots are created when a request can start and all existing
+// slots are busy.
+//
+#define WORKER_PIPELINE_SLOTS                   8
+
+//
+// Time in 100 ns units that pipeline slots are kept with nothing to do
+// before their threads and block buffers are freed
+//
+#define WORKER_PIPELINE_IDLE_TIMEOUT            (10LL * 10000000LL)
+
 #define ACCESS_FROM_CTL_CODE(ctrlCode)          ((UCHAR)((ctrlCode >> 14) & 0x03))
 #define FUNCTN_FROM_CTL_CODE(ctrlCode)          (((ctrlCode) >> 2) & 0xfff)
 
@@ -104,6 +130,41 @@
 #endif
 #define ExFreePool(a) ExFreePoolWithTag(a,POOL_TAG)
 
+//
+// Allocation table is looked up when dispatching reads at DISPATCH_LEVEL,
+// so leaves are kept in non-paged pool.
+//
+#define AIMWRFLTR_BLOCK_MAP_ALLOCATE(size) ExAllocateNonPagedPool(size)
+#define AIMWRFLTR_BLOCK_MAP_FREE(ptr) ExFreePool(ptr)
+
+#include "inc\fltblkmap.h"
+
+C_ASSERT(AIMWRFLTR_BLOCK_MAP_LEAF_SIZE == DIFF_BLOCK_SIZE);
+C_ASSERT(AIMWRFLTR_BLOCK_MAP_UNALLOCATED == DIFF_BLOCK_UNALLOCATED);
+
+#include "inc\fltextidx.h"
+
+#include "inc\fltsecmap.h"
+
+#define AIMWRFLTR_PIPELINE_SLOTS WORKER_PIPELINE_SLOTS
+
+#include "inc\fltpipeline.h"
+
+C_ASSERT(AIMWRFLTR_SECTOR_MAP_BLOCK_BITS == DIFF_BLOCK_BITS);
+C_ASSERT(AIMWRFLTR_SECTOR_MAP_SECTOR_BITS == SECTOR_BITS);
+
+//
+// Sector maps are kept in a block map indexed by diff block number, with
+// AIMWRFLTR_SECTOR_MAP_WORDS entries for each diff block. On diff device,
+// each leaf is saved in a diff block of its own. Diff block numbers for
+// leaves are kept in a directory saved in the last block of the area
+// reserved for allocation table. Diff blocks beyond what the directory can
+// describe are always filled completely when allocated.
+//
+#define SECTOR_MAP_BLOCKS_PER_LEAF              (AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES / AIMWRFLTR_SECTOR_MAP_WORDS)
+#define SECTOR_MAP_DIRECTORY_ENTRIES            (DIFF_BLOCK_SIZE / sizeof(LONG))
+#define SECTOR_MAP_MAX_DIFF_BLOCKS              ((ULONGLONG)SECTOR_MAP_DIRECTORY_ENTRIES * SECTOR_MAP_BLOCKS_PER_LEAF)
+
 #pragma warning(disable: 4200)
 
 inline void *operator_new(size_t Size, UCHAR FillByte)
@@ -345,9 +406,36 @@ typedef struct _DEVICE_EXTENSION
     AIMWRFLTR_DEVICE_STATISTICS Statistics;
 
     //
-    // Pointer to diff block allocation table
+    // Diff block allocation table
+    //
+    AIMWRFLTR_BLOCK_MAP AllocationTable;
+
+    //
+    // Serializes loading allocation table leaves from diff device
+    //
+    KEVENT AllocationTableLoadEvent;
+
+    //
+    // Handle to thread loading allocation table in background
+    //
+    HANDLE AllocationTablePrefetchThread;
+
+    //
+    // Sectors missing from diff blocks that were allocated by partial
+    // writes. Indexed by diff block number.
+    //
+    AIMWRFLTR_BLOCK_MAP SectorMaps;
+
+    //
+    // Diff block numbers where sector map leaves are saved, zero for
+    // leaves not yet saved. SECTOR_MAP_DIRECTORY_ENTRIES entries.
+    //
+    PLONG SectorMapDirectory;
+
+    //
+    // TRUE if diff device had sector maps saved when attached
     //
-    LONG volatile * AllocationTable;
+    bool SectorMapsOnDiffDevice;
 
     //
     // Sector size power bits (default = 9)
@@ -389,6 +477,13 @@ typedef struct _DEVICE_EXTENSION
     //
     KSPIN_LOCK ListLock;
 
+    //
+    // Byte ranges of queued writes and trims in ListHead, so that reads
+    // can find them without walking the whole queue. Protected by
+    // ListLock.
+    //
+    AIMWRFLTR_EXTENT_INDEX QueuedExtents;
+
     //
     // 
     //
@@ -436,6 +531,52 @@ typedef struct _DEVICE_EXTENSION
 
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
+//
+// Gets sector map for a diff block. Returns TRUE if some sectors of block
+// are not on diff device.
+//
+FORCEINLINE
+BOOLEAN
+AIMWrFltrGetSectorMap(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG DiffBlock,
+    OUT PAIMWRFLTR_SECTOR_MAP SectorMap)
+{
+    ULONGLONG entry = (ULONGLONG)DiffBlock * AIMWRFLTR_SECTOR_MAP_WORDS;
+
+    for (ULONG i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+    {
+        SectorMap->Missing[i] = (ULONG)AIMWrFltrBlockMapGet(
+            &DeviceExtension->SectorMaps, entry + i);
+    }
+
+    return !AIMWrFltrSectorMapIsComplete(SectorMap);
+}
+
+//
+// Sets sector map for a diff block. Returns FALSE if diff block is out of
+// range for sector maps or memory allocation failed. All words of a map
+// are in the same leaf, so nothing is changed in that case.
+//
+FORCEINLINE
+BOOLEAN
+AIMWrFltrSetSectorMap(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONG DiffBlock,
+    IN const AIMWRFLTR_SECTOR_MAP *SectorMap)
+{
+    ULONGLONG entry = (ULONGLONG)DiffBlock * AIMWRFLTR_SECTOR_MAP_WORDS;
+
+    for (ULONG i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+    {
+        if (!AIMWrFltrBlockMapSet(&DeviceExtension->SectorMaps, entry + i,
+            (LONG)SectorMap->Missing[i]))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 typedef struct _CACHED_IRP
 {
     //
@@ -458,6 +599,11 @@ typedef struct _CACHED_IRP
     //
     PDEVICE_OBJECT DeviceObject;
 
+    //
+    // Node in QueuedExtents, for queued writes and trims
+    //
+    AIMWRFLTR_EXTENT_NODE ExtentNode;
+
     //
     // Buffer with copy of data to write 
     //
@@ -583,6 +729,122 @@ typedef struct _CACHED_IRP
 
 } CACHED_IRP, *PCACHED_IRP;
 
+//
+// Adds a queued write or trim to index of queued byte ranges. Trims are
+// indexed by the range from their first to their last byte. Other items
+// are not indexed. Caller holds ListLock.
+//
+FORCEINLINE
+VOID
+AIMWrFltrIndexQueuedIrp(IN PAIMWRFLTR_EXTENT_INDEX Index, IN PCACHED_IRP CachedIrp)
+{
+    PIO_STACK_LOCATION item = &CachedIrp->IoStack;
+
+    if (item->MajorFunction == IRP_MJ_WRITE && CachedIrp->Irp == NULL)
+    {
+        if (item->Parameters.Write.Length > 0)
+        {
+            AIMWrFltrExtentIndexInsert(Index, &CachedIrp->ExtentNode,
+                item->Parameters.Write.ByteOffset.QuadPart,
+                item->Parameters.Write.ByteOffset.QuadPart + item->Parameters.Write.Length);
+        }
+    }
+    else if (item->MajorFunction == IRP_MJ_DEVICE_CONTROL &&
+        item->Parameters.DeviceIoControl.IoControlCode == IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES &&
+        ((PDEVICE_MANAGE_DATA_SET_ATTRIBUTES)CachedIrp->Buffer)->Action == DeviceDsmAction_Trim)
+    {
+        PDEVICE_MANAGE_DATA_SET_ATTRIBUTES attrs = (PDEVICE_MANAGE_DATA_SET_ATTRIBUTES)CachedIrp->Buffer;
+
+        ULONG items = attrs->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
+
+        PDEVICE_DATA_SET_RANGE range = (PDEVICE_DATA_SET_RANGE)((PUCHAR)attrs + attrs->DataSetRangesOffset);
+
+        LONGLONG start_pos = MAXLONGLONG;
+        LONGLONG end_pos = 0;
+
+        for (ULONG i = 0; i < items; i++)
+        {
+            if (range[i].LengthInBytes == 0)
+            {
+                continue;
+            }
+
+            start_pos = min(start_pos, range[i].StartingOffset);
+            end_pos = max(end_pos, range[i].StartingOffset + (LONGLONG)range[i].LengthInBytes);
+        }
+
+        if (start_pos < end_pos)
+        {
+            AIMWrFltrExtentIndexInsert(Index, &CachedIrp->ExtentNode,
+                start_pos, end_pos);
+        }
+    }
+}
+
+//
+// Pipeline slot where worker thread runs a queued request while it goes on
+// with other queued requests for other blocks.
+//
+typedef struct _WORKER_PIPELINE_SLOT
+{
+    PDEVICE_EXTENSION DeviceExtension;
+
+    //
+    // Set by worker thread when Request or Exit is set
+    //
+    KEVENT StartEvent;
+
+    //
+    // Set by slot thread when Request is done
+    //
+    PKEVENT DoneEvent;
+
+    HANDLE Thread;
+
+    PUCHAR BlockBuffer;
+
+    //
+    // Request in progress, NULL if slot is free
+    //
+    PCACHED_IRP Request;
+
+    //
+    // Volume blocks Request touches
+    //
+    LONGLONG FirstBlock;
+    LONGLONG LastBlock;
+
+    volatile LONG Done;
+
+    bool Exit;
+
+} WORKER_PIPELINE_SLOT, *PWORKER_PIPELINE_SLOT;
+
+typedef struct _WORKER_PIPELINE
+{
+    //
+    // Set when any slot is done
+    //
+    KEVENT DoneEvent;
+
+    //
+    // Number of slots with a running thread
+    //
+    ULONG NumberOfSlots;
+
+    //
+    // Number of slots that can be created, lowered if a slot could not
+    // be created
+    //
+    ULONG SlotLimit;
+
+    WORKER_PIPELINE_SLOT Slots[WORKER_PIPELINE_SLOTS];
+
+} WORKER_PIPELINE, *PWORKER_PIPELINE;
+
+// Worker thread keeps a bit for each slot in a ULONG
+C_ASSERT(WORKER_PIPELINE_SLOTS <= 32);
+
 //
 // Function to free a driver allocated IRP, including unlocking and
 // freeing all MDLs assigned to the IRP.
@@ -825,6 +1087,44 @@ extern "C"
 
     KSTART_ROUTINE AIMWrFltrDeviceWorkerThread;
 
+    KSTART_ROUTINE AIMWrFltrWorkerPipelineThread;
+
+    PWORKER_PIPELINE
+        AIMWrFltrStartWorkerPipeline(
+            PDEVICE_EXTENSION DeviceExtension);
+
+    VOID
+        AIMWrFltrStopWorkerPipeline(
+            PWORKER_PIPELINE Pipeline);
+
+    PWORKER_PIPELINE_SLOT
+        AIMWrFltrAddWorkerPipelineSlot(
+            PDEVICE_EXTENSION DeviceExtension,
+            PWORKER_PIPELINE Pipeline);
+
+    VOID
+        AIMWrFltrStopWorkerPipelineSlots(
+            PWORKER_PIPELINE Pipeline);
+
+    bool
+        AIMWrFltrGetQueuedRequestBlocks(
+            PCACHED_IRP CachedIrp,
+            PLONGLONG FirstBlock,
+            PLONGLONG LastBlock);
+
+    VOID
+        AIMWrFltrProcessQueuedRequest(
+            PDEVICE_EXTENSION DeviceExtension,
+            PCACHED_IRP CachedIrp,
+            PUCHAR BlockBuffer);
+
+    VOID
+        AIMWrFltrRetireQueuedRequest(
+            PDEVICE_EXTENSION DeviceExtension,
+            PCACHED_IRP CachedIrp);
+
+    KSTART_ROUTINE AIMWrFltrAllocationTablePrefetchThread;
+
     NTSTATUS
         AIMWrFltrDeferredRead(
             PDEVICE_EXTENSION DeviceExtension,
@@ -912,6 +1212,34 @@ extern "C"
     NTSTATUS
         AIMWrFltrInitializeDiffDeviceUnsafe(IN PDEVICE_EXTENSION DeviceExtension);
 
+    NTSTATUS
+        AIMWrFltrLoadAllocationTable(IN PDEVICE_EXTENSION DeviceExtension,
+            IN ULONGLONG NumberOfBlocks);
+
+    NTSTATUS
+        AIMWrFltrLoadAllocationTableLeaves(IN PDEVICE_EXTENSION DeviceExtension,
+            IN ULONG FirstLeaf,
+            IN ULONG NumberOfLeaves);
+
+    NTSTATUS
+        AIMWrFltrLoadAllocationTableRange(IN PDEVICE_EXTENSION DeviceExtension,
+            IN ULONGLONG FirstBlock,
+            IN ULONGLONG LastBlock);
+
+    NTSTATUS
+        AIMWrFltrLoadSectorMaps(IN PDEVICE_EXTENSION DeviceExtension,
+            IN ULONGLONG NumberOfBlocks);
+
+    NTSTATUS
+        AIMWrFltrReadPartialBlock(IN PDEVICE_EXTENSION DeviceExtension,
+            IN LONGLONG BlockOffset,
+            IN LONG DiffBlock,
+            IN const AIMWRFLTR_SECTOR_MAP *SectorMap,
+            IN OUT PUCHAR BlockBuffer,
+            IN ULONG Offset,
+            IN ULONG Length,
+            IN PETHREAD Thread);
+
     FORCEINLINE
         PDEVICE_OBJECT
         AIMWrFltrGetLowerDeviceObjectAndDereference(
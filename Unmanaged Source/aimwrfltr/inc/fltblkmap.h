@@ -0,0 +1,432 @@
+/// fltblkmap.h
+/// AIM Write Filter - Diff block allocation table.
+///
+/// Maps block numbers on filtered volume to block numbers on diff device.
+/// The table is kept in two levels, a directory with one pointer for each
+/// leaf and leaves with one entry for each block. Leaves are only allocated
+/// when a block in their range is first allocated, so memory needed is
+/// proportional to modified parts of volume rather than to volume size.
+///
+/// One leaf is the same size as one block of allocation table stored on
+/// diff device, which makes it possible to load and save leaves one at a
+/// time.
+///
+/// Leaves can also be loaded on demand. Each leaf then starts out as not
+/// loaded and lookups in it are not valid until it is loaded with
+/// AIMWrFltrBlockMapLoadLeaf. Callers check this with
+/// AIMWrFltrBlockMapIsBlockLoaded before relying on a lookup.
+///
+/// Lookups do not take any locks. Leaves are never freed while the table
+/// is in use, and a new leaf is filled in before it is published in
+/// directory, so a lookup either finds a NULL directory entry, which means
+/// that no block in that range is allocated, or a valid leaf. Entries are
+/// updated by one thread at a time.
+///
+/// This only depends on compiler, so it can be used outside the driver as
+/// well. Define AIMWRFLTR_BLOCK_MAP_ALLOCATE and AIMWRFLTR_BLOCK_MAP_FREE
+/// before including this file to use other memory functions than malloc
+/// and free.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_FLTBLKMAP_
+#define _INC_FLTBLKMAP_
+
+#if !defined(_WIN32) && !defined(_NTDDK_)
+#include <stdint.h>
+#include <stddef.h>
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint8_t UCHAR;
+typedef uint64_t ULONGLONG;
+#endif
+
+#ifndef AIMWRFLTR_BLOCK_MAP_ALLOCATE
+#include <stdlib.h>
+#define AIMWRFLTR_BLOCK_MAP_ALLOCATE(size) malloc(size)
+#define AIMWRFLTR_BLOCK_MAP_FREE(ptr) free(ptr)
+#endif
+
+#if defined(_MSC_VER)
+#define AIMWRFLTR_BLOCK_MAP_INLINE __forceinline
+#define AIMWRFLTR_BLOCK_MAP_BARRIER() MemoryBarrier()
+#define AIMWRFLTR_BLOCK_MAP_PUBLISH(p, v) \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(p), (PVOID)(v), NULL) == NULL)
+#define AIMWRFLTR_BLOCK_MAP_INCREMENT(p) InterlockedIncrement((LONG volatile*)(p))
+#else
+#define AIMWRFLTR_BLOCK_MAP_INLINE static inline
+#define AIMWRFLTR_BLOCK_MAP_BARRIER() __sync_synchronize()
+#define AIMWRFLTR_BLOCK_MAP_PUBLISH(p, v) \
+    __sync_bool_compare_and_swap((p), (LONG volatile*)NULL, (v))
+#define AIMWRFLTR_BLOCK_MAP_INCREMENT(p) __sync_add_and_fetch((p), 1)
+#endif
+
+//
+// Number of bits of block number used within a leaf. Leaves of 16384
+// entries are 64 KB, the same as one DIFF_BLOCK_SIZE block of allocation
+// table on diff device, and map 1 GB of filtered volume.
+//
+#define AIMWRFLTR_BLOCK_MAP_LEAF_BITS           14
+#define AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES        (1UL << AIMWRFLTR_BLOCK_MAP_LEAF_BITS)
+#define AIMWRFLTR_BLOCK_MAP_LEAF_SIZE           (AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES * sizeof(LONG))
+#define AIMWRFLTR_BLOCK_MAP_LEAF_MASK           (AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES - 1)
+
+//
+// Entry value for blocks not yet allocated on diff device
+//
+#define AIMWRFLTR_BLOCK_MAP_UNALLOCATED         0
+
+typedef struct _AIMWRFLTR_BLOCK_MAP
+{
+    //
+    // One pointer for each leaf, NULL where leaf is not allocated
+    //
+    LONG volatile * volatile * Directory;
+
+    //
+    // One byte for each leaf, non-zero when leaf is loaded
+    //
+    UCHAR volatile * LeafLoaded;
+
+    //
+    // Number of blocks on filtered volume
+    //
+    ULONGLONG NumberOfBlocks;
+
+    //
+    // Number of pointers in directory
+    //
+    ULONG DirectoryEntries;
+
+    //
+    // Number of leaves currently allocated
+    //
+    ULONG volatile AllocatedLeaves;
+
+    //
+    // Number of leaves loaded
+    //
+    ULONG volatile LoadedLeaves;
+
+} AIMWRFLTR_BLOCK_MAP, *PAIMWRFLTR_BLOCK_MAP;
+
+//
+// Allocates directory for a volume with NumberOfBlocks blocks. Leaves are
+// allocated later, as needed. If Loaded is zero, all leaves need to be
+// loaded before use, otherwise table starts out loaded with no blocks
+// allocated. Returns zero if memory allocation failed.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+int
+AIMWrFltrBlockMapInitialize(PAIMWRFLTR_BLOCK_MAP Map,
+    ULONGLONG NumberOfBlocks, int Loaded)
+{
+    ULONG entries = (ULONG)((NumberOfBlocks + AIMWRFLTR_BLOCK_MAP_LEAF_MASK) >>
+        AIMWRFLTR_BLOCK_MAP_LEAF_BITS);
+    ULONG i;
+
+    if (entries == 0)
+    {
+        entries = 1;
+    }
+
+    // Leaf states are kept after directory in same allocation
+    Map->Directory = (LONG volatile * volatile *)
+        AIMWRFLTR_BLOCK_MAP_ALLOCATE(entries *
+            (sizeof(*Map->Directory) + sizeof(*Map->LeafLoaded)));
+
+    if (Map->Directory == NULL)
+    {
+        return 0;
+    }
+
+    Map->LeafLoaded = (UCHAR volatile *)(Map->Directory + entries);
+
+    for (i = 0; i < entries; i++)
+    {
+        Map->Directory[i] = NULL;
+        Map->LeafLoaded[i] = Loaded ? 1 : 0;
+    }
+
+    Map->NumberOfBlocks = NumberOfBlocks;
+    Map->DirectoryEntries = entries;
+    Map->AllocatedLeaves = 0;
+    Map->LoadedLeaves = Loaded ? entries : 0;
+
+    return 1;
+}
+
+//
+// Frees directory and all leaves. No lookups may be in progress.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+void
+AIMWrFltrBlockMapFree(PAIMWRFLTR_BLOCK_MAP Map)
+{
+    ULONG i;
+
+    if (Map->Directory == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < Map->DirectoryEntries; i++)
+    {
+        if (Map->Directory[i] != NULL)
+        {
+            AIMWRFLTR_BLOCK_MAP_FREE((void*)Map->Directory[i]);
+        }
+    }
+
+    AIMWRFLTR_BLOCK_MAP_FREE((void*)Map->Directory);
+
+    Map->Directory = NULL;
+    Map->LeafLoaded = NULL;
+    Map->NumberOfBlocks = 0;
+    Map->DirectoryEntries = 0;
+    Map->AllocatedLeaves = 0;
+    Map->LoadedLeaves = 0;
+}
+
+AIMWRFLTR_BLOCK_MAP_INLINE
+int
+AIMWrFltrBlockMapIsInitialized(const AIMWRFLTR_BLOCK_MAP *Map)
+{
+    return Map->Directory != NULL;
+}
+
+//
+// Returns leaf with given index, or NULL if not allocated.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+LONG volatile *
+AIMWrFltrBlockMapGetLeaf(const AIMWRFLTR_BLOCK_MAP *Map, ULONG Leaf)
+{
+    if (Leaf >= Map->DirectoryEntries)
+    {
+        return NULL;
+    }
+
+    return Map->Directory[Leaf];
+}
+
+AIMWRFLTR_BLOCK_MAP_INLINE
+int
+AIMWrFltrBlockMapIsLeafLoaded(const AIMWRFLTR_BLOCK_MAP *Map, ULONG Leaf)
+{
+    return Leaf >= Map->DirectoryEntries || Map->LeafLoaded[Leaf] != 0;
+}
+
+//
+// Returns non-zero if lookups for Block are valid. Blocks out of range
+// count as loaded, they are never allocated.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+int
+AIMWrFltrBlockMapIsBlockLoaded(const AIMWRFLTR_BLOCK_MAP *Map,
+    ULONGLONG Block)
+{
+    if (Block >= Map->NumberOfBlocks)
+    {
+        return 1;
+    }
+
+    return AIMWrFltrBlockMapIsLeafLoaded(Map,
+        (ULONG)(Block >> AIMWRFLTR_BLOCK_MAP_LEAF_BITS));
+}
+
+//
+// Returns leaf with given index, allocating a leaf if there is none.
+// New leaves are copied from Entries, or zeroed if Entries is NULL.
+// Returns NULL if Leaf is out of range or memory allocation failed.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+LONG volatile *
+AIMWrFltrBlockMapAllocateLeaf(PAIMWRFLTR_BLOCK_MAP Map, ULONG Leaf,
+    const LONG *Entries)
+{
+    LONG volatile *leaf;
+    ULONG i;
+
+    if (Leaf >= Map->DirectoryEntries)
+    {
+        return NULL;
+    }
+
+    leaf = Map->Directory[Leaf];
+
+    if (leaf != NULL)
+    {
+        return leaf;
+    }
+
+    leaf = (LONG volatile *)
+        AIMWRFLTR_BLOCK_MAP_ALLOCATE(AIMWRFLTR_BLOCK_MAP_LEAF_SIZE);
+
+    if (leaf == NULL)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES; i++)
+    {
+        leaf[i] = Entries != NULL ? Entries[i] :
+            AIMWRFLTR_BLOCK_MAP_UNALLOCATED;
+    }
+
+    // Another thread could have created this leaf while we were zeroing
+    // ours. Then use that one instead.
+    if (!AIMWRFLTR_BLOCK_MAP_PUBLISH(&Map->Directory[Leaf], leaf))
+    {
+        AIMWRFLTR_BLOCK_MAP_FREE((void*)leaf);
+        return Map->Directory[Leaf];
+    }
+
+    // Leaves for different blocks can be created by several threads
+    AIMWRFLTR_BLOCK_MAP_INCREMENT(&Map->AllocatedLeaves);
+
+    return leaf;
+}
+
+//
+// Returns leaf with given index, allocating a zeroed leaf if there is none.
+// Returns NULL if Leaf is out of range or memory allocation failed.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+LONG volatile *
+AIMWrFltrBlockMapCreateLeaf(PAIMWRFLTR_BLOCK_MAP Map, ULONG Leaf)
+{
+    return AIMWrFltrBlockMapAllocateLeaf(Map, Leaf, NULL);
+}
+
+//
+// Loads a leaf with entries read from allocation table on diff device and
+// marks it as loaded. Leaves with no allocated blocks are not allocated in
+// memory. Does nothing if leaf is already loaded. Returns zero if memory
+// allocation failed.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+int
+AIMWrFltrBlockMapLoadLeaf(PAIMWRFLTR_BLOCK_MAP Map, ULONG Leaf,
+    const LONG *Entries)
+{
+    ULONG i;
+
+    if (AIMWrFltrBlockMapIsLeafLoaded(Map, Leaf))
+    {
+        return 1;
+    }
+
+    for (i = 0; i < AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES; i++)
+    {
+        if (Entries[i] != AIMWRFLTR_BLOCK_MAP_UNALLOCATED)
+        {
+            break;
+        }
+    }
+
+    if (i < AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES &&
+        AIMWrFltrBlockMapAllocateLeaf(Map, Leaf, Entries) == NULL)
+    {
+        return 0;
+    }
+
+    // Lookups that see leaf as loaded must also see its entries
+    AIMWRFLTR_BLOCK_MAP_BARRIER();
+
+    Map->LeafLoaded[Leaf] = 1;
+
+    ++Map->LoadedLeaves;
+
+    return 1;
+}
+
+//
+// Returns diff device block number for a block on filtered volume, or
+// AIMWRFLTR_BLOCK_MAP_UNALLOCATED if block is not allocated or is out of
+// range.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+LONG
+AIMWrFltrBlockMapGet(const AIMWRFLTR_BLOCK_MAP *Map, ULONGLONG Block)
+{
+    LONG volatile *leaf;
+
+    if (Block >= Map->NumberOfBlocks)
+    {
+        return AIMWRFLTR_BLOCK_MAP_UNALLOCATED;
+    }
+
+    leaf = Map->Directory[Block >> AIMWRFLTR_BLOCK_MAP_LEAF_BITS];
+
+    if (leaf == NULL)
+    {
+        return AIMWRFLTR_BLOCK_MAP_UNALLOCATED;
+    }
+
+    return leaf[Block & AIMWRFLTR_BLOCK_MAP_LEAF_MASK];
+}
+
+//
+// Sets diff device block number for a block on filtered volume, allocating
+// leaf if needed. Returns zero if block is out of range or memory
+// allocation failed.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+int
+AIMWrFltrBlockMapSet(PAIMWRFLTR_BLOCK_MAP Map, ULONGLONG Block, LONG Value)
+{
+    LONG volatile *leaf;
+
+    if (Block >= Map->NumberOfBlocks)
+    {
+        return 0;
+    }
+
+    if (Value == AIMWRFLTR_BLOCK_MAP_UNALLOCATED)
+    {
+        leaf = AIMWrFltrBlockMapGetLeaf(Map,
+            (ULONG)(Block >> AIMWRFLTR_BLOCK_MAP_LEAF_BITS));
+
+        // Nothing allocated in this range anyway
+        if (leaf == NULL)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        leaf = AIMWrFltrBlockMapCreateLeaf(Map,
+            (ULONG)(Block >> AIMWRFLTR_BLOCK_MAP_LEAF_BITS));
+
+        if (leaf == NULL)
+        {
+            return 0;
+        }
+    }
+
+    leaf[Block & AIMWRFLTR_BLOCK_MAP_LEAF_MASK] = Value;
+
+    return 1;
+}
+
+//
+// Number of bytes currently allocated for directory and leaves.
+//
+AIMWRFLTR_BLOCK_MAP_INLINE
+ULONGLONG
+AIMWrFltrBlockMapMemoryUsage(const AIMWRFLTR_BLOCK_MAP *Map)
+{
+    return (ULONGLONG)Map->DirectoryEntries *
+        (sizeof(*Map->Directory) + sizeof(*Map->LeafLoaded)) +
+        (ULONGLONG)Map->AllocatedLeaves * AIMWRFLTR_BLOCK_MAP_LEAF_SIZE;
+}
+
+#endif // _INC_FLTBLKMAP_
@@ -0,0 +1,455 @@
+/// fltextidx.h
+/// AIM Write Filter - Index of byte ranges covered by queued requests.
+///
+/// Queued writes and trims that have not yet reached diff device are kept
+/// in an interval tree keyed by start offset, where each node also holds
+/// highest end offset in its subtree. Finding items that overlap a range is
+/// then proportional to number of overlapping items and depth of tree
+/// rather than to length of queue. Tree is kept balanced as a treap with
+/// priorities derived from sequence numbers.
+///
+/// Nodes are embedded in the items they index, so neither inserts,
+/// removals nor lookups allocate memory. Locking is left to caller.
+///
+/// This only depends on compiler, so it can be used outside the driver as
+/// well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_FLTEXTIDX_
+#define _INC_FLTEXTIDX_
+
+#if !defined(_WIN32) && !defined(_NTDDK_)
+#include <stdint.h>
+#include <stddef.h>
+typedef uint32_t ULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+#endif
+
+#if defined(_MSC_VER)
+#define AIMWRFLTR_EXTENT_INDEX_INLINE __forceinline
+#else
+#define AIMWRFLTR_EXTENT_INDEX_INLINE static inline
+#endif
+
+typedef struct _AIMWRFLTR_EXTENT_NODE
+{
+    struct _AIMWRFLTR_EXTENT_NODE *Parent;
+    struct _AIMWRFLTR_EXTENT_NODE *Left;
+    struct _AIMWRFLTR_EXTENT_NODE *Right;
+
+    //
+    // Links overlapping nodes found by AIMWrFltrExtentIndexFind. Only
+    // valid until tree is changed.
+    //
+    struct _AIMWRFLTR_EXTENT_NODE *Next;
+
+    //
+    // Byte range covered, End is first byte after range
+    //
+    LONGLONG Start;
+    LONGLONG End;
+
+    //
+    // Highest End in subtree
+    //
+    LONGLONG MaxEnd;
+
+    //
+    // Order in which nodes were inserted, zero when not in tree
+    //
+    ULONGLONG Sequence;
+
+    ULONG Priority;
+
+} AIMWRFLTR_EXTENT_NODE, *PAIMWRFLTR_EXTENT_NODE;
+
+typedef struct _AIMWRFLTR_EXTENT_INDEX
+{
+    PAIMWRFLTR_EXTENT_NODE Root;
+
+    ULONGLONG LastSequence;
+
+    ULONG Count;
+
+} AIMWRFLTR_EXTENT_INDEX, *PAIMWRFLTR_EXTENT_INDEX;
+
+AIMWRFLTR_EXTENT_INDEX_INLINE
+void
+AIMWrFltrExtentIndexInitialize(PAIMWRFLTR_EXTENT_INDEX Index)
+{
+    Index->Root = NULL;
+    Index->LastSequence = 0;
+    Index->Count = 0;
+}
+
+AIMWRFLTR_EXTENT_INDEX_INLINE
+int
+AIMWrFltrExtentIndexIsEmpty(const AIMWRFLTR_EXTENT_INDEX *Index)
+{
+    return Index->Root == NULL;
+}
+
+AIMWRFLTR_EXTENT_INDEX_INLINE
+int
+AIMWrFltrExtentIndexContains(const AIMWRFLTR_EXTENT_NODE *Node)
+{
+    return Node->Sequence != 0;
+}
+
+//
+// Mixes bits of sequence number, so that priorities look random even for
+// nodes inserted in offset order.
+//
+AIMWRFLTR_EXTENT_INDEX_INLINE
+ULONG
+AIMWrFltrExtentIndexPriority(ULONGLONG Sequence)
+{
+    Sequence ^= Sequence >> 30;
+    Sequence *= 0xBF58476D1CE4E5B9ULL;
+    Sequence ^= Sequence >> 27;
+    Sequence *= 0x94D049BB133111EBULL;
+    Sequence ^= Sequence >> 31;
+
+    return (ULONG)Sequence;
+}
+
+AIMWRFLTR_EXTENT_INDEX_INLINE
+void
+AIMWrFltrExtentIndexUpdate(PAIMWRFLTR_EXTENT_NODE Node)
+{
+    LONGLONG max_end = Node->End;
+
+    if (Node->Left != NULL && Node->Left->MaxEnd > max_end)
+    {
+        max_end = Node->Left->MaxEnd;
+    }
+
+    if (Node->Right != NULL && Node->Right->MaxEnd > max_end)
+    {
+        max_end = Node->Right->MaxEnd;
+    }
+
+    Node->MaxEnd = max_end;
+}
+
+//
+// Moves Node up one level, to the place of its parent.
+//
+AIMWRFLTR_EXTENT_INDEX_INLINE
+void
+AIMWrFltrExtentIndexRotateUp(PAIMWRFLTR_EXTENT_INDEX Index,
+    PAIMWRFLTR_EXTENT_NODE Node)
+{
+    PAIMWRFLTR_EXTENT_NODE parent = Node->Parent;
+    PAIMWRFLTR_EXTENT_NODE grandparent = parent->Parent;
+
+    if (parent->Left == Node)
+    {
+        parent->Left = Node->Right;
+
+        if (Node->Right != NULL)
+        {
+            Node->Right->Parent = parent;
+        }
+
+        Node->Right = parent;
+    }
+    else
+    {
+        parent->Right = Node->Left;
+
+        if (Node->Left != NULL)
+        {
+            Node->Left->Parent = parent;
+        }
+
+        Node->Left = parent;
+    }
+
+    parent->Parent = Node;
+    Node->Parent = grandparent;
+
+    if (grandparent == NULL)
+    {
+        Index->Root = Node;
+    }
+    else if (grandparent->Left == parent)
+    {
+        grandparent->Left = Node;
+    }
+    else
+    {
+        grandparent->Right = Node;
+    }
+
+    AIMWrFltrExtentIndexUpdate(parent);
+    AIMWrFltrExtentIndexUpdate(Node);
+}
+
+//
+// Recalculates MaxEnd from Node up to root.
+//
+AIMWRFLTR_EXTENT_INDEX_INLINE
+void
+AIMWrFltrExtentIndexUpdatePath(PAIMWRFLTR_EXTENT_NODE Node)
+{
+    for (; Node != NULL; Node = Node->Parent)
+    {
+        AIMWrFltrExtentIndexUpdate(Node);
+    }
+}
+
+//
+// Adds Node for byte range Start up to End. Node must not already be in
+// any index. Nodes inserted later get higher sequence numbers.
+//
+AIMWRFLTR_EXTENT_INDEX_INLINE
+void
+AIMWrFltrExtentIndexInsert(PAIMWRFLTR_EXTENT_INDEX Index,
+    PAIMWRFLTR_EXTENT_NODE Node, LONGLONG Start, LONGLONG End)
+{
+    PAIMWRFLTR_EXTENT_NODE parent = NULL;
+    PAIMWRFLTR_EXTENT_NODE *link = &Index->Root;
+
+    Node->Start = Start;
+    Node->End = End;
+    Node->MaxEnd = End;
+    Node->Sequence = ++Index->LastSequence;
+    Node->Priority = AIMWrFltrExtentIndexPriority(Node->Sequence);
+    Node->Left = NULL;
+    Node->Right = NULL;
+    Node->Next = NULL;
+
+    // Equal start offsets go to the right, so that in order traversal
+    // also follows sequence for those
+    while (*link != NULL)
+    {
+        parent = *link;
+
+        link = Start < parent->Start ? &parent->Left : &parent->Right;
+    }
+
+    Node->Parent = parent;
+    *link = Node;
+
+    while (Node->Parent != NULL && Node->Parent->Priority < Node->Priority)
+    {
+        AIMWrFltrExtentIndexRotateUp(Index, Node);
+    }
+
+    AIMWrFltrExtentIndexUpdatePath(Node->Parent);
+
+    ++Index->Count;
+}
+
+//
+// Removes Node from index. Does nothing if Node is not in index.
+//
+AIMWRFLTR_EXTENT_INDEX_INLINE
+void
+AIMWrFltrExtentIndexRemove(PAIMWRFLTR_EXTENT_INDEX Index,
+    PAIMWRFLTR_EXTENT_NODE Node)
+{
+    PAIMWRFLTR_EXTENT_NODE child;
+    PAIMWRFLTR_EXTENT_NODE parent;
+
+    if (!AIMWrFltrExtentIndexContains(Node))
+    {
+        return;
+    }
+
+    // Move node down until it has at most one child
+    while (Node->Left != NULL && Node->Right != NULL)
+    {
+        AIMWrFltrExtentIndexRotateUp(Index,
+            Node->Left->Priority > Node->Right->Priority ?
+            Node->Left : Node->Right);
+    }
+
+    child = Node->Left != NULL ? Node->Left : Node->Right;
+    parent = Node->Parent;
+
+    if (child != NULL)
+    {
+        child->Parent = parent;
+    }
+
+    if (parent == NULL)
+    {
+        Index->Root = child;
+    }
+    else if (parent->Left == Node)
+    {
+        parent->Left = child;
+    }
+    else
+    {
+        parent->Right = child;
+    }
+
+    AIMWrFltrExtentIndexUpdatePath(parent);
+
+    Node->Parent = NULL;
+    Node->Left = NULL;
+    Node->Right = NULL;
+    Node->Next = NULL;
+    Node->Sequence = 0;
+
+    --Index->Count;
+}
+
+//
+// Sorts a list linked through Next by sequence number, oldest first.
+// Merge sort of runs doubling in length, so that no recursion or extra
+// memory is needed.
+//
+AIMWRFLTR_EXTENT_INDEX_INLINE
+PAIMWRFLTR_EXTENT_NODE
+AIMWrFltrExtentIndexSortList(PAIMWRFLTR_EXTENT_NODE List)
+{
+    ULONG run;
+
+    if (List == NULL || List->Next == NULL)
+    {
+        return List;
+    }
+
+    for (run = 1;; run <<= 1)
+    {
+        PAIMWRFLTR_EXTENT_NODE rest = List;
+        PAIMWRFLTR_EXTENT_NODE head = NULL;
+        PAIMWRFLTR_EXTENT_NODE *tail = &head;
+        ULONG merges = 0;
+
+        while (rest != NULL)
+        {
+            PAIMWRFLTR_EXTENT_NODE a = rest;
+            PAIMWRFLTR_EXTENT_NODE b = rest;
+            ULONG a_length = 0;
+            ULONG b_length = run;
+
+            while (b != NULL && a_length < run)
+            {
+                b = b->Next;
+                a_length++;
+            }
+
+            while (a_length > 0 || (b_length > 0 && b != NULL))
+            {
+                PAIMWRFLTR_EXTENT_NODE next;
+
+                if (a_length == 0)
+                {
+                    next = b;
+                    b = b->Next;
+                    b_length--;
+                }
+                else if (b_length == 0 || b == NULL ||
+                    a->Sequence < b->Sequence)
+                {
+                    next = a;
+                    a = a->Next;
+                    a_length--;
+                }
+                else
+                {
+                    next = b;
+                    b = b->Next;
+                    b_length--;
+                }
+
+                *tail = next;
+                tail = &next->Next;
+            }
+
+            rest = b;
+            merges++;
+        }
+
+        *tail = NULL;
+        List = head;
+
+        if (merges <= 1)
+        {
+            return List;
+        }
+    }
+}
+
+//
+// Returns nodes that overlap byte range Start up to End, linked through
+// Next in sequence order, oldest first, or NULL if there are none. The
+// list is only valid until index is changed.
+//
+AIMWRFLTR_EXTENT_INDEX_INLINE
+PAIMWRFLTR_EXTENT_NODE
+AIMWrFltrExtentIndexFind(const AIMWRFLTR_EXTENT_INDEX *Index,
+    LONGLONG Start, LONGLONG End)
+{
+    PAIMWRFLTR_EXTENT_NODE node = Index->Root;
+    PAIMWRFLTR_EXTENT_NODE from = NULL;
+    PAIMWRFLTR_EXTENT_NODE list = NULL;
+
+    if (node == NULL || node->MaxEnd <= Start)
+    {
+        return NULL;
+    }
+
+    // In order traversal using parent links. Subtrees that end before
+    // Start, and right subtrees of nodes that start after End, are
+    // skipped.
+    while (node != NULL)
+    {
+        PAIMWRFLTR_EXTENT_NODE next;
+
+        if (from == node->Parent &&
+            node->Left != NULL && node->Left->MaxEnd > Start)
+        {
+            next = node->Left;
+        }
+        else if (from == node->Parent || from == node->Left)
+        {
+            if (node->Start >= End)
+            {
+                next = node->Parent;
+            }
+            else
+            {
+                if (node->End > Start)
+                {
+                    node->Next = list;
+                    list = node;
+                }
+
+                if (node->Right != NULL && node->Right->MaxEnd > Start)
+                {
+                    next = node->Right;
+                }
+                else
+                {
+                    next = node->Parent;
+                }
+            }
+        }
+        else
+        {
+            next = node->Parent;
+        }
+
+        from = node;
+        node = next;
+    }
+
+    return AIMWrFltrExtentIndexSortList(list);
+}
+
+#endif // _INC_FLTEXTIDX_
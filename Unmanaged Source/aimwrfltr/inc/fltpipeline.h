@@ -0,0 +1,161 @@
+/// fltpipeline.h
+/// AIM Write Filter - Rules for starting queued requests in worker
+/// pipeline slots.
+///
+/// Worker thread scans write queue from oldest request and checks each
+/// request that is not already in progress. A request can start when no
+/// request in progress and no earlier request still waiting touches any of
+/// its blocks. Requests for the same block therefore run one at a time in
+/// queue order, while requests for other blocks can pass them. Requests
+/// without a block range, such as flush requests, stop the scan. They run
+/// when all requests before them are done, and nothing after them starts
+/// before that.
+///
+/// This only depends on compiler, so it can be used outside the driver as
+/// well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_FLTPIPELINE_
+#define _INC_FLTPIPELINE_
+
+#if !defined(_WIN32) && !defined(_NTDDK_)
+#include <stdint.h>
+typedef uint32_t ULONG;
+typedef int64_t LONGLONG;
+#endif
+
+#if defined(_MSC_VER)
+#define AIMWRFLTR_PIPELINE_INLINE __forceinline
+#else
+#define AIMWRFLTR_PIPELINE_INLINE static inline
+#endif
+
+//
+// Largest number of requests in progress at the same time. Also the
+// number of passed over requests a scan keeps track of.
+//
+#ifndef AIMWRFLTR_PIPELINE_SLOTS
+#define AIMWRFLTR_PIPELINE_SLOTS                8
+#endif
+
+//
+// Results of AIMWrFltrPipelineCheckRequest
+//
+#define AIMWRFLTR_PIPELINE_START                0
+#define AIMWRFLTR_PIPELINE_WAIT                 1
+#define AIMWRFLTR_PIPELINE_STOP                 2
+
+typedef struct _AIMWRFLTR_PIPELINE_RANGE
+{
+    LONGLONG FirstBlock;
+    LONGLONG LastBlock;
+
+} AIMWRFLTR_PIPELINE_RANGE, *PAIMWRFLTR_PIPELINE_RANGE;
+
+typedef struct _AIMWRFLTR_PIPELINE_SCAN
+{
+    //
+    // Requests in progress, including those started during scan
+    //
+    AIMWRFLTR_PIPELINE_RANGE Busy[AIMWRFLTR_PIPELINE_SLOTS];
+    ULONG NumberOfBusy;
+
+    //
+    // Requests passed over during scan
+    //
+    AIMWRFLTR_PIPELINE_RANGE Waiting[AIMWRFLTR_PIPELINE_SLOTS];
+    ULONG NumberOfWaiting;
+
+} AIMWRFLTR_PIPELINE_SCAN, *PAIMWRFLTR_PIPELINE_SCAN;
+
+AIMWRFLTR_PIPELINE_INLINE
+void
+AIMWrFltrPipelineScanInitialize(PAIMWRFLTR_PIPELINE_SCAN Scan)
+{
+    Scan->NumberOfBusy = 0;
+    Scan->NumberOfWaiting = 0;
+}
+
+//
+// Adds a request in progress, either one that was already in progress
+// when scan started or one that caller started after
+// AIMWrFltrPipelineCheckRequest returned AIMWRFLTR_PIPELINE_START.
+//
+AIMWRFLTR_PIPELINE_INLINE
+void
+AIMWrFltrPipelineScanAddBusy(PAIMWRFLTR_PIPELINE_SCAN Scan,
+    LONGLONG FirstBlock, LONGLONG LastBlock)
+{
+    Scan->Busy[Scan->NumberOfBusy].FirstBlock = FirstBlock;
+    Scan->Busy[Scan->NumberOfBusy].LastBlock = LastBlock;
+    ++Scan->NumberOfBusy;
+}
+
+AIMWRFLTR_PIPELINE_INLINE
+int
+AIMWrFltrPipelineOverlaps(const AIMWRFLTR_PIPELINE_RANGE *Ranges,
+    ULONG NumberOfRanges, LONGLONG FirstBlock, LONGLONG LastBlock)
+{
+    ULONG i;
+
+    for (i = 0; i < NumberOfRanges; i++)
+    {
+        if (Ranges[i].FirstBlock <= LastBlock &&
+            Ranges[i].LastBlock >= FirstBlock)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//
+// Checks next request in queue order that is not in progress. HasBlocks
+// is zero for requests without a block range. Returns
+// AIMWRFLTR_PIPELINE_START if request can start now,
+// AIMWRFLTR_PIPELINE_WAIT if it needs to wait for a request for some of
+// the same blocks and scan can go on with next request, or
+// AIMWRFLTR_PIPELINE_STOP if no later request can start now either.
+//
+AIMWRFLTR_PIPELINE_INLINE
+ULONG
+AIMWrFltrPipelineCheckRequest(PAIMWRFLTR_PIPELINE_SCAN Scan, int HasBlocks,
+    LONGLONG FirstBlock, LONGLONG LastBlock)
+{
+    if (!HasBlocks || Scan->NumberOfBusy >= AIMWRFLTR_PIPELINE_SLOTS)
+    {
+        return AIMWRFLTR_PIPELINE_STOP;
+    }
+
+    if (AIMWrFltrPipelineOverlaps(Scan->Busy, Scan->NumberOfBusy,
+        FirstBlock, LastBlock) ||
+        AIMWrFltrPipelineOverlaps(Scan->Waiting, Scan->NumberOfWaiting,
+            FirstBlock, LastBlock))
+    {
+        // Later requests for these blocks need to wait for this one, so
+        // scan cannot go on if it cannot be remembered
+        if (Scan->NumberOfWaiting >= AIMWRFLTR_PIPELINE_SLOTS)
+        {
+            return AIMWRFLTR_PIPELINE_STOP;
+        }
+
+        Scan->Waiting[Scan->NumberOfWaiting].FirstBlock = FirstBlock;
+        Scan->Waiting[Scan->NumberOfWaiting].LastBlock = LastBlock;
+        ++Scan->NumberOfWaiting;
+
+        return AIMWRFLTR_PIPELINE_WAIT;
+    }
+
+    return AIMWRFLTR_PIPELINE_START;
+}
+
+#endif // _INC_FLTPIPELINE_
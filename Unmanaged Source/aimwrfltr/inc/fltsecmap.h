@@ -0,0 +1,163 @@
+/// fltsecmap.h
+/// AIM Write Filter - Map of sectors present in a diff block.
+///
+/// A diff block that was allocated for a write of less than a complete
+/// block only holds the sectors that have been written to it. Other
+/// sectors are still read from original volume. Each diff block has a map
+/// with one bit for each sector that is missing from diff block, so that a
+/// map with all bits clear means that the complete block is on diff device,
+/// as with blocks from diff devices written before maps existed.
+///
+/// Functions here work on byte offsets within a block. Writes are expected
+/// to be sector aligned, reads can start and end anywhere.
+///
+/// This only depends on compiler, so it can be used outside the driver as
+/// well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_FLTSECMAP_
+#define _INC_FLTSECMAP_
+
+#if !defined(_WIN32) && !defined(_NTDDK_)
+#include <stdint.h>
+typedef uint32_t ULONG;
+#endif
+
+#if defined(_MSC_VER)
+#define AIMWRFLTR_SECTOR_MAP_INLINE __forceinline
+#else
+#define AIMWRFLTR_SECTOR_MAP_INLINE static inline
+#endif
+
+#define AIMWRFLTR_SECTOR_MAP_SECTOR_BITS        9
+#define AIMWRFLTR_SECTOR_MAP_BLOCK_BITS         16
+#define AIMWRFLTR_SECTOR_MAP_SECTOR_SIZE        (1UL << AIMWRFLTR_SECTOR_MAP_SECTOR_BITS)
+#define AIMWRFLTR_SECTOR_MAP_BLOCK_SIZE         (1UL << AIMWRFLTR_SECTOR_MAP_BLOCK_BITS)
+#define AIMWRFLTR_SECTOR_MAP_SECTORS            (AIMWRFLTR_SECTOR_MAP_BLOCK_SIZE >> AIMWRFLTR_SECTOR_MAP_SECTOR_BITS)
+#define AIMWRFLTR_SECTOR_MAP_WORDS              (AIMWRFLTR_SECTOR_MAP_SECTORS / 32)
+
+typedef struct _AIMWRFLTR_SECTOR_MAP
+{
+    //
+    // One bit for each sector, set where sector is not on diff device
+    //
+    ULONG Missing[AIMWRFLTR_SECTOR_MAP_WORDS];
+
+} AIMWRFLTR_SECTOR_MAP, *PAIMWRFLTR_SECTOR_MAP;
+
+//
+// Returns non-zero if all sectors of block are on diff device.
+//
+AIMWRFLTR_SECTOR_MAP_INLINE
+int
+AIMWrFltrSectorMapIsComplete(const AIMWRFLTR_SECTOR_MAP *Map)
+{
+    ULONG i;
+
+    for (i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+    {
+        if (Map->Missing[i] != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+AIMWRFLTR_SECTOR_MAP_INLINE
+int
+AIMWrFltrSectorMapIsMissing(const AIMWRFLTR_SECTOR_MAP *Map, ULONG Sector)
+{
+    return (Map->Missing[Sector >> 5] >> (Sector & 31)) & 1;
+}
+
+//
+// Marks sectors covered by Length bytes at Offset as present on diff
+// device. Offset and Length are rounded out to sector boundaries.
+//
+AIMWRFLTR_SECTOR_MAP_INLINE
+void
+AIMWrFltrSectorMapSetPresent(PAIMWRFLTR_SECTOR_MAP Map, ULONG Offset,
+    ULONG Length)
+{
+    ULONG sector = Offset >> AIMWRFLTR_SECTOR_MAP_SECTOR_BITS;
+    ULONG end = (Offset + Length + AIMWRFLTR_SECTOR_MAP_SECTOR_SIZE - 1) >>
+        AIMWRFLTR_SECTOR_MAP_SECTOR_BITS;
+
+    if (end > AIMWRFLTR_SECTOR_MAP_SECTORS)
+    {
+        end = AIMWRFLTR_SECTOR_MAP_SECTORS;
+    }
+
+    for (; sector < end; sector++)
+    {
+        Map->Missing[sector >> 5] &= ~(1UL << (sector & 31));
+    }
+}
+
+//
+// Initializes map for a newly allocated block where only Length bytes at
+// Offset are written.
+//
+AIMWRFLTR_SECTOR_MAP_INLINE
+void
+AIMWrFltrSectorMapInitialize(PAIMWRFLTR_SECTOR_MAP Map, ULONG Offset,
+    ULONG Length)
+{
+    ULONG i;
+
+    for (i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+    {
+        Map->Missing[i] = 0xFFFFFFFFUL;
+    }
+
+    AIMWrFltrSectorMapSetPresent(Map, Offset, Length);
+}
+
+//
+// Finds how many bytes from Offset, up to Length bytes, are in the same
+// state as the sector at Offset. Stores that number in RunLength and
+// returns non-zero if those bytes are missing from diff device and need
+// to be read from original volume.
+//
+AIMWRFLTR_SECTOR_MAP_INLINE
+int
+AIMWrFltrSectorMapGetRun(const AIMWRFLTR_SECTOR_MAP *Map, ULONG Offset,
+    ULONG Length, ULONG *RunLength)
+{
+    ULONG sector = Offset >> AIMWRFLTR_SECTOR_MAP_SECTOR_BITS;
+    int missing = AIMWrFltrSectorMapIsMissing(Map, sector);
+    ULONG end = Offset + Length;
+    ULONG run_end;
+
+    for (++sector; sector < AIMWRFLTR_SECTOR_MAP_SECTORS; sector++)
+    {
+        if ((sector << AIMWRFLTR_SECTOR_MAP_SECTOR_BITS) >= end ||
+            AIMWrFltrSectorMapIsMissing(Map, sector) != missing)
+        {
+            break;
+        }
+    }
+
+    run_end = sector << AIMWRFLTR_SECTOR_MAP_SECTOR_BITS;
+
+    if (run_end > end)
+    {
+        run_end = end;
+    }
+
+    *RunLength = run_end - Offset;
+
+    return missing;
+}
+
+#endif // _INC_FLTSECMAP_
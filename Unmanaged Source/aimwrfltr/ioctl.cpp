@@ -605,7 +605,10 @@ AIMWrFltrDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 
                     length_done += bytes_this_iter;
 
-                    if (device_extension->AllocationTable[b] !=
+                    // Blocks in parts of allocation table not yet loaded
+                    // could be allocated, let worker thread find out
+                    if (!AIMWrFltrBlockMapIsBlockLoaded(&device_extension->AllocationTable, b) ||
+                        AIMWrFltrBlockMapGet(&device_extension->AllocationTable, b) !=
                         DIFF_BLOCK_UNALLOCATED)
                     {
                         allocated = true;
@@ -681,6 +684,8 @@ AIMWrFltrDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
             InsertTailList(&device_extension->ListHead,
                 &cached_irp->ListEntry);
 
+            AIMWrFltrIndexQueuedIrp(&device_extension->QueuedExtents, cached_irp);
+
             AIMWrFltrReleaseLock(&lock_handle, &lowest_assumed_irql);
 
             KeSetEvent(&device_extension->ListEvent, 0, FALSE);
@@ -25,7 +25,13 @@ const UCHAR diff_file_magic[FIELD_SIZE(AIMWRFLTR_VBR_HEAD_FIELDS, Magic)] =
 
 const USHORT vbr_signature = 0xAA55;
 
-const ULONG major_version = 1UL;
+const ULONG major_version = 2UL;
+
+//
+// Diff devices from before sector maps existed only have complete blocks,
+// so they can still be used as they are.
+//
+const ULONG compatible_major_version = 1UL;
 
 const ULONG minor_version = 0UL;
 
@@ -354,12 +360,43 @@ AIMWrFltrSyncFilterWithTarget(IN PDEVICE_OBJECT FilterDevice,
     FilterDevice->Characteristics |= prop_flags;
 }
 
+//
+// Sector map directory is saved in the last block of the area reserved for
+// allocation table, which allocation table itself never uses.
+//
+LONGLONG
+AIMWrFltrGetSectorMapDirectoryOffset(IN PDEVICE_EXTENSION DeviceExtension)
+{
+    LONGLONG first_allocated_block = DeviceExtension->Statistics.
+        DiffDeviceVbr.Fields.Head.OffsetToFirstAllocatedBlock >>
+        (DIFF_BLOCK_BITS - SECTOR_BITS);
+
+    return (first_allocated_block - 1) << DIFF_BLOCK_BITS;
+}
+
 NTSTATUS
 AIMWrFltSaveDiffHeader(IN PDEVICE_EXTENSION DeviceExtension)
 {
     LARGE_INTEGER offset = { 0 };
     IO_STATUS_BLOCK io_status;
 
+    // Diff blocks for sector map leaves not saved before are allocated
+    // first, so that they are included in LastAllocatedBlock in header
+    if (DeviceExtension->SectorMapDirectory != NULL)
+    {
+        for (ULONG leaf = 0;
+            leaf < DeviceExtension->SectorMaps.DirectoryEntries;
+            leaf++)
+        {
+            if (AIMWrFltrBlockMapGetLeaf(&DeviceExtension->SectorMaps, leaf) != NULL &&
+                DeviceExtension->SectorMapDirectory[leaf] == DIFF_BLOCK_UNALLOCATED)
+            {
+                DeviceExtension->SectorMapDirectory[leaf] =
+                    ++DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.LastAllocatedBlock;
+            }
+        }
+    }
+
     offset.QuadPart = 0;
 
     NTSTATUS status = AIMWrFltrSynchronousReadWrite(
@@ -379,25 +416,93 @@ AIMWrFltSaveDiffHeader(IN PDEVICE_EXTENSION DeviceExtension)
         return status;
     }
 
-    offset.QuadPart =
-        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.OffsetToAllocationTable;
+    // Only leaves in memory can have allocated blocks. Parts of allocation
+    // table on diff device for other leaves are still all zeros.
+    for (ULONG leaf = 0;
+        leaf < DeviceExtension->AllocationTable.DirectoryEntries;
+        leaf++)
+    {
+        LONG volatile *entries =
+            AIMWrFltrBlockMapGetLeaf(&DeviceExtension->AllocationTable, leaf);
+
+        if (entries == NULL)
+        {
+            continue;
+        }
 
-    ULONG alloc_table_size = (ULONG)DeviceExtension->Statistics.
-        DiffDeviceVbr.Fields.Head.AllocationTableBlocks << DIFF_BLOCK_BITS;
+        offset.QuadPart =
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.OffsetToAllocationTable +
+            ((LONGLONG)leaf << DIFF_BLOCK_BITS);
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_WRITE,
+            (PVOID)entries,
+            AIMWRFLTR_BLOCK_MAP_LEAF_SIZE,
+            &offset,
+            NULL,
+            &io_status);
+
+        if (io_status.Information != AIMWRFLTR_BLOCK_MAP_LEAF_SIZE || !NT_SUCCESS(status))
+        {
+            DbgPrint(__FUNCTION__ ": Error writing diff allocation table: %#x\n", status);
+            return status;
+        }
+    }
+
+    if (DeviceExtension->SectorMapDirectory == NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    for (ULONG leaf = 0;
+        leaf < DeviceExtension->SectorMaps.DirectoryEntries;
+        leaf++)
+    {
+        LONG volatile *entries =
+            AIMWrFltrBlockMapGetLeaf(&DeviceExtension->SectorMaps, leaf);
+
+        if (entries == NULL)
+        {
+            continue;
+        }
+
+        offset.QuadPart = (LONGLONG)DeviceExtension->SectorMapDirectory[leaf] <<
+            DIFF_BLOCK_BITS;
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_WRITE,
+            (PVOID)entries,
+            AIMWRFLTR_BLOCK_MAP_LEAF_SIZE,
+            &offset,
+            NULL,
+            &io_status);
+
+        if (io_status.Information != AIMWRFLTR_BLOCK_MAP_LEAF_SIZE || !NT_SUCCESS(status))
+        {
+            DbgPrint(__FUNCTION__ ": Error writing diff sector maps: %#x\n", status);
+            return status;
+        }
+    }
+
+    offset.QuadPart = AIMWrFltrGetSectorMapDirectoryOffset(DeviceExtension);
 
     status = AIMWrFltrSynchronousReadWrite(
         DeviceExtension->DiffDeviceObject,
         DeviceExtension->DiffFileObject,
         IRP_MJ_WRITE,
-        (PVOID)DeviceExtension->AllocationTable,
-        alloc_table_size,
+        DeviceExtension->SectorMapDirectory,
+        DIFF_BLOCK_SIZE,
         &offset,
         NULL,
         &io_status);
 
-    if (io_status.Information != alloc_table_size || !NT_SUCCESS(status))
+    if (io_status.Information != DIFF_BLOCK_SIZE || !NT_SUCCESS(status))
     {
-        DbgPrint(__FUNCTION__ ": Error writing diff allocation table: %#x\n", status);
+        DbgPrint(__FUNCTION__ ": Error writing diff sector map directory: %#x\n", status);
         return status;
     }
 
@@ -443,13 +548,29 @@ AIMWrFltrCleanupDevice(IN PDEVICE_EXTENSION DeviceExtension)
         DeviceExtension->WorkerThread = NULL;
     }
 
-    if (DeviceExtension->AllocationTable != NULL &&
+    if (DeviceExtension->AllocationTablePrefetchThread != NULL)
+    {
+        DeviceExtension->ShutdownThread = true;
+        ZwWaitForSingleObject(DeviceExtension->AllocationTablePrefetchThread,
+            FALSE, NULL);
+        ZwClose(DeviceExtension->AllocationTablePrefetchThread);
+        DeviceExtension->AllocationTablePrefetchThread = NULL;
+    }
+
+    if (AIMWrFltrBlockMapIsInitialized(&DeviceExtension->AllocationTable) &&
         DeviceExtension->Statistics.Initialized)
     {
         AIMWrFltSaveDiffHeader(DeviceExtension);
 
-        delete[] DeviceExtension->AllocationTable;
-        DeviceExtension->AllocationTable = NULL;
+        AIMWrFltrBlockMapFree(&DeviceExtension->AllocationTable);
+    }
+
+    AIMWrFltrBlockMapFree(&DeviceExtension->SectorMaps);
+
+    if (DeviceExtension->SectorMapDirectory != NULL)
+    {
+        ExFreePool(DeviceExtension->SectorMapDirectory);
+        DeviceExtension->SectorMapDirectory = NULL;
     }
 
     if (DeviceExtension->DiffFileObject != NULL)
@@ -770,8 +891,14 @@ AIMWrFltrReadDiffDeviceVbr(IN PDEVICE_EXTENSION DeviceExtension)
             return STATUS_WRONG_VOLUME;
         }
 
+        DeviceExtension->SectorMapsOnDiffDevice =
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            MajorVersion == major_version;
+
         if (DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-            MajorVersion != major_version)
+            MajorVersion != major_version &&
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+            MajorVersion != compatible_major_version)
         {
             DbgPrint(__FUNCTION__ ": Overwriting incompatible version. Found in VBR %i:%i, expected %i:%i.\n",
                 DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
@@ -1021,6 +1148,421 @@ AIMWrFltrInitializePhDskMntDiffDevice(IN PDEVICE_EXTENSION DeviceExtension,
     return AIMWrFltrInitializeDiffDeviceUnsafe(DeviceExtension);
 }
 
+//
+// Creates allocation table. Leaves are loaded from diff device on first use
+// or by a prefetch thread started here.
+//
+NTSTATUS
+AIMWrFltrLoadAllocationTable(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONGLONG NumberOfBlocks)
+{
+    if (!AIMWrFltrBlockMapInitialize(&DeviceExtension->AllocationTable,
+        NumberOfBlocks, FALSE))
+    {
+        DbgPrint(
+            __FUNCTION__ ": Memory allocation error.\n");
+
+#if DBG
+        if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
+            DbgBreakPoint();
+#endif
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    NTSTATUS status = PsCreateSystemThread(
+        &DeviceExtension->AllocationTablePrefetchThread,
+        (ACCESS_MASK)0L,
+        NULL,
+        NULL,
+        NULL,
+        AIMWrFltrAllocationTablePrefetchThread,
+        DeviceExtension);
+
+    if (!NT_SUCCESS(status))
+    {
+        // Not fatal, leaves are still loaded when first used
+        DbgPrint(__FUNCTION__ ": Cannot start allocation table prefetch thread for %p: 0x%X\n",
+            DeviceExtension->DeviceObject, status);
+
+        DeviceExtension->AllocationTablePrefetchThread = NULL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Loads allocation table leaves from diff device. Leaves already loaded are
+// left as they are. Only one thread loads leaves at a time, so other
+// threads waiting for leaves wait at most for one read request.
+//
+NTSTATUS
+AIMWrFltrLoadAllocationTableLeaves(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONG FirstLeaf,
+    IN ULONG NumberOfLeaves)
+{
+    PAGED_CODE();
+
+    PAIMWRFLTR_BLOCK_MAP table = &DeviceExtension->AllocationTable;
+
+    if (FirstLeaf >= table->DirectoryEntries)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (NumberOfLeaves > table->DirectoryEntries - FirstLeaf)
+    {
+        NumberOfLeaves = table->DirectoryEntries - FirstLeaf;
+    }
+
+    WPagedPoolMem<LONG> buffer(
+        (SIZE_T)NumberOfLeaves * AIMWRFLTR_BLOCK_MAP_LEAF_SIZE);
+
+    if (!buffer)
+    {
+        DbgPrint(
+            __FUNCTION__ ": Memory allocation error.\n");
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeWaitForSingleObject(&DeviceExtension->AllocationTableLoadEvent,
+        Executive, KernelMode, FALSE, NULL);
+
+    // Skip leaves that were loaded while we waited
+    while (NumberOfLeaves > 0 &&
+        AIMWrFltrBlockMapIsLeafLoaded(table, FirstLeaf))
+    {
+        ++FirstLeaf;
+        --NumberOfLeaves;
+    }
+
+    while (NumberOfLeaves > 0 &&
+        AIMWrFltrBlockMapIsLeafLoaded(table, FirstLeaf + NumberOfLeaves - 1))
+    {
+        --NumberOfLeaves;
+    }
+
+    if (NumberOfLeaves == 0)
+    {
+        KeSetEvent(&DeviceExtension->AllocationTableLoadEvent, 0, FALSE);
+
+        return STATUS_SUCCESS;
+    }
+
+    ULONG bytes_to_read = NumberOfLeaves * AIMWRFLTR_BLOCK_MAP_LEAF_SIZE;
+
+    LARGE_INTEGER lower_offset;
+
+    lower_offset.QuadPart =
+        DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
+        OffsetToAllocationTable + ((LONGLONG)FirstLeaf << DIFF_BLOCK_BITS);
+
+    IO_STATUS_BLOCK io_status = { 0 };
+
+    NTSTATUS status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        IRP_MJ_READ,
+        buffer,
+        bytes_to_read,
+        &lower_offset,
+        NULL,
+        &io_status);
+
+    // Parts of allocation table not yet written to diff device
+    if (status == STATUS_END_OF_FILE)
+    {
+        io_status.Information = 0;
+        status = STATUS_SUCCESS;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        KeSetEvent(&DeviceExtension->AllocationTableLoadEvent, 0, FALSE);
+
+        DbgPrint(
+            __FUNCTION__ ": Error reading allocation table for %p: 0x%X\n",
+            DeviceExtension->DeviceObject, status);
+
+        return status;
+    }
+
+    if (io_status.Information < bytes_to_read)
+    {
+        RtlZeroMemory((PUCHAR)(PLONG)buffer + io_status.Information,
+            bytes_to_read - io_status.Information);
+    }
+
+    for (ULONG i = 0; i < NumberOfLeaves; i++)
+    {
+        if (!AIMWrFltrBlockMapLoadLeaf(table, FirstLeaf + i,
+            buffer + (int)(i * AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES)))
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+    }
+
+    KeSetEvent(&DeviceExtension->AllocationTableLoadEvent, 0, FALSE);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(
+            __FUNCTION__ ": Memory allocation error.\n");
+    }
+
+    return status;
+}
+
+//
+// Makes sure allocation table leaves for a range of blocks are loaded
+// before they are used.
+//
+NTSTATUS
+AIMWrFltrLoadAllocationTableRange(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONGLONG FirstBlock,
+    IN ULONGLONG LastBlock)
+{
+    PAIMWRFLTR_BLOCK_MAP table = &DeviceExtension->AllocationTable;
+
+    if (table->LoadedLeaves == table->DirectoryEntries)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    for (ULONGLONG block = FirstBlock & ~(ULONGLONG)AIMWRFLTR_BLOCK_MAP_LEAF_MASK;
+        block <= LastBlock;
+        block += AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES)
+    {
+        if (AIMWrFltrBlockMapIsBlockLoaded(table, block))
+        {
+            continue;
+        }
+
+        NTSTATUS status = AIMWrFltrLoadAllocationTableLeaves(DeviceExtension,
+            (ULONG)(block >> AIMWRFLTR_BLOCK_MAP_LEAF_BITS), 1);
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Creates sector maps for diff blocks and loads those saved on diff device.
+// Diff devices without saved sector maps only have complete blocks, so
+// sector maps start empty then and an empty directory is written, so that
+// nothing left in that block from before is taken as a directory later.
+//
+NTSTATUS
+AIMWrFltrLoadSectorMaps(IN PDEVICE_EXTENSION DeviceExtension,
+    IN ULONGLONG NumberOfBlocks)
+{
+    PAGED_CODE();
+
+    if (NumberOfBlocks > SECTOR_MAP_MAX_DIFF_BLOCKS)
+    {
+        NumberOfBlocks = SECTOR_MAP_MAX_DIFF_BLOCKS;
+    }
+
+    if (DeviceExtension->SectorMapDirectory == NULL)
+    {
+        DeviceExtension->SectorMapDirectory = (PLONG)
+            ExAllocatePagedPool(DIFF_BLOCK_SIZE);
+
+        if (DeviceExtension->SectorMapDirectory == NULL)
+        {
+            DbgPrint(
+                __FUNCTION__ ": Memory allocation error.\n");
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (!AIMWrFltrBlockMapInitialize(&DeviceExtension->SectorMaps,
+        NumberOfBlocks * AIMWRFLTR_SECTOR_MAP_WORDS, TRUE))
+    {
+        DbgPrint(
+            __FUNCTION__ ": Memory allocation error.\n");
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    LARGE_INTEGER lower_offset;
+
+    lower_offset.QuadPart =
+        AIMWrFltrGetSectorMapDirectoryOffset(DeviceExtension);
+
+    IO_STATUS_BLOCK io_status = { 0 };
+
+    NTSTATUS status;
+
+    if (!DeviceExtension->SectorMapsOnDiffDevice)
+    {
+        RtlZeroMemory(DeviceExtension->SectorMapDirectory, DIFF_BLOCK_SIZE);
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_WRITE,
+            DeviceExtension->SectorMapDirectory,
+            DIFF_BLOCK_SIZE,
+            &lower_offset,
+            NULL,
+            &io_status);
+
+        if (!NT_SUCCESS(status) || io_status.Information != DIFF_BLOCK_SIZE)
+        {
+            DbgPrint(
+                __FUNCTION__ ": Error writing sector map directory for %p: 0x%X\n",
+                DeviceExtension->DeviceObject, status);
+
+            return NT_SUCCESS(status) ? STATUS_DISK_FULL : status;
+        }
+
+        DeviceExtension->SectorMapsOnDiffDevice = true;
+
+        return STATUS_SUCCESS;
+    }
+
+    status = AIMWrFltrSynchronousReadWrite(
+        DeviceExtension->DiffDeviceObject,
+        DeviceExtension->DiffFileObject,
+        IRP_MJ_READ,
+        DeviceExtension->SectorMapDirectory,
+        DIFF_BLOCK_SIZE,
+        &lower_offset,
+        NULL,
+        &io_status);
+
+    // Directory not yet written to diff device
+    if (status == STATUS_END_OF_FILE)
+    {
+        io_status.Information = 0;
+        status = STATUS_SUCCESS;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(
+            __FUNCTION__ ": Error reading sector map directory for %p: 0x%X\n",
+            DeviceExtension->DeviceObject, status);
+
+        return status;
+    }
+
+    if (io_status.Information < DIFF_BLOCK_SIZE)
+    {
+        RtlZeroMemory((PUCHAR)DeviceExtension->SectorMapDirectory +
+            io_status.Information,
+            DIFF_BLOCK_SIZE - io_status.Information);
+    }
+
+    WPagedPoolMem<LONG> buffer(AIMWRFLTR_BLOCK_MAP_LEAF_SIZE);
+
+    if (!buffer)
+    {
+        DbgPrint(
+            __FUNCTION__ ": Memory allocation error.\n");
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG leaf = 0; leaf < SECTOR_MAP_DIRECTORY_ENTRIES; leaf++)
+    {
+        if (DeviceExtension->SectorMapDirectory[leaf] ==
+            DIFF_BLOCK_UNALLOCATED)
+        {
+            continue;
+        }
+
+        // Leaves for diff blocks that cannot exist on this volume
+        if (leaf >= DeviceExtension->SectorMaps.DirectoryEntries)
+        {
+            DeviceExtension->SectorMapDirectory[leaf] =
+                DIFF_BLOCK_UNALLOCATED;
+
+            continue;
+        }
+
+        lower_offset.QuadPart =
+            (LONGLONG)DeviceExtension->SectorMapDirectory[leaf] <<
+            DIFF_BLOCK_BITS;
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_READ,
+            buffer,
+            AIMWRFLTR_BLOCK_MAP_LEAF_SIZE,
+            &lower_offset,
+            NULL,
+            &io_status);
+
+        if (!NT_SUCCESS(status) ||
+            io_status.Information != AIMWRFLTR_BLOCK_MAP_LEAF_SIZE)
+        {
+            DbgPrint(
+                __FUNCTION__ ": Error reading sector maps for %p: 0x%X\n",
+                DeviceExtension->DeviceObject, status);
+
+            return NT_SUCCESS(status) ? STATUS_FILE_CORRUPT_ERROR : status;
+        }
+
+        if (AIMWrFltrBlockMapAllocateLeaf(&DeviceExtension->SectorMaps,
+            leaf, buffer) == NULL)
+        {
+            DbgPrint(
+                __FUNCTION__ ": Memory allocation error.\n");
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Loads allocation table in background after diff device is initialized,
+// so that requests seldom need to wait for leaves to load.
+//
+VOID
+AIMWrFltrAllocationTablePrefetchThread(PVOID Context)
+{
+    PDEVICE_EXTENSION device_extension = (PDEVICE_EXTENSION)Context;
+    PAIMWRFLTR_BLOCK_MAP table = &device_extension->AllocationTable;
+
+    LONGLONG start_time = KeQueryInterruptTime();
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (ULONG leaf = 0;
+        leaf < table->DirectoryEntries && !device_extension->ShutdownThread;
+        leaf += ALLOCATION_TABLE_LEAVES_PER_READ)
+    {
+        status = AIMWrFltrLoadAllocationTableLeaves(device_extension, leaf,
+            ALLOCATION_TABLE_LEAVES_PER_READ);
+
+        if (!NT_SUCCESS(status))
+        {
+            // Leaves not loaded here are tried again when first used
+            break;
+        }
+    }
+
+    KdPrint((__FUNCTION__ ": Loaded %u of %u allocation table leaves for %p in %I64i ms, %I64u bytes used.\n",
+        table->LoadedLeaves, table->DirectoryEntries,
+        device_extension->DeviceObject,
+        (KeQueryInterruptTime() - start_time) / 10000,
+        AIMWrFltrBlockMapMemoryUsage(table)));
+
+    PsTerminateSystemThread(status);
+}
+
 NTSTATUS
 AIMWrFltrInitializeDiffDeviceUnsafe(IN PDEVICE_EXTENSION DeviceExtension)
 {
@@ -1180,8 +1722,24 @@ AIMWrFltrInitializeDiffDeviceUnsafe(IN PDEVICE_EXTENSION DeviceExtension)
             DeviceExtension->DeviceObject, status);
     }
 
+    // Create sector maps for diff blocks, including blocks used for
+    // allocation table and for sector maps themselves
+    if (!AIMWrFltrBlockMapIsInitialized(&DeviceExtension->SectorMaps))
+    {
+        status = AIMWrFltrLoadSectorMaps(DeviceExtension,
+            number_of_blocks + DeviceExtension->Statistics.DiffDeviceVbr.
+            Fields.Head.AllocationTableBlocks + SECTOR_MAP_DIRECTORY_ENTRIES + 2);
+
+        if (!NT_SUCCESS(status))
+        {
+            DeviceExtension->Statistics.LastErrorCode = status;
+
+            return status;
+        }
+    }
+
     // Create allocation table
-    if (DeviceExtension->AllocationTable == NULL)
+    if (!AIMWrFltrBlockMapIsInitialized(&DeviceExtension->AllocationTable))
     {
         LONG alloc_table_blocks = (LONG)
             DIFF_GET_NUMBER_OF_BLOCKS(sizeof(LONG) * number_of_blocks) + 1;
@@ -1204,64 +1762,15 @@ AIMWrFltrInitializeDiffDeviceUnsafe(IN PDEVICE_EXTENSION DeviceExtension)
             return status;
         }
 
-        DeviceExtension->AllocationTable = new LONG[
-            (size_t)alloc_table_blocks << DIFF_BLOCK_BITS];
-
-        if (DeviceExtension->AllocationTable == NULL)
-        {
-            DbgPrint(
-                __FUNCTION__ ": Memory allocation error.\n");
-
-#if DBG
-            if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
-                DbgBreakPoint();
-#endif
-
-            status = STATUS_INSUFFICIENT_RESOURCES;
-
-            DeviceExtension->Statistics.LastErrorCode = status;
-
-            return status;
-        }
-
-        lower_offset.QuadPart =
-            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.
-            OffsetToAllocationTable;
-
-        status = AIMWrFltrSynchronousReadWrite(
-            DeviceExtension->DiffDeviceObject,
-            DeviceExtension->DiffFileObject,
-            IRP_MJ_READ,
-            (PVOID)DeviceExtension->AllocationTable,
-            (ULONG)alloc_table_blocks << DIFF_BLOCK_BITS,
-            &lower_offset,
-            NULL,
-            &io_status);
+        status = AIMWrFltrLoadAllocationTable(DeviceExtension,
+            number_of_blocks);
 
-        if (!NT_SUCCESS(status) && status != STATUS_END_OF_FILE)
+        if (!NT_SUCCESS(status))
         {
-            DbgPrint(
-                __FUNCTION__ ": Error reading diff device for %p: 0x%X\n",
-                DeviceExtension->DeviceObject, status);
-
-#if DBG
-            if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
-                DbgBreakPoint();
-#endif
-
             DeviceExtension->Statistics.LastErrorCode = status;
 
             return status;
         }
-
-        if (io_status.Information !=
-            ((ULONG_PTR)alloc_table_blocks << DIFF_BLOCK_BITS))
-        {
-            RtlZeroMemory((PUCHAR)DeviceExtension->AllocationTable +
-                io_status.Information,
-                ((ULONG_PTR)alloc_table_blocks << DIFF_BLOCK_BITS) -
-                io_status.Information);
-        }
     }
 
     DeviceExtension->Statistics.Initialized = TRUE;
@@ -1623,6 +2132,7 @@ AIMWrFltrAddDevice(IN PDRIVER_OBJECT DriverObject,
 
     KeInitializeSpinLock(&device_extension->ListLock);
     InitializeListHead(&device_extension->ListHead);
+    AIMWrFltrExtentIndexInitialize(&device_extension->QueuedExtents);
     KeInitializeEvent(&device_extension->ListEvent, SynchronizationEvent,
         FALSE);
 
@@ -1630,6 +2140,9 @@ AIMWrFltrAddDevice(IN PDRIVER_OBJECT DriverObject,
         SynchronizationEvent, TRUE);
     KeInitializeGuardedMutex(&device_extension->InitializationMutex);
 
+    KeInitializeEvent(&device_extension->AllocationTableLoadEvent,
+        SynchronizationEvent, TRUE);
+
     //
     // Save the filter device object in the device extension
     //
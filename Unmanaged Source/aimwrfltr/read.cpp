@@ -79,6 +79,20 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         return STATUS_END_OF_MEDIA;
     }
 
+    // Parts of allocation table for this range may not yet be loaded from
+    // diff device. This only waits for the leaves this request needs.
+    status = AIMWrFltrLoadAllocationTableRange(device_extension,
+        DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Read.ByteOffset.QuadPart),
+        DIFF_GET_BLOCK_NUMBER(highest_byte - 1));
+
+    if (!NT_SUCCESS(status))
+    {
+        Irp->IoStatus.Status = status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return status;
+    }
+
     KIRQL current_irql = PASSIVE_LEVEL;
 
     KLOCK_QUEUE_HANDLE lock_handle = { 0 };
@@ -173,11 +187,23 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    // Map of sectors found in write queue. Kept on stack unless read is
+    // larger than usual.
     RTL_BITMAP bitmap;
 
-    WNonPagedPoolMem<ULONG> bitmap_buffer((io_stack->Parameters.Read.Length >> 9) + sizeof(ULONG) - 1);
+    ULONG bitmap_stack_buffer[READ_QUEUE_BITMAP_SECTORS / (sizeof(ULONG) << 3)];
+
+    WNonPagedPoolMem<ULONG> bitmap_buffer;
 
-    if (!bitmap_buffer)
+    PULONG bitmap_bits = bitmap_stack_buffer;
+
+    if ((io_stack->Parameters.Read.Length >> 9) > READ_QUEUE_BITMAP_SECTORS)
+    {
+        bitmap_bits = bitmap_buffer.ReAlloc((io_stack->Parameters.Read.Length >> 9) + sizeof(ULONG) - 1) ?
+            (PULONG)bitmap_buffer : NULL;
+    }
+
+    if (bitmap_bits == NULL)
     {
         Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -190,33 +216,34 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    bitmap_buffer.Clear();
+    RtlInitializeBitMap(&bitmap, bitmap_bits, io_stack->Parameters.Read.Length >> 9);
 
-    RtlInitializeBitMap(&bitmap, bitmap_buffer, io_stack->Parameters.Read.Length >> 9);
+    RtlClearAllBits(&bitmap);
 
     ULONG bytes_from_cache = 0;
 
     ULONG items_in_queue = 0;
 
     // First check whether we have queued write or trim requests that
-    // match region covered by this read request
+    // match region covered by this read request. Index returns them in
+    // queue order, so that later writes overwrite earlier ones here too.
 
     AIMWrFltrAcquireLock(&device_extension->ListLock, &lock_handle,
         current_irql);
 
-    for (PLIST_ENTRY entry = device_extension->ListHead.Flink;
-        entry != &device_extension->ListHead;
-        entry = entry->Flink)
-    {
-        items_in_queue++;
+    items_in_queue = device_extension->QueuedExtents.Count;
 
-        PCACHED_IRP cached_irp = CONTAINING_RECORD(entry, CACHED_IRP, ListEntry);
+    for (PAIMWRFLTR_EXTENT_NODE node = AIMWrFltrExtentIndexFind(
+        &device_extension->QueuedExtents,
+        io_stack->Parameters.Read.ByteOffset.QuadPart, highest_byte);
+        node != NULL;
+        node = node->Next)
+    {
+        PCACHED_IRP cached_irp = CONTAINING_RECORD(node, CACHED_IRP, ExtentNode);
 
         PIO_STACK_LOCATION item = &cached_irp->IoStack;
 
-        if (item->MajorFunction == IRP_MJ_WRITE && cached_irp->Irp == NULL &&
-            (item->Parameters.Write.ByteOffset.QuadPart < (io_stack->Parameters.Read.ByteOffset.QuadPart + io_stack->Parameters.Read.Length)) &&
-            ((item->Parameters.Write.ByteOffset.QuadPart + item->Parameters.Write.Length) > io_stack->Parameters.Read.ByteOffset.QuadPart))
+        if (item->MajorFunction == IRP_MJ_WRITE)
         {
             LONGLONG start_pos = max(item->Parameters.Write.ByteOffset.QuadPart,
                 io_stack->Parameters.Read.ByteOffset.QuadPart);
@@ -238,10 +265,9 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
             device_extension->Statistics.ReadBytesFromCache +=
                 end_pos - start_pos;
         }
-        else if (item->MajorFunction == IRP_MJ_DEVICE_CONTROL &&
-            item->Parameters.DeviceIoControl.IoControlCode == IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES &&
-            ((PDEVICE_MANAGE_DATA_SET_ATTRIBUTES)cached_irp->Buffer)->Action == DeviceDsmAction_Trim)
+        else
         {
+            // Trim, indexed by range from its first to its last byte
             PDEVICE_MANAGE_DATA_SET_ATTRIBUTES attrs = (PDEVICE_MANAGE_DATA_SET_ATTRIBUTES)cached_irp->Buffer;
 
             ULONG items = attrs->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
@@ -282,7 +308,7 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
     {
         bool any_block_modified = false;
 
-        if ((device_extension->AllocationTable != NULL) &&
+        if (AIMWrFltrBlockMapIsInitialized(&device_extension->AllocationTable) &&
             (device_extension->DiffDeviceObject != NULL))
         {
             LONG first = (LONG)DIFF_GET_BLOCK_NUMBER(io_stack->Parameters.Read.ByteOffset.QuadPart);
@@ -291,7 +317,7 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
 
             for (LONG i = first; i <= last; i++)
             {
-                if (device_extension->AllocationTable[i] != DIFF_BLOCK_UNALLOCATED)
+                if (AIMWrFltrBlockMapGet(&device_extension->AllocationTable, i) != DIFF_BLOCK_UNALLOCATED)
                 {
                     any_block_modified = true;
                     break;
@@ -443,13 +469,14 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
             ULONG length_done = 0;
 
             ULONG first = (ULONG)DIFF_GET_BLOCK_NUMBER(lower_offset.QuadPart);
-            ULONG last = (ULONG)DIFF_GET_BLOCK_NUMBER(lower_offset.QuadPart +
-                lower_length - 1);
 
+            // Runs within partially written blocks do not end at block
+            // boundaries, so next block number is found from where next
+            // iteration starts
             for (
                 ULONG i = first;
-                (i <= last) && (length_done < lower_length);
-                i++)
+                length_done < lower_length;
+                i = (ULONG)DIFF_GET_BLOCK_NUMBER(lower_offset.QuadPart + length_done))
             {
                 LONGLONG abs_offset_this_iter = lower_offset.QuadPart + length_done;
                 ULONG page_offset_this_iter = DIFF_GET_BLOCK_OFFSET(abs_offset_this_iter);
@@ -459,14 +486,14 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
                 PDEVICE_OBJECT lower_device = NULL;
                 PFILE_OBJECT lower_file = NULL;
 
-                if (device_extension->AllocationTable[i] == DIFF_BLOCK_UNALLOCATED)
+                if (AIMWrFltrBlockMapGet(&device_extension->AllocationTable, i) == DIFF_BLOCK_UNALLOCATED)
                 {
                     ULONG block_size = DIFF_BLOCK_SIZE;
 
                     // Contiguous? Then merge with next iteration
                     while ((page_offset_this_iter + bytes_this_iter) > block_size)
                     {
-                        if (device_extension->AllocationTable[i + 1] ==
+                        if (AIMWrFltrBlockMapGet(&device_extension->AllocationTable, i + 1) ==
                             DIFF_BLOCK_UNALLOCATED)
                         {
                             block_size += DIFF_BLOCK_SIZE;
@@ -491,13 +518,31 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
                 else
                 {
                     ULONG block_size = DIFF_BLOCK_SIZE;
-                    LONG block_base = device_extension->AllocationTable[i];
+                    LONG block_base = AIMWrFltrBlockMapGet(&device_extension->AllocationTable, i);
+                    AIMWRFLTR_SECTOR_MAP sector_map;
+                    int missing = 0;
+
+                    if (AIMWrFltrGetSectorMap(device_extension, block_base, &sector_map))
+                    {
+                        // Block allocated by partial writes. Read one run of
+                        // sectors that are all either on diff device or not.
+                        if ((page_offset_this_iter + bytes_this_iter) > block_size)
+                        {
+                            bytes_this_iter = block_size - page_offset_this_iter;
+                        }
+
+                        missing = AIMWrFltrSectorMapGetRun(&sector_map,
+                            page_offset_this_iter, bytes_this_iter, &bytes_this_iter);
+                    }
 
                     // Contiguous? Then merge with next iteration
                     while ((page_offset_this_iter + bytes_this_iter) > block_size)
                     {
-                        if (device_extension->AllocationTable[i + 1] ==
-                            device_extension->AllocationTable[i] + 1)
+                        if (AIMWrFltrBlockMapGet(&device_extension->AllocationTable, i + 1) ==
+                            AIMWrFltrBlockMapGet(&device_extension->AllocationTable, i) + 1 &&
+                            !AIMWrFltrGetSectorMap(device_extension,
+                                AIMWrFltrBlockMapGet(&device_extension->AllocationTable, i + 1),
+                                &sector_map))
                         {
                             block_size += DIFF_BLOCK_SIZE;
                             ++i;
@@ -508,17 +553,31 @@ AIMWrFltrRead(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
                         }
                     }
 
-                    InterlockedExchangeAdd64(&device_extension->Statistics.ReadBytesFromDiff,
-                        bytes_this_iter);
+                    if (missing)
+                    {
+                        InterlockedExchangeAdd64(
+                            &device_extension->Statistics.ReadBytesFromOriginal,
+                            bytes_this_iter);
+
+                        bytes_from_orig += bytes_this_iter;
+
+                        lower_device = device_extension->TargetDeviceObject;
+                        offset_this_iter.QuadPart = abs_offset_this_iter;
+                    }
+                    else
+                    {
+                        InterlockedExchangeAdd64(&device_extension->Statistics.ReadBytesFromDiff,
+                            bytes_this_iter);
 
-                    bytes_from_diff += bytes_this_iter;
+                        bytes_from_diff += bytes_this_iter;
 
-                    lower_device = device_extension->DiffDeviceObject;
-                    lower_file = device_extension->DiffFileObject;
+                        lower_device = device_extension->DiffDeviceObject;
+                        lower_file = device_extension->DiffFileObject;
 
-                    offset_this_iter.QuadPart =
-                        ((LONGLONG)block_base << DIFF_BLOCK_BITS) +
-                        page_offset_this_iter;
+                        offset_this_iter.QuadPart =
+                            ((LONGLONG)block_base << DIFF_BLOCK_BITS) +
+                            page_offset_this_iter;
+                    }
                 }
 
                 __analysis_assume(lower_device != NULL);
@@ -690,7 +749,8 @@ AIMWrFltrDeferredRead(
         }
 
         NTSTATUS status;
-        LONG block_address = DeviceExtension->AllocationTable[i];
+        AIMWRFLTR_SECTOR_MAP sector_map;
+        LONG block_address = AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, i);
         if (block_address == DIFF_BLOCK_UNALLOCATED)
         {
             LARGE_INTEGER lower_offset;
@@ -753,6 +813,24 @@ AIMWrFltrDeferredRead(
                 return io_status.Status;
             }
         }
+        else if (AIMWrFltrGetSectorMap(DeviceExtension, block_address,
+            &sector_map))
+        {
+            // Only some sectors of this block are on diff device
+            status = AIMWrFltrReadPartialBlock(DeviceExtension,
+                DIFF_GET_BLOCK_BASE_FROM_ABS_OFFSET(abs_offset_this_iter),
+                block_address,
+                &sector_map,
+                BlockBuffer,
+                page_offset_this_iter,
+                bytes_this_iter,
+                Irp->Tail.Overlay.Thread);
+
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+        }
         else
         {
             LARGE_INTEGER lower_offset = { 0 };
@@ -841,4 +919,149 @@ AIMWrFltrDeferredRead(
     return STATUS_SUCCESS;
 }
 
+//
+// Reads Length bytes at Offset within a diff block that only has some of
+// its sectors on diff device, into same position in BlockBuffer. Sectors
+// that are on diff device are read from there, aligned to diff device
+// sector size, which may overwrite parts of BlockBuffer outside requested
+// range. Other sectors are then read from original volume. Sectors beyond
+// end of volume are filled with zeroes.
+//
+NTSTATUS
+AIMWrFltrReadPartialBlock(IN PDEVICE_EXTENSION DeviceExtension,
+    IN LONGLONG BlockOffset,
+    IN LONG DiffBlock,
+    IN const AIMWRFLTR_SECTOR_MAP *SectorMap,
+    IN OUT PUCHAR BlockBuffer,
+    IN ULONG Offset,
+    IN ULONG Length,
+    IN PETHREAD Thread)
+{
+    ULONG sector_mask = SECTOR_SIZE - 1;
+
+    if (DeviceExtension->DiffDeviceSectorSize > SECTOR_SIZE)
+    {
+        sector_mask = (ULONG)(DeviceExtension->DiffDeviceSectorSize - 1);
+    }
+
+    ULONG end = Offset + Length;
+    ULONG run_length;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+
+    // Sectors on diff device first, so that anything read there for
+    // alignment is replaced with data from original volume below
+    for (ULONG position = Offset; position < end; position += run_length)
+    {
+        if (AIMWrFltrSectorMapGetRun(SectorMap, position, end - position,
+            &run_length))
+        {
+            continue;
+        }
+
+        ULONG aligned_position = position & ~sector_mask;
+        ULONG aligned_length = (position - aligned_position + run_length +
+            sector_mask) & ~sector_mask;
+
+        if (aligned_position + aligned_length > (ULONG)DIFF_BLOCK_SIZE)
+        {
+            aligned_length = DIFF_BLOCK_SIZE - aligned_position;
+        }
+
+        LARGE_INTEGER lower_offset;
+
+        lower_offset.QuadPart = ((LONGLONG)DiffBlock << DIFF_BLOCK_BITS) +
+            aligned_position;
+
+        status = AIMWrFltrSynchronousReadWrite(
+            DeviceExtension->DiffDeviceObject,
+            DeviceExtension->DiffFileObject,
+            IRP_MJ_READ,
+            BlockBuffer + aligned_position,
+            aligned_length,
+            &lower_offset,
+            Thread,
+            &io_status);
+
+        if (NT_SUCCESS(status) &&
+            io_status.Information < position - aligned_position + run_length)
+        {
+            DbgPrint(__FUNCTION__ ": Read request 0x%X bytes, done 0x%IX.\n",
+                aligned_length, io_status.Information);
+
+#if DBG
+            if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
+                DbgBreakPoint();
+#endif
+
+            status = STATUS_DISK_CORRUPT_ERROR;
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint((__FUNCTION__ ": Read from diff device failed: 0x%X\n",
+                status));
+
+            return status;
+        }
+    }
+
+    for (ULONG position = Offset; position < end; position += run_length)
+    {
+        if (!AIMWrFltrSectorMapGetRun(SectorMap, position, end - position,
+            &run_length))
+        {
+            continue;
+        }
+
+        LARGE_INTEGER lower_offset;
+
+        lower_offset.QuadPart = BlockOffset + position;
+
+        ULONG read_length = run_length;
+
+        // If at end of media, read as much as possible and pad the rest
+        // with zeroes
+        if (lower_offset.QuadPart + read_length >
+            DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.QuadPart)
+        {
+            read_length = lower_offset.QuadPart <
+                DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.QuadPart ?
+                (ULONG)(DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.Size.QuadPart -
+                    lower_offset.QuadPart) : 0;
+        }
+
+        io_status.Information = 0;
+
+        if (read_length > 0)
+        {
+            status = AIMWrFltrSynchronousReadWrite(
+                DeviceExtension->TargetDeviceObject,
+                NULL,
+                IRP_MJ_READ,
+                BlockBuffer + position,
+                read_length,
+                &lower_offset,
+                NULL,
+                &io_status);
+
+            if (!NT_SUCCESS(status))
+            {
+                KdPrint((__FUNCTION__ ": Read from target device failed: 0x%X\n",
+                    status));
+
+                return status;
+            }
+        }
+
+        if (io_status.Information < run_length)
+        {
+            RtlZeroMemory(BlockBuffer + position + io_status.Information,
+                run_length - io_status.Information);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
 
@@ -0,0 +1,183 @@
+/// blkload_bench.cpp
+/// Time to first I/O after attaching a diff device, with the allocation
+/// table read from a file in leaves the way mainwdm.cpp reads it from diff
+/// device. Compares loading the whole table before first lookup, as was
+/// done before leaves were loaded on demand, with loading only the leaf
+/// first lookup needs. Table is for a 4 TB volume with 10% of leaves
+/// populated. Runs with table file in page cache and, where the system
+/// lets it be dropped from cache, read from disk.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <fltblkmap.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+
+static const ULONG BenchLeaves = 4096;              // 4 TB in 64 KB blocks
+static const ULONG BenchLeavesPerRead = 16;         // ALLOCATION_TABLE_LEAVES_PER_READ
+static const ULONGLONG BenchLeafEntries = AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES;
+
+static bool
+BenchLoadLeaves(int Fd, PAIMWRFLTR_BLOCK_MAP Map, ULONG FirstLeaf,
+    ULONG NumberOfLeaves, std::vector<LONG> *Buffer)
+{
+    size_t bytes = (size_t)NumberOfLeaves * AIMWRFLTR_BLOCK_MAP_LEAF_SIZE;
+
+    Buffer->resize(NumberOfLeaves * BenchLeafEntries);
+
+    if (pread(Fd, Buffer->data(), bytes,
+        (off_t)FirstLeaf * AIMWRFLTR_BLOCK_MAP_LEAF_SIZE) != (ssize_t)bytes)
+    {
+        return false;
+    }
+
+    for (ULONG i = 0; i < NumberOfLeaves; i++)
+    {
+        if (!AIMWrFltrBlockMapLoadLeaf(Map, FirstLeaf + i,
+            Buffer->data() + i * BenchLeafEntries))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+///
+/// Milliseconds from attach to first lookup of Block answered.
+///
+static double
+BenchFirstLookup(int Fd, ULONGLONG Block, bool Eager, ULONG *Allocated)
+{
+    AIMWRFLTR_BLOCK_MAP map = { };
+    std::vector<LONG> buffer;
+
+    double start = ImTestSeconds();
+
+    AIMWrFltrBlockMapInitialize(&map, BenchLeaves * BenchLeafEntries, 0);
+
+    if (Eager)
+    {
+        for (ULONG leaf = 0; leaf < BenchLeaves; leaf += BenchLeavesPerRead)
+        {
+            BenchLoadLeaves(Fd, &map, leaf, BenchLeavesPerRead, &buffer);
+        }
+    }
+    else
+    {
+        BenchLoadLeaves(Fd, &map, (ULONG)(Block / BenchLeafEntries), 1,
+            &buffer);
+    }
+
+    LONG value = AIMWrFltrBlockMapGet(&map, Block);
+
+    double ms = (ImTestSeconds() - start) * 1000;
+
+    if (value == 0)
+    {
+        printf("Block %llu not found\n", (unsigned long long)Block);
+    }
+
+    *Allocated = map.AllocatedLeaves;
+
+    AIMWrFltrBlockMapFree(&map);
+
+    return ms;
+}
+
+static bool
+BenchDropCache(int Fd)
+{
+    return fdatasync(Fd) == 0 &&
+        posix_fadvise(Fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+}
+
+int
+main()
+{
+    char path[] = "/var/tmp/blkload_bench_XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+
+    unlink(path);
+
+    // Every tenth leaf has some allocated blocks
+    std::vector<LONG> leaf(BenchLeafEntries);
+    uint64_t state = 41;
+    ULONGLONG first_io = 0;
+
+    for (ULONG i = 0; i < BenchLeaves; i++)
+    {
+        memset(leaf.data(), 0, AIMWRFLTR_BLOCK_MAP_LEAF_SIZE);
+
+        if (i % 10 == 0)
+        {
+            for (int j = 0; j < 2000; j++)
+            {
+                ULONG entry = ImTestRandom(&state) % BenchLeafEntries;
+                leaf[entry] = (LONG)(1 + ImTestRandom(&state) % 0x7FFFFFFE);
+
+                first_io = i * BenchLeafEntries + entry;
+            }
+        }
+
+        if (write(fd, leaf.data(), AIMWRFLTR_BLOCK_MAP_LEAF_SIZE) !=
+            (ssize_t)AIMWRFLTR_BLOCK_MAP_LEAF_SIZE)
+        {
+            perror("write");
+            return 1;
+        }
+    }
+
+    printf("4 TB volume, %u leaves, table %u MB\n", BenchLeaves,
+        (unsigned)((ULONGLONG)BenchLeaves * AIMWRFLTR_BLOCK_MAP_LEAF_SIZE >> 20));
+    printf("%-8s %-14s %12s %10s\n", "cache", "load", "first I/O ms",
+        "leaves");
+
+    for (int cold = 0; cold < 2; cold++)
+    {
+        for (int eager = 1; eager >= 0; eager--)
+        {
+            ULONG allocated;
+
+            if (cold && !BenchDropCache(fd))
+            {
+                printf("%-8s %-14s %12s\n", "cold", eager ? "whole table" :
+                    "one leaf", "n/a");
+                continue;
+            }
+
+            // Warm page cache
+            if (!cold)
+            {
+                BenchFirstLookup(fd, first_io, true, &allocated);
+            }
+
+            double ms = BenchFirstLookup(fd, first_io, eager != 0, &allocated);
+
+            printf("%-8s %-14s %12.2f %10u\n", cold ? "cold" : "cached",
+                eager ? "whole table" : "one leaf", ms, (unsigned)allocated);
+        }
+    }
+
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,391 @@
+/// blkload_test.cpp
+/// Tests for loading the allocation table in fltblkmap.h on demand. Leaves
+/// are loaded from an in-memory copy of the table on diff device the same
+/// way as AIMWrFltrLoadAllocationTableLeaves in mainwdm.cpp does, with a
+/// mutex in place of the load event. Checks that a table starts out not
+/// loaded, that leaves with nothing allocated take no memory when loaded,
+/// that loading does not overwrite entries changed after an earlier load,
+/// that failed loads can be retried, that a lookup only loads the leaves
+/// it needs, and runs lookups against a prefetch thread.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::atomic<long> BlockLoadTestOutstanding(0);
+static std::atomic<long> BlockLoadTestFailCountdown(0);
+
+static void *
+BlockLoadTestAllocate(size_t Size)
+{
+    if (BlockLoadTestFailCountdown > 0 && --BlockLoadTestFailCountdown == 0)
+    {
+        return NULL;
+    }
+
+    void *ptr = malloc(Size);
+
+    if (ptr != NULL)
+    {
+        BlockLoadTestOutstanding++;
+    }
+
+    return ptr;
+}
+
+static void
+BlockLoadTestFree(void *Ptr)
+{
+    BlockLoadTestOutstanding--;
+    free(Ptr);
+}
+
+#define AIMWRFLTR_BLOCK_MAP_ALLOCATE(size) BlockLoadTestAllocate(size)
+#define AIMWRFLTR_BLOCK_MAP_FREE(ptr) BlockLoadTestFree(ptr)
+
+#include <fltblkmap.h>
+
+static const ULONGLONG LeafEntries = AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES;
+
+///
+/// Allocation table with a copy on "diff device" to load leaves from.
+///
+struct BlockLoadTestTable
+{
+    AIMWRFLTR_BLOCK_MAP Map;
+    std::vector<LONG> Disk;
+    std::mutex LoadLock;
+    std::atomic<ULONG> Reads;
+
+    BlockLoadTestTable(ULONG Leaves)
+        : Disk((size_t)Leaves * LeafEntries), Reads(0)
+    {
+        memset(&Map, 0, sizeof(Map));
+        AIMWrFltrBlockMapInitialize(&Map, Leaves * LeafEntries, 0);
+    }
+
+    ~BlockLoadTestTable()
+    {
+        AIMWrFltrBlockMapFree(&Map);
+    }
+
+    ///
+    /// Same steps as AIMWrFltrLoadAllocationTableLeaves.
+    ///
+    bool LoadLeaves(ULONG FirstLeaf, ULONG NumberOfLeaves)
+    {
+        if (FirstLeaf >= Map.DirectoryEntries)
+        {
+            return true;
+        }
+
+        if (NumberOfLeaves > Map.DirectoryEntries - FirstLeaf)
+        {
+            NumberOfLeaves = Map.DirectoryEntries - FirstLeaf;
+        }
+
+        std::lock_guard<std::mutex> lock(LoadLock);
+
+        while (NumberOfLeaves > 0 &&
+            AIMWrFltrBlockMapIsLeafLoaded(&Map, FirstLeaf))
+        {
+            ++FirstLeaf;
+            --NumberOfLeaves;
+        }
+
+        while (NumberOfLeaves > 0 &&
+            AIMWrFltrBlockMapIsLeafLoaded(&Map, FirstLeaf + NumberOfLeaves - 1))
+        {
+            --NumberOfLeaves;
+        }
+
+        if (NumberOfLeaves == 0)
+        {
+            return true;
+        }
+
+        // Read request to diff device
+        std::vector<LONG> buffer(Disk.begin() + FirstLeaf * LeafEntries,
+            Disk.begin() + (FirstLeaf + NumberOfLeaves) * LeafEntries);
+
+        Reads++;
+
+        for (ULONG i = 0; i < NumberOfLeaves; i++)
+        {
+            if (!AIMWrFltrBlockMapLoadLeaf(&Map, FirstLeaf + i,
+                buffer.data() + i * LeafEntries))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    ///
+    /// Same steps as AIMWrFltrLoadAllocationTableRange.
+    ///
+    bool LoadRange(ULONGLONG FirstBlock, ULONGLONG LastBlock)
+    {
+        if (Map.LoadedLeaves == Map.DirectoryEntries)
+        {
+            return true;
+        }
+
+        for (ULONGLONG block = FirstBlock & ~(ULONGLONG)(LeafEntries - 1);
+            block <= LastBlock;
+            block += LeafEntries)
+        {
+            if (AIMWrFltrBlockMapIsBlockLoaded(&Map, block))
+            {
+                continue;
+            }
+
+            if (!LoadLeaves((ULONG)(block / LeafEntries), 1))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+///
+/// Fills every tenth leaf of table on disk with a few allocated blocks.
+/// Returns number of populated leaves.
+///
+static ULONG
+BlockLoadTestPopulate(BlockLoadTestTable *Table, uint64_t *State)
+{
+    ULONG populated = 0;
+
+    for (ULONG leaf = 0; leaf < Table->Map.DirectoryEntries; leaf += 10)
+    {
+        for (int i = 0; i < 50; i++)
+        {
+            ULONGLONG block = leaf * LeafEntries +
+                ImTestRandom(State) % LeafEntries;
+
+            Table->Disk[block] = (LONG)(block + 1);
+        }
+
+        populated++;
+    }
+
+    return populated;
+}
+
+static void
+TestNotLoaded()
+{
+    BlockLoadTestTable table(8);
+
+    IMTEST_CHECK(table.Map.LoadedLeaves == 0);
+
+    for (ULONG leaf = 0; leaf < 8; leaf++)
+    {
+        IMTEST_CHECK(!AIMWrFltrBlockMapIsLeafLoaded(&table.Map, leaf));
+        IMTEST_CHECK(!AIMWrFltrBlockMapIsBlockLoaded(&table.Map,
+            leaf * LeafEntries + 3));
+    }
+
+    // Outside volume counts as loaded, nothing is allocated there
+    IMTEST_CHECK(AIMWrFltrBlockMapIsLeafLoaded(&table.Map, 8));
+    IMTEST_CHECK(AIMWrFltrBlockMapIsBlockLoaded(&table.Map, 8 * LeafEntries));
+    IMTEST_CHECK(table.LoadLeaves(8, 1));
+    IMTEST_CHECK(table.Reads == 0);
+}
+
+static void
+TestLoadLeaf()
+{
+    BlockLoadTestTable table(8);
+
+    table.Disk[2 * LeafEntries + 17] = 1234;
+    table.Disk[3 * LeafEntries - 1] = 5678;
+
+    // Leaf with nothing allocated is marked loaded but takes no memory
+    IMTEST_CHECK(table.LoadLeaves(1, 1));
+    IMTEST_CHECK(AIMWrFltrBlockMapIsLeafLoaded(&table.Map, 1));
+    IMTEST_CHECK(AIMWrFltrBlockMapGetLeaf(&table.Map, 1) == NULL);
+    IMTEST_CHECK(table.Map.AllocatedLeaves == 0);
+    IMTEST_CHECK(table.Map.LoadedLeaves == 1);
+
+    IMTEST_CHECK(table.LoadLeaves(2, 1));
+    IMTEST_CHECK(table.Map.AllocatedLeaves == 1);
+    IMTEST_CHECK(table.Map.LoadedLeaves == 2);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&table.Map, 2 * LeafEntries + 17) == 1234);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&table.Map, 3 * LeafEntries - 1) == 5678);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&table.Map, 2 * LeafEntries) == 0);
+
+    // Loaded leaf changed afterwards is not overwritten by another load
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&table.Map, 2 * LeafEntries + 17, 99));
+    IMTEST_CHECK(AIMWrFltrBlockMapLoadLeaf(&table.Map, 2,
+        &table.Disk[2 * LeafEntries]));
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&table.Map, 2 * LeafEntries + 17) == 99);
+    IMTEST_CHECK(table.Map.LoadedLeaves == 2);
+
+    // Range of leaves skips loaded ones at both ends in one read
+    table.Reads = 0;
+    IMTEST_CHECK(table.LoadLeaves(1, 4));
+    IMTEST_CHECK(table.Reads == 1);
+    IMTEST_CHECK(table.Map.LoadedLeaves == 4);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&table.Map, 2 * LeafEntries + 17) == 99);
+
+    IMTEST_CHECK(table.LoadLeaves(1, 4));
+    IMTEST_CHECK(table.Reads == 1);
+}
+
+static void
+TestLoadFailure()
+{
+    BlockLoadTestTable table(4);
+
+    table.Disk[LeafEntries + 1] = 42;
+
+    BlockLoadTestFailCountdown = 1;
+    IMTEST_CHECK(!table.LoadLeaves(1, 1));
+    IMTEST_CHECK(!AIMWrFltrBlockMapIsLeafLoaded(&table.Map, 1));
+    IMTEST_CHECK(table.Map.LoadedLeaves == 0);
+
+    IMTEST_CHECK(table.LoadLeaves(1, 1));
+    IMTEST_CHECK(AIMWrFltrBlockMapIsLeafLoaded(&table.Map, 1));
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&table.Map, LeafEntries + 1) == 42);
+}
+
+static void
+TestLoadOnlyNeeded()
+{
+    BlockLoadTestTable table(64);
+    uint64_t state = 31;
+
+    BlockLoadTestPopulate(&table, &state);
+
+    // One block, one leaf
+    IMTEST_CHECK(table.LoadRange(20 * LeafEntries + 5, 20 * LeafEntries + 5));
+    IMTEST_CHECK(table.Map.LoadedLeaves == 1);
+    IMTEST_CHECK(table.Reads == 1);
+
+    // Request crossing two leaf boundaries
+    IMTEST_CHECK(table.LoadRange(30 * LeafEntries - 1, 31 * LeafEntries + 1));
+    IMTEST_CHECK(table.Map.LoadedLeaves == 4);
+    IMTEST_CHECK(table.Reads == 4);
+
+    // Already loaded
+    IMTEST_CHECK(table.LoadRange(20 * LeafEntries, 21 * LeafEntries - 1));
+    IMTEST_CHECK(table.Reads == 4);
+
+    ULONG errors = 0;
+
+    for (ULONGLONG block = 29 * LeafEntries; block < 32 * LeafEntries; block++)
+    {
+        if (AIMWrFltrBlockMapGet(&table.Map, block) != table.Disk[block])
+        {
+            errors++;
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+
+    // Populated leaves loaded so far are 20 and 30
+    IMTEST_CHECK(table.Map.AllocatedLeaves == 2);
+}
+
+///
+/// Lookups on several threads, each loading what it needs first, while a
+/// prefetch thread loads the table 16 leaves at a time. Every lookup must
+/// agree with the table on disk and every leaf must be loaded once.
+///
+static void
+TestLookupsDuringPrefetch()
+{
+    static const ULONG Leaves = 1024;
+
+    BlockLoadTestTable table(Leaves);
+    uint64_t state = 37;
+    std::atomic<ULONG> errors(0);
+    std::atomic<ULONG> early_loads(0);
+    std::vector<std::thread> readers;
+
+    ULONG populated = BlockLoadTestPopulate(&table, &state);
+
+    std::thread prefetch([&table]()
+    {
+        for (ULONG leaf = 0; leaf < Leaves; leaf += 16)
+        {
+            table.LoadLeaves(leaf, 16);
+        }
+    });
+
+    for (int r = 0; r < 3; r++)
+    {
+        readers.push_back(std::thread([&table, &errors, &early_loads, r]()
+        {
+            uint64_t reader_state = 200 + r;
+
+            for (int i = 0; i < 20000; i++)
+            {
+                ULONGLONG block =
+                    ((ULONGLONG)ImTestRandom(&reader_state) << 8 ^
+                    ImTestRandom(&reader_state)) % (Leaves * LeafEntries);
+
+                if (!AIMWrFltrBlockMapIsBlockLoaded(&table.Map, block))
+                {
+                    early_loads++;
+                }
+
+                if (!table.LoadRange(block, block) ||
+                    !AIMWrFltrBlockMapIsBlockLoaded(&table.Map, block) ||
+                    AIMWrFltrBlockMapGet(&table.Map, block) !=
+                    table.Disk[block])
+                {
+                    errors++;
+                }
+            }
+        }));
+    }
+
+    prefetch.join();
+
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        readers[i].join();
+    }
+
+    printf("%u lookups loaded their own leaf, %u reads\n",
+        (unsigned)early_loads, (unsigned)table.Reads);
+
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(table.Map.LoadedLeaves == Leaves);
+    IMTEST_CHECK(table.Map.AllocatedLeaves == populated);
+
+    // Directory and one block for each populated leaf
+    IMTEST_CHECK(BlockLoadTestOutstanding == (long)populated + 1);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestNotLoaded);
+    IMTEST_RUN(TestLoadLeaf);
+    IMTEST_RUN(TestLoadFailure);
+    IMTEST_RUN(TestLoadOnlyNeeded);
+    IMTEST_RUN(TestLookupsDuringPrefetch);
+
+    IMTEST_CHECK(BlockLoadTestOutstanding == 0);
+
+    return IMTEST_RESULT();
+}
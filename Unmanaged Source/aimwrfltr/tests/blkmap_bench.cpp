@@ -0,0 +1,165 @@
+/// blkmap_bench.cpp
+/// Memory use and lookup time of the two-level allocation table in
+/// fltblkmap.h compared to the flat table it replaced, for filtered volumes
+/// of 1 to 64 TB in DIFF_BLOCK_SIZE (64 KB) blocks. Memory is shown before
+/// any write and after 4 GB has been written, either in one sequential
+/// range or as scattered single blocks, which is close to worst case for
+/// the leaves. Lookups are at random blocks with the scattered writes in
+/// place. Flat table lookups are only timed where the table fits in memory
+/// of a small test machine, its size is shown for all volumes.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <fltblkmap.h>
+
+#include <vector>
+
+static const ULONG BenchBlockBits = 16;
+static const ULONGLONG BenchWrittenBlocks = (4ULL << 30) >> BenchBlockBits;
+static const ULONGLONG BenchFlatLimit = 512ULL << 20;
+static const int BenchLookups = 20000000;
+
+static double
+BenchMB(ULONGLONG Bytes)
+{
+    return Bytes / 1048576.0;
+}
+
+///
+/// Nanoseconds per lookup at random blocks.
+///
+static double
+BenchMapLookups(const AIMWRFLTR_BLOCK_MAP *Map, ULONGLONG Blocks)
+{
+    uint64_t state = 5;
+    LONG sum = 0;
+
+    double start = ImTestSeconds();
+
+    for (int i = 0; i < BenchLookups; i++)
+    {
+        sum += AIMWrFltrBlockMapGet(Map,
+            ((ULONGLONG)ImTestRandom(&state) << 16 ^ ImTestRandom(&state)) %
+            Blocks);
+    }
+
+    double seconds = ImTestSeconds() - start;
+
+    // Keep result used
+    if (sum == 1)
+    {
+        printf("\n");
+    }
+
+    return seconds * 1e9 / BenchLookups;
+}
+
+static double
+BenchFlatLookups(const LONG *Table, ULONGLONG Blocks)
+{
+    uint64_t state = 5;
+    LONG sum = 0;
+
+    double start = ImTestSeconds();
+
+    for (int i = 0; i < BenchLookups; i++)
+    {
+        ULONGLONG block =
+            ((ULONGLONG)ImTestRandom(&state) << 16 ^ ImTestRandom(&state)) %
+            Blocks;
+
+        // Same range check as the map does
+        sum += block < Blocks ? Table[block] : 0;
+    }
+
+    double seconds = ImTestSeconds() - start;
+
+    if (sum == 1)
+    {
+        printf("\n");
+    }
+
+    return seconds * 1e9 / BenchLookups;
+}
+
+int
+main()
+{
+    printf("%6s %12s %12s %12s %12s %12s %12s\n", "TB", "flat MB",
+        "empty MB", "seq 4G MB", "rand 4G MB", "flat ns", "map ns");
+
+    for (ULONGLONG tb = 1; tb <= 64; tb <<= 1)
+    {
+        ULONGLONG blocks = (tb << 40) >> BenchBlockBits;
+        ULONGLONG flat_size = blocks * sizeof(LONG);
+        AIMWRFLTR_BLOCK_MAP map = { };
+        uint64_t state = tb;
+
+        if (!AIMWrFltrBlockMapInitialize(&map, blocks, 1))
+        {
+            return 1;
+        }
+
+        ULONGLONG empty = AIMWrFltrBlockMapMemoryUsage(&map);
+
+        for (ULONGLONG i = 0; i < BenchWrittenBlocks; i++)
+        {
+            AIMWrFltrBlockMapSet(&map, blocks / 3 + i, (LONG)(i + 1));
+        }
+
+        ULONGLONG sequential = AIMWrFltrBlockMapMemoryUsage(&map);
+
+        AIMWrFltrBlockMapFree(&map);
+        AIMWrFltrBlockMapInitialize(&map, blocks, 1);
+
+        for (ULONGLONG i = 0; i < BenchWrittenBlocks; i++)
+        {
+            ULONGLONG block =
+                ((ULONGLONG)ImTestRandom(&state) << 16 ^ ImTestRandom(&state)) %
+                blocks;
+
+            AIMWrFltrBlockMapSet(&map, block, (LONG)(i + 1));
+        }
+
+        ULONGLONG scattered = AIMWrFltrBlockMapMemoryUsage(&map);
+
+        double map_ns = BenchMapLookups(&map, blocks);
+
+        printf("%6u %12.1f %12.3f %12.3f %12.1f", (unsigned)tb,
+            BenchMB(flat_size), BenchMB(empty), BenchMB(sequential),
+            BenchMB(scattered));
+
+        if (flat_size <= BenchFlatLimit)
+        {
+            std::vector<LONG> flat(blocks);
+            uint64_t flat_state = tb;
+
+            for (ULONGLONG i = 0; i < BenchWrittenBlocks; i++)
+            {
+                flat[((ULONGLONG)ImTestRandom(&flat_state) << 16 ^
+                    ImTestRandom(&flat_state)) % blocks] = (LONG)(i + 1);
+            }
+
+            printf(" %12.1f", BenchFlatLookups(flat.data(), blocks));
+        }
+        else
+        {
+            printf(" %12s", "-");
+        }
+
+        printf(" %12.1f\n", map_ns);
+
+        AIMWrFltrBlockMapFree(&map);
+    }
+
+    return 0;
+}
@@ -0,0 +1,434 @@
+/// blkmap_test.cpp
+/// Tests for the two-level diff block allocation table in fltblkmap.h.
+/// Checks directory sizing, that leaves are only allocated for ranges with
+/// allocated blocks, entries at leaf boundaries and at end of volume,
+/// allocation failures, random updates against a plain model, and threads
+/// creating the same leaves and looking up blocks while they are set.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <atomic>
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
+
+static std::atomic<long> BlockMapTestOutstanding(0);
+static std::atomic<long> BlockMapTestFailCountdown(0);
+
+///
+/// malloc that counts outstanding allocations and fails the allocation
+/// that BlockMapTestFailCountdown counts down to.
+///
+static void *
+BlockMapTestAllocate(size_t Size)
+{
+    if (BlockMapTestFailCountdown > 0 && --BlockMapTestFailCountdown == 0)
+    {
+        return NULL;
+    }
+
+    void *ptr = malloc(Size);
+
+    if (ptr != NULL)
+    {
+        BlockMapTestOutstanding++;
+    }
+
+    return ptr;
+}
+
+static void
+BlockMapTestFree(void *Ptr)
+{
+    BlockMapTestOutstanding--;
+    free(Ptr);
+}
+
+#define AIMWRFLTR_BLOCK_MAP_ALLOCATE(size) BlockMapTestAllocate(size)
+#define AIMWRFLTR_BLOCK_MAP_FREE(ptr) BlockMapTestFree(ptr)
+
+#include <fltblkmap.h>
+
+static const ULONGLONG LeafEntries = AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES;
+
+static void
+TestInitialize()
+{
+    AIMWRFLTR_BLOCK_MAP map = { };
+
+    IMTEST_CHECK(!AIMWrFltrBlockMapIsInitialized(&map));
+
+    // Empty volume still gets a directory
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, 0, 1));
+    IMTEST_CHECK(AIMWrFltrBlockMapIsInitialized(&map));
+    IMTEST_CHECK(map.DirectoryEntries == 1);
+    AIMWrFltrBlockMapFree(&map);
+    IMTEST_CHECK(!AIMWrFltrBlockMapIsInitialized(&map));
+
+    // Partial last leaf
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, 3 * LeafEntries + 1, 1));
+    IMTEST_CHECK(map.DirectoryEntries == 4);
+    AIMWrFltrBlockMapFree(&map);
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, 4 * LeafEntries, 1));
+    IMTEST_CHECK(map.DirectoryEntries == 4);
+    IMTEST_CHECK(map.AllocatedLeaves == 0);
+    IMTEST_CHECK(map.LoadedLeaves == 4);
+
+    // Only directory and leaf states before any block is allocated
+    IMTEST_CHECK(AIMWrFltrBlockMapMemoryUsage(&map) ==
+        4 * (sizeof(void*) + 1));
+    IMTEST_CHECK(BlockMapTestOutstanding == 1);
+
+    for (ULONGLONG block = 0; block < 4 * LeafEntries; block += 97)
+    {
+        IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, block) ==
+            AIMWRFLTR_BLOCK_MAP_UNALLOCATED);
+    }
+
+    AIMWrFltrBlockMapFree(&map);
+    IMTEST_CHECK(BlockMapTestOutstanding == 0);
+
+    // 64 TB volume in 64 KB blocks, directory is 64K pointers
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, 1ULL << 30, 1));
+    IMTEST_CHECK(map.DirectoryEntries == 65536);
+    AIMWrFltrBlockMapFree(&map);
+}
+
+static void
+TestLeafAllocation()
+{
+    AIMWRFLTR_BLOCK_MAP map = { };
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, 8 * LeafEntries, 1));
+
+    // Clearing a block in a range with no leaf does not create one
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&map, 5, AIMWRFLTR_BLOCK_MAP_UNALLOCATED));
+    IMTEST_CHECK(map.AllocatedLeaves == 0);
+    IMTEST_CHECK(AIMWrFltrBlockMapGetLeaf(&map, 0) == NULL);
+
+    // First and last entries of a leaf share it
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&map, 3 * LeafEntries, 11));
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&map, 4 * LeafEntries - 1, 12));
+    IMTEST_CHECK(map.AllocatedLeaves == 1);
+    IMTEST_CHECK(AIMWrFltrBlockMapGetLeaf(&map, 3) != NULL);
+    IMTEST_CHECK(AIMWrFltrBlockMapGetLeaf(&map, 2) == NULL);
+    IMTEST_CHECK(AIMWrFltrBlockMapGetLeaf(&map, 4) == NULL);
+
+    // Neighbours across leaf boundaries are not touched
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, 3 * LeafEntries - 1) == 0);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, 3 * LeafEntries) == 11);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, 3 * LeafEntries + 1) == 0);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, 4 * LeafEntries - 1) == 12);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, 4 * LeafEntries) == 0);
+
+    // Rest of a new leaf is zeroed
+    LONG volatile *leaf = AIMWrFltrBlockMapGetLeaf(&map, 3);
+    ULONG nonzero = 0;
+
+    for (ULONG i = 1; i < LeafEntries - 1; i++)
+    {
+        if (leaf[i] != 0)
+        {
+            nonzero++;
+        }
+    }
+
+    IMTEST_CHECK(nonzero == 0);
+
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&map, 4 * LeafEntries, 13));
+    IMTEST_CHECK(map.AllocatedLeaves == 2);
+    IMTEST_CHECK(AIMWrFltrBlockMapMemoryUsage(&map) ==
+        8 * (sizeof(void*) + 1) + 2 * AIMWRFLTR_BLOCK_MAP_LEAF_SIZE);
+
+    // Cleared entries keep their leaf
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&map, 3 * LeafEntries,
+        AIMWRFLTR_BLOCK_MAP_UNALLOCATED));
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, 3 * LeafEntries) == 0);
+    IMTEST_CHECK(map.AllocatedLeaves == 2);
+
+    // Creating an existing leaf returns it
+    IMTEST_CHECK(AIMWrFltrBlockMapCreateLeaf(&map, 3) == leaf);
+    IMTEST_CHECK(map.AllocatedLeaves == 2);
+
+    AIMWrFltrBlockMapFree(&map);
+    IMTEST_CHECK(BlockMapTestOutstanding == 0);
+}
+
+static void
+TestEndOfVolume()
+{
+    AIMWRFLTR_BLOCK_MAP map = { };
+    ULONGLONG blocks = 2 * LeafEntries + 100;
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, blocks, 1));
+
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&map, blocks - 1, 7));
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, blocks - 1) == 7);
+
+    // Past end of volume, also inside last leaf
+    IMTEST_CHECK(!AIMWrFltrBlockMapSet(&map, blocks, 8));
+    IMTEST_CHECK(!AIMWrFltrBlockMapSet(&map, 3 * LeafEntries, 8));
+    IMTEST_CHECK(!AIMWrFltrBlockMapSet(&map, ~0ULL, 8));
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, blocks) == 0);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, ~0ULL) == 0);
+    IMTEST_CHECK(AIMWrFltrBlockMapGetLeaf(&map, 3) == NULL);
+    IMTEST_CHECK(AIMWrFltrBlockMapCreateLeaf(&map, 3) == NULL);
+    IMTEST_CHECK(map.AllocatedLeaves == 1);
+
+    AIMWrFltrBlockMapFree(&map);
+}
+
+static void
+TestAllocationFailure()
+{
+    AIMWRFLTR_BLOCK_MAP map = { };
+
+    BlockMapTestFailCountdown = 1;
+    IMTEST_CHECK(!AIMWrFltrBlockMapInitialize(&map, 4 * LeafEntries, 1));
+    IMTEST_CHECK(!AIMWrFltrBlockMapIsInitialized(&map));
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, 4 * LeafEntries, 1));
+
+    // Failed leaf allocation leaves map as it was
+    BlockMapTestFailCountdown = 1;
+    IMTEST_CHECK(!AIMWrFltrBlockMapSet(&map, LeafEntries + 5, 9));
+    IMTEST_CHECK(map.AllocatedLeaves == 0);
+    IMTEST_CHECK(AIMWrFltrBlockMapGetLeaf(&map, 1) == NULL);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, LeafEntries + 5) == 0);
+
+    // and can be retried
+    IMTEST_CHECK(AIMWrFltrBlockMapSet(&map, LeafEntries + 5, 9));
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, LeafEntries + 5) == 9);
+
+    AIMWrFltrBlockMapFree(&map);
+    IMTEST_CHECK(BlockMapTestOutstanding == 0);
+}
+
+static void
+TestRandomAgainstModel()
+{
+    static const ULONGLONG Blocks = 37 * LeafEntries + 1234;
+
+    AIMWRFLTR_BLOCK_MAP map = { };
+    std::map<ULONGLONG, LONG> model;
+    std::set<ULONGLONG> written_leaves;
+    uint64_t state = 29;
+    ULONG errors = 0;
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, Blocks, 1));
+
+    for (int i = 0; i < 200000; i++)
+    {
+        // Clustered in a few leaves, as written parts of a volume are
+        ULONGLONG block = (ImTestRandom(&state) % 6) * 6 * LeafEntries +
+            ImTestRandom(&state) % (2 * LeafEntries);
+        LONG value = (ImTestRandom(&state) % 4) == 0 ?
+            AIMWRFLTR_BLOCK_MAP_UNALLOCATED :
+            (LONG)(1 + ImTestRandom(&state) % 0x7FFFFFFE);
+
+        if (block >= Blocks)
+        {
+            continue;
+        }
+
+        if (!AIMWrFltrBlockMapSet(&map, block, value))
+        {
+            errors++;
+        }
+
+        model[block] = value;
+
+        if (value != AIMWRFLTR_BLOCK_MAP_UNALLOCATED)
+        {
+            written_leaves.insert(block / LeafEntries);
+        }
+
+        ULONGLONG probe = ImTestRandom(&state) % Blocks;
+        std::map<ULONGLONG, LONG>::const_iterator it = model.find(probe);
+        LONG expected = it == model.end() ? 0 : it->second;
+
+        if (AIMWrFltrBlockMapGet(&map, probe) != expected)
+        {
+            errors++;
+        }
+    }
+
+    for (std::map<ULONGLONG, LONG>::const_iterator it = model.begin();
+        it != model.end(); ++it)
+    {
+        if (AIMWrFltrBlockMapGet(&map, it->first) != it->second)
+        {
+            errors++;
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+
+    // Leaves only where a block was allocated, two of every six
+    ULONG leaves = 0;
+
+    for (ULONG leaf = 0; leaf < map.DirectoryEntries; leaf++)
+    {
+        if ((AIMWrFltrBlockMapGetLeaf(&map, leaf) != NULL) !=
+            (written_leaves.count(leaf) != 0))
+        {
+            errors++;
+        }
+
+        if (AIMWrFltrBlockMapGetLeaf(&map, leaf) != NULL)
+        {
+            leaves++;
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(map.AllocatedLeaves == leaves);
+    IMTEST_CHECK(leaves == 12);
+
+    AIMWrFltrBlockMapFree(&map);
+    IMTEST_CHECK(BlockMapTestOutstanding == 0);
+}
+
+///
+/// Threads racing to create the same leaves all get the one that was
+/// published, and the others are freed.
+///
+static void
+TestConcurrentLeafCreation()
+{
+    static const int Threads = 8;
+    static const ULONG Leaves = 256;
+
+    AIMWRFLTR_BLOCK_MAP map = { };
+    std::vector<std::vector<LONG volatile*> > seen(Threads,
+        std::vector<LONG volatile*>(Leaves));
+    std::vector<std::thread> threads;
+    std::atomic<int> ready(0);
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, Leaves * LeafEntries, 1));
+
+    for (int t = 0; t < Threads; t++)
+    {
+        threads.push_back(std::thread([&map, &seen, &ready, t]()
+        {
+            ready++;
+
+            while (ready < Threads)
+            {
+            }
+
+            for (ULONG leaf = 0; leaf < Leaves; leaf++)
+            {
+                seen[t][leaf] = AIMWrFltrBlockMapCreateLeaf(&map, leaf);
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    ULONG errors = 0;
+
+    for (ULONG leaf = 0; leaf < Leaves; leaf++)
+    {
+        for (int t = 0; t < Threads; t++)
+        {
+            if (seen[t][leaf] == NULL ||
+                seen[t][leaf] != AIMWrFltrBlockMapGetLeaf(&map, leaf))
+            {
+                errors++;
+            }
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(map.AllocatedLeaves == Leaves);
+    IMTEST_CHECK(BlockMapTestOutstanding == (long)Leaves + 1);
+
+    AIMWrFltrBlockMapFree(&map);
+    IMTEST_CHECK(BlockMapTestOutstanding == 0);
+}
+
+///
+/// Lock-free lookups while one thread sets blocks. A lookup sees either no
+/// allocation or the value that was set, never anything else.
+///
+static void
+TestLookupWhileSetting()
+{
+    static const ULONGLONG Blocks = 64 * LeafEntries;
+
+    AIMWRFLTR_BLOCK_MAP map = { };
+    std::atomic<bool> done(false);
+    std::atomic<ULONG> errors(0);
+    std::vector<std::thread> readers;
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&map, Blocks, 1));
+
+    for (int r = 0; r < 3; r++)
+    {
+        readers.push_back(std::thread([&map, &done, &errors, r]()
+        {
+            uint64_t state = 100 + r;
+
+            while (!done)
+            {
+                ULONGLONG block = ImTestRandom(&state) % Blocks;
+                LONG value = AIMWrFltrBlockMapGet(&map, block);
+
+                if (value != 0 && value != (LONG)(block + 1))
+                {
+                    errors++;
+                }
+            }
+        }));
+    }
+
+    // Scattered, so that leaves are created while readers run
+    for (ULONGLONG i = 0; i < Blocks; i++)
+    {
+        ULONGLONG block = (i * 40503) % Blocks;
+
+        AIMWrFltrBlockMapSet(&map, block, (LONG)(block + 1));
+    }
+
+    done = true;
+
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        readers[i].join();
+    }
+
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(map.AllocatedLeaves == 64);
+    IMTEST_CHECK(AIMWrFltrBlockMapGet(&map, Blocks - 1) == (LONG)Blocks);
+
+    AIMWrFltrBlockMapFree(&map);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestInitialize);
+    IMTEST_RUN(TestLeafAllocation);
+    IMTEST_RUN(TestEndOfVolume);
+    IMTEST_RUN(TestAllocationFailure);
+    IMTEST_RUN(TestRandomAgainstModel);
+    IMTEST_RUN(TestConcurrentLeafCreation);
+    IMTEST_RUN(TestLookupWhileSetting);
+
+    return IMTEST_RESULT();
+}
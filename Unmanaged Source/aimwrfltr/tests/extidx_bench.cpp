@@ -0,0 +1,134 @@
+/// extidx_bench.cpp
+/// Time to find queued writes and trims overlapping a read, at queue depths
+/// of 16 to 65536. Compares walking the whole queue, as was done before the
+/// index, with a lookup in the interval treap in fltextidx.h. Queue holds
+/// 4 KB to 64 KB writes at random offsets in a 4 GB range, reads are
+/// 64 KB. Each round also removes oldest queued write and queues a new one,
+/// as when worker thread completes a request and another one arrives.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <fltextidx.h>
+
+#include <vector>
+
+static const LONGLONG BenchRangeBlocks = (4LL << 30) >> 12;
+static const LONGLONG BenchReadSize = 64 << 10;
+static const int BenchRounds = 200000;
+
+///
+/// Queues a new write in Node. Without index, queue is only a list.
+///
+static void
+BenchQueue(PAIMWRFLTR_EXTENT_INDEX Index, PAIMWRFLTR_EXTENT_NODE Node,
+    uint64_t *State)
+{
+    LONGLONG start = (LONGLONG)(ImTestRandom(State) % BenchRangeBlocks) << 12;
+    LONGLONG length = (LONGLONG)(1 + ImTestRandom(State) % 16) << 12;
+
+    if (Index != NULL)
+    {
+        AIMWrFltrExtentIndexRemove(Index, Node);
+        AIMWrFltrExtentIndexInsert(Index, Node, start, start + length);
+    }
+    else
+    {
+        Node->Start = start;
+        Node->End = start + length;
+    }
+}
+
+///
+/// Nanoseconds per read lookup, including queue update. Nodes are used as
+/// a ring, oldest first. Found is set to average overlaps per read.
+///
+static double
+BenchRun(ULONG Depth, bool UseIndex, double *Found)
+{
+    std::vector<AIMWRFLTR_EXTENT_NODE> nodes(Depth);
+    AIMWRFLTR_EXTENT_INDEX index;
+    uint64_t state = Depth;
+    ULONG oldest = 0;
+    ULONG found = 0;
+
+    AIMWrFltrExtentIndexInitialize(&index);
+
+    for (ULONG i = 0; i < Depth; i++)
+    {
+        BenchQueue(UseIndex ? &index : NULL, &nodes[i], &state);
+    }
+
+    int rounds = UseIndex ? BenchRounds : BenchRounds * 16 / (int)Depth + 100;
+
+    double start_time = ImTestSeconds();
+
+    for (int round = 0; round < rounds; round++)
+    {
+        LONGLONG start = (LONGLONG)(ImTestRandom(&state) % BenchRangeBlocks)
+            << 12;
+        LONGLONG end = start + BenchReadSize;
+
+        if (UseIndex)
+        {
+            for (PAIMWRFLTR_EXTENT_NODE node =
+                AIMWrFltrExtentIndexFind(&index, start, end);
+                node != NULL; node = node->Next)
+            {
+                found++;
+            }
+        }
+        else
+        {
+            // Queue order is oldest first from ring position
+            for (ULONG i = 0; i < Depth; i++)
+            {
+                const AIMWRFLTR_EXTENT_NODE *node =
+                    &nodes[(oldest + i) % Depth];
+
+                if (node->Start < end && node->End > start)
+                {
+                    found++;
+                }
+            }
+        }
+
+        BenchQueue(UseIndex ? &index : NULL, &nodes[oldest], &state);
+        oldest = (oldest + 1) % Depth;
+    }
+
+    double seconds = ImTestSeconds() - start_time;
+
+    *Found = (double)found / rounds;
+
+    return seconds * 1e9 / rounds;
+}
+
+int
+main()
+{
+    printf("%8s %14s %14s %10s\n", "depth", "list ns", "index ns",
+        "overlaps");
+
+    for (ULONG depth = 16; depth <= 65536; depth <<= 2)
+    {
+        double list_found;
+        double index_found;
+
+        double list_ns = BenchRun(depth, false, &list_found);
+        double index_ns = BenchRun(depth, true, &index_found);
+
+        printf("%8u %14.1f %14.1f %10.3f\n", (unsigned)depth, list_ns,
+            index_ns, index_found);
+    }
+
+    return 0;
+}
@@ -0,0 +1,452 @@
+/// extidx_test.cpp
+/// Tests for the interval treap of queued write and trim ranges in
+/// fltextidx.h. After every change the tree is checked for key order, heap
+/// order of priorities, parent links, subtree end offsets and node count.
+/// Overlap lookups are checked at range edges, for equal start offsets and
+/// for queue order of results, and random inserts, removals and lookups are
+/// compared against a plain list. Also checks tree depth for ranges
+/// inserted in offset order, as sequential writes are queued, and sorting
+/// of result lists.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <fltextidx.h>
+
+#include <algorithm>
+#include <vector>
+
+///
+/// Checks subtree under Node and returns number of nodes in it, or -1 if
+/// any rule is broken. Depth is set to height of subtree.
+///
+static long
+ExtentTestCheckSubtree(const AIMWRFLTR_EXTENT_NODE *Node,
+    const AIMWRFLTR_EXTENT_NODE *Parent, ULONG *Depth)
+{
+    ULONG left_depth = 0;
+    ULONG right_depth = 0;
+
+    *Depth = 0;
+
+    if (Node == NULL)
+    {
+        return 0;
+    }
+
+    if (Node->Parent != Parent || Node->Sequence == 0 ||
+        (Parent != NULL && Parent->Priority < Node->Priority))
+    {
+        return -1;
+    }
+
+    long left = ExtentTestCheckSubtree(Node->Left, Node, &left_depth);
+    long right = ExtentTestCheckSubtree(Node->Right, Node, &right_depth);
+
+    if (left < 0 || right < 0)
+    {
+        return -1;
+    }
+
+    LONGLONG max_end = Node->End;
+
+    if (Node->Left != NULL)
+    {
+        max_end = std::max(max_end, Node->Left->MaxEnd);
+    }
+
+    if (Node->Right != NULL)
+    {
+        max_end = std::max(max_end, Node->Right->MaxEnd);
+    }
+
+    if (Node->MaxEnd != max_end)
+    {
+        return -1;
+    }
+
+    *Depth = 1 + std::max(left_depth, right_depth);
+
+    return 1 + left + right;
+}
+
+///
+/// Key order is checked by walking nodes in order. Rotations may move nodes
+/// with equal start offsets to either side, but order between them must
+/// still follow sequence.
+///
+static bool
+ExtentTestCheck(const AIMWRFLTR_EXTENT_INDEX *Index, ULONG *Depth = NULL)
+{
+    ULONG depth;
+
+    if (Index->Root != NULL && Index->Root->Parent != NULL)
+    {
+        return false;
+    }
+
+    long count = ExtentTestCheckSubtree(Index->Root, NULL, &depth);
+
+    if (count < 0 || (ULONG)count != Index->Count)
+    {
+        return false;
+    }
+
+    std::vector<const AIMWRFLTR_EXTENT_NODE*> stack;
+    const AIMWRFLTR_EXTENT_NODE *node = Index->Root;
+    const AIMWRFLTR_EXTENT_NODE *previous = NULL;
+
+    while (node != NULL || !stack.empty())
+    {
+        while (node != NULL)
+        {
+            stack.push_back(node);
+            node = node->Left;
+        }
+
+        node = stack.back();
+        stack.pop_back();
+
+        // In order traversal follows offset, then sequence
+        if (previous != NULL && (previous->Start > node->Start ||
+            (previous->Start == node->Start &&
+            previous->Sequence > node->Sequence)))
+        {
+            return false;
+        }
+
+        previous = node;
+        node = node->Right;
+    }
+
+    if (Depth != NULL)
+    {
+        *Depth = depth;
+    }
+
+    return true;
+}
+
+static std::vector<const AIMWRFLTR_EXTENT_NODE*>
+ExtentTestFind(const AIMWRFLTR_EXTENT_INDEX *Index, LONGLONG Start,
+    LONGLONG End)
+{
+    std::vector<const AIMWRFLTR_EXTENT_NODE*> found;
+
+    for (const AIMWRFLTR_EXTENT_NODE *node =
+        AIMWrFltrExtentIndexFind(Index, Start, End);
+        node != NULL; node = node->Next)
+    {
+        found.push_back(node);
+    }
+
+    return found;
+}
+
+static void
+TestEmpty()
+{
+    AIMWRFLTR_EXTENT_INDEX index;
+    AIMWRFLTR_EXTENT_NODE node = { };
+
+    AIMWrFltrExtentIndexInitialize(&index);
+
+    IMTEST_CHECK(AIMWrFltrExtentIndexIsEmpty(&index));
+    IMTEST_CHECK(AIMWrFltrExtentIndexFind(&index, 0, 1LL << 40) == NULL);
+
+    // Removing a node not in index does nothing
+    IMTEST_CHECK(!AIMWrFltrExtentIndexContains(&node));
+    AIMWrFltrExtentIndexRemove(&index, &node);
+    IMTEST_CHECK(index.Count == 0);
+
+    AIMWrFltrExtentIndexInsert(&index, &node, 100, 200);
+    IMTEST_CHECK(AIMWrFltrExtentIndexContains(&node));
+    IMTEST_CHECK(!AIMWrFltrExtentIndexIsEmpty(&index));
+    IMTEST_CHECK(index.Root == &node && index.Count == 1);
+
+    AIMWrFltrExtentIndexRemove(&index, &node);
+    IMTEST_CHECK(!AIMWrFltrExtentIndexContains(&node));
+    IMTEST_CHECK(AIMWrFltrExtentIndexIsEmpty(&index));
+    IMTEST_CHECK(index.Count == 0);
+
+    // Twice is fine too
+    AIMWrFltrExtentIndexRemove(&index, &node);
+    IMTEST_CHECK(index.Count == 0);
+}
+
+static void
+TestOverlapEdges()
+{
+    AIMWRFLTR_EXTENT_INDEX index;
+    AIMWRFLTR_EXTENT_NODE node = { };
+
+    AIMWrFltrExtentIndexInitialize(&index);
+    AIMWrFltrExtentIndexInsert(&index, &node, 4096, 8192);
+
+    // Ranges touching but not overlapping
+    IMTEST_CHECK(ExtentTestFind(&index, 0, 4096).empty());
+    IMTEST_CHECK(ExtentTestFind(&index, 8192, 12288).empty());
+
+    // One byte in at either end
+    IMTEST_CHECK(ExtentTestFind(&index, 0, 4097).size() == 1);
+    IMTEST_CHECK(ExtentTestFind(&index, 8191, 12288).size() == 1);
+
+    // Inside and around
+    IMTEST_CHECK(ExtentTestFind(&index, 5000, 6000).size() == 1);
+    IMTEST_CHECK(ExtentTestFind(&index, 0, 1LL << 40).size() == 1);
+}
+
+static void
+TestQueueOrder()
+{
+    AIMWRFLTR_EXTENT_INDEX index;
+    AIMWRFLTR_EXTENT_NODE nodes[6] = { };
+
+    AIMWrFltrExtentIndexInitialize(&index);
+
+    // Later writes to same place, and a long trim queued in between
+    AIMWrFltrExtentIndexInsert(&index, &nodes[0], 8192, 12288);
+    AIMWrFltrExtentIndexInsert(&index, &nodes[1], 0, 65536);
+    AIMWrFltrExtentIndexInsert(&index, &nodes[2], 8192, 12288);
+    AIMWrFltrExtentIndexInsert(&index, &nodes[3], 4096, 8192);
+    AIMWrFltrExtentIndexInsert(&index, &nodes[4], 8192, 9216);
+    AIMWrFltrExtentIndexInsert(&index, &nodes[5], 65536, 131072);
+
+    IMTEST_CHECK(ExtentTestCheck(&index));
+
+    std::vector<const AIMWRFLTR_EXTENT_NODE*> found =
+        ExtentTestFind(&index, 8192, 9000);
+
+    // Oldest first, so that later writes are applied last
+    IMTEST_CHECK(found.size() == 4);
+    IMTEST_CHECK(found.size() == 4 && found[0] == &nodes[0] &&
+        found[1] == &nodes[1] && found[2] == &nodes[2] &&
+        found[3] == &nodes[4]);
+
+    AIMWrFltrExtentIndexRemove(&index, &nodes[1]);
+    IMTEST_CHECK(ExtentTestCheck(&index));
+
+    found = ExtentTestFind(&index, 0, 1 << 20);
+    IMTEST_CHECK(found.size() == 5);
+
+    for (size_t i = 1; i < found.size(); i++)
+    {
+        IMTEST_CHECK(found[i - 1]->Sequence < found[i]->Sequence);
+    }
+
+    // A node inserted again is newest
+    AIMWrFltrExtentIndexInsert(&index, &nodes[1], 8192, 8704);
+    found = ExtentTestFind(&index, 8192, 8193);
+    IMTEST_CHECK(!found.empty() && found.back() == &nodes[1]);
+    IMTEST_CHECK(ExtentTestCheck(&index));
+}
+
+///
+/// Random inserts, removals and lookups compared against a plain list of
+/// nodes in index.
+///
+static void
+TestRandomAgainstModel()
+{
+    static const size_t Nodes = 2000;
+
+    std::vector<AIMWRFLTR_EXTENT_NODE> nodes(Nodes);
+    std::vector<size_t> queued;
+    AIMWRFLTR_EXTENT_INDEX index;
+    uint64_t state = 43;
+    ULONG errors = 0;
+    ULONG check_errors = 0;
+
+    AIMWrFltrExtentIndexInitialize(&index);
+
+    for (int i = 0; i < 100000; i++)
+    {
+        ULONG op = ImTestRandom(&state) % 8;
+
+        if (op < 3 || queued.empty())
+        {
+            size_t n = ImTestRandom(&state) % Nodes;
+
+            if (!AIMWrFltrExtentIndexContains(&nodes[n]))
+            {
+                // 4 KB to 64 KB in a 16 MB range, some trims much longer
+                LONGLONG start = (LONGLONG)(ImTestRandom(&state) % 4096) << 12;
+                LONGLONG length = (op == 0) ?
+                    (LONGLONG)(1 + ImTestRandom(&state) % 256) << 16 :
+                    (LONGLONG)(1 + ImTestRandom(&state) % 16) << 12;
+
+                AIMWrFltrExtentIndexInsert(&index, &nodes[n], start,
+                    start + length);
+                queued.push_back(n);
+            }
+        }
+        else if (op < 5)
+        {
+            size_t q = ImTestRandom(&state) % queued.size();
+
+            AIMWrFltrExtentIndexRemove(&index, &nodes[queued[q]]);
+            queued.erase(queued.begin() + q);
+        }
+        else
+        {
+            LONGLONG start = (LONGLONG)(ImTestRandom(&state) % (17 << 12)) << 10;
+            LONGLONG end = start + 1 + ImTestRandom(&state) % (256 << 10);
+
+            std::vector<const AIMWRFLTR_EXTENT_NODE*> expected;
+
+            for (size_t q = 0; q < queued.size(); q++)
+            {
+                const AIMWRFLTR_EXTENT_NODE *node = &nodes[queued[q]];
+
+                if (node->Start < end && node->End > start)
+                {
+                    expected.push_back(node);
+                }
+            }
+
+            std::sort(expected.begin(), expected.end(),
+                [](const AIMWRFLTR_EXTENT_NODE *a,
+                    const AIMWRFLTR_EXTENT_NODE *b)
+            {
+                return a->Sequence < b->Sequence;
+            });
+
+            if (ExtentTestFind(&index, start, end) != expected)
+            {
+                errors++;
+            }
+        }
+
+        if (index.Count != queued.size())
+        {
+            errors++;
+        }
+
+        if (i % 97 == 0 && !ExtentTestCheck(&index))
+        {
+            check_errors++;
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(check_errors == 0);
+
+    while (!queued.empty())
+    {
+        AIMWrFltrExtentIndexRemove(&index, &nodes[queued.back()]);
+        queued.pop_back();
+    }
+
+    IMTEST_CHECK(AIMWrFltrExtentIndexIsEmpty(&index));
+    IMTEST_CHECK(index.Count == 0);
+}
+
+///
+/// Sequential writes are queued in offset order, which would make a plain
+/// binary tree a list.
+///
+static void
+TestDepth()
+{
+    static const size_t Nodes = 65536;
+
+    std::vector<AIMWRFLTR_EXTENT_NODE> nodes(Nodes);
+    AIMWRFLTR_EXTENT_INDEX index;
+    ULONG depth = 0;
+
+    AIMWrFltrExtentIndexInitialize(&index);
+
+    for (size_t i = 0; i < Nodes; i++)
+    {
+        AIMWrFltrExtentIndexInsert(&index, &nodes[i], (LONGLONG)i << 16,
+            (LONGLONG)(i + 1) << 16);
+    }
+
+    IMTEST_CHECK(ExtentTestCheck(&index, &depth));
+    printf("Depth with %u sequential ranges: %u\n", (unsigned)Nodes, depth);
+    IMTEST_CHECK(depth <= 64);
+
+    // Same start offset, as repeated writes to the same block
+    for (size_t i = 0; i < Nodes; i++)
+    {
+        AIMWrFltrExtentIndexRemove(&index, &nodes[i]);
+        AIMWrFltrExtentIndexInsert(&index, &nodes[i], 0, 65536);
+    }
+
+    IMTEST_CHECK(ExtentTestCheck(&index, &depth));
+    printf("Depth with %u equal ranges: %u\n", (unsigned)Nodes, depth);
+    IMTEST_CHECK(depth <= 64);
+
+    // Removed oldest first, as worker thread does
+    for (size_t i = 0; i < Nodes; i++)
+    {
+        AIMWrFltrExtentIndexRemove(&index, &nodes[i]);
+    }
+
+    IMTEST_CHECK(AIMWrFltrExtentIndexIsEmpty(&index));
+}
+
+static void
+TestSortList()
+{
+    std::vector<AIMWRFLTR_EXTENT_NODE> nodes(200);
+    uint64_t state = 47;
+    ULONG errors = 0;
+
+    IMTEST_CHECK(AIMWrFltrExtentIndexSortList(NULL) == NULL);
+
+    for (size_t length = 1; length <= nodes.size(); length++)
+    {
+        PAIMWRFLTR_EXTENT_NODE list = NULL;
+
+        for (size_t i = 0; i < length; i++)
+        {
+            nodes[i].Sequence = 1 + ImTestRandom(&state);
+            nodes[i].Next = list;
+            list = &nodes[i];
+        }
+
+        list = AIMWrFltrExtentIndexSortList(list);
+
+        size_t count = 0;
+
+        for (PAIMWRFLTR_EXTENT_NODE node = list; node != NULL;
+            node = node->Next)
+        {
+            if (node->Next != NULL && node->Next->Sequence < node->Sequence)
+            {
+                errors++;
+            }
+
+            count++;
+        }
+
+        if (count != length)
+        {
+            errors++;
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestEmpty);
+    IMTEST_RUN(TestOverlapEdges);
+    IMTEST_RUN(TestQueueOrder);
+    IMTEST_RUN(TestRandomAgainstModel);
+    IMTEST_RUN(TestDepth);
+    IMTEST_RUN(TestSortList);
+
+    return IMTEST_RESULT();
+}
@@ -0,0 +1,400 @@
+/// pipeline_bench.cpp
+/// Replays a write trace through the dispatch loop of
+/// AIMWrFltrDeviceWorkerThread with the rules in fltpipeline.h, with slot
+/// threads created on demand up to a limit. Limit 0 runs every request on
+/// worker thread, as before the pipeline. Device I/O is simulated with a
+/// fixed latency per request, and any number of them can be in flight.
+/// Each write to a new block does two fill reads first, unless the block
+/// gets a sector map. Trace has 5000 writes, a quarter of them to 64 hot
+/// blocks, some spanning two blocks and some flush requests. A second
+/// trace only writes to one block, where no more than one slot is useful.
+/// Checks that each block ends up with the last write to it in queue order.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <fltpipeline.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const int BenchRequests = 5000;
+static const ULONG BenchBlocks = 65536;
+
+struct BenchRequest
+{
+    bool HasBlocks;
+    LONGLONG FirstBlock;
+    LONGLONG LastBlock;
+    int Sequence;
+};
+
+struct BenchEvent
+{
+    std::mutex Mutex;
+    std::condition_variable Condition;
+    bool Signaled;
+
+    BenchEvent() : Signaled(false)
+    {
+    }
+
+    void Set()
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Signaled = true;
+        Condition.notify_one();
+    }
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        Condition.wait(lock, [this] { return Signaled; });
+        Signaled = false;
+    }
+};
+
+struct BenchDevice
+{
+    int LatencyUs;
+    bool SectorMaps;
+
+    std::vector<char> Allocated;
+    std::vector<int> LastWrite;
+    std::atomic<int> OrderErrors;
+
+    BenchDevice(int LatencyUs, bool SectorMaps) :
+        LatencyUs(LatencyUs), SectorMaps(SectorMaps),
+        Allocated(BenchBlocks + 1), LastWrite(BenchBlocks + 1, -1),
+        OrderErrors(0)
+    {
+    }
+
+    void Io()
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(LatencyUs));
+    }
+
+    void Process(const BenchRequest *Request)
+    {
+        if (!Request->HasBlocks)
+        {
+            Io();
+            return;
+        }
+
+        for (LONGLONG block = Request->FirstBlock;
+            block <= Request->LastBlock; block++)
+        {
+            if (!Allocated[block])
+            {
+                Allocated[block] = 1;
+
+                if (!SectorMaps)
+                {
+                    Io();
+                    Io();
+                }
+            }
+
+            Io();
+
+            if (LastWrite[block] > Request->Sequence)
+            {
+                OrderErrors++;
+            }
+
+            LastWrite[block] = Request->Sequence;
+        }
+    }
+};
+
+struct BenchSlot
+{
+    BenchEvent Start;
+    const BenchRequest *Request;
+    LONGLONG FirstBlock;
+    LONGLONG LastBlock;
+    std::atomic<bool> Done;
+    bool Exit;
+    std::thread Thread;
+
+    BenchSlot() : Request(NULL), FirstBlock(0), LastBlock(0), Done(false),
+        Exit(false)
+    {
+    }
+};
+
+///
+/// Returns requests per second. SlotsCreated is set to number of slot
+/// threads started.
+///
+static double
+BenchReplay(const std::vector<BenchRequest> &Trace, BenchDevice *Device,
+    ULONG SlotLimit, ULONG *SlotsCreated)
+{
+    std::list<const BenchRequest*> queue;
+    std::vector<BenchSlot*> slots;
+    BenchEvent done_event;
+    ULONG busy_slots = 0;
+
+    for (size_t i = 0; i < Trace.size(); i++)
+    {
+        queue.push_back(&Trace[i]);
+    }
+
+    double start = ImTestSeconds();
+
+    for (;;)
+    {
+        bool progress = false;
+
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (slots[i]->Request != NULL && slots[i]->Done.exchange(false))
+            {
+                queue.remove(slots[i]->Request);
+                slots[i]->Request = NULL;
+                --busy_slots;
+                progress = true;
+            }
+        }
+
+        AIMWRFLTR_PIPELINE_SCAN scan;
+        ULONG started_slots = 0;
+        bool need_slot = false;
+
+        AIMWrFltrPipelineScanInitialize(&scan);
+
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (slots[i]->Request != NULL)
+            {
+                AIMWrFltrPipelineScanAddBusy(&scan, slots[i]->FirstBlock,
+                    slots[i]->LastBlock);
+            }
+        }
+
+        for (std::list<const BenchRequest*>::iterator it = queue.begin();
+            it != queue.end(); ++it)
+        {
+            size_t free_slot = slots.size();
+            bool in_progress = false;
+
+            for (size_t i = 0; i < slots.size(); i++)
+            {
+                if (slots[i]->Request == *it)
+                {
+                    in_progress = true;
+                }
+                else if (slots[i]->Request == NULL && free_slot == slots.size())
+                {
+                    free_slot = i;
+                }
+            }
+
+            if (in_progress)
+            {
+                continue;
+            }
+
+            ULONG action = AIMWrFltrPipelineCheckRequest(&scan,
+                (*it)->HasBlocks, (*it)->FirstBlock, (*it)->LastBlock);
+
+            if (action == AIMWRFLTR_PIPELINE_WAIT)
+            {
+                continue;
+            }
+
+            if (action == AIMWRFLTR_PIPELINE_STOP)
+            {
+                break;
+            }
+
+            if (free_slot == slots.size())
+            {
+                need_slot = slots.size() < SlotLimit;
+                break;
+            }
+
+            slots[free_slot]->Request = *it;
+            slots[free_slot]->FirstBlock = (*it)->FirstBlock;
+            slots[free_slot]->LastBlock = (*it)->LastBlock;
+
+            AIMWrFltrPipelineScanAddBusy(&scan, (*it)->FirstBlock,
+                (*it)->LastBlock);
+
+            started_slots |= 1UL << free_slot;
+            ++busy_slots;
+        }
+
+        const BenchRequest *run_here = NULL;
+
+        if (busy_slots == 0 && !queue.empty() && !need_slot)
+        {
+            run_here = queue.front();
+        }
+
+        if (need_slot)
+        {
+            BenchSlot *slot = new BenchSlot;
+
+            slot->Thread = std::thread([slot, Device, &done_event]
+            {
+                for (;;)
+                {
+                    slot->Start.Wait();
+
+                    if (slot->Exit)
+                    {
+                        break;
+                    }
+
+                    Device->Process(slot->Request);
+
+                    slot->Done = true;
+
+                    done_event.Set();
+                }
+            });
+
+            slots.push_back(slot);
+            progress = true;
+        }
+
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (started_slots & (1UL << i))
+            {
+                slots[i]->Start.Set();
+                progress = true;
+            }
+        }
+
+        if (queue.empty())
+        {
+            break;
+        }
+
+        if (run_here != NULL)
+        {
+            Device->Process(run_here);
+            queue.pop_front();
+            continue;
+        }
+
+        if (!progress)
+        {
+            done_event.Wait();
+        }
+    }
+
+    double seconds = ImTestSeconds() - start;
+
+    *SlotsCreated = (ULONG)slots.size();
+
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        slots[i]->Exit = true;
+        slots[i]->Start.Set();
+        slots[i]->Thread.join();
+        delete slots[i];
+    }
+
+    return Trace.size() / seconds;
+}
+
+int
+main()
+{
+    std::vector<BenchRequest> trace(BenchRequests);
+    uint64_t state = 71;
+
+    for (int i = 0; i < BenchRequests; i++)
+    {
+        BenchRequest &request = trace[i];
+
+        request.Sequence = i;
+        request.HasBlocks = ImTestRandom(&state) % 500 != 0;
+        request.FirstBlock = ImTestRandom(&state) % 4 == 0 ?
+            ImTestRandom(&state) % 64 : ImTestRandom(&state) % (BenchBlocks - 1);
+        request.LastBlock = request.FirstBlock +
+            (ImTestRandom(&state) % 8 == 0 ? 1 : 0);
+    }
+
+    // Last write to each block in queue order
+    std::vector<int> expected(BenchBlocks + 1, -1);
+
+    for (int i = 0; i < BenchRequests; i++)
+    {
+        if (trace[i].HasBlocks)
+        {
+            for (LONGLONG block = trace[i].FirstBlock;
+                block <= trace[i].LastBlock; block++)
+            {
+                expected[block] = i;
+            }
+        }
+    }
+
+    printf("%-12s %8s %6s %10s %8s\n", "new blocks", "latency", "limit",
+        "req/s", "slots");
+
+    for (int sector_maps = 0; sector_maps < 2; sector_maps++)
+    {
+        for (int latency = 50; latency <= 200; latency *= 4)
+        {
+            for (ULONG limit = 0; limit <= AIMWRFLTR_PIPELINE_SLOTS;
+                limit = limit == 0 ? 1 : limit * 2)
+            {
+                BenchDevice device(latency, sector_maps != 0);
+                ULONG slots_created;
+
+                double rate = BenchReplay(trace, &device, limit,
+                    &slots_created);
+
+                printf("%-12s %6d us %6u %10.0f %8u%s\n",
+                    sector_maps ? "sector map" : "fill reads", latency,
+                    (unsigned)limit, rate, (unsigned)slots_created,
+                    device.OrderErrors == 0 && device.LastWrite == expected ?
+                    "" : "  ORDER ERROR");
+            }
+        }
+    }
+
+    std::vector<BenchRequest> one_block(1000);
+
+    for (size_t i = 0; i < one_block.size(); i++)
+    {
+        one_block[i].Sequence = (int)i;
+        one_block[i].HasBlocks = true;
+        one_block[i].FirstBlock = 0;
+        one_block[i].LastBlock = 0;
+    }
+
+    BenchDevice device(50, true);
+    ULONG slots_created;
+
+    double rate = BenchReplay(one_block, &device, AIMWRFLTR_PIPELINE_SLOTS,
+        &slots_created);
+
+    printf("%-12s %6d us %6u %10.0f %8u%s\n", "one block", 50,
+        (unsigned)AIMWRFLTR_PIPELINE_SLOTS, rate, (unsigned)slots_created,
+        device.OrderErrors == 0 && device.LastWrite[0] == 999 ?
+        "" : "  ORDER ERROR");
+
+    return 0;
+}
@@ -0,0 +1,421 @@
+/// pipeline_test.cpp
+/// Tests for the rules in fltpipeline.h that decide which queued requests
+/// worker thread starts in pipeline slots. Checks single decisions for
+/// requests for busy blocks, requests for blocks of earlier waiting
+/// requests, requests spanning two blocks, requests without blocks, all
+/// slots busy and too many waiting requests. Then runs the dispatch loop of
+/// AIMWrFltrDeviceWorkerThread over random queues, with requests done in
+/// random order, new requests arriving while others run and a slot limit
+/// as when slots cannot be created. Checks that requests touching the same
+/// block never run at the same time and start in queue order, that requests
+/// without blocks run alone after everything before them, and that the
+/// queue always drains.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <fltpipeline.h>
+
+#include <list>
+#include <vector>
+
+static ULONG
+PipelineTestCheck(PAIMWRFLTR_PIPELINE_SCAN Scan, LONGLONG FirstBlock,
+    LONGLONG LastBlock)
+{
+    ULONG action = AIMWrFltrPipelineCheckRequest(Scan, 1, FirstBlock,
+        LastBlock);
+
+    if (action == AIMWRFLTR_PIPELINE_START)
+    {
+        AIMWrFltrPipelineScanAddBusy(Scan, FirstBlock, LastBlock);
+    }
+
+    return action;
+}
+
+static void
+TestBusyBlocks()
+{
+    AIMWRFLTR_PIPELINE_SCAN scan;
+
+    AIMWrFltrPipelineScanInitialize(&scan);
+    AIMWrFltrPipelineScanAddBusy(&scan, 10, 10);
+
+    // Same block waits, other blocks can pass it
+    IMTEST_CHECK(PipelineTestCheck(&scan, 10, 10) == AIMWRFLTR_PIPELINE_WAIT);
+    IMTEST_CHECK(PipelineTestCheck(&scan, 11, 11) == AIMWRFLTR_PIPELINE_START);
+    IMTEST_CHECK(PipelineTestCheck(&scan, 9, 9) == AIMWRFLTR_PIPELINE_START);
+
+    // Spanning into a busy block at either end
+    IMTEST_CHECK(PipelineTestCheck(&scan, 8, 9) == AIMWRFLTR_PIPELINE_WAIT);
+    IMTEST_CHECK(PipelineTestCheck(&scan, 11, 12) == AIMWRFLTR_PIPELINE_WAIT);
+    IMTEST_CHECK(PipelineTestCheck(&scan, 0, 100) == AIMWRFLTR_PIPELINE_WAIT);
+
+    IMTEST_CHECK(PipelineTestCheck(&scan, 12, 13) == AIMWRFLTR_PIPELINE_WAIT);
+    IMTEST_CHECK(scan.NumberOfBusy == 3);
+    IMTEST_CHECK(scan.NumberOfWaiting == 5);
+}
+
+static void
+TestWaitingBlocks()
+{
+    AIMWRFLTR_PIPELINE_SCAN scan;
+
+    AIMWrFltrPipelineScanInitialize(&scan);
+    AIMWrFltrPipelineScanAddBusy(&scan, 1, 1);
+
+    // Block 1 is busy, so this waits, and so does everything after it for
+    // blocks 1 and 2, although block 2 is not busy
+    IMTEST_CHECK(PipelineTestCheck(&scan, 1, 2) == AIMWRFLTR_PIPELINE_WAIT);
+    IMTEST_CHECK(PipelineTestCheck(&scan, 2, 2) == AIMWRFLTR_PIPELINE_WAIT);
+
+    // And now everything for block 3 too
+    IMTEST_CHECK(PipelineTestCheck(&scan, 2, 3) == AIMWRFLTR_PIPELINE_WAIT);
+    IMTEST_CHECK(PipelineTestCheck(&scan, 3, 3) == AIMWRFLTR_PIPELINE_WAIT);
+
+    IMTEST_CHECK(PipelineTestCheck(&scan, 4, 4) == AIMWRFLTR_PIPELINE_START);
+}
+
+static void
+TestStop()
+{
+    AIMWRFLTR_PIPELINE_SCAN scan;
+
+    // Requests without blocks
+    AIMWrFltrPipelineScanInitialize(&scan);
+    IMTEST_CHECK(AIMWrFltrPipelineCheckRequest(&scan, 0, 0, 0) ==
+        AIMWRFLTR_PIPELINE_STOP);
+
+    // All slots busy
+    AIMWrFltrPipelineScanInitialize(&scan);
+
+    for (ULONG i = 0; i < AIMWRFLTR_PIPELINE_SLOTS; i++)
+    {
+        IMTEST_CHECK(PipelineTestCheck(&scan, i, i) == AIMWRFLTR_PIPELINE_START);
+    }
+
+    IMTEST_CHECK(PipelineTestCheck(&scan, 1000, 1000) == AIMWRFLTR_PIPELINE_STOP);
+    IMTEST_CHECK(scan.NumberOfWaiting == 0);
+
+    // Waiting list full. A conflicting request stops scan, since it could
+    // not be remembered, others can still start.
+    AIMWrFltrPipelineScanInitialize(&scan);
+    AIMWrFltrPipelineScanAddBusy(&scan, 0, 0);
+
+    for (ULONG i = 0; i < AIMWRFLTR_PIPELINE_SLOTS; i++)
+    {
+        IMTEST_CHECK(PipelineTestCheck(&scan, 0, 0) == AIMWRFLTR_PIPELINE_WAIT);
+    }
+
+    IMTEST_CHECK(PipelineTestCheck(&scan, 0, 0) == AIMWRFLTR_PIPELINE_STOP);
+    IMTEST_CHECK(PipelineTestCheck(&scan, 5, 5) == AIMWRFLTR_PIPELINE_START);
+}
+
+struct PipelineTestRequest
+{
+    bool HasBlocks;
+    LONGLONG FirstBlock;
+    LONGLONG LastBlock;
+
+    bool Started;
+    bool Done;
+};
+
+struct PipelineTestResult
+{
+    ULONG Violations;
+    ULONG Deadlocks;
+    ULONG MaxBusy;
+    ULONG Passed;
+};
+
+static bool
+PipelineTestOverlaps(const PipelineTestRequest &A, const PipelineTestRequest &B)
+{
+    return !A.HasBlocks || !B.HasBlocks ||
+        (A.FirstBlock <= B.LastBlock && A.LastBlock >= B.FirstBlock);
+}
+
+///
+/// Checks that request Index may start now: nothing before it in queue
+/// that touches its blocks is unfinished, nothing running touches them,
+/// and requests without blocks are alone.
+///
+static bool
+PipelineTestMayStart(const std::vector<PipelineTestRequest> &Requests,
+    size_t Index, bool *Passed)
+{
+    for (size_t i = 0; i < Requests.size(); i++)
+    {
+        if (i == Index || Requests[i].Done || !Requests[i].Started)
+        {
+            continue;
+        }
+
+        // Running at the same time
+        if (PipelineTestOverlaps(Requests[i], Requests[Index]))
+        {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < Index; i++)
+    {
+        if (Requests[i].Done)
+        {
+            continue;
+        }
+
+        if (PipelineTestOverlaps(Requests[i], Requests[Index]))
+        {
+            return false;
+        }
+
+        *Passed = true;
+    }
+
+    return true;
+}
+
+///
+/// Same steps as dispatch loop in AIMWrFltrDeviceWorkerThread, with slots
+/// created on demand up to SlotLimit. Slots finish in random order.
+///
+static void
+PipelineTestRun(ULONG Requests, ULONG Blocks, ULONG SlotLimit,
+    uint64_t *State, PipelineTestResult *Result)
+{
+    std::vector<PipelineTestRequest> requests;
+    std::list<size_t> queue;
+    std::vector<size_t> slots;
+    std::vector<LONGLONG> slot_first;
+    std::vector<LONGLONG> slot_last;
+    ULONG busy_slots = 0;
+    ULONG idle_rounds = 0;
+
+    requests.reserve(Requests);
+
+    while (requests.size() < Requests || !queue.empty())
+    {
+        // New requests arrive while others run
+        for (ULONG i = ImTestRandom(State) % 4;
+            i > 0 && requests.size() < Requests; i--)
+        {
+            PipelineTestRequest request = { };
+
+            request.HasBlocks = ImTestRandom(State) % 50 != 0;
+            request.FirstBlock = ImTestRandom(State) % Blocks;
+            request.LastBlock = request.FirstBlock +
+                (ImTestRandom(State) % 6 == 0 ? 1 : 0);
+
+            queue.push_back(requests.size());
+            requests.push_back(request);
+        }
+
+        // Some slots finish
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (slots[i] != (size_t)-1 && ImTestRandom(State) % 3 == 0)
+            {
+                requests[slots[i]].Done = true;
+                queue.remove(slots[i]);
+                slots[i] = (size_t)-1;
+                --busy_slots;
+            }
+        }
+
+        AIMWRFLTR_PIPELINE_SCAN scan;
+        bool need_slot = false;
+        bool progress = false;
+
+        AIMWrFltrPipelineScanInitialize(&scan);
+
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (slots[i] != (size_t)-1)
+            {
+                AIMWrFltrPipelineScanAddBusy(&scan, slot_first[i],
+                    slot_last[i]);
+            }
+        }
+
+        for (std::list<size_t>::iterator it = queue.begin();
+            it != queue.end(); ++it)
+        {
+            size_t free_slot = slots.size();
+            bool in_progress = false;
+
+            for (size_t i = 0; i < slots.size(); i++)
+            {
+                if (slots[i] == *it)
+                {
+                    in_progress = true;
+                }
+                else if (slots[i] == (size_t)-1 && free_slot == slots.size())
+                {
+                    free_slot = i;
+                }
+            }
+
+            if (in_progress)
+            {
+                continue;
+            }
+
+            PipelineTestRequest &request = requests[*it];
+
+            ULONG action = AIMWrFltrPipelineCheckRequest(&scan,
+                request.HasBlocks, request.FirstBlock, request.LastBlock);
+
+            if (action == AIMWRFLTR_PIPELINE_WAIT)
+            {
+                continue;
+            }
+
+            if (action == AIMWRFLTR_PIPELINE_STOP)
+            {
+                break;
+            }
+
+            if (free_slot == slots.size())
+            {
+                need_slot = slots.size() < SlotLimit;
+                break;
+            }
+
+            bool passed = false;
+
+            if (!PipelineTestMayStart(requests, *it, &passed))
+            {
+                Result->Violations++;
+            }
+
+            if (passed)
+            {
+                Result->Passed++;
+            }
+
+            slots[free_slot] = *it;
+            slot_first[free_slot] = request.FirstBlock;
+            slot_last[free_slot] = request.LastBlock;
+            request.Started = true;
+
+            AIMWrFltrPipelineScanAddBusy(&scan, request.FirstBlock,
+                request.LastBlock);
+
+            ++busy_slots;
+            progress = true;
+        }
+
+        if (busy_slots > Result->MaxBusy)
+        {
+            Result->MaxBusy = busy_slots;
+        }
+
+        if (need_slot)
+        {
+            slots.push_back((size_t)-1);
+            slot_first.push_back(0);
+            slot_last.push_back(0);
+            progress = true;
+        }
+        else if (busy_slots == 0 && !queue.empty())
+        {
+            // Runs on worker thread and is done before next scan
+            size_t here = queue.front();
+            bool passed = false;
+
+            if (requests[here].Started ||
+                !PipelineTestMayStart(requests, here, &passed) || passed)
+            {
+                Result->Violations++;
+            }
+
+            requests[here].Started = true;
+            requests[here].Done = true;
+            queue.pop_front();
+            progress = true;
+        }
+
+        // Nothing can happen without a slot finishing
+        if (!progress && busy_slots == 0 && requests.size() == Requests &&
+            !queue.empty())
+        {
+            Result->Deadlocks++;
+            return;
+        }
+
+        idle_rounds = progress ? 0 : idle_rounds + 1;
+
+        if (idle_rounds > 10000)
+        {
+            Result->Deadlocks++;
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        if (!requests[i].Done)
+        {
+            Result->Deadlocks++;
+            return;
+        }
+    }
+}
+
+static void
+TestRandomQueues()
+{
+    uint64_t state = 67;
+    ULONG runs = 0;
+
+    for (ULONG slot_limit = 0; slot_limit <= AIMWRFLTR_PIPELINE_SLOTS;
+        slot_limit++)
+    {
+        for (ULONG blocks = 1; blocks <= 4096; blocks *= 8)
+        {
+            PipelineTestResult result = { };
+
+            for (int i = 0; i < 40; i++)
+            {
+                PipelineTestRun(500, blocks, slot_limit, &state, &result);
+                runs++;
+            }
+
+            IMTEST_CHECK(result.Violations == 0);
+            IMTEST_CHECK(result.Deadlocks == 0);
+            IMTEST_CHECK(result.MaxBusy <= slot_limit);
+
+            // With enough blocks to spread over, requests run side by side
+            // and pass waiting ones
+            if (slot_limit > 1 && blocks >= 64)
+            {
+                IMTEST_CHECK(result.MaxBusy == slot_limit);
+                IMTEST_CHECK(result.Passed > 0);
+            }
+        }
+    }
+
+    printf("%u random queues\n", (unsigned)runs);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestBusyBlocks);
+    IMTEST_RUN(TestWaitingBlocks);
+    IMTEST_RUN(TestStop);
+    IMTEST_RUN(TestRandomQueues);
+
+    return IMTEST_RESULT();
+}
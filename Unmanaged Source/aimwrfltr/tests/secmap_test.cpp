@@ -0,0 +1,639 @@
+/// secmap_test.cpp
+/// Tests for the sector maps of partially written diff blocks in
+/// fltsecmap.h. A diff block is written and read the same way as
+/// AIMWrFltrDeferredWrite, AIMWrFltrReadPartialBlock and the read path in
+/// read.cpp do, with diff device sector sizes of 512 and 4096 bytes, and
+/// every read is compared against a plain copy of the block with all
+/// writes applied. Also checks that sector aligned writes to new blocks
+/// need no fill reads, run lengths at edges of sectors and of the block,
+/// rounding of unaligned ranges, and that maps are stored in the block map
+/// the way AIMWrFltrSetSectorMap stores them.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <fltsecmap.h>
+#include <fltblkmap.h>
+
+#include <bitset>
+#include <vector>
+
+static const ULONG SecMapTestBlockSize = AIMWRFLTR_SECTOR_MAP_BLOCK_SIZE;
+static const ULONG SecMapTestSectorSize = AIMWRFLTR_SECTOR_MAP_SECTOR_SIZE;
+
+///
+/// One diff block, with original volume data for the same range.
+///
+struct SecMapTestBlock
+{
+    // Sector size of diff device minus one
+    ULONG AlignmentMask;
+
+    bool Allocated;
+    bool Partial;
+    AIMWRFLTR_SECTOR_MAP Map;
+
+    std::vector<UCHAR> Original;
+    std::vector<UCHAR> Diff;
+
+    // What the block should read as
+    std::vector<UCHAR> Expected;
+
+    ULONG FillReads;
+};
+
+static void
+SecMapTestInitialize(SecMapTestBlock *Block, ULONG DiffSectorSize,
+    uint64_t *State)
+{
+    Block->AlignmentMask = DiffSectorSize - 1;
+    Block->Allocated = false;
+    Block->Partial = false;
+    Block->FillReads = 0;
+
+    Block->Original.resize(SecMapTestBlockSize);
+    Block->Diff.assign(SecMapTestBlockSize, 0xEE);
+
+    for (ULONG i = 0; i < SecMapTestBlockSize; i++)
+    {
+        Block->Original[i] = (UCHAR)ImTestRandom(State);
+    }
+
+    Block->Expected = Block->Original;
+}
+
+///
+/// Reads Length bytes at Offset of a partial block into Buffer at same
+/// offset. Same as AIMWrFltrReadPartialBlock: runs on diff device are read
+/// aligned to its sector size first, then runs missing from diff block are
+/// read from original volume over anything read for alignment.
+///
+static void
+SecMapTestReadPartial(const SecMapTestBlock *Block, UCHAR *Buffer,
+    ULONG Offset, ULONG Length)
+{
+    ULONG end = Offset + Length;
+    ULONG run_length;
+
+    for (ULONG position = Offset; position < end; position += run_length)
+    {
+        if (AIMWrFltrSectorMapGetRun(&Block->Map, position, end - position,
+            &run_length))
+        {
+            continue;
+        }
+
+        ULONG aligned_position = position & ~Block->AlignmentMask;
+        ULONG aligned_length = (position - aligned_position + run_length +
+            Block->AlignmentMask) & ~Block->AlignmentMask;
+
+        if (aligned_position + aligned_length > SecMapTestBlockSize)
+        {
+            aligned_length = SecMapTestBlockSize - aligned_position;
+        }
+
+        memcpy(Buffer + aligned_position, &Block->Diff[aligned_position],
+            aligned_length);
+    }
+
+    for (ULONG position = Offset; position < end; position += run_length)
+    {
+        if (!AIMWrFltrSectorMapGetRun(&Block->Map, position, end - position,
+            &run_length))
+        {
+            continue;
+        }
+
+        memcpy(Buffer + position, &Block->Original[position], run_length);
+    }
+}
+
+///
+/// Writes Length bytes at Offset, which are sector aligned for the
+/// volume, in the same steps as AIMWrFltrDeferredWrite.
+///
+static void
+SecMapTestWrite(SecMapTestBlock *Block, ULONG Offset, ULONG Length,
+    const UCHAR *Data)
+{
+    std::vector<UCHAR> buffer(SecMapTestBlockSize, 0xCC);
+    ULONG mask = Block->AlignmentMask;
+
+    memcpy(&Block->Expected[Offset], Data, Length);
+
+    if (Block->Allocated && ((Offset & mask) != 0 || (Length & mask) != 0))
+    {
+        ULONG new_offset = Offset & ~mask;
+        ULONG new_length = ((Offset - new_offset) + Length + mask) & ~mask;
+
+        if (Block->Partial)
+        {
+            SecMapTestReadPartial(Block, buffer.data(), new_offset,
+                new_length);
+        }
+        else
+        {
+            memcpy(&buffer[new_offset], &Block->Diff[new_offset], new_length);
+        }
+
+        memcpy(&buffer[Offset], Data, Length);
+
+        Offset = new_offset;
+        Length = new_length;
+    }
+    else
+    {
+        memcpy(&buffer[Offset], Data, Length);
+    }
+
+    if (!Block->Allocated)
+    {
+        Block->Allocated = true;
+
+        if (Length < SecMapTestBlockSize && (Offset & mask) == 0 &&
+            (Length & mask) == 0)
+        {
+            AIMWrFltrSectorMapInitialize(&Block->Map, Offset, Length);
+            Block->Partial = true;
+        }
+        else if (Length < SecMapTestBlockSize)
+        {
+            // Fill up from original volume
+            memcpy(buffer.data(), Block->Original.data(), Offset);
+            memcpy(&buffer[Offset + Length], &Block->Original[Offset + Length],
+                SecMapTestBlockSize - Offset - Length);
+
+            Block->FillReads += (Offset > 0) + (Offset + Length < SecMapTestBlockSize);
+
+            Offset = 0;
+            Length = SecMapTestBlockSize;
+        }
+    }
+
+    memcpy(&Block->Diff[Offset], &buffer[Offset], Length);
+
+    if (Block->Partial)
+    {
+        AIMWrFltrSectorMapSetPresent(&Block->Map, Offset, Length);
+    }
+}
+
+///
+/// Reads Length bytes at Offset the way read.cpp does for an allocated
+/// block, one run of sectors in same state at a time.
+///
+static void
+SecMapTestRead(const SecMapTestBlock *Block, UCHAR *Buffer, ULONG Offset,
+    ULONG Length)
+{
+    ULONG done = 0;
+
+    while (done < Length)
+    {
+        ULONG position = Offset + done;
+        ULONG run_length = Length - done;
+        int missing = 0;
+
+        if (Block->Partial && !AIMWrFltrSectorMapIsComplete(&Block->Map))
+        {
+            missing = AIMWrFltrSectorMapGetRun(&Block->Map, position,
+                run_length, &run_length);
+        }
+
+        memcpy(Buffer + done, missing ? &Block->Original[position] :
+            &Block->Diff[position], run_length);
+
+        done += run_length;
+    }
+}
+
+static void
+TestInitialize()
+{
+    AIMWRFLTR_SECTOR_MAP map;
+
+    memset(&map, 0, sizeof(map));
+    IMTEST_CHECK(AIMWrFltrSectorMapIsComplete(&map));
+
+    // Nothing written
+    AIMWrFltrSectorMapInitialize(&map, 0, 0);
+    IMTEST_CHECK(!AIMWrFltrSectorMapIsComplete(&map));
+
+    for (ULONG i = 0; i < AIMWRFLTR_SECTOR_MAP_SECTORS; i++)
+    {
+        IMTEST_CHECK(AIMWrFltrSectorMapIsMissing(&map, i));
+    }
+
+    // Whole block
+    AIMWrFltrSectorMapInitialize(&map, 0, SecMapTestBlockSize);
+    IMTEST_CHECK(AIMWrFltrSectorMapIsComplete(&map));
+
+    // Only last sector missing
+    AIMWrFltrSectorMapInitialize(&map, 0,
+        SecMapTestBlockSize - SecMapTestSectorSize);
+    IMTEST_CHECK(!AIMWrFltrSectorMapIsComplete(&map));
+    IMTEST_CHECK(AIMWrFltrSectorMapIsMissing(&map,
+        AIMWRFLTR_SECTOR_MAP_SECTORS - 1));
+    IMTEST_CHECK(!AIMWrFltrSectorMapIsMissing(&map,
+        AIMWRFLTR_SECTOR_MAP_SECTORS - 2));
+
+    AIMWrFltrSectorMapSetPresent(&map,
+        SecMapTestBlockSize - SecMapTestSectorSize, SecMapTestSectorSize);
+    IMTEST_CHECK(AIMWrFltrSectorMapIsComplete(&map));
+}
+
+static void
+TestRounding()
+{
+    AIMWRFLTR_SECTOR_MAP map;
+
+    // One byte in middle of a sector marks whole sector
+    AIMWrFltrSectorMapInitialize(&map, 5 * SecMapTestSectorSize + 100, 1);
+    IMTEST_CHECK(AIMWrFltrSectorMapIsMissing(&map, 4));
+    IMTEST_CHECK(!AIMWrFltrSectorMapIsMissing(&map, 5));
+    IMTEST_CHECK(AIMWrFltrSectorMapIsMissing(&map, 6));
+
+    // Crossing a sector boundary marks both
+    AIMWrFltrSectorMapInitialize(&map, 8 * SecMapTestSectorSize - 1, 2);
+    IMTEST_CHECK(AIMWrFltrSectorMapIsMissing(&map, 6));
+    IMTEST_CHECK(!AIMWrFltrSectorMapIsMissing(&map, 7));
+    IMTEST_CHECK(!AIMWrFltrSectorMapIsMissing(&map, 8));
+    IMTEST_CHECK(AIMWrFltrSectorMapIsMissing(&map, 9));
+
+    // Ranges past end of block are cut at end, and words past the last
+    // sector are never touched
+    AIMWRFLTR_SECTOR_MAP maps[2];
+
+    AIMWrFltrSectorMapInitialize(&maps[1], 0, 0);
+    AIMWrFltrSectorMapInitialize(&maps[0], SecMapTestBlockSize -
+        SecMapTestSectorSize, 4 * SecMapTestSectorSize);
+    IMTEST_CHECK(!AIMWrFltrSectorMapIsMissing(&maps[0],
+        AIMWRFLTR_SECTOR_MAP_SECTORS - 1));
+
+    for (ULONG i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+    {
+        IMTEST_CHECK(maps[1].Missing[i] == 0xFFFFFFFFUL);
+    }
+}
+
+static void
+TestRuns()
+{
+    AIMWRFLTR_SECTOR_MAP map;
+    ULONG run;
+
+    // Sectors 32 up to 64 present, crossing no word boundary, and sector 100
+    AIMWrFltrSectorMapInitialize(&map, 32 * SecMapTestSectorSize,
+        32 * SecMapTestSectorSize);
+    AIMWrFltrSectorMapSetPresent(&map, 100 * SecMapTestSectorSize,
+        SecMapTestSectorSize);
+
+    IMTEST_CHECK(AIMWrFltrSectorMapGetRun(&map, 0, SecMapTestBlockSize, &run));
+    IMTEST_CHECK(run == 32 * SecMapTestSectorSize);
+
+    // Starting inside a sector
+    IMTEST_CHECK(AIMWrFltrSectorMapGetRun(&map, 100, SecMapTestBlockSize - 100,
+        &run));
+    IMTEST_CHECK(run == 32 * SecMapTestSectorSize - 100);
+
+    IMTEST_CHECK(!AIMWrFltrSectorMapGetRun(&map, 32 * SecMapTestSectorSize,
+        SecMapTestBlockSize - 32 * SecMapTestSectorSize, &run));
+    IMTEST_CHECK(run == 32 * SecMapTestSectorSize);
+
+    // Run cut at requested length, also inside a sector
+    IMTEST_CHECK(!AIMWrFltrSectorMapGetRun(&map, 40 * SecMapTestSectorSize,
+        7, &run));
+    IMTEST_CHECK(run == 7);
+
+    IMTEST_CHECK(!AIMWrFltrSectorMapGetRun(&map, 100 * SecMapTestSectorSize + 1,
+        SecMapTestBlockSize - 100 * SecMapTestSectorSize - 1, &run));
+    IMTEST_CHECK(run == SecMapTestSectorSize - 1);
+
+    // Last run ends at end of block
+    IMTEST_CHECK(AIMWrFltrSectorMapGetRun(&map, 101 * SecMapTestSectorSize,
+        SecMapTestBlockSize - 101 * SecMapTestSectorSize, &run));
+    IMTEST_CHECK(run == SecMapTestBlockSize - 101 * SecMapTestSectorSize);
+
+    IMTEST_CHECK(AIMWrFltrSectorMapGetRun(&map, SecMapTestBlockSize - 1, 1,
+        &run));
+    IMTEST_CHECK(run == 1);
+}
+
+///
+/// Random maps, run lengths checked against sector states.
+///
+static void
+TestRandomRuns()
+{
+    uint64_t state = 53;
+    ULONG errors = 0;
+
+    for (int i = 0; i < 20000; i++)
+    {
+        AIMWRFLTR_SECTOR_MAP map;
+        std::bitset<AIMWRFLTR_SECTOR_MAP_SECTORS> present;
+
+        AIMWrFltrSectorMapInitialize(&map, 0, 0);
+
+        for (ULONG j = ImTestRandom(&state) % 8; j > 0; j--)
+        {
+            ULONG sector = ImTestRandom(&state) % AIMWRFLTR_SECTOR_MAP_SECTORS;
+            ULONG count = 1 + ImTestRandom(&state) %
+                (AIMWRFLTR_SECTOR_MAP_SECTORS - sector);
+
+            AIMWrFltrSectorMapSetPresent(&map,
+                sector * SecMapTestSectorSize, count * SecMapTestSectorSize);
+
+            for (ULONG k = sector; k < sector + count; k++)
+            {
+                present.set(k);
+            }
+        }
+
+        for (ULONG k = 0; k < AIMWRFLTR_SECTOR_MAP_SECTORS; k++)
+        {
+            if (AIMWrFltrSectorMapIsMissing(&map, k) == present.test(k))
+            {
+                errors++;
+            }
+        }
+
+        if ((AIMWrFltrSectorMapIsComplete(&map) != 0) != present.all())
+        {
+            errors++;
+        }
+
+        ULONG offset = ImTestRandom(&state) % SecMapTestBlockSize;
+        ULONG length = 1 + ImTestRandom(&state) % (SecMapTestBlockSize - offset);
+        ULONG run;
+
+        int missing = AIMWrFltrSectorMapGetRun(&map, offset, length, &run);
+
+        if (run == 0 || run > length)
+        {
+            errors++;
+            continue;
+        }
+
+        // Every byte of run in same state, and next byte different unless
+        // at end of requested range
+        for (ULONG k = offset; k < offset + run; k++)
+        {
+            if (present.test(k / SecMapTestSectorSize) == (missing != 0))
+            {
+                errors++;
+                break;
+            }
+        }
+
+        if (run < length &&
+            present.test((offset + run) / SecMapTestSectorSize) != (missing != 0))
+        {
+            errors++;
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+///
+/// Random sequences of writes and reads on one block, compared to a plain
+/// copy of the block.
+///
+static void
+TestAgainstModel(ULONG DiffSectorSize)
+{
+    uint64_t state = 59 + DiffSectorSize;
+    ULONG errors = 0;
+    ULONG partial_blocks = 0;
+    ULONG aligned_new_blocks = 0;
+    ULONG fill_errors = 0;
+
+    for (int i = 0; i < 3000; i++)
+    {
+        SecMapTestBlock block;
+        std::vector<UCHAR> data(SecMapTestBlockSize);
+        std::vector<UCHAR> buffer(SecMapTestBlockSize);
+
+        SecMapTestInitialize(&block, DiffSectorSize, &state);
+
+        for (int op = 0; op < 16; op++)
+        {
+            if (ImTestRandom(&state) % 3 != 0)
+            {
+                // Volume sector aligned writes, mostly small
+                ULONG sectors = AIMWRFLTR_SECTOR_MAP_SECTORS;
+                ULONG sector = ImTestRandom(&state) % sectors;
+                ULONG count = 1 + ImTestRandom(&state) %
+                    std::min<ULONG>(ImTestRandom(&state) % 2 ? 16 : sectors,
+                        sectors - sector);
+
+                // Half of them aligned to 4 KB, as most file system writes
+                if (ImTestRandom(&state) % 2)
+                {
+                    sector &= ~7UL;
+                    count = std::min<ULONG>((count + 7) & ~7UL,
+                        sectors - sector);
+                }
+
+                for (ULONG k = 0; k < count * SecMapTestSectorSize; k++)
+                {
+                    data[k] = (UCHAR)ImTestRandom(&state);
+                }
+
+                bool new_aligned = !block.Allocated &&
+                    ((sector * SecMapTestSectorSize) & block.AlignmentMask) == 0 &&
+                    ((count * SecMapTestSectorSize) & block.AlignmentMask) == 0;
+
+                SecMapTestWrite(&block, sector * SecMapTestSectorSize,
+                    count * SecMapTestSectorSize, data.data());
+
+                if (new_aligned)
+                {
+                    aligned_new_blocks++;
+
+                    if (block.FillReads != 0)
+                    {
+                        fill_errors++;
+                    }
+                }
+
+                // Written sectors are present
+                if (block.Partial &&
+                    AIMWrFltrSectorMapIsMissing(&block.Map, sector))
+                {
+                    errors++;
+                }
+            }
+            else if (block.Allocated)
+            {
+                // Reads can start and end anywhere
+                ULONG offset = ImTestRandom(&state) % SecMapTestBlockSize;
+                ULONG length = 1 + ImTestRandom(&state) %
+                    (SecMapTestBlockSize - offset);
+
+                SecMapTestRead(&block, buffer.data(), offset, length);
+
+                if (memcmp(buffer.data(), &block.Expected[offset], length) != 0)
+                {
+                    errors++;
+                }
+
+                if (block.Partial)
+                {
+                    memset(buffer.data(), 0xCC, SecMapTestBlockSize);
+
+                    SecMapTestReadPartial(&block, buffer.data(), offset,
+                        length);
+
+                    if (memcmp(&buffer[offset], &block.Expected[offset],
+                        length) != 0)
+                    {
+                        errors++;
+                    }
+                }
+            }
+        }
+
+        if (block.Partial)
+        {
+            partial_blocks++;
+        }
+
+        if (block.Allocated)
+        {
+            SecMapTestRead(&block, buffer.data(), 0, SecMapTestBlockSize);
+
+            if (buffer != block.Expected)
+            {
+                errors++;
+            }
+        }
+    }
+
+    printf("Diff sector size %u: %u partial blocks\n",
+        (unsigned)DiffSectorSize, (unsigned)partial_blocks);
+
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(fill_errors == 0);
+    IMTEST_CHECK(aligned_new_blocks > 0);
+    IMTEST_CHECK(partial_blocks > 0);
+}
+
+static void
+TestAgainstModel512()
+{
+    TestAgainstModel(512);
+}
+
+static void
+TestAgainstModel4096()
+{
+    TestAgainstModel(4096);
+}
+
+///
+/// Maps stored in a block map as AIMWrFltrSetSectorMap and
+/// AIMWrFltrGetSectorMap do, AIMWRFLTR_SECTOR_MAP_WORDS entries per diff
+/// block.
+///
+static void
+TestBlockMapStorage()
+{
+    static const ULONG Blocks = 3 * AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES /
+        AIMWRFLTR_SECTOR_MAP_WORDS;
+
+    AIMWRFLTR_BLOCK_MAP maps = { };
+    std::vector<AIMWRFLTR_SECTOR_MAP> expected(Blocks);
+    uint64_t state = 61;
+    ULONG errors = 0;
+
+    // Words of a map never end up in two leaves
+    IMTEST_CHECK(AIMWRFLTR_BLOCK_MAP_LEAF_ENTRIES %
+        AIMWRFLTR_SECTOR_MAP_WORDS == 0);
+
+    IMTEST_CHECK(AIMWrFltrBlockMapInitialize(&maps,
+        (ULONGLONG)Blocks * AIMWRFLTR_SECTOR_MAP_WORDS, 1));
+
+    for (ULONG block = 0; block < Blocks; block++)
+    {
+        if (ImTestRandom(&state) % 4 != 0)
+        {
+            memset(&expected[block], 0, sizeof(expected[block]));
+            continue;
+        }
+
+        ULONG sector = ImTestRandom(&state) % AIMWRFLTR_SECTOR_MAP_SECTORS;
+
+        // Some with all bits set in a word, stored as -1
+        AIMWrFltrSectorMapInitialize(&expected[block],
+            sector * SecMapTestSectorSize, (1 + ImTestRandom(&state) % 4) *
+            SecMapTestSectorSize);
+
+        for (ULONG i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+        {
+            if (!AIMWrFltrBlockMapSet(&maps,
+                (ULONGLONG)block * AIMWRFLTR_SECTOR_MAP_WORDS + i,
+                (LONG)expected[block].Missing[i]))
+            {
+                errors++;
+            }
+        }
+    }
+
+    for (ULONG block = 0; block < Blocks; block++)
+    {
+        AIMWRFLTR_SECTOR_MAP map;
+
+        for (ULONG i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+        {
+            map.Missing[i] = (ULONG)AIMWrFltrBlockMapGet(&maps,
+                (ULONGLONG)block * AIMWRFLTR_SECTOR_MAP_WORDS + i);
+        }
+
+        if (memcmp(&map, &expected[block], sizeof(map)) != 0)
+        {
+            errors++;
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+
+    // Blocks without a map read back as complete
+    AIMWRFLTR_SECTOR_MAP map;
+
+    AIMWrFltrBlockMapFree(&maps);
+    AIMWrFltrBlockMapInitialize(&maps,
+        (ULONGLONG)Blocks * AIMWRFLTR_SECTOR_MAP_WORDS, 1);
+
+    for (ULONG i = 0; i < AIMWRFLTR_SECTOR_MAP_WORDS; i++)
+    {
+        map.Missing[i] = (ULONG)AIMWrFltrBlockMapGet(&maps, i);
+    }
+
+    IMTEST_CHECK(AIMWrFltrSectorMapIsComplete(&map));
+
+    AIMWrFltrBlockMapFree(&maps);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestInitialize);
+    IMTEST_RUN(TestRounding);
+    IMTEST_RUN(TestRuns);
+    IMTEST_RUN(TestRandomRuns);
+    IMTEST_RUN(TestAgainstModel512);
+    IMTEST_RUN(TestAgainstModel4096);
+    IMTEST_RUN(TestBlockMapStorage);
+
+    return IMTEST_RESULT();
+}
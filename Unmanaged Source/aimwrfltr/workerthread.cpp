@@ -1,7 +1,7 @@
 
 /// workerthread.c
 /// AIM Write Filter - Worker thread.
-/// 
+///
 /// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
 /// This source code and API are available under the terms of the Affero General Public
 /// License v3.
@@ -15,6 +15,360 @@
 
 #include <common.h>
 
+//
+// Gets first and last volume block that a queued request reads or writes.
+// Returns false for requests that need all requests before them in queue
+// to be done before they start, and that all requests after them need to
+// wait for. These are flush requests, forwarded requests and requests that
+// do not have a byte range.
+//
+bool
+AIMWrFltrGetQueuedRequestBlocks(PCACHED_IRP CachedIrp,
+    PLONGLONG FirstBlock,
+    PLONGLONG LastBlock)
+{
+    if (CachedIrp->DeviceObject != NULL)
+    {
+        return false;
+    }
+
+    PIO_STACK_LOCATION io_stack = &CachedIrp->IoStack;
+
+    LONGLONG offset;
+    LONGLONG length;
+
+    switch (io_stack->MajorFunction)
+    {
+    case IRP_MJ_READ:
+        offset = io_stack->Parameters.Read.ByteOffset.QuadPart;
+        length = io_stack->Parameters.Read.Length;
+        break;
+
+    case IRP_MJ_WRITE:
+        offset = io_stack->Parameters.Write.ByteOffset.QuadPart;
+        length = io_stack->Parameters.Write.Length;
+        break;
+
+    default:
+        // Trims are indexed by the range from their first to their last
+        // byte. Other requests are not.
+        if (!AIMWrFltrExtentIndexContains(&CachedIrp->ExtentNode))
+        {
+            return false;
+        }
+
+        offset = CachedIrp->ExtentNode.Start;
+        length = CachedIrp->ExtentNode.End - CachedIrp->ExtentNode.Start;
+    }
+
+    if (offset < 0 || length < 0)
+    {
+        return false;
+    }
+
+    *FirstBlock = DIFF_GET_BLOCK_NUMBER(offset);
+    *LastBlock = length > 0 ?
+        DIFF_GET_BLOCK_NUMBER(offset + length - 1) : *FirstBlock;
+
+    return true;
+}
+
+//
+// Runs a queued request and completes original IRP, if any. Called from
+// worker thread or from a pipeline slot thread.
+//
+VOID
+AIMWrFltrProcessQueuedRequest(PDEVICE_EXTENSION DeviceExtension,
+    PCACHED_IRP CachedIrp,
+    PUCHAR BlockBuffer)
+{
+    if (DeviceExtension->ShutdownThread &&
+        (DeviceExtension->DiffFileObject->Flags & FO_DELETE_ON_CLOSE) != 0)
+    {
+        if (CachedIrp->Irp != NULL)
+        {
+            AIMWrFltrHandleRemovedDevice(CachedIrp->Irp);
+        }
+
+        return;
+    }
+
+    if (CachedIrp->DeviceObject != NULL && CachedIrp->Irp != NULL)
+    {
+        IoCallDriver(CachedIrp->DeviceObject, CachedIrp->Irp);
+
+        return;
+    }
+
+    NTSTATUS status;
+    PIO_STACK_LOCATION io_stack = &CachedIrp->IoStack;
+
+    switch (io_stack->MajorFunction)
+    {
+    case IRP_MJ_READ:
+        status = AIMWrFltrDeferredRead(DeviceExtension, CachedIrp->Irp, BlockBuffer);
+        break;
+
+    case IRP_MJ_WRITE:
+        status = AIMWrFltrDeferredWrite(DeviceExtension, CachedIrp, BlockBuffer);
+
+        if (!NT_SUCCESS(status) &&
+            CachedIrp->Irp == NULL)
+        {
+#if DBG
+            if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
+                DbgBreakPoint();
+#endif
+
+            DeviceExtension->Statistics.DelayWriteFailed = TRUE;
+
+            DbgPrint(__FUNCTION__ ": Delayed write failed: 0x%X\n",
+                status);
+
+            if (AIMWrFltrDiffFullEvent != NULL)
+            {
+                KePulseEvent(AIMWrFltrDiffFullEvent, 0, FALSE);
+            }
+        }
+
+        break;
+
+    case IRP_MJ_FLUSH_BUFFERS:
+        status = AIMWrFltrDeferredFlushBuffers(DeviceExtension, CachedIrp);
+        break;
+
+    case IRP_MJ_DEVICE_CONTROL:
+        switch (io_stack->Parameters.DeviceIoControl.IoControlCode)
+        {
+#ifdef FSCTL_FILE_LEVEL_TRIM
+        case IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES:
+            status = AIMWrFltrDeferredManageDataSetAttributes(DeviceExtension, CachedIrp,
+                BlockBuffer);
+
+            if (status == STATUS_INVALID_DEVICE_REQUEST)
+            {
+                DeviceExtension->TrimNotSupported = TRUE;
+            }
+
+            break;
+#endif
+
+        default:
+            status = STATUS_INTERNAL_ERROR;
+            KdPrint((__FUNCTION__ ": Internal error.\n"));
+
+#if DBG
+            if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
+                DbgBreakPoint();
+#endif
+
+#pragma warning(suppress: 4065)
+        }
+
+        break;
+
+    default:
+        status = STATUS_INTERNAL_ERROR;
+        KdPrint((__FUNCTION__ ": Internal error.\n"));
+
+#if DBG
+        if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
+            DbgBreakPoint();
+#endif
+    }
+
+    if (CachedIrp->Irp != NULL)
+    {
+        CachedIrp->Irp->IoStatus.Status = status;
+        IoCompleteRequest(CachedIrp->Irp, IO_NO_INCREMENT);
+    }
+    else if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Delayed 0x%X failed: 0x%X\n",
+            (int)io_stack->MajorFunction,
+            status);
+
+        DeviceExtension->Statistics.LastErrorCode = status;
+    }
+}
+
+//
+// Removes a request that is done from queue. Queued writes stay in queue
+// until here, so that reads find their data in queue until it is on diff
+// device.
+//
+VOID
+AIMWrFltrRetireQueuedRequest(PDEVICE_EXTENSION DeviceExtension,
+    PCACHED_IRP CachedIrp)
+{
+    KLOCK_QUEUE_HANDLE lock_handle = { 0 };
+
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    IoReleaseRemoveLock(&DeviceExtension->RemoveLock, CachedIrp);
+
+    AIMWrFltrAcquireLock(&DeviceExtension->ListLock, &lock_handle,
+        lowest_assumed_irql);
+
+    RemoveEntryList(&CachedIrp->ListEntry);
+
+    AIMWrFltrExtentIndexRemove(&DeviceExtension->QueuedExtents,
+        &CachedIrp->ExtentNode);
+
+    delete CachedIrp;
+
+    AIMWrFltrReleaseLock(&lock_handle, &lowest_assumed_irql);
+}
+
+VOID
+AIMWrFltrWorkerPipelineThread(PVOID Context)
+{
+    PWORKER_PIPELINE_SLOT slot = (PWORKER_PIPELINE_SLOT)Context;
+
+    for (;;)
+    {
+        KeWaitForSingleObject(&slot->StartEvent, Executive, KernelMode,
+            FALSE, NULL);
+
+        if (slot->Exit)
+        {
+            break;
+        }
+
+        AIMWrFltrProcessQueuedRequest(slot->DeviceExtension, slot->Request,
+            slot->BlockBuffer);
+
+        InterlockedExchange(&slot->Done, TRUE);
+
+        KeSetEvent(slot->DoneEvent, 0, FALSE);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+//
+// Creates an empty pipeline. Slots are added by
+// AIMWrFltrAddWorkerPipelineSlot when needed. Returns NULL if memory
+// allocation failed, then worker thread runs all requests itself.
+//
+PWORKER_PIPELINE
+AIMWrFltrStartWorkerPipeline(PDEVICE_EXTENSION DeviceExtension)
+{
+    UNREFERENCED_PARAMETER(DeviceExtension);
+
+    PWORKER_PIPELINE pipeline = new WORKER_PIPELINE;
+
+    if (pipeline == NULL)
+    {
+        return NULL;
+    }
+
+    KeInitializeEvent(&pipeline->DoneEvent, SynchronizationEvent, FALSE);
+
+    pipeline->NumberOfSlots = 0;
+    pipeline->SlotLimit = WORKER_PIPELINE_SLOTS;
+
+    return pipeline;
+}
+
+//
+// Creates a new slot with a thread and block buffer. Returns NULL if no
+// more slots can be created. Then slot limit is lowered, so that worker
+// thread does not try again until slots are freed.
+//
+PWORKER_PIPELINE_SLOT
+AIMWrFltrAddWorkerPipelineSlot(PDEVICE_EXTENSION DeviceExtension,
+    PWORKER_PIPELINE Pipeline)
+{
+    if (Pipeline->NumberOfSlots >= Pipeline->SlotLimit)
+    {
+        return NULL;
+    }
+
+    PWORKER_PIPELINE_SLOT slot = &Pipeline->Slots[Pipeline->NumberOfSlots];
+
+    slot->DeviceExtension = DeviceExtension;
+    slot->DoneEvent = &Pipeline->DoneEvent;
+    slot->Request = NULL;
+    slot->Done = FALSE;
+    slot->Exit = false;
+
+    KeInitializeEvent(&slot->StartEvent, SynchronizationEvent, FALSE);
+
+    slot->BlockBuffer = new UCHAR[DIFF_BLOCK_SIZE];
+
+    if (slot->BlockBuffer == NULL)
+    {
+        Pipeline->SlotLimit = Pipeline->NumberOfSlots;
+        return NULL;
+    }
+
+    NTSTATUS status = PsCreateSystemThread(
+        &slot->Thread,
+        (ACCESS_MASK)0L,
+        NULL,
+        NULL,
+        NULL,
+        AIMWrFltrWorkerPipelineThread,
+        slot);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Cannot start pipeline thread for %p: 0x%X\n",
+            DeviceExtension->DeviceObject, status);
+
+        delete[] slot->BlockBuffer;
+        slot->BlockBuffer = NULL;
+
+        Pipeline->SlotLimit = Pipeline->NumberOfSlots;
+        return NULL;
+    }
+
+    ++Pipeline->NumberOfSlots;
+
+    KdPrint((__FUNCTION__ ": Device %p pipeline has %u slots\n",
+        DeviceExtension->DeviceObject, Pipeline->NumberOfSlots));
+
+    return slot;
+}
+
+//
+// Stops slot threads and frees their block buffers. All slots need to be
+// free.
+//
+VOID
+AIMWrFltrStopWorkerPipelineSlots(PWORKER_PIPELINE Pipeline)
+{
+    for (ULONG i = 0; i < Pipeline->NumberOfSlots; i++)
+    {
+        PWORKER_PIPELINE_SLOT slot = &Pipeline->Slots[i];
+
+        slot->Exit = true;
+
+        KeSetEvent(&slot->StartEvent, 0, FALSE);
+
+        ZwWaitForSingleObject(slot->Thread, FALSE, NULL);
+        ZwClose(slot->Thread);
+
+        delete[] slot->BlockBuffer;
+        slot->BlockBuffer = NULL;
+    }
+
+    Pipeline->NumberOfSlots = 0;
+    Pipeline->SlotLimit = WORKER_PIPELINE_SLOTS;
+}
+
+//
+// Stops slot threads and frees pipeline. All slots need to be free.
+//
+VOID
+AIMWrFltrStopWorkerPipeline(PWORKER_PIPELINE Pipeline)
+{
+    AIMWrFltrStopWorkerPipelineSlots(Pipeline);
+
+    delete Pipeline;
+}
+
 void
 AIMWrFltrDeviceWorkerThread(PVOID Context)
 {
@@ -32,7 +386,13 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
         return;
     }
 
-    PLIST_ENTRY request = &device_extension->ListHead;
+    // Requests for different blocks run in pipeline slots at the same time.
+    // Requests start in queue order, except that a request can start
+    // before earlier requests for other blocks that are still waiting. See
+    // fltpipeline.h for the rules.
+    PWORKER_PIPELINE pipeline = AIMWrFltrStartWorkerPipeline(device_extension);
+
+    ULONG busy_slots = 0;
 
     KLOCK_QUEUE_HANDLE lock_handle = { 0 };
 
@@ -40,24 +400,158 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
 
     for (;;)
     {
+        bool progress = false;
+
+        ULONG number_of_slots = pipeline != NULL ? pipeline->NumberOfSlots : 0;
+
+        // Remove requests done in pipeline slots from queue
+        for (ULONG i = 0; i < number_of_slots; i++)
+        {
+            PWORKER_PIPELINE_SLOT slot = &pipeline->Slots[i];
+
+            if (slot->Request != NULL &&
+                InterlockedExchange(&slot->Done, FALSE))
+            {
+                AIMWrFltrRetireQueuedRequest(device_extension, slot->Request);
+
+                slot->Request = NULL;
+
+                --busy_slots;
+
+                progress = true;
+            }
+        }
+
+        AIMWRFLTR_PIPELINE_SCAN scan;
+
+        AIMWrFltrPipelineScanInitialize(&scan);
+
+        for (ULONG i = 0; i < number_of_slots; i++)
+        {
+            if (pipeline->Slots[i].Request != NULL)
+            {
+                AIMWrFltrPipelineScanAddBusy(&scan,
+                    pipeline->Slots[i].FirstBlock, pipeline->Slots[i].LastBlock);
+            }
+        }
+
+        // Bit for each slot where a request was started
+        ULONG started_slots = 0;
+
+        // Set if a request could start, but all slots were busy
+        bool need_slot = false;
+
+        PCACHED_IRP run_here = NULL;
+
+        bool queue_empty;
+
         AIMWrFltrAcquireLock(&device_extension->ListLock, &lock_handle,
             lowest_assumed_irql);
 
-        // Free previously handled request, if any
-        if (request != &device_extension->ListHead)
+        queue_empty = IsListEmpty(&device_extension->ListHead) != FALSE;
+
+        for (PLIST_ENTRY request = device_extension->ListHead.Flink;
+            request != &device_extension->ListHead;
+            request = request->Flink)
         {
-            RemoveEntryList(request);
+            PCACHED_IRP cached_irp = CONTAINING_RECORD(request, CACHED_IRP, ListEntry);
+
+            bool in_progress = false;
+            ULONG free_slot = number_of_slots;
+
+            for (ULONG i = 0; i < number_of_slots; i++)
+            {
+                if (pipeline->Slots[i].Request == cached_irp)
+                {
+                    in_progress = true;
+                }
+                else if (pipeline->Slots[i].Request == NULL && free_slot == number_of_slots)
+                {
+                    free_slot = i;
+                }
+            }
+
+            if (in_progress)
+            {
+                continue;
+            }
+
+            LONGLONG first = 0;
+            LONGLONG last = 0;
+
+            bool has_blocks = AIMWrFltrGetQueuedRequestBlocks(cached_irp,
+                &first, &last);
+
+            ULONG action = AIMWrFltrPipelineCheckRequest(&scan, has_blocks,
+                first, last);
 
-            delete CONTAINING_RECORD(request, CACHED_IRP, ListEntry);
+            if (action == AIMWRFLTR_PIPELINE_WAIT)
+            {
+                continue;
+            }
+
+            // Requests without blocks run here when everything before them
+            // is done
+            if (action == AIMWRFLTR_PIPELINE_STOP)
+            {
+                break;
+            }
+
+            // Threads cannot be created while holding list lock
+            if (free_slot == number_of_slots)
+            {
+                need_slot = pipeline != NULL &&
+                    pipeline->NumberOfSlots < pipeline->SlotLimit;
+
+                break;
+            }
+
+            pipeline->Slots[free_slot].Request = cached_irp;
+            pipeline->Slots[free_slot].FirstBlock = first;
+            pipeline->Slots[free_slot].LastBlock = last;
+
+            AIMWrFltrPipelineScanAddBusy(&scan, first, last);
+
+            started_slots |= 1UL << free_slot;
+
+            ++busy_slots;
         }
 
-        // Pick next request in queue
-        request = device_extension->ListHead.Flink;
+        // Requests that cannot run in a pipeline slot run here, when all
+        // requests before them are done. That is also where all requests
+        // run if no slot can be created.
+        if (busy_slots == 0 && !queue_empty && !need_slot)
+        {
+            run_here = CONTAINING_RECORD(device_extension->ListHead.Flink,
+                CACHED_IRP, ListEntry);
+        }
 
         AIMWrFltrReleaseLock(&lock_handle, &lowest_assumed_irql);
 
-        if (request == &device_extension->ListHead &&
-            device_extension->ShutdownThread)
+        // Scan again with new slot. If no slot could be created, slot
+        // limit is lowered and next scan waits for slots in use, or runs
+        // requests here if there are none.
+        if (need_slot)
+        {
+            AIMWrFltrAddWorkerPipelineSlot(device_extension, pipeline);
+
+            progress = true;
+        }
+
+        if (started_slots != 0)
+        {
+            for (ULONG i = 0; i < number_of_slots; i++)
+            {
+                if (started_slots & (1UL << i))
+                {
+                    KeSetEvent(&pipeline->Slots[i].StartEvent, 0, FALSE);
+                }
+            }
+
+            progress = true;
+        }
+
+        if (queue_empty && device_extension->ShutdownThread)
         {
             KdPrint((__FUNCTION__ ": Device %p queue empty, worker thread shutting down\n",
                 device_extension->DeviceObject));
@@ -89,130 +583,64 @@ AIMWrFltrDeviceWorkerThread(PVOID Context)
             }
         }
 
-        if (request == &device_extension->ListHead)
+        if (run_here != NULL)
         {
-            KeWaitForSingleObject(&device_extension->ListEvent, Executive,
-                KernelMode, FALSE, NULL);
+            AIMWrFltrProcessQueuedRequest(device_extension, run_here,
+                block_buffer);
+
+            AIMWrFltrRetireQueuedRequest(device_extension, run_here);
 
             continue;
         }
 
-        PCACHED_IRP cached_irp = CONTAINING_RECORD(request, CACHED_IRP, ListEntry);
-
-        if (device_extension->ShutdownThread &&
-            (device_extension->DiffFileObject->Flags & FO_DELETE_ON_CLOSE) != 0)
-        {
-            if (cached_irp->Irp != NULL)
-            {
-                AIMWrFltrHandleRemovedDevice(cached_irp->Irp);
-            }
-        }
-        else if (cached_irp->DeviceObject != NULL && cached_irp->Irp != NULL)
+        if (progress)
         {
-            IoCallDriver(cached_irp->DeviceObject, cached_irp->Irp);
+            continue;
         }
-        else
-        {
-            NTSTATUS status;
-            PIO_STACK_LOCATION io_stack = &cached_irp->IoStack;
-
-            switch (io_stack->MajorFunction)
-            {
-            case IRP_MJ_READ:
-                status = AIMWrFltrDeferredRead(device_extension, cached_irp->Irp, block_buffer);
-                break;
-
-            case IRP_MJ_WRITE:
-                status = AIMWrFltrDeferredWrite(device_extension, cached_irp, block_buffer);
-
-                if (!NT_SUCCESS(status) &&
-                    cached_irp->Irp == NULL)
-                {
-#if DBG
-                    if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
-                        DbgBreakPoint();
-#endif
-
-                    device_extension->Statistics.DelayWriteFailed = TRUE;
-
-                    DbgPrint(__FUNCTION__ ": Delayed write failed: 0x%X\n",
-                        status);
-
-                    if (AIMWrFltrDiffFullEvent != NULL)
-                    {
-                        KePulseEvent(AIMWrFltrDiffFullEvent, 0, FALSE);
-                    }
-                }
-
-                break;
-
-            case IRP_MJ_FLUSH_BUFFERS:
-                status = AIMWrFltrDeferredFlushBuffers(device_extension, cached_irp);
-                break;
-
-            case IRP_MJ_DEVICE_CONTROL:
-                switch (io_stack->Parameters.DeviceIoControl.IoControlCode)
-                {
-#ifdef FSCTL_FILE_LEVEL_TRIM
-                case IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES:
-                    status = AIMWrFltrDeferredManageDataSetAttributes(device_extension, cached_irp,
-                        block_buffer);
-
-                    if (status == STATUS_INVALID_DEVICE_REQUEST)
-                    {
-                        device_extension->TrimNotSupported = TRUE;
-                    }
 
-                    break;
-#endif
-
-                default:
-                    status = STATUS_INTERNAL_ERROR;
-                    KdPrint((__FUNCTION__ ": Internal error.\n"));
-
-#if DBG
-                    if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
-                        DbgBreakPoint();
-#endif
-
-#pragma warning(suppress: 4065)
-                }
+        if (pipeline != NULL)
+        {
+            PVOID wait_objects[] = {
+                &device_extension->ListEvent,
+                &pipeline->DoneEvent
+            };
 
-                break;
+            // Slots that have had nothing to do for a while are freed. Slot
+            // limit lowered after a failure is also reset then.
+            LARGE_INTEGER idle_timeout;
+            idle_timeout.QuadPart = -WORKER_PIPELINE_IDLE_TIMEOUT;
 
-            default:
-                status = STATUS_INTERNAL_ERROR;
-                KdPrint((__FUNCTION__ ": Internal error.\n"));
+            bool idle = busy_slots == 0 && (pipeline->NumberOfSlots > 0 ||
+                pipeline->SlotLimit < WORKER_PIPELINE_SLOTS);
 
-#if DBG
-                if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
-                    DbgBreakPoint();
-#endif
-            }
+            NTSTATUS status = KeWaitForMultipleObjects(ARRAYSIZE(wait_objects),
+                wait_objects, WaitAny, Executive, KernelMode, FALSE,
+                idle ? &idle_timeout : NULL, NULL);
 
-            if (cached_irp->Irp != NULL)
+            if (status == STATUS_TIMEOUT)
             {
-                cached_irp->Irp->IoStatus.Status = status;
-                IoCompleteRequest(cached_irp->Irp, IO_NO_INCREMENT);
-            }
-            else if (!NT_SUCCESS(status))
-            {
-                DbgPrint(__FUNCTION__ ": Delayed 0x%X failed: 0x%X\n",
-                    (int)io_stack->MajorFunction,
-                    status);
+                KdPrint((__FUNCTION__ ": Device %p pipeline idle, freeing %u slots\n",
+                    device_extension->DeviceObject, pipeline->NumberOfSlots));
 
-                device_extension->Statistics.LastErrorCode = status;
+                AIMWrFltrStopWorkerPipelineSlots(pipeline);
             }
         }
-
-        IoReleaseRemoveLock(&device_extension->RemoveLock, cached_irp);
+        else
+        {
+            KeWaitForSingleObject(&device_extension->ListEvent, Executive,
+                KernelMode, FALSE, NULL);
+        }
     }
 
     KdPrint((__FUNCTION__ ": Terminating worker thread for device %p\n",
         device_extension->DeviceObject));
 
+    if (pipeline != NULL)
+    {
+        AIMWrFltrStopWorkerPipeline(pipeline);
+    }
+
     delete[] block_buffer;
 
     PsTerminateSystemThread(STATUS_SUCCESS);
 }
-
@@ -225,6 +225,8 @@ AIMWrFltrWrite(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
         InsertTailList(&device_extension->ListHead,
             &cached_irp->ListEntry);
 
+        AIMWrFltrIndexQueuedIrp(&device_extension->QueuedExtents, cached_irp);
+
         AIMWrFltrReleaseLock(&lock_handle, &current_irql);
 
         KeSetEvent(&device_extension->ListEvent, 0, FALSE);
@@ -291,6 +293,14 @@ PUCHAR BlockBuffer)
         InterlockedExchangeAdd64(&DeviceExtension->Statistics.SplitWrites, splits);
     }
 
+    NTSTATUS load_status = AIMWrFltrLoadAllocationTableRange(DeviceExtension,
+        first, last);
+
+    if (!NT_SUCCESS(load_status))
+    {
+        return load_status;
+    }
+
     IO_STATUS_BLOCK io_status;
     ULONG length_done = 0;
 
@@ -309,20 +319,43 @@ PUCHAR BlockBuffer)
 
         NTSTATUS status;
 
-        LONG block_address = DeviceExtension->AllocationTable[i];
+        LONG block_address = AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, i);
 
         if ((page_offset_this_iter + bytes_this_iter) > (ULONG)DIFF_BLOCK_SIZE)
         {
             bytes_this_iter = DIFF_BLOCK_SIZE - page_offset_this_iter;
         }
 
+        // Sectors missing from existing diff block, if it was allocated
+        // by partial writes
+        AIMWRFLTR_SECTOR_MAP sector_map = { 0 };
+
+        bool partial_block = block_address != DIFF_BLOCK_UNALLOCATED &&
+            AIMWrFltrGetSectorMap(DeviceExtension, block_address, &sector_map);
+
+        // Writes that only fill a part of a new block, or of a block that
+        // is still partial, need to be aligned both to sector size of diff
+        // device and to sectors in sector map
+        ULONG write_alignment_mask = SECTOR_SIZE - 1;
+
+        if (DeviceExtension->DiffDeviceSectorSize > SECTOR_SIZE)
+        {
+            write_alignment_mask =
+                (ULONG)(DeviceExtension->DiffDeviceSectorSize - 1);
+        }
+
         // If requested I/O position or length are not aligned to sector
         // size of diff device, we need to fill parts of buffer before and
         // after new data with old data from existing diff block
         ULONG sector_mask = (ULONG)(DeviceExtension->DiffDeviceSectorSize - 1);
 
+        if (partial_block)
+        {
+            sector_mask = write_alignment_mask;
+        }
+
         if (block_address != DIFF_BLOCK_UNALLOCATED &&
-            DeviceExtension->DiffDeviceSectorSize != 0 &&
+            (DeviceExtension->DiffDeviceSectorSize != 0 || partial_block) &&
             ((page_offset_this_iter & sector_mask) != 0 ||
                 ((bytes_this_iter & sector_mask) != 0)))
         {
@@ -342,15 +375,32 @@ PUCHAR BlockBuffer)
             KdPrint((__FUNCTION__ ": Alignment read 0x%X bytes from 0x%I64X.\n",
                 new_bytes_this_iter, offset));
 
-            status = AIMWrFltrSynchronousReadWrite(
-                DeviceExtension->DiffDeviceObject,
-                DeviceExtension->DiffFileObject,
-                IRP_MJ_READ,
-                BlockBuffer + new_page_offset_this_iter,
-                new_bytes_this_iter,
-                &offset,
-                NULL,
-                &io_status);
+            if (partial_block)
+            {
+                status = AIMWrFltrReadPartialBlock(
+                    DeviceExtension,
+                    DIFF_GET_BLOCK_BASE_FROM_ABS_OFFSET(abs_offset_this_iter),
+                    block_address,
+                    &sector_map,
+                    BlockBuffer,
+                    new_page_offset_this_iter,
+                    new_bytes_this_iter,
+                    NULL);
+
+                io_status.Information = new_bytes_this_iter;
+            }
+            else
+            {
+                status = AIMWrFltrSynchronousReadWrite(
+                    DeviceExtension->DiffDeviceObject,
+                    DeviceExtension->DiffFileObject,
+                    IRP_MJ_READ,
+                    BlockBuffer + new_page_offset_this_iter,
+                    new_bytes_this_iter,
+                    &offset,
+                    NULL,
+                    &io_status);
+            }
 
             if (NT_SUCCESS(status) &&
                 io_status.Information != new_bytes_this_iter)
@@ -397,11 +447,42 @@ PUCHAR BlockBuffer)
 
         if (block_address == DIFF_BLOCK_UNALLOCATED)
         {
-            block_address = ++DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.LastAllocatedBlock;
+            // Make sure there is an allocation table leaf for this block
+            // before allocating it on diff device
+            if (AIMWrFltrBlockMapCreateLeaf(&DeviceExtension->AllocationTable,
+                (ULONG)((ULONGLONG)i >> AIMWRFLTR_BLOCK_MAP_LEAF_BITS)) == NULL)
+            {
+                DbgPrint(__FUNCTION__ ": Memory allocation error for allocation table.\n");
 
-            // If not writing a complete block, we need to fill up by reading
-            // some data from target volume
-            if (bytes_this_iter < DIFF_BLOCK_SIZE)
+#if DBG
+                if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
+                    DbgBreakPoint();
+#endif
+
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            // Other pipeline slots can allocate blocks at the same time
+            block_address = InterlockedIncrement(
+                &DeviceExtension->Statistics.DiffDeviceVbr.Fields.Head.LastAllocatedBlock);
+
+            // If not writing a complete block, but whole sectors, only those
+            // sectors are written to the new block and the rest are still
+            // read from target volume until written. Otherwise, or if there
+            // is no room for a sector map for this block, we need to fill up
+            // by reading some data from target volume.
+            if (bytes_this_iter < DIFF_BLOCK_SIZE &&
+                (page_offset_this_iter & write_alignment_mask) == 0 &&
+                (bytes_this_iter & write_alignment_mask) == 0)
+            {
+                AIMWrFltrSectorMapInitialize(&sector_map,
+                    page_offset_this_iter, bytes_this_iter);
+
+                partial_block = AIMWrFltrSetSectorMap(DeviceExtension,
+                    block_address, &sector_map) != FALSE;
+            }
+
+            if (bytes_this_iter < DIFF_BLOCK_SIZE && !partial_block)
             {
                 // Need to fill up beginning of block?
                 if (page_offset_this_iter > 0)
@@ -436,9 +517,9 @@ PUCHAR BlockBuffer)
                             page_offset_this_iter, io_status.Information);
                     }
 
-                    ++DeviceExtension->Statistics.FillReads;
-                    DeviceExtension->Statistics.FillReadBytes +=
-                        page_offset_this_iter;
+                    InterlockedIncrement64(&DeviceExtension->Statistics.FillReads);
+                    InterlockedExchangeAdd64(&DeviceExtension->Statistics.FillReadBytes,
+                        page_offset_this_iter);
 
                     bytes_this_iter += page_offset_this_iter;
                     page_offset_this_iter = 0;
@@ -499,9 +580,9 @@ PUCHAR BlockBuffer)
                         RtlZeroMemory(BlockBuffer + bytes_this_iter + io_status.Information, pad_length);
                     }
 
-                    ++DeviceExtension->Statistics.FillReads;
-                    DeviceExtension->Statistics.FillReadBytes +=
-                        DIFF_BLOCK_SIZE - bytes_this_iter;
+                    InterlockedIncrement64(&DeviceExtension->Statistics.FillReads);
+                    InterlockedExchangeAdd64(&DeviceExtension->Statistics.FillReadBytes,
+                        DIFF_BLOCK_SIZE - bytes_this_iter);
 
                     bytes_this_iter = DIFF_BLOCK_SIZE;
                 }
@@ -551,9 +632,29 @@ PUCHAR BlockBuffer)
             return status;
         }
 
-        if (DeviceExtension->AllocationTable[i] != block_address)
+        if (partial_block)
+        {
+            AIMWRFLTR_SECTOR_MAP written_map = sector_map;
+
+            AIMWrFltrSectorMapSetPresent(&written_map, page_offset_this_iter,
+                bytes_this_iter);
+
+            if (RtlCompareMemory(&written_map, &sector_map,
+                sizeof(sector_map)) != sizeof(sector_map))
+            {
+                AIMWrFltrSetSectorMap(DeviceExtension, block_address,
+                    &written_map);
+            }
+        }
+
+        if (AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, i) !=
+            block_address)
         {
-            DeviceExtension->AllocationTable[i] = block_address;
+            // Sector map for a new block must be visible before block
+            KeMemoryBarrier();
+
+            AIMWrFltrBlockMapSet(&DeviceExtension->AllocationTable, i,
+                block_address);
         }
     }
 
@@ -783,6 +884,14 @@ PUCHAR BlockBuffer)
         LONG last = (LONG)DIFF_GET_BLOCK_NUMBER(range[i].StartingOffset +
             range[i].LengthInBytes - 1);
 
+        NTSTATUS status = AIMWrFltrLoadAllocationTableRange(DeviceExtension,
+            first, last);
+
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
         ULONGLONG length_done = 0;
 
         for (
@@ -798,7 +907,7 @@ PUCHAR BlockBuffer)
                 range[i].LengthInBytes - length_done;
             ULONGLONG block_size = DIFF_BLOCK_SIZE;
 
-            if (DeviceExtension->AllocationTable[b] == DIFF_BLOCK_UNALLOCATED)
+            if (AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, b) == DIFF_BLOCK_UNALLOCATED)
             {
                 if ((page_offset_this_iter + bytes_this_iter) > block_size)
                 {
@@ -816,8 +925,8 @@ PUCHAR BlockBuffer)
             while ((page_offset_this_iter + bytes_this_iter) > block_size)
             {
                 // Contigous? Then merge with next iteration
-                if (DeviceExtension->AllocationTable[b + 1] ==
-                    (DeviceExtension->AllocationTable[b] + 1))
+                if (AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, b + 1) ==
+                    (AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, b) + 1))
                 {
                     block_size += DIFF_BLOCK_SIZE;
                     ++b;
@@ -895,7 +1004,7 @@ PUCHAR BlockBuffer)
             ULONGLONG bytes_this_iter =
                 range[i].LengthInBytes - length_done;
             ULONGLONG block_size = DIFF_BLOCK_SIZE;
-            LONG block_base = DeviceExtension->AllocationTable[b];
+            LONG block_base = AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, b);
 
             if (block_base == DIFF_BLOCK_UNALLOCATED)
             {
@@ -912,8 +1021,8 @@ PUCHAR BlockBuffer)
             while ((page_offset_this_iter + bytes_this_iter) > block_size)
             {
                 // Contigous? Then merge with next iteration
-                if (DeviceExtension->AllocationTable[b + 1] ==
-                    (DeviceExtension->AllocationTable[b] + 1))
+                if (AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, b + 1) ==
+                    (AIMWrFltrBlockMapGet(&DeviceExtension->AllocationTable, b) + 1))
                 {
                     block_size += DIFF_BLOCK_SIZE;
                     ++b;
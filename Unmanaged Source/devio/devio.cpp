@@ -0,0 +1,2522 @@
+
+/// devio.cpp
+/// Reference server for the ImDisk/devio proxy protocol on Linux. Serves raw
+/// or sparse image files and block devices over TCP/IP to proxy clients, such
+/// as virtual disks created with IMSCSI_PROXY_TYPE_TCP through DevIoSvc.
+///
+/// All sockets are non-blocking and handled by a single epoll event loop,
+/// with the loop core in deviopoll.h.
+/// Complete requests are handed to a pool of worker threads that perform the
+/// actual file I/O, so that slow storage does not hold up other clients.
+/// Clients that send tagged requests can have several of them executing at
+/// the same time on one connection, answered in order of completion.
+///
+/// Alternatively, serves one client through POSIX shared memory with the
+/// ring layout described in imdproxy.h, using futexes to sleep and wake up.
+///
+/// Copyright (c) 2012-2026, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <linux/futex.h>
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <imdproxy.h>
+#include <imdshmring.h>
+
+#include "deviopoll.h"
+
+#define DEVIO_DEFAULT_PORT              "9000"
+#define DEVIO_DEFAULT_ALIGNMENT         512
+#define DEVIO_MAX_TRANSFER_SIZE         (64ULL << 20)
+#define DEVIO_MAX_RANGES_SIZE           (1ULL << 20)
+#define DEVIO_MAX_PATH_SIZE             (32768 * sizeof(WCHAR))
+#define DEVIO_RECV_BUFFER_SIZE          (64 << 10)
+#define DEVIO_MAX_TAGGED_REQUESTS       32
+#define DEVIO_RECYCLE_BUFFER_SIZE       (1 << 20)
+#define DEVIO_SHM_DEFAULT_SLOTS         64
+#define DEVIO_SHM_DEFAULT_SLOT_DATA     (1 << 20)
+#define DEVIO_SHM_SPIN_COUNT            20000
+#define DEVIO_SHM_SLEEP_MS              100
+
+// Same layout as DEVICE_DATA_SET_RANGE in ntddstor.h, which is what clients
+// send as payload with IMDPROXY_REQ_UNMAP and IMDPROXY_REQ_ZERO.
+typedef struct _DEVICE_DATA_SET_RANGE
+{
+    LONGLONG StartingOffset;
+    ULONGLONG LengthInBytes;
+} DEVICE_DATA_SET_RANGE, *PDEVICE_DATA_SET_RANGE;
+
+typedef union _DEVIO_REQUEST_HEADER
+{
+    ULONGLONG request_code;
+    IMDPROXY_CONNECT_REQ connect;
+    IMDPROXY_READ_REQ read;
+    IMDPROXY_WRITE_REQ write;
+    IMDPROXY_UNMAP_REQ unmap;
+    IMDPROXY_ZERO_REQ zero;
+    IMDPROXY_READV_REQ readv;
+    IMDPROXY_WRITEV_REQ writev;
+} DEVIO_REQUEST_HEADER, *PDEVIO_REQUEST_HEADER;
+
+typedef union _DEVIO_RESPONSE_HEADER
+{
+    IMDPROXY_CONNECT_RESP connect;
+    IMDPROXY_INFO_RESP info;
+    IMDPROXY_READ_RESP read;
+    IMDPROXY_WRITE_RESP write;
+    IMDPROXY_UNMAP_RESP unmap;
+    IMDPROXY_ZERO_RESP zero;
+    IMDPROXY_READV_RESP readv;
+    IMDPROXY_WRITEV_RESP writev;
+} DEVIO_RESPONSE_HEADER, *PDEVIO_RESPONSE_HEADER;
+
+static int verbose = 0;
+
+#define DevioTrace(level, ...) \
+    do { if (verbose >= (level)) fprintf(stderr, "devio: " __VA_ARGS__); } while (0)
+
+static size_t
+DevioRequestHeaderSize(ULONGLONG RequestCode)
+{
+    switch (RequestCode)
+    {
+    case IMDPROXY_REQ_INFO:
+    case IMDPROXY_REQ_CLOSE:
+        return sizeof(ULONGLONG);
+
+    case IMDPROXY_REQ_CONNECT:
+        return sizeof(IMDPROXY_CONNECT_REQ);
+
+    case IMDPROXY_REQ_READ:
+        return sizeof(IMDPROXY_READ_REQ);
+
+    case IMDPROXY_REQ_WRITE:
+        return sizeof(IMDPROXY_WRITE_REQ);
+
+    case IMDPROXY_REQ_UNMAP:
+        return sizeof(IMDPROXY_UNMAP_REQ);
+
+    case IMDPROXY_REQ_ZERO:
+        return sizeof(IMDPROXY_ZERO_REQ);
+
+    case IMDPROXY_REQ_READV:
+        return sizeof(IMDPROXY_READV_REQ);
+
+    case IMDPROXY_REQ_WRITEV:
+        return sizeof(IMDPROXY_WRITEV_REQ);
+
+    default:
+        return 0;
+    }
+}
+
+///
+/// Sum of extent lengths in a vectored request. Fails if it exceeds maximum
+/// transfer size.
+///
+static bool
+DevioExtentsLength(const void *Extents, ULONGLONG Count, ULONGLONG *Length)
+{
+    ULONGLONG length = 0;
+
+    for (ULONGLONG i = 0; i < Count; i++)
+    {
+        IMDPROXY_EXTENT extent;
+        memcpy(&extent, (const IMDPROXY_EXTENT*)Extents + i, sizeof extent);
+
+        if (extent.length > DEVIO_MAX_TRANSFER_SIZE - length)
+        {
+            return false;
+        }
+
+        length += extent.length;
+    }
+
+    *Length = length;
+    return true;
+}
+
+static bool
+DevioParseSize(const char *String, ULONGLONG *Value)
+{
+    char *suffix;
+
+    errno = 0;
+    ULONGLONG value = strtoull(String, &suffix, 0);
+    if (errno != 0 || suffix == String)
+    {
+        return false;
+    }
+
+    switch (*suffix)
+    {
+    case 'T': case 't':
+        value <<= 10;
+    case 'G': case 'g':
+        value <<= 10;
+    case 'M': case 'm':
+        value <<= 10;
+    case 'K': case 'k':
+        value <<= 10;
+        suffix++;
+    }
+
+    if (*suffix != 0)
+    {
+        return false;
+    }
+
+    *Value = value;
+    return true;
+}
+
+///
+/// An opened image file or block device. Shared between all connections
+/// that serve the same file.
+///
+static void
+DevioFutexWake(volatile ULONG *Address)
+{
+    syscall(SYS_futex, Address, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+///
+/// Sleeps while *Address equals Value, or until timeout. Shared memory is
+/// mapped by other processes, so these are not private futexes.
+///
+static void
+DevioFutexWait(volatile ULONG *Address, ULONG Value, long TimeoutMs)
+{
+    struct timespec timeout;
+    timeout.tv_sec = TimeoutMs / 1000;
+    timeout.tv_nsec = (TimeoutMs % 1000) * 1000000;
+
+    syscall(SYS_futex, Address, FUTEX_WAIT, Value, &timeout, nullptr, 0);
+}
+
+class DevioImage
+{
+public:
+    int fd = -1;
+    ULONGLONG size = 0;
+    ULONGLONG alignment = DEVIO_DEFAULT_ALIGNMENT;
+    bool read_only = false;
+    bool block_device = false;
+    std::string path;
+
+    ~DevioImage()
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    static std::shared_ptr<DevioImage>
+    Open(const char *Path, bool ReadOnly, ULONGLONG Size, int *Error)
+    {
+        std::shared_ptr<DevioImage> image = std::make_shared<DevioImage>();
+
+        image->path = Path;
+        image->read_only = ReadOnly;
+
+        int open_flags = O_CLOEXEC | (ReadOnly ? O_RDONLY : O_RDWR);
+        if (Size != 0 && !ReadOnly)
+        {
+            open_flags |= O_CREAT;
+        }
+
+        image->fd = open(Path, open_flags, 0644);
+        if (image->fd == -1)
+        {
+            *Error = errno;
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(image->fd, &st) != 0)
+        {
+            *Error = errno;
+            return nullptr;
+        }
+
+        if (S_ISBLK(st.st_mode))
+        {
+            image->block_device = true;
+
+            uint64_t dev_size;
+            if (ioctl(image->fd, BLKGETSIZE64, &dev_size) != 0)
+            {
+                *Error = errno;
+                return nullptr;
+            }
+
+            image->size = dev_size;
+
+            int sector_size;
+            if (ioctl(image->fd, BLKSSZGET, &sector_size) == 0 &&
+                sector_size > 0)
+            {
+                image->alignment = (ULONGLONG)sector_size;
+            }
+
+            if (Size != 0 && Size < image->size)
+            {
+                image->size = Size;
+            }
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            image->size = (ULONGLONG)st.st_size;
+
+            // Requested size larger than existing file extends it without
+            // allocating any blocks, which gives a sparse image file.
+            if (Size != 0)
+            {
+                if (Size > image->size && ftruncate(image->fd, (off_t)Size) != 0)
+                {
+                    *Error = errno;
+                    return nullptr;
+                }
+
+                image->size = Size;
+            }
+        }
+        else
+        {
+            *Error = EINVAL;
+            return nullptr;
+        }
+
+        *Error = 0;
+        return image;
+    }
+
+    ULONGLONG
+    Flags() const
+    {
+        if (read_only)
+        {
+            return IMDPROXY_FLAG_RO | IMDPROXY_FLAG_SUPPORTS_VECTORED;
+        }
+
+        return IMDPROXY_FLAG_SUPPORTS_UNMAP | IMDPROXY_FLAG_SUPPORTS_ZERO |
+            IMDPROXY_FLAG_SUPPORTS_VECTORED;
+    }
+
+    int
+    Read(void *Buffer, ULONGLONG Length, ULONGLONG Offset, ULONGLONG *Done)
+    {
+        *Done = 0;
+
+        if (Offset >= size)
+        {
+            return 0;
+        }
+
+        if (Length > size - Offset)
+        {
+            Length = size - Offset;
+        }
+
+        while (*Done < Length)
+        {
+            ssize_t rc = pread(fd, (char*)Buffer + *Done,
+                (size_t)(Length - *Done), (off_t)(Offset + *Done));
+
+            if (rc < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return errno;
+            }
+
+            if (rc == 0)
+            {
+                // Logical image size beyond physical end of file reads as
+                // zeros.
+                memset((char*)Buffer + *Done, 0, (size_t)(Length - *Done));
+                *Done = Length;
+                break;
+            }
+
+            *Done += (ULONGLONG)rc;
+        }
+
+        return 0;
+    }
+
+    int
+    Write(const void *Buffer, ULONGLONG Length, ULONGLONG Offset, ULONGLONG *Done)
+    {
+        *Done = 0;
+
+        if (read_only)
+        {
+            return EROFS;
+        }
+
+        if (Offset > size || Length > size - Offset)
+        {
+            return ENOSPC;
+        }
+
+        while (*Done < Length)
+        {
+            ssize_t rc = pwrite(fd, (const char*)Buffer + *Done,
+                (size_t)(Length - *Done), (off_t)(Offset + *Done));
+
+            if (rc < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return errno;
+            }
+
+            *Done += (ULONGLONG)rc;
+        }
+
+        return 0;
+    }
+
+    int
+    Unmap(ULONGLONG Offset, ULONGLONG Length)
+    {
+        if (read_only)
+        {
+            return EROFS;
+        }
+
+        if (Offset > size || Length > size - Offset)
+        {
+            return EINVAL;
+        }
+
+        int rc;
+
+        if (block_device)
+        {
+            uint64_t range[] = { Offset, Length };
+            rc = ioctl(fd, BLKDISCARD, range);
+        }
+        else
+        {
+            rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)Offset, (off_t)Length);
+        }
+
+        // Unmap is only a hint, so it is not an error if the underlying
+        // storage cannot deallocate anything.
+        if (rc != 0 && errno != EOPNOTSUPP && errno != ENOTTY)
+        {
+            return errno;
+        }
+
+        return 0;
+    }
+
+    int
+    Zero(ULONGLONG Offset, ULONGLONG Length)
+    {
+        if (read_only)
+        {
+            return EROFS;
+        }
+
+        if (Offset > size || Length > size - Offset)
+        {
+            return EINVAL;
+        }
+
+        if (block_device)
+        {
+            uint64_t range[] = { Offset, Length };
+            if (ioctl(fd, BLKZEROOUT, range) == 0)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                (off_t)Offset, (off_t)Length) == 0)
+            {
+                return 0;
+            }
+
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)Offset, (off_t)Length) == 0)
+            {
+                return 0;
+            }
+        }
+
+        // No support for zeroing ranges in underlying storage, write zeros
+        // instead.
+        static const char zeros[64 << 10] = { 0 };
+
+        while (Length > 0)
+        {
+            ULONGLONG block = Length < sizeof zeros ? Length : sizeof zeros;
+            ULONGLONG done;
+
+            int error = Write(zeros, block, Offset, &done);
+            if (error != 0)
+            {
+                return error;
+            }
+
+            Offset += block;
+            Length -= block;
+        }
+
+        return 0;
+    }
+};
+
+typedef enum _DEVIO_POLL_KIND
+{
+    DEVIO_POLL_LISTEN = DEVIO_POLL_WAKE + 1,
+    DEVIO_POLL_SIGNAL,
+    DEVIO_POLL_CLIENT
+} DEVIO_POLL_KIND;
+
+typedef enum _DEVIO_RECV_STATE
+{
+    DEVIO_RECV_CODE,
+    DEVIO_RECV_TAG,
+    DEVIO_RECV_HEADER,
+    DEVIO_RECV_DATA
+} DEVIO_RECV_STATE;
+
+struct DevioConnection;
+
+///
+/// A request and its response. Owned by the event loop thread while it is
+/// received or sent, and by a worker thread while it executes.
+///
+struct DevioRequest
+{
+    // Null for requests received in a shared memory slot.
+    DevioConnection *conn = nullptr;
+    ULONG shm_slot = 0;
+
+    std::shared_ptr<DevioImage> image;
+
+    // Set for requests received with an IMDPROXY_TAGGED_REQ header. The tag
+    // is sent back in front of the response.
+    bool tagged = false;
+    IMDPROXY_TAGGED_RESP tag = { 0 };
+
+    DEVIO_REQUEST_HEADER request = { 0 };
+    size_t request_header_size = 0;
+    size_t request_header_done = 0;
+
+    // Request payload for write, connect, unmap and zero requests and
+    // response payload for read requests. Points into a shared memory slot
+    // if data_external is set.
+    unsigned char *data = nullptr;
+    size_t data_capacity = 0;
+    bool data_external = false;
+    size_t data_size = 0;
+    size_t data_done = 0;
+
+    DEVIO_RESPONSE_HEADER response = { { 0 } };
+    size_t response_header_size = 0;
+    size_t response_data_offset = 0;
+    size_t response_data_size = 0;
+    size_t response_done = 0;
+
+    ~DevioRequest()
+    {
+        if (!data_external)
+        {
+            free(data);
+        }
+    }
+
+    ///
+    /// Untagged requests, and connect requests that switch image for the
+    /// whole connection, are never executed concurrently with others.
+    ///
+    bool
+    IsBarrier() const
+    {
+        return !tagged || request.request_code == IMDPROXY_REQ_CONNECT;
+    }
+
+    ///
+    /// Prepares for reuse, keeping data buffer.
+    ///
+    void
+    Reset()
+    {
+        unsigned char *saved_data = data;
+        size_t saved_capacity = data_capacity;
+        bool saved_external = data_external;
+
+        data = nullptr;
+        data_external = false;
+        *this = DevioRequest();
+        data = saved_data;
+        data_capacity = saved_capacity;
+        data_external = saved_external;
+    }
+
+    bool
+    EnsureDataBuffer(size_t Size)
+    {
+        if (Size <= data_capacity)
+        {
+            return true;
+        }
+
+        if (data_external)
+        {
+            return false;
+        }
+
+        unsigned char *new_data = (unsigned char*)realloc(data, Size);
+        if (new_data == nullptr)
+        {
+            return false;
+        }
+
+        data = new_data;
+        data_capacity = Size;
+        return true;
+    }
+};
+
+///
+/// Per client connection state. Only touched by the event loop thread.
+/// Worker threads only see requests, which are queued back to the event
+/// loop when executed.
+///
+struct DevioConnection : DevioPollEntry
+{
+    std::shared_ptr<DevioImage> image;
+    std::string peer;
+
+    // Bytes received from socket, but not yet consumed by request parser.
+    unsigned char recv_buffer[DEVIO_RECV_BUFFER_SIZE];
+    size_t recv_start = 0;
+    size_t recv_end = 0;
+
+    DEVIO_RECV_STATE recv_state = DEVIO_RECV_CODE;
+    DevioRequest *receiving = nullptr;
+
+    // Completely received barrier request, waiting for requests in flight to
+    // finish before it can be executed.
+    DevioRequest *barrier = nullptr;
+    bool barrier_in_flight = false;
+
+    // Requests executing on worker threads or waiting in send queue.
+    unsigned in_flight = 0;
+    std::deque<DevioRequest*> send_queue;
+    bool send_blocked = false;
+
+    std::vector<DevioRequest*> free_requests;
+
+    bool dead = false;
+
+    ~DevioConnection()
+    {
+        delete receiving;
+        delete barrier;
+
+        for (DevioRequest *request : send_queue)
+        {
+            delete request;
+        }
+
+        for (DevioRequest *request : free_requests)
+        {
+            delete request;
+        }
+
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    bool
+    CanReceive() const
+    {
+        return !dead && barrier == nullptr && !barrier_in_flight &&
+            in_flight < DEVIO_MAX_TAGGED_REQUESTS;
+    }
+
+    DevioRequest *
+    NewRequest()
+    {
+        DevioRequest *request;
+
+        if (free_requests.empty())
+        {
+            request = new DevioRequest;
+        }
+        else
+        {
+            request = free_requests.back();
+            free_requests.pop_back();
+        }
+
+        request->conn = this;
+        return request;
+    }
+
+    ///
+    /// Keeps a few request objects around, together with their data buffers
+    /// unless these have grown large.
+    ///
+    void
+    FreeRequest(DevioRequest *Request)
+    {
+        if (free_requests.size() >= DEVIO_MAX_TAGGED_REQUESTS ||
+            Request->data_capacity > DEVIO_RECYCLE_BUFFER_SIZE)
+        {
+            delete Request;
+            return;
+        }
+
+        Request->Reset();
+
+        free_requests.push_back(Request);
+    }
+};
+
+class DevioServer
+{
+public:
+    std::shared_ptr<DevioImage> default_image;
+    const char *export_dir = nullptr;
+    bool read_only = false;
+    ULONGLONG alignment = 0;
+    unsigned worker_count = 0;
+
+    ~DevioServer()
+    {
+        if (listen_entry.fd != -1)
+        {
+            close(listen_entry.fd);
+        }
+
+        if (signal_entry.fd != -1)
+        {
+            close(signal_entry.fd);
+        }
+
+        if (shm != nullptr)
+        {
+            munmap(shm, shm_size);
+            shm_unlink(shm_name.c_str());
+        }
+    }
+
+    bool Listen(const char *Address, const char *Port);
+
+    bool MapSharedMemory(const char *Name, ULONG SlotCount, ULONG SlotDataSize);
+
+    int Run();
+
+private:
+    DevioPoll poll;
+    DevioPollEntry listen_entry = { DEVIO_POLL_LISTEN, -1, 0 };
+    DevioPollEntry signal_entry = { DEVIO_POLL_SIGNAL, -1, 0 };
+
+    std::vector<DevioConnection*> connections;
+    std::vector<DevioConnection*> closed;
+
+    std::mutex work_lock;
+    std::condition_variable work_cond;
+    std::deque<DevioRequest*> work_queue;
+    bool stopping = false;
+
+    std::mutex done_lock;
+    std::vector<DevioRequest*> done_list;
+
+    std::vector<std::thread> workers;
+
+    // Shared memory with ring layout. Submission ring is consumed by
+    // ShmThread, completion ring is filled by worker threads.
+    PIMDPROXY_SHM_RING_HEADER shm = nullptr;
+    std::string shm_name;
+    size_t shm_size = 0;
+    ULONG shm_slot_count = 0;
+    ULONG shm_slot_data_size = 0;
+    size_t shm_slot_size = 0;
+    unsigned shm_spin_count = 0;                    // 0 with only one CPU
+    std::unique_ptr<DevioRequest[]> shm_requests;   // One per slot
+    std::atomic<unsigned> shm_in_flight{ 0 };
+    std::atomic<bool> shm_stopping{ false };
+    std::mutex shm_lock;                            // Completion ring producers
+    std::thread shm_thread;
+
+    unsigned char *
+    ShmSlot(ULONG Slot) const
+    {
+        return (unsigned char*)shm + IMDPROXY_HEADER_SIZE + Slot * shm_slot_size;
+    }
+
+    void ShmThread();
+    bool ShmStartRequest(ULONG Slot);
+    void ShmCompleteRequest(DevioRequest *Request);
+    void ShmReset();
+
+    void WorkerThread();
+    void ExecuteRequest(DevioRequest *Request);
+    void ExecuteConnect(DevioRequest *Request);
+    int ExecuteRanges(DevioRequest *Request);
+    void ExecuteVectored(DevioRequest *Request);
+
+    void Accept();
+    void Close(DevioConnection *Conn);
+    void FreeClosed();
+    bool Resume(DevioConnection *Conn);
+    ssize_t Receive(DevioConnection *Conn, void *Buffer, size_t Length);
+    bool OnReadable(DevioConnection *Conn);
+    bool OnRequestHeader(DevioRequest *Request);
+    bool OnRequestData(DevioRequest *Request);
+    bool DispatchRequest(DevioRequest *Request);
+    bool StartRequest(DevioRequest *Request);
+    bool SendResponses(DevioConnection *Conn);
+    void OnWorkDone();
+};
+
+bool
+DevioServer::Listen(const char *Address, const char *Port)
+{
+    struct addrinfo hints = { 0 };
+    struct addrinfo *result;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rc = getaddrinfo(Address, Port, &hints, &result);
+    if (rc != 0)
+    {
+        fprintf(stderr, "devio: Cannot resolve '%s:%s': %s\n",
+            Address != nullptr ? Address : "*", Port, gai_strerror(rc));
+
+        return false;
+    }
+
+    int sock = -1;
+
+    for (struct addrinfo *ai = result; ai != nullptr; ai = ai->ai_next)
+    {
+        sock = socket(ai->ai_family,
+            ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+
+        if (sock == -1)
+        {
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(sock, SOMAXCONN) == 0)
+        {
+            break;
+        }
+
+        close(sock);
+        sock = -1;
+    }
+
+    freeaddrinfo(result);
+
+    if (sock == -1)
+    {
+        fprintf(stderr, "devio: Cannot listen on '%s:%s': %s\n",
+            Address != nullptr ? Address : "*", Port, strerror(errno));
+
+        return false;
+    }
+
+    listen_entry.fd = sock;
+    return true;
+}
+
+///
+/// Creates POSIX shared memory object /Name and initializes it with ring
+/// layout, ready for a client to map it and start submitting requests.
+///
+bool
+DevioServer::MapSharedMemory(const char *Name, ULONG SlotCount, ULONG SlotDataSize)
+{
+    if (SlotCount == 0 || SlotCount > IMDPROXY_SHM_RING_MAX_SLOTS ||
+        (SlotCount & (SlotCount - 1)) != 0)
+    {
+        fprintf(stderr, "devio: Slot count must be a power of two up to %u.\n",
+            IMDPROXY_SHM_RING_MAX_SLOTS);
+
+        return false;
+    }
+
+    shm_name = std::string("/") + Name;
+    shm_slot_count = SlotCount;
+    shm_slot_data_size = SlotDataSize;
+    // Polling only keeps client from running if there is just one CPU
+    shm_spin_count = std::thread::hardware_concurrency() > 1 ?
+        DEVIO_SHM_SPIN_COUNT : 0;
+    shm_slot_size = ((size_t)IMDPROXY_HEADER_SIZE + SlotDataSize +
+        IMDPROXY_HEADER_SIZE - 1) & ~(size_t)(IMDPROXY_HEADER_SIZE - 1);
+    shm_size = IMDPROXY_HEADER_SIZE + SlotCount * shm_slot_size;
+
+    int fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+        0600);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "devio: Cannot create shared memory '%s': %s\n",
+            shm_name.c_str(), strerror(errno));
+
+        return false;
+    }
+
+    void *mem = MAP_FAILED;
+
+    if (ftruncate(fd, (off_t)shm_size) == 0)
+    {
+        mem = mmap(nullptr, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    int error = errno;
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "devio: Cannot map shared memory '%s': %s\n",
+            shm_name.c_str(), strerror(error));
+
+        shm_unlink(shm_name.c_str());
+        return false;
+    }
+
+    shm = (PIMDPROXY_SHM_RING_HEADER)mem;
+    shm->slot_count = SlotCount;
+    shm->slot_data_size = SlotDataSize;
+    shm->slot_size = shm_slot_size;
+    shm->version = IMDPROXY_SHM_RING_VERSION;
+
+    // Clients look at signature first
+    ImdProxyShmFullBarrier();
+    shm->signature = IMDPROXY_SHM_RING_SIGNATURE;
+
+    shm_requests.reset(new DevioRequest[SlotCount]);
+
+    return true;
+}
+
+int
+DevioServer::Run()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    // Block termination signals in all threads and receive them through
+    // signalfd in the event loop instead.
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    signal_entry.fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (signal_entry.fd == -1 || !poll.Open() ||
+        !poll.Add(&signal_entry, EPOLLIN) ||
+        (listen_entry.fd != -1 && !poll.Add(&listen_entry, EPOLLIN)))
+    {
+        perror("devio: Event loop setup failed");
+        return 1;
+    }
+
+    if (worker_count == 0)
+    {
+        worker_count = std::thread::hardware_concurrency() * 2;
+        if (worker_count < 4)
+        {
+            worker_count = 4;
+        }
+    }
+
+    for (unsigned i = 0; i < worker_count; i++)
+    {
+        workers.emplace_back(&DevioServer::WorkerThread, this);
+    }
+
+    if (shm != nullptr)
+    {
+        shm_thread = std::thread(&DevioServer::ShmThread, this);
+    }
+
+    DevioTrace(1, "Ready, %u worker threads.\n", worker_count);
+
+    bool running = true;
+
+    while (running)
+    {
+        DevioPollEntry *entries[DEVIO_POLL_MAX_EVENTS];
+        uint32_t events[DEVIO_POLL_MAX_EVENTS];
+
+        int count = poll.Wait(entries, events, DEVIO_POLL_MAX_EVENTS, -1);
+
+        if (count < 0)
+        {
+            perror("devio: epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            DevioPollEntry *entry = entries[i];
+
+            switch (entry->kind)
+            {
+            case DEVIO_POLL_LISTEN:
+                Accept();
+                break;
+
+            case DEVIO_POLL_WAKE:
+                OnWorkDone();
+                break;
+
+            case DEVIO_POLL_SIGNAL:
+                DevioTrace(1, "Shutting down.\n");
+                running = false;
+                break;
+
+            case DEVIO_POLL_CLIENT:
+            {
+                DevioConnection *conn = (DevioConnection*)entry;
+
+                if (conn->dead)
+                {
+                    break;
+                }
+
+                // Hang up while not receiving. Nothing more can be sent, so
+                // there is no point waiting for requests in flight.
+                if (!conn->CanReceive() && (events[i] & (EPOLLHUP | EPOLLERR)))
+                {
+                    Close(conn);
+                    break;
+                }
+
+                if ((events[i] & EPOLLOUT) && !SendResponses(conn))
+                {
+                    Close(conn);
+                    break;
+                }
+
+                if ((events[i] & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                    !OnReadable(conn))
+                {
+                    Close(conn);
+                    break;
+                }
+
+                if (!Resume(conn))
+                {
+                    Close(conn);
+                }
+
+                break;
+            }
+            }
+        }
+
+        FreeClosed();
+    }
+
+    if (shm_thread.joinable())
+    {
+        shm_stopping = true;
+        DevioFutexWake(&shm->submission.tail);
+        shm_thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(work_lock);
+        stopping = true;
+    }
+
+    work_cond.notify_all();
+
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    for (DevioRequest *request : work_queue)
+    {
+        // Shared memory requests belong to shm_requests
+        if (request->conn != nullptr)
+        {
+            delete request;
+        }
+    }
+
+    for (DevioRequest *request : done_list)
+    {
+        delete request;
+    }
+
+    work_queue.clear();
+    done_list.clear();
+
+    for (DevioConnection *conn : connections)
+    {
+        delete conn;
+    }
+
+    connections.clear();
+
+    return 0;
+}
+
+void
+DevioServer::Accept()
+{
+    for (;;)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof addr;
+
+        int sock = accept4(listen_entry.fd, (struct sockaddr*)&addr, &addr_len,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (sock == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("devio: accept failed");
+            }
+
+            return;
+        }
+
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+        DevioConnection *conn = new DevioConnection;
+        conn->kind = DEVIO_POLL_CLIENT;
+        conn->fd = sock;
+        conn->image = default_image;
+
+        char host[NI_MAXHOST];
+        char port[NI_MAXSERV];
+        if (getnameinfo((struct sockaddr*)&addr, addr_len, host, sizeof host,
+            port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        {
+            conn->peer = std::string(host) + ":" + port;
+        }
+
+        if (!poll.Add(conn, EPOLLIN))
+        {
+            perror("devio: epoll_ctl failed");
+            delete conn;
+            continue;
+        }
+
+        connections.push_back(conn);
+
+        DevioTrace(1, "Connection from %s.\n", conn->peer.c_str());
+    }
+}
+
+///
+/// Stops polling a connection. It is freed after current batch of poll
+/// events has been processed, or when the last of its requests comes back
+/// from worker threads.
+///
+void
+DevioServer::Close(DevioConnection *Conn)
+{
+    if (Conn->dead)
+    {
+        return;
+    }
+
+    DevioTrace(1, "Connection from %s closed.\n", Conn->peer.c_str());
+
+    poll.Remove(Conn);
+    Conn->dead = true;
+
+    // Requests not owned by worker threads can go right away.
+    delete Conn->receiving;
+    Conn->receiving = nullptr;
+
+    delete Conn->barrier;
+    Conn->barrier = nullptr;
+
+    for (DevioRequest *request : Conn->send_queue)
+    {
+        delete request;
+    }
+
+    Conn->in_flight -= (unsigned)Conn->send_queue.size();
+    Conn->send_queue.clear();
+
+    if (Conn->in_flight == 0)
+    {
+        closed.push_back(Conn);
+    }
+}
+
+void
+DevioServer::FreeClosed()
+{
+    for (DevioConnection *conn : closed)
+    {
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            if (connections[i] == conn)
+            {
+                connections[i] = connections.back();
+                connections.pop_back();
+                break;
+            }
+        }
+
+        delete conn;
+    }
+
+    closed.clear();
+}
+
+///
+/// Continues with requests already in receive buffer and updates poll
+/// events after requests have been received or responses sent.
+///
+bool
+DevioServer::Resume(DevioConnection *Conn)
+{
+    // Next request might already be waiting in receive buffer, in which case
+    // there will not be any new poll event for it.
+    if (Conn->CanReceive() && Conn->recv_start < Conn->recv_end &&
+        !OnReadable(Conn))
+    {
+        return false;
+    }
+
+    uint32_t events = (Conn->CanReceive() ? EPOLLIN : 0) |
+        (Conn->send_blocked ? EPOLLOUT : 0);
+
+    return poll.SetEvents(Conn, events);
+}
+
+ssize_t
+DevioServer::Receive(DevioConnection *Conn, void *Buffer, size_t Length)
+{
+    if (Conn->recv_start < Conn->recv_end)
+    {
+        size_t length = Conn->recv_end - Conn->recv_start;
+        if (length > Length)
+        {
+            length = Length;
+        }
+
+        memcpy(Buffer, Conn->recv_buffer + Conn->recv_start, length);
+        Conn->recv_start += length;
+
+        return (ssize_t)length;
+    }
+
+    Conn->recv_start = 0;
+    Conn->recv_end = 0;
+
+    // Large payloads go directly into destination buffer, everything else
+    // is read ahead into receive buffer to keep number of syscalls down.
+    if (Length >= sizeof Conn->recv_buffer)
+    {
+        return recv(Conn->fd, Buffer, Length, 0);
+    }
+
+    ssize_t rc = recv(Conn->fd, Conn->recv_buffer, sizeof Conn->recv_buffer, 0);
+    if (rc <= 0)
+    {
+        return rc;
+    }
+
+    Conn->recv_end = (size_t)rc;
+
+    return Receive(Conn, Buffer, Length);
+}
+
+bool
+DevioServer::OnReadable(DevioConnection *Conn)
+{
+    while (Conn->CanReceive())
+    {
+        void *buffer;
+        size_t length;
+
+        if (Conn->receiving == nullptr)
+        {
+            Conn->receiving = Conn->NewRequest();
+        }
+
+        DevioRequest *request = Conn->receiving;
+
+        switch (Conn->recv_state)
+        {
+        case DEVIO_RECV_CODE:
+        case DEVIO_RECV_HEADER:
+            buffer = (unsigned char*)&request->request + request->request_header_done;
+            length = (Conn->recv_state == DEVIO_RECV_CODE ?
+                sizeof(ULONGLONG) : request->request_header_size) -
+                request->request_header_done;
+            break;
+
+        case DEVIO_RECV_TAG:
+            buffer = (unsigned char*)&request->tag + request->request_header_done;
+            length = sizeof request->tag - request->request_header_done;
+            break;
+
+        default:
+            buffer = request->data + request->data_done;
+            length = request->data_size - request->data_done;
+            break;
+        }
+
+        ssize_t rc = Receive(Conn, buffer, length);
+
+        if (rc == 0)
+        {
+            return false;
+        }
+
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        if (Conn->recv_state == DEVIO_RECV_DATA)
+        {
+            request->data_done += (size_t)rc;
+
+            if (request->data_done < request->data_size)
+            {
+                continue;
+            }
+
+            if (!OnRequestData(request))
+            {
+                return false;
+            }
+
+            if (request->data_done < request->data_size)
+            {
+                continue;
+            }
+        }
+        else if (Conn->recv_state == DEVIO_RECV_TAG)
+        {
+            request->request_header_done += (size_t)rc;
+
+            if (request->request_header_done < sizeof request->tag)
+            {
+                continue;
+            }
+
+            // Tag complete, actual request follows.
+            request->request_header_done = 0;
+            Conn->recv_state = DEVIO_RECV_CODE;
+            continue;
+        }
+        else
+        {
+            request->request_header_done += (size_t)rc;
+
+            if (Conn->recv_state == DEVIO_RECV_CODE)
+            {
+                if (request->request_header_done < sizeof(ULONGLONG))
+                {
+                    continue;
+                }
+
+                if (request->request.request_code == IMDPROXY_REQ_TAGGED &&
+                    !request->tagged)
+                {
+                    request->tagged = true;
+                    request->request_header_done = 0;
+                    Conn->recv_state = DEVIO_RECV_TAG;
+                    continue;
+                }
+
+                request->request_header_size =
+                    DevioRequestHeaderSize(request->request.request_code);
+
+                if (request->request_header_size == 0)
+                {
+                    DevioTrace(0, "Unsupported request code %#llx from %s.\n",
+                        (unsigned long long)request->request.request_code,
+                        Conn->peer.c_str());
+
+                    return false;
+                }
+
+                Conn->recv_state = DEVIO_RECV_HEADER;
+            }
+
+            if (request->request_header_done < request->request_header_size)
+            {
+                continue;
+            }
+
+            if (!OnRequestHeader(request))
+            {
+                return false;
+            }
+
+            if (Conn->recv_state == DEVIO_RECV_DATA)
+            {
+                continue;
+            }
+        }
+
+        Conn->recv_state = DEVIO_RECV_CODE;
+        Conn->receiving = nullptr;
+
+        if (!DispatchRequest(request))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+///
+/// Called when a complete request header has been received. Sets up
+/// receive of request payload, if any.
+///
+bool
+DevioServer::OnRequestHeader(DevioRequest *Request)
+{
+    ULONGLONG payload_size;
+    ULONGLONG max_payload_size;
+
+    switch (Request->request.request_code)
+    {
+    case IMDPROXY_REQ_CONNECT:
+        payload_size = Request->request.connect.length;
+        max_payload_size = DEVIO_MAX_PATH_SIZE;
+        break;
+
+    case IMDPROXY_REQ_WRITE:
+        payload_size = Request->request.write.length;
+        max_payload_size = DEVIO_MAX_TRANSFER_SIZE;
+        break;
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+        payload_size = Request->request.unmap.length;
+        max_payload_size = DEVIO_MAX_RANGES_SIZE;
+        break;
+
+    case IMDPROXY_REQ_READV:
+    case IMDPROXY_REQ_WRITEV:
+        if (Request->request.readv.extent_count > IMDPROXY_MAX_EXTENTS)
+        {
+            DevioTrace(0, "Request from %s with too many extents (%llu).\n",
+                Request->conn->peer.c_str(),
+                (unsigned long long)Request->request.readv.extent_count);
+
+            return false;
+        }
+
+        // Write data follows extent list, see OnRequestData.
+        payload_size = Request->request.readv.extent_count *
+            sizeof(IMDPROXY_EXTENT);
+        max_payload_size = IMDPROXY_MAX_EXTENTS * sizeof(IMDPROXY_EXTENT);
+        break;
+
+    default:
+        return true;
+    }
+
+    if (payload_size > max_payload_size)
+    {
+        DevioTrace(0, "Request %llu from %s with too large payload (%llu bytes).\n",
+            (unsigned long long)Request->request.request_code,
+            Request->conn->peer.c_str(), (unsigned long long)payload_size);
+
+        return false;
+    }
+
+    if (payload_size == 0)
+    {
+        return true;
+    }
+
+    if (!Request->EnsureDataBuffer((size_t)payload_size))
+    {
+        DevioTrace(0, "Memory allocation failed for %llu bytes.\n",
+            (unsigned long long)payload_size);
+
+        return false;
+    }
+
+    Request->data_size = (size_t)payload_size;
+    Request->data_done = 0;
+    Request->conn->recv_state = DEVIO_RECV_DATA;
+
+    return true;
+}
+
+///
+/// Called when request payload received so far is complete. For vectored
+/// writes, that first happens after extent list, which tells how much data
+/// follows.
+///
+bool
+DevioServer::OnRequestData(DevioRequest *Request)
+{
+    size_t extents_size = (size_t)Request->request.writev.extent_count *
+        sizeof(IMDPROXY_EXTENT);
+
+    if (Request->request.request_code != IMDPROXY_REQ_WRITEV ||
+        Request->data_size != extents_size)
+    {
+        return true;
+    }
+
+    ULONGLONG length;
+    if (!DevioExtentsLength(Request->data, Request->request.writev.extent_count,
+        &length))
+    {
+        DevioTrace(0, "Vectored write from %s with too large payload.\n",
+            Request->conn->peer.c_str());
+
+        return false;
+    }
+
+    if (!Request->EnsureDataBuffer(extents_size + (size_t)length))
+    {
+        DevioTrace(0, "Memory allocation failed for %llu bytes.\n",
+            (unsigned long long)length);
+
+        return false;
+    }
+
+    Request->data_size = extents_size + (size_t)length;
+
+    return true;
+}
+
+///
+/// Called when a complete request including payload has been received.
+///
+bool
+DevioServer::DispatchRequest(DevioRequest *Request)
+{
+    DevioConnection *conn = Request->conn;
+
+    if (Request->request.request_code == IMDPROXY_REQ_CLOSE)
+    {
+        DevioTrace(2, "Close request from %s.\n", conn->peer.c_str());
+
+        conn->FreeRequest(Request);
+        return false;
+    }
+
+    // Barriers wait until everything received before them has been answered.
+    // Nothing more is received meanwhile.
+    if (Request->IsBarrier() && conn->in_flight > 0)
+    {
+        conn->barrier = Request;
+        return true;
+    }
+
+    return StartRequest(Request);
+}
+
+bool
+DevioServer::StartRequest(DevioRequest *Request)
+{
+    DevioConnection *conn = Request->conn;
+
+    conn->in_flight++;
+
+    if (Request->IsBarrier())
+    {
+        conn->barrier_in_flight = true;
+    }
+
+    Request->image = conn->image;
+
+    if (Request->request.request_code == IMDPROXY_REQ_INFO)
+    {
+        // Cheap enough to answer directly from event loop.
+        memset(&Request->response, 0, sizeof Request->response);
+        Request->response_header_size = sizeof(IMDPROXY_INFO_RESP);
+
+        if (Request->image)
+        {
+            Request->response.info.file_size = Request->image->size;
+            Request->response.info.req_alignment = alignment != 0 ?
+                alignment : Request->image->alignment;
+            Request->response.info.flags = Request->image->Flags();
+        }
+
+        Request->response.info.flags |= IMDPROXY_FLAG_SUPPORTS_TAGGED;
+
+        conn->send_queue.push_back(Request);
+
+        return conn->send_blocked || SendResponses(conn);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(work_lock);
+        work_queue.push_back(Request);
+    }
+
+    work_cond.notify_one();
+
+    return true;
+}
+
+///
+/// Sends as much as possible of queued responses without blocking. When
+/// the last request in flight has been answered, a waiting barrier request
+/// is started.
+///
+bool
+DevioServer::SendResponses(DevioConnection *Conn)
+{
+    Conn->send_blocked = false;
+
+    while (!Conn->send_queue.empty())
+    {
+        DevioRequest *request = Conn->send_queue.front();
+
+        const struct iovec parts[] = {
+            { &request->tag, request->tagged ? sizeof request->tag : 0 },
+            { &request->response, request->response_header_size },
+            { request->data + request->response_data_offset, request->response_data_size }
+        };
+
+        size_t total = parts[0].iov_len + parts[1].iov_len + parts[2].iov_len;
+
+        while (request->response_done < total)
+        {
+            struct iovec iov[3];
+            struct msghdr msg = { 0 };
+            size_t skip = request->response_done;
+
+            msg.msg_iov = iov;
+
+            for (const struct iovec &part : parts)
+            {
+                if (skip >= part.iov_len)
+                {
+                    skip -= part.iov_len;
+                    continue;
+                }
+
+                iov[msg.msg_iovlen].iov_base = (unsigned char*)part.iov_base + skip;
+                iov[msg.msg_iovlen].iov_len = part.iov_len - skip;
+                msg.msg_iovlen++;
+                skip = 0;
+            }
+
+            ssize_t rc = sendmsg(Conn->fd, &msg, MSG_NOSIGNAL);
+
+            if (rc < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    Conn->send_blocked = true;
+                    return true;
+                }
+
+                return false;
+            }
+
+            request->response_done += (size_t)rc;
+        }
+
+        Conn->send_queue.pop_front();
+        Conn->in_flight--;
+
+        if (request->IsBarrier())
+        {
+            Conn->barrier_in_flight = false;
+        }
+
+        Conn->FreeRequest(request);
+    }
+
+    if (Conn->barrier != nullptr && Conn->in_flight == 0)
+    {
+        DevioRequest *request = Conn->barrier;
+        Conn->barrier = nullptr;
+
+        return StartRequest(request);
+    }
+
+    return true;
+}
+
+void
+DevioServer::OnWorkDone()
+{
+    std::vector<DevioRequest*> done;
+
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        done.swap(done_list);
+    }
+
+    for (DevioRequest *request : done)
+    {
+        DevioConnection *conn = request->conn;
+
+        if (conn->dead)
+        {
+            delete request;
+
+            if (--conn->in_flight == 0)
+            {
+                closed.push_back(conn);
+            }
+
+            continue;
+        }
+
+        // Image opened by a connect request is used for everything after it.
+        if (request->request.request_code == IMDPROXY_REQ_CONNECT &&
+            request->response.connect.error_code == 0)
+        {
+            conn->image = request->image;
+        }
+
+        conn->send_queue.push_back(request);
+
+        if ((!conn->send_blocked && !SendResponses(conn)) || !Resume(conn))
+        {
+            Close(conn);
+        }
+    }
+}
+
+void
+DevioServer::WorkerThread()
+{
+    for (;;)
+    {
+        DevioRequest *request;
+
+        {
+            std::unique_lock<std::mutex> guard(work_lock);
+
+            work_cond.wait(guard, [this] { return stopping || !work_queue.empty(); });
+
+            if (stopping)
+            {
+                return;
+            }
+
+            request = work_queue.front();
+            work_queue.pop_front();
+        }
+
+        ExecuteRequest(request);
+
+        if (request->conn == nullptr)
+        {
+            ShmCompleteRequest(request);
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(done_lock);
+            done_list.push_back(request);
+        }
+
+        poll.Wake();
+    }
+}
+
+///
+/// Picks up requests from submission ring and hands them to worker threads.
+/// Polls for a while after each request before it sleeps on the futex.
+///
+void
+DevioServer::ShmThread()
+{
+    PIMDPROXY_SHM_RING submission = &shm->submission;
+    unsigned idle = shm_spin_count;
+    bool broken = false;
+
+    DevioTrace(1, "Serving shared memory '%s', %u slots of %u bytes.\n",
+        shm_name.c_str(), shm_slot_count, shm_slot_data_size);
+
+    while (!shm_stopping)
+    {
+        ULONG slot;
+
+        if (!broken && ImdProxyShmRingPop(submission, shm_slot_count, &slot))
+        {
+            idle = 0;
+
+            if (!ShmStartRequest(slot))
+            {
+                // Nothing more is accepted until client disconnects
+                broken = true;
+            }
+
+            continue;
+        }
+
+        if (shm->closed)
+        {
+            ShmReset();
+            broken = false;
+            continue;
+        }
+
+        if (idle < shm_spin_count)
+        {
+            idle++;
+            ImdProxyShmPause();
+            continue;
+        }
+
+        if (ImdProxyShmRingPrepareSleep(submission))
+        {
+            ImdProxyShmRingFinishSleep(submission);
+            continue;
+        }
+
+        DevioFutexWait(&submission->tail, submission->head, DEVIO_SHM_SLEEP_MS);
+
+        ImdProxyShmRingFinishSleep(submission);
+    }
+}
+
+///
+/// Copies a request from its slot and queues it for a worker thread. Info
+/// requests are answered directly. Returns false if client has broken
+/// protocol.
+///
+bool
+DevioServer::ShmStartRequest(ULONG Slot)
+{
+    if (Slot >= shm_slot_count)
+    {
+        DevioTrace(0, "Request in invalid slot %u.\n", Slot);
+        return false;
+    }
+
+    DevioRequest *request = &shm_requests[Slot];
+    unsigned char *slot_ptr = ShmSlot(Slot);
+    ULONGLONG request_code;
+
+    memcpy(&request_code, slot_ptr, sizeof request_code);
+
+    size_t header_size = DevioRequestHeaderSize(request_code);
+
+    if (header_size == 0 || request_code == IMDPROXY_REQ_CLOSE ||
+        request_code == IMDPROXY_REQ_CONNECT)
+    {
+        DevioTrace(0, "Unsupported request %llu in shared memory.\n",
+            (unsigned long long)request_code);
+
+        return false;
+    }
+
+    request->Reset();
+    request->shm_slot = Slot;
+    request->image = default_image;
+
+    memcpy(&request->request, slot_ptr, header_size);
+
+    shm_in_flight++;
+
+    if (request_code == IMDPROXY_REQ_INFO)
+    {
+        request->response_header_size = sizeof(IMDPROXY_INFO_RESP);
+        request->response.info.file_size = default_image->size;
+        request->response.info.req_alignment = alignment != 0 ?
+            alignment : default_image->alignment;
+        request->response.info.flags = default_image->Flags();
+
+        ShmCompleteRequest(request);
+        return true;
+    }
+
+    ULONGLONG length = 0;
+    ULONGLONG transfer_length = 0;
+    size_t extents_size = 0;
+
+    switch (request_code)
+    {
+    case IMDPROXY_REQ_READ:
+        transfer_length = request->request.read.length;
+        break;
+
+    case IMDPROXY_REQ_WRITE:
+        transfer_length = length = request->request.write.length;
+        break;
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+        transfer_length = length = request->request.unmap.length;
+        break;
+
+    case IMDPROXY_REQ_READV:
+    case IMDPROXY_REQ_WRITEV:
+        if (request->request.readv.extent_count > IMDPROXY_MAX_EXTENTS ||
+            !DevioExtentsLength(slot_ptr + header_size,
+                request->request.readv.extent_count, &transfer_length))
+        {
+            transfer_length = ULLONG_MAX;
+            break;
+        }
+
+        extents_size = (size_t)request->request.readv.extent_count *
+            sizeof(IMDPROXY_EXTENT);
+
+        if (request_code == IMDPROXY_REQ_WRITEV)
+        {
+            length = transfer_length;
+        }
+
+        break;
+    }
+
+    if (transfer_length > shm_slot_data_size)
+    {
+        DevioTrace(0, "Request %llu in slot %u too large for shared memory.\n",
+            (unsigned long long)request_code, Slot);
+
+        shm_in_flight--;
+        return false;
+    }
+
+    // Requests execute directly on the slot data area, which is used the
+    // same way as the buffer of requests received on sockets. Vectored
+    // requests need extent list right in front of the data, so it is moved
+    // to the end of the header area. Response header never reaches there.
+    unsigned char *slot_data = slot_ptr + IMDPROXY_HEADER_SIZE;
+
+    if (extents_size > 0)
+    {
+        memmove(slot_data - extents_size, slot_ptr + header_size, extents_size);
+    }
+
+    request->data = slot_data - extents_size;
+    request->data_capacity = extents_size + shm_slot_data_size;
+    request->data_external = true;
+    request->data_size = extents_size + (size_t)length;
+
+    {
+        std::lock_guard<std::mutex> guard(work_lock);
+        work_queue.push_back(request);
+    }
+
+    work_cond.notify_one();
+
+    return true;
+}
+
+///
+/// Writes response back to the slot the request came from and adds the slot
+/// to completion ring. Called from worker threads, and from ShmThread for
+/// requests answered directly.
+///
+void
+DevioServer::ShmCompleteRequest(DevioRequest *Request)
+{
+    unsigned char *slot_ptr = ShmSlot(Request->shm_slot);
+
+    memcpy(slot_ptr, &Request->response, Request->response_header_size);
+
+    {
+        std::lock_guard<std::mutex> guard(shm_lock);
+        ImdProxyShmRingPush(&shm->completion, shm_slot_count, Request->shm_slot);
+    }
+
+    if (ImdProxyShmRingNeedsWakeup(&shm->completion))
+    {
+        DevioFutexWake(&shm->completion.tail);
+    }
+
+    shm_in_flight--;
+}
+
+///
+/// Called when client has disconnected. Waits for requests still executing
+/// and makes shared memory ready for next client.
+///
+void
+DevioServer::ShmReset()
+{
+    while (shm_in_flight > 0)
+    {
+        usleep(1000);
+    }
+
+    shm->submission.head = shm->submission.tail = 0;
+    shm->completion.head = shm->completion.tail = 0;
+    shm->client_version = 0;
+
+    ImdProxyShmFullBarrier();
+    shm->closed = 0;
+
+    DevioTrace(1, "Shared memory client disconnected.\n");
+}
+
+///
+/// Executes a received request on a worker thread and builds response
+/// header and response data in request buffers.
+///
+void
+DevioServer::ExecuteRequest(DevioRequest *Request)
+{
+    memset(&Request->response, 0, sizeof Request->response);
+
+    if (Request->request.request_code == IMDPROXY_REQ_CONNECT)
+    {
+        ExecuteConnect(Request);
+        return;
+    }
+
+    DevioImage *image = Request->image.get();
+
+    switch (Request->request.request_code)
+    {
+    case IMDPROXY_REQ_READ:
+    {
+        ULONGLONG length = Request->request.read.length;
+        ULONGLONG done = 0;
+
+        Request->response_header_size = sizeof(IMDPROXY_READ_RESP);
+
+        if (image == nullptr)
+        {
+            Request->response.read.errorno = ENODEV;
+        }
+        else if (length > DEVIO_MAX_TRANSFER_SIZE)
+        {
+            Request->response.read.errorno = E2BIG;
+        }
+        else if (!Request->EnsureDataBuffer((size_t)length))
+        {
+            Request->response.read.errorno = ENOMEM;
+        }
+        else
+        {
+            Request->response.read.errorno = (ULONGLONG)image->Read(Request->data,
+                length, Request->request.read.offset, &done);
+        }
+
+        Request->response.read.length = done;
+        Request->response_data_size = (size_t)done;
+
+        DevioTrace(3, "Read %llu bytes at %llu: %llu done, error %llu.\n",
+            (unsigned long long)length,
+            (unsigned long long)Request->request.read.offset,
+            (unsigned long long)done,
+            (unsigned long long)Request->response.read.errorno);
+
+        break;
+    }
+
+    case IMDPROXY_REQ_WRITE:
+    {
+        ULONGLONG done = 0;
+
+        Request->response_header_size = sizeof(IMDPROXY_WRITE_RESP);
+
+        if (image == nullptr)
+        {
+            Request->response.write.errorno = ENODEV;
+        }
+        else
+        {
+            Request->response.write.errorno = (ULONGLONG)image->Write(Request->data,
+                Request->request.write.length, Request->request.write.offset, &done);
+        }
+
+        Request->response.write.length = done;
+
+        DevioTrace(3, "Write %llu bytes at %llu: %llu done, error %llu.\n",
+            (unsigned long long)Request->request.write.length,
+            (unsigned long long)Request->request.write.offset,
+            (unsigned long long)done,
+            (unsigned long long)Request->response.write.errorno);
+
+        break;
+    }
+
+    case IMDPROXY_REQ_UNMAP:
+    case IMDPROXY_REQ_ZERO:
+        Request->response_header_size = sizeof(IMDPROXY_UNMAP_RESP);
+        Request->response.unmap.errorno = (ULONGLONG)ExecuteRanges(Request);
+        break;
+
+    case IMDPROXY_REQ_READV:
+    case IMDPROXY_REQ_WRITEV:
+        ExecuteVectored(Request);
+        break;
+    }
+}
+
+///
+/// Vectored requests have extent list first in data buffer. Write data
+/// follows it, and read data is placed after it in the same way.
+///
+void
+DevioServer::ExecuteVectored(DevioRequest *Request)
+{
+    DevioImage *image = Request->image.get();
+    bool write = Request->request.request_code == IMDPROXY_REQ_WRITEV;
+    ULONGLONG count = Request->request.readv.extent_count;
+    size_t extents_size = (size_t)count * sizeof(IMDPROXY_EXTENT);
+    ULONGLONG length = 0;
+    ULONGLONG done = 0;
+    int error = 0;
+
+    // Same layout for both
+    Request->response_header_size = sizeof(IMDPROXY_READV_RESP);
+
+    if (image == nullptr)
+    {
+        error = ENODEV;
+    }
+    else if (!DevioExtentsLength(Request->data, count, &length))
+    {
+        error = E2BIG;
+    }
+    else if (!write && !Request->EnsureDataBuffer(extents_size + (size_t)length))
+    {
+        error = ENOMEM;
+    }
+
+    for (ULONGLONG i = 0; error == 0 && i < count; i++)
+    {
+        IMDPROXY_EXTENT extent;
+        memcpy(&extent, (IMDPROXY_EXTENT*)Request->data + i, sizeof extent);
+
+        unsigned char *buffer = Request->data + extents_size + done;
+        ULONGLONG extent_done = 0;
+
+        if (write)
+        {
+            error = image->Write(buffer, extent.length, extent.offset,
+                &extent_done);
+        }
+        else
+        {
+            error = image->Read(buffer, extent.length, extent.offset,
+                &extent_done);
+        }
+
+        done += extent_done;
+
+        // Short read at end of image ends the request.
+        if (extent_done < extent.length)
+        {
+            break;
+        }
+    }
+
+    Request->response.readv.errorno = (ULONGLONG)error;
+    Request->response.readv.length = done;
+
+    if (!write)
+    {
+        Request->response_data_offset = extents_size;
+        Request->response_data_size = (size_t)done;
+    }
+
+    DevioTrace(3, "%s %llu extents, %llu bytes: %llu done, error %d.\n",
+        write ? "Write" : "Read", (unsigned long long)count,
+        (unsigned long long)length, (unsigned long long)done, error);
+}
+
+int
+DevioServer::ExecuteRanges(DevioRequest *Request)
+{
+    DevioImage *image = Request->image.get();
+
+    if (image == nullptr)
+    {
+        return ENODEV;
+    }
+
+    PDEVICE_DATA_SET_RANGE ranges = (PDEVICE_DATA_SET_RANGE)Request->data;
+    size_t items = (size_t)Request->request.unmap.length / sizeof(DEVICE_DATA_SET_RANGE);
+
+    for (size_t i = 0; i < items; i++)
+    {
+        DEVICE_DATA_SET_RANGE range;
+        memcpy(&range, ranges + i, sizeof range);
+
+        if (range.StartingOffset < 0)
+        {
+            return EINVAL;
+        }
+
+        int error;
+        if (Request->request.request_code == IMDPROXY_REQ_ZERO)
+        {
+            error = image->Zero((ULONGLONG)range.StartingOffset,
+                range.LengthInBytes);
+        }
+        else
+        {
+            error = image->Unmap((ULONGLONG)range.StartingOffset,
+                range.LengthInBytes);
+        }
+
+        if (error != 0)
+        {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+///
+/// Connect requests carry a UTF-16 path to an image file to open on server
+/// side. This is what DevIoSvc forwards as the part after :// in the
+/// connection string. Paths are resolved within the export directory. If no
+/// export directory is configured, the image file given on command line is
+/// served regardless of requested path.
+///
+void
+DevioServer::ExecuteConnect(DevioRequest *Request)
+{
+    Request->response_header_size = sizeof(IMDPROXY_CONNECT_RESP);
+
+    std::string path;
+    const WCHAR *wpath = (const WCHAR*)Request->data;
+    size_t wlength = (size_t)Request->request.connect.length / sizeof(WCHAR);
+
+    for (size_t i = 0; i < wlength; i++)
+    {
+        uint32_t c = wpath[i];
+
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < wlength &&
+            wpath[i + 1] >= 0xDC00 && wpath[i + 1] < 0xE000)
+        {
+            c = 0x10000 + ((c - 0xD800) << 10) + (wpath[++i] - 0xDC00);
+        }
+
+        if (c == 0)
+        {
+            break;
+        }
+        else if (c == '\\')
+        {
+            c = '/';
+        }
+
+        if (c < 0x80)
+        {
+            path += (char)c;
+        }
+        else if (c < 0x800)
+        {
+            path += (char)(0xC0 | (c >> 6));
+            path += (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            path += (char)(0xE0 | (c >> 12));
+            path += (char)(0x80 | ((c >> 6) & 0x3F));
+            path += (char)(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            path += (char)(0xF0 | (c >> 18));
+            path += (char)(0x80 | ((c >> 12) & 0x3F));
+            path += (char)(0x80 | ((c >> 6) & 0x3F));
+            path += (char)(0x80 | (c & 0x3F));
+        }
+    }
+
+    DevioTrace(1, "Connect request from %s for '%s'.\n",
+        Request->conn->peer.c_str(), path.c_str());
+
+    if (export_dir == nullptr)
+    {
+        Request->response.connect.error_code = default_image ? 0 : ENOENT;
+        return;
+    }
+
+    // Do not allow anything that could escape export directory.
+    size_t start = path.find_first_not_of('/');
+    path.erase(0, start == std::string::npos ? path.size() : start);
+
+    if (path.empty() || path == ".." || path.compare(0, 3, "../") == 0 ||
+        path.find("/../") != std::string::npos ||
+        (path.size() >= 3 && path.compare(path.size() - 3, 3, "/..") == 0))
+    {
+        Request->response.connect.error_code = EACCES;
+        return;
+    }
+
+    path = std::string(export_dir) + "/" + path;
+
+    int error;
+    std::shared_ptr<DevioImage> image = DevioImage::Open(path.c_str(),
+        read_only, 0, &error);
+
+    if (!image)
+    {
+        DevioTrace(0, "Cannot open '%s': %s\n", path.c_str(), strerror(error));
+        Request->response.connect.error_code = (ULONGLONG)error;
+        return;
+    }
+
+    Request->image = image;
+}
+
+static void
+DevioUsage()
+{
+    fputs("Reference server for Arsenal Image Mounter proxy connections.\n"
+        "\n"
+        "Usage:\n"
+        "devio [-r] [-s size] [-a alignment] [-t threads] [-e exportdir] [-v]\n"
+        "      [address:]port [imagefile]\n"
+        "devio [-r] [-s size] [-a alignment] [-t threads] [-q slots] [-b size]\n"
+        "      [-v] -m name imagefile\n"
+        "\n"
+        "-r     Serve image read-only.\n"
+        "-s     Image size. Image files smaller than this are extended as sparse\n"
+        "       files, created if they do not exist. Suffixes K, M, G and T.\n"
+        "-a     Alignment requirement reported to clients. Default is sector\n"
+        "       size of block devices, otherwise 512 bytes.\n"
+        "-t     Number of I/O worker threads. Default is two per CPU.\n"
+        "-e     Directory where connecting clients can open image files by\n"
+        "       path, as the part after :// in DevIoSvc connection strings.\n"
+        "-m     Serve through POSIX shared memory object with this name instead\n"
+        "       of a socket, with ring layout for concurrent requests.\n"
+        "-q     Number of request slots in shared memory. Default is 64.\n"
+        "-b     Data size of each shared memory slot. Default is 1M.\n"
+        "-v     Verbose output. Repeat for more details.\n",
+        stderr);
+}
+
+int
+main(int argc, char **argv)
+{
+    DevioServer server;
+    ULONGLONG size = 0;
+    const char *shm_name = nullptr;
+    ULONG shm_slots = DEVIO_SHM_DEFAULT_SLOTS;
+    ULONGLONG shm_slot_data = DEVIO_SHM_DEFAULT_SLOT_DATA;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rs:a:t:e:m:q:b:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            server.read_only = true;
+            break;
+
+        case 's':
+            if (!DevioParseSize(optarg, &size))
+            {
+                fprintf(stderr, "devio: Invalid size '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'a':
+            if (!DevioParseSize(optarg, &server.alignment) ||
+                (server.alignment & (server.alignment - 1)) != 0)
+            {
+                fprintf(stderr, "devio: Invalid alignment '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 't':
+            server.worker_count = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'e':
+            server.export_dir = optarg;
+            break;
+
+        case 'm':
+            shm_name = optarg;
+            break;
+
+        case 'q':
+            shm_slots = (ULONG)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'b':
+            if (!DevioParseSize(optarg, &shm_slot_data) || shm_slot_data == 0 ||
+                shm_slot_data > DEVIO_MAX_TRANSFER_SIZE)
+            {
+                fprintf(stderr, "devio: Invalid slot size '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'v':
+            verbose++;
+            break;
+
+        default:
+            DevioUsage();
+            return 1;
+        }
+    }
+
+    // Shared memory mode has no address argument, and no way to connect to
+    // other images than the one given on command line.
+    const char *image_file = nullptr;
+
+    if (shm_name != nullptr)
+    {
+        if (optind + 1 != argc)
+        {
+            DevioUsage();
+            return 1;
+        }
+
+        image_file = argv[optind];
+    }
+    else if (optind >= argc ||
+        (optind + 1 >= argc && server.export_dir == nullptr))
+    {
+        DevioUsage();
+        return 1;
+    }
+    else if (optind + 1 < argc)
+    {
+        image_file = argv[optind + 1];
+    }
+
+    if (image_file != nullptr)
+    {
+        int error;
+        server.default_image = DevioImage::Open(image_file,
+            server.read_only, size, &error);
+
+        if (!server.default_image)
+        {
+            fprintf(stderr, "devio: Cannot open '%s': %s\n", image_file,
+                strerror(error));
+
+            return 1;
+        }
+
+        DevioTrace(1, "Serving '%s', %llu bytes%s.\n", image_file,
+            (unsigned long long)server.default_image->size,
+            server.read_only ? ", read-only" : "");
+    }
+
+    if (shm_name != nullptr)
+    {
+        if (!server.MapSharedMemory(shm_name, shm_slots, (ULONG)shm_slot_data))
+        {
+            return 1;
+        }
+
+        return server.Run();
+    }
+
+    std::string address;
+    const char *port = argv[optind];
+    const char *colon = strrchr(port, ':');
+
+    if (colon != nullptr)
+    {
+        address.assign(port, colon - port);
+        port = colon + 1;
+
+        if (address.size() >= 2 && address.front() == '[' && address.back() == ']')
+        {
+            address = address.substr(1, address.size() - 2);
+        }
+    }
+
+    if (*port == 0)
+    {
+        port = DEVIO_DEFAULT_PORT;
+    }
+
+    if (!server.Listen(address.empty() ? nullptr : address.c_str(), port))
+    {
+        return 1;
+    }
+
+    return server.Run();
+}
@@ -0,0 +1,183 @@
+/// deviopoll.h
+/// Event loop core for devio. One epoll instance watches any number of
+/// non-blocking sessions, and other threads can wake the loop through an
+/// eventfd when they have work for it. A session costs a poll entry and its
+/// descriptor, not a thread, so the owning program can serve hundreds of
+/// idle sessions with one loop thread and a small pool of worker threads
+/// that do blocking work.
+///
+/// Entries are owned by the caller and must stay valid until removed. Only
+/// Wake may be called from other threads than the loop thread.
+///
+/// Copyright (c) 2012-2026, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_DEVIOPOLL_
+#define _INC_DEVIOPOLL_
+
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define DEVIO_POLL_MAX_EVENTS           256
+
+// Kind of the entry returned by DevioPoll::Wait after DevioPoll::Wake.
+// Callers number their own kinds from DEVIO_POLL_WAKE + 1.
+#define DEVIO_POLL_WAKE                 0
+
+struct DevioPollEntry
+{
+    int kind;
+    int fd;
+    uint32_t poll_events;       // Events currently polled for
+};
+
+class DevioPoll
+{
+public:
+    ~DevioPoll()
+    {
+        if (wake_entry.fd != -1)
+        {
+            close(wake_entry.fd);
+        }
+
+        if (epoll_fd != -1)
+        {
+            close(epoll_fd);
+        }
+    }
+
+    bool
+    Open()
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_entry.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        return epoll_fd != -1 && wake_entry.fd != -1 &&
+            Add(&wake_entry, EPOLLIN);
+    }
+
+    bool
+    Add(DevioPollEntry *Entry, uint32_t Events)
+    {
+        struct epoll_event ev = { 0 };
+        ev.events = Events;
+        ev.data.ptr = Entry;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, Entry->fd, &ev) != 0)
+        {
+            return false;
+        }
+
+        Entry->poll_events = Events;
+        return true;
+    }
+
+    ///
+    /// Changes events to poll for. Does nothing if they are already set.
+    ///
+    bool
+    SetEvents(DevioPollEntry *Entry, uint32_t Events)
+    {
+        if (Events == Entry->poll_events)
+        {
+            return true;
+        }
+
+        struct epoll_event ev = { 0 };
+        ev.events = Events;
+        ev.data.ptr = Entry;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, Entry->fd, &ev) != 0)
+        {
+            return false;
+        }
+
+        Entry->poll_events = Events;
+        return true;
+    }
+
+    ///
+    /// Stops polling an entry. Events for it that were already returned by
+    /// Wait in the same batch are still in caller's array.
+    ///
+    void
+    Remove(DevioPollEntry *Entry)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, Entry->fd, nullptr);
+        Entry->poll_events = 0;
+    }
+
+    ///
+    /// Makes loop thread return from Wait with the wake entry. Several
+    /// calls before loop thread gets to it are seen as one.
+    ///
+    void
+    Wake()
+    {
+        uint64_t one = 1;
+
+        while (write(wake_entry.fd, &one, sizeof one) < 0 && errno == EINTR)
+        {
+        }
+    }
+
+    ///
+    /// Waits for events and fills Entries and Events with up to MaxEvents
+    /// of them. Returns number of entries, zero on timeout or signal, or -1
+    /// with errno set on failure.
+    ///
+    int
+    Wait(DevioPollEntry **Entries, uint32_t *Events, int MaxEvents,
+        int TimeoutMs)
+    {
+        struct epoll_event events[DEVIO_POLL_MAX_EVENTS];
+
+        if (MaxEvents > DEVIO_POLL_MAX_EVENTS)
+        {
+            MaxEvents = DEVIO_POLL_MAX_EVENTS;
+        }
+
+        int count = epoll_wait(epoll_fd, events, MaxEvents, TimeoutMs);
+
+        if (count < 0)
+        {
+            return errno == EINTR ? 0 : -1;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            Entries[i] = (DevioPollEntry*)events[i].data.ptr;
+            Events[i] = events[i].events;
+
+            if (Entries[i] == &wake_entry)
+            {
+                uint64_t value;
+
+                // Nothing to read if another wake-up was already consumed
+                if (read(wake_entry.fd, &value, sizeof value) < 0 &&
+                    errno != EAGAIN)
+                {
+                    return -1;
+                }
+            }
+        }
+
+        return count;
+    }
+
+private:
+    int epoll_fd = -1;
+    DevioPollEntry wake_entry = { DEVIO_POLL_WAKE, -1, 0 };
+};
+
+#endif // _INC_DEVIOPOLL_
@@ -0,0 +1,1633 @@
+/// devioload.cpp
+/// Load generator and integrity test for the devio reference server. Starts
+/// devio on a loopback port with a temporary sparse image file, then opens a
+/// number of client connections and runs a random mix of read, write, zero
+/// and unmap requests on each, optionally tagged with several requests in
+/// flight per connection. Each connection owns a separate part of the image
+/// and keeps a copy of what it wrote there, so every read is verified.
+///
+/// Reports request rate, throughput and thread count and memory use of the
+/// server process with all connections open, and what each connection adds
+/// to that compared with the idle server. Exit status is zero if all
+/// requests completed and all data compared equal.
+///
+/// With -l, connections go through a relay that delays data by half the
+/// given round trip time in each direction, to show how tagged requests in
+/// flight make up for network latency.
+///
+/// With -v, each request covers several blocks that are not adjacent, sent
+/// as one IMDPROXY_REQ_READV or _WRITEV request, or one zero or unmap
+/// request with several ranges. Compared with the same amount of data in
+/// separate requests, this shows what the driver saves by sending merged
+/// requests with gaps between them as vectored requests.
+///
+/// With -s, each client opens that number of connections to the server,
+/// like proxy service does for a ",streams=" connection string, and splits
+/// each read and write in one part for each connection, like the driver
+/// does for large requests. Zero and unmap requests are sent whole on first
+/// connection.
+///
+/// With -m, the client talks to server through a POSIX shared memory object
+/// with ring layout instead, like the driver does for shared memory proxy
+/// connections. Requests are built in place in ring slots, read data is
+/// checked in place, and client polls completion ring for a while before
+/// it sleeps on a futex. Server serves only one shared memory client.
+///
+/// Copyright (c) 2012-2026, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <climits>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <imdproxy.h>
+#include <imdshmring.h>
+
+typedef struct _DEVICE_DATA_SET_RANGE
+{
+    LONGLONG StartingOffset;
+    ULONGLONG LengthInBytes;
+} DEVICE_DATA_SET_RANGE, *PDEVICE_DATA_SET_RANGE;
+
+#define DEVIOLOAD_MAX_DEPTH     32
+#define DEVIOLOAD_MAX_EXTENTS   16
+#define DEVIOLOAD_SHM_SPIN_COUNT    20000
+#define DEVIOLOAD_SHM_TIMEOUT_MS    10000
+
+enum DEVIOLOAD_BLOCK_STATE
+{
+    DEVIOLOAD_BLOCK_ZERO,       // Never written, zeroed
+    DEVIOLOAD_BLOCK_DATA,       // Written with pattern for stored seed
+    DEVIOLOAD_BLOCK_UNMAPPED    // Contents undefined until next write
+};
+
+struct DevioLoadOptions
+{
+    unsigned connections = 16;
+    unsigned depth = 1;
+    unsigned requests = 2000;
+    ULONG block_size = 64 << 10;
+    ULONGLONG image_size = 0;
+    unsigned latency_ms = 0;
+    unsigned extents = 1;
+    unsigned streams = 1;
+    bool shm = false;
+};
+
+struct DevioLoadResult
+{
+    ULONGLONG requests = 0;
+    ULONGLONG bytes = 0;
+    ULONGLONG mismatches = 0;
+    bool failed = false;
+};
+
+static std::atomic<bool> stop_all(false);
+
+static void
+DevioLoadFill(unsigned char *Buffer, size_t Length, ULONGLONG Seed)
+{
+    std::minstd_rand gen((uint32_t)(Seed ^ (Seed >> 32)) | 1);
+
+    for (size_t i = 0; i < Length; i += sizeof(uint32_t))
+    {
+        uint32_t value = gen();
+        memcpy(Buffer + i, &value, sizeof value);
+    }
+}
+
+static bool
+DevioLoadSend(int Sock, const void *Buffer, size_t Length)
+{
+    const unsigned char *ptr = (const unsigned char*)Buffer;
+
+    while (Length > 0)
+    {
+        ssize_t rc = send(Sock, ptr, Length, MSG_NOSIGNAL);
+
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (rc <= 0)
+        {
+            return false;
+        }
+
+        ptr += rc;
+        Length -= (size_t)rc;
+    }
+
+    return true;
+}
+
+static bool
+DevioLoadRecv(int Sock, void *Buffer, size_t Length)
+{
+    unsigned char *ptr = (unsigned char*)Buffer;
+
+    while (Length > 0)
+    {
+        ssize_t rc = recv(Sock, ptr, Length, MSG_WAITALL);
+
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (rc <= 0)
+        {
+            return false;
+        }
+
+        ptr += rc;
+        Length -= (size_t)rc;
+    }
+
+    return true;
+}
+
+static int
+DevioLoadConnect(unsigned short Port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        return -1;
+    }
+
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof addr) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+    return sock;
+}
+
+static void
+DevioLoadFutexWake(volatile ULONG *Address)
+{
+    syscall(SYS_futex, Address, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static void
+DevioLoadFutexWait(volatile ULONG *Address, ULONG Value, long TimeoutMs)
+{
+    struct timespec timeout;
+    timeout.tv_sec = TimeoutMs / 1000;
+    timeout.tv_nsec = (TimeoutMs % 1000) * 1000000;
+
+    syscall(SYS_futex, Address, FUTEX_WAIT, Value, &timeout, nullptr, 0);
+}
+
+///
+/// Maps shared memory object Name, or returns nullptr if it does not exist
+/// yet or server has not finished ring header. Size is set to mapped size.
+///
+static PIMDPROXY_SHM_RING_HEADER
+DevioLoadMapShm(const char *Name, size_t *Size)
+{
+    int fd = shm_open(Name, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        return nullptr;
+    }
+
+    struct stat st;
+    void *mem = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= IMDPROXY_HEADER_SIZE)
+    {
+        mem = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    PIMDPROXY_SHM_RING_HEADER header = (PIMDPROXY_SHM_RING_HEADER)mem;
+
+    if (header->signature != IMDPROXY_SHM_RING_SIGNATURE)
+    {
+        munmap(mem, (size_t)st.st_size);
+        return nullptr;
+    }
+
+    ImdProxyShmFullBarrier();
+
+    *Size = (size_t)st.st_size;
+    return header;
+}
+
+///
+/// Picks a port number that is free on loopback right now, for the server to
+/// listen on.
+///
+static unsigned short
+DevioLoadFreePort()
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        return 0;
+    }
+
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof addr;
+
+    unsigned short port = 0;
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof addr) == 0 &&
+        getsockname(sock, (struct sockaddr*)&addr, &addr_len) == 0)
+    {
+        port = ntohs(addr.sin_port);
+    }
+
+    close(sock);
+    return port;
+}
+
+///
+/// One client connection. Blocks in its own part of the image are only used
+/// by one request in flight at a time, so server may complete tagged
+/// requests in any order without affecting what reads should return.
+///
+class DevioLoadClient
+{
+public:
+
+    DevioLoadClient(const DevioLoadOptions &Options, unsigned Index,
+        ULONGLONG RegionOffset, ULONG Blocks) :
+        options(Options),
+        index(Index),
+        region_offset(RegionOffset),
+        block_state(Blocks, DEVIOLOAD_BLOCK_ZERO),
+        block_seed(Blocks),
+        block_busy(Blocks, false),
+        gen(Index * 7919 + 1)
+    {
+    }
+
+    bool Connect(unsigned short Port);
+    bool ConnectShm(const char *Name);
+    void Run(DevioLoadResult *Result);
+
+    ~DevioLoadClient()
+    {
+        for (int sock : socks)
+        {
+            close(sock);
+        }
+
+        if (shm != nullptr)
+        {
+            shm->closed = 1;
+            ImdProxyShmFullBarrier();
+            DevioLoadFutexWake(&shm->submission.tail);
+            munmap(shm, shm_size);
+        }
+    }
+
+private:
+
+    struct Pending
+    {
+        ULONGLONG request_code;
+        unsigned block_count;
+        ULONG blocks[DEVIOLOAD_MAX_EXTENTS];
+        ULONGLONG seed;             // Block i is written with seed + i
+        unsigned part_count;        // Part i is sent on connection i
+        unsigned parts_left;
+        ULONG part_size;
+    };
+
+    bool CheckInfo(const IMDPROXY_INFO_RESP *Info);
+    bool Submit(unsigned Slot);
+    bool SendPart(Pending *p, unsigned Slot, unsigned Part);
+    bool Complete(unsigned Stream, DevioLoadResult *Result, unsigned *Slot);
+    bool RecvHeader(unsigned Stream, unsigned Slot, void *Header,
+        size_t Length);
+    int WaitForResponse();
+    void ShmSubmit(unsigned Slot);
+    bool ShmWaitForCompletion(unsigned *Slot);
+
+    unsigned char *ShmSlot(unsigned Slot) const
+    {
+        return (unsigned char*)shm + IMDPROXY_HEADER_SIZE +
+            Slot * shm->slot_size;
+    }
+
+    // Request data follows header on sockets. In shared memory it starts at
+    // data area of slot.
+    unsigned char *DataStart(unsigned Slot, unsigned char *HeaderEnd) const
+    {
+        return shm != nullptr ?
+            ShmSlot(Slot) + IMDPROXY_HEADER_SIZE : HeaderEnd;
+    }
+
+    ULONGLONG BlockOffset(ULONG Block) const
+    {
+        return region_offset + (ULONGLONG)Block * options.block_size;
+    }
+
+    ULONG PartLength(const Pending *p, unsigned Part) const
+    {
+        ULONG offset = Part * p->part_size;
+        ULONG data_size = p->block_count * options.block_size;
+
+        return data_size - offset < p->part_size ?
+            data_size - offset : p->part_size;
+    }
+
+    const DevioLoadOptions &options;
+    unsigned index;
+    ULONGLONG region_offset;
+    std::vector<int> socks;
+    unsigned next_stream = 0;
+    PIMDPROXY_SHM_RING_HEADER shm = nullptr;
+    size_t shm_size = 0;
+    unsigned shm_completed = 0;         // Slot found by WaitForResponse
+    std::vector<DEVIOLOAD_BLOCK_STATE> block_state;
+    std::vector<ULONGLONG> block_seed;
+    std::vector<bool> block_busy;
+    std::minstd_rand gen;
+    Pending pending[DEVIOLOAD_MAX_DEPTH];
+    std::vector<unsigned char> send_buffer;
+    std::vector<unsigned char> recv_buffer;
+    std::vector<unsigned char> expected;
+    ULONGLONG next_seed = 1;
+};
+
+bool
+DevioLoadClient::Connect(unsigned short Port)
+{
+    IMDPROXY_INFO_RESP info;
+
+    for (unsigned i = 0; i < options.streams; i++)
+    {
+        int sock = DevioLoadConnect(Port);
+        if (sock == -1)
+        {
+            return false;
+        }
+
+        socks.push_back(sock);
+
+        ULONGLONG request_code = IMDPROXY_REQ_INFO;
+
+        if (!DevioLoadSend(sock, &request_code, sizeof request_code) ||
+            !DevioLoadRecv(sock, &info, sizeof info))
+        {
+            return false;
+        }
+    }
+
+    return CheckInfo(&info);
+}
+
+bool
+DevioLoadClient::ConnectShm(const char *Name)
+{
+    shm = DevioLoadMapShm(Name, &shm_size);
+    if (shm == nullptr)
+    {
+        return false;
+    }
+
+    if (shm->slot_count < options.depth ||
+        shm->slot_data_size < (ULONGLONG)options.extents * options.block_size ||
+        shm_size < IMDPROXY_HEADER_SIZE + shm->slot_count * shm->slot_size)
+    {
+        fprintf(stderr, "devioload: Shared memory has %u slots of %u bytes.\n",
+            shm->slot_count, shm->slot_data_size);
+
+        return false;
+    }
+
+    shm->client_version = IMDPROXY_SHM_RING_VERSION;
+
+    ULONGLONG request_code = IMDPROXY_REQ_INFO;
+    IMDPROXY_INFO_RESP info;
+    unsigned slot;
+
+    memcpy(ShmSlot(0), &request_code, sizeof request_code);
+    ShmSubmit(0);
+
+    if (!ShmWaitForCompletion(&slot) || slot != 0)
+    {
+        return false;
+    }
+
+    memcpy(&info, ShmSlot(0), sizeof info);
+
+    return CheckInfo(&info);
+}
+
+///
+/// Checks info response from server and sets up buffers for requests.
+///
+bool
+DevioLoadClient::CheckInfo(const IMDPROXY_INFO_RESP *Info)
+{
+    const IMDPROXY_INFO_RESP &info = *Info;
+
+    ULONGLONG needed = IMDPROXY_FLAG_SUPPORTS_UNMAP | IMDPROXY_FLAG_SUPPORTS_ZERO;
+
+    // Shared memory slots are tags of their own
+    if (options.depth > 1 && shm == nullptr)
+    {
+        needed |= IMDPROXY_FLAG_SUPPORTS_TAGGED;
+    }
+
+    if (options.extents > 1)
+    {
+        needed |= IMDPROXY_FLAG_SUPPORTS_VECTORED;
+    }
+
+    if (info.file_size < region_offset +
+        (ULONGLONG)block_state.size() * options.block_size ||
+        (info.flags & needed) != needed ||
+        (info.flags & IMDPROXY_FLAG_RO) != 0 ||
+        options.block_size % info.req_alignment != 0)
+    {
+        fprintf(stderr, "devioload: Unexpected info response, size %llu, "
+            "alignment %llu, flags %#llx.\n",
+            (unsigned long long)info.file_size,
+            (unsigned long long)info.req_alignment,
+            (unsigned long long)info.flags);
+
+        return false;
+    }
+
+    size_t data_size = (size_t)options.extents * options.block_size;
+
+    send_buffer.resize(sizeof(IMDPROXY_TAGGED_REQ) +
+        sizeof(IMDPROXY_WRITEV_REQ) +
+        options.extents * sizeof(IMDPROXY_EXTENT) + data_size);
+
+    // Parts of a read may arrive after parts of other reads, so each slot
+    // receives into a buffer of its own
+    recv_buffer.resize(data_size * options.depth);
+    expected.resize(options.block_size);
+
+    return true;
+}
+
+///
+/// Sends a new request for random blocks that have no request in flight.
+/// Untagged connections have at most one request in flight.
+///
+bool
+DevioLoadClient::Submit(unsigned Slot)
+{
+    ULONG blocks = (ULONG)block_state.size();
+    Pending *p = pending + Slot;
+
+    p->block_count = options.extents;
+
+    for (unsigned i = 0; i < p->block_count; i++)
+    {
+        ULONG block = (ULONG)(gen() % blocks);
+
+        while (block_busy[block])
+        {
+            block = (block + 1) % blocks;
+        }
+
+        block_busy[block] = true;
+        p->blocks[i] = block;
+    }
+
+    unsigned op = gen() % 16;
+    bool vectored = options.extents > 1;
+
+    if (op < 8)
+    {
+        p->request_code = vectored ? IMDPROXY_REQ_READV : IMDPROXY_REQ_READ;
+    }
+    else if (op < 14)
+    {
+        p->request_code = vectored ? IMDPROXY_REQ_WRITEV : IMDPROXY_REQ_WRITE;
+    }
+    else if (op < 15)
+    {
+        p->request_code = IMDPROXY_REQ_ZERO;
+    }
+    else
+    {
+        p->request_code = IMDPROXY_REQ_UNMAP;
+    }
+
+    if (p->request_code == IMDPROXY_REQ_WRITE ||
+        p->request_code == IMDPROXY_REQ_WRITEV)
+    {
+        p->seed = ((ULONGLONG)index << 40) | next_seed;
+        next_seed += p->block_count;
+    }
+
+    p->part_count = 1;
+    p->part_size = p->block_count * options.block_size;
+
+    // Parts are whole sectors, so there may be fewer than connections
+    if (options.streams > 1 &&
+        (p->request_code == IMDPROXY_REQ_READ ||
+            p->request_code == IMDPROXY_REQ_WRITE))
+    {
+        p->part_size = (options.block_size / options.streams + 511) & ~511U;
+        p->part_count = (options.block_size + p->part_size - 1) /
+            p->part_size;
+    }
+
+    p->parts_left = p->part_count;
+
+    // Parts of a write are copied from here
+    if (p->request_code == IMDPROXY_REQ_WRITE)
+    {
+        DevioLoadFill(expected.data(), options.block_size, p->seed);
+    }
+
+    for (unsigned part = 0; part < p->part_count; part++)
+    {
+        if (!SendPart(p, Slot, part))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+DevioLoadClient::SendPart(Pending *p, unsigned Slot, unsigned Part)
+{
+    ULONG part_offset = Part * p->part_size;
+    ULONG part_length = PartLength(p, Part);
+    unsigned char *ptr = send_buffer.data();
+
+    if (shm != nullptr)
+    {
+        ptr = ShmSlot(Slot);
+    }
+    else if (options.depth > 1)
+    {
+        IMDPROXY_TAGGED_REQ tagged;
+        tagged.request_code = IMDPROXY_REQ_TAGGED;
+        tagged.io_tag = Slot;
+        memcpy(ptr, &tagged, sizeof tagged);
+        ptr += sizeof tagged;
+    }
+
+    switch (p->request_code)
+    {
+    case IMDPROXY_REQ_READ:
+    case IMDPROXY_REQ_WRITE:
+    {
+        IMDPROXY_READ_REQ req;
+        req.request_code = p->request_code;
+        req.offset = BlockOffset(p->blocks[0]) + part_offset;
+        req.length = part_length;
+        memcpy(ptr, &req, sizeof req);
+        ptr = DataStart(Slot, ptr + sizeof req);
+
+        break;
+    }
+
+    case IMDPROXY_REQ_READV:
+    case IMDPROXY_REQ_WRITEV:
+    {
+        IMDPROXY_READV_REQ req;
+        req.request_code = p->request_code;
+        req.extent_count = p->block_count;
+        memcpy(ptr, &req, sizeof req);
+        ptr += sizeof req;
+
+        for (unsigned i = 0; i < p->block_count; i++)
+        {
+            IMDPROXY_EXTENT extent;
+            extent.offset = BlockOffset(p->blocks[i]);
+            extent.length = options.block_size;
+            memcpy(ptr, &extent, sizeof extent);
+            ptr += sizeof extent;
+        }
+
+        ptr = DataStart(Slot, ptr);
+
+        break;
+    }
+
+    default:
+    {
+        IMDPROXY_ZERO_REQ req;
+        req.request_code = p->request_code;
+        req.length = p->block_count * sizeof(DEVICE_DATA_SET_RANGE);
+        memcpy(ptr, &req, sizeof req);
+        ptr = DataStart(Slot, ptr + sizeof req);
+
+        for (unsigned i = 0; i < p->block_count; i++)
+        {
+            DEVICE_DATA_SET_RANGE range;
+            range.StartingOffset = (LONGLONG)BlockOffset(p->blocks[i]);
+            range.LengthInBytes = options.block_size;
+            memcpy(ptr, &range, sizeof range);
+            ptr += sizeof range;
+        }
+
+        break;
+    }
+    }
+
+    if (p->request_code == IMDPROXY_REQ_WRITEV)
+    {
+        for (unsigned i = 0; i < p->block_count; i++)
+        {
+            DevioLoadFill(ptr, options.block_size, p->seed + i);
+            ptr += options.block_size;
+        }
+    }
+    else if (p->request_code == IMDPROXY_REQ_WRITE)
+    {
+        memcpy(ptr, expected.data() + part_offset, part_length);
+        ptr += part_length;
+    }
+
+    if (shm != nullptr)
+    {
+        ShmSubmit(Slot);
+        return true;
+    }
+
+    return DevioLoadSend(socks[Part], send_buffer.data(),
+        ptr - send_buffer.data());
+}
+
+///
+/// Adds a slot with a complete request to submission ring and wakes server
+/// if it sleeps. Only one thread submits, so no lock is needed.
+///
+void
+DevioLoadClient::ShmSubmit(unsigned Slot)
+{
+    ImdProxyShmRingPush(&shm->submission, shm->slot_count, Slot);
+
+    if (ImdProxyShmRingNeedsWakeup(&shm->submission))
+    {
+        DevioLoadFutexWake(&shm->submission.tail);
+    }
+}
+
+///
+/// Waits for next slot in completion ring. Polls for a while before it
+/// sleeps, like server does for submission ring. Returns false if server
+/// does not answer or completes a slot that was not submitted.
+///
+bool
+DevioLoadClient::ShmWaitForCompletion(unsigned *Slot)
+{
+    PIMDPROXY_SHM_RING completion = &shm->completion;
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(DEVIOLOAD_SHM_TIMEOUT_MS);
+    unsigned idle = 0;
+    ULONG slot;
+
+    // Polling only keeps server from running if there is just one CPU
+    unsigned spin_count = std::thread::hardware_concurrency() > 1 ?
+        DEVIOLOAD_SHM_SPIN_COUNT : 0;
+
+    while (!ImdProxyShmRingPop(completion, shm->slot_count, &slot))
+    {
+        if (idle < spin_count)
+        {
+            idle++;
+            ImdProxyShmPause();
+            continue;
+        }
+
+        if (stop_all || std::chrono::steady_clock::now() > deadline)
+        {
+            fprintf(stderr, "devioload: No response in shared memory.\n");
+            return false;
+        }
+
+        if (ImdProxyShmRingPrepareSleep(completion))
+        {
+            ImdProxyShmRingFinishSleep(completion);
+            continue;
+        }
+
+        DevioLoadFutexWait(&completion->tail, completion->head, 100);
+
+        ImdProxyShmRingFinishSleep(completion);
+    }
+
+    if (slot >= options.depth)
+    {
+        fprintf(stderr, "devioload: Completion for invalid slot %u.\n", slot);
+        return false;
+    }
+
+    *Slot = slot;
+    return true;
+}
+
+///
+/// Waits until a response arrives on any connection and returns its index,
+/// or -1 on error. Connections are checked in turn, so that none of them
+/// is left behind.
+///
+int
+DevioLoadClient::WaitForResponse()
+{
+    if (shm != nullptr)
+    {
+        return ShmWaitForCompletion(&shm_completed) ? 0 : -1;
+    }
+
+    if (socks.size() == 1)
+    {
+        return 0;
+    }
+
+    std::vector<struct pollfd> fds(socks.size());
+
+    for (size_t i = 0; i < socks.size(); i++)
+    {
+        fds[i].fd = socks[i];
+        fds[i].events = POLLIN;
+    }
+
+    for (;;)
+    {
+        int rc = poll(fds.data(), fds.size(), -1);
+
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (rc < 0)
+        {
+            return -1;
+        }
+
+        for (size_t i = 0; i < socks.size(); i++)
+        {
+            unsigned stream = (next_stream + i) % socks.size();
+
+            if (fds[stream].revents != 0)
+            {
+                next_stream = stream + 1;
+                return (int)stream;
+            }
+        }
+    }
+}
+
+///
+/// Receives next response on connection Stream and checks it against what
+/// was sent. Slot is set to request slot when last part of a request has
+/// completed, or to DEVIOLOAD_MAX_DEPTH if more parts are still in flight.
+/// Returns false on protocol or data errors.
+///
+bool
+DevioLoadClient::Complete(unsigned Stream, DevioLoadResult *Result,
+    unsigned *Slot)
+{
+    unsigned slot = 0;
+
+    *Slot = DEVIOLOAD_MAX_DEPTH;
+
+    if (shm != nullptr)
+    {
+        slot = shm_completed;
+    }
+    else if (options.depth > 1)
+    {
+        IMDPROXY_TAGGED_RESP tagged;
+        if (!DevioLoadRecv(socks[Stream], &tagged, sizeof tagged) ||
+            tagged.io_tag >= options.depth)
+        {
+            fprintf(stderr, "devioload: Connection %u, bad tagged response.\n",
+                index);
+
+            return false;
+        }
+
+        slot = (unsigned)tagged.io_tag;
+    }
+
+    Pending *p = pending + slot;
+
+    if (Stream >= p->part_count || p->parts_left == 0)
+    {
+        fprintf(stderr, "devioload: Connection %u, unexpected response on "
+            "stream %u.\n", index, Stream);
+
+        return false;
+    }
+
+    ULONGLONG errorno;
+    ULONGLONG length = 0;
+    ULONG data_size = p->block_count * options.block_size;
+    ULONG part_length = PartLength(p, Stream);
+    unsigned char *data = shm != nullptr ?
+        ShmSlot(slot) + IMDPROXY_HEADER_SIZE :
+        recv_buffer.data() + (size_t)slot * data_size;
+    bool transfer = p->request_code == IMDPROXY_REQ_READ ||
+        p->request_code == IMDPROXY_REQ_WRITE ||
+        p->request_code == IMDPROXY_REQ_READV ||
+        p->request_code == IMDPROXY_REQ_WRITEV;
+
+    // Vectored responses have the same layout
+    if (transfer)
+    {
+        IMDPROXY_READ_RESP resp;
+        if (!RecvHeader(Stream, slot, &resp, sizeof resp))
+        {
+            return false;
+        }
+
+        errorno = resp.errorno;
+        length = resp.length;
+    }
+    else
+    {
+        IMDPROXY_ZERO_RESP resp;
+        if (!RecvHeader(Stream, slot, &resp, sizeof resp))
+        {
+            return false;
+        }
+
+        errorno = resp.errorno;
+    }
+
+    if (errorno != 0 || (transfer && length != part_length))
+    {
+        fprintf(stderr, "devioload: Connection %u, request %llu failed, "
+            "error %llu, length %llu.\n", index,
+            (unsigned long long)p->request_code,
+            (unsigned long long)errorno, (unsigned long long)length);
+
+        return false;
+    }
+
+    // Read data is checked in place in shared memory slot
+    if ((p->request_code == IMDPROXY_REQ_READ ||
+        p->request_code == IMDPROXY_REQ_READV) && shm == nullptr &&
+        !DevioLoadRecv(socks[Stream], data + Stream * p->part_size, part_length))
+    {
+        return false;
+    }
+
+    if (--p->parts_left > 0)
+    {
+        return true;
+    }
+
+    for (unsigned i = 0; i < p->block_count; i++)
+    {
+        ULONG block = p->blocks[i];
+
+        switch (p->request_code)
+        {
+        case IMDPROXY_REQ_READ:
+        case IMDPROXY_REQ_READV:
+            if (block_state[block] == DEVIOLOAD_BLOCK_UNMAPPED)
+            {
+                break;
+            }
+
+            if (block_state[block] == DEVIOLOAD_BLOCK_ZERO)
+            {
+                memset(expected.data(), 0, options.block_size);
+            }
+            else
+            {
+                DevioLoadFill(expected.data(), options.block_size,
+                    block_seed[block]);
+            }
+
+            if (memcmp(expected.data(),
+                data + (size_t)i * options.block_size,
+                options.block_size) != 0)
+            {
+                fprintf(stderr, "devioload: Connection %u, data mismatch in "
+                    "block %u.\n", index, block);
+
+                Result->mismatches++;
+            }
+
+            break;
+
+        case IMDPROXY_REQ_WRITE:
+        case IMDPROXY_REQ_WRITEV:
+            block_state[block] = DEVIOLOAD_BLOCK_DATA;
+            block_seed[block] = p->seed + i;
+            break;
+
+        case IMDPROXY_REQ_ZERO:
+            block_state[block] = DEVIOLOAD_BLOCK_ZERO;
+            break;
+
+        default:
+            block_state[block] = DEVIOLOAD_BLOCK_UNMAPPED;
+            break;
+        }
+
+        block_busy[block] = false;
+    }
+
+    if (transfer)
+    {
+        Result->bytes += data_size;
+    }
+
+    Result->requests++;
+    *Slot = slot;
+
+    return true;
+}
+
+bool
+DevioLoadClient::RecvHeader(unsigned Stream, unsigned Slot, void *Header,
+    size_t Length)
+{
+    if (shm != nullptr)
+    {
+        memcpy(Header, ShmSlot(Slot), Length);
+        return true;
+    }
+
+    return DevioLoadRecv(socks[Stream], Header, Length);
+}
+
+void
+DevioLoadClient::Run(DevioLoadResult *Result)
+{
+    unsigned in_flight = 0;
+    unsigned submitted = 0;
+
+    while (in_flight < options.depth && submitted < options.requests)
+    {
+        if (!Submit(in_flight))
+        {
+            Result->failed = true;
+            return;
+        }
+
+        in_flight++;
+        submitted++;
+    }
+
+    while (in_flight > 0 && !stop_all)
+    {
+        int stream = WaitForResponse();
+        unsigned slot;
+
+        if (stream < 0 || !Complete((unsigned)stream, Result, &slot))
+        {
+            Result->failed = true;
+            stop_all = true;
+            return;
+        }
+
+        if (slot == DEVIOLOAD_MAX_DEPTH)
+        {
+            continue;
+        }
+
+        in_flight--;
+
+        // Reuse slot of the request that just completed.
+        if (submitted < options.requests)
+        {
+            if (!Submit(slot))
+            {
+                Result->failed = true;
+                stop_all = true;
+                return;
+            }
+
+            in_flight++;
+            submitted++;
+        }
+    }
+
+    if (stop_all && in_flight > 0)
+    {
+        Result->failed = true;
+    }
+}
+
+///
+/// Reads thread count and resident set size of a process from /proc.
+///
+static void
+DevioLoadProcessFootprint(pid_t Pid, unsigned *Threads, unsigned long *RssKB)
+{
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/status", (int)Pid);
+
+    *Threads = 0;
+    *RssKB = 0;
+
+    FILE *f = fopen(path, "r");
+    if (f == nullptr)
+    {
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof line, f) != nullptr)
+    {
+        if (strncmp(line, "Threads:", 8) == 0)
+        {
+            *Threads = (unsigned)strtoul(line + 8, nullptr, 10);
+        }
+        else if (strncmp(line, "VmRSS:", 6) == 0)
+        {
+            *RssKB = strtoul(line + 6, nullptr, 10);
+        }
+    }
+
+    fclose(f);
+}
+
+///
+/// Starts server listening on loopback Port, or serving shared memory
+/// object ShmName with ShmSlots slots of ShmSlotData bytes if ShmName is not
+/// nullptr.
+///
+static pid_t
+DevioLoadStartServer(const char *DevioPath, const char *ImageFile,
+    ULONGLONG ImageSize, unsigned short Port, const char *ShmName,
+    ULONG ShmSlots, ULONG ShmSlotData)
+{
+    char size[32];
+    char address[32];
+    char slots[16];
+    char slot_data[16];
+
+    snprintf(size, sizeof size, "%llu", (unsigned long long)ImageSize);
+    snprintf(address, sizeof address, "127.0.0.1:%u", (unsigned)Port);
+    snprintf(slots, sizeof slots, "%u", ShmSlots);
+    snprintf(slot_data, sizeof slot_data, "%u", ShmSlotData);
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        if (ShmName != nullptr)
+        {
+            execl(DevioPath, DevioPath, "-s", size, "-m", ShmName, "-q", slots,
+                "-b", slot_data, ImageFile, (char*)nullptr);
+        }
+        else
+        {
+            execl(DevioPath, DevioPath, "-s", size, address, ImageFile,
+                (char*)nullptr);
+        }
+
+        fprintf(stderr, "devioload: Cannot start '%s': %s\n", DevioPath,
+            strerror(errno));
+
+        _exit(127);
+    }
+
+    return pid;
+}
+
+///
+/// One direction of a delayed connection. Everything received is queued
+/// with the time it may be sent on, like on a long network path with
+/// unlimited bandwidth.
+///
+class DevioLoadDelayPipe
+{
+public:
+
+    DevioLoadDelayPipe(int From, int To, unsigned DelayUs) :
+        from(From),
+        to(To),
+        delay(DelayUs)
+    {
+        receiver = std::thread(&DevioLoadDelayPipe::Receive, this);
+        sender = std::thread(&DevioLoadDelayPipe::Send, this);
+    }
+
+    ~DevioLoadDelayPipe()
+    {
+        receiver.join();
+        sender.join();
+    }
+
+private:
+
+    struct Chunk
+    {
+        std::chrono::steady_clock::time_point due;
+        std::vector<unsigned char> data;   // Empty at end of stream
+    };
+
+    void Receive()
+    {
+        for (;;)
+        {
+            Chunk chunk;
+            chunk.data.resize(256 << 10);
+
+            ssize_t rc = recv(from, chunk.data.data(), chunk.data.size(), 0);
+
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            chunk.data.resize(rc > 0 ? (size_t)rc : 0);
+            chunk.due = std::chrono::steady_clock::now() + delay;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(chunk));
+            cond.notify_one();
+
+            if (rc <= 0)
+            {
+                return;
+            }
+        }
+    }
+
+    void Send()
+    {
+        for (;;)
+        {
+            Chunk chunk;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return !queue.empty(); });
+                chunk = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            std::this_thread::sleep_until(chunk.due);
+
+            if (chunk.data.empty() ||
+                !DevioLoadSend(to, chunk.data.data(), chunk.data.size()))
+            {
+                shutdown(to, SHUT_WR);
+                return;
+            }
+        }
+    }
+
+    int from;
+    int to;
+    std::chrono::microseconds delay;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Chunk> queue;
+    std::thread receiver;
+    std::thread sender;
+};
+
+///
+/// Accepts client connections on a loopback port and connects each one to
+/// server through a pair of delay pipes.
+///
+class DevioLoadDelayRelay
+{
+public:
+
+    bool Start(unsigned short ServerPort, unsigned RoundTripMs)
+    {
+        listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        struct sockaddr_in addr = { 0 };
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof addr;
+
+        if (listen_sock == -1 ||
+            bind(listen_sock, (struct sockaddr*)&addr, sizeof addr) != 0 ||
+            listen(listen_sock, SOMAXCONN) != 0 ||
+            getsockname(listen_sock, (struct sockaddr*)&addr, &addr_len) != 0)
+        {
+            return false;
+        }
+
+        port = ntohs(addr.sin_port);
+        server_port = ServerPort;
+        delay_us = RoundTripMs * 500;
+
+        acceptor = std::thread(&DevioLoadDelayRelay::Accept, this);
+        return true;
+    }
+
+    unsigned short Port() const
+    {
+        return port;
+    }
+
+    ~DevioLoadDelayRelay()
+    {
+        if (listen_sock != -1)
+        {
+            shutdown(listen_sock, SHUT_RDWR);
+        }
+
+        if (acceptor.joinable())
+        {
+            acceptor.join();
+        }
+
+        // Pipes finish when both ends have closed.
+        pipes.clear();
+
+        for (int fd : sockets)
+        {
+            close(fd);
+        }
+
+        if (listen_sock != -1)
+        {
+            close(listen_sock);
+        }
+    }
+
+private:
+
+    void Accept()
+    {
+        for (;;)
+        {
+            int client = accept4(listen_sock, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client == -1)
+            {
+                return;
+            }
+
+            int server = DevioLoadConnect(server_port);
+            if (server == -1)
+            {
+                close(client);
+                continue;
+            }
+
+            int on = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+            sockets.push_back(client);
+            sockets.push_back(server);
+
+            pipes.emplace_back(new DevioLoadDelayPipe(client, server, delay_us));
+            pipes.emplace_back(new DevioLoadDelayPipe(server, client, delay_us));
+        }
+    }
+
+    int listen_sock = -1;
+    unsigned short port = 0;
+    unsigned short server_port = 0;
+    unsigned delay_us = 0;
+    std::thread acceptor;
+    std::vector<int> sockets;
+    std::vector<std::unique_ptr<DevioLoadDelayPipe>> pipes;
+};
+
+static void
+DevioLoadUsage()
+{
+    fputs("Load generator and integrity test for devio reference server.\n"
+        "\n"
+        "Usage:\n"
+        "devioload [-c connections] [-q depth] [-n requests] [-b blocksize]\n"
+        "          [-l rtt] [-v extents] [-s streams] [-m] path-to-devio\n"
+        "\n"
+        "-c     Number of client connections. Default is 16.\n"
+        "-q     Tagged requests in flight per connection, at most 32. Default\n"
+        "       is 1, which sends untagged requests.\n"
+        "-n     Requests per connection. Default is 2000.\n"
+        "-b     Request size. Default is 64K.\n"
+        "-l     Round trip time in milliseconds to add between clients and\n"
+        "       server. Default is none.\n"
+        "-v     Blocks per request, at most 16. More than one sends vectored\n"
+        "       requests for blocks that are not adjacent. Default is 1.\n"
+        "-s     Server connections per client, at most 16. Reads and writes\n"
+        "       are split in one part for each. Default is 1.\n"
+        "-m     Connect through shared memory with ring layout instead of\n"
+        "       TCP. Server takes one client, so this needs -c 1, and cannot\n"
+        "       be used with -l or -s.\n",
+        stderr);
+}
+
+int
+main(int argc, char **argv)
+{
+    DevioLoadOptions options;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:q:n:b:l:v:s:mh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            options.connections = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'q':
+            options.depth = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'n':
+            options.requests = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'b':
+            options.block_size = (ULONG)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'l':
+            options.latency_ms = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'v':
+            options.extents = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 's':
+            options.streams = (unsigned)strtoul(optarg, nullptr, 0);
+            break;
+
+        case 'm':
+            options.shm = true;
+            break;
+
+        default:
+            DevioLoadUsage();
+            return 1;
+        }
+    }
+
+    if (optind + 1 != argc || options.connections == 0 ||
+        options.depth == 0 || options.depth > DEVIOLOAD_MAX_DEPTH ||
+        options.extents == 0 || options.extents > DEVIOLOAD_MAX_EXTENTS ||
+        options.streams == 0 || options.streams > IMDPROXY_MAX_STREAMS ||
+        options.block_size == 0 || options.block_size % 512 != 0 ||
+        (options.shm && (options.connections != 1 ||
+            options.latency_ms != 0 || options.streams != 1)))
+    {
+        DevioLoadUsage();
+        return 1;
+    }
+
+    // Enough blocks per connection for all requests in flight to use
+    // different blocks, and some more to keep reads of earlier writes likely.
+    ULONG blocks_per_client = options.depth * options.extents * 4 + 16;
+    ULONGLONG region_size = (ULONGLONG)blocks_per_client * options.block_size;
+    options.image_size = region_size * options.connections;
+
+    char image_file[] = "/tmp/devioload.XXXXXX";
+    int image_fd = mkstemp(image_file);
+    if (image_fd == -1)
+    {
+        perror("devioload: mkstemp");
+        return 1;
+    }
+
+    close(image_fd);
+
+    // Smallest power of two slot count for all requests in flight
+    ULONG shm_slots = 1;
+    while (shm_slots < options.depth)
+    {
+        shm_slots <<= 1;
+    }
+
+    char shm_name[32];
+    snprintf(shm_name, sizeof shm_name, "devioload.%d", (int)getpid());
+
+    unsigned short port = DevioLoadFreePort();
+    pid_t server = DevioLoadStartServer(argv[optind], image_file,
+        options.image_size, port, options.shm ? shm_name : nullptr,
+        shm_slots, options.extents * options.block_size);
+
+    // Server adds the slash
+    std::string shm_path = std::string("/") + shm_name;
+
+    if (server == -1)
+    {
+        perror("devioload: fork");
+        unlink(image_file);
+        return 1;
+    }
+
+    // Wait for server to start listening.
+    bool listening = false;
+    for (int i = 0; i < 200 && !listening; i++)
+    {
+        if (options.shm)
+        {
+            size_t shm_size;
+            PIMDPROXY_SHM_RING_HEADER header =
+                DevioLoadMapShm(shm_path.c_str(), &shm_size);
+
+            if (header != nullptr)
+            {
+                munmap(header, shm_size);
+                listening = true;
+                break;
+            }
+        }
+        else
+        {
+            int sock = DevioLoadConnect(port);
+            if (sock != -1)
+            {
+                close(sock);
+                listening = true;
+                break;
+            }
+        }
+
+        if (waitpid(server, nullptr, WNOHANG) == server)
+        {
+            break;
+        }
+
+        usleep(10000);
+    }
+
+    int status = 1;
+
+    DevioLoadDelayRelay relay;
+    std::vector<std::unique_ptr<DevioLoadClient>> clients;
+    std::vector<DevioLoadResult> results(options.connections);
+    unsigned idle_threads = 0;
+    unsigned long idle_rss_kb = 0;
+
+    if (!listening)
+    {
+        fprintf(stderr, "devioload: Server did not start.\n");
+        goto done;
+    }
+
+    if (options.latency_ms > 0)
+    {
+        if (!relay.Start(port, options.latency_ms))
+        {
+            perror("devioload: Cannot start delay relay");
+            goto done;
+        }
+
+        port = relay.Port();
+    }
+
+    DevioLoadProcessFootprint(server, &idle_threads, &idle_rss_kb);
+
+    for (unsigned i = 0; i < options.connections; i++)
+    {
+        clients.emplace_back(new DevioLoadClient(options, i, region_size * i,
+            blocks_per_client));
+
+        if (options.shm ? !clients.back()->ConnectShm(shm_path.c_str()) :
+            !clients.back()->Connect(port))
+        {
+            fprintf(stderr, "devioload: Connection %u failed.\n", i);
+            goto done;
+        }
+    }
+
+    {
+        unsigned threads;
+        unsigned long rss_kb;
+        DevioLoadProcessFootprint(server, &threads, &rss_kb);
+
+        printf("%u connections, queue depth %u, %u x %u byte requests, "
+            "%u ms added round trip, %u streams%s\n", options.connections,
+            options.depth, options.extents, options.block_size,
+            options.latency_ms, options.streams,
+            options.shm ? ", shared memory" : "");
+
+        printf("Server idle: %u threads, %lu KB resident\n", idle_threads,
+            idle_rss_kb);
+
+        printf("Server with all connections open: %u threads, %lu KB resident\n",
+            threads, rss_kb);
+
+        printf("Per connection: %.3f threads, %.1f KB resident\n",
+            ((double)threads - idle_threads) / options.connections,
+            ((double)rss_kb - idle_rss_kb) / options.connections);
+
+        std::vector<std::thread> threads_list;
+        auto start = std::chrono::steady_clock::now();
+
+        for (unsigned i = 0; i < options.connections; i++)
+        {
+            threads_list.emplace_back(&DevioLoadClient::Run, clients[i].get(),
+                &results[i]);
+        }
+
+        for (auto &t : threads_list)
+        {
+            t.join();
+        }
+
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        DevioLoadResult total;
+        for (auto &r : results)
+        {
+            total.requests += r.requests;
+            total.bytes += r.bytes;
+            total.mismatches += r.mismatches;
+            total.failed |= r.failed;
+        }
+
+        DevioLoadProcessFootprint(server, &threads, &rss_kb);
+
+        printf("%llu requests in %.2f s, %.0f requests/s, %.1f MB/s\n",
+            (unsigned long long)total.requests, seconds,
+            total.requests / seconds, total.bytes / seconds / 1048576);
+
+        printf("Server after load: %u threads, %lu KB resident\n",
+            threads, rss_kb);
+
+        printf("Per connection after load: %.3f threads, %.1f KB resident\n",
+            ((double)threads - idle_threads) / options.connections,
+            ((double)rss_kb - idle_rss_kb) / options.connections);
+
+        if (total.failed || total.mismatches != 0 ||
+            total.requests != (ULONGLONG)options.requests * options.connections)
+        {
+            fprintf(stderr, "devioload: FAILED, %llu mismatches.\n",
+                (unsigned long long)total.mismatches);
+        }
+        else
+        {
+            status = 0;
+        }
+    }
+
+done:
+    clients.clear();
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    unlink(image_file);
+
+    return status;
+}
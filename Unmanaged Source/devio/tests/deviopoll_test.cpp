@@ -0,0 +1,454 @@
+/// deviopoll_test.cpp
+/// Tests for the event loop core in deviopoll.h, used the way a session
+/// forwarder uses it: sessions are set up by a small pool of worker
+/// threads, away from the thread that accepts them, then watched by one
+/// loop thread until the other side closes, after which a worker frees
+/// them. Runs 500 sessions at once and reports thread count and resident
+/// memory of the process with all of them open.
+///
+/// Copyright (c) 2012-2026, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "imtest.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../deviopoll.h"
+
+#define POLL_TEST_SESSIONS      500
+#define POLL_TEST_WORKERS       2
+
+enum
+{
+    POLL_TEST_SESSION = DEVIO_POLL_WAKE + 1
+};
+
+struct PollTestSession : DevioPollEntry
+{
+    unsigned index;
+    unsigned echoed = 0;
+};
+
+///
+/// One loop thread and a few worker threads serving any number of
+/// sessions. Workers set up new sessions and free closed ones, the loop
+/// thread only moves data.
+///
+class PollTestForwarder
+{
+public:
+    std::atomic<unsigned> setup_count{ 0 };
+    std::atomic<unsigned> freed_count{ 0 };
+    std::atomic<unsigned> wake_count{ 0 };
+    std::atomic<unsigned> loop_errors{ 0 };     // Checked by main thread
+    std::vector<unsigned> freed_per_session;
+
+    bool
+    Start()
+    {
+        if (!poll.Open())
+        {
+            return false;
+        }
+
+        freed_per_session.assign(POLL_TEST_SESSIONS, 0);
+
+        loop = std::thread(&PollTestForwarder::LoopThread, this);
+
+        for (int i = 0; i < POLL_TEST_WORKERS; i++)
+        {
+            workers.emplace_back(&PollTestForwarder::WorkerThread, this);
+        }
+
+        return true;
+    }
+
+    void
+    Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+
+        work_cond.notify_all();
+        poll.Wake();
+
+        loop.join();
+
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    ///
+    /// Called from accepting thread. Returns at once, setup is queued.
+    ///
+    void
+    Accept(int Fd, unsigned Index)
+    {
+        PollTestSession *session = new PollTestSession;
+        session->kind = POLL_TEST_SESSION;
+        session->fd = Fd;
+        session->poll_events = 0;
+        session->index = Index;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            setup_queue.push_back(session);
+        }
+
+        work_cond.notify_one();
+    }
+
+private:
+    DevioPoll poll;
+    std::thread loop;
+    std::vector<std::thread> workers;
+
+    std::mutex lock;
+    std::condition_variable work_cond;
+    std::deque<PollTestSession*> setup_queue;   // To workers
+    std::deque<PollTestSession*> free_queue;    // To workers
+    std::vector<PollTestSession*> ready_list;   // To loop thread
+    bool stopping = false;
+
+    void
+    WorkerThread()
+    {
+        for (;;)
+        {
+            PollTestSession *session;
+            bool setup;
+
+            {
+                std::unique_lock<std::mutex> guard(lock);
+
+                work_cond.wait(guard, [this] {
+                    return stopping || !setup_queue.empty() ||
+                        !free_queue.empty(); });
+
+                if (!free_queue.empty())
+                {
+                    session = free_queue.front();
+                    free_queue.pop_front();
+                    setup = false;
+                }
+                else if (!setup_queue.empty())
+                {
+                    session = setup_queue.front();
+                    setup_queue.pop_front();
+                    setup = true;
+                }
+                else
+                {
+                    return;
+                }
+            }
+
+            if (setup)
+            {
+                fcntl(session->fd, F_SETFL,
+                    fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    ready_list.push_back(session);
+                }
+
+                setup_count++;
+                poll.Wake();
+            }
+            else
+            {
+                close(session->fd);
+                freed_per_session[session->index]++;
+                delete session;
+                freed_count++;
+            }
+        }
+    }
+
+    void
+    LoopThread()
+    {
+        for (;;)
+        {
+            DevioPollEntry *entries[DEVIO_POLL_MAX_EVENTS];
+            uint32_t events[DEVIO_POLL_MAX_EVENTS];
+
+            int count = poll.Wait(entries, events, DEVIO_POLL_MAX_EVENTS, -1);
+
+            if (count < 0)
+            {
+                loop_errors++;
+                return;
+            }
+
+            for (int i = 0; i < count; i++)
+            {
+                if (entries[i]->kind == DEVIO_POLL_WAKE)
+                {
+                    wake_count++;
+
+                    std::vector<PollTestSession*> ready;
+
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+
+                        if (stopping)
+                        {
+                            return;
+                        }
+
+                        ready.swap(ready_list);
+                    }
+
+                    for (PollTestSession *session : ready)
+                    {
+                        if (!poll.Add(session, EPOLLIN) ||
+                            session->poll_events != EPOLLIN)
+                        {
+                            loop_errors++;
+                        }
+                    }
+
+                    continue;
+                }
+
+                OnReadable((PollTestSession*)entries[i]);
+            }
+        }
+    }
+
+    void
+    OnReadable(PollTestSession *Session)
+    {
+        char buffer[64];
+        ssize_t rc = read(Session->fd, buffer, sizeof buffer);
+
+        if (rc < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+
+        if (rc > 0 && write(Session->fd, buffer, rc) == rc)
+        {
+            Session->echoed++;
+            return;
+        }
+
+        // Other side closed, hand session to a worker to free
+        poll.Remove(Session);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            free_queue.push_back(Session);
+        }
+
+        work_cond.notify_one();
+    }
+};
+
+static unsigned
+ProcessThreads(unsigned long *RssKB)
+{
+    unsigned threads = 0;
+    char line[256];
+    FILE *f = fopen("/proc/self/status", "r");
+
+    *RssKB = 0;
+
+    if (f == nullptr)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof line, f) != nullptr)
+    {
+        sscanf(line, "Threads: %u", &threads);
+        sscanf(line, "VmRSS: %lu", RssKB);
+    }
+
+    fclose(f);
+    return threads;
+}
+
+static bool
+WaitFor(const std::atomic<unsigned> &Counter, unsigned Value)
+{
+    for (int i = 0; i < 1000 && Counter < Value; i++)
+    {
+        usleep(5000);
+    }
+
+    return Counter == Value;
+}
+
+static void
+TestWaitTimeoutAndWake()
+{
+    DevioPoll poll;
+    IMTEST_CHECK(poll.Open());
+
+    DevioPollEntry *entries[4];
+    uint32_t events[4];
+
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 0) == 0);
+
+    // Several wake-ups before the loop gets to them are seen as one
+    poll.Wake();
+    poll.Wake();
+    poll.Wake();
+
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 1000) == 1);
+    IMTEST_CHECK(entries[0]->kind == DEVIO_POLL_WAKE);
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 0) == 0);
+}
+
+static void
+TestSetEvents()
+{
+    DevioPoll poll;
+    IMTEST_CHECK(poll.Open());
+
+    int fds[2];
+    IMTEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    DevioPollEntry entry = { POLL_TEST_SESSION, fds[0], 0 };
+    IMTEST_CHECK(poll.Add(&entry, EPOLLIN));
+
+    DevioPollEntry *entries[4];
+    uint32_t events[4];
+
+    // Writable socket only shows up once asked for
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 0) == 0);
+    IMTEST_CHECK(poll.SetEvents(&entry, EPOLLIN | EPOLLOUT));
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 0) == 1);
+    IMTEST_CHECK(entries[0] == &entry && (events[0] & EPOLLOUT));
+
+    IMTEST_CHECK(poll.SetEvents(&entry, EPOLLIN));
+    IMTEST_CHECK(poll.SetEvents(&entry, EPOLLIN));
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 0) == 0);
+
+    IMTEST_CHECK(write(fds[1], "x", 1) == 1);
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 0) == 1);
+    IMTEST_CHECK(entries[0] == &entry && (events[0] & EPOLLIN));
+
+    poll.Remove(&entry);
+    IMTEST_CHECK(poll.Wait(entries, events, 4, 0) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+TestManySessions()
+{
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    if (limit.rlim_cur < POLL_TEST_SESSIONS * 2 + 64)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    unsigned long rss_before;
+    unsigned threads_before = ProcessThreads(&rss_before);
+
+    PollTestForwarder forwarder;
+    IMTEST_CHECK(forwarder.Start());
+
+    std::vector<int> peers;
+    double start = ImTestSeconds();
+
+    for (unsigned i = 0; i < POLL_TEST_SESSIONS; i++)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+        {
+            IMTEST_CHECK(!"socketpair failed");
+            break;
+        }
+
+        forwarder.Accept(fds[0], i);
+        peers.push_back(fds[1]);
+    }
+
+    IMTEST_CHECK(WaitFor(forwarder.setup_count, POLL_TEST_SESSIONS));
+
+    // Every session answers through the one loop thread
+    for (unsigned round = 0; round < 2; round++)
+    {
+        for (int peer : peers)
+        {
+            IMTEST_CHECK(write(peer, "ping", 4) == 4);
+        }
+
+        for (int peer : peers)
+        {
+            char buffer[4];
+            IMTEST_CHECK(read(peer, buffer, 4) == 4 &&
+                memcmp(buffer, "ping", 4) == 0);
+        }
+    }
+
+    unsigned long rss_open;
+    unsigned threads_open = ProcessThreads(&rss_open);
+
+    printf("%u sessions open: %u threads (%u before), %lu KB resident "
+        "(%lu KB before), %.1f ms to set up and echo\n",
+        (unsigned)peers.size(), threads_open, threads_before, rss_open,
+        rss_before, (ImTestSeconds() - start) * 1000);
+
+    // Loop thread and workers only, however many sessions
+    IMTEST_CHECK(threads_open == threads_before + 1 + POLL_TEST_WORKERS);
+
+    for (int peer : peers)
+    {
+        close(peer);
+    }
+
+    IMTEST_CHECK(WaitFor(forwarder.freed_count, POLL_TEST_SESSIONS));
+
+    forwarder.Stop();
+
+    IMTEST_CHECK(forwarder.loop_errors == 0);
+    IMTEST_CHECK(forwarder.wake_count > 0);
+
+    for (unsigned i = 0; i < POLL_TEST_SESSIONS; i++)
+    {
+        IMTEST_CHECK(forwarder.freed_per_session[i] == 1);
+    }
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestWaitTimeoutAndWake);
+    IMTEST_RUN(TestSetEvents);
+    IMTEST_RUN(TestManySessions);
+
+    return IMTEST_RESULT();
+}
@@ -52,7 +52,17 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING)
         DbgBreakPoint();
 #endif
 
-    InitializeListHead(&FileTable);
+    for (ULONG i = 0; i < DEVIODRV_FILE_TABLE_BUCKETS; i++)
+    {
+        InitializeListHead(&FileTable[i]);
+    }
+
+    NTSTATUS status = ExInitializeResourceLite(&FileTableLock);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Failed initializing file table lock: %#x\n", status);
+        return status;
+    }
 
     DevIoDrvInitializeSpinLock(&ReferencedObjectsListLock);
 
@@ -65,9 +75,10 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING)
 
     PDEVICE_OBJECT DeviceObject;
 
-    NTSTATUS status = IoCreateDevice(DriverObject, 0, &dev_path, FILE_DEVICE_DISK_FILE_SYSTEM, 0, FALSE, &DeviceObject);
+    status = IoCreateDevice(DriverObject, 0, &dev_path, FILE_DEVICE_DISK_FILE_SYSTEM, 0, FALSE, &DeviceObject);
     if (!NT_SUCCESS(status))
     {
+        ExDeleteResourceLite(&FileTableLock);
         DbgPrint(__FUNCTION__ ": Failed creating device %wZ: %#x\n", &dev_path, status);
         return status;
     }
@@ -78,6 +89,7 @@ DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING)
     if (!NT_SUCCESS(status))
     {
         IoDeleteDevice(DeviceObject);
+        ExDeleteResourceLite(&FileTableLock);
         DbgPrint(__FUNCTION__ ": Failed creating symlink %wZ to %wZ: %#x\n", &symlink_path, &dev_path, status);
         return status;
     }
@@ -149,4 +161,6 @@ DevIoDrvUnload(PDRIVER_OBJECT DriverObject)
 #pragma warning(suppress: 6001)
         IoDeleteDevice(DriverObject->DeviceObject);
     }
+
+    ExDeleteResourceLite(&FileTableLock);
 }
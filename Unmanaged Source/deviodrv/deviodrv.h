@@ -38,6 +38,8 @@
 #include <ntkmapi.h>
 
 #include <imdproxy.h>
+#include <imdtagtab.h>
+#include <imdbatch.h>
 
 typedef struct _OBJECT_CONTEXT
 {
@@ -45,6 +47,8 @@ typedef struct _OBJECT_CONTEXT
 
     UNICODE_STRING Name;
 
+    ULONG NameHash;
+
     LONG RefCount;
 
     LARGE_INTEGER FileSize;
@@ -65,7 +69,10 @@ typedef struct _OBJECT_CONTEXT
 
     LIST_ENTRY ClientReceivedIrpList;
 
-    LIST_ENTRY ClientSentIrpList;
+    // Client requests sent to server and waiting for response, indexed by
+    // io_tag. Protected by IrpListLock.
+
+    IMD_TAG_TABLE SentRequests;
 
 } OBJECT_CONTEXT, *POBJECT_CONTEXT;
 
@@ -89,6 +96,8 @@ typedef struct _IRP_QUEUE_ITEM
 
     ULONG MappedBufferSize;
 
+    ULONG BatchMaxEntries;      // Server requests, zero if not batched
+
 } IRP_QUEUE_ITEM, *PIRP_QUEUE_ITEM;
 
 #ifdef _NTDDK_
@@ -148,6 +157,17 @@ NTSTATUS
 DevIoDrvCancelAll(PFILE_OBJECT FileObject,
     PKIRQL LowestAssumedIrql);
 
+NTSTATUS
+DevIoDrvInsertSentClientRequest(POBJECT_CONTEXT File,
+    PIRP_QUEUE_ITEM Item,
+    PULONGLONG Tag,
+    PKIRQL LowestAssumedIrql);
+
+PIRP_QUEUE_ITEM
+DevIoDrvGetSentClientRequest(POBJECT_CONTEXT File,
+    ULONGLONG Tag,
+    PKIRQL LowestAssumedIrql);
+
 void
 DevIoDrvSendClientRequestToServer(POBJECT_CONTEXT File,
     PIRP_QUEUE_ITEM ClientItem,
@@ -164,6 +184,10 @@ NTSTATUS
 DevIoDrvDispatchServerIORequest(PIRP Irp,
     PKIRQL LowestAssumedIrql);
 
+NTSTATUS
+DevIoDrvDispatchServerBatchRequest(PIRP Irp,
+    PKIRQL LowestAssumedIrql);
+
 NTSTATUS
 DevIoDrvDispatchClientRequest(PIRP Irp,
     PKIRQL LowestAssumedIrql);
@@ -198,7 +222,14 @@ DevIoDrvQueueMemoryIrp(PIRP_QUEUE_ITEM MemoryIrp,
 void
 DevIoDrvInitializeSpinLock(PKSPIN_LOCK Lock);
 
-extern LIST_ENTRY FileTable;
+//
+// Open files, hashed by case-insensitive name. Protected by FileTableLock.
+//
+#define DEVIODRV_FILE_TABLE_BUCKETS 256
+
+extern LIST_ENTRY FileTable[DEVIODRV_FILE_TABLE_BUCKETS];
+
+extern ERESOURCE FileTableLock;
 
 typedef struct _REFERENCED_OBJECT
 {
@@ -136,12 +136,7 @@ DevIoDrvDispatchClose(PDEVICE_OBJECT, PIRP Irp)
         KdPrint(("Closing handle for FileObject=%p Name='%wZ'\n",
             io_stack->FileObject, &context->Name));
 
-        while (!NT_SUCCESS(DevIoDrvCloseFileTableEntry(io_stack->FileObject)))
-        {
-            LARGE_INTEGER interval;
-            interval.QuadPart = -200000;
-            KeDelayExecutionThread(KernelMode, TRUE, &interval);
-        }
+        DevIoDrvCloseFileTableEntry(io_stack->FileObject);
     }
     else
     {
@@ -426,6 +421,17 @@ DevIoDrvDispatchControl(PDEVICE_OBJECT, PIRP Irp)
         return DevIoDrvDispatchServerIORequest(Irp, &lowest_assumed_irql);
     }
 
+    case IOCTL_DEVIODRV_EXCHANGE_IO_BATCH:
+    {
+        if (context->Server != io_stack->FileObject)
+        {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+
+        return DevIoDrvDispatchServerBatchRequest(Irp, &lowest_assumed_irql);
+    }
+
     case IOCTL_DEVIODRV_LOCK_MEMORY:
     {
         if (context->Server != io_stack->FileObject)
@@ -41,9 +41,51 @@
 
 #pragma code_seg("PAGE")
 
-LIST_ENTRY FileTable;
+LIST_ENTRY FileTable[DEVIODRV_FILE_TABLE_BUCKETS];
 
-LONG FileTableListLock;
+ERESOURCE FileTableLock;
+
+//
+// Case-insensitive hash of a file name, used both to select a bucket in
+// FileTable and to skip most name comparisons within that bucket.
+//
+ULONG DevIoDrvHashFileName(PCUNICODE_STRING Name)
+{
+    PAGED_CODE();
+
+    ULONG hash = 0;
+
+    if (!NT_SUCCESS(RtlHashUnicodeString(Name, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &hash)))
+    {
+        hash = 0;
+    }
+
+    return hash;
+}
+
+//
+// Finds a file table entry. Called with FileTableLock held, shared or
+// exclusive.
+//
+POBJECT_CONTEXT DevIoDrvFindFileTableEntry(PCUNICODE_STRING Name, ULONG Hash)
+{
+    PAGED_CODE();
+
+    PLIST_ENTRY bucket = &FileTable[Hash & (DEVIODRV_FILE_TABLE_BUCKETS - 1)];
+
+    for (PLIST_ENTRY entry = bucket->Flink; entry != bucket; entry = entry->Flink)
+    {
+        POBJECT_CONTEXT context = CONTAINING_RECORD(entry, OBJECT_CONTEXT, ListEntry);
+
+        if (context->NameHash == Hash &&
+            RtlEqualUnicodeString(Name, &context->Name, TRUE))
+        {
+            return context;
+        }
+    }
+
+    return NULL;
+}
 
 NTSTATUS DevIoDrvOpenFileTableEntry(PFILE_OBJECT FileObject, ULONG DesiredAccess)
 {
@@ -55,43 +97,46 @@ NTSTATUS DevIoDrvOpenFileTableEntry(PFILE_OBJECT FileObject, ULONG DesiredAccess
     BOOLEAN requests_write_access =
         (DesiredAccess & (GENERIC_WRITE | GENERIC_ALL | FILE_WRITE_DATA)) != 0;
 
-    if (InterlockedExchange(&FileTableListLock, 1) != 0)
-    {
-        return STATUS_DEVICE_BUSY;
-    }
-
-    PLIST_ENTRY entry = FileTable.Flink;
+    ULONG hash = DevIoDrvHashFileName(&FileObject->FileName);
 
     NTSTATUS status = STATUS_OBJECT_NAME_NOT_FOUND;
 
-    POBJECT_CONTEXT context = NULL;
-
     LONG ref_number = 0;
 
-    while (entry != &FileTable)
-    {
-        context = CONTAINING_RECORD(entry, OBJECT_CONTEXT, ListEntry);
-
-        if (RtlEqualUnicodeString(&FileObject->FileName, &context->Name, TRUE))
-        {
-            ref_number = InterlockedIncrement(&context->RefCount);
-
-            if (ref_number == 2)
-            {
-                context->Client = FileObject;
-            }
+    BOOLEAN is_client = FALSE;
 
-            FileObject->FsContext2 = context;
+    // Entries are only added and removed, and server and client pointers
+    // cleared, with lock held exclusive, so concurrent opens can share it.
+    // Reference count and client pointer are updated with interlocked
+    // operations.
+    KeEnterCriticalRegion();
+    ExAcquireResourceSharedLite(&FileTableLock, TRUE);
 
-            status = STATUS_SUCCESS;
+    POBJECT_CONTEXT context = DevIoDrvFindFileTableEntry(&FileObject->FileName, hash);
 
-            break;
+    if (context != NULL)
+    {
+        ref_number = InterlockedIncrement(&context->RefCount);
+
+        // Attribute queries hold references too, so client side is claimed
+        // through client pointer rather than by reference count. Not after
+        // server side has closed, while an earlier client still holds a
+        // reference.
+        if (!check_attributes_only &&
+            context->Server != NULL &&
+            InterlockedCompareExchangePointer((PVOID volatile*)&context->Client,
+                FileObject, NULL) == NULL)
+        {
+            is_client = TRUE;
         }
 
-        entry = entry->Flink;
+        FileObject->FsContext2 = context;
+
+        status = STATUS_SUCCESS;
     }
 
-    InterlockedExchange(&FileTableListLock, 0);
+    ExReleaseResourceLite(&FileTableLock);
+    KeLeaveCriticalRegion();
 
     if (status == STATUS_SUCCESS)
     {
@@ -104,7 +149,7 @@ NTSTATUS DevIoDrvOpenFileTableEntry(PFILE_OBJECT FileObject, ULONG DesiredAccess
         }
         // Opening client side can only be done once
         else if (!check_attributes_only &&
-            ref_number != 2)
+            !is_client)
         {
             status = STATUS_SHARING_VIOLATION;
         }
@@ -139,33 +184,23 @@ NTSTATUS DevIoDrvCreateFileTableEntry(PFILE_OBJECT FileObject)
 {
     PAGED_CODE();
 
-    if (InterlockedExchange(&FileTableListLock, 1) != 0)
-    {
-        return STATUS_DEVICE_BUSY;
-    }
-
-    PLIST_ENTRY entry = FileTable.Flink;
+    ULONG hash = DevIoDrvHashFileName(&FileObject->FileName);
 
     NTSTATUS status = STATUS_SUCCESS;
 
-    POBJECT_CONTEXT context = NULL;
-
-    while (entry != &FileTable)
-    {
-        context = CONTAINING_RECORD(entry, OBJECT_CONTEXT, ListEntry);
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&FileTableLock, TRUE);
 
-        if (RtlEqualUnicodeString(&FileObject->FileName, &context->Name, TRUE))
-        {
-            status = STATUS_OBJECT_NAME_COLLISION;
-            break;
-        }
+    POBJECT_CONTEXT context = DevIoDrvFindFileTableEntry(&FileObject->FileName, hash);
 
-        entry = entry->Flink;
+    if (context != NULL)
+    {
+        status = STATUS_OBJECT_NAME_COLLISION;
     }
 
     if (NT_SUCCESS(status))
     {
-        context = (POBJECT_CONTEXT)ExAllocatePoolWithTag(NonPagedPool, sizeof OBJECT_CONTEXT, POOL_TAG);
+        context = (POBJECT_CONTEXT)ExAllocatePoolWithTag(NonPagedPool, sizeof(OBJECT_CONTEXT), POOL_TAG);
 
         if (context == NULL)
         {
@@ -175,7 +210,7 @@ NTSTATUS DevIoDrvCreateFileTableEntry(PFILE_OBJECT FileObject)
 
     if (NT_SUCCESS(status))
     {
-        RtlZeroMemory(context, sizeof OBJECT_CONTEXT);
+        RtlZeroMemory(context, sizeof(OBJECT_CONTEXT));
 
         context->Name.Buffer = (PWCHAR)ExAllocatePoolWithTag(NonPagedPool, FileObject->FileName.Length, POOL_TAG);
 
@@ -190,24 +225,26 @@ NTSTATUS DevIoDrvCreateFileTableEntry(PFILE_OBJECT FileObject)
     {
         context->Name.MaximumLength = context->Name.Length = FileObject->FileName.Length;
         RtlCopyUnicodeString(&context->Name, &FileObject->FileName);
+        context->NameHash = hash;
 
         DevIoDrvInitializeSpinLock(&context->IrpListLock);
         InitializeListHead(&context->ServerRequestIrpList);
         InitializeListHead(&context->ServerMemoryIrpList);
         InitializeListHead(&context->ClientReceivedIrpList);
-        InitializeListHead(&context->ClientSentIrpList);
+        ImdTagTableInitialize(&context->SentRequests);
 
         context->Server = FileObject;
         context->RefCount = 1;
         FileObject->FsContext2 = context;
 
-        InsertHeadList(&FileTable, &context->ListEntry);
+        InsertHeadList(&FileTable[hash & (DEVIODRV_FILE_TABLE_BUCKETS - 1)], &context->ListEntry);
 
         FileObject->ReadAccess = TRUE;
         FileObject->WriteAccess = TRUE;
     }
 
-    InterlockedExchange(&FileTableListLock, 0);
+    ExReleaseResourceLite(&FileTableLock);
+    KeLeaveCriticalRegion();
 
     return status;
 }
@@ -216,10 +253,8 @@ NTSTATUS DevIoDrvCloseFileTableEntry(PFILE_OBJECT FileObject)
 {
     PAGED_CODE();
 
-    if (InterlockedExchange(&FileTableListLock, 1) != 0)
-    {
-        return STATUS_RESOURCE_IN_USE;
-    }
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&FileTableLock, TRUE);
 
     POBJECT_CONTEXT context = (POBJECT_CONTEXT)FileObject->FsContext2;
 
@@ -236,7 +271,8 @@ NTSTATUS DevIoDrvCloseFileTableEntry(PFILE_OBJECT FileObject)
     {
         KdPrint(("Reference to file '%wZ' closing. Not last reference.\n", &context->Name));
 
-        InterlockedExchange(&FileTableListLock, 0);
+        ExReleaseResourceLite(&FileTableLock);
+        KeLeaveCriticalRegion();
         return STATUS_SUCCESS;
     }
 
@@ -246,10 +282,16 @@ NTSTATUS DevIoDrvCloseFileTableEntry(PFILE_OBJECT FileObject)
 
     FileObject->FsContext2 = NULL;
 
-    InterlockedExchange(&FileTableListLock, 0);
+    ExReleaseResourceLite(&FileTableLock);
+    KeLeaveCriticalRegion();
 
     ExFreePoolWithTag(context->Name.Buffer, POOL_TAG);
 
+    if (context->SentRequests.slots != NULL)
+    {
+        ExFreePoolWithTag(context->SentRequests.slots, POOL_TAG);
+    }
+
     ExFreePoolWithTag(context, POOL_TAG);
 
     return STATUS_SUCCESS;
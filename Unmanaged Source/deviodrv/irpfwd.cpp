@@ -130,14 +130,17 @@ DevIoDrvCancelAll(PFILE_OBJECT FileObject,
         DevIoDrvCompleteIrpQueueItem(item, STATUS_DEVICE_DOES_NOT_EXIST, 0, &raised_irql);
     }
 
-    while (!IsListEmpty(&context->ClientSentIrpList))
+    for (ULONG slot = 0; slot < context->SentRequests.capacity; slot++)
     {
-        PLIST_ENTRY entry = context->ClientSentIrpList.Flink;
-        PIRP_QUEUE_ITEM item = CONTAINING_RECORD(entry, IRP_QUEUE_ITEM, ListEntry);
+        if (context->SentRequests.slots[slot].item == NULL)
+        {
+            continue;
+        }
 
-        KdPrint(("Canceling processed client IRP=%p\n", item->Irp));
+        PIRP_QUEUE_ITEM item = (PIRP_QUEUE_ITEM)
+            ImdTagTableRemoveSlot(&context->SentRequests, slot);
 
-        RemoveEntryList(entry);
+        KdPrint(("Canceling processed client IRP=%p\n", item->Irp));
 
         DevIoDrvCompleteIrpQueueItem(item, STATUS_DEVICE_DOES_NOT_EXIST, 0, &raised_irql);
     }
@@ -147,32 +150,108 @@ DevIoDrvCancelAll(PFILE_OBJECT FileObject,
     return STATUS_SUCCESS;
 }
 
-PIRP_QUEUE_ITEM
-DevIoDrvGetSentClientRequest(POBJECT_CONTEXT File,
-    ULONGLONG Tag,
+NTSTATUS
+DevIoDrvInsertSentClientRequest(POBJECT_CONTEXT File,
+    PIRP_QUEUE_ITEM Item,
+    PULONGLONG Tag,
     PKIRQL LowestAssumedIrql)
 {
     KLOCK_QUEUE_HANDLE lock_handle;
 
-    PIRP_QUEUE_ITEM found_item = NULL;
-
     ImScsiAcquireLock(&File->IrpListLock, &lock_handle, *LowestAssumedIrql);
 
-    for (PLIST_ENTRY entry = File->ClientSentIrpList.Flink; entry != &File->ClientSentIrpList; entry = entry->Flink)
+    if (ImdTagTableIsFull(&File->SentRequests))
     {
-        if ((ULONGLONG)(ULONG_PTR)entry == Tag)
+        // Table is full, double it. Slot numbers stay the same, so tags
+        // already sent to server are still valid.
+        ULONG new_capacity = ImdTagTableNextCapacity(&File->SentRequests);
+
+        PIMD_TAG_SLOT new_slots = NULL;
+
+        if (new_capacity != 0)
         {
-            RemoveEntryList(entry);
-            found_item = CONTAINING_RECORD(entry, IRP_QUEUE_ITEM, ListEntry);
-            break;
+            new_slots = (PIMD_TAG_SLOT)ExAllocatePoolWithTag(NonPagedPool,
+                new_capacity * sizeof(IMD_TAG_SLOT), POOL_TAG);
+        }
+
+        if (new_slots == NULL)
+        {
+            ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        PIMD_TAG_SLOT old_slots = ImdTagTableGrow(&File->SentRequests,
+            new_slots, new_capacity);
+
+        if (old_slots != NULL)
+        {
+            ExFreePoolWithTag(old_slots, POOL_TAG);
         }
     }
 
+    *Tag = ImdTagTableInsert(&File->SentRequests, Item);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return STATUS_SUCCESS;
+}
+
+PIRP_QUEUE_ITEM
+DevIoDrvGetSentClientRequest(POBJECT_CONTEXT File,
+    ULONGLONG Tag,
+    PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    ImScsiAcquireLock(&File->IrpListLock, &lock_handle, *LowestAssumedIrql);
+
+    // Tags from server are not trusted. Stale ones, for requests that have
+    // already been completed or cancelled, have wrong generation.
+    PIRP_QUEUE_ITEM found_item = (PIRP_QUEUE_ITEM)
+        ImdTagTableRemove(&File->SentRequests, Tag);
+
     ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
 
     return found_item;
 }
 
+//
+// Puts a client request, already marked pending, in table of requests sent
+// to server and stores its io_tag in server buffer. If that fails, both
+// requests are completed and FALSE is returned.
+//
+BOOLEAN
+DevIoDrvTagClientRequest(POBJECT_CONTEXT File,
+    PIRP_QUEUE_ITEM ClientItem,
+    PIRP_QUEUE_ITEM ServerItem,
+    NTSTATUS *ClientStatus,
+    NTSTATUS *ServerStatus,
+    PKIRQL LowestAssumedIrql)
+{
+    ULONGLONG tag;
+
+    NTSTATUS status = DevIoDrvInsertSentClientRequest(File, ClientItem, &tag, LowestAssumedIrql);
+
+    if (!NT_SUCCESS(status))
+    {
+        DevIoDrvCompleteIrpQueueItem(ClientItem, status, 0, LowestAssumedIrql);
+        DevIoDrvCompleteIrpQueueItem(ServerItem, status, 0, LowestAssumedIrql);
+
+        *ClientStatus = STATUS_PENDING;
+        *ServerStatus = status;
+
+        return FALSE;
+    }
+
+    ServerItem->MappedBuffer->io_tag = tag;
+
+    KdPrint(("Sending client IRP=%p to server IRP=%p. I/O tag = %#I64x\n",
+        ClientItem->Irp, ServerItem->Irp, tag));
+
+    return TRUE;
+}
+
 void
 DevIoDrvCompleteIrpQueueItem(PIRP_QUEUE_ITEM Item,
     NTSTATUS Status,
@@ -385,6 +464,180 @@ DevIoDrvDispatchServerLockMemory(PIRP Irp,
     return STATUS_PENDING;
 }
 
+//
+// Completes a client request with a server response. If response does not
+// match request, client request is completed with an I/O error and
+// STATUS_INVALID_PARAMETER is returned.
+//
+NTSTATUS
+DevIoDrvCompleteClientRequest(PIRP_QUEUE_ITEM ClientItem,
+    ULONGLONG RequestCode,
+    ULONGLONG ErrorNo,
+    ULONGLONG Length,
+    PUCHAR Data,
+    ULONGLONG DataSize,
+    PKIRQL LowestAssumedIrql)
+{
+    PIO_STACK_LOCATION io_stack_client = IoGetCurrentIrpStackLocation(ClientItem->Irp);
+
+    ULONG_PTR client_length = 0;
+
+    if (io_stack_client->MajorFunction == IRP_MJ_READ &&
+        RequestCode == IMDPROXY_REQ_READ &&
+        io_stack_client->Parameters.Read.Length >= Length &&
+        DataSize >= Length)
+    {
+        KdPrint(("IRP=%p IMDPROXY_REQ_READ.\n", ClientItem->Irp));
+
+        if (Length > 0)
+        {
+            PVOID client_buffer = MmGetSystemAddressForMdlSafe(ClientItem->Irp->MdlAddress, NormalPagePriority);
+
+            if (client_buffer == NULL)
+            {
+                DevIoDrvCompleteIrpQueueItem(ClientItem, STATUS_INSUFFICIENT_RESOURCES, 0, LowestAssumedIrql);
+
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            RtlCopyMemory(client_buffer, Data, (SIZE_T)Length);
+        }
+
+        client_length = (ULONG_PTR)Length;
+    }
+    else if (io_stack_client->MajorFunction == IRP_MJ_WRITE &&
+        RequestCode == IMDPROXY_REQ_WRITE &&
+        io_stack_client->Parameters.Write.Length >= Length)
+    {
+        KdPrint(("IRP=%p IMDPROXY_REQ_WRITE.\n", ClientItem->Irp));
+
+        client_length = (ULONG_PTR)Length;
+    }
+    else if (io_stack_client->MajorFunction == IRP_MJ_FILE_SYSTEM_CONTROL &&
+        RequestCode == IMDPROXY_REQ_ZERO &&
+        io_stack_client->Parameters.FileSystemControl.FsControlCode == FSCTL_SET_ZERO_DATA)
+    {
+        KdPrint(("IRP=%p IMDPROXY_REQ_ZERO.\n", ClientItem->Irp));
+    }
+    else if (io_stack_client->MajorFunction == IRP_MJ_FILE_SYSTEM_CONTROL &&
+        RequestCode == IMDPROXY_REQ_UNMAP &&
+        io_stack_client->Parameters.FileSystemControl.FsControlCode == FSCTL_FILE_LEVEL_TRIM)
+    {
+        KdPrint(("IRP=%p IMDPROXY_REQ_UNMAP.\n", ClientItem->Irp));
+
+        if (ErrorNo == 0)
+        {
+            if (io_stack_client->Parameters.FileSystemControl.OutputBufferLength >=
+                sizeof(FILE_LEVEL_TRIM_OUTPUT))
+            {
+                PFILE_LEVEL_TRIM in_buffer = (PFILE_LEVEL_TRIM)ClientItem->Irp->AssociatedIrp.SystemBuffer;
+                PFILE_LEVEL_TRIM_OUTPUT out_buffer = (PFILE_LEVEL_TRIM_OUTPUT)ClientItem->Irp->AssociatedIrp.SystemBuffer;
+                out_buffer->NumRangesProcessed = in_buffer->NumRanges;
+            }
+
+            client_length = sizeof(FILE_LEVEL_TRIM_OUTPUT);
+        }
+    }
+    else
+    {
+        DevIoDrvCompleteIrpQueueItem(ClientItem, STATUS_IO_DEVICE_ERROR, 0, LowestAssumedIrql);
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KIRQL irql;
+
+    KeRaiseIrql(APC_LEVEL, &irql);
+
+    KIRQL new_irql = APC_LEVEL;
+
+    if (ErrorNo == 0)
+    {
+        DevIoDrvCompleteIrpQueueItem(ClientItem, STATUS_SUCCESS, client_length, &new_irql);
+    }
+    else
+    {
+        DevIoDrvCompleteIrpQueueItem(ClientItem, STATUS_IO_DEVICE_ERROR, client_length, &new_irql);
+    }
+
+    KeLowerIrql(irql);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Sends next waiting client request to server, or queues server request
+// until a client request arrives. BatchMaxEntries is zero for
+// IOCTL_DEVIODRV_EXCHANGE_IO.
+//
+NTSTATUS
+DevIoDrvQueueServerRequest(POBJECT_CONTEXT Context,
+    PIRP Irp,
+    PIRP_QUEUE_ITEM MemoryIrp,
+    PIMDPROXY_DEVIODRV_BUFFER_HEADER Buffer,
+    ULONG BufferSize,
+    ULONG BatchMaxEntries,
+    PKIRQL LowestAssumedIrql)
+{
+    PIRP_QUEUE_ITEM server_item = (PIRP_QUEUE_ITEM)ExAllocatePoolWithTag(NonPagedPool, sizeof IRP_QUEUE_ITEM, POOL_TAG);
+
+    if (server_item == NULL)
+    {
+        DevIoDrvCompleteIrp(Irp, STATUS_INSUFFICIENT_RESOURCES, 0);
+        DevIoDrvQueueMemoryIrp(MemoryIrp, Context, LowestAssumedIrql);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(server_item, sizeof *server_item);
+
+    server_item->Irp = Irp;
+    server_item->BatchMaxEntries = BatchMaxEntries;
+
+    KLOCK_QUEUE_HANDLE lock_handle;
+    ImScsiAcquireLock(&Context->IrpListLock, &lock_handle, *LowestAssumedIrql);
+
+    PLIST_ENTRY entry = RemoveHeadList(&Context->ClientReceivedIrpList);
+
+    if (entry == &Context->ClientReceivedIrpList)
+    {
+        KdPrint(("IRP=%p No client request available. Queuing server IRP.\n", Irp));
+
+        KIRQL cancel_irql;
+
+        IoAcquireCancelSpinLock(&cancel_irql);
+
+        DevIoDrvQueueMemoryIrpUnsafe(MemoryIrp, Context);
+
+        IoSetCancelRoutine(Irp, DevIoDrvServerIrpCancelRoutine);
+
+        IoMarkIrpPending(Irp);
+
+        InsertTailList(&Context->ServerRequestIrpList, &server_item->ListEntry);
+
+        IoReleaseCancelSpinLock(cancel_irql);
+
+        ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+        return STATUS_PENDING;
+    }
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    server_item->MemoryIrp = MemoryIrp;
+    server_item->MappedBuffer = Buffer;
+    server_item->MappedBufferSize = BufferSize;
+
+    KdPrint(("IRP=%p Client request found. Completing server request in-thread.\n",
+        Irp));
+
+    PIRP_QUEUE_ITEM client_item = CONTAINING_RECORD(entry, IRP_QUEUE_ITEM, ListEntry);
+
+    NTSTATUS client_status, server_status;
+    DevIoDrvSendClientRequestToServer(Context, client_item, server_item, &client_status, &server_status, LowestAssumedIrql);
+
+    return server_status;
+}
+
 NTSTATUS
 DevIoDrvDispatchServerIORequest(PIRP Irp,
     PKIRQL LowestAssumedIrql)
@@ -421,6 +674,18 @@ DevIoDrvDispatchServerIORequest(PIRP Irp,
         return status;
     }
 
+    // Memory locked earlier with IOCTL_DEVIODRV_LOCK_MEMORY can be smaller
+    // than the check of output buffer length above.
+    if (buffer_size < IMDPROXY_HEADER_SIZE)
+    {
+        KdPrint((__FUNCTION__ ": IRP=%p Locked buffer too small: %u.\n",
+            Irp, buffer_size));
+
+        DevIoDrvCompleteIrp(Irp, STATUS_BUFFER_TOO_SMALL, 0);
+        DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
     KdPrint(("IRP=%p I/O tag %#I64x, request code %#I64x flags %#I64x.\n",
         Irp, buffer->io_tag, buffer->request_code, buffer->flags));
 
@@ -446,9 +711,18 @@ DevIoDrvDispatchServerIORequest(PIRP Irp,
             Irp, client_item->Irp));
     }
 
-    PIMDPROXY_READ_RESP read_write_response = (PIMDPROXY_READ_RESP)(buffer + 1);
+    if (client_item != NULL)
+    {
+        // Zero and unmap responses only have errorno, length is not used
+        // for those.
+        PIMDPROXY_READ_RESP response = (PIMDPROXY_READ_RESP)(buffer + 1);
 
-    if (client_item == NULL && buffer->request_code == IMDPROXY_REQ_INFO)
+        status = DevIoDrvCompleteClientRequest(client_item, buffer->request_code,
+            response->errorno, response->length,
+            ((PUCHAR)buffer) + IMDPROXY_HEADER_SIZE, buffer_size - IMDPROXY_HEADER_SIZE,
+            LowestAssumedIrql);
+    }
+    else if (buffer->request_code == IMDPROXY_REQ_INFO)
     {
         KdPrint(("IRP=%p IMDPROXY_REQ_INFO.\n",
             Irp));
@@ -458,220 +732,358 @@ DevIoDrvDispatchServerIORequest(PIRP Irp,
         context->AlignmentRequirement = (ULONG)(response->req_alignment - 1);
         context->ServiceFlags = response->flags;
     }
-    else if (client_item != NULL &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->MajorFunction == IRP_MJ_READ &&
-        buffer->request_code == IMDPROXY_REQ_READ &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->Parameters.Read.Length >= read_write_response->length &&
-        buffer_size >= IMDPROXY_HEADER_SIZE + read_write_response->length)
+    else if (buffer->request_code == IMDPROXY_REQ_NULL)
     {
-        KdPrint(("IRP=%p IMDPROXY_REQ_READ.\n", Irp));
+        // no response here, just wants next request
 
-        PIMDPROXY_READ_RESP response = (PIMDPROXY_READ_RESP)(buffer + 1);
+        KdPrint(("IRP=%p IMDPROXY_REQ_NULL.\n",
+            Irp));
+    }
+    else
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
 
-        if (response->length > 0)
-        {
-            PVOID client_buffer = MmGetSystemAddressForMdlSafe(client_item->Irp->MdlAddress, NormalPagePriority);
+    if (status == STATUS_INVALID_PARAMETER)
+    {
+        DbgPrint("IRP=%p Bad server request.\n", Irp);
 
-            if (client_buffer == NULL)
-            {
-                DevIoDrvCompleteIrpQueueItem(client_item, STATUS_INSUFFICIENT_RESOURCES, 0, LowestAssumedIrql);
-                DevIoDrvCompleteIrp(Irp, STATUS_INSUFFICIENT_RESOURCES, 0);
-                DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
+#if DBG
+        if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
+            DbgBreakPoint();
+#endif
+    }
 
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
+    if (!NT_SUCCESS(status))
+    {
+        DevIoDrvCompleteIrp(Irp, status, 0);
+        DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
+        return status;
+    }
 
-            RtlCopyMemory(client_buffer, ((PUCHAR)buffer) + IMDPROXY_HEADER_SIZE, (SIZE_T)response->length);
-        }
+    return DevIoDrvQueueServerRequest(context, Irp, memory_irp, buffer, buffer_size, 0, LowestAssumedIrql);
+}
 
-        KIRQL irql;
+NTSTATUS
+DevIoDrvDispatchServerBatchRequest(PIRP Irp,
+    PKIRQL LowestAssumedIrql)
+{
+    PIO_STACK_LOCATION io_stack = IoGetCurrentIrpStackLocation(Irp);
+    POBJECT_CONTEXT context = DevIoDrvGetContext(io_stack);
 
-        KeRaiseIrql(APC_LEVEL, &irql);
+    KdPrint(("IRP=%p Server batch I/O request.\n", Irp));
 
-        KIRQL new_irql = APC_LEVEL;
+    if (io_stack->Parameters.DeviceIoControl.OutputBufferLength > 0 &&
+        io_stack->Parameters.DeviceIoControl.OutputBufferLength < IMDPROXY_HEADER_SIZE)
+    {
+        KdPrint((__FUNCTION__ ": IRP=%p Buffer too small: %u.\n",
+            Irp, io_stack->Parameters.DeviceIoControl.OutputBufferLength));
 
-        if (response->errorno == 0)
-        {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_SUCCESS, (ULONG_PTR)response->length, &new_irql);
-        }
-        else
-        {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_IO_DEVICE_ERROR, (ULONG_PTR)response->length, &new_irql);
-        }
+        DevIoDrvCompleteIrp(Irp, STATUS_BUFFER_TOO_SMALL, 0);
 
-        KeLowerIrql(irql);
+        return STATUS_BUFFER_TOO_SMALL;
     }
-    else if (client_item != NULL &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->MajorFunction == IRP_MJ_WRITE &&
-        buffer->request_code == IMDPROXY_REQ_WRITE &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->Parameters.Write.Length >= read_write_response->length)
+
+    PIRP_QUEUE_ITEM memory_irp;
+    PIMDPROXY_DEVIODRV_BUFFER_HEADER buffer;
+    ULONG buffer_size;
+
+    NTSTATUS status = DevIoDrvReserveMemoryIrp(Irp, &memory_irp, &buffer, &buffer_size, LowestAssumedIrql);
+
+    if (!NT_SUCCESS(status))
     {
-        KdPrint(("IRP=%p IMDPROXY_REQ_WRITE.\n",
-            Irp));
+        KdPrint(("IRP=%p Failed getting direct I/O address. %#x\n",
+            Irp, status));
 
-        PIMDPROXY_WRITE_RESP response = (PIMDPROXY_WRITE_RESP)(buffer + 1);
+        DevIoDrvCompleteIrp(Irp, status, 0);
 
-        KIRQL irql;
+        return status;
+    }
 
-        KeRaiseIrql(APC_LEVEL, &irql);
+    if (buffer_size < IMDPROXY_HEADER_SIZE)
+    {
+        KdPrint((__FUNCTION__ ": IRP=%p Locked buffer too small: %u.\n",
+            Irp, buffer_size));
 
-        KIRQL new_irql = APC_LEVEL;
+        DevIoDrvCompleteIrp(Irp, STATUS_BUFFER_TOO_SMALL, 0);
+        DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
-        if (response->errorno == 0)
-        {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_SUCCESS, (ULONG_PTR)response->length, &new_irql);
-        }
-        else
-        {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_IO_DEVICE_ERROR, (ULONG_PTR)response->length, &new_irql);
-        }
+    // Buffer is shared with server, so header and each entry are read once
+    // before they are checked and used.
+    PIMDPROXY_DEVIODRV_BATCH_HEADER batch = (PIMDPROXY_DEVIODRV_BATCH_HEADER)buffer;
+    PIMDPROXY_DEVIODRV_BATCH_ENTRY entries = (PIMDPROXY_DEVIODRV_BATCH_ENTRY)(batch + 1);
+
+    ULONG max_entries = batch->max_entries;
+    ULONG entry_count = batch->entry_count;
+
+    if (!ImdBatchCheckHeader(max_entries, entry_count, buffer_size))
+    {
+        KdPrint(("IRP=%p Bad batch header, %u of %u entries.\n",
+            Irp, entry_count, max_entries));
 
-        KeLowerIrql(irql);
+        DevIoDrvCompleteIrp(Irp, STATUS_INVALID_PARAMETER, 0);
+        DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
+        return STATUS_INVALID_PARAMETER;
     }
-    else if (client_item != NULL &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->MajorFunction == IRP_MJ_FILE_SYSTEM_CONTROL &&
-        buffer->request_code == IMDPROXY_REQ_ZERO &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->Parameters.FileSystemControl.FsControlCode == FSCTL_SET_ZERO_DATA)
+
+    KdPrint(("IRP=%p %u responses, room for %u requests.\n",
+        Irp, entry_count, max_entries));
+
+    for (ULONG i = 0; i < entry_count; i++)
     {
-        KdPrint(("IRP=%p IMDPROXY_REQ_ZERO.\n",
-            Irp));
+        IMDPROXY_DEVIODRV_BATCH_ENTRY entry = entries[i];
 
-        PIMDPROXY_ZERO_RESP response = (PIMDPROXY_ZERO_RESP)(buffer + 1);
+        if (entry.io_tag == 0 && entry.request_code == IMDPROXY_REQ_NULL)
+        {
+            continue;
+        }
 
-        KIRQL irql;
+        PIRP_QUEUE_ITEM client_item = DevIoDrvGetSentClientRequest(context, entry.io_tag, LowestAssumedIrql);
 
-        KeRaiseIrql(APC_LEVEL, &irql);
+        if (client_item == NULL)
+        {
+            KdPrint(("IRP=%p Error finding client request with tag %#I64x.\n",
+                Irp, entry.io_tag));
+
+            status = STATUS_INVALID_PARAMETER;
 
-        KIRQL new_irql = APC_LEVEL;
+            continue;
+        }
 
-        if (response->errorno == 0)
+        PUCHAR data = NULL;
+        ULONGLONG data_size = ImdBatchResponseDataSize(entry.data_offset, buffer_size);
+
+        if (data_size > 0)
         {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_SUCCESS, 0, &new_irql);
+            data = ((PUCHAR)buffer) + entry.data_offset;
         }
-        else
+
+        // Other failures only affect the client request and have already
+        // been reported to client.
+        if (DevIoDrvCompleteClientRequest(client_item, entry.request_code,
+            entry.errorno, entry.length, data, data_size,
+            LowestAssumedIrql) == STATUS_INVALID_PARAMETER)
         {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_IO_DEVICE_ERROR, 0, &new_irql);
+            DbgPrint("IRP=%p Bad server response with tag %#I64x.\n",
+                Irp, entry.io_tag);
+
+            status = STATUS_INVALID_PARAMETER;
         }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        DevIoDrvCompleteIrp(Irp, status, 0);
+        DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
+        return status;
+    }
+
+    return DevIoDrvQueueServerRequest(context, Irp, memory_irp, buffer, buffer_size, max_entries, LowestAssumedIrql);
+}
+
+//
+// Formats a client request as an entry in a batch buffer, with its data at
+// DataEnd, and puts it in table of requests sent to server. Returns
+// STATUS_BUFFER_TOO_SMALL if request does not fit, without touching client
+// request. Client request is completed on other failures.
+//
+NTSTATUS
+DevIoDrvFormatBatchEntry(POBJECT_CONTEXT File,
+    PIRP_QUEUE_ITEM ClientItem,
+    PIRP_QUEUE_ITEM ServerItem,
+    PIMDPROXY_DEVIODRV_BATCH_ENTRY Entry,
+    PULONGLONG DataEnd,
+    PKIRQL LowestAssumedIrql)
+{
+    PIO_STACK_LOCATION io_stack_client = IoGetCurrentIrpStackLocation(ClientItem->Irp);
+
+    PUCHAR data = ((PUCHAR)ServerItem->MappedBuffer) + *DataEnd;
+
+    ULONGLONG request_code;
+    ULONGLONG offset = 0;
+    ULONGLONG length;
 
-        KeLowerIrql(irql);
+    if (io_stack_client->MajorFunction == IRP_MJ_READ)
+    {
+        request_code = IMDPROXY_REQ_READ;
+        offset = io_stack_client->Parameters.Read.ByteOffset.QuadPart;
+        length = io_stack_client->Parameters.Read.Length;
     }
-    else if (client_item != NULL &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->MajorFunction == IRP_MJ_FILE_SYSTEM_CONTROL &&
-        buffer->request_code == IMDPROXY_REQ_UNMAP &&
-        IoGetCurrentIrpStackLocation(client_item->Irp)->Parameters.FileSystemControl.FsControlCode == FSCTL_FILE_LEVEL_TRIM)
+    else if (io_stack_client->MajorFunction == IRP_MJ_WRITE)
     {
-        KdPrint(("IRP=%p IMDPROXY_REQ_UNMAP.\n",
-            Irp));
+        request_code = IMDPROXY_REQ_WRITE;
+        offset = io_stack_client->Parameters.Write.ByteOffset.QuadPart;
+        length = io_stack_client->Parameters.Write.Length;
+    }
+    else if (io_stack_client->MajorFunction == IRP_MJ_FILE_SYSTEM_CONTROL &&
+        io_stack_client->Parameters.FileSystemControl.FsControlCode == FSCTL_SET_ZERO_DATA)
+    {
+        request_code = IMDPROXY_REQ_ZERO;
+        length = sizeof DEVICE_DATA_SET_RANGE;
+    }
+    else if (io_stack_client->MajorFunction == IRP_MJ_FILE_SYSTEM_CONTROL &&
+        io_stack_client->Parameters.FileSystemControl.FsControlCode == FSCTL_FILE_LEVEL_TRIM)
+    {
+        PFILE_LEVEL_TRIM trim_info = (PFILE_LEVEL_TRIM)ClientItem->Irp->AssociatedIrp.SystemBuffer;
 
-        PIMDPROXY_UNMAP_RESP response = (PIMDPROXY_UNMAP_RESP)(buffer + 1);
+        request_code = IMDPROXY_REQ_UNMAP;
+        length = trim_info->NumRanges * (ULONGLONG)sizeof DEVICE_DATA_SET_RANGE;
+    }
+    else
+    {
+        DevIoDrvCompleteIrpQueueItem(ClientItem, STATUS_INTERNAL_ERROR, 0, LowestAssumedIrql);
 
-        KIRQL irql;
+        return STATUS_INTERNAL_ERROR;
+    }
 
-        KeRaiseIrql(APC_LEVEL, &irql);
+    if (!ImdBatchDataFits(*DataEnd, length, ServerItem->MappedBufferSize))
+    {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
-        KIRQL new_irql = APC_LEVEL;
+    if (request_code == IMDPROXY_REQ_WRITE && length > 0)
+    {
+        PVOID client_buffer = MmGetSystemAddressForMdlSafe(ClientItem->Irp->MdlAddress, NormalPagePriority);
 
-        if (response->errorno == 0)
+        if (client_buffer == NULL)
         {
-            if (IoGetCurrentIrpStackLocation(client_item->Irp)->Parameters.FileSystemControl.OutputBufferLength >=
-                sizeof(FILE_LEVEL_TRIM_OUTPUT))
-            {
-                PFILE_LEVEL_TRIM in_buffer = (PFILE_LEVEL_TRIM)client_item->Irp->AssociatedIrp.SystemBuffer;
-                PFILE_LEVEL_TRIM_OUTPUT out_buffer = (PFILE_LEVEL_TRIM_OUTPUT)client_item->Irp->AssociatedIrp.SystemBuffer;
-                out_buffer->NumRangesProcessed = in_buffer->NumRanges;
-            }
+            DevIoDrvCompleteIrpQueueItem(ClientItem, STATUS_INSUFFICIENT_RESOURCES, 0, LowestAssumedIrql);
 
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_SUCCESS, sizeof(FILE_LEVEL_TRIM_OUTPUT), &new_irql);
-        }
-        else
-        {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_IO_DEVICE_ERROR, 0, &new_irql);
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        KeLowerIrql(irql);
+        RtlCopyMemory(data, client_buffer, (SIZE_T)length);
     }
-    else if (client_item == NULL && buffer->request_code == IMDPROXY_REQ_NULL)
+    else if (request_code == IMDPROXY_REQ_ZERO)
     {
-        // no response here, just wants next request
+        PFILE_ZERO_DATA_INFORMATION zero_info = (PFILE_ZERO_DATA_INFORMATION)ClientItem->Irp->AssociatedIrp.SystemBuffer;
 
-        KdPrint(("IRP=%p IMDPROXY_REQ_NULL.\n",
-            Irp));
+        PDEVICE_DATA_SET_RANGE range = (PDEVICE_DATA_SET_RANGE)data;
+        range->StartingOffset = zero_info->FileOffset.QuadPart;
+        range->LengthInBytes = zero_info->BeyondFinalZero.QuadPart - zero_info->FileOffset.QuadPart;
     }
-    else
+    else if (request_code == IMDPROXY_REQ_UNMAP)
     {
-        DbgPrint("IRP=%p Bad server request.\n", Irp);
+        PFILE_LEVEL_TRIM trim_info = (PFILE_LEVEL_TRIM)ClientItem->Irp->AssociatedIrp.SystemBuffer;
 
-#if DBG
-        if (!KD_REFRESH_DEBUGGER_NOT_PRESENT)
-            DbgBreakPoint();
-#endif
+        PDEVICE_DATA_SET_RANGE range = (PDEVICE_DATA_SET_RANGE)data;
 
-        if (client_item != NULL)
+        for (ULONG i = 0; i < trim_info->NumRanges; i++)
         {
-            DevIoDrvCompleteIrpQueueItem(client_item, STATUS_IO_DEVICE_ERROR, 0, LowestAssumedIrql);
+            range[i].StartingOffset = trim_info->Ranges[i].Offset;
+            range[i].LengthInBytes = trim_info->Ranges[i].Length;
         }
-
-        DevIoDrvCompleteIrp(Irp, STATUS_INVALID_PARAMETER, 0);
-        DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
-        return STATUS_INVALID_PARAMETER;
     }
 
-    PIRP_QUEUE_ITEM server_item = (PIRP_QUEUE_ITEM)ExAllocatePoolWithTag(NonPagedPool, sizeof IRP_QUEUE_ITEM, POOL_TAG);
+    KdPrint(("Sending client IRP=%p in batch to server IRP=%p.\n",
+        ClientItem->Irp, ServerItem->Irp));
 
-    if (server_item == NULL)
+    ULONGLONG tag;
+
+    NTSTATUS status = DevIoDrvInsertSentClientRequest(File, ClientItem, &tag, LowestAssumedIrql);
+
+    if (!NT_SUCCESS(status))
     {
-        DevIoDrvCompleteIrp(Irp, STATUS_INSUFFICIENT_RESOURCES, 0);
-        DevIoDrvQueueMemoryIrp(memory_irp, context, LowestAssumedIrql);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        DevIoDrvCompleteIrpQueueItem(ClientItem, status, 0, LowestAssumedIrql);
+
+        return status;
     }
 
-    RtlZeroMemory(server_item, sizeof *server_item);
+    Entry->request_code = request_code;
+    Entry->io_tag = tag;
+    Entry->offset = offset;
+    Entry->length = length;
+    Entry->errorno = 0;
+    Entry->data_offset = *DataEnd;
 
-    server_item->Irp = Irp;
+    *DataEnd = ImdBatchNextDataOffset(*DataEnd, length, ServerItem->MappedBufferSize);
 
-    KLOCK_QUEUE_HANDLE lock_handle;
-    ImScsiAcquireLock(&context->IrpListLock, &lock_handle, *LowestAssumedIrql);
+    return STATUS_SUCCESS;
+}
+
+//
+// Fills a batch buffer with ClientItem followed by as many other waiting
+// client requests as fit, then completes server request.
+//
+void
+DevIoDrvSendClientRequestBatchToServer(POBJECT_CONTEXT File,
+    PIRP_QUEUE_ITEM ClientItem,
+    PIRP_QUEUE_ITEM ServerItem,
+    NTSTATUS *ClientStatus,
+    NTSTATUS *ServerStatus,
+    PKIRQL LowestAssumedIrql)
+{
+    PIMDPROXY_DEVIODRV_BATCH_HEADER batch = (PIMDPROXY_DEVIODRV_BATCH_HEADER)ServerItem->MappedBuffer;
+    PIMDPROXY_DEVIODRV_BATCH_ENTRY entries = (PIMDPROXY_DEVIODRV_BATCH_ENTRY)(batch + 1);
 
-    PLIST_ENTRY entry = RemoveHeadList(&context->ClientReceivedIrpList);
+    ULONG max_entries = ServerItem->BatchMaxEntries;
+    ULONGLONG data_end = IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(max_entries);
+    ULONG entry_count = 0;
 
-    if (entry == &context->ClientReceivedIrpList)
+    NTSTATUS status = STATUS_SUCCESS;
+
+    IoMarkIrpPending(ClientItem->Irp);
+
+    *ClientStatus = STATUS_PENDING;
+
+    // Memory IRP may have been replaced since server request was checked
+    if (data_end > ServerItem->MappedBufferSize)
     {
-        KdPrint(("IRP=%p No client request available. Queuing server IRP.\n", Irp));
+        status = STATUS_BUFFER_TOO_SMALL;
 
-        KIRQL cancel_irql;
+        ImScsiInterlockedInsertHeadList(&File->ClientReceivedIrpList, &ClientItem->ListEntry, &File->IrpListLock, LowestAssumedIrql);
 
-        IoAcquireCancelSpinLock(&cancel_irql);
+        ClientItem = NULL;
+    }
 
-        DevIoDrvQueueMemoryIrpUnsafe(memory_irp, context);
+    while (ClientItem != NULL)
+    {
+        status = DevIoDrvFormatBatchEntry(File, ClientItem, ServerItem,
+            &entries[entry_count], &data_end, LowestAssumedIrql);
 
-        IoSetCancelRoutine(Irp, DevIoDrvServerIrpCancelRoutine);
+        if (status == STATUS_BUFFER_TOO_SMALL)
+        {
+            ImScsiInterlockedInsertHeadList(&File->ClientReceivedIrpList, &ClientItem->ListEntry, &File->IrpListLock, LowestAssumedIrql);
 
-        IoMarkIrpPending(Irp);
+            break;
+        }
 
-        InsertTailList(&context->ServerRequestIrpList, &server_item->ListEntry);
+        if (NT_SUCCESS(status))
+        {
+            entry_count++;
+        }
 
-        IoReleaseCancelSpinLock(cancel_irql);
+        if (entry_count == max_entries)
+        {
+            break;
+        }
 
-        ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+        PLIST_ENTRY entry = ImScsiInterlockedRemoveHeadList(&File->ClientReceivedIrpList, &File->IrpListLock, LowestAssumedIrql);
 
-        return STATUS_PENDING;
+        ClientItem = entry != NULL
+            ? CONTAINING_RECORD(entry, IRP_QUEUE_ITEM, ListEntry)
+            : NULL;
     }
 
-    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+    if (entry_count == 0 && status == STATUS_BUFFER_TOO_SMALL)
+    {
+        DevIoDrvCompleteIrpQueueItem(ServerItem, STATUS_BUFFER_TOO_SMALL, 0, LowestAssumedIrql);
 
-    server_item->MemoryIrp = memory_irp;
-    server_item->MappedBuffer = buffer;
-    server_item->MappedBufferSize = buffer_size;
+        *ServerStatus = STATUS_BUFFER_TOO_SMALL;
 
-    KdPrint(("IRP=%p Client request found. Completing server request in-thread.\n",
-        Irp));
+        return;
+    }
 
-    client_item = CONTAINING_RECORD(entry, IRP_QUEUE_ITEM, ListEntry);
+    KdPrint(("IRP=%p Sending %u requests to server.\n", ServerItem->Irp, entry_count));
 
-    NTSTATUS client_status, server_status;
-    DevIoDrvSendClientRequestToServer(context, client_item, server_item, &client_status, &server_status, LowestAssumedIrql);
+    batch->entry_count = entry_count;
+    batch->data_size = data_end;
 
-    return server_status;
+    DevIoDrvCompleteIrpQueueItem(ServerItem, STATUS_SUCCESS, (ULONG_PTR)data_end, LowestAssumedIrql);
+
+    *ServerStatus = STATUS_SUCCESS;
 }
 
 void
@@ -700,11 +1112,15 @@ DevIoDrvSendClientRequestToServer(POBJECT_CONTEXT File,
         }
     }
 
-    ServerItem->MappedBuffer->flags = 0;
-    ServerItem->MappedBuffer->io_tag = (ULONGLONG)(ULONG_PTR)&ClientItem->ListEntry;
+    if (ServerItem->BatchMaxEntries != 0)
+    {
+        DevIoDrvSendClientRequestBatchToServer(File, ClientItem, ServerItem, ClientStatus, ServerStatus, LowestAssumedIrql);
 
-    KdPrint(("Sending client IRP=%p to server IRP=%p. I/O tag = %#I64x\n",
-        ClientItem->Irp, ServerItem->Irp, ServerItem->MappedBuffer->io_tag));
+        return;
+    }
+
+    ServerItem->MappedBuffer->flags = 0;
+    ServerItem->MappedBuffer->io_tag = 0;
 
     PIO_STACK_LOCATION io_stack_client = IoGetCurrentIrpStackLocation(ClientItem->Irp);
 
@@ -732,7 +1148,10 @@ DevIoDrvSendClientRequestToServer(POBJECT_CONTEXT File,
 
         IoMarkIrpPending(ClientItem->Irp);
 
-        ImScsiInterlockedInsertTailList(&File->ClientSentIrpList, &ClientItem->ListEntry, &File->IrpListLock, LowestAssumedIrql);
+        if (!DevIoDrvTagClientRequest(File, ClientItem, ServerItem, ClientStatus, ServerStatus, LowestAssumedIrql))
+        {
+            return;
+        }
 
         DevIoDrvCompleteIrpQueueItem(ServerItem, STATUS_SUCCESS, IMDPROXY_HEADER_SIZE, LowestAssumedIrql);
 
@@ -780,7 +1199,10 @@ DevIoDrvSendClientRequestToServer(POBJECT_CONTEXT File,
 
         IoMarkIrpPending(ClientItem->Irp);
 
-        ImScsiInterlockedInsertTailList(&File->ClientSentIrpList, &ClientItem->ListEntry, &File->IrpListLock, LowestAssumedIrql);
+        if (!DevIoDrvTagClientRequest(File, ClientItem, ServerItem, ClientStatus, ServerStatus, LowestAssumedIrql))
+        {
+            return;
+        }
 
         DevIoDrvCompleteIrpQueueItem(ServerItem, STATUS_SUCCESS, IMDPROXY_HEADER_SIZE + (ULONG_PTR)io_stack_client->Parameters.Write.Length, LowestAssumedIrql);
 
@@ -816,7 +1238,10 @@ DevIoDrvSendClientRequestToServer(POBJECT_CONTEXT File,
 
         IoMarkIrpPending(ClientItem->Irp);
 
-        ImScsiInterlockedInsertTailList(&File->ClientSentIrpList, &ClientItem->ListEntry, &File->IrpListLock, LowestAssumedIrql);
+        if (!DevIoDrvTagClientRequest(File, ClientItem, ServerItem, ClientStatus, ServerStatus, LowestAssumedIrql))
+        {
+            return;
+        }
 
         DevIoDrvCompleteIrpQueueItem(ServerItem, STATUS_SUCCESS, IMDPROXY_HEADER_SIZE, LowestAssumedIrql);
 
@@ -856,7 +1281,10 @@ DevIoDrvSendClientRequestToServer(POBJECT_CONTEXT File,
 
         IoMarkIrpPending(ClientItem->Irp);
 
-        ImScsiInterlockedInsertTailList(&File->ClientSentIrpList, &ClientItem->ListEntry, &File->IrpListLock, LowestAssumedIrql);
+        if (!DevIoDrvTagClientRequest(File, ClientItem, ServerItem, ClientStatus, ServerStatus, LowestAssumedIrql))
+        {
+            return;
+        }
 
         DevIoDrvCompleteIrpQueueItem(ServerItem, STATUS_SUCCESS, IMDPROXY_HEADER_SIZE, LowestAssumedIrql);
 
@@ -984,7 +1412,8 @@ DevIoDrvServerIrpCancelRoutine(PDEVICE_OBJECT, PIRP Irp)
 
     PLIST_ENTRY irp_list = NULL;
 
-    if (io_stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_DEVIODRV_EXCHANGE_IO)
+    if (io_stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_DEVIODRV_EXCHANGE_IO ||
+        io_stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_DEVIODRV_EXCHANGE_IO_BATCH)
     {
         irp_list = &context->ServerRequestIrpList;
     }
@@ -0,0 +1,457 @@
+/// filetable_test.cpp
+/// Tests for the hashed file table in ../filetable.cpp, compiled unchanged
+/// against the host stand-ins in kmshim. Checks open, create and close
+/// rules for server and client file objects, allocation failures, and runs
+/// threads that open and close objects for a small set of names at the
+/// same time, checking that each name has at most one server and one
+/// client and that nothing is leaked.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include "../filetable.cpp"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define FILE_TABLE_TEST_READ_ATTRIBUTES 0x0080
+
+long kmshim_pool_outstanding = 0;
+long kmshim_pool_fail_countdown = 0;
+__thread LONG kmshim_critical_region = 0;
+
+void
+DevIoDrvInitializeSpinLock(PKSPIN_LOCK Lock)
+{
+    *Lock = 0;
+}
+
+///
+/// File object with its own copy of a name.
+///
+struct FileTableTestObject
+{
+    FILE_OBJECT file_object;
+    std::vector<WCHAR> name;
+
+    explicit FileTableTestObject(const std::string &Name) :
+        name(Name.begin(), Name.end())
+    {
+        memset(&file_object, 0, sizeof file_object);
+        file_object.FileName.Buffer = name.data();
+        file_object.FileName.Length =
+            file_object.FileName.MaximumLength =
+            (USHORT)(name.size() * sizeof(WCHAR));
+    }
+};
+
+static void
+FileTableTestInitialize()
+{
+    for (ULONG i = 0; i < DEVIODRV_FILE_TABLE_BUCKETS; i++)
+    {
+        InitializeListHead(&FileTable[i]);
+    }
+
+    ExInitializeResourceLite(&FileTableLock);
+}
+
+static bool
+FileTableTestEmpty()
+{
+    for (ULONG i = 0; i < DEVIODRV_FILE_TABLE_BUCKETS; i++)
+    {
+        if (!IsListEmpty(&FileTable[i]))
+        {
+            return false;
+        }
+    }
+
+    return kmshim_pool_outstanding == 0;
+}
+
+static void
+TestCreateOpenClose()
+{
+    FileTableTestObject server("\\image1");
+    FileTableTestObject server2("\\IMAGE1");
+    FileTableTestObject client("\\Image1");
+    FileTableTestObject client2("\\image1");
+    FileTableTestObject attributes("\\image1");
+    FileTableTestObject missing("\\image2");
+
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&client.file_object,
+        GENERIC_READ) == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server.file_object) ==
+        STATUS_SUCCESS);
+
+    POBJECT_CONTEXT context = (POBJECT_CONTEXT)server.file_object.FsContext2;
+    IMTEST_CHECK(context != NULL && context->RefCount == 1);
+    IMTEST_CHECK(context->Server == &server.file_object);
+
+    // Names compare without case
+    IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server2.file_object) ==
+        STATUS_OBJECT_NAME_COLLISION);
+
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&missing.file_object,
+        GENERIC_READ) == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    // Attributes are not available until server has sent info
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&attributes.file_object,
+        FILE_TABLE_TEST_READ_ATTRIBUTES) == STATUS_OBJECT_NAME_NOT_FOUND);
+    IMTEST_CHECK(context->RefCount == 1);
+
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&client.file_object,
+        GENERIC_READ | GENERIC_WRITE) == STATUS_SUCCESS);
+    IMTEST_CHECK(client.file_object.FsContext2 == context);
+    IMTEST_CHECK(context->Client == &client.file_object);
+    IMTEST_CHECK(client.file_object.ReadAccess && client.file_object.WriteAccess);
+    IMTEST_CHECK(context->RefCount == 2);
+
+    // Only one client
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&client2.file_object,
+        GENERIC_READ) == STATUS_SHARING_VIOLATION);
+    IMTEST_CHECK(context->RefCount == 2);
+    IMTEST_CHECK(context->Client == &client.file_object);
+
+    context->FileSize.QuadPart = 1 << 20;
+
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&attributes.file_object,
+        FILE_TABLE_TEST_READ_ATTRIBUTES) == STATUS_SUCCESS);
+    IMTEST_CHECK(context->RefCount == 3);
+    IMTEST_CHECK(!attributes.file_object.ReadAccess);
+
+    // Server goes away first, entry stays until client closes
+    DevIoDrvCloseFileTableEntry(&server.file_object);
+    IMTEST_CHECK(context->Server == NULL && context->RefCount == 2);
+    IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server2.file_object) ==
+        STATUS_OBJECT_NAME_COLLISION);
+
+    DevIoDrvCloseFileTableEntry(&attributes.file_object);
+
+    // No new client for an entry without server, even when reference
+    // count is back to where a client would come next
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&client2.file_object,
+        GENERIC_READ) == STATUS_SHARING_VIOLATION);
+    IMTEST_CHECK(context->Client == &client.file_object);
+
+    DevIoDrvCloseFileTableEntry(&client.file_object);
+    IMTEST_CHECK(FileTableTestEmpty());
+
+    // Name can be used again
+    IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server2.file_object) ==
+        STATUS_SUCCESS);
+    DevIoDrvCloseFileTableEntry(&server2.file_object);
+
+    IMTEST_CHECK(FileTableTestEmpty());
+    IMTEST_CHECK(kmshim_critical_region == 0);
+}
+
+static void
+TestAttributesBeforeClient()
+{
+    FileTableTestObject server("\attr");
+    FileTableTestObject attributes("\attr");
+    FileTableTestObject client("\attr");
+
+    IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server.file_object) ==
+        STATUS_SUCCESS);
+
+    POBJECT_CONTEXT context = (POBJECT_CONTEXT)server.file_object.FsContext2;
+    context->FileSize.QuadPart = 4096;
+
+    // Open attribute query does not take client side
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&attributes.file_object,
+        FILE_TABLE_TEST_READ_ATTRIBUTES) == STATUS_SUCCESS);
+    IMTEST_CHECK(context->Client == NULL);
+
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&client.file_object,
+        GENERIC_READ) == STATUS_SUCCESS);
+    IMTEST_CHECK(context->Client == &client.file_object);
+
+    DevIoDrvCloseFileTableEntry(&attributes.file_object);
+    IMTEST_CHECK(context->Client == &client.file_object);
+
+    DevIoDrvCloseFileTableEntry(&client.file_object);
+    DevIoDrvCloseFileTableEntry(&server.file_object);
+
+    IMTEST_CHECK(FileTableTestEmpty());
+}
+
+static void
+TestReadOnlyServer()
+{
+    FileTableTestObject server("\\ro");
+    FileTableTestObject client("\\ro");
+
+    IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server.file_object) ==
+        STATUS_SUCCESS);
+
+    POBJECT_CONTEXT context = (POBJECT_CONTEXT)server.file_object.FsContext2;
+    context->ServiceFlags = IMDPROXY_FLAG_RO;
+
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&client.file_object,
+        GENERIC_WRITE) == STATUS_MEDIA_WRITE_PROTECTED);
+    IMTEST_CHECK(context->RefCount == 1 && context->Client == NULL);
+
+    IMTEST_CHECK(DevIoDrvOpenFileTableEntry(&client.file_object,
+        GENERIC_READ) == STATUS_SUCCESS);
+    IMTEST_CHECK(!client.file_object.WriteAccess);
+
+    DevIoDrvCloseFileTableEntry(&client.file_object);
+    DevIoDrvCloseFileTableEntry(&server.file_object);
+
+    IMTEST_CHECK(FileTableTestEmpty());
+}
+
+static void
+TestAllocationFailure()
+{
+    for (long fail = 1; fail <= 2; fail++)
+    {
+        FileTableTestObject server("\\alloc");
+
+        kmshim_pool_fail_countdown = fail;
+
+        IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server.file_object) ==
+            STATUS_INSUFFICIENT_RESOURCES);
+        IMTEST_CHECK(server.file_object.FsContext2 == NULL);
+        IMTEST_CHECK(FileTableTestEmpty());
+
+        kmshim_pool_fail_countdown = 0;
+
+        IMTEST_CHECK(DevIoDrvCreateFileTableEntry(&server.file_object) ==
+            STATUS_SUCCESS);
+        DevIoDrvCloseFileTableEntry(&server.file_object);
+    }
+
+    IMTEST_CHECK(FileTableTestEmpty());
+}
+
+#define FILE_TABLE_TEST_NAMES       64
+#define FILE_TABLE_TEST_THREADS     8
+#define FILE_TABLE_TEST_OPERATIONS  200000
+
+struct FileTableTestCounts
+{
+    std::atomic<int> servers[FILE_TABLE_TEST_NAMES];
+    std::atomic<int> clients[FILE_TABLE_TEST_NAMES];
+    std::atomic<unsigned> violations{ 0 };
+    std::atomic<unsigned> bad_status{ 0 };
+    std::atomic<unsigned long> created{ 0 };
+    std::atomic<unsigned long> opened{ 0 };
+};
+
+///
+/// Random creates, opens and closes by one thread. Live objects are
+/// counted per name: incremented after a successful create or client open
+/// and decremented before close, so a count above one means the table let
+/// two servers or two clients in for the same name. Attribute queries are
+/// held open too, so that reference counts do not tell who is client.
+///
+static void
+FileTableTestStressThread(unsigned Thread, FileTableTestCounts *Counts)
+{
+    enum HeldKind
+    {
+        HeldServer,
+        HeldClient,
+        HeldAttributes
+    };
+
+    struct Held
+    {
+        FileTableTestObject *object;
+        unsigned name;
+        HeldKind kind;
+    };
+
+    uint64_t state = Thread * 7919 + 1;
+    std::vector<Held> held;
+
+    for (unsigned i = 0; i < FILE_TABLE_TEST_OPERATIONS; i++)
+    {
+        unsigned op = ImTestRandom(&state) % 8;
+
+        if (op < 3 && !held.empty())
+        {
+            size_t index = ImTestRandom(&state) % held.size();
+            Held h = held[index];
+
+            held[index] = held.back();
+            held.pop_back();
+
+            if (h.kind != HeldAttributes)
+            {
+                (h.kind == HeldServer ? Counts->servers : Counts->clients)[h.name]--;
+            }
+
+            DevIoDrvCloseFileTableEntry(&h.object->file_object);
+            delete h.object;
+            continue;
+        }
+
+        unsigned name = ImTestRandom(&state) % FILE_TABLE_TEST_NAMES;
+        std::string text = "\\proxy" + std::to_string(name);
+
+        // Random case, same entry
+        for (char &c : text)
+        {
+            if (c >= 'a' && c <= 'z' && (ImTestRandom(&state) & 1))
+            {
+                c = (char)(c - 'a' + 'A');
+            }
+        }
+
+        FileTableTestObject *object = new FileTableTestObject(text);
+        NTSTATUS status;
+
+        if (op < 5)
+        {
+            status = DevIoDrvCreateFileTableEntry(&object->file_object);
+
+            if (status == STATUS_SUCCESS)
+            {
+                if (++Counts->servers[name] > 1)
+                {
+                    Counts->violations++;
+                }
+
+                // Server has sent size, attribute queries can open
+                ((POBJECT_CONTEXT)object->file_object.FsContext2)->
+                    FileSize.QuadPart = 1 << 20;
+
+                Counts->created++;
+                held.push_back({ object, name, HeldServer });
+                continue;
+            }
+
+            if (status != STATUS_OBJECT_NAME_COLLISION)
+            {
+                Counts->bad_status++;
+            }
+        }
+        else if (op < 7)
+        {
+            status = DevIoDrvOpenFileTableEntry(&object->file_object,
+                GENERIC_READ | GENERIC_WRITE);
+
+            if (status == STATUS_SUCCESS)
+            {
+                if (++Counts->clients[name] > 1)
+                {
+                    Counts->violations++;
+                }
+
+                Counts->opened++;
+                held.push_back({ object, name, HeldClient });
+                continue;
+            }
+
+            if (status != STATUS_OBJECT_NAME_NOT_FOUND &&
+                status != STATUS_SHARING_VIOLATION)
+            {
+                Counts->bad_status++;
+            }
+        }
+        else
+        {
+            status = DevIoDrvOpenFileTableEntry(&object->file_object,
+                FILE_TABLE_TEST_READ_ATTRIBUTES);
+
+            if (status == STATUS_SUCCESS)
+            {
+                held.push_back({ object, name, HeldAttributes });
+                continue;
+            }
+
+            if (status != STATUS_OBJECT_NAME_NOT_FOUND)
+            {
+                Counts->bad_status++;
+            }
+        }
+
+        delete object;
+    }
+
+    for (Held &h : held)
+    {
+        if (h.kind != HeldAttributes)
+        {
+            (h.kind == HeldServer ? Counts->servers : Counts->clients)[h.name]--;
+        }
+
+        DevIoDrvCloseFileTableEntry(&h.object->file_object);
+        delete h.object;
+    }
+
+    if (kmshim_critical_region != 0)
+    {
+        Counts->bad_status++;
+    }
+}
+
+static void
+TestConcurrentOpenClose()
+{
+    FileTableTestCounts counts;
+
+    for (int i = 0; i < FILE_TABLE_TEST_NAMES; i++)
+    {
+        counts.servers[i] = 0;
+        counts.clients[i] = 0;
+    }
+
+    std::vector<std::thread> threads;
+    double start = ImTestSeconds();
+
+    for (unsigned i = 0; i < FILE_TABLE_TEST_THREADS; i++)
+    {
+        threads.emplace_back(FileTableTestStressThread, i, &counts);
+    }
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    double seconds = ImTestSeconds() - start;
+
+    printf("%u threads, %u operations: %lu creates, %lu client opens, "
+        "up to %d shared holders, %.0f operations/s\n",
+        FILE_TABLE_TEST_THREADS,
+        FILE_TABLE_TEST_THREADS * FILE_TABLE_TEST_OPERATIONS,
+        counts.created.load(), counts.opened.load(),
+        (int)FileTableLock.max_shared_holders,
+        FILE_TABLE_TEST_THREADS * FILE_TABLE_TEST_OPERATIONS / seconds);
+
+    IMTEST_CHECK(counts.violations == 0);
+    IMTEST_CHECK(counts.bad_status == 0);
+    IMTEST_CHECK(counts.created > 0 && counts.opened > 0);
+    IMTEST_CHECK(FileTableTestEmpty());
+}
+
+int
+main()
+{
+    FileTableTestInitialize();
+
+    IMTEST_RUN(TestCreateOpenClose);
+    IMTEST_RUN(TestAttributesBeforeClient);
+    IMTEST_RUN(TestReadOnlyServer);
+    IMTEST_RUN(TestAllocationFailure);
+    IMTEST_RUN(TestConcurrentOpenClose);
+
+    return IMTEST_RESULT();
+}
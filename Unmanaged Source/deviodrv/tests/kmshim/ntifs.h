@@ -0,0 +1,351 @@
+/// ntifs.h
+/// Host stand-in for the few kernel types and routines that driver sources
+/// tested in ../ use, so those sources can be compiled unchanged with a
+/// host compiler. Executive resources are reader/writer locks, pool is
+/// malloc with a count of outstanding allocations and optional failure
+/// injection, and interlocked routines are compiler atomics.
+///
+/// Only what the tested sources need is here. This is not a general
+/// emulation of the kernel API.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define _NTDDK_
+
+typedef void VOID, *PVOID;
+typedef unsigned char BOOLEAN, UCHAR, *PUCHAR;
+typedef char CHAR, *PCHAR;
+typedef uint16_t WCHAR, *PWCHAR;
+typedef uint16_t USHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+typedef union _LARGE_INTEGER
+{
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _UNICODE_STRING
+{
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCHAR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+typedef struct _FILE_OBJECT
+{
+    UNICODE_STRING FileName;
+    PVOID FsContext2;
+    BOOLEAN ReadAccess;
+    BOOLEAN WriteAccess;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _IO_STACK_LOCATION
+{
+    PFILE_OBJECT FileObject;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef struct _IRP IRP, *PIRP;
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef NTSTATUS IO_COMPLETION_ROUTINE(PDEVICE_OBJECT, PIRP, PVOID);
+typedef VOID DRIVER_UNLOAD(PDRIVER_OBJECT);
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT, PUNICODE_STRING);
+typedef NTSTATUS DRIVER_DISPATCH(PDEVICE_OBJECT, PIRP);
+typedef VOID DRIVER_CANCEL(PDEVICE_OBJECT, PIRP);
+
+typedef enum _POOL_TYPE
+{
+    NonPagedPool,
+    PagedPool
+} POOL_TYPE;
+
+#define EXTERN_C                        extern "C"
+#define __drv_dispatchType(x)
+#define __forceinline                   inline
+
+#define TRUE                            1
+#define FALSE                           0
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034L)
+#define STATUS_OBJECT_NAME_COLLISION    ((NTSTATUS)0xC0000035L)
+#define STATUS_SHARING_VIOLATION        ((NTSTATUS)0xC0000043L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_MEDIA_WRITE_PROTECTED    ((NTSTATUS)0xC00000A2L)
+
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+
+#define FILE_READ_DATA                  0x0001
+#define FILE_WRITE_DATA                 0x0002
+#define GENERIC_ALL                     0x10000000L
+#define GENERIC_WRITE                   0x40000000L
+#define GENERIC_READ                    0x80000000L
+
+#define HASH_STRING_ALGORITHM_DEFAULT   0
+
+#define FlagOn(F, SF)                   ((F) & (SF))
+
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((PCHAR)(address) - offsetof(type, field)))
+
+#define PAGED_CODE()
+#define KdPrint(x)
+
+//
+// Pool
+//
+
+extern long kmshim_pool_outstanding;
+extern long kmshim_pool_fail_countdown;     // Fail allocation when it reaches zero
+
+inline PVOID
+ExAllocatePoolWithTag(POOL_TYPE, size_t Size, ULONG)
+{
+    if (__atomic_load_n(&kmshim_pool_fail_countdown, __ATOMIC_RELAXED) > 0 &&
+        __atomic_sub_fetch(&kmshim_pool_fail_countdown, 1, __ATOMIC_RELAXED) == 0)
+    {
+        return NULL;
+    }
+
+    PVOID block = malloc(Size);
+
+    if (block != NULL)
+    {
+        __atomic_add_fetch(&kmshim_pool_outstanding, 1, __ATOMIC_RELAXED);
+    }
+
+    return block;
+}
+
+inline VOID
+ExFreePoolWithTag(PVOID Block, ULONG)
+{
+    __atomic_sub_fetch(&kmshim_pool_outstanding, 1, __ATOMIC_RELAXED);
+    free(Block);
+}
+
+//
+// Executive resources and critical regions
+//
+
+typedef struct _ERESOURCE
+{
+    pthread_rwlock_t lock;
+    LONG shared_holders;
+    LONG max_shared_holders;
+    LONG exclusive_holders;
+} ERESOURCE, *PERESOURCE;
+
+extern __thread LONG kmshim_critical_region;
+
+inline VOID
+KeEnterCriticalRegion()
+{
+    kmshim_critical_region++;
+}
+
+inline VOID
+KeLeaveCriticalRegion()
+{
+    kmshim_critical_region--;
+}
+
+inline NTSTATUS
+ExInitializeResourceLite(PERESOURCE Resource)
+{
+    memset(Resource, 0, sizeof(*Resource));
+    pthread_rwlock_init(&Resource->lock, NULL);
+    return STATUS_SUCCESS;
+}
+
+inline NTSTATUS
+ExDeleteResourceLite(PERESOURCE Resource)
+{
+    pthread_rwlock_destroy(&Resource->lock);
+    return STATUS_SUCCESS;
+}
+
+inline BOOLEAN
+ExAcquireResourceSharedLite(PERESOURCE Resource, BOOLEAN)
+{
+    pthread_rwlock_rdlock(&Resource->lock);
+
+    LONG holders = __atomic_add_fetch(&Resource->shared_holders, 1,
+        __ATOMIC_RELAXED);
+    LONG max = __atomic_load_n(&Resource->max_shared_holders, __ATOMIC_RELAXED);
+
+    while (holders > max &&
+        !__atomic_compare_exchange_n(&Resource->max_shared_holders, &max,
+            holders, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+
+    return TRUE;
+}
+
+inline BOOLEAN
+ExAcquireResourceExclusiveLite(PERESOURCE Resource, BOOLEAN)
+{
+    pthread_rwlock_wrlock(&Resource->lock);
+    Resource->exclusive_holders++;
+    return TRUE;
+}
+
+inline VOID
+ExReleaseResourceLite(PERESOURCE Resource)
+{
+    if (Resource->exclusive_holders > 0)
+    {
+        Resource->exclusive_holders--;
+    }
+    else
+    {
+        __atomic_sub_fetch(&Resource->shared_holders, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&Resource->lock);
+}
+
+inline LONG
+InterlockedIncrement(LONG volatile *Addend)
+{
+    return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG
+InterlockedDecrement(LONG volatile *Addend)
+{
+    return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline PVOID
+InterlockedCompareExchangePointer(PVOID volatile *Destination,
+    PVOID Exchange, PVOID Comparand)
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, false,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+//
+// Lists and strings
+//
+
+inline VOID
+InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+inline BOOLEAN
+IsListEmpty(const LIST_ENTRY *ListHead)
+{
+    return ListHead->Flink == ListHead;
+}
+
+inline VOID
+InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead->Flink;
+    Entry->Blink = ListHead;
+    ListHead->Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+inline BOOLEAN
+RemoveEntryList(PLIST_ENTRY Entry)
+{
+    Entry->Blink->Flink = Entry->Flink;
+    Entry->Flink->Blink = Entry->Blink;
+    return Entry->Flink == Entry->Blink;
+}
+
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+
+inline WCHAR
+KmShimUpcase(WCHAR Char)
+{
+    return Char >= 'a' && Char <= 'z' ? (WCHAR)(Char - 'a' + 'A') : Char;
+}
+
+inline NTSTATUS
+RtlHashUnicodeString(PCUNICODE_STRING String, BOOLEAN CaseInSensitive,
+    ULONG, PULONG HashValue)
+{
+    ULONG hash = 0;
+
+    for (USHORT i = 0; i < String->Length / sizeof(WCHAR); i++)
+    {
+        WCHAR c = String->Buffer[i];
+        hash = hash * 65599 + (CaseInSensitive ? KmShimUpcase(c) : c);
+    }
+
+    *HashValue = hash;
+    return STATUS_SUCCESS;
+}
+
+inline BOOLEAN
+RtlEqualUnicodeString(PCUNICODE_STRING String1, PCUNICODE_STRING String2,
+    BOOLEAN CaseInSensitive)
+{
+    if (String1->Length != String2->Length)
+    {
+        return FALSE;
+    }
+
+    for (USHORT i = 0; i < String1->Length / sizeof(WCHAR); i++)
+    {
+        WCHAR c1 = String1->Buffer[i];
+        WCHAR c2 = String2->Buffer[i];
+
+        if (CaseInSensitive ? KmShimUpcase(c1) != KmShimUpcase(c2) : c1 != c2)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+inline VOID
+RtlCopyUnicodeString(PUNICODE_STRING DestinationString,
+    PCUNICODE_STRING SourceString)
+{
+    USHORT length = SourceString->Length < DestinationString->MaximumLength ?
+        SourceString->Length : DestinationString->MaximumLength;
+
+    memcpy(DestinationString->Buffer, SourceString->Buffer, length);
+    DestinationString->Length = length;
+}
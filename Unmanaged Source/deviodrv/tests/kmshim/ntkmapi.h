@@ -0,0 +1,8 @@
+/// ntkmapi.h
+/// Host stand-in for the kernel header of the same name, see ntifs.h in
+/// this directory.
+///
+
+#pragma once
+
+#include <ntifs.h>
@@ -60,6 +60,13 @@ SERVICE_STATUS ImDiskSvcStatus;
 SERVICE_STATUS_HANDLE ImDiskSvcStatusHandle;
 HANDLE ImDiskSvcStopEvent = NULL;
 
+// Completion port where connected sessions wait for driver to close pipe
+HANDLE ImDiskSvcCompletionPort = NULL;
+
+// Number of threads waiting on ImDiskSvcCompletionPort. They only clean up
+// closed sessions, so a few of them serve any number of sessions.
+#define DEVIOSVC_COMPLETION_THREADS     2
+
 // Define DEBUG if you want debug output.
 //#define DEBUG
 
@@ -96,6 +103,15 @@ class ImDiskSvcServerSession
     HANDLE hPipe;
     WOverlapped Overlapped;
 
+    // Additional connections to server when connection string contains
+    // IMDPROXY_STREAMS_OPTION
+    HANDLE hExtraTargets[IMDPROXY_MAX_STREAMS - 1];
+    DWORD ExtraTargetCount;
+
+    // Connection handed over to driver, closed when driver closes pipe
+    HANDLE hActiveTarget;
+    DWORD PipeData;
+
     DWORD CALLBACK Thread()
     {
         IMDPROXY_CONNECT_REQ ConnectReq;
@@ -234,6 +250,31 @@ class ImDiskSvcServerSession
         case IMSCSI_PROXY_TYPE_TCP:
         {
             LPWSTR ServerName = ConnectionString;
+
+            DWORD StreamCount = 1;
+
+            LPWSTR StreamsOption = wcsstr(ConnectionString,
+                IMDPROXY_STREAMS_OPTION);
+
+            if (StreamsOption != NULL)
+            {
+                *StreamsOption = 0;
+
+                StreamCount = wcstoul(StreamsOption +
+                    _countof(IMDPROXY_STREAMS_OPTION) - 1, NULL, 10);
+
+                if ((StreamCount == 0) || (StreamCount > IMDPROXY_MAX_STREAMS))
+                {
+                    KdPrint(("DevIoSvc: Unsupported number of streams (%u).\n",
+                        StreamCount));
+
+                    connect_resp.error_code = ERROR_INVALID_PARAMETER;
+                    Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
+
+                    delete this;
+                    return 0;
+                }
+            }
             
             LPWSTR PortName = wcsrchr(ConnectionString, L':');
 
@@ -268,8 +309,33 @@ class ImDiskSvcServerSession
             setsockopt((SOCKET)hTarget, IPPROTO_TCP, TCP_NODELAY, (LPCSTR)&b,
                 sizeof b);
 
-            KdPrint(("DevIoSvc: Connected to '%ws:%ws' and configured.\n",
-                ServerName, PortName));
+            // Driver spreads requests over all connections, which gets more
+            // throughput from fast links than one TCP stream can.
+            while (ExtraTargetCount < StreamCount - 1)
+            {
+                HANDLE hExtraTarget = (HANDLE)ConnectTCP(ServerName, PortName);
+                if (hExtraTarget == INVALID_HANDLE_VALUE)
+                {
+                    connect_resp.error_code = GetLastError();
+
+                    KdPrintLastError(("ConnectTCP() failed"));
+
+                    CloseHandle(hTarget);
+
+                    Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
+
+                    delete this;
+                    return 0;
+                }
+
+                setsockopt((SOCKET)hExtraTarget, IPPROTO_TCP, TCP_NODELAY,
+                    (LPCSTR)&b, sizeof b);
+
+                hExtraTargets[ExtraTargetCount++] = hExtraTarget;
+            }
+
+            KdPrint(("DevIoSvc: Connected to '%ws:%ws' with %u streams and configured.\n",
+                ServerName, PortName, StreamCount));
 
             break;
         }
@@ -315,33 +381,44 @@ class ImDiskSvcServerSession
 
             memcpy(open_request + 1, path_part, path_size);
 
-            if (!Overlapped.BufSend(hTarget, open_request, (DWORD)req_size))
+            // Each connection to server needs to open the image
+            for (DWORD i = 0; i <= ExtraTargetCount; i++)
             {
-                KdPrintLastError(("Failed to send connect request to server"));
+                HANDLE hStream = i == 0 ? hTarget : hExtraTargets[i - 1];
 
-                connect_resp.error_code = (ULONGLONG)-1;
-                Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
+                if (!Overlapped.BufSend(hStream, open_request, (DWORD)req_size))
+                {
+                    KdPrintLastError(("Failed to send connect request to server"));
 
-                delete this;
-                return 0;
-            }
+                    connect_resp.error_code = (ULONGLONG)-1;
+                    Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
 
-            open_request.Free();
+                    delete this;
+                    return 0;
+                }
 
-            if (Overlapped.BufRecv(hTarget, &connect_resp, sizeof connect_resp) !=
-                sizeof connect_resp)
-            {
-                connect_resp.object_ptr = NULL;
-                if (connect_resp.error_code == 0)
+                if (Overlapped.BufRecv(hStream, &connect_resp, sizeof connect_resp) !=
+                    sizeof connect_resp)
                 {
-                    connect_resp.error_code = (ULONGLONG)-1;
-                }
+                    connect_resp.object_ptr = NULL;
+                    if (connect_resp.error_code == 0)
+                    {
+                        connect_resp.error_code = (ULONGLONG)-1;
+                    }
 
-                Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
+                    Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
                 
-                delete this;
-                return 0;
+                    delete this;
+                    return 0;
+                }
+
+                if (connect_resp.error_code != 0)
+                {
+                    break;
+                }
             }
+
+            open_request.Free();
         }
         
         ConnectionString.Free();
@@ -390,27 +467,92 @@ class ImDiskSvcServerSession
             return 0;
         }
 
+        ULONGLONG ExtraObjectPtrs[IMDPROXY_MAX_STREAMS - 1] = { 0 };
+
+        for (DWORD i = 0; i < ExtraTargetCount; i++)
+        {
+            if (!DeviceIoControl(hDriver,
+                IOCTL_DEVIODRV_REFERENCE_HANDLE,
+                &hExtraTargets[i],
+#pragma warning(suppress: 28132)
+                sizeof hExtraTargets[i],
+                &ExtraObjectPtrs[i],
+                sizeof ExtraObjectPtrs[i],
+                &dw,
+                NULL))
+            {
+                connect_resp.error_code = GetLastError();
+                connect_resp.object_ptr = 0;
+
+                KdPrintLastError(("IOCTL_DEVIODRV_REFERENCE_HANDLE failed"));
+                CloseHandle(hDriver);
+                CloseHandle(hTarget);
+
+                Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
+
+                delete this;
+                return 0;
+            }
+        }
+
         CloseHandle(hDriver);
 
         Overlapped.BufSend(hPipe, &connect_resp, sizeof connect_resp);
 
-        // This will fail when driver closes the pipe, but that just indicates that
-        // we should shut down this connection.
-        Overlapped.BufRecv(hPipe, &dw, sizeof dw);
+        // Driver expects these after response when it succeeds
+        if ((connect_resp.error_code == 0) && (ExtraTargetCount > 0))
+        {
+            Overlapped.BufSend(hPipe, ExtraObjectPtrs,
+                ExtraTargetCount * sizeof *ExtraObjectPtrs);
+        }
 
-        KdPrint(("DevIoSvc: Cleaning up.\n"));
+        hActiveTarget = hTarget;
 
-        CloseHandle(hTarget);
+        // This will complete with an error when driver closes the pipe, which
+        // just indicates that we should shut down this connection. Wait for
+        // that on completion port, so that this thread is free for other
+        // sessions meanwhile.
+        if (CreateIoCompletionPort(hPipe, ImDiskSvcCompletionPort,
+            (ULONG_PTR)this, 0) == NULL)
+        {
+            KdPrintLastError(("CreateIoCompletionPort() failed"));
+
+            Close();
+            return 1;
+        }
+
+        if (!ReadFile(hPipe, &PipeData, sizeof PipeData, NULL, &Overlapped) &&
+            (GetLastError() != ERROR_IO_PENDING))
+        {
+            Close();
+            return 1;
+        }
 
-        delete this;
         return 1;
     }
 
 public:
+    ///
+    /// Closes connection handed over to driver and deletes session. Called
+    /// from completion port thread when pipe read completes, which means
+    /// that driver has closed its end.
+    ///
+    void Close()
+    {
+        KdPrint(("DevIoSvc: Cleaning up.\n"));
+
+        CloseHandle(hActiveTarget);
+
+        delete this;
+    }
+
     ~ImDiskSvcServerSession()
     {
         if (hPipe != INVALID_HANDLE_VALUE)
             CloseHandle(hPipe);
+
+        while (ExtraTargetCount > 0)
+            CloseHandle(hExtraTargets[--ExtraTargetCount]);
     }
 
     bool Connect()
@@ -440,23 +582,22 @@ public:
             union
             {
                 DWORD(CALLBACK ImDiskSvcServerSession::*Member)();
-                UINT(CALLBACK *Static)(LPVOID);
+                LPTHREAD_START_ROUTINE Static;
             } ThreadFunction;
             ThreadFunction.Member = &ImDiskSvcServerSession::Thread;
 
-            KdPrint(("DevIoSvc: Creating thread.\n"));
+            KdPrint(("DevIoSvc: Queueing connection setup.\n"));
 
-            UINT id = 0;
-            HANDLE hThread = (HANDLE)
-                _beginthreadex(NULL, 0, ThreadFunction.Static, this, 0, &id);
-            if (hThread == NULL)
+            // Connecting to server can take a while, so it runs in system
+            // thread pool and this thread goes on waiting for next client.
+            if (!QueueUserWorkItem(ThreadFunction.Static, this,
+                WT_EXECUTELONGFUNCTION))
             {
                 ImDiskSvcStatus.dwWin32ExitCode = GetLastError();
                 delete this;
                 return false;
             }
 
-            CloseHandle(hThread);
             ImDiskSvcStatus.dwWin32ExitCode = NO_ERROR;
             return true;
         }
@@ -475,6 +616,9 @@ public:
 
     ImDiskSvcServerSession()
     {
+        ExtraTargetCount = 0;
+        hActiveTarget = INVALID_HANDLE_VALUE;
+
         hPipe = CreateNamedPipe(IMDPROXY_SVC_PIPE_DOSDEV_NAME,
             PIPE_ACCESS_DUPLEX |
             FILE_FLAG_WRITE_THROUGH |
@@ -499,6 +643,58 @@ public:
     }
 };
 
+UINT
+CALLBACK
+ImDiskSvcCompletionThread(LPVOID)
+{
+    for (;;)
+    {
+        DWORD dwBytes;
+        ULONG_PTR CompletionKey;
+        LPOVERLAPPED lpOverlapped;
+
+        // Read failing is the normal way for these to complete
+        if (!GetQueuedCompletionStatus(ImDiskSvcCompletionPort, &dwBytes,
+            &CompletionKey, &lpOverlapped, INFINITE) &&
+            (lpOverlapped == NULL))
+        {
+            KdPrintLastError(("GetQueuedCompletionStatus() failed"));
+            return 0;
+        }
+
+        ((ImDiskSvcServerSession*)CompletionKey)->Close();
+    }
+}
+
+bool
+ImDiskSvcStartCompletionThreads()
+{
+    ImDiskSvcCompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE,
+        NULL, 0, DEVIOSVC_COMPLETION_THREADS);
+
+    if (ImDiskSvcCompletionPort == NULL)
+    {
+        KdPrintLastError(("CreateIoCompletionPort() failed"));
+        return false;
+    }
+
+    for (int i = 0; i < DEVIOSVC_COMPLETION_THREADS; i++)
+    {
+        UINT id = 0;
+        HANDLE hThread = (HANDLE)
+            _beginthreadex(NULL, 0, ImDiskSvcCompletionThread, NULL, 0, &id);
+        if (hThread == NULL)
+        {
+            KdPrintLastError(("_beginthreadex() failed"));
+            return false;
+        }
+
+        CloseHandle(hThread);
+    }
+
+    return true;
+}
+
 VOID
 CALLBACK
 ImDiskSvcCtrlHandler(DWORD Opcode)
@@ -602,6 +798,11 @@ wWinMain(HINSTANCE,
         return 0;
     }
 
+    if (!ImDiskSvcStartCompletionThreads())
+    {
+        return 0;
+    }
+
     for (;;)
     {
         if (WaitForSingleObject(ImDiskSvcStopEvent, 0) != WAIT_TIMEOUT)
@@ -663,6 +864,11 @@ wWinMain(HINSTANCE,
         return 0;
     }
 
+    if (!ImDiskSvcStartCompletionThreads())
+    {
+        return 0;
+    }
+
     if (!StartServiceCtrlDispatcher(ServiceTable))
     {
         KdPrintLastError(("StartServiceCtrlDispatcher() failed"));
@@ -130,6 +130,27 @@
 /// Check if flags indicate write overlay mode
 #define IMSCSI_WRITE_OVERLAY(x)         ((ULONG)(x) & 0x00080000)
 
+/// Priority class of requests to a device, compared to other devices on the
+/// same adapter. Can be specified when device is created and changed with
+/// ImScsiChangeFlags. Low and background devices are slowed down while
+/// devices in higher classes have requests in progress.
+#define IMSCSI_PRIORITY_NORMAL          0x00000000
+#define IMSCSI_PRIORITY_HIGH            0x00100000
+#define IMSCSI_PRIORITY_LOW             0x00200000
+#define IMSCSI_PRIORITY_BACKGROUND      0x00300000
+/// Mask for priority class bits
+#define IMSCSI_PRIORITY_MASK            0x00300000
+/// Get priority class from flags
+#define IMSCSI_PRIORITY(x)              ((ULONG)(x) & 0x00300000)
+
+/// An IMSCSI_DEVICE_QOS_LIMITS structure follows file names in
+/// IMSCSI_DEVICE_CONFIGURATION, see IMSCSI_QOS_LIMITS_OFFSET. Set by driver
+/// on query when device has limits, so that limits are kept when a device
+/// is created again from queried configuration.
+#define IMSCSI_OPTION_QOS_LIMITS        0x00400000
+/// Check if flags indicate that QoS limits follow file names
+#define IMSCSI_QOS_LIMITS(x)            ((ULONG)(x) & 0x00400000)
+
 /// Specify as device number to remove all devices.
 #define IMSCSI_ALL_DEVICES              (0x00FFFFFFUL)
 
@@ -162,6 +183,8 @@
 #define IMSCSI_CFG_SIZE_PREFIX                    _T("Size")
 #define IMSCSI_CFG_FLAGS_PREFIX                   _T("Flags")
 #define IMSCSI_CFG_OFFSET_PREFIX                  _T("ImageOffset")
+#define IMSCSI_CFG_MAX_IOPS_PREFIX                _T("MaxIops")
+#define IMSCSI_CFG_MAX_BYTES_PREFIX               _T("MaxBytesPerSecond")
 
 #define KEY_NAME_HKEY_MOUNTPOINTS  \
   _T("Software\\Microsoft\\Windows\\CurrentVersion\\Explorer\\MountPoints")
@@ -245,8 +268,166 @@ typedef struct _IMSCSI_DEVICE_CONFIGURATION
     WCHAR           FileName[];
 
 } IMSCSI_DEVICE_CONFIGURATION, *PIMSCSI_DEVICE_CONFIGURATION;
+
+///
+/// Request rate limits for a device, following file names in
+/// IMSCSI_DEVICE_CONFIGURATION when Flags field contains
+/// IMSCSI_OPTION_QOS_LIMITS. Same limits as in IMSCSI_QOS_INFO.
+///
+typedef struct _IMSCSI_DEVICE_QOS_LIMITS
+{
+    /// Largest number of read and write requests per second. Zero for no
+    /// limit.
+    ULONG           MaxIops;
+
+    ULONG           Reserved;
+
+    /// Largest number of bytes read and written per second. Zero for no
+    /// limit.
+    ULONGLONG       MaxBytesPerSecond;
+
+} IMSCSI_DEVICE_QOS_LIMITS, *PIMSCSI_DEVICE_QOS_LIMITS;
 #pragma pack(pop)
 
+///
+/// Byte offset of IMSCSI_DEVICE_QOS_LIMITS from start of an
+/// IMSCSI_DEVICE_CONFIGURATION. It follows FileName and, with write overlay,
+/// write overlay file name and 8 bytes where driver returns handle to write
+/// overlay on query. Those 8 bytes are ignored on create. Limits are not
+/// aligned, so they should be copied before use.
+///
+#define IMSCSI_QOS_LIMITS_OFFSET(Config) \
+    (FIELD_OFFSET(IMSCSI_DEVICE_CONFIGURATION, FileName) + \
+    (Config)->FileNameLength + \
+    (IMSCSI_WRITE_OVERLAY((Config)->Flags) ? \
+    (Config)->WriteOverlayFileNameLength + sizeof(ULONGLONG) : 0))
+
+///
+/// Read cache and read-ahead settings and counters for a virtual disk. Used
+/// with SMP_IMSCSI_QUERY_READ_CACHE and SMP_IMSCSI_SET_READ_CACHE calls.
+///
+typedef struct _IMSCSI_READ_CACHE_INFO
+{
+    /// Largest read-ahead window in bytes for each sequential read stream.
+    /// Zero disables read-ahead. This is the only member used by
+    /// SMP_IMSCSI_SET_READ_CACHE.
+    ULONG           MaxReadAheadSize;
+
+    /// Bytes of read cache memory, zero if device is not cached.
+    ULONG           CacheSize;
+
+    /// Read requests served from cache and read requests that were not.
+    ULONGLONG       CacheHits;
+    ULONGLONG       CacheMisses;
+
+    /// Read-ahead requests sent to image and bytes read by them.
+    ULONGLONG       ReadAheadRequests;
+    ULONGLONG       ReadAheadBytes;
+
+    /// Bytes read ahead that were dropped from cache, or left behind by a
+    /// stream that ended, before anyone read them.
+    ULONGLONG       ReadAheadWastedBytes;
+
+    /// Sequential read streams currently tracked, and sum of their current
+    /// read-ahead windows in bytes.
+    ULONG           SequentialStreams;
+    ULONG           ReadAheadWindow;
+
+} IMSCSI_READ_CACHE_INFO, *PIMSCSI_READ_CACHE_INFO;
+
+///
+/// Request rate limits, priority class and counters for a virtual disk.
+/// Used with SMP_IMSCSI_QUERY_QOS and SMP_IMSCSI_SET_QOS calls.
+///
+typedef struct _IMSCSI_QOS_INFO
+{
+    /// Largest number of read and write requests per second. Zero for no
+    /// limit.
+    ULONG           MaxIops;
+
+    /// One of IMSCSI_PRIORITY_xxx values.
+    ULONG           Priority;
+
+    /// Largest number of bytes read and written per second. Zero for no
+    /// limit.
+    ULONGLONG       MaxBytesPerSecond;
+
+    /// Requests that were delayed by limits or priority class, and total
+    /// time they were delayed in 100 ns units. Not used by
+    /// SMP_IMSCSI_SET_QOS.
+    ULONGLONG       DelayedRequests;
+    ULONGLONG       DelayTime;
+
+} IMSCSI_QOS_INFO, *PIMSCSI_QOS_INFO;
+
+#define IMSCSI_LATENCY_BUCKETS          24
+
+///
+/// Request counters and latency histograms for a virtual disk. Used with
+/// SMP_IMSCSI_QUERY_STATISTICS calls, which is the way to read them from
+/// user mode, also through ImScsiQueryStatistics in aimapi and in aim_ll
+/// device status output. Miniport does not register as a WMI data provider,
+/// so they are not available through WMI. Counters start at zero when
+/// device is created.
+///
+typedef struct _IMSCSI_DEVICE_STATISTICS
+{
+    /// Completed requests of each kind. Other requests are SCSI commands
+    /// that do not read, write or unmap data.
+    ULONGLONG       ReadRequests;
+    ULONGLONG       WriteRequests;
+    ULONGLONG       UnmapRequests;
+    ULONGLONG       OtherRequests;
+
+    /// Bytes read and written by successful requests.
+    ULONGLONG       BytesRead;
+    ULONGLONG       BytesWritten;
+
+    /// Requests completed with an error status.
+    ULONGLONG       Errors;
+
+    /// Requests currently queued or in progress, and most there has been at
+    /// the same time.
+    ULONG           QueueDepth;
+    ULONG           MaxQueueDepth;
+
+    /// Latency histograms. Element n counts requests that took from 2^n up
+    /// to 2^(n+1) microseconds. First element also counts shorter requests
+    /// and last element longer ones. BackendLatency counts time spent in
+    /// image I/O and only requests that reached image, TotalLatency counts
+    /// time from request arrived at adapter until it was completed.
+    ULONGLONG       BackendLatency[IMSCSI_LATENCY_BUCKETS];
+    ULONGLONG       TotalLatency[IMSCSI_LATENCY_BUCKETS];
+
+} IMSCSI_DEVICE_STATISTICS, *PIMSCSI_DEVICE_STATISTICS;
+
+///
+/// Used with SMP_IMSCSI_QUERY_TRACE calls to read request trace records kept
+/// for one processor. Followed by as many IMSCSI_TRACE_RECORD structures, as
+/// defined in imscsitrace.h, as there is room for in request buffer.
+///
+typedef struct _IMSCSI_TRACE_QUERY
+{
+    /// Processor to read trace records for.
+    ULONG           Processor;
+
+    /// Number of processors with trace records, zero if tracing is
+    /// disabled. Set by driver.
+    ULONG           ProcessorCount;
+
+    /// Position of first record to return, zero for oldest record kept.
+    /// Set by driver to position to continue at in next call.
+    ULONG           Position;
+
+    /// Number of records returned. Set by driver.
+    ULONG           RecordCount;
+
+    /// Performance counter frequency, for timestamps in trace records. Set
+    /// by driver.
+    LONGLONG        Frequency;
+
+} IMSCSI_TRACE_QUERY, *PIMSCSI_TRACE_QUERY;
+
 #ifdef _NTDDSCSIH_
 
 ///
@@ -342,6 +523,50 @@ typedef struct {
 
 } SRB_IMSCSI_EXTEND_DEVICE, *PSRB_IMSCSI_EXTEND_DEVICE;
 
+typedef struct _SRB_IMSCSI_READ_CACHE
+{
+    /// SRB_IO_CONTROL header
+    SRB_IO_CONTROL          SrbIoControl;
+
+    DEVICE_NUMBER           DeviceNumber;
+
+    IMSCSI_READ_CACHE_INFO  Info;
+
+} SRB_IMSCSI_READ_CACHE, *PSRB_IMSCSI_READ_CACHE;
+
+typedef struct _SRB_IMSCSI_QOS
+{
+    /// SRB_IO_CONTROL header
+    SRB_IO_CONTROL          SrbIoControl;
+
+    DEVICE_NUMBER           DeviceNumber;
+
+    IMSCSI_QOS_INFO         Info;
+
+} SRB_IMSCSI_QOS, *PSRB_IMSCSI_QOS;
+
+typedef struct _SRB_IMSCSI_STATISTICS
+{
+    /// SRB_IO_CONTROL header
+    SRB_IO_CONTROL              SrbIoControl;
+
+    DEVICE_NUMBER               DeviceNumber;
+
+    IMSCSI_DEVICE_STATISTICS    Info;
+
+} SRB_IMSCSI_STATISTICS, *PSRB_IMSCSI_STATISTICS;
+
+typedef struct _SRB_IMSCSI_TRACE
+{
+    /// SRB_IO_CONTROL header
+    SRB_IO_CONTROL              SrbIoControl;
+
+    IMSCSI_TRACE_QUERY          Info;
+
+    // Trace records follow
+
+} SRB_IMSCSI_TRACE, *PSRB_IMSCSI_TRACE;
+
 typedef struct {
     /// SRB_IO_CONTROL header
     SRB_IO_CONTROL  SrbIoControl;
@@ -571,6 +796,12 @@ ImScsiInterlockedRemoveHeadList(
 #define SMP_IMSCSI_SET_DEVICE_FLAGS     ((ULONG) (SMP_IMSCSI | 0x805))
 #define SMP_IMSCSI_REMOVE_DEVICE        ((ULONG) (SMP_IMSCSI | 0x806))
 #define SMP_IMSCSI_EXTEND_DEVICE        ((ULONG) (SMP_IMSCSI | 0x807))
+#define SMP_IMSCSI_QUERY_READ_CACHE     ((ULONG) (SMP_IMSCSI | 0x808))
+#define SMP_IMSCSI_SET_READ_CACHE       ((ULONG) (SMP_IMSCSI | 0x809))
+#define SMP_IMSCSI_QUERY_QOS            ((ULONG) (SMP_IMSCSI | 0x80A))
+#define SMP_IMSCSI_SET_QOS              ((ULONG) (SMP_IMSCSI | 0x80B))
+#define SMP_IMSCSI_QUERY_STATISTICS     ((ULONG) (SMP_IMSCSI | 0x80C))
+#define SMP_IMSCSI_QUERY_TRACE          ((ULONG) (SMP_IMSCSI | 0x80D))
 
 #define IMSCSI_API_NO_BROADCAST_NOTIFY  0x00000001
 #define IMSCSI_API_FORCE_DISMOUNT       0x00000002
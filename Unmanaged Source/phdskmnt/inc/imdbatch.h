@@ -0,0 +1,90 @@
+/// imdbatch.h
+/// Checks and offset arithmetic for the batch buffer layout used with
+/// IOCTL_DEVIODRV_EXCHANGE_IO_BATCH, described in imdproxy.h. Buffer is
+/// shared with the other side, so each value is copied out once and then
+/// checked with these before it is used.
+///
+/// This only depends on compiler, so servers and tests can encode and
+/// decode batches the same way as the driver does.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMDBATCH_
+#define _INC_IMDBATCH_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMD_BATCH_INLINE __forceinline
+#else
+#define IMD_BATCH_INLINE static inline
+#endif
+
+///
+/// Returns nonzero if a batch header with these values, copied from a
+/// buffer of BufferSize bytes, describes entries and a data area that fit
+/// in that buffer. Caller checks that BufferSize holds the header itself
+/// before reading it.
+///
+IMD_BATCH_INLINE
+int
+ImdBatchCheckHeader(ULONG MaxEntries, ULONG EntryCount, ULONGLONG BufferSize)
+{
+    return (MaxEntries != 0) &&
+        (MaxEntries <= IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES) &&
+        (EntryCount <= MaxEntries) &&
+        (IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(MaxEntries) <= BufferSize);
+}
+
+///
+/// Number of bytes available at DataOffset of a response entry, in a buffer
+/// of BufferSize bytes. Zero if DataOffset is outside buffer.
+///
+IMD_BATCH_INLINE
+ULONGLONG
+ImdBatchResponseDataSize(ULONGLONG DataOffset, ULONGLONG BufferSize)
+{
+    if (DataOffset > BufferSize)
+    {
+        return 0;
+    }
+
+    return BufferSize - DataOffset;
+}
+
+///
+/// Returns nonzero if Length bytes of request data fit at DataEnd in a
+/// buffer of BufferSize bytes.
+///
+IMD_BATCH_INLINE
+int
+ImdBatchDataFits(ULONGLONG DataEnd, ULONGLONG Length, ULONGLONG BufferSize)
+{
+    return (DataEnd <= BufferSize) && (Length <= BufferSize - DataEnd);
+}
+
+///
+/// Where data for next request starts, after Length bytes at DataEnd that
+/// fit according to ImdBatchDataFits. Never beyond BufferSize, so it can
+/// also be returned as size of data area used.
+///
+IMD_BATCH_INLINE
+ULONGLONG
+ImdBatchNextDataOffset(ULONGLONG DataEnd, ULONGLONG Length,
+    ULONGLONG BufferSize)
+{
+    ULONGLONG next = (DataEnd + Length +
+        IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT - 1) &
+        ~(ULONGLONG)(IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT - 1);
+
+    return next < BufferSize ? next : BufferSize;
+}
+
+#endif // _INC_IMDBATCH_
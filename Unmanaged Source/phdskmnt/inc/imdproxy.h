@@ -52,6 +52,8 @@ typedef u_char UCHAR;
 #define IMDPROXY_FLAG_SUPPORTS_SCSI     0x08 // SCSI SRB operations
 #define IMDPROXY_FLAG_SUPPORTS_SHARED   0x10 // Shared image access with reservations
 #define IMDPROXY_FLAG_KEEP_OPEN         0x20 // DevIoDrv mode with persistent virtual file
+#define IMDPROXY_FLAG_SUPPORTS_TAGGED   0x40 // Tagged requests, see IMDPROXY_TAGGED_REQ
+#define IMDPROXY_FLAG_SUPPORTS_VECTORED 0x80 // IMDPROXY_REQ_READV and IMDPROXY_REQ_WRITEV
 
 typedef enum _IMDPROXY_REQ
 {
@@ -64,7 +66,10 @@ typedef enum _IMDPROXY_REQ
     IMDPROXY_REQ_UNMAP,
     IMDPROXY_REQ_ZERO,
     IMDPROXY_REQ_SCSI,
-    IMDPROXY_REQ_SHARED
+    IMDPROXY_REQ_SHARED,
+    IMDPROXY_REQ_TAGGED,
+    IMDPROXY_REQ_READV,
+    IMDPROXY_REQ_WRITEV
 } IMDPROXY_REQ, *PIMDPROXY_REQ;
 
 typedef struct _IMDPROXY_CLOSE_REQ
@@ -85,6 +90,13 @@ typedef struct _IMDPROXY_CONNECT_RESP
     ULONGLONG object_ptr;
 } IMDPROXY_CONNECT_RESP, *PIMDPROXY_CONNECT_RESP;
 
+// Connection string option for TCP connections through proxy service, for
+// example "server:9000,streams=4". Proxy service then opens that number of
+// connections to the server. Its IMDPROXY_CONNECT_RESP is followed by one
+// ULONGLONG object pointer for each connection after the first one.
+#define IMDPROXY_STREAMS_OPTION         L",streams="
+#define IMDPROXY_MAX_STREAMS            16
+
 typedef struct _IMDPROXY_INFO_RESP
 {
     ULONGLONG file_size;
@@ -118,6 +130,44 @@ typedef struct _IMDPROXY_WRITE_RESP
     ULONGLONG length;
 } IMDPROXY_WRITE_RESP, *PIMDPROXY_WRITE_RESP;
 
+typedef struct _IMDPROXY_EXTENT
+{
+    ULONGLONG offset;
+    ULONGLONG length;
+} IMDPROXY_EXTENT, *PIMDPROXY_EXTENT;
+
+// Followed by extent_count IMDPROXY_EXTENT items. Response header is followed
+// by length bytes of data, extents in the order requested. If end of image
+// or an error is reached, length is less than the sum of extent lengths.
+typedef struct _IMDPROXY_READV_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG extent_count;
+} IMDPROXY_READV_REQ, *PIMDPROXY_READV_REQ;
+
+typedef struct _IMDPROXY_READV_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG length;
+} IMDPROXY_READV_RESP, *PIMDPROXY_READV_RESP;
+
+// Followed by extent_count IMDPROXY_EXTENT items and then data for all
+// extents, in the same order. Response length is number of bytes written.
+typedef struct _IMDPROXY_WRITEV_REQ
+{
+    ULONGLONG request_code;
+    ULONGLONG extent_count;
+} IMDPROXY_WRITEV_REQ, *PIMDPROXY_WRITEV_REQ;
+
+typedef struct _IMDPROXY_WRITEV_RESP
+{
+    ULONGLONG errorno;
+    ULONGLONG length;
+} IMDPROXY_WRITEV_RESP, *PIMDPROXY_WRITEV_RESP;
+
+// Request header and extent list always fit within IMDPROXY_HEADER_SIZE.
+#define IMDPROXY_MAX_EXTENTS ((IMDPROXY_HEADER_SIZE - sizeof(IMDPROXY_READV_REQ)) / sizeof(IMDPROXY_EXTENT))
+
 typedef struct _IMDPROXY_UNMAP_REQ
 {
     ULONGLONG request_code;
@@ -197,10 +247,85 @@ typedef enum _IMDPROXY_SHARED_RESP_CODE
     IOError
 } IMDPROXY_SHARED_RESP_CODE, *PIMDPROXY_SHARED_RESP_CODE;
 
+// For stream based connections where server sets IMDPROXY_FLAG_SUPPORTS_TAGGED
+// in IMDPROXY_INFO_RESP. A client may then send this header immediately
+// followed by a complete READ, WRITE, UNMAP or ZERO request. The server
+// answers with an IMDPROXY_TAGGED_RESP with the same io_tag, immediately
+// followed by the usual response header and data for that request.
+//
+// Tagged requests may be processed concurrently, so responses can arrive in
+// any order. Untagged requests on the same connection act as barriers. They
+// are processed after all earlier requests have been answered, and before
+// any later requests.
+typedef struct _IMDPROXY_TAGGED_REQ
+{
+    ULONGLONG request_code;     // IMDPROXY_REQ_TAGGED
+    ULONGLONG io_tag;           // Tag to forward to response header.
+} IMDPROXY_TAGGED_REQ, *PIMDPROXY_TAGGED_REQ;
+
+typedef struct _IMDPROXY_TAGGED_RESP
+{
+    ULONGLONG io_tag;           // Tag from request header.
+} IMDPROXY_TAGGED_RESP, *PIMDPROXY_TAGGED_RESP;
+
 // For shared memory proxy communication only. Offset to data area in
 // shared memory.
 #define IMDPROXY_HEADER_SIZE 4096
 
+// Ring layout for shared memory proxy communication. Server selects it by
+// initializing the first IMDPROXY_HEADER_SIZE bytes of shared memory with
+// an IMDPROXY_SHM_RING_HEADER before client connects. Shared memory is then
+// divided into slot_count slots starting at IMDPROXY_HEADER_SIZE, each with
+// the same layout as the whole shared memory without ring layout: request
+// and response header at offset zero and data at IMDPROXY_HEADER_SIZE.
+//
+// Slot size is a multiple of IMDPROXY_HEADER_SIZE, so slot data areas are
+// page aligned. Servers can do I/O directly to and from them, and clients
+// can fill and drain them in place, without intermediate buffers.
+//
+// Client writes a request to a free slot and adds slot number to submission
+// ring. Server executes it, writes the response to the same slot and adds
+// slot number to completion ring. Any number of slots can be in flight and
+// they complete in any order. Each ring has a single producer and a single
+// consumer.
+//
+// A consumer that finds its ring empty may poll for a while, then sets
+// consumer_waiting and checks the ring again before it sleeps. A producer
+// that finds consumer_waiting set after adding an entry wakes the consumer,
+// by setting the _Request or _Response event on Windows, or with a futex
+// wake on the ring tail elsewhere.
+//
+// Client sets client_version to select ring layout. Clients that do not
+// know about ring layout write their first request at offset zero instead,
+// which overwrites signature. Client sets closed when it disconnects.
+#define IMDPROXY_SHM_RING_SIGNATURE     0x474E495250444D49ULL   // "IMDPRING"
+#define IMDPROXY_SHM_RING_VERSION       1
+#define IMDPROXY_SHM_RING_MAX_SLOTS     256
+
+typedef struct _IMDPROXY_SHM_RING
+{
+    volatile ULONG tail;                // Next entry to fill, written by producer
+    ULONG reserved1[15];
+    volatile ULONG head;                // Next entry to consume, written by consumer
+    volatile ULONG consumer_waiting;    // Set by consumer before it sleeps
+    ULONG reserved2[14];
+    volatile ULONG entries[IMDPROXY_SHM_RING_MAX_SLOTS];   // Slot numbers
+} IMDPROXY_SHM_RING, *PIMDPROXY_SHM_RING;
+
+typedef struct _IMDPROXY_SHM_RING_HEADER
+{
+    ULONGLONG signature;                // IMDPROXY_SHM_RING_SIGNATURE
+    ULONG version;                      // IMDPROXY_SHM_RING_VERSION
+    volatile ULONG client_version;      // Set by client using ring layout
+    ULONG slot_count;                   // Power of two, at most IMDPROXY_SHM_RING_MAX_SLOTS
+    ULONG slot_data_size;               // Size of data area in each slot
+    ULONGLONG slot_size;                // Distance between slots, page aligned
+    volatile ULONG closed;              // Set by client when disconnecting
+    ULONG reserved[7];
+    IMDPROXY_SHM_RING submission;       // Requests, client to server
+    IMDPROXY_SHM_RING completion;       // Responses, server to client
+} IMDPROXY_SHM_RING_HEADER, *PIMDPROXY_SHM_RING_HEADER;
+
 // For use with deviodrv driver, where requests and responses are tagged
 // with an id for asynchronous operations.
 typedef struct _IMDPROXY_DEVIODRV_BUFFER_HEADER
@@ -210,6 +335,46 @@ typedef struct _IMDPROXY_DEVIODRV_BUFFER_HEADER
     ULONGLONG flags;            // Reserved. Currently not used.
 } IMDPROXY_DEVIODRV_BUFFER_HEADER, *PIMDPROXY_DEVIODRV_BUFFER_HEADER;
 
+// Batched exchange with deviodrv driver, IOCTL_DEVIODRV_EXCHANGE_IO_BATCH.
+// Buffer starts with IMDPROXY_DEVIODRV_BATCH_HEADER, followed by max_entries
+// IMDPROXY_DEVIODRV_BATCH_ENTRY. Data area starts at
+// IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(max_entries) and data_offset in each
+// entry is counted from start of buffer.
+//
+// Server sets max_entries and fills entry_count entries with responses to
+// earlier requests, using request_code and io_tag from each request. Driver
+// completes them and then fills buffer with up to max_entries new requests
+// and sets entry_count. Data for each new request is aligned to
+// IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT: write data, a list of
+// DEVICE_DATA_SET_RANGE for zero and unmap, or space for read data that
+// server can reuse for its response. If no requests are waiting, call
+// is pended until one arrives.
+#define IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES     256
+#define IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT  512
+
+typedef struct _IMDPROXY_DEVIODRV_BATCH_HEADER
+{
+    ULONG entry_count;          // Number of entries used, set by both sides.
+    ULONG max_entries;          // Size of entry array, set by server.
+    ULONGLONG data_size;        // End of data area used by requests, set by driver.
+} IMDPROXY_DEVIODRV_BATCH_HEADER, *PIMDPROXY_DEVIODRV_BATCH_HEADER;
+
+typedef struct _IMDPROXY_DEVIODRV_BATCH_ENTRY
+{
+    ULONGLONG request_code;     // IMDPROXY_REQ_READ, _WRITE, _ZERO or _UNMAP.
+    ULONGLONG io_tag;           // Tag to forward to response entry.
+    ULONGLONG offset;           // Request: offset on device.
+    ULONGLONG length;           // Request: size of data. Response: bytes transferred.
+    ULONGLONG errorno;          // Response: zero for success.
+    ULONGLONG data_offset;      // Request data, or read response data.
+} IMDPROXY_DEVIODRV_BATCH_ENTRY, *PIMDPROXY_DEVIODRV_BATCH_ENTRY;
+
+#define IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(max_entries) \
+    (((ULONGLONG)sizeof(IMDPROXY_DEVIODRV_BATCH_HEADER) + \
+    (ULONGLONG)(max_entries) * sizeof(IMDPROXY_DEVIODRV_BATCH_ENTRY) + \
+    IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT - 1) & \
+    ~(ULONGLONG)(IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT - 1))
+
 #if defined(CTL_CODE) && !defined(IOCTL_DEVIODRV_EXCHANGE_IO)
 #ifndef FILE_DEVICE_IMDISK
 #define FILE_DEVICE_IMDISK                      0x8372
@@ -219,6 +384,7 @@ typedef struct _IMDPROXY_DEVIODRV_BUFFER_HEADER
 
 #define IOCTL_DEVIODRV_EXCHANGE_IO	            ((ULONG) CTL_CODE(FILE_DEVICE_IMDISK, 0x8D0, METHOD_OUT_DIRECT, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
 #define IOCTL_DEVIODRV_LOCK_MEMORY	            ((ULONG) CTL_CODE(FILE_DEVICE_IMDISK, 0x8D1, METHOD_OUT_DIRECT, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
+#define IOCTL_DEVIODRV_EXCHANGE_IO_BATCH        ((ULONG) CTL_CODE(FILE_DEVICE_IMDISK, 0x8D2, METHOD_OUT_DIRECT, FILE_READ_ACCESS | FILE_WRITE_ACCESS))
 #endif
 
 #endif // _INC_IMDPROXY_
@@ -0,0 +1,145 @@
+/// imdshmring.h
+/// Submission and completion ring operations for shared memory proxy
+/// connections with ring layout, see IMDPROXY_SHM_RING_HEADER in imdproxy.h.
+/// Used by both driver and servers, so this only depends on compiler
+/// intrinsics. Sleeping and waking up is left to caller.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMDSHMRING_
+#define _INC_IMDSHMRING_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+
+#define IMDPROXY_SHM_INLINE __forceinline
+
+#if defined(_M_IX86) || defined(_M_AMD64)
+#define ImdProxyShmAcquireFence() _ReadWriteBarrier()
+#define ImdProxyShmReleaseFence() _ReadWriteBarrier()
+#else
+#define ImdProxyShmAcquireFence() MemoryBarrier()
+#define ImdProxyShmReleaseFence() MemoryBarrier()
+#endif
+
+#define ImdProxyShmFullBarrier() MemoryBarrier()
+#define ImdProxyShmPause() YieldProcessor()
+
+#else
+
+#define IMDPROXY_SHM_INLINE static inline
+
+#define ImdProxyShmAcquireFence() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define ImdProxyShmReleaseFence() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define ImdProxyShmFullBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define ImdProxyShmPause() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define ImdProxyShmPause() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define ImdProxyShmPause() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#endif
+
+IMDPROXY_SHM_INLINE
+ULONG
+ImdProxyShmLoadAcquire(volatile const ULONG *Value)
+{
+    ULONG value = *Value;
+    ImdProxyShmAcquireFence();
+    return value;
+}
+
+IMDPROXY_SHM_INLINE
+void
+ImdProxyShmStoreRelease(volatile ULONG *Target, ULONG Value)
+{
+    ImdProxyShmReleaseFence();
+    *Target = Value;
+}
+
+///
+/// Producer side. Callers serialize producers, and never have more than
+/// slot_count entries in a ring, so it cannot overflow. Slot contents must
+/// be complete before this is called.
+///
+IMDPROXY_SHM_INLINE
+void
+ImdProxyShmRingPush(PIMDPROXY_SHM_RING Ring, ULONG SlotCount, ULONG Slot)
+{
+    ULONG tail = Ring->tail;
+
+    Ring->entries[tail & (SlotCount - 1)] = Slot;
+
+    ImdProxyShmStoreRelease(&Ring->tail, tail + 1);
+}
+
+///
+/// Called by producer after one or more ImdProxyShmRingPush calls. Returns
+/// nonzero if consumer could be sleeping and needs to be woken up.
+///
+IMDPROXY_SHM_INLINE
+int
+ImdProxyShmRingNeedsWakeup(PIMDPROXY_SHM_RING Ring)
+{
+    ImdProxyShmFullBarrier();
+
+    return Ring->consumer_waiting != 0;
+}
+
+///
+/// Consumer side. Returns zero if ring is empty. Slot number comes from the
+/// other side and needs to be checked against slot_count by caller.
+///
+IMDPROXY_SHM_INLINE
+int
+ImdProxyShmRingPop(PIMDPROXY_SHM_RING Ring, ULONG SlotCount, ULONG *Slot)
+{
+    ULONG head = Ring->head;
+
+    if (head == ImdProxyShmLoadAcquire(&Ring->tail))
+    {
+        return 0;
+    }
+
+    *Slot = Ring->entries[head & (SlotCount - 1)];
+
+    ImdProxyShmStoreRelease(&Ring->head, head + 1);
+
+    return 1;
+}
+
+///
+/// Called by consumer before it sleeps. Returns nonzero if entries arrived
+/// meanwhile, in which case consumer should call ImdProxyShmRingFinishSleep
+/// and continue without sleeping.
+///
+IMDPROXY_SHM_INLINE
+int
+ImdProxyShmRingPrepareSleep(PIMDPROXY_SHM_RING Ring)
+{
+    Ring->consumer_waiting = 1;
+
+    ImdProxyShmFullBarrier();
+
+    return Ring->head != Ring->tail;
+}
+
+IMDPROXY_SHM_INLINE
+void
+ImdProxyShmRingFinishSleep(PIMDPROXY_SHM_RING Ring)
+{
+    Ring->consumer_waiting = 0;
+}
+
+#endif // _INC_IMDSHMRING_
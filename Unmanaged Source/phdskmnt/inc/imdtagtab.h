@@ -0,0 +1,232 @@
+/// imdtagtab.h
+/// Table of requests waiting for a response, indexed by io_tag. A tag holds
+/// slot number in low 32 bits and slot generation in high 32 bits, so a
+/// response is matched to its request by direct index. Each time a slot is
+/// freed its generation changes, so late or forged tags for a request that
+/// has already been completed do not match a newer request in the same slot.
+/// Tags never contain addresses.
+///
+/// This only depends on compiler and caller provided memory, so it can be
+/// used outside the drivers as well. Locking and allocation of slot arrays
+/// are left to caller.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMDTAGTAB_
+#define _INC_IMDTAGTAB_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMD_TAG_TABLE_INLINE __forceinline
+#else
+#include <stddef.h>
+#define IMD_TAG_TABLE_INLINE static inline
+#endif
+
+#define IMD_TAG_TABLE_NO_SLOT           0xFFFFFFFFUL
+#define IMD_TAG_TABLE_INITIAL_CAPACITY  64
+#define IMD_TAG_TABLE_MAX_CAPACITY      0x10000000UL
+
+typedef struct _IMD_TAG_SLOT
+{
+    void *item;                 // NULL if slot is free
+    ULONG generation;           // Changed each time slot is freed, never zero
+    ULONG next_free;            // Valid if slot is free
+} IMD_TAG_SLOT, *PIMD_TAG_SLOT;
+
+typedef struct _IMD_TAG_TABLE
+{
+    PIMD_TAG_SLOT slots;
+    ULONG capacity;
+    ULONG free_head;            // IMD_TAG_TABLE_NO_SLOT if table is full
+    ULONG in_use;
+} IMD_TAG_TABLE, *PIMD_TAG_TABLE;
+
+IMD_TAG_TABLE_INLINE
+ULONGLONG
+ImdTagTableMakeTag(ULONG Slot, ULONG Generation)
+{
+    return ((ULONGLONG)Generation << 32) | Slot;
+}
+
+IMD_TAG_TABLE_INLINE
+void
+ImdTagTableInitialize(PIMD_TAG_TABLE Table)
+{
+    Table->slots = NULL;
+    Table->capacity = 0;
+    Table->free_head = IMD_TAG_TABLE_NO_SLOT;
+    Table->in_use = 0;
+}
+
+IMD_TAG_TABLE_INLINE
+int
+ImdTagTableIsFull(const IMD_TAG_TABLE *Table)
+{
+    return Table->free_head == IMD_TAG_TABLE_NO_SLOT;
+}
+
+///
+/// Capacity to grow a full table to, or zero if it cannot grow any more.
+/// Caller allocates that number of IMD_TAG_SLOT and calls ImdTagTableGrow.
+///
+IMD_TAG_TABLE_INLINE
+ULONG
+ImdTagTableNextCapacity(const IMD_TAG_TABLE *Table)
+{
+    if (Table->capacity == 0)
+    {
+        return IMD_TAG_TABLE_INITIAL_CAPACITY;
+    }
+
+    if (Table->capacity >= IMD_TAG_TABLE_MAX_CAPACITY)
+    {
+        return 0;
+    }
+
+    return Table->capacity << 1;
+}
+
+///
+/// Moves table to NewSlots, which has room for NewCapacity slots, and puts
+/// new slots on free list. Slot numbers and generations stay the same, so
+/// tags already handed out are still valid. Returns old slot array for
+/// caller to free, or NULL if there was none.
+///
+IMD_TAG_TABLE_INLINE
+PIMD_TAG_SLOT
+ImdTagTableGrow(PIMD_TAG_TABLE Table, PIMD_TAG_SLOT NewSlots,
+    ULONG NewCapacity)
+{
+    PIMD_TAG_SLOT old_slots = Table->slots;
+    ULONG slot;
+
+    for (slot = 0; slot < Table->capacity; slot++)
+    {
+        NewSlots[slot] = old_slots[slot];
+    }
+
+    // Lowest new slot numbers first on free list.
+    for (slot = NewCapacity; slot-- > Table->capacity;)
+    {
+        NewSlots[slot].item = NULL;
+        NewSlots[slot].generation = 1;
+        NewSlots[slot].next_free = Table->free_head;
+        Table->free_head = slot;
+    }
+
+    Table->slots = NewSlots;
+    Table->capacity = NewCapacity;
+
+    return old_slots;
+}
+
+///
+/// Stores Item, which must not be NULL, in a free slot and returns its tag.
+/// Table must not be full. Tags are never zero.
+///
+IMD_TAG_TABLE_INLINE
+ULONGLONG
+ImdTagTableInsert(PIMD_TAG_TABLE Table, void *Item)
+{
+    ULONG slot = Table->free_head;
+    PIMD_TAG_SLOT entry = Table->slots + slot;
+
+    Table->free_head = entry->next_free;
+    Table->in_use++;
+
+    entry->item = Item;
+
+    return ImdTagTableMakeTag(slot, entry->generation);
+}
+
+///
+/// Frees a slot in use and returns its item. New generation makes any later
+/// lookup with the old tag fail.
+///
+IMD_TAG_TABLE_INLINE
+void *
+ImdTagTableRemoveSlot(PIMD_TAG_TABLE Table, ULONG Slot)
+{
+    PIMD_TAG_SLOT entry = Table->slots + Slot;
+    void *item = entry->item;
+
+    entry->item = NULL;
+
+    if (++entry->generation == 0)
+    {
+        entry->generation = 1;
+    }
+
+    entry->next_free = Table->free_head;
+    Table->free_head = Slot;
+    Table->in_use--;
+
+    return item;
+}
+
+///
+/// Item for Tag, or NULL if Tag does not belong to a request in table. Tags
+/// can come from other side of a connection and are not trusted.
+///
+IMD_TAG_TABLE_INLINE
+void *
+ImdTagTableLookup(const IMD_TAG_TABLE *Table, ULONGLONG Tag)
+{
+    ULONG slot = (ULONG)Tag;
+    ULONG generation = (ULONG)(Tag >> 32);
+
+    if (slot >= Table->capacity ||
+        Table->slots[slot].item == NULL ||
+        Table->slots[slot].generation != generation)
+    {
+        return NULL;
+    }
+
+    return Table->slots[slot].item;
+}
+
+///
+/// Removes and returns item for Tag, or NULL if Tag does not match a
+/// request in table.
+///
+IMD_TAG_TABLE_INLINE
+void *
+ImdTagTableRemove(PIMD_TAG_TABLE Table, ULONGLONG Tag)
+{
+    if (ImdTagTableLookup(Table, Tag) == NULL)
+    {
+        return NULL;
+    }
+
+    return ImdTagTableRemoveSlot(Table, (ULONG)Tag);
+}
+
+///
+/// Puts Item, which must not be NULL, in place of item for Tag and returns
+/// the old one, or NULL if Tag does not match a request in table. Tag stays
+/// valid, so a response that is still on its way finds the new item.
+///
+IMD_TAG_TABLE_INLINE
+void *
+ImdTagTableReplace(PIMD_TAG_TABLE Table, ULONGLONG Tag, void *Item)
+{
+    void *item = ImdTagTableLookup(Table, Tag);
+
+    if (item != NULL)
+    {
+        Table->slots[(ULONG)Tag].item = Item;
+    }
+
+    return item;
+}
+
+#endif // _INC_IMDTAGTAB_
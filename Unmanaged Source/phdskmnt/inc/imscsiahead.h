@@ -0,0 +1,235 @@
+/// imscsiahead.h
+/// Sequential stream detection and window sizing for read-ahead into the
+/// read cache in imscsicache.h. Read requests are matched against a few
+/// tracked streams. Each stream has a read-ahead window that grows while
+/// read-ahead data is used or reader catches up with it, and shrinks when
+/// data read ahead is evicted before it is read.
+/// This only depends on compiler, so it can be used outside the driver as
+/// well. Locking is left to caller, the same lock as for the cache.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSIAHEAD_
+#define _INC_IMSCSIAHEAD_
+
+#include <imdproxy.h>
+#include <imscsicache.h>
+
+#if defined(_MSC_VER)
+#define IMSCSI_AHEAD_INLINE __forceinline
+#else
+#define IMSCSI_AHEAD_INLINE static inline
+#endif
+
+#define IMSCSI_READ_AHEAD_STREAMS       8            // Sequential streams tracked per LU
+#define IMSCSI_READ_AHEAD_MIN_WINDOW    (128UL << 10)
+#define IMSCSI_READ_AHEAD_CHUNK         (256UL << 10) // Largest read done at a time
+
+// Sequential read stream detected among read requests on a cached LU.
+// Read-ahead keeps Window bytes after NextOffset in read cache.
+typedef struct _IMSCSI_READ_AHEAD_STREAM
+{
+    LONGLONG    NextOffset;            // Where next read in stream is expected
+    LONGLONG    FilledOffset;          // Read-ahead is in cache up to here
+    LONGLONG    AheadOffset;           // Read-ahead is started up to here
+    ULONG       Window;                // Zero until stream is sequential
+    ULONG       SequentialCount;       // Zero if slot is unused
+    ULONG       LastUsed;              // For replacing least recently used
+    ULONG       Id;                    // Changed each time slot is reused
+} IMSCSI_READ_AHEAD_STREAM, *PIMSCSI_READ_AHEAD_STREAM;
+
+#define IMSCSI_AHEAD_MIN(a, b)          ((a) < (b) ? (a) : (b))
+#define IMSCSI_AHEAD_MAX(a, b)          ((a) > (b) ? (a) : (b))
+
+///
+/// Window limit for each stream, for a cache of CacheSize bytes. Streams
+/// together should not use more than half of the cache, or read-ahead
+/// data pushes out itself.
+///
+IMSCSI_AHEAD_INLINE
+ULONG
+ImScsiAheadMaxWindow(ULONGLONG CacheSize, ULONG MaxReadAheadSize)
+{
+    ULONGLONG max_window = IMSCSI_AHEAD_MIN((ULONGLONG)MaxReadAheadSize,
+        CacheSize / (2 * IMSCSI_READ_AHEAD_STREAMS));
+
+    return (ULONG)max_window & ~(IMSCSI_CACHE_LINE_SIZE - 1);
+}
+
+///
+/// Called for each read request with Hit set if it was served from cache.
+/// Clock is incremented by caller for each call. Bytes read ahead that will
+/// not be read are added to WastedBytes. Returns nonzero if there is
+/// read-ahead to do for the stream the request belongs to.
+///
+IMSCSI_AHEAD_INLINE
+int
+ImScsiAheadTrack(PIMSCSI_READ_AHEAD_STREAM Streams, ULONG Clock,
+    ULONG MaxWindow, LONGLONG DiskSize, LONGLONG Offset, ULONG Length,
+    int Hit, ULONGLONG *WastedBytes)
+{
+    PIMSCSI_READ_AHEAD_STREAM stream = NULL;
+    PIMSCSI_READ_AHEAD_STREAM victim = NULL;
+    ULONG i;
+
+    if (MaxWindow < IMSCSI_CACHE_LINE_SIZE)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < IMSCSI_READ_AHEAD_STREAMS; i++)
+    {
+        PIMSCSI_READ_AHEAD_STREAM candidate = &Streams[i];
+
+        if (candidate->SequentialCount == 0)
+        {
+            if (victim == NULL || victim->SequentialCount != 0)
+            {
+                victim = candidate;
+            }
+
+            continue;
+        }
+
+        if (candidate->NextOffset == Offset)
+        {
+            stream = candidate;
+            break;
+        }
+
+        if (victim == NULL ||
+            (victim->SequentialCount != 0 &&
+            (LONG)(candidate->LastUsed - victim->LastUsed) < 0))
+        {
+            victim = candidate;
+        }
+    }
+
+    if (stream == NULL)
+    {
+        // Data read ahead for replaced stream will not be read now
+        if (victim->SequentialCount != 0 &&
+            victim->FilledOffset > victim->NextOffset)
+        {
+            *WastedBytes += victim->FilledOffset - victim->NextOffset;
+        }
+
+        victim->NextOffset = Offset + Length;
+        victim->FilledOffset = victim->NextOffset;
+        victim->AheadOffset = victim->NextOffset;
+        victim->Window = 0;
+        victim->SequentialCount = 1;
+        victim->LastUsed = Clock;
+        victim->Id++;
+
+        return 0;
+    }
+
+    stream->LastUsed = Clock;
+    stream->SequentialCount++;
+
+    if (stream->Window == 0)
+    {
+        stream->Window = IMSCSI_AHEAD_MAX(IMSCSI_READ_AHEAD_MIN_WINDOW,
+            Length << 1);
+    }
+    else if (!Hit && Offset < stream->FilledOffset)
+    {
+        *WastedBytes += IMSCSI_AHEAD_MIN(stream->FilledOffset,
+            Offset + Length) - Offset;
+
+        stream->Window = IMSCSI_AHEAD_MAX(stream->Window >> 1,
+            IMSCSI_READ_AHEAD_MIN_WINDOW);
+    }
+    else if (Hit ? Offset < stream->FilledOffset : Offset >= stream->AheadOffset)
+    {
+        stream->Window <<= 1;
+    }
+
+    stream->Window = IMSCSI_AHEAD_MIN(stream->Window, MaxWindow);
+
+    stream->NextOffset = Offset + Length;
+
+    if (stream->AheadOffset < stream->NextOffset)
+    {
+        stream->AheadOffset = stream->NextOffset;
+        stream->FilledOffset = stream->NextOffset;
+    }
+
+    return (stream->AheadOffset < stream->NextOffset + stream->Window) &&
+        (stream->AheadOffset < DiskSize);
+}
+
+///
+/// Picks next chunk to read ahead, from first stream that has lines in its
+/// window that are not in Cache. Chunk is whole lines and at most
+/// IMSCSI_READ_AHEAD_CHUNK bytes, and is marked as started in stream.
+/// First line of device is never read ahead, because fake disk signature
+/// is applied to it on synchronous path. Returns index of stream, or -1 if
+/// there is nothing to read ahead.
+///
+IMSCSI_AHEAD_INLINE
+int
+ImScsiAheadNext(PIMSCSI_READ_AHEAD_STREAM Streams, PIMSCSI_CACHE Cache,
+    LONGLONG DiskSize, LONGLONG *Offset, ULONG *Length)
+{
+    ULONG i;
+
+    for (i = 0; i < IMSCSI_READ_AHEAD_STREAMS; i++)
+    {
+        PIMSCSI_READ_AHEAD_STREAM candidate = &Streams[i];
+        LONGLONG offset;
+        LONGLONG end;
+        ULONG length;
+
+        if (candidate->Window == 0)
+        {
+            continue;
+        }
+
+        end = IMSCSI_AHEAD_MIN(candidate->NextOffset + candidate->Window,
+            DiskSize);
+
+        offset = IMSCSI_AHEAD_MAX(candidate->AheadOffset &
+            ~(LONGLONG)(IMSCSI_CACHE_LINE_SIZE - 1),
+            (LONGLONG)IMSCSI_CACHE_LINE_SIZE);
+
+        while ((offset < end) &&
+            (ImScsiCacheFindLine(Cache,
+                offset >> IMSCSI_CACHE_LINE_SHIFT, 0) != NULL))
+        {
+            offset += IMSCSI_CACHE_LINE_SIZE;
+        }
+
+        if (offset >= end)
+        {
+            candidate->AheadOffset = IMSCSI_AHEAD_MAX(candidate->AheadOffset, end);
+            candidate->FilledOffset = IMSCSI_AHEAD_MAX(candidate->FilledOffset, end);
+            continue;
+        }
+
+        length = (ULONG)IMSCSI_AHEAD_MIN(end - offset,
+            (LONGLONG)IMSCSI_READ_AHEAD_CHUNK);
+        length = (length + IMSCSI_CACHE_LINE_SIZE - 1) &
+            ~(IMSCSI_CACHE_LINE_SIZE - 1);
+        length = (ULONG)IMSCSI_AHEAD_MIN((LONGLONG)length, DiskSize - offset);
+
+        candidate->AheadOffset = offset + length;
+
+        *Offset = offset;
+        *Length = length;
+
+        return (int)i;
+    }
+
+    return -1;
+}
+
+#endif // _INC_IMSCSIAHEAD_
@@ -0,0 +1,426 @@
+/// imscsicache.h
+/// Set-associative read cache with CLOCK replacement within each set, used
+/// as intermediate cache for image I/O. Cached data is kept in fixed size
+/// lines indexed by byte offset on device. This only depends on compiler
+/// and caller provided memory, so it can be used outside the driver as well.
+/// Locking is left to caller.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSICACHE_
+#define _INC_IMSCSICACHE_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMSCSI_CACHE_INLINE __forceinline
+#else
+#include <string.h>
+#define IMSCSI_CACHE_INLINE static inline
+#endif
+
+#define IMSCSI_CACHE_WAYS           8
+#define IMSCSI_CACHE_LINE_SHIFT     12
+#define IMSCSI_CACHE_LINE_SIZE      (1 << IMSCSI_CACHE_LINE_SHIFT)
+
+#define IMSCSI_CACHE_FREE_LINE      (-1LL)
+
+typedef struct _IMSCSI_CACHE_ENTRY
+{
+    LONGLONG line;              // Line number on device, IMSCSI_CACHE_FREE_LINE if free
+    ULONG referenced;           // Second chance flag for CLOCK replacement
+    ULONG reserved;
+} IMSCSI_CACHE_ENTRY, *PIMSCSI_CACHE_ENTRY;
+
+typedef struct _IMSCSI_CACHE
+{
+    ULONG set_count;            // Power of two, zero if cache is disabled
+    ULONG reserved;
+    ULONGLONG generation;       // Incremented by each write or invalidation
+    PIMSCSI_CACHE_ENTRY entries;    // set_count * IMSCSI_CACHE_WAYS entries
+    ULONGLONG *set_generations; // Value of generation when each set was last written
+    UCHAR *hands;               // CLOCK hand for each set
+    UCHAR *data;                // Line data, in same order as entries
+    ULONGLONG hits;
+    ULONGLONG misses;
+} IMSCSI_CACHE, *PIMSCSI_CACHE;
+
+///
+/// Memory needed for a cache with SetCount sets, to be passed to
+/// ImScsiCacheInitialize. Line data comes first, so memory keeps the
+/// alignment it was allocated with.
+///
+IMSCSI_CACHE_INLINE
+ULONGLONG
+ImScsiCacheMemorySize(ULONG SetCount)
+{
+    ULONGLONG lines = (ULONGLONG)SetCount * IMSCSI_CACHE_WAYS;
+
+    return (lines << IMSCSI_CACHE_LINE_SHIFT) +
+        lines * sizeof(IMSCSI_CACHE_ENTRY) +
+        SetCount * sizeof(ULONGLONG) +
+        SetCount;
+}
+
+///
+/// Largest power of two set count that fits within MemorySize bytes, or
+/// zero if not even one set fits.
+///
+IMSCSI_CACHE_INLINE
+ULONG
+ImScsiCacheSetCountForSize(ULONGLONG MemorySize)
+{
+    ULONG set_count = 1;
+
+    if (ImScsiCacheMemorySize(1) > MemorySize)
+    {
+        return 0;
+    }
+
+    while (set_count < 0x40000000UL &&
+        ImScsiCacheMemorySize(set_count << 1) <= MemorySize)
+    {
+        set_count <<= 1;
+    }
+
+    return set_count;
+}
+
+IMSCSI_CACHE_INLINE
+void
+ImScsiCacheInitialize(PIMSCSI_CACHE Cache, void *Memory, ULONG SetCount)
+{
+    ULONG lines = SetCount * IMSCSI_CACHE_WAYS;
+    ULONG i;
+
+    memset(Cache, 0, sizeof(*Cache));
+
+    if (SetCount == 0 || Memory == NULL)
+    {
+        return;
+    }
+
+    Cache->data = (UCHAR*)Memory;
+    Cache->entries = (PIMSCSI_CACHE_ENTRY)(Cache->data +
+        ((ULONGLONG)lines << IMSCSI_CACHE_LINE_SHIFT));
+    Cache->set_generations = (ULONGLONG*)(Cache->entries + lines);
+    Cache->hands = (UCHAR*)(Cache->set_generations + SetCount);
+
+    for (i = 0; i < lines; i++)
+    {
+        Cache->entries[i].line = IMSCSI_CACHE_FREE_LINE;
+        Cache->entries[i].referenced = 0;
+    }
+
+    memset(Cache->set_generations, 0, SetCount * sizeof(ULONGLONG));
+    memset(Cache->hands, 0, SetCount);
+
+    Cache->set_count = SetCount;
+}
+
+IMSCSI_CACHE_INLINE
+ULONG
+ImScsiCacheFirstEntry(PIMSCSI_CACHE Cache, LONGLONG Line)
+{
+    // Consecutive lines go to consecutive sets. High bits are folded in so
+    // that lines far apart with equal low bits do not always collide.
+    ULONGLONG hash = (ULONGLONG)Line ^ ((ULONGLONG)Line >> 20);
+
+    return ((ULONG)hash & (Cache->set_count - 1)) * IMSCSI_CACHE_WAYS;
+}
+
+///
+/// Marks set that Line belongs to as written at current generation, so that
+/// data read for lines in that set before now is not stored by
+/// ImScsiCacheFill.
+///
+IMSCSI_CACHE_INLINE
+void
+ImScsiCacheTouchSet(PIMSCSI_CACHE Cache, LONGLONG Line)
+{
+    Cache->set_generations[ImScsiCacheFirstEntry(Cache, Line) /
+        IMSCSI_CACHE_WAYS] = Cache->generation;
+}
+
+///
+/// Returns data for a cached line, or NULL if line is not cached.
+///
+IMSCSI_CACHE_INLINE
+UCHAR *
+ImScsiCacheFindLine(PIMSCSI_CACHE Cache, LONGLONG Line, int Reference)
+{
+    ULONG first = ImScsiCacheFirstEntry(Cache, Line);
+    ULONG i;
+
+    for (i = first; i < first + IMSCSI_CACHE_WAYS; i++)
+    {
+        if (Cache->entries[i].line == Line)
+        {
+            if (Reference)
+            {
+                Cache->entries[i].referenced = 1;
+            }
+
+            return Cache->data + ((ULONGLONG)i << IMSCSI_CACHE_LINE_SHIFT);
+        }
+    }
+
+    return NULL;
+}
+
+///
+/// Returns data area for a line, reusing an existing entry for the same line
+/// or replacing a victim selected by CLOCK within the set.
+///
+IMSCSI_CACHE_INLINE
+UCHAR *
+ImScsiCacheAllocateLine(PIMSCSI_CACHE Cache, LONGLONG Line)
+{
+    ULONG first = ImScsiCacheFirstEntry(Cache, Line);
+    ULONG set = first / IMSCSI_CACHE_WAYS;
+    ULONG i;
+
+    UCHAR *existing = ImScsiCacheFindLine(Cache, Line, 1);
+
+    if (existing != NULL)
+    {
+        return existing;
+    }
+
+    for (;;)
+    {
+        i = first + Cache->hands[set];
+
+        Cache->hands[set] = (UCHAR)((Cache->hands[set] + 1) % IMSCSI_CACHE_WAYS);
+
+        if (Cache->entries[i].line == IMSCSI_CACHE_FREE_LINE ||
+            !Cache->entries[i].referenced)
+        {
+            break;
+        }
+
+        Cache->entries[i].referenced = 0;
+    }
+
+    Cache->entries[i].line = Line;
+    Cache->entries[i].referenced = 0;
+
+    return Cache->data + ((ULONGLONG)i << IMSCSI_CACHE_LINE_SHIFT);
+}
+
+///
+/// Returns nonzero if all lines touched by Length bytes at Offset are
+/// cached. Does not count as a hit or miss.
+///
+IMSCSI_CACHE_INLINE
+int
+ImScsiCacheContains(PIMSCSI_CACHE Cache, LONGLONG Offset, ULONG Length)
+{
+    LONGLONG first_line = Offset >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG last_line = (Offset + Length - 1) >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG line;
+
+    if (Cache->set_count == 0 || Length == 0)
+    {
+        return 0;
+    }
+
+    for (line = first_line; line <= last_line; line++)
+    {
+        if (ImScsiCacheFindLine(Cache, line, 0) == NULL)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+///
+/// Copies Length bytes at Offset to Buffer if all lines they touch are
+/// cached. Returns nonzero on hit.
+///
+IMSCSI_CACHE_INLINE
+int
+ImScsiCacheRead(PIMSCSI_CACHE Cache, LONGLONG Offset, ULONG Length, void *Buffer)
+{
+    LONGLONG first_line = Offset >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG last_line = (Offset + Length - 1) >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG line;
+    UCHAR *dest = (UCHAR*)Buffer;
+
+    if (Cache->set_count == 0 || Length == 0)
+    {
+        return 0;
+    }
+
+    if (!ImScsiCacheContains(Cache, Offset, Length))
+    {
+        Cache->misses++;
+        return 0;
+    }
+
+    for (line = first_line; line <= last_line; line++)
+    {
+        LONGLONG line_offset = line << IMSCSI_CACHE_LINE_SHIFT;
+        LONGLONG start = Offset > line_offset ? Offset : line_offset;
+        LONGLONG end = Offset + Length < line_offset + IMSCSI_CACHE_LINE_SIZE ?
+            Offset + Length : line_offset + IMSCSI_CACHE_LINE_SIZE;
+
+        UCHAR *data = ImScsiCacheFindLine(Cache, line, 1);
+
+        memcpy(dest + (start - Offset), data + (start - line_offset),
+            (size_t)(end - start));
+    }
+
+    Cache->hits++;
+
+    return 1;
+}
+
+///
+/// Stores data read from device. Only lines completely covered are stored.
+/// Generation is the value of Cache->generation from before data was read.
+/// Lines in sets that have been written or invalidated since are skipped,
+/// because data for them could be older than what is on device by now.
+/// Writes elsewhere on device do not keep other lines from being stored.
+///
+IMSCSI_CACHE_INLINE
+void
+ImScsiCacheFill(PIMSCSI_CACHE Cache, ULONGLONG Generation, LONGLONG Offset, ULONG Length, const void *Buffer)
+{
+    LONGLONG line = (Offset + IMSCSI_CACHE_LINE_SIZE - 1) >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG end_line = (Offset + Length) >> IMSCSI_CACHE_LINE_SHIFT;
+    const UCHAR *src = (const UCHAR*)Buffer;
+
+    if (Cache->set_count == 0)
+    {
+        return;
+    }
+
+    for (; line < end_line; line++)
+    {
+        if (Cache->set_generations[ImScsiCacheFirstEntry(Cache, line) /
+            IMSCSI_CACHE_WAYS] > Generation)
+        {
+            continue;
+        }
+
+        memcpy(ImScsiCacheAllocateLine(Cache, line),
+            src + ((line << IMSCSI_CACHE_LINE_SHIFT) - Offset),
+            IMSCSI_CACHE_LINE_SIZE);
+    }
+}
+
+///
+/// Drops cached lines that overlap Length bytes at Offset.
+///
+IMSCSI_CACHE_INLINE
+void
+ImScsiCacheInvalidate(PIMSCSI_CACHE Cache, LONGLONG Offset, ULONGLONG Length)
+{
+    LONGLONG first_line = Offset >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG last_line = (LONGLONG)((Offset + Length - 1) >> IMSCSI_CACHE_LINE_SHIFT);
+    ULONG lines = Cache->set_count * IMSCSI_CACHE_WAYS;
+    ULONG i;
+
+    Cache->generation++;
+
+    if (Cache->set_count == 0 || Length == 0)
+    {
+        return;
+    }
+
+    // Large ranges, typically from unmap requests, are cheaper to check
+    // against each entry than to look up line by line. They cover at least
+    // as many consecutive lines as there are sets, so all sets are touched.
+    if ((ULONGLONG)(last_line - first_line) >= lines)
+    {
+        for (i = 0; i < Cache->set_count; i++)
+        {
+            Cache->set_generations[i] = Cache->generation;
+        }
+
+        for (i = 0; i < lines; i++)
+        {
+            if (Cache->entries[i].line >= first_line &&
+                Cache->entries[i].line <= last_line)
+            {
+                Cache->entries[i].line = IMSCSI_CACHE_FREE_LINE;
+            }
+        }
+
+        return;
+    }
+
+    for (; first_line <= last_line; first_line++)
+    {
+        UCHAR *data = ImScsiCacheFindLine(Cache, first_line, 0);
+
+        ImScsiCacheTouchSet(Cache, first_line);
+
+        if (data != NULL)
+        {
+            i = (ULONG)((data - Cache->data) >> IMSCSI_CACHE_LINE_SHIFT);
+
+            Cache->entries[i].line = IMSCSI_CACHE_FREE_LINE;
+        }
+    }
+}
+
+///
+/// Updates cache with data written to device. Lines completely covered are
+/// stored, partly covered lines that are already cached are patched.
+///
+IMSCSI_CACHE_INLINE
+void
+ImScsiCacheWrite(PIMSCSI_CACHE Cache, LONGLONG Offset, ULONG Length, const void *Buffer)
+{
+    LONGLONG first_line = Offset >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG last_line = (Offset + Length - 1) >> IMSCSI_CACHE_LINE_SHIFT;
+    LONGLONG line;
+    const UCHAR *src = (const UCHAR*)Buffer;
+
+    Cache->generation++;
+
+    if (Cache->set_count == 0 || Length == 0)
+    {
+        return;
+    }
+
+    for (line = first_line; line <= last_line; line++)
+    {
+        LONGLONG line_offset = line << IMSCSI_CACHE_LINE_SHIFT;
+        LONGLONG start = Offset > line_offset ? Offset : line_offset;
+        LONGLONG end = Offset + Length < line_offset + IMSCSI_CACHE_LINE_SIZE ?
+            Offset + Length : line_offset + IMSCSI_CACHE_LINE_SIZE;
+
+        UCHAR *data;
+
+        ImScsiCacheTouchSet(Cache, line);
+
+        if (end - start == IMSCSI_CACHE_LINE_SIZE)
+        {
+            data = ImScsiCacheAllocateLine(Cache, line);
+        }
+        else
+        {
+            data = ImScsiCacheFindLine(Cache, line, 0);
+        }
+
+        if (data != NULL)
+        {
+            memcpy(data + (start - line_offset), src + (start - Offset),
+                (size_t)(end - start));
+        }
+    }
+}
+
+#endif // _INC_IMSCSICACHE_
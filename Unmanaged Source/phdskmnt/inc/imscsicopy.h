@@ -0,0 +1,115 @@
+/// imscsicopy.h
+/// Memory copy for VM (RAM) disks, between request buffers and the image
+/// buffer. Large writes to the image are done with non-temporal stores, so
+/// that they do not push everything else out of processor caches. Reads
+/// use plain copies, because request buffer is about to be used by whoever
+/// sent the request and should stay in cache. Streaming stores are only
+/// used on x64, where kernel mode code can use SSE2 registers without
+/// saving floating point state first. Other architectures use memcpy.
+/// This only depends on compiler, so it can be used outside the driver as
+/// well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSICOPY_
+#define _INC_IMSCSICOPY_
+
+#include <imdproxy.h>
+
+#if defined(_M_AMD64) || defined(__x86_64__)
+#define IMSCSI_COPY_STREAMING
+#endif
+
+#if defined(_MSC_VER)
+#define IMSCSI_COPY_INLINE __forceinline
+#if defined(IMSCSI_COPY_STREAMING)
+#include <intrin.h>
+#endif
+#else
+#define IMSCSI_COPY_INLINE static inline
+#include <stddef.h>
+#include <string.h>
+#if defined(IMSCSI_COPY_STREAMING)
+#include <emmintrin.h>
+#endif
+#endif
+
+#define IMSCSI_NON_TEMPORAL_COPY_MIN    (256UL << 10) // Smallest VM disk write done with streaming stores
+
+///
+/// Copies with 16 byte streaming stores, after plain copy of head up to
+/// first aligned destination address. Stores are fenced before return, so
+/// data is visible to other processors when request is completed.
+///
+#if defined(IMSCSI_COPY_STREAMING)
+IMSCSI_COPY_INLINE
+void
+ImScsiCopyStreaming(void *Destination, const void *Source, size_t Length)
+{
+    UCHAR *dst = (UCHAR*)Destination;
+    const UCHAR *src = (const UCHAR*)Source;
+    size_t head = ((size_t)0 - (size_t)dst) & 15;
+
+    if (head > Length)
+    {
+        head = Length;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    Length -= head;
+
+    while (Length >= 64)
+    {
+        __m128i x0 = _mm_loadu_si128((const __m128i*)src);
+        __m128i x1 = _mm_loadu_si128((const __m128i*)(src + 16));
+        __m128i x2 = _mm_loadu_si128((const __m128i*)(src + 32));
+        __m128i x3 = _mm_loadu_si128((const __m128i*)(src + 48));
+
+        _mm_stream_si128((__m128i*)dst, x0);
+        _mm_stream_si128((__m128i*)(dst + 16), x1);
+        _mm_stream_si128((__m128i*)(dst + 32), x2);
+        _mm_stream_si128((__m128i*)(dst + 48), x3);
+
+        dst += 64;
+        src += 64;
+        Length -= 64;
+    }
+
+    _mm_sfence();
+
+    memcpy(dst, src, Length);
+}
+#endif
+
+IMSCSI_COPY_INLINE
+void
+ImScsiCopyFromVMDisk(void *Destination, const void *Image, size_t Length)
+{
+    memcpy(Destination, Image, Length);
+}
+
+IMSCSI_COPY_INLINE
+void
+ImScsiCopyToVMDisk(void *Image, const void *Source, size_t Length)
+{
+#if defined(IMSCSI_COPY_STREAMING)
+    if (Length >= IMSCSI_NON_TEMPORAL_COPY_MIN)
+    {
+        ImScsiCopyStreaming(Image, Source, Length);
+        return;
+    }
+#endif
+
+    memcpy(Image, Source, Length);
+}
+
+#endif // _INC_IMSCSICOPY_
@@ -0,0 +1,211 @@
+/// imscsimerge.h
+/// Merging of queued read or write requests for adjacent byte ranges into
+/// one larger request to image, and splitting of the result back to each of
+/// the merged requests. Requests are only appended at end of merged range,
+/// so data for each request is at a known position in a merged buffer.
+///
+/// If a gap span is allowed, requests that start after a gap are appended
+/// as well, within that span from start of first request. Such a merged
+/// request is served as a list of extents, with data for all of them
+/// concatenated in merged buffer, as in IMDPROXY_REQ_READV and _WRITEV.
+///
+/// This only depends on compiler, so it can be used outside the driver as
+/// well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSIMERGE_
+#define _INC_IMSCSIMERGE_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMSCSI_MERGE_INLINE __forceinline
+#else
+#define IMSCSI_MERGE_INLINE static inline
+#endif
+
+#define IMSCSI_MERGE_MAX_REQUESTS   16          // Requests in one merged request
+
+typedef struct _IMSCSI_MERGE
+{
+    LONGLONG offset;            // First byte on device
+    LONGLONG end;               // End of last merged request on device
+    ULONG length;               // Total length of merged requests
+    ULONG write;                // Nonzero if requests are writes
+    ULONG max_length;           // Largest total length allowed
+    ULONG max_span;             // Largest end - offset with gaps, zero for none
+    ULONG count;
+    ULONG extent_count;         // Number of separate ranges on device
+    ULONG lengths[IMSCSI_MERGE_MAX_REQUESTS];
+    LONGLONG offsets[IMSCSI_MERGE_MAX_REQUESTS];
+} IMSCSI_MERGE, *PIMSCSI_MERGE;
+
+///
+/// Starts a merged request with one request.
+///
+IMSCSI_MERGE_INLINE
+void
+ImScsiMergeInit(PIMSCSI_MERGE Merge, LONGLONG Offset, ULONG Length,
+    int Write, ULONG MaxLength)
+{
+    Merge->offset = Offset;
+    Merge->end = Offset + Length;
+    Merge->length = Length;
+    Merge->write = Write ? 1 : 0;
+    Merge->max_length = MaxLength;
+    Merge->max_span = 0;
+    Merge->count = 1;
+    Merge->extent_count = 1;
+    Merge->lengths[0] = Length;
+    Merge->offsets[0] = Offset;
+}
+
+///
+/// Also accept requests that start after a gap, as long as all merged
+/// requests are within MaxSpan bytes from start of first one.
+///
+IMSCSI_MERGE_INLINE
+void
+ImScsiMergeAllowGaps(PIMSCSI_MERGE Merge, ULONG MaxSpan)
+{
+    Merge->max_span = MaxSpan;
+}
+
+///
+/// Returns nonzero if a request starts where merged range ends, or after a
+/// gap if allowed, goes in the same direction and fits within limits.
+///
+IMSCSI_MERGE_INLINE
+int
+ImScsiMergeCanAppend(const IMSCSI_MERGE *Merge, LONGLONG Offset,
+    ULONG Length, int Write)
+{
+    if ((Merge->count >= IMSCSI_MERGE_MAX_REQUESTS) ||
+        (Length == 0) ||
+        ((Write ? 1U : 0U) != Merge->write) ||
+        (Length > Merge->max_length) ||
+        (Merge->length > Merge->max_length - Length))
+    {
+        return 0;
+    }
+
+    if (Offset == Merge->end)
+    {
+        return 1;
+    }
+
+    return (Offset > Merge->end) &&
+        (Offset - Merge->offset < (LONGLONG)Merge->max_span) &&
+        ((LONGLONG)Length <= (LONGLONG)Merge->max_span -
+            (Offset - Merge->offset));
+}
+
+///
+/// Appends a request accepted by ImScsiMergeCanAppend. Returns its index.
+///
+IMSCSI_MERGE_INLINE
+ULONG
+ImScsiMergeAppend(PIMSCSI_MERGE Merge, LONGLONG Offset, ULONG Length)
+{
+    if (Offset != Merge->end)
+    {
+        Merge->extent_count++;
+    }
+
+    Merge->lengths[Merge->count] = Length;
+    Merge->offsets[Merge->count] = Offset;
+    Merge->length += Length;
+    Merge->end = Offset + Length;
+
+    return Merge->count++;
+}
+
+///
+/// Fills Extents, which has room for extent_count items, with ranges on
+/// device that merged requests cover. Adjacent requests share an extent.
+/// Returns number of extents.
+///
+IMSCSI_MERGE_INLINE
+ULONG
+ImScsiMergeGetExtents(const IMSCSI_MERGE *Merge, PIMDPROXY_EXTENT Extents)
+{
+    ULONG count = 0;
+    ULONG i;
+
+    for (i = 0; i < Merge->count; i++)
+    {
+        if ((count > 0) &&
+            ((LONGLONG)(Extents[count - 1].offset +
+                Extents[count - 1].length) == Merge->offsets[i]))
+        {
+            Extents[count - 1].length += Merge->lengths[i];
+            continue;
+        }
+
+        Extents[count].offset = (ULONGLONG)Merge->offsets[i];
+        Extents[count].length = Merge->lengths[i];
+        count++;
+    }
+
+    return count;
+}
+
+///
+/// Position of request Index in merged buffer.
+///
+IMSCSI_MERGE_INLINE
+ULONG
+ImScsiMergeGetPosition(const IMSCSI_MERGE *Merge, ULONG Index)
+{
+    ULONG position = 0;
+    ULONG i;
+
+    for (i = 0; i < Index && i < Merge->count; i++)
+    {
+        position += Merge->lengths[i];
+    }
+
+    return position;
+}
+
+///
+/// Number of bytes transferred for request Index, when Done bytes were
+/// transferred for merged request. A short transfer ends early requests in
+/// full, cuts one of them and leaves the rest with nothing.
+///
+IMSCSI_MERGE_INLINE
+ULONG
+ImScsiMergeGetTransferred(const IMSCSI_MERGE *Merge, ULONG Index,
+    ULONG Done)
+{
+    ULONG position;
+
+    if (Index >= Merge->count)
+    {
+        return 0;
+    }
+
+    position = ImScsiMergeGetPosition(Merge, Index);
+
+    if (Done <= position)
+    {
+        return 0;
+    }
+
+    if (Done - position < Merge->lengths[Index])
+    {
+        return Done - position;
+    }
+
+    return Merge->lengths[Index];
+}
+
+#endif // _INC_IMSCSIMERGE_
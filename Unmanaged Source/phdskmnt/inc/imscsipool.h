@@ -0,0 +1,178 @@
+/// imscsipool.h
+/// Size classes and free list accounting for work items and data buffers
+/// allocated on I/O path. Data buffers are in a number of size classes,
+/// each a power of two. Free entries are kept in each class up to a
+/// capacity that grows with each LU, anything beyond that goes back to
+/// nonpaged pool. Lists and allocations themselves are left to caller, as
+/// is locking, so this only depends on compiler and can be used outside the
+/// driver as well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSIPOOL_
+#define _INC_IMSCSIPOOL_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMSCSI_POOL_INLINE __forceinline
+#else
+#define IMSCSI_POOL_INLINE static inline
+#endif
+
+#define IMSCSI_POOL_MIN_SHIFT           12           // Smallest data buffer class, 4 KB
+#define IMSCSI_POOL_CLASSES             9            // Data buffer classes up to 1 MB
+#define IMSCSI_POOL_WORK_ITEMS_PER_LU   32           // Work items allocated with each LU
+#define IMSCSI_POOL_BYTES_PER_LU        (256UL << 10) // Free buffers kept in each class for each LU
+#define IMSCSI_POOL_MIN_BUFFERS_PER_LU  2
+
+// Counters for one free list, updated under the lock for the list.
+typedef struct _IMSCSI_POOL_STATE
+{
+    ULONG       Size;              // Zero for buffers larger than largest class
+    ULONG       FreeCount;
+    ULONG       Capacity;          // Most free entries kept, grows with each LU
+    ULONG       InUse;
+    ULONG       HighWater;         // Most entries in use at the same time
+    ULONGLONG   Allocations;
+    ULONGLONG   Hits;              // Allocations served from free list
+    ULONGLONG   Failures;
+} IMSCSI_POOL_STATE, *PIMSCSI_POOL_STATE;
+
+///
+/// Index of smallest data buffer class that holds Size bytes, or
+/// IMSCSI_POOL_CLASSES if Size is larger than largest class.
+///
+IMSCSI_POOL_INLINE
+ULONG
+ImScsiPoolClassIndex(ULONG Size)
+{
+    ULONG i;
+
+    for (i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        if (Size <= (1UL << (IMSCSI_POOL_MIN_SHIFT + i)))
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+IMSCSI_POOL_INLINE
+ULONG
+ImScsiPoolClassSize(ULONG Index)
+{
+    return 1UL << (IMSCSI_POOL_MIN_SHIFT + Index);
+}
+
+///
+/// Free buffers kept in a data buffer class for each LU. Each class keeps
+/// about the same number of bytes, but at least a couple of buffers.
+///
+IMSCSI_POOL_INLINE
+ULONG
+ImScsiPoolBuffersPerLU(ULONG Index)
+{
+    ULONG buffers = IMSCSI_POOL_BYTES_PER_LU >> (IMSCSI_POOL_MIN_SHIFT + Index);
+
+    if (buffers < IMSCSI_POOL_MIN_BUFFERS_PER_LU)
+    {
+        buffers = IMSCSI_POOL_MIN_BUFFERS_PER_LU;
+    }
+
+    return buffers;
+}
+
+///
+/// Counts an allocation, with FromFreeList set if an entry was taken off
+/// the free list. Otherwise caller allocates a new entry, and calls
+/// ImScsiPoolCountFailure if that fails.
+///
+IMSCSI_POOL_INLINE
+void
+ImScsiPoolCountAllocate(PIMSCSI_POOL_STATE State, int FromFreeList)
+{
+    if (FromFreeList)
+    {
+        State->FreeCount--;
+        State->Hits++;
+    }
+
+    State->Allocations++;
+    State->InUse++;
+
+    if (State->InUse > State->HighWater)
+    {
+        State->HighWater = State->InUse;
+    }
+}
+
+IMSCSI_POOL_INLINE
+void
+ImScsiPoolCountFailure(PIMSCSI_POOL_STATE State)
+{
+    State->InUse--;
+    State->Failures++;
+}
+
+///
+/// Counts an entry given back. Returns nonzero if caller should put it on
+/// free list, zero if it should be freed.
+///
+IMSCSI_POOL_INLINE
+int
+ImScsiPoolCountFree(PIMSCSI_POOL_STATE State)
+{
+    State->InUse--;
+
+    if (State->FreeCount < State->Capacity)
+    {
+        State->FreeCount++;
+        return 1;
+    }
+
+    return 0;
+}
+
+///
+/// Changes capacity, never below zero. Returns number of entries caller
+/// should take off free list and free, those are already subtracted from
+/// FreeCount. Entries missing up to new capacity are returned in Missing.
+///
+IMSCSI_POOL_INLINE
+ULONG
+ImScsiPoolChangeCapacity(PIMSCSI_POOL_STATE State, LONG Change,
+    ULONG *Missing)
+{
+    ULONG excess = 0;
+
+    if ((Change < 0) && ((ULONGLONG)-(LONGLONG)Change > State->Capacity))
+    {
+        State->Capacity = 0;
+    }
+    else
+    {
+        State->Capacity += Change;
+    }
+
+    if (State->FreeCount > State->Capacity)
+    {
+        excess = State->FreeCount - State->Capacity;
+        State->FreeCount = State->Capacity;
+    }
+
+    *Missing = State->Capacity - State->FreeCount;
+
+    return excess;
+}
+
+#endif // _INC_IMSCSIPOOL_
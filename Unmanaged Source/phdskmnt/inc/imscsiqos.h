@@ -0,0 +1,234 @@
+/// imscsiqos.h
+/// Limits for requests and bytes per second on a virtual disk, and priority
+/// classes between virtual disks on the same adapter. Limits are kept with
+/// token buckets that save up at most IMSCSI_QOS_BURST_TICKS worth of
+/// tokens. A request larger than that is let through when bucket is full and
+/// leaves it in debt, so large requests are delayed rather than blocked
+/// forever. Requests in lower priority classes yield for a short time to
+/// requests in progress in higher classes, once per request, so they are
+/// slowed down but never starved.
+/// Time is counted in 100 ns ticks from any starting point. This only
+/// depends on compiler, so it can be used outside the driver as well.
+/// Locking is left to caller.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSIQOS_
+#define _INC_IMSCSIQOS_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMSCSI_QOS_INLINE __forceinline
+#else
+#define IMSCSI_QOS_INLINE static inline
+#endif
+
+#define IMSCSI_QOS_TICKS_PER_SECOND 10000000ULL
+#define IMSCSI_QOS_BURST_TICKS      (IMSCSI_QOS_TICKS_PER_SECOND / 10)
+#define IMSCSI_QOS_MAX_ELAPSED      (IMSCSI_QOS_TICKS_PER_SECOND * 3600)
+#define IMSCSI_QOS_MAX_RATE         (1ULL << 38)    // Keeps tick arithmetic in 64 bits
+
+#define IMSCSI_QOS_CLASS_HIGH       0
+#define IMSCSI_QOS_CLASS_NORMAL     1
+#define IMSCSI_QOS_CLASS_LOW        2
+#define IMSCSI_QOS_CLASS_BACKGROUND 3
+#define IMSCSI_QOS_CLASSES          4
+
+typedef struct _IMSCSI_QOS_BUCKET
+{
+    ULONGLONG rate;             // Tokens per second, zero for no limit
+    ULONGLONG burst;            // Most tokens saved up
+    LONGLONG tokens;            // Negative after a request larger than burst
+    ULONGLONG last;             // Time of last refill
+} IMSCSI_QOS_BUCKET, *PIMSCSI_QOS_BUCKET;
+
+typedef struct _IMSCSI_QOS
+{
+    IMSCSI_QOS_BUCKET requests;
+    IMSCSI_QOS_BUCKET bytes;
+    int priority_class;         // IMSCSI_QOS_CLASS_xxx
+    ULONGLONG delayed;          // Requests that had to wait
+    ULONGLONG delay_ticks;      // Total time requests waited
+} IMSCSI_QOS, *PIMSCSI_QOS;
+
+IMSCSI_QOS_INLINE
+void
+ImScsiQosSetRate(PIMSCSI_QOS_BUCKET Bucket, ULONGLONG Rate, ULONGLONG Now)
+{
+    if (Rate > IMSCSI_QOS_MAX_RATE)
+    {
+        Rate = IMSCSI_QOS_MAX_RATE;
+    }
+
+    Bucket->rate = Rate;
+    Bucket->burst = Rate * IMSCSI_QOS_BURST_TICKS / IMSCSI_QOS_TICKS_PER_SECOND;
+
+    if (Bucket->burst == 0)
+    {
+        Bucket->burst = 1;
+    }
+
+    Bucket->tokens = (LONGLONG)Bucket->burst;
+    Bucket->last = Now;
+}
+
+IMSCSI_QOS_INLINE
+void
+ImScsiQosRefill(PIMSCSI_QOS_BUCKET Bucket, ULONGLONG Now)
+{
+    ULONGLONG elapsed;
+    ULONGLONG part;
+    ULONGLONG added;
+
+    if (Bucket->rate == 0 || Now <= Bucket->last)
+    {
+        return;
+    }
+
+    elapsed = Now - Bucket->last;
+    Bucket->last = Now;
+
+    if (elapsed > IMSCSI_QOS_MAX_ELAPSED)
+    {
+        elapsed = IMSCSI_QOS_MAX_ELAPSED;
+    }
+
+    part = (elapsed % IMSCSI_QOS_TICKS_PER_SECOND) * Bucket->rate;
+
+    added = (elapsed / IMSCSI_QOS_TICKS_PER_SECOND) * Bucket->rate +
+        part / IMSCSI_QOS_TICKS_PER_SECOND;
+
+    // Ticks not yet worth a whole token count towards next refill, or low
+    // rates checked often would never add anything
+    Bucket->last -= (part % IMSCSI_QOS_TICKS_PER_SECOND) / Bucket->rate;
+
+    Bucket->tokens += (LONGLONG)added;
+
+    if (Bucket->tokens > (LONGLONG)Bucket->burst)
+    {
+        Bucket->tokens = (LONGLONG)Bucket->burst;
+    }
+}
+
+///
+/// Ticks to wait before Cost tokens can be taken, zero if they can be taken
+/// now. Call ImScsiQosRefill first.
+///
+IMSCSI_QOS_INLINE
+ULONGLONG
+ImScsiQosGetWait(const IMSCSI_QOS_BUCKET *Bucket, ULONGLONG Cost)
+{
+    ULONGLONG need;
+    ULONGLONG missing;
+
+    if (Bucket->rate == 0)
+    {
+        return 0;
+    }
+
+    need = Cost < Bucket->burst ? Cost : Bucket->burst;
+
+    if (Bucket->tokens >= (LONGLONG)need)
+    {
+        return 0;
+    }
+
+    missing = (ULONGLONG)((LONGLONG)need - Bucket->tokens);
+
+    return (missing / Bucket->rate) * IMSCSI_QOS_TICKS_PER_SECOND +
+        (missing % Bucket->rate) * IMSCSI_QOS_TICKS_PER_SECOND / Bucket->rate +
+        1;
+}
+
+///
+/// Sets limits, zero for no limit. Buckets start out full.
+///
+IMSCSI_QOS_INLINE
+void
+ImScsiQosSetLimits(PIMSCSI_QOS Qos, ULONGLONG MaxRequests,
+    ULONGLONG MaxBytes, ULONGLONG Now)
+{
+    ImScsiQosSetRate(&Qos->requests, MaxRequests, Now);
+    ImScsiQosSetRate(&Qos->bytes, MaxBytes, Now);
+}
+
+///
+/// Takes tokens for Requests requests of Bytes bytes in total and returns
+/// zero, or returns ticks to wait before trying again without taking
+/// anything.
+///
+IMSCSI_QOS_INLINE
+ULONGLONG
+ImScsiQosAdmit(PIMSCSI_QOS Qos, ULONG Requests, ULONGLONG Bytes,
+    ULONGLONG Now)
+{
+    ULONGLONG wait;
+    ULONGLONG bytes_wait;
+
+    ImScsiQosRefill(&Qos->requests, Now);
+    ImScsiQosRefill(&Qos->bytes, Now);
+
+    wait = ImScsiQosGetWait(&Qos->requests, Requests);
+    bytes_wait = ImScsiQosGetWait(&Qos->bytes, Bytes);
+
+    if (bytes_wait > wait)
+    {
+        wait = bytes_wait;
+    }
+
+    if (wait != 0)
+    {
+        return wait;
+    }
+
+    if (Qos->requests.rate != 0)
+    {
+        Qos->requests.tokens -= (LONGLONG)Requests;
+    }
+
+    if (Qos->bytes.rate != 0)
+    {
+        Qos->bytes.tokens -= (LONGLONG)Bytes;
+    }
+
+    return 0;
+}
+
+///
+/// Ticks a request in Class yields to requests in progress in higher
+/// classes, zero if it does not need to. Active holds number of requests in
+/// progress in each class.
+///
+IMSCSI_QOS_INLINE
+ULONGLONG
+ImScsiQosGetYield(const LONG *Active, int Class)
+{
+    int i;
+
+    if (Class <= IMSCSI_QOS_CLASS_NORMAL || Class >= IMSCSI_QOS_CLASSES)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < Class; i++)
+    {
+        if (Active[i] > 0)
+        {
+            // 1 ms for low, 4 ms for background
+            return (IMSCSI_QOS_TICKS_PER_SECOND / 1000) <<
+                ((Class - IMSCSI_QOS_CLASS_LOW) * 2);
+        }
+    }
+
+    return 0;
+}
+
+#endif // _INC_IMSCSIQOS_
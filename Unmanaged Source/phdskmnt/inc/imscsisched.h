@@ -0,0 +1,206 @@
+/// imscsisched.h
+/// Range conflict scheduling for requests served by several worker threads
+/// on the same LU. A queued request can start when it does not conflict
+/// with any request in progress or with any request queued before it. Two
+/// requests conflict when their byte ranges overlap and at least one of them
+/// writes, or when one of them is a barrier. That keeps order between
+/// overlapping reads and writes, while other requests are free to pass each
+/// other. A request is never passed by one that conflicts with it, so it
+/// only waits for conflicting requests that were started before it.
+/// This only depends on compiler, so it can be used outside the driver as
+/// well. Locking is left to caller.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSISCHED_
+#define _INC_IMSCSISCHED_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMSCSI_SCHED_INLINE __forceinline
+#else
+#define IMSCSI_SCHED_INLINE static inline
+#endif
+
+#define IMSCSI_SCHED_MAX_ACTIVE     32          // Bits in active_mask
+#define IMSCSI_SCHED_SCAN_DEPTH     16          // Queued requests looked at
+#define IMSCSI_SCHED_NO_SLOT        (-1)
+
+typedef struct _IMSCSI_SCHED_RANGE
+{
+    LONGLONG offset;            // First byte on device
+    LONGLONG end;               // First byte after range
+    ULONG write;                // Nonzero if range is modified
+    ULONG barrier;              // Nonzero if request conflicts with all others
+} IMSCSI_SCHED_RANGE, *PIMSCSI_SCHED_RANGE;
+
+typedef struct _IMSCSI_SCHED
+{
+    IMSCSI_SCHED_RANGE active[IMSCSI_SCHED_MAX_ACTIVE];
+    ULONG active_mask;          // Bit set for each slot in use in active
+    ULONG active_count;
+    ULONGLONG started;
+    ULONGLONG passed;           // Requests started before an earlier queued one
+} IMSCSI_SCHED, *PIMSCSI_SCHED;
+
+IMSCSI_SCHED_INLINE
+void
+ImScsiSchedSetRange(PIMSCSI_SCHED_RANGE Range, LONGLONG Offset,
+    ULONG Length, int Write)
+{
+    Range->offset = Offset;
+    Range->end = Offset + Length;
+    Range->write = Write ? 1 : 0;
+    Range->barrier = 0;
+}
+
+IMSCSI_SCHED_INLINE
+void
+ImScsiSchedSetBarrier(PIMSCSI_SCHED_RANGE Range)
+{
+    Range->offset = 0;
+    Range->end = 0;
+    Range->write = 1;
+    Range->barrier = 1;
+}
+
+IMSCSI_SCHED_INLINE
+int
+ImScsiSchedRangesConflict(const IMSCSI_SCHED_RANGE *First,
+    const IMSCSI_SCHED_RANGE *Second)
+{
+    if (First->barrier || Second->barrier)
+    {
+        return 1;
+    }
+
+    if (!First->write && !Second->write)
+    {
+        return 0;
+    }
+
+    return First->offset < Second->end && Second->offset < First->end;
+}
+
+///
+/// Returns nonzero if Queued[Index] can be started now. Queued holds
+/// requests in the order they were queued, from oldest.
+///
+IMSCSI_SCHED_INLINE
+int
+ImScsiSchedCanStart(const IMSCSI_SCHED *Sched,
+    const IMSCSI_SCHED_RANGE *Queued, ULONG Index)
+{
+    ULONG mask;
+    ULONG slot;
+    ULONG i;
+
+    if (Sched->active_count >= IMSCSI_SCHED_MAX_ACTIVE)
+    {
+        return 0;
+    }
+
+    for (mask = Sched->active_mask, slot = 0; mask != 0; mask >>= 1, slot++)
+    {
+        if ((mask & 1) &&
+            ImScsiSchedRangesConflict(&Sched->active[slot], &Queued[Index]))
+        {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < Index; i++)
+    {
+        if (ImScsiSchedRangesConflict(&Queued[i], &Queued[Index]))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+///
+/// Index of first of Count queued requests that can be started now, or -1
+/// if all of them have to wait.
+///
+IMSCSI_SCHED_INLINE
+int
+ImScsiSchedSelect(const IMSCSI_SCHED *Sched,
+    const IMSCSI_SCHED_RANGE *Queued, ULONG Count)
+{
+    ULONG i;
+
+    for (i = 0; i < Count && i < IMSCSI_SCHED_SCAN_DEPTH; i++)
+    {
+        if (ImScsiSchedCanStart(Sched, Queued, i))
+        {
+            return (int)i;
+        }
+
+        // Nothing can pass a barrier
+        if (Queued[i].barrier)
+        {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+///
+/// Marks a request selected by ImScsiSchedSelect or ImScsiSchedCanStart as
+/// in progress. Returns slot to pass to ImScsiSchedFinish, or
+/// IMSCSI_SCHED_NO_SLOT if all slots are in use.
+///
+IMSCSI_SCHED_INLINE
+int
+ImScsiSchedStart(PIMSCSI_SCHED Sched, const IMSCSI_SCHED_RANGE *Range,
+    ULONG Index)
+{
+    ULONG slot;
+
+    for (slot = 0; slot < IMSCSI_SCHED_MAX_ACTIVE; slot++)
+    {
+        if ((Sched->active_mask & (1UL << slot)) == 0)
+        {
+            Sched->active[slot] = *Range;
+            Sched->active_mask |= 1UL << slot;
+            Sched->active_count++;
+            Sched->started++;
+
+            if (Index != 0)
+            {
+                Sched->passed++;
+            }
+
+            return (int)slot;
+        }
+    }
+
+    return IMSCSI_SCHED_NO_SLOT;
+}
+
+IMSCSI_SCHED_INLINE
+void
+ImScsiSchedFinish(PIMSCSI_SCHED Sched, int Slot)
+{
+    if (Slot < 0 || Slot >= IMSCSI_SCHED_MAX_ACTIVE ||
+        (Sched->active_mask & (1UL << Slot)) == 0)
+    {
+        return;
+    }
+
+    Sched->active_mask &= ~(1UL << Slot);
+    Sched->active_count--;
+}
+
+#endif // _INC_IMSCSISCHED_
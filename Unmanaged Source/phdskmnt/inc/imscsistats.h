@@ -0,0 +1,118 @@
+/// imscsistats.h
+/// Request counters and latency histograms for a virtual disk. Histogram
+/// buckets are powers of two in microseconds: bucket n counts latencies
+/// from 2^n up to 2^(n+1) microseconds, bucket zero also counts anything
+/// shorter and the last bucket anything longer. Time is counted in 100 ns
+/// ticks. This only depends on compiler, so it can be used outside the
+/// driver as well. Locking is left to caller.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSISTATS_
+#define _INC_IMSCSISTATS_
+
+#include <imdproxy.h>
+
+#if defined(_MSC_VER)
+#define IMSCSI_STATS_INLINE __forceinline
+#else
+#define IMSCSI_STATS_INLINE static inline
+#endif
+
+#define IMSCSI_STATS_LATENCY_BUCKETS    24          // Last one starts at about 8 s
+
+#define IMSCSI_STATS_READ               0
+#define IMSCSI_STATS_WRITE              1
+#define IMSCSI_STATS_UNMAP              2
+#define IMSCSI_STATS_OTHER              3
+#define IMSCSI_STATS_KINDS              4
+
+typedef struct _IMSCSI_STATS
+{
+    ULONGLONG requests[IMSCSI_STATS_KINDS];
+    ULONGLONG bytes[IMSCSI_STATS_KINDS];
+    ULONGLONG errors;
+    ULONG queue_depth;          // Requests queued or in progress
+    ULONG max_queue_depth;
+    ULONGLONG backend_latency[IMSCSI_STATS_LATENCY_BUCKETS];
+    ULONGLONG total_latency[IMSCSI_STATS_LATENCY_BUCKETS];
+} IMSCSI_STATS, *PIMSCSI_STATS;
+
+IMSCSI_STATS_INLINE
+ULONG
+ImScsiStatsGetBucket(ULONGLONG Ticks)
+{
+    ULONGLONG us = Ticks / 10;
+    ULONG bucket = 0;
+
+    while (us > 1 && bucket < IMSCSI_STATS_LATENCY_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+///
+/// Counts a request as queued, until ImScsiStatsFinish is called for it
+/// with Queued set.
+///
+IMSCSI_STATS_INLINE
+void
+ImScsiStatsQueue(PIMSCSI_STATS Stats)
+{
+    Stats->queue_depth++;
+
+    if (Stats->queue_depth > Stats->max_queue_depth)
+    {
+        Stats->max_queue_depth = Stats->queue_depth;
+    }
+}
+
+///
+/// Counts a finished request. BackendTicks is zero for requests that never
+/// reached image, such as read cache hits.
+///
+IMSCSI_STATS_INLINE
+void
+ImScsiStatsFinish(PIMSCSI_STATS Stats, int Kind, ULONGLONG Bytes,
+    ULONGLONG TotalTicks, ULONGLONG BackendTicks, int Failed, int Queued)
+{
+    if (Kind < 0 || Kind >= IMSCSI_STATS_KINDS)
+    {
+        Kind = IMSCSI_STATS_OTHER;
+    }
+
+    if (Queued && Stats->queue_depth > 0)
+    {
+        Stats->queue_depth--;
+    }
+
+    Stats->requests[Kind]++;
+
+    if (Failed)
+    {
+        Stats->errors++;
+    }
+    else
+    {
+        Stats->bytes[Kind] += Bytes;
+    }
+
+    Stats->total_latency[ImScsiStatsGetBucket(TotalTicks)]++;
+
+    if (BackendTicks != 0)
+    {
+        Stats->backend_latency[ImScsiStatsGetBucket(BackendTicks)]++;
+    }
+}
+
+#endif // _INC_IMSCSISTATS_
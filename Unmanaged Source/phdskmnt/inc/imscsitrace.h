@@ -0,0 +1,199 @@
+/// imscsitrace.h
+/// Binary trace of request stages, kept in one ring of fixed size records for
+/// each processor. Writers reserve a slot with an interlocked increment and
+/// never wait for each other or for readers. A record is marked as being
+/// written by clearing its sequence number until all other fields are
+/// written, so readers skip records that are incomplete or were overwritten
+/// while copied. Timestamps are performance counter values, which are
+/// comparable between processors.
+/// Trace dump files are a IMSCSI_TRACE_DUMP_HEADER followed by records from
+/// all processors. This only depends on compiler, so it can be used outside
+/// the driver as well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSITRACE_
+#define _INC_IMSCSITRACE_
+
+#include "imdproxy.h"
+
+#if defined(_MSC_VER)
+#define IMSCSI_TRACE_INLINE __forceinline
+#define IMSCSI_TRACE_BARRIER() MemoryBarrier()
+#define IMSCSI_TRACE_INCREMENT(p) ((ULONG)InterlockedIncrement((volatile LONG*)(p)))
+#else
+#define IMSCSI_TRACE_INLINE static inline
+#define IMSCSI_TRACE_BARRIER() __sync_synchronize()
+#define IMSCSI_TRACE_INCREMENT(p) __sync_add_and_fetch((p), 1)
+#endif
+
+#define IMSCSI_TRACE_VERSION        1
+#define IMSCSI_TRACE_DUMP_MAGIC     0x544D4941      // "AIMT"
+#define IMSCSI_TRACE_CACHE_LINE     64
+
+///
+/// Stages recorded for each request. A request does not pass all stages,
+/// for instance read cache hits only have IMSCSI_TRACE_COMPLETED.
+///
+#define IMSCSI_TRACE_QUEUED         1   // Handed to worker thread or image I/O
+#define IMSCSI_TRACE_DISPATCHED     2   // Picked up by worker thread
+#define IMSCSI_TRACE_IO_START       3   // Sent to image
+#define IMSCSI_TRACE_IO_DONE        4   // Image I/O done
+#define IMSCSI_TRACE_COMPLETED      5   // Status set, completing to port driver
+#define IMSCSI_TRACE_STAGES         6
+
+typedef struct _IMSCSI_TRACE_RECORD
+{
+    ULONGLONG timestamp;        // Performance counter
+    ULONGLONG request;          // Same for all stages of a request
+    LONGLONG offset;            // Byte offset on device, zero if none
+    ULONG device;               // DEVICE_NUMBER
+    ULONG length;               // Bytes to transfer
+    ULONG sequence;             // From ImScsiTraceSequence, zero while written
+    ULONG cpu;
+    UCHAR stage;                // IMSCSI_TRACE_xxx
+    UCHAR opcode;               // SCSI operation code
+    UCHAR reserved[6];
+} IMSCSI_TRACE_RECORD, *PIMSCSI_TRACE_RECORD;
+
+typedef struct _IMSCSI_TRACE_RING
+{
+    PIMSCSI_TRACE_RECORD records;
+    volatile ULONG position;    // Records reserved since start
+    ULONG mask;                 // Number of records, a power of two, minus one
+    ULONG cpu;
+
+    // Rings for different processors are kept in different cache lines
+    UCHAR pad[IMSCSI_TRACE_CACHE_LINE - sizeof(PIMSCSI_TRACE_RECORD) -
+        3 * sizeof(ULONG)];
+} IMSCSI_TRACE_RING, *PIMSCSI_TRACE_RING;
+
+typedef struct _IMSCSI_TRACE_DUMP_HEADER
+{
+    ULONG magic;                // IMSCSI_TRACE_DUMP_MAGIC
+    ULONG version;              // IMSCSI_TRACE_VERSION
+    ULONG record_size;          // sizeof(IMSCSI_TRACE_RECORD)
+    ULONG record_count;         // Records following header
+    LONGLONG frequency;         // Performance counter ticks per second
+} IMSCSI_TRACE_DUMP_HEADER, *PIMSCSI_TRACE_DUMP_HEADER;
+
+///
+/// Sequence number for record at Position. Never zero.
+///
+IMSCSI_TRACE_INLINE
+ULONG
+ImScsiTraceSequence(ULONG Position)
+{
+    return Position + 1 != 0 ? Position + 1 : 1;
+}
+
+///
+/// Records is an array of Count records, where Count is a power of two.
+///
+IMSCSI_TRACE_INLINE
+void
+ImScsiTraceInit(PIMSCSI_TRACE_RING Ring, PIMSCSI_TRACE_RECORD Records,
+    ULONG Count, ULONG Cpu)
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++)
+    {
+        Records[i].sequence = 0;
+    }
+
+    Ring->records = Records;
+    Ring->position = 0;
+    Ring->mask = Count - 1;
+    Ring->cpu = Cpu;
+}
+
+///
+/// Adds a record, overwriting oldest one if ring is full. Sequence and cpu
+/// members of Record are ignored.
+///
+IMSCSI_TRACE_INLINE
+void
+ImScsiTraceWrite(PIMSCSI_TRACE_RING Ring, const IMSCSI_TRACE_RECORD *Record)
+{
+    ULONG position = IMSCSI_TRACE_INCREMENT(&Ring->position) - 1;
+    PIMSCSI_TRACE_RECORD dest = &Ring->records[position & Ring->mask];
+    int i;
+
+    dest->sequence = 0;
+
+    IMSCSI_TRACE_BARRIER();
+
+    dest->timestamp = Record->timestamp;
+    dest->request = Record->request;
+    dest->offset = Record->offset;
+    dest->device = Record->device;
+    dest->length = Record->length;
+    dest->cpu = Ring->cpu;
+    dest->stage = Record->stage;
+    dest->opcode = Record->opcode;
+
+    for (i = 0; i < (int)sizeof(dest->reserved); i++)
+    {
+        dest->reserved[i] = 0;
+    }
+
+    IMSCSI_TRACE_BARRIER();
+
+    dest->sequence = ImScsiTraceSequence(position);
+}
+
+///
+/// Copies at most Count records from Position on, oldest first. Records
+/// already overwritten, or being written, are skipped. Returns number of
+/// records copied and sets Position to where to continue next time. Start
+/// with zero to get all records still in ring.
+///
+IMSCSI_TRACE_INLINE
+ULONG
+ImScsiTraceRead(PIMSCSI_TRACE_RING Ring, ULONG *Position,
+    PIMSCSI_TRACE_RECORD Records, ULONG Count)
+{
+    ULONG end = Ring->position;
+    ULONG position = *Position;
+    ULONG copied = 0;
+
+    // Oldest record still in ring. Positions ahead of end are not valid
+    // either, and are also moved back to here.
+    if (end - position > Ring->mask + 1)
+    {
+        position = end - (Ring->mask + 1);
+    }
+
+    for (; position != end && copied < Count; position++)
+    {
+        volatile IMSCSI_TRACE_RECORD *source =
+            &Ring->records[position & Ring->mask];
+        ULONG sequence = source->sequence;
+
+        IMSCSI_TRACE_BARRIER();
+
+        Records[copied] = *(IMSCSI_TRACE_RECORD*)source;
+
+        IMSCSI_TRACE_BARRIER();
+
+        if ((sequence == ImScsiTraceSequence(position)) &&
+            (source->sequence == sequence))
+        {
+            copied++;
+        }
+    }
+
+    *Position = position;
+
+    return copied;
+}
+
+#endif // _INC_IMSCSITRACE_
@@ -0,0 +1,367 @@
+/// imscsizero.h
+/// Checks whether buffers are all zeros, with variants for SSE2, AVX2,
+/// AVX-512 and NEON. Each variant looks at one 64 byte cache line at a time
+/// and returns as soon as a line with non-zero data is found.
+/// ImScsiZeroScanLevel finds the best variant supported by processor and
+/// operating system. Callers in kernel mode need to save extended processor
+/// state around AVX variants. This only depends on compiler, so it can be
+/// used outside the driver as well.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMSCSIZERO_
+#define _INC_IMSCSIZERO_
+
+#include <imdproxy.h>
+
+#if defined(_M_AMD64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define IMSCSI_ZERO_X86
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define IMSCSI_ZERO_ARM64
+#endif
+
+#if defined(_MSC_VER)
+
+#define IMSCSI_ZERO_INLINE __forceinline
+#define IMSCSI_ZERO_TARGET(x)
+
+#if defined(IMSCSI_ZERO_X86)
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(IMSCSI_ZERO_ARM64)
+#include <arm64_neon.h>
+#endif
+
+#else
+
+#define IMSCSI_ZERO_INLINE static inline
+#define IMSCSI_ZERO_TARGET(x) __attribute__((target(x)))
+
+#include <stddef.h>
+
+#if defined(IMSCSI_ZERO_X86)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(IMSCSI_ZERO_ARM64)
+#include <arm_neon.h>
+#endif
+
+#endif
+
+#define IMSCSI_ZERO_GENERIC         0
+#define IMSCSI_ZERO_SSE2            1
+#define IMSCSI_ZERO_AVX2            2
+#define IMSCSI_ZERO_AVX512          3
+#define IMSCSI_ZERO_NEON            4
+
+#define IMSCSI_ZERO_LINE_SIZE       64
+
+///
+/// Plain C variant, also used for parts smaller than a cache line in the
+/// vector variants.
+///
+IMSCSI_ZERO_INLINE
+int
+ImScsiIsZeroGeneric(const void *Buffer, size_t Length)
+{
+    const UCHAR *ptr = (const UCHAR*)Buffer;
+
+    while (Length >= IMSCSI_ZERO_LINE_SIZE)
+    {
+        const ULONGLONG *line = (const ULONGLONG*)ptr;
+
+        if ((line[0] | line[1] | line[2] | line[3] |
+            line[4] | line[5] | line[6] | line[7]) != 0)
+        {
+            return 0;
+        }
+
+        ptr += IMSCSI_ZERO_LINE_SIZE;
+        Length -= IMSCSI_ZERO_LINE_SIZE;
+    }
+
+    while (Length >= sizeof(ULONGLONG))
+    {
+        if (*(const ULONGLONG*)ptr != 0)
+        {
+            return 0;
+        }
+
+        ptr += sizeof(ULONGLONG);
+        Length -= sizeof(ULONGLONG);
+    }
+
+    while (Length > 0)
+    {
+        if (*ptr != 0)
+        {
+            return 0;
+        }
+
+        ptr++;
+        Length--;
+    }
+
+    return 1;
+}
+
+#if defined(IMSCSI_ZERO_X86)
+
+IMSCSI_ZERO_INLINE
+IMSCSI_ZERO_TARGET("sse2")
+int
+ImScsiIsZeroSse2(const void *Buffer, size_t Length)
+{
+    const UCHAR *ptr = (const UCHAR*)Buffer;
+
+    while (Length >= IMSCSI_ZERO_LINE_SIZE)
+    {
+        __m128i line = _mm_or_si128(
+            _mm_or_si128(
+                _mm_loadu_si128((const __m128i*)ptr),
+                _mm_loadu_si128((const __m128i*)(ptr + 16))),
+            _mm_or_si128(
+                _mm_loadu_si128((const __m128i*)(ptr + 32)),
+                _mm_loadu_si128((const __m128i*)(ptr + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(line, _mm_setzero_si128())) !=
+            0xFFFF)
+        {
+            return 0;
+        }
+
+        ptr += IMSCSI_ZERO_LINE_SIZE;
+        Length -= IMSCSI_ZERO_LINE_SIZE;
+    }
+
+    return ImScsiIsZeroGeneric(ptr, Length);
+}
+
+#if defined(_M_AMD64) || defined(__x86_64__)
+
+IMSCSI_ZERO_INLINE
+IMSCSI_ZERO_TARGET("avx2")
+int
+ImScsiIsZeroAvx2(const void *Buffer, size_t Length)
+{
+    const UCHAR *ptr = (const UCHAR*)Buffer;
+
+    while (Length >= IMSCSI_ZERO_LINE_SIZE)
+    {
+        __m256i line = _mm256_or_si256(
+            _mm256_loadu_si256((const __m256i*)ptr),
+            _mm256_loadu_si256((const __m256i*)(ptr + 32)));
+
+        if (!_mm256_testz_si256(line, line))
+        {
+            _mm256_zeroupper();
+            return 0;
+        }
+
+        ptr += IMSCSI_ZERO_LINE_SIZE;
+        Length -= IMSCSI_ZERO_LINE_SIZE;
+    }
+
+    _mm256_zeroupper();
+
+    return ImScsiIsZeroGeneric(ptr, Length);
+}
+
+IMSCSI_ZERO_INLINE
+IMSCSI_ZERO_TARGET("avx512f")
+int
+ImScsiIsZeroAvx512(const void *Buffer, size_t Length)
+{
+    const UCHAR *ptr = (const UCHAR*)Buffer;
+
+    while (Length >= IMSCSI_ZERO_LINE_SIZE)
+    {
+        __m512i line = _mm512_loadu_si512((const void*)ptr);
+
+        if (_mm512_test_epi64_mask(line, line) != 0)
+        {
+            _mm256_zeroupper();
+            return 0;
+        }
+
+        ptr += IMSCSI_ZERO_LINE_SIZE;
+        Length -= IMSCSI_ZERO_LINE_SIZE;
+    }
+
+    _mm256_zeroupper();
+
+    return ImScsiIsZeroGeneric(ptr, Length);
+}
+
+#endif
+
+IMSCSI_ZERO_INLINE
+void
+ImScsiZeroCpuId(int Leaf, int SubLeaf, int Registers[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex(Registers, Leaf, SubLeaf);
+#else
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    __cpuid_count(Leaf, SubLeaf, eax, ebx, ecx, edx);
+
+    Registers[0] = (int)eax;
+    Registers[1] = (int)ebx;
+    Registers[2] = (int)ecx;
+    Registers[3] = (int)edx;
+#endif
+}
+
+IMSCSI_ZERO_INLINE
+ULONGLONG
+ImScsiZeroGetXcr0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+    return ((ULONGLONG)edx << 32) | eax;
+#endif
+}
+
+#endif
+
+#if defined(IMSCSI_ZERO_ARM64)
+
+IMSCSI_ZERO_INLINE
+int
+ImScsiIsZeroNeon(const void *Buffer, size_t Length)
+{
+    const UCHAR *ptr = (const UCHAR*)Buffer;
+
+    while (Length >= IMSCSI_ZERO_LINE_SIZE)
+    {
+        uint8x16_t line = vorrq_u8(
+            vorrq_u8(vld1q_u8(ptr), vld1q_u8(ptr + 16)),
+            vorrq_u8(vld1q_u8(ptr + 32), vld1q_u8(ptr + 48)));
+
+        if (vmaxvq_u8(line) != 0)
+        {
+            return 0;
+        }
+
+        ptr += IMSCSI_ZERO_LINE_SIZE;
+        Length -= IMSCSI_ZERO_LINE_SIZE;
+    }
+
+    return ImScsiIsZeroGeneric(ptr, Length);
+}
+
+#endif
+
+///
+/// Best variant supported by processor and by operating system, which needs
+/// to have enabled saving of AVX and AVX-512 registers.
+///
+IMSCSI_ZERO_INLINE
+int
+ImScsiZeroScanLevel()
+{
+#if defined(IMSCSI_ZERO_X86)
+    int regs[4];
+    int max_leaf;
+    int level = IMSCSI_ZERO_GENERIC;
+    ULONGLONG xcr0;
+
+    ImScsiZeroCpuId(0, 0, regs);
+
+    if (regs[0] < 1)
+    {
+        return level;
+    }
+
+    max_leaf = regs[0];
+
+    ImScsiZeroCpuId(1, 0, regs);
+
+    if (regs[3] & (1 << 26))            // SSE2
+    {
+        level = IMSCSI_ZERO_SSE2;
+    }
+
+#if defined(_M_AMD64) || defined(__x86_64__)
+    if ((max_leaf < 7) ||
+        ((regs[2] & (1 << 27)) == 0) || // OSXSAVE
+        ((regs[2] & (1 << 28)) == 0))   // AVX
+    {
+        return level;
+    }
+
+    xcr0 = ImScsiZeroGetXcr0();
+
+    if ((xcr0 & 0x06) != 0x06)          // XMM and YMM state
+    {
+        return level;
+    }
+
+    ImScsiZeroCpuId(7, 0, regs);
+
+    if (regs[1] & (1 << 5))             // AVX2
+    {
+        level = IMSCSI_ZERO_AVX2;
+    }
+
+    if ((regs[1] & (1 << 16)) &&        // AVX512F
+        ((xcr0 & 0xE0) == 0xE0))        // Opmask and ZMM state
+    {
+        level = IMSCSI_ZERO_AVX512;
+    }
+#else
+    (void)max_leaf;
+    (void)xcr0;
+#endif
+
+    return level;
+#elif defined(IMSCSI_ZERO_ARM64)
+    return IMSCSI_ZERO_NEON;
+#else
+    return IMSCSI_ZERO_GENERIC;
+#endif
+}
+
+///
+/// Runs the variant for Level, which should not be higher than what
+/// ImScsiZeroScanLevel returned.
+///
+IMSCSI_ZERO_INLINE
+int
+ImScsiIsZero(int Level, const void *Buffer, size_t Length)
+{
+    switch (Level)
+    {
+#if defined(IMSCSI_ZERO_X86)
+    case IMSCSI_ZERO_SSE2:
+        return ImScsiIsZeroSse2(Buffer, Length);
+#if defined(_M_AMD64) || defined(__x86_64__)
+    case IMSCSI_ZERO_AVX2:
+        return ImScsiIsZeroAvx2(Buffer, Length);
+    case IMSCSI_ZERO_AVX512:
+        return ImScsiIsZeroAvx512(Buffer, Length);
+#endif
+#endif
+#if defined(IMSCSI_ZERO_ARM64)
+    case IMSCSI_ZERO_NEON:
+        return ImScsiIsZeroNeon(Buffer, Length);
+#endif
+    default:
+        return ImScsiIsZeroGeneric(Buffer, Length);
+    }
+}
+
+#endif // _INC_IMSCSIZERO_
@@ -120,6 +120,16 @@ extern "C" {
 
 #include "common.h"
 #include "imdproxy.h"
+#include "imscsicache.h"
+#include "imscsiahead.h"
+#include "imscsisched.h"
+#include "imscsizero.h"
+#include "imscsimerge.h"
+#include "imscsiqos.h"
+#include "imscsistats.h"
+#include "imscsitrace.h"
+#include "imscsipool.h"
+#include "imscsicopy.h"
 #include "phdskmntver.h"
 
 #if !defined(_MP_User_Mode_Only)                      // User-mode only.
@@ -161,6 +171,16 @@ extern "C" {
 #define DEFAULT_DEBUG_LEVEL         2               
 #define DEFAULT_INITIATOR_ID        7
 #define DEFAULT_NUMBER_OF_BUSES     1
+#define DEFAULT_READ_CACHE_SIZE_PER_LU  4096         // KB
+#define DEFAULT_READ_CACHE_SIZE_TOTAL   65536        // KB
+#define DEFAULT_READ_AHEAD_MAX_SIZE     2048         // KB
+#define DEFAULT_WORKER_THREADS_PER_LU   4
+#define DEFAULT_MERGE_MAX_SIZE          1024         // KB
+#define DEFAULT_TRACE_BUFFER_SIZE       64           // KB
+
+#define IMSCSI_MAX_WORKERS_PER_LU       16
+
+#define IMSCSI_ZERO_SCAN_AVX_MIN        (16UL << 10)  // Smallest zero scan worth saving AVX state for
 
 #define GET_FLAG(Flags, Bit)        ((Flags) & (Bit))
 #define SET_FLAG(Flags, Bit)        ((Flags) |= (Bit))
@@ -191,8 +211,22 @@ extern "C" {
         UNICODE_STRING   ProductRevision;
         ULONG            NumberOfBuses;       // Number of buses (paths) supported by this adapter
         ULONG            InitiatorID;        // Adapter's target ID
+        ULONG            ReadCacheSizePerLU; // Read cache size in KB for each LU, zero to disable
+        ULONG            ReadCacheSizeTotal; // Read cache size in KB for all LUs together
+        ULONG            ReadAheadMaxSize;   // Largest read-ahead window in KB, zero to disable
+        ULONG            WorkerThreadsPerLU; // Largest number of worker threads serving each LU
+        ULONG            MergeMaxSize;       // Largest merged read or write in KB, zero to disable
+        ULONG            TraceBufferSize;    // Request trace records in KB for each processor, zero to disable
     } MP_REG_INFO, *pMP_REG_INFO;
 
+    // Free list of equally sized nonpaged allocations used on I/O path, see
+    // ImScsiAllocateBuffer and ImScsiAllocateWorkItem.
+    typedef struct _IMSCSI_POOL_CLASS {
+        KSPIN_LOCK                     Lock;
+        SINGLE_LIST_ENTRY              FreeList;
+        IMSCSI_POOL_STATE              State;
+    } IMSCSI_POOL_CLASS, *PIMSCSI_POOL_CLASS;
+
     typedef struct _MPDriverInfo {                        // The master miniport object. In effect, an extension of the driver object for the miniport.
         MP_REG_INFO                    MPRegInfo;
         KSPIN_LOCK                     DrvInfoLock;
@@ -214,6 +248,15 @@ extern "C" {
 #endif
         ULONG                          DrvInfoNbrMPHBAObj;// Count of items in ListMPHBAObj.
         ULONG                          RandomSeed;
+        LONG                           ReadCacheAllocated;// KB of read cache memory in use by all LUs.
+        IMSCSI_POOL_CLASS              WorkItemPool;
+        IMSCSI_POOL_CLASS              BufferPool[IMSCSI_POOL_CLASSES];
+        IMSCSI_POOL_CLASS              LargeBufferPool;   // Only for accounting, never kept
+        int                            ZeroScanLevel;     // IMSCSI_ZERO_xxx variant for ImScsiIsBufferZero
+        LONG                           QosActive[IMSCSI_QOS_CLASSES]; // Requests in progress in each priority class
+        LONGLONG                       PerformanceFrequency; // For converting ImScsiGetTimestamp values
+        PIMSCSI_TRACE_RING             TraceRings;        // One for each processor, NULL if tracing is disabled
+        ULONG                          TraceRingCount;
     } MPDriverInfo, *pMPDriverInfo;
 
     typedef struct _DEVICE_THREAD {
@@ -247,6 +290,9 @@ extern "C" {
 
 #define LU_DEVICE_INITIALIZED   0x0001
 
+    struct _PROXY_TAGGED_CONTEXT;
+    struct _PROXY_SHM_RING_CONTEXT;
+
     typedef struct _PROXY_CONNECTION
     {
         enum PROXY_CONNECTION_TYPE
@@ -269,10 +315,56 @@ extern "C" {
                 PKEVENT response_event;
                 PUCHAR shared_memory;
                 ULONG_PTR shared_memory_size;
+                ULONG_PTR shared_memory_data_size;  // Max data size per request
             };
         };
+
+        // Additional connections to the same server for PROXY_CONNECTION_DEVICE
+        // connections, when proxy service was asked to open more than one.
+        // Only used with tagged requests.
+        ULONG extra_stream_count;
+        PFILE_OBJECT extra_streams[IMDPROXY_MAX_STREAMS - 1];
+
+        // Set for PROXY_CONNECTION_DEVICE connections when server supports
+        // tagged requests. Responses are then received by a separate thread
+        // for each connection, linked from this one.
+        struct _PROXY_TAGGED_CONTEXT *tagged;
+
+        // Set for PROXY_CONNECTION_SHM connections when server has set up
+        // shared memory with ring layout. Requests are then submitted the
+        // same way as on tagged connections.
+        struct _PROXY_SHM_RING_CONTEXT *shm_ring;
+
+        // IMDPROXY_FLAG_* values from last IMDPROXY_INFO_RESP
+        ULONGLONG server_flags;
     } PROXY_CONNECTION, *PPROXY_CONNECTION;
 
+    struct _PROXY_TAGGED_REQUEST;
+
+    typedef VOID
+        PROXY_TAGGED_COMPLETION(struct _PROXY_TAGGED_REQUEST *Request);
+
+    typedef PROXY_TAGGED_COMPLETION *PPROXY_TAGGED_COMPLETION;
+
+    // A request in flight on a tagged proxy connection. Response header and
+    // data are received directly into the buffers given here.
+    typedef struct _PROXY_TAGGED_REQUEST
+    {
+        ULONGLONG IoTag;                   // Non-zero while waiting for response
+        PVOID ResponseHeader;
+        ULONG ResponseHeaderSize;
+        PVOID ResponseData;
+        ULONG ResponseDataBufferSize;
+        PULONGLONG ResponseDataSize;       // Points into response header
+        BOOLEAN DiscardResponseData;       // Read into ResponseData in pieces and dropped
+        IO_STATUS_BLOCK IoStatus;
+        PPROXY_TAGGED_COMPLETION CompletionRoutine; // Called in receive thread
+        PVOID CompletionContext;
+        KEVENT CompletionEvent;            // Set if no CompletionRoutine
+        struct _PROXY_TAGGED_CONTEXT *Context; // Connection it was sent on
+        LONG Load;                         // Bytes counted as in flight
+    } PROXY_TAGGED_REQUEST, *PPROXY_TAGGED_REQUEST;
+
     typedef struct _HW_LU_EXTENSION {                     // LUN extension allocated by port driver.
         LIST_ENTRY            List;                       // Pointers to next and previous HW_LU_EXTENSION objects, used in HW_HBA_EXT.
         pHW_HBA_EXT           pHBAExt;
@@ -282,6 +374,14 @@ extern "C" {
         KEVENT                Initialized;
         PKTHREAD              WorkerThread;
         KEVENT                StopThread;
+        IMSCSI_SCHED          Sched;                      // Protected by RequestListLock
+        KEVENT                SchedIdle;                  // Set while no request holds a slot in Sched
+        ULONG                 MaxWorkers;                 // One if requests need to be served in order
+        ULONG                 WorkerCount;                // Protected by RequestListLock
+        LONG                  IdleWorkers;
+        HANDLE                ExtraWorkerThreads[IMSCSI_MAX_WORKERS_PER_LU - 1]; // Protected by RequestListLock
+        ULONG                 MergeMaxSize;               // Zero if queued requests are not merged
+        ULONG                 MergeMaxSpan;               // Nonzero if merged requests may have gaps, served as vectored proxy requests
         LARGE_INTEGER         ImageOffset;
         LARGE_INTEGER         DiskSize;
         UCHAR                 BlockPower;
@@ -291,10 +391,20 @@ extern "C" {
         BOOLEAN               ReadOnly;
         ULONG                 FakeDiskSignature;
         UCHAR                 LastReportedEvent;
-        PVOID                 LastIoBuffer;
-        LONGLONG              LastIoStartSector;
-        ULONG                 LastIoLength;
-        KSPIN_LOCK            LastIoLock;
+        IMSCSI_CACHE          ReadCache;                  // Zero set_count if LU is not cached
+        PVOID                 ReadCacheMemory;
+        LONG                  ReadCacheCharge;            // KB counted in ReadCacheAllocated
+        KSPIN_LOCK            ReadCacheLock;
+        IMSCSI_READ_AHEAD_STREAM ReadAheadStreams[IMSCSI_READ_AHEAD_STREAMS]; // Protected by ReadCacheLock
+        ULONG                 ReadAheadClock;
+        ULONG                 MaxReadAheadSize;           // Bytes, zero if disabled
+        ULONGLONG             ReadAheadRequests;
+        ULONGLONG             ReadAheadBytes;
+        ULONGLONG             ReadAheadWastedBytes;
+        KSPIN_LOCK            QosLock;
+        IMSCSI_QOS            Qos;                        // Protected by QosLock
+        KSPIN_LOCK            StatsLock;
+        IMSCSI_STATS          Stats;                      // Protected by StatsLock
         DEVICE_NUMBER         DeviceNumber;
         UNICODE_STRING        ObjectName;
         HANDLE                ImageFile;
@@ -338,8 +448,12 @@ extern "C" {
         KIRQL                LowestAssumedIrql;
         PVOID                MappedSystemBuffer;
         PVOID                AllocatedBuffer;
+        ULONG                AllocatedBufferSize;
         BOOLEAN              CopyBack;
         PKEVENT              CallerWaitEvent;
+        struct _MP_WorkRtnParms *pMergedNext;   // Adjacent requests served together with this one
+        LONGLONG             StartTime;         // ImScsiGetTimestamp when queued, zero if not counted in Stats
+        LONGLONG             BackendTime;       // Time in image I/O, start time while asynchronous I/O is in flight
     } MP_WorkRtnParms, *pMP_WorkRtnParms;
 
     typedef enum ResultType {
@@ -772,6 +886,11 @@ extern "C" {
             __in pMP_WorkRtnParms        pWkRtnParms
             );
 
+    VOID
+        ImScsiDispatchMergedReadWrite(
+            __in pMP_WorkRtnParms        pWkRtnParms
+            );
+
     NTSTATUS
         ImScsiCallDriverAndWait(__in PDEVICE_OBJECT DeviceObject,
             __in PIRP Irp,
@@ -786,6 +905,16 @@ extern "C" {
     KSTART_ROUTINE
         ImScsiWorkerThread;
 
+    KSTART_ROUTINE
+        ImScsiExtraWorkerThread;
+
+    BOOLEAN
+        ImScsiDispatchTaggedProxyReadWrite(
+            __in pMP_WorkRtnParms        pWkRtnParms,
+            __in int                     SchedSlot,
+            __in int                     QosClass
+            );
+
     VOID
         ImScsiCreateLU(
             __in pHW_HBA_EXT             pHBAExt,
@@ -852,6 +981,150 @@ extern "C" {
             __inout __deref PSRB_IMSCSI_CREATE_DATA CreateData,
             __in __deref PETHREAD ClientThread);
 
+    VOID
+        ImScsiAllocateReadCache(
+            __in pHW_LU_EXTENSION pLUExt
+            );
+
+    VOID
+        ImScsiFreeReadCache(
+            __in pHW_LU_EXTENSION pLUExt
+            );
+
+    BOOLEAN
+        ImScsiReadCacheRead(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in LONGLONG Offset,
+            __in ULONG Length,
+            __out PVOID Buffer,
+            __in BOOLEAN Retry,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    BOOLEAN
+        ImScsiReadCacheContains(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in LONGLONG Offset,
+            __in ULONG Length,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    BOOLEAN
+        ImScsiReadAhead(
+            __in pHW_LU_EXTENSION pLUExt
+            );
+
+    NTSTATUS
+        ImScsiQueryReadCache(
+            __in pHW_HBA_EXT pHBAExt,
+            __inout __deref PSRB_IMSCSI_READ_CACHE read_cache_data,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    NTSTATUS
+        ImScsiSetReadCache(
+            __in pHW_HBA_EXT pHBAExt,
+            __in __deref PSRB_IMSCSI_READ_CACHE read_cache_data,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    NTSTATUS
+        ImScsiQueryQos(
+            __in pHW_HBA_EXT pHBAExt,
+            __inout __deref PSRB_IMSCSI_QOS qos_data,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    NTSTATUS
+        ImScsiSetQos(
+            __in pHW_HBA_EXT pHBAExt,
+            __in __deref PSRB_IMSCSI_QOS qos_data,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    NTSTATUS
+        ImScsiQueryStatistics(
+            __in pHW_HBA_EXT pHBAExt,
+            __inout __deref PSRB_IMSCSI_STATISTICS stats_data,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    NTSTATUS
+        ImScsiQueryTrace(
+            __inout __deref PSRB_IMSCSI_TRACE trace_data
+            );
+
+    //
+    // Translates between IMSCSI_PRIORITY_xxx flag values and IMSCSI_QOS_CLASS_xxx
+    // classes in order from highest.
+    //
+    FORCEINLINE
+        int
+        ImScsiGetQosClass(ULONG Flags)
+    {
+        switch (IMSCSI_PRIORITY(Flags))
+        {
+        case IMSCSI_PRIORITY_HIGH:
+            return IMSCSI_QOS_CLASS_HIGH;
+        case IMSCSI_PRIORITY_LOW:
+            return IMSCSI_QOS_CLASS_LOW;
+        case IMSCSI_PRIORITY_BACKGROUND:
+            return IMSCSI_QOS_CLASS_BACKGROUND;
+        default:
+            return IMSCSI_QOS_CLASS_NORMAL;
+        }
+    }
+
+    FORCEINLINE
+        ULONG
+        ImScsiGetQosPriorityFlags(int Class)
+    {
+        switch (Class)
+        {
+        case IMSCSI_QOS_CLASS_HIGH:
+            return IMSCSI_PRIORITY_HIGH;
+        case IMSCSI_QOS_CLASS_LOW:
+            return IMSCSI_PRIORITY_LOW;
+        case IMSCSI_QOS_CLASS_BACKGROUND:
+            return IMSCSI_PRIORITY_BACKGROUND;
+        default:
+            return IMSCSI_PRIORITY_NORMAL;
+        }
+    }
+
+    ULONGLONG
+        ImScsiReadCacheGetGeneration(
+            __in pHW_LU_EXTENSION pLUExt,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    VOID
+        ImScsiReadCacheFill(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in ULONGLONG Generation,
+            __in LONGLONG Offset,
+            __in ULONG Length,
+            __in PVOID Buffer,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    VOID
+        ImScsiReadCacheWrite(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in LONGLONG Offset,
+            __in ULONG Length,
+            __in PVOID Buffer,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
+    VOID
+        ImScsiReadCacheInvalidate(
+            __in pHW_LU_EXTENSION pLUExt,
+            __in LONGLONG Offset,
+            __in ULONGLONG Length,
+            __inout __deref PKIRQL LowestAssumedIrql
+            );
+
     NTSTATUS
         ImScsiCloseDevice(
             __in pHW_LU_EXTENSION pLUExt,
@@ -873,7 +1146,7 @@ extern "C" {
             __in ULONG ResponseHeaderSize,
             __drv_when(ResponseDataBufferSize > 0 && *ResponseDataSize > 0, __out) __drv_when(ResponseDataBufferSize > 0, __deref) PVOID ResponseData,
             __in ULONG ResponseDataBufferSize,
-            __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize);
+            __drv_when(ResponseDataBufferSize > 0, __inout __deref) PULONGLONG ResponseDataSize);
 
     NTSTATUS
         ImScsiConnectProxy(__inout __deref PPROXY_CONNECTION Proxy,
@@ -890,6 +1163,21 @@ extern "C" {
             __out __deref PIMDPROXY_INFO_RESP ProxyInfoResponse,
             __in ULONG ProxyInfoResponseLength);
 
+    NTSTATUS
+        ImScsiStartTaggedProxy(__inout __deref PPROXY_CONNECTION Proxy);
+
+    VOID
+        ImScsiFailPendingProxyRequests(__inout __deref PPROXY_CONNECTION Proxy);
+
+    NTSTATUS
+        ImScsiSendTaggedProxyRequest(__in __deref PPROXY_CONNECTION Proxy,
+            __inout __deref PPROXY_TAGGED_REQUEST Request,
+            __in __deref PKEVENT CancelEvent OPTIONAL,
+            __in __deref PVOID RequestHeader,
+            __in ULONG RequestHeaderSize,
+            __drv_when(RequestDataSize > 0, __in __deref) PVOID RequestData,
+            __in ULONG RequestDataSize);
+
     NTSTATUS
         ImScsiReadProxy(__in __deref PPROXY_CONNECTION Proxy,
             __out __deref PIO_STATUS_BLOCK IoStatusBlock,
@@ -906,6 +1194,22 @@ extern "C" {
             __in ULONG Length,
             __in __deref PLARGE_INTEGER ByteOffset);
 
+    NTSTATUS
+        ImScsiReadVProxy(__in __deref PPROXY_CONNECTION Proxy,
+            __out __deref PIO_STATUS_BLOCK IoStatusBlock,
+            __in __deref PKEVENT CancelEvent,
+            PVOID Buffer,
+            __in __deref PIMDPROXY_EXTENT Extents,
+            __in ULONG ExtentCount);
+
+    NTSTATUS
+        ImScsiWriteVProxy(__in __deref PPROXY_CONNECTION Proxy,
+            __out __deref PIO_STATUS_BLOCK IoStatusBlock,
+            __in __deref PKEVENT CancelEvent,
+            PVOID Buffer,
+            __in __deref PIMDPROXY_EXTENT Extents,
+            __in ULONG ExtentCount);
+
     IMDPROXY_SHARED_RESP_CODE
         ImScsiSharedKeyProxy(__in __deref pHW_LU_EXTENSION LuExt,
             __in __deref PIMDPROXY_SHARED_REQ Request,
@@ -1000,20 +1304,66 @@ extern "C" {
     VOID ImScsiScheduleWorkItem(pMP_WorkRtnParms pWkRtnParms,
         PKIRQL LowestAssumedIrql);
 
+    VOID ImScsiInitializePools();
+
+    VOID ImScsiResizePools(LONG LUCountChange);
+
+    VOID ImScsiFreePools();
+
+    PVOID ImScsiAllocateBuffer(ULONG Size);
+
+    VOID ImScsiFreeBuffer(PVOID Buffer, ULONG Size);
+
+    pMP_WorkRtnParms ImScsiAllocateWorkItem();
+
+    VOID ImScsiFreeWorkItem(pMP_WorkRtnParms pWkRtnParms);
+
+    VOID ImScsiInitializeZeroScan();
+
+    BOOLEAN ImScsiIsBufferZero(PVOID Buffer, ULONG Length);
+
+    //
+    // Timestamps for request statistics, in performance counter units.
+    // Performance counter has better resolution than interrupt time, which
+    // is too coarse for latencies of fast requests.
+    //
     FORCEINLINE
-        BOOLEAN
-        ImScsiIsBufferZero(PVOID Buffer, ULONG Length)
+        LONGLONG
+        ImScsiGetTimestamp()
     {
-        PULONGLONG ptr;
+        return KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+
+    VOID ImScsiStatsRequestQueued(pMP_WorkRtnParms pWkRtnParms,
+        PKIRQL LowestAssumedIrql);
 
-        if (Length < sizeof(ULONGLONG))
-            return FALSE;
+    VOID ImScsiStatsRequestDone(pHW_LU_EXTENSION pLUExt,
+        PSCSI_REQUEST_BLOCK pSrb, LONGLONG StartTime, LONGLONG BackendTime,
+        BOOLEAN Queued, PKIRQL LowestAssumedIrql);
 
-        for (ptr = (PULONGLONG)Buffer;
-        (ptr <= (PULONGLONG)((PUCHAR)Buffer + Length - sizeof(ULONGLONG))) &&
-            (*ptr == 0); ptr++);
+    VOID ImScsiStatsWorkDone(pMP_WorkRtnParms pWkRtnParms,
+        PKIRQL LowestAssumedIrql);
+
+    VOID ImScsiInitializeTrace();
+
+    VOID ImScsiFreeTrace();
 
-            return (BOOLEAN)(ptr == (PULONGLONG)((PUCHAR)Buffer + Length));
+    VOID ImScsiTraceWriteRequest(pHW_LU_EXTENSION pLUExt,
+        PSCSI_REQUEST_BLOCK pSrb, UCHAR Stage);
+
+    //
+    // Adds a request stage to trace ring of current processor. Only costs a
+    // test when tracing is disabled.
+    //
+    FORCEINLINE
+        VOID
+        ImScsiTraceRequest(pHW_LU_EXTENSION pLUExt, PSCSI_REQUEST_BLOCK pSrb,
+            UCHAR Stage)
+    {
+        if (pMPDrvInfoGlobal->TraceRings != NULL)
+        {
+            ImScsiTraceWriteRequest(pLUExt, pSrb, Stage);
+        }
     }
 
 #if DBG
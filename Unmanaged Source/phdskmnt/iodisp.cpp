@@ -145,11 +145,7 @@ __inout __deref PKIRQL         LowestAssumedIrql
         ImScsiCloseProxy(&pLUExt->Proxy);
     }
 
-    if (pLUExt->LastIoBuffer != NULL)
-    {
-        ExFreePoolWithTag(pLUExt->LastIoBuffer, MP_TAG_GENERAL);
-        pLUExt->LastIoBuffer = NULL;
-    }
+    ImScsiFreeReadCache(pLUExt);
 
     if (pLUExt->VMDisk)
     {
@@ -261,6 +257,11 @@ PVOID Context)
 
     UNREFERENCED_PARAMETER(DeviceObject);
 
+    pWkRtnParms->BackendTime = ImScsiGetTimestamp() - pWkRtnParms->BackendTime;
+
+    ImScsiTraceRequest(pWkRtnParms->pLUExt, pWkRtnParms->pSrb,
+        IMSCSI_TRACE_IO_DONE);
+
     if (!NT_SUCCESS(Irp->IoStatus.Status))
     {
         switch (Irp->IoStatus.Status)
@@ -404,8 +405,6 @@ PVOID Context)
 
     if (pWkRtnParms->AllocatedBuffer != NULL)
     {
-        KLOCK_QUEUE_HANDLE LockHandle;
-
         if (thread == NULL)
         {
             thread = PsGetCurrentThread();
@@ -416,23 +415,14 @@ PVOID Context)
             lowest_assumed_irql = pWkRtnParms->LowestAssumedIrql;
         }
 
-        ImScsiAcquireLock(&pWkRtnParms->pLUExt->LastIoLock, &LockHandle,
-            lowest_assumed_irql);
-
-        if (pWkRtnParms->pLUExt->LastIoBuffer != NULL)
-        {
-            ExFreePoolWithTag(pWkRtnParms->pLUExt->LastIoBuffer,
-                MP_TAG_GENERAL);
-        }
-
-        pWkRtnParms->pLUExt->LastIoStartSector = startingSector.QuadPart;
-        pWkRtnParms->pLUExt->LastIoLength =
-            pWkRtnParms->pSrb->DataTransferLength;
-        pWkRtnParms->pLUExt->LastIoBuffer = pWkRtnParms->AllocatedBuffer;
-
-        ImScsiReleaseLock(&LockHandle, &lowest_assumed_irql);
+        // Devices with parallel I/O are not read cached, see
+        // ImScsiAllocateReadCache
+        ImScsiFreeBuffer(pWkRtnParms->AllocatedBuffer,
+            pWkRtnParms->AllocatedBufferSize);
     }
 
+    ImScsiStatsWorkDone(pWkRtnParms, &lowest_assumed_irql);
+
 #ifdef USE_SCSIPORT
 
     if (thread == NULL)
@@ -448,7 +438,7 @@ PVOID Context)
         ScsiPortNotification(NextRequest, pWkRtnParms->pHBAExt);
         ScsiPortNotification(NextLuRequest, pWkRtnParms->pHBAExt, 0, 0, 0);
 
-        ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+        ImScsiFreeWorkItem(pWkRtnParms);
     }
     else
     {
@@ -490,7 +480,7 @@ PVOID Context)
     KdPrint2(("PhDskMnt::ImScsiParallelReadWriteImageCompletion sending 'RequestComplete' to port StorPort.\n"));
     StorPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
 
-    ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+    ImScsiFreeWorkItem(pWkRtnParms);
 
 #endif
 
@@ -670,9 +660,11 @@ __inout __deref PKIRQL      LowestAssumedIrql
             return;
         }
 
+        pWkRtnParms->AllocatedBufferSize =
+            pWkRtnParms->pSrb->DataTransferLength;
+
         pWkRtnParms->AllocatedBuffer =
-            ExAllocatePoolWithTag(NonPagedPool,
-            pWkRtnParms->pSrb->DataTransferLength, MP_TAG_GENERAL);
+            ImScsiAllocateBuffer(pWkRtnParms->AllocatedBufferSize);
 
         if (pWkRtnParms->AllocatedBuffer == NULL)
         {
@@ -741,7 +733,8 @@ __inout __deref PKIRQL      LowestAssumedIrql
     {
         if (pWkRtnParms->AllocatedBuffer != NULL)
         {
-            ExFreePoolWithTag(pWkRtnParms->AllocatedBuffer, MP_TAG_GENERAL);
+            ImScsiFreeBuffer(pWkRtnParms->AllocatedBuffer,
+                pWkRtnParms->AllocatedBufferSize);
             pWkRtnParms->AllocatedBuffer = NULL;
         }
 
@@ -778,6 +771,13 @@ __inout __deref PKIRQL      LowestAssumedIrql
     pWkRtnParms->pReqThread = PsGetCurrentThread();
     pWkRtnParms->LowestAssumedIrql = *LowestAssumedIrql;
 
+    ImScsiStatsRequestQueued(pWkRtnParms, LowestAssumedIrql);
+
+    pWkRtnParms->BackendTime = ImScsiGetTimestamp();
+
+    ImScsiTraceRequest(pWkRtnParms->pLUExt, pWkRtnParms->pSrb,
+        IMSCSI_TRACE_IO_START);
+
     IoSetCompletionRoutine(lower_irp, ImScsiParallelReadWriteImageCompletion,
         pWkRtnParms, TRUE, TRUE, TRUE);
 
@@ -812,7 +812,7 @@ __in PULONG           Length
         ULONG_PTR vm_offset = Offset->LowPart;
 #endif
 
-        RtlCopyMemory(Buffer,
+        ImScsiCopyFromVMDisk(Buffer,
             pLUExt->ImageBuffer + vm_offset,
             *Length);
 
@@ -980,7 +980,7 @@ __in PULONG           Length
         ULONG_PTR vm_offset = Offset->LowPart;
 #endif
 
-        RtlCopyMemory(pLUExt->ImageBuffer + vm_offset,
+        ImScsiCopyToVMDisk(pLUExt->ImageBuffer + vm_offset,
             Buffer,
             *Length);
 
@@ -1101,6 +1101,422 @@ ImScsiGenerateUniqueId(pHW_LU_EXTENSION pLUExt)
     }
 }
 
+//
+// Read cache for devices where all I/O goes through the worker thread. Cache
+// memory is taken from a global budget, ReadCacheSizeTotal, in chunks of at
+// most ReadCacheSizePerLU. Offsets below are byte offsets on the virtual
+// disk, not including ImageOffset.
+//
+VOID
+ImScsiAllocateReadCache(pHW_LU_EXTENSION pLUExt)
+{
+    LONG total;
+    LONG allocated;
+    LONG charge;
+    LONG used;
+    ULONG set_count;
+    ULONGLONG memory_size = 0;
+    PVOID memory = NULL;
+
+    // Memory backed devices gain nothing from this. Shared images can be
+    // modified by someone else and parallel I/O bypasses the worker thread.
+    if (pLUExt->VMDisk ||
+        pLUExt->AWEAllocDisk ||
+        pLUExt->SharedImage ||
+        (pLUExt->FileObject != NULL))
+    {
+        return;
+    }
+
+    total = (LONG)min(pMPDrvInfoGlobal->MPRegInfo.ReadCacheSizeTotal, MAXLONG);
+
+    for (;;)
+    {
+        allocated = pMPDrvInfoGlobal->ReadCacheAllocated;
+
+        if (allocated >= total)
+        {
+            KdPrint((__FUNCTION__ ": Read cache budget used up, pLUExt=%p not cached.
+",
+                pLUExt));
+
+            return;
+        }
+
+        charge = (LONG)min(pMPDrvInfoGlobal->MPRegInfo.ReadCacheSizePerLU,
+            (ULONG)(total - allocated));
+
+        if (charge == 0)
+        {
+            return;
+        }
+
+        if (InterlockedCompareExchange(&pMPDrvInfoGlobal->ReadCacheAllocated,
+            allocated + charge, allocated) == allocated)
+        {
+            break;
+        }
+    }
+
+    for (set_count = ImScsiCacheSetCountForSize((ULONGLONG)charge << 10);
+        set_count != 0;
+        set_count >>= 1)
+    {
+        memory_size = ImScsiCacheMemorySize(set_count);
+
+        if (memory_size != (SIZE_T)memory_size)
+        {
+            continue;
+        }
+
+        memory = ExAllocatePoolWithTag(NonPagedPool, (SIZE_T)memory_size,
+            MP_TAG_GENERAL);
+
+        if (memory != NULL)
+        {
+            break;
+        }
+    }
+
+    if (memory == NULL)
+    {
+        DbgPrint(__FUNCTION__ ": Memory allocation failed for %i KB read cache.\n",
+            charge);
+
+        InterlockedExchangeAdd(&pMPDrvInfoGlobal->ReadCacheAllocated, -charge);
+
+        return;
+    }
+
+    // Give back what was rounded off
+    used = (LONG)((memory_size + 1023) >> 10);
+
+    if (used < charge)
+    {
+        InterlockedExchangeAdd(&pMPDrvInfoGlobal->ReadCacheAllocated,
+            used - charge);
+
+        charge = used;
+    }
+
+    ImScsiCacheInitialize(&pLUExt->ReadCache, memory, set_count);
+
+    pLUExt->ReadCacheMemory = memory;
+    pLUExt->ReadCacheCharge = charge;
+
+    pLUExt->MaxReadAheadSize = (ULONG)min(
+        (ULONGLONG)pMPDrvInfoGlobal->MPRegInfo.ReadAheadMaxSize << 10, MAXULONG);
+
+    KdPrint((__FUNCTION__ ": pLUExt=%p, %u sets, %i KB read cache.\n",
+        pLUExt, set_count, charge));
+}
+
+VOID
+ImScsiFreeReadCache(pHW_LU_EXTENSION pLUExt)
+{
+    if (pLUExt->ReadCacheMemory == NULL)
+    {
+        return;
+    }
+
+    KdPrint((__FUNCTION__ ": pLUExt=%p, read cache hits=%I64u misses=%I64u\n",
+        pLUExt, pLUExt->ReadCache.hits, pLUExt->ReadCache.misses));
+
+    pLUExt->ReadCache.set_count = 0;
+
+    ExFreePoolWithTag(pLUExt->ReadCacheMemory, MP_TAG_GENERAL);
+    pLUExt->ReadCacheMemory = NULL;
+
+    InterlockedExchangeAdd(&pMPDrvInfoGlobal->ReadCacheAllocated,
+        -pLUExt->ReadCacheCharge);
+
+    pLUExt->ReadCacheCharge = 0;
+}
+
+//
+// Called with ReadCacheLock held for each read request on a cached LU.
+// Follows sequential streams and adapts their windows, see imscsiahead.h.
+// Returns TRUE if worker thread has read-ahead to do.
+//
+static BOOLEAN
+ImScsiReadAheadTrack(
+    pHW_LU_EXTENSION pLUExt,
+    LONGLONG Offset,
+    ULONG Length,
+    BOOLEAN Hit)
+{
+    ULONG max_window = ImScsiAheadMaxWindow(
+        (ULONGLONG)pLUExt->ReadCache.set_count *
+        IMSCSI_CACHE_WAYS * IMSCSI_CACHE_LINE_SIZE,
+        pLUExt->MaxReadAheadSize);
+
+    return (BOOLEAN)ImScsiAheadTrack(pLUExt->ReadAheadStreams,
+        ++pLUExt->ReadAheadClock, max_window, pLUExt->DiskSize.QuadPart,
+        Offset, Length, Hit, &pLUExt->ReadAheadWastedBytes);
+}
+
+//
+// Retry is set when the request already missed once in ScsiOpReadWrite, but
+// could have been read ahead into cache while it was queued. It is then
+// not tracked or counted again.
+//
+BOOLEAN
+ImScsiReadCacheRead(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG Offset,
+    __in ULONG Length,
+    __out PVOID Buffer,
+    __in BOOLEAN Retry,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    BOOLEAN hit;
+    BOOLEAN read_ahead = FALSE;
+
+    if (pLUExt->ReadCache.set_count == 0)
+    {
+        return FALSE;
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    hit = (BOOLEAN)ImScsiCacheRead(&pLUExt->ReadCache, Offset, Length, Buffer);
+
+    if (Retry)
+    {
+        pLUExt->ReadCache.misses--;
+    }
+    else if (pLUExt->MaxReadAheadSize != 0)
+    {
+        read_ahead = ImScsiReadAheadTrack(pLUExt, Offset, Length, hit);
+    }
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    // Misses are queued anyway, which wakes up worker thread
+    if (read_ahead && hit)
+    {
+        KeSetEvent(&pLUExt->RequestEvent, (KPRIORITY)0, FALSE);
+    }
+
+    return hit;
+}
+
+BOOLEAN
+ImScsiReadCacheContains(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG Offset,
+    __in ULONG Length,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    BOOLEAN found;
+
+    if (pLUExt->ReadCache.set_count == 0)
+    {
+        return FALSE;
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    found = (BOOLEAN)ImScsiCacheContains(&pLUExt->ReadCache, Offset, Length);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return found;
+}
+
+//
+// Called by LU worker thread when there are no queued requests. Reads at
+// most one chunk ahead for one stream into read cache. Returns TRUE if
+// anything was done, so that caller looks for new requests before calling
+// this again.
+//
+BOOLEAN
+ImScsiReadAhead(
+    __in pHW_LU_EXTENSION pLUExt)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    PIMSCSI_READ_AHEAD_STREAM stream = NULL;
+    LARGE_INTEGER offset = { 0 };
+    ULONG length = 0;
+    ULONG id = 0;
+    ULONGLONG generation = 0;
+    PVOID buffer;
+    ULONG buffer_size;
+    NTSTATUS status;
+    int i;
+
+    if ((pLUExt->ReadCache.set_count == 0) ||
+        (pLUExt->MaxReadAheadSize == 0))
+    {
+        return FALSE;
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, lowest_assumed_irql);
+
+    i = ImScsiAheadNext(pLUExt->ReadAheadStreams, &pLUExt->ReadCache,
+        pLUExt->DiskSize.QuadPart, &offset.QuadPart, &length);
+
+    if (i >= 0)
+    {
+        stream = &pLUExt->ReadAheadStreams[i];
+        id = stream->Id;
+        generation = pLUExt->ReadCache.generation;
+
+        pLUExt->ReadAheadRequests++;
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (stream == NULL)
+    {
+        return FALSE;
+    }
+
+    buffer_size = length;
+
+    buffer = ImScsiAllocateBuffer(buffer_size);
+
+    if (buffer == NULL)
+    {
+        KdPrint((__FUNCTION__ ": Memory allocation failed.\n"));
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    else
+    {
+        KdPrint2((__FUNCTION__ ": pLUExt=%p, Offset=0x%I64X, Length=0x%X\n",
+            pLUExt, offset.QuadPart, length));
+
+        status = ImScsiReadDevice(pLUExt, buffer, &offset, &length);
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, lowest_assumed_irql);
+
+    if (NT_SUCCESS(status))
+    {
+        ImScsiCacheFill(&pLUExt->ReadCache, generation, offset.QuadPart,
+            length, buffer);
+
+        pLUExt->ReadAheadBytes += length;
+
+        if ((stream->Id == id) &&
+            (stream->FilledOffset < offset.QuadPart + length))
+        {
+            stream->FilledOffset = offset.QuadPart + length;
+        }
+    }
+    else if (stream->Id == id)
+    {
+        // Leave it to requests on synchronous path to report errors
+        stream->Window = 0;
+        stream->SequentialCount = 1;
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (buffer != NULL)
+    {
+        ImScsiFreeBuffer(buffer, buffer_size);
+    }
+
+    return TRUE;
+}
+
+//
+// Called before reading from image. Pass the result to ImScsiReadCacheFill
+// after the read, so that data read while a write to the same cache sets
+// was in progress is not cached.
+//
+ULONGLONG
+ImScsiReadCacheGetGeneration(
+    __in pHW_LU_EXTENSION pLUExt,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    ULONGLONG generation;
+
+    if (pLUExt->ReadCache.set_count == 0)
+    {
+        return 0;
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    generation = pLUExt->ReadCache.generation;
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return generation;
+}
+
+VOID
+ImScsiReadCacheFill(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in ULONGLONG Generation,
+    __in LONGLONG Offset,
+    __in ULONG Length,
+    __in PVOID Buffer,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    if (pLUExt->ReadCache.set_count == 0)
+    {
+        return;
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    ImScsiCacheFill(&pLUExt->ReadCache, Generation, Offset, Length, Buffer);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+}
+
+VOID
+ImScsiReadCacheWrite(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG Offset,
+    __in ULONG Length,
+    __in PVOID Buffer,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    if (pLUExt->ReadCache.set_count == 0)
+    {
+        return;
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    ImScsiCacheWrite(&pLUExt->ReadCache, Offset, Length, Buffer);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+}
+
+VOID
+ImScsiReadCacheInvalidate(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in LONGLONG Offset,
+    __in ULONGLONG Length,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    if (pLUExt->ReadCache.set_count == 0)
+    {
+        return;
+    }
+
+    ImScsiAcquireLock(&pLUExt->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    ImScsiCacheInvalidate(&pLUExt->ReadCache, Offset, Length);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+}
+
 NTSTATUS
 ImScsiInitializeLU(__inout __deref pHW_LU_EXTENSION pLUExt,
 __inout __deref PSRB_IMSCSI_CREATE_DATA CreateData,
@@ -2047,6 +2463,19 @@ __in __deref PETHREAD ClientThread)
             if ((proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_SHARED) == 0)
                 CreateData->Fields.Flags &= ~IMSCSI_OPTION_SHARED_IMAGE;
 
+            if ((proxy_info.flags & IMDPROXY_FLAG_SUPPORTS_TAGGED) &&
+                (proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_DEVICE))
+            {
+                // Not fatal, requests are then sent one at a time as before
+                status = ImScsiStartTaggedProxy(&proxy);
+
+                if (!NT_SUCCESS(status))
+                {
+                    KdPrint((__FUNCTION__ ": Cannot start tagged requests (%#x).\n",
+                        status));
+                }
+            }
+
             KdPrint((__FUNCTION__ ": Got from proxy: Siz=0x%08x%08x Flg=%#x Alg=%#x.\n",
                 CreateData->Fields.DiskSize.HighPart,
                 CreateData->Fields.DiskSize.LowPart,
@@ -2404,6 +2833,49 @@ __in __deref PETHREAD ClientThread)
         }
     }
 
+    ImScsiAllocateReadCache(pLUExt);
+
+    // Requests on a plain proxy connection need to be sent and answered one
+    // at a time. Other kinds of LUs can be served by more worker threads,
+    // which are started by worker threads when queue grows.
+    pLUExt->MaxWorkers = pMPDrvInfoGlobal->MPRegInfo.WorkerThreadsPerLU;
+
+    if (pLUExt->MaxWorkers > IMSCSI_MAX_WORKERS_PER_LU)
+    {
+        pLUExt->MaxWorkers = IMSCSI_MAX_WORKERS_PER_LU;
+    }
+
+    if ((pLUExt->MaxWorkers == 0) ||
+        (pLUExt->UseProxy &&
+        (pLUExt->Proxy.tagged == NULL) &&
+        (pLUExt->Proxy.shm_ring == NULL)))
+    {
+        pLUExt->MaxWorkers = 1;
+    }
+
+    pLUExt->WorkerCount = 1;
+
+    // Adjacent requests queued at the same time are served as one request
+    // to image, unless they are already copied directly to a VM disk or
+    // sent without waiting on a tagged proxy connection.
+    if (!pLUExt->VMDisk &&
+        !(pLUExt->UseProxy &&
+        ((pLUExt->Proxy.tagged != NULL) ||
+        (pLUExt->Proxy.shm_ring != NULL))))
+    {
+        pLUExt->MergeMaxSize = (ULONG)min(
+            (ULONGLONG)pMPDrvInfoGlobal->MPRegInfo.MergeMaxSize << 10, MAXULONG);
+
+        // Proxy servers that take vectored requests also get nearby
+        // requests with gaps between them in one request.
+        if (pLUExt->UseProxy &&
+            (pLUExt->Proxy.server_flags & IMDPROXY_FLAG_SUPPORTS_VECTORED))
+        {
+            pLUExt->MergeMaxSpan = (ULONG)min(
+                (ULONGLONG)pLUExt->MergeMaxSize * 4, MAXULONG);
+        }
+    }
+
     status = PsCreateSystemThread(
         &thread_handle,
         (ACCESS_MASK)0L,
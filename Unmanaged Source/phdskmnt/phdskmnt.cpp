@@ -165,6 +165,13 @@ ImScsiFreeGlobalResources()
             pMPDrvInfoGlobal->WorkerThread = NULL;
         }
 
+        if (pMPDrvInfoGlobal->GlobalsInitialized)
+        {
+            ImScsiFreePools();
+
+            ImScsiFreeTrace();
+        }
+
 #ifdef USE_SCSIPORT
         if (pMPDrvInfoGlobal->ControllerObject != NULL)
         {
@@ -566,6 +573,20 @@ __out      PBOOLEAN                        pBAgain
 
         KeInitializeEvent(&pMPDrvInfoGlobal->StopWorker, NotificationEvent, FALSE);
 
+        ImScsiInitializePools();
+
+        ImScsiInitializeZeroScan();
+
+        {
+            LARGE_INTEGER frequency;
+
+            KeQueryPerformanceCounter(&frequency);
+
+            pMPDrvInfoGlobal->PerformanceFrequency = frequency.QuadPart;
+        }
+
+        ImScsiInitializeTrace();
+
         pMPDrvInfoGlobal->GlobalsInitialized = TRUE;
 
         InitializeObjectAttributes(&object_attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
@@ -722,7 +743,7 @@ __inout __deref PKIRQL LowestAssumedIrql
         ScsiPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
         ScsiPortNotification(NextRequest, pWkRtnParms->pHBAExt);
 
-        ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);      // Free parm list.
+        ImScsiFreeWorkItem(pWkRtnParms);                     // Free parm list.
     }
 }
 
@@ -1501,7 +1522,7 @@ pMP_WorkRtnParms ImScsiCreateWorkItem(pHW_HBA_EXT pHBAExt,
     PSCSI_REQUEST_BLOCK pSrb)
 {
     pMP_WorkRtnParms pWkRtnParms =                                     // Allocate parm area for work routine.
-        (pMP_WorkRtnParms)ExAllocatePoolWithTag(NonPagedPool, sizeof(MP_WorkRtnParms), MP_TAG_GENERAL);
+        ImScsiAllocateWorkItem();
 
     if (pWkRtnParms == NULL)
     {
@@ -1524,6 +1545,8 @@ VOID ImScsiScheduleWorkItem(pMP_WorkRtnParms pWkRtnParms, PKIRQL LowestAssumedIr
 
     KLOCK_QUEUE_HANDLE lock_handle;
 
+    ImScsiStatsRequestQueued(pWkRtnParms, LowestAssumedIrql);
+
     if (pWkRtnParms->pLUExt == NULL)
     {
         ImScsiAcquireLock(&pMPDrvInfoGlobal->RequestListLock, &lock_handle, *LowestAssumedIrql);
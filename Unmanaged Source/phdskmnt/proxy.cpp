@@ -18,66 +18,1524 @@
 
 #include <imdproxy.h>
 
+#include <imdshmring.h>
+
+#include <imdtagtab.h>
+
 #pragma warning(disable : 4204)
 #pragma warning(disable : 4221)
 
-VOID
-ImScsiCloseProxy(__in __deref PPROXY_CONNECTION Proxy)
-{
-    //PAGED_CODE();
+//
+// State for a proxy connection where server supports tagged requests. Any
+// number of threads can send requests. Responses are received by a separate
+// thread and matched with sent requests by io_tag, which holds slot number
+// and generation in pending table. Tags do not reveal kernel addresses, and
+// a late response does not match a newer request. When proxy service has
+// opened several connections to the same server, each one has its own
+// context, linked through next, and requests are sent on the one with least
+// in flight.
+//
+typedef struct _PROXY_TAGGED_CONTEXT
+{
+    struct _PROXY_TAGGED_CONTEXT *next;
+    PFILE_OBJECT device;
+    KEVENT send_lock;
+    KSPIN_LOCK pending_lock;
+    IMD_TAG_TABLE pending;      // Requests waiting for response
+    LONG load;                  // Sum of Load for requests in pending
+    NTSTATUS failure_status;
+    KEVENT stop_event;
+    PKTHREAD receive_thread;
+} PROXY_TAGGED_CONTEXT, *PPROXY_TAGGED_CONTEXT;
+
+//
+// State for a shared memory proxy connection with ring layout. Any number
+// of threads can submit requests, each one in a slot of its own. Responses
+// are picked up by a separate thread that polls completion ring for a while
+// before it sleeps on response event.
+//
+typedef struct _PROXY_SHM_RING_CONTEXT
+{
+    PIMDPROXY_SHM_RING_HEADER header;
+    PUCHAR slots;
+    ULONG slot_count;           // Copied from header and validated once
+    ULONG slot_data_size;
+    ULONG_PTR slot_size;
+    ULONG spin_count;           // IMSCSI_SHM_RING_SPIN_COUNT, or 0 on one CPU
+    PKEVENT request_event;
+    PKEVENT response_event;
+    KSEMAPHORE free_slots;      // Count of slots on free_list
+    KSPIN_LOCK slot_lock;       // Protects everything below except submit_lock
+    ULONG free_count;
+    ULONG free_list[IMDPROXY_SHM_RING_MAX_SLOTS];
+    BOOLEAN slot_busy[IMDPROXY_SHM_RING_MAX_SLOTS];
+    PPROXY_TAGGED_REQUEST slot_requests[IMDPROXY_SHM_RING_MAX_SLOTS];
+    NTSTATUS failure_status;
+    KSPIN_LOCK submit_lock;     // Serializes submission ring producers
+    KEVENT stop_event;
+    PKTHREAD completion_thread;
+} PROXY_SHM_RING_CONTEXT, *PPROXY_SHM_RING_CONTEXT;
+
+// Number of times to poll for a response before sleeping on an event. Most
+// requests on shared memory complete within this time. Not used with only
+// one processor, where polling keeps server from running.
+#define IMSCSI_SHM_RING_SPIN_COUNT      4000
+
+// Response data for abandoned requests is read in pieces of this size
+#define IMSCSI_TAGGED_TOMBSTONE_BUFFER_SIZE 4096
+
+//
+// Left in pending table in place of a tagged request that its caller has
+// abandoned. Server still sends a response for the tag, which is read into
+// tombstone and dropped, so that next response header is read from the
+// right place in the stream.
+//
+typedef struct _PROXY_TAGGED_TOMBSTONE
+{
+    PROXY_TAGGED_REQUEST request;
+    ULONGLONG response_header[4];
+    UCHAR discard_buffer[IMSCSI_TAGGED_TOMBSTONE_BUFFER_SIZE];
+} PROXY_TAGGED_TOMBSTONE, *PPROXY_TAGGED_TOMBSTONE;
+
+VOID
+ImScsiStopTaggedProxy(__inout __deref PPROXY_CONNECTION Proxy);
+
+VOID
+ImScsiStopShmRingProxy(__inout __deref PPROXY_CONNECTION Proxy);
+
+VOID
+ImScsiCloseProxy(__in __deref PPROXY_CONNECTION Proxy)
+{
+    //PAGED_CODE();
+
+    ASSERT(Proxy != NULL);
+
+    switch (Proxy->connection_type)
+    {
+    case PROXY_CONNECTION::PROXY_CONNECTION_DEVICE:
+        if (Proxy->tagged != NULL)
+            ImScsiStopTaggedProxy(Proxy);
+
+        if (Proxy->device != NULL)
+            ObDereferenceObject(Proxy->device);
+
+        Proxy->device = NULL;
+
+        for (ULONG i = 0; i < Proxy->extra_stream_count; i++)
+        {
+            ObDereferenceObject(Proxy->extra_streams[i]);
+            Proxy->extra_streams[i] = NULL;
+        }
+
+        Proxy->extra_stream_count = 0;
+        break;
+
+    case PROXY_CONNECTION::PROXY_CONNECTION_SHM:
+        if ((Proxy->request_event != NULL) &&
+            (Proxy->response_event != NULL) &&
+            (Proxy->shared_memory != NULL))
+        {
+            if (Proxy->shm_ring != NULL)
+            {
+                ImScsiStopShmRingProxy(Proxy);
+            }
+            else
+            {
+                *(ULONGLONG*)Proxy->shared_memory = IMDPROXY_REQ_CLOSE;
+                KeSetEvent(Proxy->request_event, (KPRIORITY)0, FALSE);
+            }
+        }
+
+        if (Proxy->request_event_handle != NULL)
+        {
+            ZwClose(Proxy->request_event_handle);
+            Proxy->request_event_handle = NULL;
+        }
+
+        if (Proxy->response_event_handle != NULL)
+        {
+            ZwClose(Proxy->response_event_handle);
+            Proxy->response_event_handle = NULL;
+        }
+
+        if (Proxy->request_event != NULL)
+        {
+            ObDereferenceObject(Proxy->request_event);
+            Proxy->request_event = NULL;
+        }
+
+        if (Proxy->response_event != NULL)
+        {
+            ObDereferenceObject(Proxy->response_event);
+            Proxy->response_event = NULL;
+        }
+
+        if (Proxy->shared_memory != NULL)
+        {
+            ZwUnmapViewOfSection(NtCurrentProcess(), Proxy->shared_memory);
+            Proxy->shared_memory = NULL;
+        }
+
+        break;
+    }
+}
+
+//
+// Adds a request to pending table and sets its IoTag. Called with
+// pending_lock held.
+//
+NTSTATUS
+ImScsiLinkTaggedProxyRequest(__inout __deref PPROXY_TAGGED_CONTEXT Context,
+__inout __deref PPROXY_TAGGED_REQUEST Request)
+{
+    if (ImdTagTableIsFull(&Context->pending))
+    {
+        ULONG new_capacity = ImdTagTableNextCapacity(&Context->pending);
+        PIMD_TAG_SLOT new_slots = NULL;
+        PIMD_TAG_SLOT old_slots;
+
+        if (new_capacity != 0)
+        {
+            new_slots = (PIMD_TAG_SLOT)ExAllocatePoolWithTag(NonPagedPool,
+                new_capacity * sizeof(IMD_TAG_SLOT), MP_TAG_GENERAL);
+        }
+
+        if (new_slots == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        old_slots = ImdTagTableGrow(&Context->pending, new_slots,
+            new_capacity);
+
+        if (old_slots != NULL)
+        {
+            ExFreePoolWithTag(old_slots, MP_TAG_GENERAL);
+        }
+    }
+
+    Request->IoTag = ImdTagTableInsert(&Context->pending, Request);
+    Context->load += Request->Load;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Takes a request out of pending table. Called with pending_lock held.
+//
+VOID
+ImScsiUnlinkTaggedProxyRequest(__inout __deref PPROXY_TAGGED_CONTEXT Context,
+__inout __deref PPROXY_TAGGED_REQUEST Request)
+{
+    ImdTagTableRemove(&Context->pending, Request->IoTag);
+    Request->IoTag = 0;
+    Context->load -= Request->Load;
+}
+
+//
+// Completes a request taken out of pending table, either by calling its
+// completion routine or by waking up a thread waiting for it.
+//
+VOID
+ImScsiCompleteTaggedProxyRequest(__inout __deref PPROXY_TAGGED_REQUEST Request,
+__in NTSTATUS Status,
+__in ULONG_PTR Information)
+{
+    Request->IoStatus.Status = Status;
+    Request->IoStatus.Information = Information;
+
+    if (Request->CompletionRoutine != NULL)
+    {
+        Request->CompletionRoutine(Request);
+    }
+    else
+    {
+        KeSetEvent(&Request->CompletionEvent, (KPRIORITY)0, FALSE);
+    }
+}
+
+VOID
+ImScsiFreeTaggedProxyTombstone(__in PPROXY_TAGGED_REQUEST Request)
+{
+    ExFreePoolWithTag(CONTAINING_RECORD(Request, PROXY_TAGGED_TOMBSTONE,
+        request), MP_TAG_GENERAL);
+}
+
+//
+// Creates a tombstone that expects the same response as Request. Returns
+// NULL if there is no memory or if response header does not fit.
+//
+PPROXY_TAGGED_TOMBSTONE
+ImScsiCreateTaggedProxyTombstone(__in __deref PPROXY_TAGGED_REQUEST Request)
+{
+    PPROXY_TAGGED_TOMBSTONE tombstone;
+    ULONG_PTR size_offset = 0;
+
+    if (Request->ResponseHeaderSize > sizeof(tombstone->response_header))
+    {
+        return NULL;
+    }
+
+    if (Request->ResponseDataSize != NULL)
+    {
+        size_offset = (PUCHAR)Request->ResponseDataSize -
+            (PUCHAR)Request->ResponseHeader;
+
+        if (size_offset + sizeof(ULONGLONG) > Request->ResponseHeaderSize)
+        {
+            return NULL;
+        }
+    }
+
+    tombstone = (PPROXY_TAGGED_TOMBSTONE)ExAllocatePoolWithTag(NonPagedPool,
+        sizeof(PROXY_TAGGED_TOMBSTONE), MP_TAG_GENERAL);
+
+    if (tombstone == NULL)
+    {
+        return NULL;
+    }
+
+    RtlZeroMemory(&tombstone->request, sizeof(tombstone->request));
+
+    tombstone->request.ResponseHeader = tombstone->response_header;
+    tombstone->request.ResponseHeaderSize = Request->ResponseHeaderSize;
+    tombstone->request.ResponseData = tombstone->discard_buffer;
+    tombstone->request.ResponseDataBufferSize =
+        Request->ResponseDataBufferSize;
+    tombstone->request.DiscardResponseData = TRUE;
+    tombstone->request.CompletionRoutine = ImScsiFreeTaggedProxyTombstone;
+    tombstone->request.Context = Request->Context;
+    tombstone->request.Load = Request->Load;
+
+    if (Request->ResponseDataSize != NULL)
+    {
+        tombstone->request.ResponseDataSize = (PULONGLONG)
+            ((PUCHAR)tombstone->response_header + size_offset);
+    }
+
+    return tombstone;
+}
+
+//
+// Reads response data for a tombstone and drops it.
+//
+NTSTATUS
+ImScsiDiscardTaggedProxyData(__inout __deref PPROXY_TAGGED_CONTEXT Context,
+__in __deref PPROXY_TAGGED_REQUEST Request,
+__in ULONG Length)
+{
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (ULONG done = 0; (done < Length) && NT_SUCCESS(status);)
+    {
+        ULONG piece = min(Length - done, IMSCSI_TAGGED_TOMBSTONE_BUFFER_SIZE);
+
+        status = ImScsiSafeIOStream(Context->device,
+            IRP_MJ_READ,
+            &io_status,
+            &Context->stop_event,
+            Request->ResponseData,
+            piece);
+
+        done += piece;
+    }
+
+    return status;
+}
+
+VOID
+ImScsiTaggedProxyReceiveThread(__in PVOID Context)
+{
+    PPROXY_TAGGED_CONTEXT context = (PPROXY_TAGGED_CONTEXT)Context;
+    IO_STATUS_BLOCK io_status;
+    NTSTATUS status;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    KdPrint((__FUNCTION__ ": Receive thread start. context=%p\n", context));
+
+    for (;;)
+    {
+        IMDPROXY_TAGGED_RESP tagged_resp;
+        PPROXY_TAGGED_REQUEST request;
+        ULONG response_data_size = 0;
+
+        status = ImScsiSafeIOStream(context->device,
+            IRP_MJ_READ,
+            &io_status,
+            &context->stop_event,
+            &tagged_resp,
+            sizeof(tagged_resp));
+
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint((__FUNCTION__ ": Response header error %#x\n.",
+                status));
+
+            break;
+        }
+
+        ImScsiAcquireLock(&context->pending_lock, &lock_handle,
+            lowest_assumed_irql);
+
+        // Tags from server are not trusted. Requests abandoned by their
+        // callers are still found here, as tombstones.
+        request = (PPROXY_TAGGED_REQUEST)
+            ImdTagTableLookup(&context->pending, tagged_resp.io_tag);
+
+        if (request != NULL)
+        {
+            ImScsiUnlinkTaggedProxyRequest(context, request);
+        }
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+        // Size of what follows is not known without a request, so stream
+        // cannot be followed any further.
+        if (request == NULL)
+        {
+            DbgPrint(__FUNCTION__ ": Response for unknown tag %#I64x.\n",
+                tagged_resp.io_tag);
+
+            status = STATUS_IO_DEVICE_ERROR;
+            break;
+        }
+
+        if (request->ResponseHeaderSize > 0)
+        {
+            status = ImScsiSafeIOStream(context->device,
+                IRP_MJ_READ,
+                &io_status,
+                &context->stop_event,
+                request->ResponseHeader,
+                request->ResponseHeaderSize);
+
+            if (!NT_SUCCESS(status))
+            {
+                KdPrint((__FUNCTION__ ": Response header error %#x\n.",
+                    status));
+
+                ImScsiCompleteTaggedProxyRequest(request, status, 0);
+                break;
+            }
+        }
+
+        if (request->ResponseDataSize != NULL)
+        {
+            if (*request->ResponseDataSize > request->ResponseDataBufferSize)
+            {
+                DbgPrint(__FUNCTION__ ": Fatal: Request %u bytes, "
+                    "receiving %I64u bytes.\n",
+                    request->ResponseDataBufferSize,
+                    *request->ResponseDataSize);
+
+                status = STATUS_IO_DEVICE_ERROR;
+                ImScsiCompleteTaggedProxyRequest(request, status, 0);
+                break;
+            }
+
+            response_data_size = (ULONG)*request->ResponseDataSize;
+        }
+
+        if (response_data_size > 0)
+        {
+            if (request->DiscardResponseData)
+            {
+                status = ImScsiDiscardTaggedProxyData(context, request,
+                    response_data_size);
+            }
+            else
+            {
+                status = ImScsiSafeIOStream(context->device,
+                    IRP_MJ_READ,
+                    &io_status,
+                    &context->stop_event,
+                    request->ResponseData,
+                    response_data_size);
+            }
+
+            if (!NT_SUCCESS(status))
+            {
+                KdPrint((__FUNCTION__ ": Response data error %#x\n.",
+                    status));
+
+                ImScsiCompleteTaggedProxyRequest(request, status, 0);
+                break;
+            }
+        }
+
+        ImScsiCompleteTaggedProxyRequest(request, STATUS_SUCCESS,
+            response_data_size);
+    }
+
+    // Connection is unusable from here. Fail everything that is still
+    // waiting for a response and refuse new requests.
+    if (NT_SUCCESS(status) || status == STATUS_CANCELLED)
+    {
+        status = STATUS_CONNECTION_RESET;
+    }
+
+    ImScsiAcquireLock(&context->pending_lock, &lock_handle,
+        lowest_assumed_irql);
+
+    context->failure_status = status;
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    // Nothing is added after failure_status is set, so capacity does not
+    // change during this loop.
+    for (ULONG slot = 0; slot < context->pending.capacity; slot++)
+    {
+        PPROXY_TAGGED_REQUEST request;
+
+        ImScsiAcquireLock(&context->pending_lock, &lock_handle,
+            lowest_assumed_irql);
+
+        request = (PPROXY_TAGGED_REQUEST)context->pending.slots[slot].item;
+
+        if (request != NULL)
+        {
+            ImScsiUnlinkTaggedProxyRequest(context, request);
+        }
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+        if (request != NULL)
+        {
+            ImScsiCompleteTaggedProxyRequest(request, status, 0);
+        }
+    }
+
+    KdPrint((__FUNCTION__ ": Receive thread exit. status=%#x\n", status));
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+//
+// Creates context and receive thread for one connection to server.
+//
+NTSTATUS
+ImScsiStartTaggedProxyStream(__in PFILE_OBJECT Device,
+__out __deref PPROXY_TAGGED_CONTEXT *Context)
+{
+    PPROXY_TAGGED_CONTEXT context;
+    HANDLE thread_handle;
+    NTSTATUS status;
+
+    context = (PPROXY_TAGGED_CONTEXT)ExAllocatePoolWithTag(NonPagedPool,
+        sizeof(PROXY_TAGGED_CONTEXT), MP_TAG_GENERAL);
+
+    if (context == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(context, sizeof(PROXY_TAGGED_CONTEXT));
+
+    context->device = Device;
+    KeInitializeEvent(&context->send_lock, SynchronizationEvent, TRUE);
+    KeInitializeSpinLock(&context->pending_lock);
+    ImdTagTableInitialize(&context->pending);
+    KeInitializeEvent(&context->stop_event, NotificationEvent, FALSE);
+
+    status = PsCreateSystemThread(
+        &thread_handle,
+        (ACCESS_MASK)0L,
+        NULL,
+        NULL,
+        NULL,
+        ImScsiTaggedProxyReceiveThread,
+        context);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Cannot create receive thread. (%#x)\n", status);
+
+        ExFreePoolWithTag(context, MP_TAG_GENERAL);
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(
+        thread_handle,
+        FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&context->receive_thread,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Cannot reference receive thread. (%#x)\n", status);
+
+        KeSetEvent(&context->stop_event, (KPRIORITY)0, FALSE);
+        ZwWaitForSingleObject(thread_handle, FALSE, NULL);
+        ZwClose(thread_handle);
+
+        ExFreePoolWithTag(context, MP_TAG_GENERAL);
+        return status;
+    }
+
+    ZwClose(thread_handle);
+
+    *Context = context;
+
+    return STATUS_SUCCESS;
+}
+
+///
+/// Called when server has reported IMDPROXY_FLAG_SUPPORTS_TAGGED. Starts a
+/// thread that receives responses, after which any number of requests can
+/// be in flight on the connection. If proxy service has opened additional
+/// connections to the server, requests are spread over all of them.
+///
+NTSTATUS
+ImScsiStartTaggedProxy(__inout __deref PPROXY_CONNECTION Proxy)
+{
+    PPROXY_TAGGED_CONTEXT *link;
+    NTSTATUS status;
+
+    ASSERT(Proxy != NULL);
+
+    if ((Proxy->connection_type != PROXY_CONNECTION::PROXY_CONNECTION_DEVICE) ||
+        (Proxy->device == NULL))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (Proxy->tagged != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    status = ImScsiStartTaggedProxyStream(Proxy->device, &Proxy->tagged);
+
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    link = &Proxy->tagged->next;
+
+    for (ULONG i = 0; i < Proxy->extra_stream_count; i++)
+    {
+        status = ImScsiStartTaggedProxyStream(Proxy->extra_streams[i], link);
+
+        if (!NT_SUCCESS(status))
+        {
+            ImScsiStopTaggedProxy(Proxy);
+            return status;
+        }
+
+        link = &(*link)->next;
+    }
+
+    KdPrint((__FUNCTION__ ": Tagged requests enabled on %u connections.\n",
+        Proxy->extra_stream_count + 1));
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ImScsiStopTaggedProxy(__inout __deref PPROXY_CONNECTION Proxy)
+{
+    PPROXY_TAGGED_CONTEXT context;
+
+    for (context = Proxy->tagged; context != NULL; context = context->next)
+    {
+        KeSetEvent(&context->stop_event, (KPRIORITY)0, FALSE);
+    }
+
+    while (Proxy->tagged != NULL)
+    {
+        context = Proxy->tagged;
+
+        KeWaitForSingleObject(context->receive_thread, Executive, KernelMode,
+            FALSE, NULL);
+
+        ObDereferenceObject(context->receive_thread);
+
+        Proxy->tagged = context->next;
+
+        if (context->pending.slots != NULL)
+        {
+            ExFreePoolWithTag(context->pending.slots, MP_TAG_GENERAL);
+        }
+
+        ExFreePoolWithTag(context, MP_TAG_GENERAL);
+    }
+}
+
+///
+/// Fails all requests still waiting for a response on tagged connections or
+/// shared memory ring, by stopping their receive or completion threads.
+/// Later requests use synchronous protocol. Used when device is going away
+/// and server does not answer.
+///
+VOID
+ImScsiFailPendingProxyRequests(__inout __deref PPROXY_CONNECTION Proxy)
+{
+    if (Proxy->tagged != NULL)
+    {
+        ImScsiStopTaggedProxy(Proxy);
+    }
+
+    if (Proxy->shm_ring != NULL)
+    {
+        ImScsiStopShmRingProxy(Proxy);
+    }
+}
+
+VOID
+ImScsiFreeShmRingSlot(__inout __deref PPROXY_SHM_RING_CONTEXT Context,
+__in ULONG Slot)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    ImScsiAcquireLock(&Context->slot_lock, &lock_handle, lowest_assumed_irql);
+
+    Context->slot_busy[Slot] = FALSE;
+    Context->free_list[Context->free_count++] = Slot;
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    KeReleaseSemaphore(&Context->free_slots, (KPRIORITY)0, 1, FALSE);
+}
+
+//
+// Copies response from a slot found in completion ring and completes the
+// request that was submitted in it. Requests abandoned by cancelled callers
+// only get their slot freed. Returns error if server has broken protocol.
+//
+NTSTATUS
+ImScsiCompleteShmRingSlot(__inout __deref PPROXY_SHM_RING_CONTEXT Context,
+__in ULONG Slot)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    PPROXY_TAGGED_REQUEST request;
+    BOOLEAN busy;
+    PUCHAR slot_ptr;
+    ULONG response_data_size = 0;
+
+    if (Slot >= Context->slot_count)
+    {
+        DbgPrint(__FUNCTION__ ": Completion for invalid slot %u.\n", Slot);
+
+        return STATUS_IO_DEVICE_ERROR;
+    }
+
+    ImScsiAcquireLock(&Context->slot_lock, &lock_handle, lowest_assumed_irql);
+
+    busy = Context->slot_busy[Slot];
+    request = Context->slot_requests[Slot];
+    Context->slot_requests[Slot] = NULL;
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (!busy)
+    {
+        DbgPrint(__FUNCTION__ ": Completion for free slot %u.\n", Slot);
+
+        return STATUS_IO_DEVICE_ERROR;
+    }
+
+    if (request == NULL)
+    {
+        ImScsiFreeShmRingSlot(Context, Slot);
+        return STATUS_SUCCESS;
+    }
+
+    slot_ptr = Context->slots + Slot * Context->slot_size;
+
+    if (request->ResponseHeaderSize > 0)
+    {
+        RtlCopyMemory(request->ResponseHeader, slot_ptr,
+            request->ResponseHeaderSize);
+    }
+
+    if (request->ResponseDataSize != NULL)
+    {
+        if ((*request->ResponseDataSize > request->ResponseDataBufferSize) ||
+            (*request->ResponseDataSize > Context->slot_data_size))
+        {
+            DbgPrint(__FUNCTION__ ": Invalid response size %I64u expected at most %u.\n",
+                *request->ResponseDataSize, request->ResponseDataBufferSize);
+
+            ImScsiFreeShmRingSlot(Context, Slot);
+            ImScsiCompleteTaggedProxyRequest(request, STATUS_IO_DEVICE_ERROR, 0);
+            return STATUS_IO_DEVICE_ERROR;
+        }
+
+        response_data_size = (ULONG)*request->ResponseDataSize;
+    }
+
+    // Server has read image data into slot, ResponseData is system address
+    // of request buffer.
+    if (response_data_size > 0)
+    {
+        RtlCopyMemory(request->ResponseData, slot_ptr + IMDPROXY_HEADER_SIZE,
+            response_data_size);
+    }
+
+    ImScsiFreeShmRingSlot(Context, Slot);
+
+    ImScsiCompleteTaggedProxyRequest(request, STATUS_SUCCESS,
+        response_data_size);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ImScsiShmRingCompletionThread(__in PVOID Context)
+{
+    PPROXY_SHM_RING_CONTEXT context = (PPROXY_SHM_RING_CONTEXT)Context;
+    PIMDPROXY_SHM_RING completion = &context->header->completion;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG idle = 0;
+
+    PKEVENT wait_objects[] = {
+        context->response_event,
+        &context->stop_event
+    };
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    KdPrint((__FUNCTION__ ": Completion thread start. context=%p\n", context));
+
+    for (;;)
+    {
+        ULONG slot;
+
+        if (ImdProxyShmRingPop(completion, context->slot_count, &slot))
+        {
+            idle = 0;
+
+            status = ImScsiCompleteShmRingSlot(context, slot);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        // Poll while requests are in flight, server is probably working on
+        // them right now.
+        if ((context->free_count < context->slot_count) &&
+            (++idle < context->spin_count))
+        {
+            ImdProxyShmPause();
+            continue;
+        }
+
+        idle = 0;
+
+        if (ImdProxyShmRingPrepareSleep(completion))
+        {
+            ImdProxyShmRingFinishSleep(completion);
+            continue;
+        }
+
+        status = KeWaitForMultipleObjects(2,
+            (PVOID*)wait_objects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL,
+            NULL);
+
+        ImdProxyShmRingFinishSleep(completion);
+
+        if (status != STATUS_WAIT_0)
+        {
+            status = STATUS_CANCELLED;
+            break;
+        }
+
+        status = STATUS_SUCCESS;
+    }
+
+    // Fail everything still in flight. Slots stay busy since server could
+    // still be using them.
+    if (status == STATUS_CANCELLED)
+    {
+        status = STATUS_CONNECTION_RESET;
+    }
+
+    ImScsiAcquireLock(&context->slot_lock, &lock_handle, lowest_assumed_irql);
+
+    context->failure_status = status;
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    KeSetEvent(&context->stop_event, (KPRIORITY)0, FALSE);
+
+    for (ULONG slot = 0; slot < context->slot_count; slot++)
+    {
+        PPROXY_TAGGED_REQUEST request;
+
+        ImScsiAcquireLock(&context->slot_lock, &lock_handle,
+            lowest_assumed_irql);
+
+        request = context->slot_requests[slot];
+        context->slot_requests[slot] = NULL;
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+        if (request != NULL)
+        {
+            ImScsiCompleteTaggedProxyRequest(request, status, 0);
+        }
+    }
+
+    KdPrint((__FUNCTION__ ": Completion thread exit. status=%#x\n", status));
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+///
+/// Called when connecting to a shared memory proxy. If server has set up
+/// shared memory with a ring layout we support, starts a thread that picks
+/// up responses, after which any number of requests can be in flight on
+/// the connection. Returns STATUS_NOT_SUPPORTED for servers that only
+/// support one request at a time.
+///
+NTSTATUS
+ImScsiStartShmRingProxy(__inout __deref PPROXY_CONNECTION Proxy)
+{
+    PIMDPROXY_SHM_RING_HEADER header;
+    PPROXY_SHM_RING_CONTEXT context;
+    HANDLE thread_handle;
+    ULONG slot_count;
+    ULONG slot_data_size;
+    ULONGLONG slot_size;
+    NTSTATUS status;
+
+    ASSERT(Proxy != NULL);
+
+    if ((Proxy->connection_type != PROXY_CONNECTION::PROXY_CONNECTION_SHM) ||
+        (Proxy->shared_memory == NULL) ||
+        (Proxy->shared_memory_size < IMDPROXY_HEADER_SIZE))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (Proxy->shm_ring != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    header = (PIMDPROXY_SHM_RING_HEADER)Proxy->shared_memory;
+
+    if ((header->signature != IMDPROXY_SHM_RING_SIGNATURE) ||
+        (header->version != IMDPROXY_SHM_RING_VERSION))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    // Read once, server could change these at any time
+    slot_count = header->slot_count;
+    slot_data_size = header->slot_data_size;
+    slot_size = header->slot_size;
+
+    if ((slot_count == 0) ||
+        (slot_count > IMDPROXY_SHM_RING_MAX_SLOTS) ||
+        ((slot_count & (slot_count - 1)) != 0) ||
+        (slot_data_size == 0) ||
+        (slot_size < (ULONGLONG)IMDPROXY_HEADER_SIZE + slot_data_size) ||
+        ((slot_size & (IMDPROXY_HEADER_SIZE - 1)) != 0) ||
+        (slot_size > (Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE) /
+            slot_count))
+    {
+        DbgPrint(__FUNCTION__ ": Invalid ring layout, %u slots of %I64u bytes.\n",
+            slot_count, slot_size);
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    context = (PPROXY_SHM_RING_CONTEXT)ExAllocatePoolWithTag(NonPagedPool,
+        sizeof(PROXY_SHM_RING_CONTEXT), MP_TAG_GENERAL);
+
+    if (context == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(context, sizeof(PROXY_SHM_RING_CONTEXT));
+
+    context->header = header;
+    context->slots = Proxy->shared_memory + IMDPROXY_HEADER_SIZE;
+    context->slot_count = slot_count;
+    context->slot_data_size = slot_data_size;
+    context->slot_size = (ULONG_PTR)slot_size;
+    context->request_event = Proxy->request_event;
+    context->response_event = Proxy->response_event;
+    KeInitializeSemaphore(&context->free_slots, (LONG)slot_count,
+        (LONG)slot_count);
+    KeInitializeSpinLock(&context->slot_lock);
+    KeInitializeSpinLock(&context->submit_lock);
+    KeInitializeEvent(&context->stop_event, NotificationEvent, FALSE);
+
+    for (ULONG slot = 0; slot < slot_count; slot++)
+    {
+        context->free_list[slot] = slot_count - 1 - slot;
+    }
+
+    context->free_count = slot_count;
+
+#if _NT_TARGET_VERSION >= 0x601
+    context->spin_count =
+        KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS) > 1 ?
+        IMSCSI_SHM_RING_SPIN_COUNT : 0;
+#else
+    context->spin_count = KeQueryActiveProcessorCount(NULL) > 1 ?
+        IMSCSI_SHM_RING_SPIN_COUNT : 0;
+#endif
+
+    status = PsCreateSystemThread(
+        &thread_handle,
+        (ACCESS_MASK)0L,
+        NULL,
+        NULL,
+        NULL,
+        ImScsiShmRingCompletionThread,
+        context);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Cannot create completion thread. (%#x)\n", status);
+
+        ExFreePoolWithTag(context, MP_TAG_GENERAL);
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(
+        thread_handle,
+        FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+        *PsThreadType,
+        KernelMode,
+        (PVOID*)&context->completion_thread,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Cannot reference completion thread. (%#x)\n", status);
+
+        KeSetEvent(&context->stop_event, (KPRIORITY)0, FALSE);
+        ZwWaitForSingleObject(thread_handle, FALSE, NULL);
+        ZwClose(thread_handle);
+
+        ExFreePoolWithTag(context, MP_TAG_GENERAL);
+        return status;
+    }
+
+    ZwClose(thread_handle);
+
+    header->client_version = IMDPROXY_SHM_RING_VERSION;
+
+    Proxy->shm_ring = context;
+    Proxy->shared_memory_data_size = slot_data_size;
+
+    KdPrint((__FUNCTION__ ": Ring layout with %u slots of %u bytes.\n",
+        slot_count, slot_data_size));
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ImScsiStopShmRingProxy(__inout __deref PPROXY_CONNECTION Proxy)
+{
+    PPROXY_SHM_RING_CONTEXT context = Proxy->shm_ring;
+
+    context->header->closed = TRUE;
+
+    ImdProxyShmFullBarrier();
+
+    KeSetEvent(context->request_event, (KPRIORITY)0, FALSE);
+
+    KeSetEvent(&context->stop_event, (KPRIORITY)0, FALSE);
+
+    KeWaitForSingleObject(context->completion_thread, Executive, KernelMode,
+        FALSE, NULL);
+
+    ObDereferenceObject(context->completion_thread);
+
+    ExFreePoolWithTag(context, MP_TAG_GENERAL);
+
+    Proxy->shm_ring = NULL;
+}
+
+//
+// Submission side of ImScsiSendTaggedProxyRequest for shared memory rings.
+// Waits for a free slot if all are in flight.
+//
+NTSTATUS
+ImScsiSendShmRingRequest(__in __deref PPROXY_CONNECTION Proxy,
+__inout __deref PPROXY_TAGGED_REQUEST Request,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in __deref PVOID RequestHeader,
+__in ULONG RequestHeaderSize,
+__drv_when(RequestDataSize > 0, __in __deref) PVOID RequestData,
+__in ULONG RequestDataSize)
+{
+    PPROXY_SHM_RING_CONTEXT context = Proxy->shm_ring;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    NTSTATUS status;
+    PUCHAR slot_ptr;
+    ULONG slot = 0;
+
+    PVOID wait_objects[] = {
+        &context->free_slots,
+        &context->stop_event,
+        CancelEvent
+    };
+
+    if ((RequestHeaderSize > IMDPROXY_HEADER_SIZE) ||
+        (Request->ResponseHeaderSize > IMDPROXY_HEADER_SIZE) ||
+        (RequestDataSize > context->slot_data_size))
+    {
+        KdPrint((__FUNCTION__ ": "
+            "Parameter values not supported.\n."));
+
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    status = KeWaitForMultipleObjects(CancelEvent != NULL ? 3 : 2,
+        wait_objects,
+        WaitAny,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL,
+        NULL);
+
+    if (status == STATUS_WAIT_2)
+    {
+        KdPrint((__FUNCTION__ ": Request cancelled.\n."));
+
+        return STATUS_CANCELLED;
+    }
+
+    ImScsiAcquireLock(&context->slot_lock, &lock_handle, lowest_assumed_irql);
+
+    if (status != STATUS_WAIT_0)
+    {
+        status = STATUS_IO_DEVICE_ERROR;
+    }
+    else if (!NT_SUCCESS(context->failure_status))
+    {
+        status = STATUS_IO_DEVICE_ERROR;
+
+        // Give slot count back for other waiters to find out
+        KeReleaseSemaphore(&context->free_slots, (KPRIORITY)0, 1, FALSE);
+    }
+    else
+    {
+        slot = context->free_list[--context->free_count];
+        context->slot_busy[slot] = TRUE;
+        context->slot_requests[slot] = Request;
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
 
-    ASSERT(Proxy != NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint((__FUNCTION__ ": Connection failed earlier.\n."));
 
-    switch (Proxy->connection_type)
+        return status;
+    }
+
+    slot_ptr = context->slots + slot * context->slot_size;
+
+    // RequestData is system address of request buffer, so this is the only
+    // copy of write data before server writes it from slot to image.
+    if (RequestHeaderSize > 0)
     {
-    case PROXY_CONNECTION::PROXY_CONNECTION_DEVICE:
-        if (Proxy->device != NULL)
-            ObDereferenceObject(Proxy->device);
+        RtlCopyMemory(slot_ptr, RequestHeader, RequestHeaderSize);
+    }
 
-        Proxy->device = NULL;
-        break;
+    if (RequestDataSize > 0)
+    {
+        RtlCopyMemory(slot_ptr + IMDPROXY_HEADER_SIZE, RequestData,
+            RequestDataSize);
+    }
 
-    case PROXY_CONNECTION::PROXY_CONNECTION_SHM:
-        if ((Proxy->request_event != NULL) &&
-            (Proxy->response_event != NULL) &&
-            (Proxy->shared_memory != NULL))
+    ImScsiAcquireLock(&context->submit_lock, &lock_handle,
+        lowest_assumed_irql);
+
+    ImdProxyShmRingPush(&context->header->submission, context->slot_count,
+        slot);
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (ImdProxyShmRingNeedsWakeup(&context->header->submission))
+    {
+        KeSetEvent(context->request_event, (KPRIORITY)0, FALSE);
+    }
+
+    return STATUS_PENDING;
+}
+
+//
+// Forgets about a request that a cancelled caller is no longer waiting for.
+// Returns FALSE if it is already being completed.
+//
+BOOLEAN
+ImScsiAbandonShmRingRequest(__inout __deref PPROXY_SHM_RING_CONTEXT Context,
+__in __deref PPROXY_TAGGED_REQUEST Request)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    BOOLEAN removed = FALSE;
+
+    ImScsiAcquireLock(&Context->slot_lock, &lock_handle, lowest_assumed_irql);
+
+    for (ULONG slot = 0; slot < Context->slot_count; slot++)
+    {
+        if (Context->slot_requests[slot] == Request)
         {
-            *(ULONGLONG*)Proxy->shared_memory = IMDPROXY_REQ_CLOSE;
-            KeSetEvent(Proxy->request_event, (KPRIORITY)0, FALSE);
+            // Slot is freed when server eventually completes it
+            Context->slot_requests[slot] = NULL;
+            removed = TRUE;
+            break;
         }
+    }
 
-        if (Proxy->request_event_handle != NULL)
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    return removed;
+}
+
+///
+/// Sends a request on a tagged proxy connection. Returns STATUS_PENDING if
+/// request was sent, in which case Request is completed later from receive
+/// thread. Any other return value means that Request will not be completed.
+///
+NTSTATUS
+ImScsiSendTaggedProxyRequest(__in __deref PPROXY_CONNECTION Proxy,
+__inout __deref PPROXY_TAGGED_REQUEST Request,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in __deref PVOID RequestHeader,
+__in ULONG RequestHeaderSize,
+__drv_when(RequestDataSize > 0, __in __deref) PVOID RequestData,
+__in ULONG RequestDataSize)
+{
+    PPROXY_TAGGED_CONTEXT context = Proxy->tagged;
+    IO_STATUS_BLOCK io_status;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    NTSTATUS status;
+    BOOLEAN removed = FALSE;
+    LONG load = (LONG)(RequestDataSize + Request->ResponseDataBufferSize);
+    ULONG io_size = sizeof(IMDPROXY_TAGGED_REQ) + RequestHeaderSize +
+        RequestDataSize;
+
+    PUCHAR io_buffer;
+    PIMDPROXY_TAGGED_REQ tagged_req;
+
+    if (Proxy->shm_ring != NULL)
+    {
+        return ImScsiSendShmRingRequest(Proxy,
+            Request,
+            CancelEvent,
+            RequestHeader,
+            RequestHeaderSize,
+            RequestData,
+            RequestDataSize);
+    }
+
+    ASSERT(context != NULL);
+
+    // With several connections to server, use the one with least data in
+    // flight. Large requests split by caller are spread this way too, since
+    // each part counts on its connection as soon as it is sent. Loads are
+    // read without locks, an outdated value only makes a less good choice.
+    for (PPROXY_TAGGED_CONTEXT candidate = context->next;
+        candidate != NULL;
+        candidate = candidate->next)
+    {
+        if (NT_SUCCESS(candidate->failure_status) &&
+            (!NT_SUCCESS(context->failure_status) ||
+                (*(volatile LONG*)&candidate->load <
+                    *(volatile LONG*)&context->load)))
         {
-            ZwClose(Proxy->request_event_handle);
-            Proxy->request_event_handle = NULL;
+            context = candidate;
         }
+    }
 
-        if (Proxy->response_event_handle != NULL)
+    Request->Context = context;
+    Request->Load = load;
+
+    if (CancelEvent != NULL ?
+        KeReadStateEvent(CancelEvent) != 0 :
+        FALSE)
+    {
+        KdPrint((__FUNCTION__ ": Request cancelled.\n."));
+
+        return STATUS_CANCELLED;
+    }
+
+    io_buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, io_size,
+        MP_TAG_GENERAL);
+
+    if (io_buffer == NULL)
+    {
+        KdPrint((__FUNCTION__ ": Memory allocation failed.\n."));
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    tagged_req = (PIMDPROXY_TAGGED_REQ)io_buffer;
+    tagged_req->request_code = IMDPROXY_REQ_TAGGED;
+
+    if (RequestHeaderSize > 0)
+    {
+        RtlCopyMemory(io_buffer + sizeof(IMDPROXY_TAGGED_REQ),
+            RequestHeader, RequestHeaderSize);
+    }
+
+    if (RequestDataSize > 0)
+    {
+        RtlCopyMemory(io_buffer + sizeof(IMDPROXY_TAGGED_REQ) +
+            RequestHeaderSize, RequestData, RequestDataSize);
+    }
+
+    // Request must be in pending table before it is sent, response could
+    // arrive before send call returns.
+    ImScsiAcquireLock(&context->pending_lock, &lock_handle,
+        lowest_assumed_irql);
+
+    status = context->failure_status;
+
+    if (NT_SUCCESS(status))
+    {
+        status = ImScsiLinkTaggedProxyRequest(context, Request);
+        tagged_req->io_tag = Request->IoTag;
+    }
+    else
+    {
+        KdPrint((__FUNCTION__ ": Connection failed earlier: %#x\n.",
+            status));
+
+        status = STATUS_IO_DEVICE_ERROR;
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (!NT_SUCCESS(status))
+    {
+        ExFreePoolWithTag(io_buffer, MP_TAG_GENERAL);
+        return status;
+    }
+
+    // Each request must reach the stream in one piece, so sends are
+    // serialized and only interrupted when the whole connection goes down.
+    KeWaitForSingleObject(&context->send_lock, Executive, KernelMode, FALSE,
+        NULL);
+
+    status = ImScsiSafeIOStream(context->device,
+        IRP_MJ_WRITE,
+        &io_status,
+        &context->stop_event,
+        io_buffer,
+        io_size);
+
+    KeSetEvent(&context->send_lock, (KPRIORITY)0, FALSE);
+
+    ExFreePoolWithTag(io_buffer, MP_TAG_GENERAL);
+
+    if (NT_SUCCESS(status))
+    {
+        return STATUS_PENDING;
+    }
+
+    KdPrint((__FUNCTION__ ": Request error %#x\n.", status));
+
+    // Partially sent request leaves stream in an unknown state. Take the
+    // connection down and let receive thread fail everything pending.
+    ImScsiAcquireLock(&context->pending_lock, &lock_handle,
+        lowest_assumed_irql);
+
+    if (NT_SUCCESS(context->failure_status))
+    {
+        context->failure_status = STATUS_IO_DEVICE_ERROR;
+    }
+
+    if (Request->IoTag != 0)
+    {
+        ImScsiUnlinkTaggedProxyRequest(context, Request);
+        removed = TRUE;
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    KeSetEvent(&context->stop_event, (KPRIORITY)0, FALSE);
+
+    if (removed)
+    {
+        return STATUS_IO_DEVICE_ERROR;
+    }
+
+    // Receive thread has already taken it and will complete it
+    return STATUS_PENDING;
+}
+
+static NTSTATUS
+ImScsiCallTaggedProxy(__in __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent OPTIONAL,
+__in __deref PVOID RequestHeader,
+__in ULONG RequestHeaderSize,
+__drv_when(RequestDataSize > 0, __in __deref) PVOID RequestData,
+__in ULONG RequestDataSize,
+__drv_when(ResponseHeaderSize > 0, __out __deref) PVOID ResponseHeader,
+__in ULONG ResponseHeaderSize,
+__drv_when(ResponseDataBufferSize > 0 && *ResponseDataSize > 0, __out) __drv_when(ResponseDataBufferSize > 0, __deref) PVOID ResponseData,
+__in ULONG ResponseDataBufferSize,
+__drv_when(ResponseDataBufferSize > 0, __inout __deref) PULONGLONG ResponseDataSize)
+{
+    PROXY_TAGGED_REQUEST request = { 0 };
+    NTSTATUS status;
+
+    request.ResponseHeader = ResponseHeader;
+    request.ResponseHeaderSize = ResponseHeaderSize;
+    request.ResponseData = ResponseData;
+    request.ResponseDataBufferSize = ResponseDataBufferSize;
+    request.ResponseDataSize = ResponseDataSize;
+
+    KeInitializeEvent(&request.CompletionEvent, NotificationEvent, FALSE);
+
+    status = ImScsiSendTaggedProxyRequest(Proxy,
+        &request,
+        CancelEvent,
+        RequestHeader,
+        RequestHeaderSize,
+        RequestData,
+        RequestDataSize);
+
+    if (status != STATUS_PENDING)
+    {
+        IoStatusBlock->Status = status;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
+    }
+
+    PKEVENT wait_objects[] = {
+        &request.CompletionEvent,
+        CancelEvent
+    };
+
+    // Responses on shared memory usually arrive within microseconds, so
+    // poll a while before sleeping.
+    if (Proxy->shm_ring != NULL)
+    {
+        for (ULONG spin = 0;
+            (spin < Proxy->shm_ring->spin_count) &&
+            (KeReadStateEvent(&request.CompletionEvent) == 0);
+            spin++)
         {
-            ZwClose(Proxy->response_event_handle);
-            Proxy->response_event_handle = NULL;
+            ImdProxyShmPause();
         }
+    }
 
-        if (Proxy->request_event != NULL)
+    status = KeWaitForMultipleObjects(CancelEvent != NULL ? 2 : 1,
+        (PVOID*)wait_objects,
+        WaitAny,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL,
+        NULL);
+
+    if (status == STATUS_WAIT_1)
+    {
+        BOOLEAN removed = FALSE;
+
+        if (Proxy->shm_ring != NULL)
         {
-            ObDereferenceObject(Proxy->request_event);
-            Proxy->request_event = NULL;
+            removed = ImScsiAbandonShmRingRequest(Proxy->shm_ring, &request);
         }
-
-        if (Proxy->response_event != NULL)
+        else
         {
-            ObDereferenceObject(Proxy->response_event);
-            Proxy->response_event = NULL;
+            PPROXY_TAGGED_CONTEXT context = request.Context;
+            PPROXY_TAGGED_TOMBSTONE tombstone;
+            KLOCK_QUEUE_HANDLE lock_handle;
+            KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+            tombstone = ImScsiCreateTaggedProxyTombstone(&request);
+
+            // Still waiting for response? Then leave a tombstone in its
+            // place, so that receive thread can read the response that
+            // server will still send for this tag. Without one, that
+            // response looks like a protocol error and connection is
+            // dropped, which is only acceptable because cancel event is
+            // only set when device is going away.
+            ImScsiAcquireLock(&context->pending_lock, &lock_handle,
+                lowest_assumed_irql);
+
+            if (request.IoTag != 0)
+            {
+                if (tombstone != NULL)
+                {
+                    tombstone->request.IoTag = request.IoTag;
+                    ImdTagTableReplace(&context->pending, request.IoTag,
+                        &tombstone->request);
+                    request.IoTag = 0;
+                    tombstone = NULL;
+                }
+                else
+                {
+                    ImScsiUnlinkTaggedProxyRequest(context, &request);
+                }
+
+                removed = TRUE;
+            }
+
+            ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+            if (tombstone != NULL)
+            {
+                ExFreePoolWithTag(tombstone, MP_TAG_GENERAL);
+            }
         }
 
-        if (Proxy->shared_memory != NULL)
+        if (removed)
         {
-            ZwUnmapViewOfSection(NtCurrentProcess(), Proxy->shared_memory);
-            Proxy->shared_memory = NULL;
+            KdPrint((__FUNCTION__ ": Request cancelled.\n."));
+
+            IoStatusBlock->Status = STATUS_CANCELLED;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
         }
 
-        break;
+        // Receive thread is currently filling our buffers
+        KeWaitForSingleObject(&request.CompletionEvent, Executive,
+            KernelMode, FALSE, NULL);
+    }
+
+    if (!NT_SUCCESS(request.IoStatus.Status))
+    {
+        KdPrint((__FUNCTION__ ": Tagged request error %#x\n.",
+            request.IoStatus.Status));
+
+        IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
+        IoStatusBlock->Information = 0;
+        return IoStatusBlock->Status;
     }
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = RequestDataSize +
+        request.IoStatus.Information;
+    return IoStatusBlock->Status;
 }
 
 NTSTATUS
@@ -92,7 +1550,7 @@ __drv_when(ResponseHeaderSize > 0, __out __deref) PVOID ResponseHeader,
 __in ULONG ResponseHeaderSize,
 __drv_when(ResponseDataBufferSize > 0 && *ResponseDataSize > 0, __out) __drv_when(ResponseDataBufferSize > 0, __deref) PVOID ResponseData,
 __in ULONG ResponseDataBufferSize,
-__drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
+__drv_when(ResponseDataBufferSize > 0, __inout __deref) PULONGLONG ResponseDataSize)
 {
     NTSTATUS status;
 
@@ -102,6 +1560,22 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
     {
     case PROXY_CONNECTION::PROXY_CONNECTION_DEVICE:
     {
+        if (Proxy->tagged != NULL)
+        {
+            return ImScsiCallTaggedProxy(Proxy,
+                IoStatusBlock,
+                CancelEvent,
+                RequestHeader,
+                RequestHeaderSize,
+                RequestData,
+                RequestDataSize,
+                ResponseHeader,
+                ResponseHeaderSize,
+                ResponseData,
+                ResponseDataBufferSize,
+                ResponseDataSize);
+        }
+
         PUCHAR io_buffer = NULL;
         PUCHAR temp_buffer = NULL;
         ULONG io_size = RequestHeaderSize + RequestDataSize;
@@ -223,7 +1697,7 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
             if (*ResponseDataSize > ResponseDataBufferSize)
             {
                 KdPrint((__FUNCTION__ ": Fatal: Request %u bytes, "
-                    "receiving %u bytes.\n",
+                    "receiving %I64u bytes.\n",
                     ResponseDataBufferSize, *ResponseDataSize));
 
                 IoStatusBlock->Status = STATUS_IO_DEVICE_ERROR;
@@ -250,14 +1724,14 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
                 IoStatusBlock,
                 CancelEvent,
                 ResponseData,
-                *ResponseDataSize);
+                (ULONG)*ResponseDataSize);
 
             if (!NT_SUCCESS(status))
             {
                 KdPrint((__FUNCTION__ ": Response data error %#x\n.",
                     status));
 
-                KdPrint((__FUNCTION__ ": Response data %u bytes, "
+                KdPrint((__FUNCTION__ ": Response data %I64u bytes, "
                     "got %u bytes.\n",
                     *ResponseDataSize,
                     (ULONG)IoStatusBlock->Information));
@@ -278,7 +1752,7 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
 
         if (ResponseDataSize != NULL)
         {
-            IoStatusBlock->Information += *ResponseDataSize;
+            IoStatusBlock->Information += (ULONG_PTR)*ResponseDataSize;
         }
 
         return IoStatusBlock->Status;
@@ -286,6 +1760,22 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
 
     case PROXY_CONNECTION::PROXY_CONNECTION_SHM:
     {
+        if (Proxy->shm_ring != NULL)
+        {
+            return ImScsiCallTaggedProxy(Proxy,
+                IoStatusBlock,
+                CancelEvent,
+                RequestHeader,
+                RequestHeaderSize,
+                RequestData,
+                RequestDataSize,
+                ResponseHeader,
+                ResponseHeaderSize,
+                ResponseData,
+                ResponseDataBufferSize,
+                ResponseDataSize);
+        }
+
         PKEVENT wait_objects[] = {
             Proxy->response_event,
             CancelEvent
@@ -354,7 +1844,7 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
                 (((ULONG_PTR)*ResponseDataSize + IMDPROXY_HEADER_SIZE) >
                     Proxy->shared_memory_size))
             {
-                DbgPrint(__FUNCTION__ ": Invalid response size %u expected at most %u.\n.",
+                DbgPrint(__FUNCTION__ ": Invalid response size %I64u expected at most %u.\n.",
                     *ResponseDataSize, ResponseDataBufferSize);
 
 #if DBG
@@ -370,21 +1860,143 @@ __drv_when(ResponseDataBufferSize > 0, __inout __deref) ULONG *ResponseDataSize)
             {
                 RtlCopyMemory(ResponseData,
                     Proxy->shared_memory + IMDPROXY_HEADER_SIZE,
-                    *ResponseDataSize);
+                    (ULONG)*ResponseDataSize);
+
+                IoStatusBlock->Information = (ULONG_PTR)*ResponseDataSize;
+            }
+        }
+
+        IoStatusBlock->Status = STATUS_SUCCESS;
+        if ((RequestDataSize > 0) && (IoStatusBlock->Information == 0))
+            IoStatusBlock->Information = RequestDataSize;
+        return IoStatusBlock->Status;
+    }
+
+    default:
+        return STATUS_DRIVER_INTERNAL_ERROR;
+    }
+}
+
+//
+// Returns number of connections to server requested in a TCP connection
+// string, see IMDPROXY_STREAMS_OPTION. Proxy service checks the same way.
+//
+ULONG
+ImScsiGetProxyStreamCount(__in __deref PWSTR ConnectionString,
+__in USHORT ConnectionStringLength)
+{
+    static const WCHAR option[] = IMDPROXY_STREAMS_OPTION;
+    const ULONG option_chars = (sizeof(option) / sizeof(*option)) - 1;
+    ULONG chars = ConnectionStringLength / sizeof(*ConnectionString);
+
+    for (ULONG i = 0; i + option_chars <= chars; i++)
+    {
+        // Server side image path follows
+        if ((i + 3 <= chars) &&
+            (ConnectionString[i] == L':') &&
+            (ConnectionString[i + 1] == L'/') &&
+            (ConnectionString[i + 2] == L'/'))
+        {
+            break;
+        }
+
+        if (RtlCompareMemory(ConnectionString + i, option,
+            option_chars * sizeof(*option)) == option_chars * sizeof(*option))
+        {
+            ULONG count = 0;
+
+            for (i += option_chars;
+                (i < chars) &&
+                (ConnectionString[i] >= L'0') &&
+                (ConnectionString[i] <= L'9') &&
+                (count <= IMDPROXY_MAX_STREAMS);
+                i++)
+            {
+                count = count * 10 + (ConnectionString[i] - L'0');
+            }
+
+            if ((count == 0) || (count > IMDPROXY_MAX_STREAMS))
+            {
+                // Proxy service refuses these
+                return 1;
+            }
+
+            return count;
+        }
+    }
+
+    return 1;
+}
+
+//
+// Claims an object that proxy service has referenced through DevIoDrv,
+// after which the reference belongs to caller.
+//
+NTSTATUS
+ImScsiClaimProxyObject(__in ULONGLONG ObjectPtr)
+{
+    // First check that ObjectPtr is really something we have referenced
+    // earlier.
+
+    KEVENT event;
+    IO_STATUS_BLOCK io_status;
+    PIRP irp;
+    PFILE_OBJECT file_object;
+    PDEVICE_OBJECT dev_object;
+    UNICODE_STRING imdisk_ctl_dev_name;
+    NTSTATUS status;
+
+    RtlInitUnicodeString(&imdisk_ctl_dev_name, DEVIODRV_DEVICE_NATIVE_NAME);
+
+    status = IoGetDeviceObjectPointer(&imdisk_ctl_dev_name, 0,
+        &file_object, &dev_object);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Cannot find '%wZ': %#x. DevIoDrv driver not installed?\n",
+            &imdisk_ctl_dev_name, status);
+
+        return status;
+    }
+
+    KeInitializeEvent(&event, NotificationEvent, FALSE);
+
+    irp = IoBuildDeviceIoControlRequest(
+        IOCTL_DEVIODRV_GET_REFERENCED_HANDLE,
+        dev_object,
+        &ObjectPtr,
+        sizeof(PFILE_OBJECT),
+        NULL,
+        0,
+        TRUE,
+        &event,
+        &io_status);
 
-                IoStatusBlock->Information = *ResponseDataSize;
-            }
-        }
+    if (irp == NULL)
+    {
+        ObDereferenceObject(file_object);
 
-        IoStatusBlock->Status = STATUS_SUCCESS;
-        if ((RequestDataSize > 0) && (IoStatusBlock->Information == 0))
-            IoStatusBlock->Information = RequestDataSize;
-        return IoStatusBlock->Status;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    default:
-        return STATUS_DRIVER_INTERNAL_ERROR;
+    status = IoCallDriver(dev_object, irp);
+
+    if (status == STATUS_PENDING)
+    {
+        KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+        status = io_status.Status;
+    }
+
+    ObDereferenceObject(file_object);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Failed claiming referenced object %p: %#x "
+            "Please upgrade Arsenal Image Mounter driver components to version 1.2.18 to resolve this problem!\n",
+            (PVOID)(ULONG_PTR)ObjectPtr, status);
     }
+
+    return status;
 }
 
 ///
@@ -500,6 +2112,18 @@ __in USHORT ConnectionStringLength)
             return IoStatusBlock->Status;
         }
 
+        Proxy->shared_memory_data_size =
+            Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE;
+
+        // Not fatal, requests are then sent one at a time as before
+        status = ImScsiStartShmRingProxy(Proxy);
+
+        if (!NT_SUCCESS(status) && (status != STATUS_NOT_SUPPORTED))
+        {
+            KdPrint((__FUNCTION__ ": Cannot use ring layout (%#x).\n",
+                status));
+        }
+
         IoStatusBlock->Status = STATUS_SUCCESS;
         IoStatusBlock->Information = 0;
         return IoStatusBlock->Status;
@@ -544,68 +2168,41 @@ __in USHORT ConnectionStringLength)
     // to the server we have to change the active reference to use here.
     if (connect_resp.object_ptr != 0)
     {
-        // First check that connect_resp.object_ptr is really something we have
-        // referenced earlier.
-
-        KEVENT event;
-        IO_STATUS_BLOCK io_status;
-        PIRP irp;
-        PFILE_OBJECT file_object;
-        PDEVICE_OBJECT dev_object;
-        UNICODE_STRING imdisk_ctl_dev_name;
-
-        RtlInitUnicodeString(&imdisk_ctl_dev_name, DEVIODRV_DEVICE_NATIVE_NAME);
-
-        status = IoGetDeviceObjectPointer(&imdisk_ctl_dev_name, 0,
-            &file_object, &dev_object);
+        ULONGLONG extra_object_ptrs[IMDPROXY_MAX_STREAMS - 1] = { 0 };
+        ULONG extra_stream_count = 0;
 
-        if (!NT_SUCCESS(status))
+        if (IMSCSI_PROXY_TYPE(Flags) == IMSCSI_PROXY_TYPE_TCP)
         {
-            DbgPrint(__FUNCTION__ ": Cannot find '%wZ': %#x. DevIoDrv driver not installed?\n",
-                &imdisk_ctl_dev_name, status);
-
-            IoStatusBlock->Status = status;
-            IoStatusBlock->Information = 0;
-            return IoStatusBlock->Status;
+            extra_stream_count = ImScsiGetProxyStreamCount(ConnectionString,
+                ConnectionStringLength) - 1;
         }
 
-        KeInitializeEvent(&event, NotificationEvent, FALSE);
-
-        irp = IoBuildDeviceIoControlRequest(
-            IOCTL_DEVIODRV_GET_REFERENCED_HANDLE,
-            dev_object,
-            &connect_resp.object_ptr,
-            sizeof(PFILE_OBJECT),
-            NULL,
-            0,
-            TRUE,
-            &event,
-            &io_status);
-
-        if (irp == NULL)
+        // Proxy service sends object pointers for additional connections
+        // right after the response.
+        if (extra_stream_count > 0)
         {
-            ObDereferenceObject(file_object);
-
-            IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
-            IoStatusBlock->Information = 0;
-            return IoStatusBlock->Status;
-        }
+            status = ImScsiSafeIOStream(Proxy->device,
+                IRP_MJ_READ,
+                IoStatusBlock,
+                CancelEvent,
+                extra_object_ptrs,
+                extra_stream_count * sizeof(*extra_object_ptrs));
 
-        status = IoCallDriver(dev_object, irp);
+            if (!NT_SUCCESS(status))
+            {
+                KdPrint((__FUNCTION__ ": Error receiving additional connections: %#X.\n",
+                    status));
 
-        if (status == STATUS_PENDING)
-        {
-            KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+                IoStatusBlock->Status = status;
+                IoStatusBlock->Information = 0;
+                return IoStatusBlock->Status;
+            }
         }
 
-        ObDereferenceObject(file_object);
+        status = ImScsiClaimProxyObject(connect_resp.object_ptr);
 
         if (!NT_SUCCESS(status))
         {
-            DbgPrint(__FUNCTION__ ": Failed claiming referenced object %p: %#x "
-                "Please upgrade Arsenal Image Mounter driver components to version 1.2.18 to resolve this problem!\n",
-                (PVOID)(ULONG_PTR)connect_resp.object_ptr, status);
-
             IoStatusBlock->Status = status;
             IoStatusBlock->Information = 0;
             return IoStatusBlock->Status;
@@ -613,6 +2210,23 @@ __in USHORT ConnectionStringLength)
 
         ObDereferenceObject(Proxy->device);
         Proxy->device = (PFILE_OBJECT)(ULONG_PTR)connect_resp.object_ptr;
+
+        for (ULONG i = 0; i < extra_stream_count; i++)
+        {
+            status = ImScsiClaimProxyObject(extra_object_ptrs[i]);
+
+            if (!NT_SUCCESS(status))
+            {
+                IoStatusBlock->Status = status;
+                IoStatusBlock->Information = 0;
+                return IoStatusBlock->Status;
+            }
+
+            Proxy->extra_streams[i] =
+                (PFILE_OBJECT)(ULONG_PTR)extra_object_ptrs[i];
+
+            Proxy->extra_stream_count = i + 1;
+        }
     }
 
     KdPrint((__FUNCTION__ ": Got ok response IMDPROXY_CONNECT_RESP.\n"));
@@ -683,6 +2297,8 @@ __in ULONG ProxyInfoResponseLength)
     }
 #endif
 
+    Proxy->server_flags = ProxyInfoResponse->flags;
+
     IoStatusBlock->Status = STATUS_SUCCESS;
     IoStatusBlock->Information = 0;
     return IoStatusBlock->Status;
@@ -710,7 +2326,7 @@ __in __deref PLARGE_INTEGER ByteOffset)
     ASSERT(ByteOffset != NULL);
 
     if (Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
-        max_transfer_size = Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE;
+        max_transfer_size = Proxy->shared_memory_data_size;
     else
         max_transfer_size = Length;
 
@@ -747,7 +2363,7 @@ __in __deref PLARGE_INTEGER ByteOffset)
             sizeof(read_resp),
             (PUCHAR)Buffer + length_done,
             (ULONG)read_req.length,
-            (PULONG)&read_resp.length);
+            &read_resp.length);
 
         if (!NT_SUCCESS(status))
         {
@@ -803,7 +2419,7 @@ __in __deref PLARGE_INTEGER ByteOffset)
     ASSERT(ByteOffset != NULL);
 
     if (Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
-        max_transfer_size = Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE;
+        max_transfer_size = Proxy->shared_memory_data_size;
     else
         max_transfer_size = Length;
 
@@ -897,6 +2513,339 @@ __in __deref PLARGE_INTEGER ByteOffset)
     //return IoStatusBlock->Status;
 }
 
+//
+// Number of extents from Extents that fit in one vectored request, with
+// total data length not above MaxTransferSize.
+//
+ULONG
+ImScsiGetVectoredBatch(__in __deref PIMDPROXY_EXTENT Extents,
+__in ULONG ExtentCount,
+__in ULONG_PTR MaxTransferSize,
+__out __deref PULONG BatchLength)
+{
+    ULONG count = 0;
+    ULONGLONG length = 0;
+
+    while ((count < ExtentCount) &&
+        (count < IMDPROXY_MAX_EXTENTS) &&
+        (length + Extents[count].length <= MaxTransferSize))
+    {
+        length += Extents[count].length;
+        count++;
+    }
+
+    *BatchLength = (ULONG)length;
+
+    return count;
+}
+
+///
+/// Reads a list of extents into consecutive locations in Buffer. Extents
+/// are sent as one IMDPROXY_REQ_READV request to servers that support it,
+/// otherwise as one IMDPROXY_REQ_READ request each. Stops at first extent
+/// that could not be read completely, IoStatusBlock->Information is set to
+/// total number of bytes read.
+///
+NTSTATUS
+ImScsiReadVProxy(__in __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent,
+PVOID Buffer,
+__in __deref PIMDPROXY_EXTENT Extents,
+__in ULONG ExtentCount)
+{
+    PIMDPROXY_READV_REQ readv_req = NULL;
+    IMDPROXY_READV_RESP readv_resp = { 0 };
+    NTSTATUS status;
+    ULONG_PTR max_transfer_size;
+    ULONG length_done;
+    ULONG extents_done;
+
+    //PAGED_CODE();
+
+    ASSERT(Proxy != NULL);
+    ASSERT(IoStatusBlock != NULL);
+    ASSERT(Buffer != NULL);
+    ASSERT(Extents != NULL);
+
+    if (Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
+        max_transfer_size = Proxy->shared_memory_data_size;
+    else
+        max_transfer_size = MAXULONG;
+
+    if (Proxy->server_flags & IMDPROXY_FLAG_SUPPORTS_VECTORED)
+    {
+        readv_req = (PIMDPROXY_READV_REQ)ExAllocatePoolWithTag(NonPagedPool,
+            IMDPROXY_HEADER_SIZE, MP_TAG_GENERAL);
+
+        if (readv_req == NULL)
+        {
+            KdPrint((__FUNCTION__ ": Memory allocation failed.\n."));
+
+            IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+    }
+
+    length_done = 0;
+    extents_done = 0;
+    status = STATUS_SUCCESS;
+
+    while (extents_done < ExtentCount)
+    {
+        ULONG batch_length = 0;
+        ULONG batch_count = 0;
+
+        if (readv_req != NULL)
+        {
+            batch_count = ImScsiGetVectoredBatch(Extents + extents_done,
+                ExtentCount - extents_done, max_transfer_size, &batch_length);
+        }
+
+        // No vectored support, or a single extent larger than transfer
+        // area, which ImScsiReadProxy splits up.
+        if (batch_count == 0)
+        {
+            LARGE_INTEGER offset;
+            ULONG length = (ULONG)Extents[extents_done].length;
+
+            offset.QuadPart = Extents[extents_done].offset;
+
+            status = ImScsiReadProxy(Proxy,
+                IoStatusBlock,
+                CancelEvent,
+                (PUCHAR)Buffer + length_done,
+                length,
+                &offset);
+
+            length_done += (ULONG)IoStatusBlock->Information;
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            extents_done++;
+
+            if (IoStatusBlock->Information < length)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        KdPrint2((__FUNCTION__ ": "
+            "IMDPROXY_REQ_READV %u extents, 0x%.8x bytes.\n",
+            batch_count, batch_length));
+
+        readv_req->request_code = IMDPROXY_REQ_READV;
+        readv_req->extent_count = batch_count;
+
+        RtlCopyMemory(readv_req + 1,
+            Extents + extents_done,
+            batch_count * sizeof(IMDPROXY_EXTENT));
+
+        status = ImScsiCallProxy(Proxy,
+            IoStatusBlock,
+            CancelEvent,
+            readv_req,
+            sizeof(IMDPROXY_READV_REQ) +
+            batch_count * sizeof(IMDPROXY_EXTENT),
+            NULL,
+            0,
+            &readv_resp,
+            sizeof(readv_resp),
+            (PUCHAR)Buffer + length_done,
+            batch_length,
+            &readv_resp.length);
+
+        if (!NT_SUCCESS(status))
+        {
+            status = STATUS_IO_DEVICE_ERROR;
+            break;
+        }
+
+        length_done += (ULONG)readv_resp.length;
+
+        if (readv_resp.errorno != 0)
+        {
+            KdPrint((__FUNCTION__ ": Server returned error %#I64x.\n",
+                readv_resp.errorno));
+
+            status = STATUS_IO_DEVICE_ERROR;
+            break;
+        }
+
+        extents_done += batch_count;
+
+        if (readv_resp.length < batch_length)
+        {
+            break;
+        }
+    }
+
+    if (readv_req != NULL)
+    {
+        ExFreePoolWithTag(readv_req, MP_TAG_GENERAL);
+    }
+
+    IoStatusBlock->Status = status;
+    IoStatusBlock->Information = length_done;
+    return IoStatusBlock->Status;
+}
+
+///
+/// Writes data from consecutive locations in Buffer to a list of extents,
+/// as IMDPROXY_REQ_WRITEV requests to servers that support it.
+///
+NTSTATUS
+ImScsiWriteVProxy(__in __deref PPROXY_CONNECTION Proxy,
+__out __deref PIO_STATUS_BLOCK IoStatusBlock,
+__in __deref PKEVENT CancelEvent,
+PVOID Buffer,
+__in __deref PIMDPROXY_EXTENT Extents,
+__in ULONG ExtentCount)
+{
+    PIMDPROXY_WRITEV_REQ writev_req = NULL;
+    IMDPROXY_WRITEV_RESP writev_resp = { 0 };
+    NTSTATUS status;
+    ULONG_PTR max_transfer_size;
+    ULONG length_done;
+    ULONG extents_done;
+
+    //PAGED_CODE();
+
+    ASSERT(Proxy != NULL);
+    ASSERT(IoStatusBlock != NULL);
+    ASSERT(Buffer != NULL);
+    ASSERT(Extents != NULL);
+
+    if (Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
+        max_transfer_size = Proxy->shared_memory_data_size;
+    else
+        max_transfer_size = MAXULONG;
+
+    if (Proxy->server_flags & IMDPROXY_FLAG_SUPPORTS_VECTORED)
+    {
+        writev_req = (PIMDPROXY_WRITEV_REQ)ExAllocatePoolWithTag(NonPagedPool,
+            IMDPROXY_HEADER_SIZE, MP_TAG_GENERAL);
+
+        if (writev_req == NULL)
+        {
+            KdPrint((__FUNCTION__ ": Memory allocation failed.\n."));
+
+            IoStatusBlock->Status = STATUS_INSUFFICIENT_RESOURCES;
+            IoStatusBlock->Information = 0;
+            return IoStatusBlock->Status;
+        }
+    }
+
+    length_done = 0;
+    extents_done = 0;
+    status = STATUS_SUCCESS;
+
+    while (extents_done < ExtentCount)
+    {
+        ULONG batch_length = 0;
+        ULONG batch_count = 0;
+
+        if (writev_req != NULL)
+        {
+            batch_count = ImScsiGetVectoredBatch(Extents + extents_done,
+                ExtentCount - extents_done, max_transfer_size, &batch_length);
+        }
+
+        if (batch_count == 0)
+        {
+            LARGE_INTEGER offset;
+
+            offset.QuadPart = Extents[extents_done].offset;
+
+            status = ImScsiWriteProxy(Proxy,
+                IoStatusBlock,
+                CancelEvent,
+                (PUCHAR)Buffer + length_done,
+                (ULONG)Extents[extents_done].length,
+                &offset);
+
+            length_done += (ULONG)IoStatusBlock->Information;
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+
+            extents_done++;
+            continue;
+        }
+
+        KdPrint2((__FUNCTION__ ": "
+            "IMDPROXY_REQ_WRITEV %u extents, 0x%.8x bytes.\n",
+            batch_count, batch_length));
+
+        writev_req->request_code = IMDPROXY_REQ_WRITEV;
+        writev_req->extent_count = batch_count;
+
+        RtlCopyMemory(writev_req + 1,
+            Extents + extents_done,
+            batch_count * sizeof(IMDPROXY_EXTENT));
+
+        status = ImScsiCallProxy(Proxy,
+            IoStatusBlock,
+            CancelEvent,
+            writev_req,
+            sizeof(IMDPROXY_WRITEV_REQ) +
+            batch_count * sizeof(IMDPROXY_EXTENT),
+            (PUCHAR)Buffer + length_done,
+            batch_length,
+            &writev_resp,
+            sizeof(writev_resp),
+            NULL,
+            0,
+            NULL);
+
+        if (!NT_SUCCESS(status))
+        {
+            status = STATUS_IO_DEVICE_ERROR;
+            break;
+        }
+
+        if (writev_resp.errorno != 0)
+        {
+            KdPrint((__FUNCTION__ ": Server returned error 0x%I64x.\n",
+                writev_resp.errorno));
+
+            status = STATUS_IO_DEVICE_ERROR;
+            break;
+        }
+
+        if (writev_resp.length != batch_length)
+        {
+            KdPrint((__FUNCTION__ ": IMDPROXY_REQ_WRITEV %u bytes, "
+                "IMDPROXY_RESP_WRITEV %u bytes.\n",
+                batch_length,
+                (ULONG)writev_resp.length));
+
+            status = STATUS_IO_DEVICE_ERROR;
+            break;
+        }
+
+        length_done += batch_length;
+        extents_done += batch_count;
+    }
+
+    if (writev_req != NULL)
+    {
+        ExFreePoolWithTag(writev_req, MP_TAG_GENERAL);
+    }
+
+    IoStatusBlock->Status = status;
+    IoStatusBlock->Information = length_done;
+    return IoStatusBlock->Status;
+}
+
 NTSTATUS
 ImScsiUnmapOrZeroProxy(
     __in __deref PPROXY_CONNECTION Proxy,
@@ -916,7 +2865,7 @@ ImScsiUnmapOrZeroProxy(
     ASSERT(Ranges != NULL);
 
     if ((Proxy->connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM) &&
-        (byte_size >= (Proxy->shared_memory_size - IMDPROXY_HEADER_SIZE)))
+        (byte_size >= Proxy->shared_memory_data_size))
     {
         status = STATUS_BUFFER_OVERFLOW;
         IoStatusBlock->Information = 0;
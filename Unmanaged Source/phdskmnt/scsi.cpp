@@ -1290,7 +1290,7 @@ ScsiOpVPDDiskUnit(
                     pLUExt->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
                 {
                     ULONG_PTR max_dsrs =
-                        (pLUExt->Proxy.shared_memory_size - sizeof(IMDPROXY_HEADER_SIZE)) /
+                        pLUExt->Proxy.shared_memory_data_size /
                         sizeof(DEVICE_DATA_SET_RANGE);
 
                     maxLbaCountPerCmd =
@@ -1655,7 +1655,6 @@ __in PKIRQL               LowestAssumedIrql
     LONGLONG                     startingOffset;
     ULONG                        numBlocks;
     pMP_WorkRtnParms             pWkRtnParms;
-    KLOCK_QUEUE_HANDLE           lock_handle = { 0 };
 
     KdPrint2((__FUNCTION__ ": pHBAExt = 0x%p, pLUExt=0x%p, pSrb=0x%p\n", pHBAExt, pLUExt, pSrb));
 
@@ -1736,52 +1735,39 @@ __in PKIRQL               LowestAssumedIrql
     }
 
     // Intermediate non-paged cache
-    if ((pLUExt->FileObject == NULL) &&
-        (pLUExt->LastIoLength > 0) &&
-        !pLUExt->SharedImage)
+    if ((pLUExt->ReadCache.set_count != 0) &&
+        ((pSrb->Cdb[0] == SCSIOP_READ) ||
+        (pSrb->Cdb[0] == SCSIOP_READ16)))
     {
-        ImScsiAcquireLock(&pLUExt->LastIoLock, &lock_handle, *LowestAssumedIrql);
+        PVOID sysaddress = NULL;
+        ULONG storage_status;
+        LONGLONG start_time = ImScsiGetTimestamp();
 
-        if (((pSrb->Cdb[0] == SCSIOP_READ) ||
-            (pSrb->Cdb[0] == SCSIOP_READ16)) &&
-            (pLUExt->LastIoBuffer != NULL) &&
-            (pLUExt->LastIoStartSector <= startingSector) &&
-            ((startingOffset - (pLUExt->LastIoStartSector << pLUExt->BlockPower) + pSrb->DataTransferLength) <= pLUExt->LastIoLength))
+        storage_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
+        if ((storage_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
         {
-            PVOID sysaddress = NULL;
-            ULONG storage_status;
+            DbgPrint(__FUNCTION__ ": StorPortGetSystemAddress failed: status=0x%X address=0x%p translated=0x%p\n",
+                storage_status,
+                pSrb->DataBuffer,
+                sysaddress);
 
-            storage_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
-            if ((storage_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
-            {
-                ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
-
-                DbgPrint(__FUNCTION__ ": StorPortGetSystemAddress failed: status=0x%X address=0x%p translated=0x%p\n",
-                    storage_status,
-                    pSrb->DataBuffer,
-                    sysaddress);
+            ScsiSetCheckCondition(pSrb, SRB_STATUS_ERROR, SCSI_SENSE_HARDWARE_ERROR, SCSI_ADSENSE_NO_SENSE, 0);
 
-                ScsiSetCheckCondition(pSrb, SRB_STATUS_ERROR, SCSI_SENSE_HARDWARE_ERROR, SCSI_ADSENSE_NO_SENSE, 0);
-            }
-            else
-            {
-                KdPrint((__FUNCTION__ ": Intermediate cache hit.\n"));
+            return;
+        }
 
-                RtlMoveMemory(
-                    sysaddress,
-                    (PUCHAR)pLUExt->LastIoBuffer + startingOffset - (pLUExt->LastIoStartSector << pLUExt->BlockPower),
-                    pSrb->DataTransferLength
-                    );
+        if (ImScsiReadCacheRead(pLUExt, startingOffset,
+            pSrb->DataTransferLength, sysaddress, FALSE, LowestAssumedIrql))
+        {
+            KdPrint2((__FUNCTION__ ": Intermediate cache hit.\n"));
 
-                ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+            ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
 
-                ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
-            }
+            ImScsiStatsRequestDone(pLUExt, pSrb, start_time, 0, FALSE,
+                LowestAssumedIrql);
 
             return;
         }
-
-        ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
     }
 
     pWkRtnParms = ImScsiCreateWorkItem(pHBAExt, pLUExt, pSrb);
@@ -75,7 +75,11 @@ __inout __deref PKIRQL      LowestAssumedIrql
             FIELD_OFFSET(SRB_IMSCSI_CREATE_DATA, Fields.FileName))
             || (srb_buffer->Fields.FileNameLength +
             (ULONG)FIELD_OFFSET(SRB_IMSCSI_CREATE_DATA, Fields.FileName) >
-            pSrb->DataTransferLength))
+            pSrb->DataTransferLength)
+            || (IMSCSI_QOS_LIMITS(srb_buffer->Fields.Flags) &&
+            (FIELD_OFFSET(SRB_IMSCSI_CREATE_DATA, Fields) +
+            IMSCSI_QOS_LIMITS_OFFSET(&srb_buffer->Fields) +
+            sizeof(IMSCSI_DEVICE_QOS_LIMITS) > pSrb->DataTransferLength)))
         {
             KdPrint((__FUNCTION__ ": Bad SMP_IMSCSI_CREATE_DEVICE request.\n"));
 
@@ -217,6 +221,132 @@ __inout __deref PKIRQL      LowestAssumedIrql
         break;
     }
 
+    case SMP_IMSCSI_QUERY_READ_CACHE:
+    {
+        PSRB_IMSCSI_READ_CACHE srb_buffer = (PSRB_IMSCSI_READ_CACHE)pSrb->DataBuffer;
+
+        KdPrint2((__FUNCTION__ ": Request SMP_IMSCSI_QUERY_READ_CACHE.\n"));
+
+        if (!SRB_IO_CONTROL_SIZE_OK(srb_buffer))
+        {
+            KdPrint((__FUNCTION__ ": Bad SMP_IMSCSI_QUERY_READ_CACHE request.\n"));
+
+            ScsiSetError(pSrb, SRB_STATUS_DATA_OVERRUN);
+            goto Done;
+        }
+
+        srb_io_control->ReturnCode = ImScsiQueryReadCache(pHBAExt, srb_buffer, LowestAssumedIrql);
+
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+        break;
+    }
+
+    case SMP_IMSCSI_SET_READ_CACHE:
+    {
+        PSRB_IMSCSI_READ_CACHE srb_buffer = (PSRB_IMSCSI_READ_CACHE)pSrb->DataBuffer;
+
+        KdPrint2((__FUNCTION__ ": Request SMP_IMSCSI_SET_READ_CACHE.\n"));
+
+        if (!SRB_IO_CONTROL_SIZE_OK(srb_buffer))
+        {
+            KdPrint((__FUNCTION__ ": Bad SMP_IMSCSI_SET_READ_CACHE request.\n"));
+
+            ScsiSetError(pSrb, SRB_STATUS_DATA_OVERRUN);
+            goto Done;
+        }
+
+        srb_io_control->ReturnCode = ImScsiSetReadCache(pHBAExt, srb_buffer, LowestAssumedIrql);
+
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+        break;
+    }
+
+    case SMP_IMSCSI_QUERY_QOS:
+    {
+        PSRB_IMSCSI_QOS srb_buffer = (PSRB_IMSCSI_QOS)pSrb->DataBuffer;
+
+        KdPrint2((__FUNCTION__ ": Request SMP_IMSCSI_QUERY_QOS.\n"));
+
+        if (!SRB_IO_CONTROL_SIZE_OK(srb_buffer))
+        {
+            KdPrint((__FUNCTION__ ": Bad SMP_IMSCSI_QUERY_QOS request.\n"));
+
+            ScsiSetError(pSrb, SRB_STATUS_DATA_OVERRUN);
+            goto Done;
+        }
+
+        srb_io_control->ReturnCode = ImScsiQueryQos(pHBAExt, srb_buffer, LowestAssumedIrql);
+
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+        break;
+    }
+
+    case SMP_IMSCSI_QUERY_STATISTICS:
+    {
+        PSRB_IMSCSI_STATISTICS srb_buffer = (PSRB_IMSCSI_STATISTICS)pSrb->DataBuffer;
+
+        KdPrint2((__FUNCTION__ ": Request SMP_IMSCSI_QUERY_STATISTICS.\n"));
+
+        if (!SRB_IO_CONTROL_SIZE_OK(srb_buffer))
+        {
+            KdPrint((__FUNCTION__ ": Bad SMP_IMSCSI_QUERY_STATISTICS request.\n"));
+
+            ScsiSetError(pSrb, SRB_STATUS_DATA_OVERRUN);
+            goto Done;
+        }
+
+        srb_io_control->ReturnCode = ImScsiQueryStatistics(pHBAExt, srb_buffer, LowestAssumedIrql);
+
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+        break;
+    }
+
+    case SMP_IMSCSI_QUERY_TRACE:
+    {
+        PSRB_IMSCSI_TRACE srb_buffer = (PSRB_IMSCSI_TRACE)pSrb->DataBuffer;
+
+        KdPrint2((__FUNCTION__ ": Request SMP_IMSCSI_QUERY_TRACE.\n"));
+
+        if (!SRB_IO_CONTROL_SIZE_OK(srb_buffer))
+        {
+            KdPrint((__FUNCTION__ ": Bad SMP_IMSCSI_QUERY_TRACE request.\n"));
+
+            ScsiSetError(pSrb, SRB_STATUS_DATA_OVERRUN);
+            goto Done;
+        }
+
+        srb_io_control->ReturnCode = ImScsiQueryTrace(srb_buffer);
+
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+        break;
+    }
+
+    case SMP_IMSCSI_SET_QOS:
+    {
+        PSRB_IMSCSI_QOS srb_buffer = (PSRB_IMSCSI_QOS)pSrb->DataBuffer;
+
+        KdPrint2((__FUNCTION__ ": Request SMP_IMSCSI_SET_QOS.\n"));
+
+        if (!SRB_IO_CONTROL_SIZE_OK(srb_buffer))
+        {
+            KdPrint((__FUNCTION__ ": Bad SMP_IMSCSI_SET_QOS request.\n"));
+
+            ScsiSetError(pSrb, SRB_STATUS_DATA_OVERRUN);
+            goto Done;
+        }
+
+        srb_io_control->ReturnCode = ImScsiSetQos(pHBAExt, srb_buffer, LowestAssumedIrql);
+
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+        break;
+    }
+
     default:
 
         DbgPrint(__FUNCTION__ ": Unknown IOControl code=0x%X\n", srb_io_control->ControlCode);
@@ -376,6 +506,9 @@ __inout __deref PKIRQL              LowestAssumedIrql
 {
     pHW_LU_EXTENSION        device_extension = NULL;
     UCHAR                   srb_status;
+    IMSCSI_DEVICE_QOS_LIMITS qos_limits = { 0 };
+    KLOCK_QUEUE_HANDLE      lock_handle;
+    ULONG                   max_length = *Length;
 
     KdPrint((__FUNCTION__ ": Device %i:%i:%i.\n",
         (int)create_data->Fields.DeviceNumber.PathId,
@@ -461,6 +594,9 @@ __inout __deref PKIRQL              LowestAssumedIrql
     if (device_extension->WriteOverlay != NULL)
         create_data->Fields.Flags |= IMSCSI_OPTION_WRITE_OVERLAY;
 
+    create_data->Fields.Flags |=
+        ImScsiGetQosPriorityFlags(device_extension->Qos.priority_class);
+
     create_data->Fields.ImageOffset = device_extension->ImageOffset;
 
     create_data->Fields.FileNameLength = device_extension->ObjectName.Length;
@@ -479,23 +615,32 @@ __inout __deref PKIRQL              LowestAssumedIrql
             device_extension->WriteOverlayFileName.Buffer,
             device_extension->WriteOverlayFileName.Length);
 
+    ImScsiAcquireLock(&device_extension->QosLock, &lock_handle, *LowestAssumedIrql);
+
+    qos_limits.MaxIops = (ULONG)device_extension->Qos.requests.rate;
+    qos_limits.MaxBytesPerSecond = device_extension->Qos.bytes.rate;
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
     /// Copy handle to write overlay if enough size for that
     if (device_extension->WriteOverlay != NULL &&
-        *Length >= FIELD_OFFSET(SRB_IMSCSI_CREATE_DATA, Fields.FileName) +
+        max_length >= FIELD_OFFSET(SRB_IMSCSI_CREATE_DATA, Fields.FileName) +
         create_data->Fields.FileNameLength +
         create_data->Fields.WriteOverlayFileNameLength +
-        sizeof(HANDLE))
+        sizeof(ULONGLONG))
     {
-        PHANDLE handle = (PHANDLE)(((PUCHAR)create_data->Fields.FileName) +
+        PUCHAR handle = ((PUCHAR)create_data->Fields.FileName) +
             create_data->Fields.FileNameLength +
-            create_data->Fields.WriteOverlayFileNameLength);
+            create_data->Fields.WriteOverlayFileNameLength;
 
-        *handle = device_extension->WriteOverlay;
+        // Slot is 8 bytes on all platforms, see IMSCSI_QOS_LIMITS_OFFSET
+        RtlZeroMemory(handle, sizeof(ULONGLONG));
+        *(PHANDLE)handle = device_extension->WriteOverlay;
 
         *Length = FIELD_OFFSET(SRB_IMSCSI_CREATE_DATA, Fields.FileName) +
             create_data->Fields.FileNameLength +
             create_data->Fields.WriteOverlayFileNameLength +
-            sizeof(HANDLE);
+            sizeof(ULONGLONG);
     }
     else
     {
@@ -504,6 +649,23 @@ __inout __deref PKIRQL              LowestAssumedIrql
             create_data->Fields.WriteOverlayFileNameLength;
     }
 
+    /// Copy QoS limits if enough size for them, so that they are kept when
+    /// device is created again from this configuration. They go where
+    /// IMSCSI_QOS_LIMITS_OFFSET expects them, which is where returned data
+    /// ends unless handle to write overlay did not fit.
+    if ((qos_limits.MaxIops != 0 || qos_limits.MaxBytesPerSecond != 0) &&
+        (*Length == FIELD_OFFSET(SRB_IMSCSI_CREATE_DATA, Fields) +
+        IMSCSI_QOS_LIMITS_OFFSET(&create_data->Fields)) &&
+        (max_length >= *Length + sizeof(qos_limits)))
+    {
+        create_data->Fields.Flags |= IMSCSI_OPTION_QOS_LIMITS;
+
+        RtlCopyMemory((PUCHAR)create_data + *Length, &qos_limits,
+            sizeof(qos_limits));
+
+        *Length += sizeof(qos_limits);
+    }
+
     KdPrint((__FUNCTION__ ": End.\n"));
     return STATUS_SUCCESS;
 }
@@ -601,6 +763,14 @@ __inout __deref PKIRQL                          LowestAssumedIrql
         device_flags->FlagsToChange &= ~IMSCSI_IMAGE_MODIFIED;
     }
 
+    if (IMSCSI_PRIORITY(device_flags->FlagsToChange))
+    {
+        device_extension->Qos.priority_class =
+            ImScsiGetQosClass(device_flags->FlagValues);
+
+        device_flags->FlagsToChange &= ~IMSCSI_PRIORITY_MASK;
+    }
+
     if (KeGetCurrentIrql() == PASSIVE_LEVEL)
     {
         if (IMSCSI_SPARSE_FILE(device_flags->FlagsToChange) &&
@@ -776,3 +946,255 @@ Done:
     return status;
 }
 
+NTSTATUS
+ImScsiQueryReadCache(
+__in            pHW_HBA_EXT                 pHBAExt,
+__inout __deref PSRB_IMSCSI_READ_CACHE      read_cache_data,
+__inout __deref PKIRQL                      LowestAssumedIrql
+)
+{
+    UCHAR status;
+    pHW_LU_EXTENSION device_extension;
+    PIMSCSI_READ_CACHE_INFO info = &read_cache_data->Info;
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    status = ScsiGetLUExtension(
+        pHBAExt,
+        &device_extension,
+        read_cache_data->DeviceNumber.PathId,
+        read_cache_data->DeviceNumber.TargetId,
+        read_cache_data->DeviceNumber.Lun,
+        LowestAssumedIrql
+        );
+
+    if ((status != SRB_STATUS_SUCCESS) || (device_extension == NULL))
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    RtlZeroMemory(info, sizeof(*info));
+
+    ImScsiAcquireLock(&device_extension->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    info->MaxReadAheadSize = device_extension->MaxReadAheadSize;
+    info->CacheSize = (ULONG)min((ULONGLONG)device_extension->ReadCache.set_count *
+        IMSCSI_CACHE_WAYS * IMSCSI_CACHE_LINE_SIZE, MAXULONG);
+    info->CacheHits = device_extension->ReadCache.hits;
+    info->CacheMisses = device_extension->ReadCache.misses;
+    info->ReadAheadRequests = device_extension->ReadAheadRequests;
+    info->ReadAheadBytes = device_extension->ReadAheadBytes;
+    info->ReadAheadWastedBytes = device_extension->ReadAheadWastedBytes;
+
+    for (ULONG i = 0; i < IMSCSI_READ_AHEAD_STREAMS; i++)
+    {
+        if (device_extension->ReadAheadStreams[i].Window != 0)
+        {
+            info->SequentialStreams++;
+            info->ReadAheadWindow += device_extension->ReadAheadStreams[i].Window;
+        }
+    }
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ImScsiSetReadCache(
+__in            pHW_HBA_EXT                 pHBAExt,
+__in __deref    PSRB_IMSCSI_READ_CACHE      read_cache_data,
+__inout __deref PKIRQL                      LowestAssumedIrql
+)
+{
+    UCHAR status;
+    pHW_LU_EXTENSION device_extension;
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    status = ScsiGetLUExtension(
+        pHBAExt,
+        &device_extension,
+        read_cache_data->DeviceNumber.PathId,
+        read_cache_data->DeviceNumber.TargetId,
+        read_cache_data->DeviceNumber.Lun,
+        LowestAssumedIrql
+        );
+
+    if ((status != SRB_STATUS_SUCCESS) || (device_extension == NULL))
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    if (device_extension->ReadCache.set_count == 0)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    ImScsiAcquireLock(&device_extension->ReadCacheLock, &lock_handle, *LowestAssumedIrql);
+
+    device_extension->MaxReadAheadSize = read_cache_data->Info.MaxReadAheadSize;
+
+    // Windows adapt to new limit from scratch
+    RtlZeroMemory(device_extension->ReadAheadStreams,
+        sizeof(device_extension->ReadAheadStreams));
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ImScsiQueryQos(
+__in            pHW_HBA_EXT                 pHBAExt,
+__inout __deref PSRB_IMSCSI_QOS             qos_data,
+__inout __deref PKIRQL                      LowestAssumedIrql
+)
+{
+    UCHAR status;
+    pHW_LU_EXTENSION device_extension;
+    PIMSCSI_QOS_INFO info = &qos_data->Info;
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    status = ScsiGetLUExtension(
+        pHBAExt,
+        &device_extension,
+        qos_data->DeviceNumber.PathId,
+        qos_data->DeviceNumber.TargetId,
+        qos_data->DeviceNumber.Lun,
+        LowestAssumedIrql
+        );
+
+    if ((status != SRB_STATUS_SUCCESS) || (device_extension == NULL))
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    RtlZeroMemory(info, sizeof(*info));
+
+    ImScsiAcquireLock(&device_extension->QosLock, &lock_handle, *LowestAssumedIrql);
+
+    info->MaxIops = (ULONG)device_extension->Qos.requests.rate;
+    info->Priority = ImScsiGetQosPriorityFlags(device_extension->Qos.priority_class);
+    info->MaxBytesPerSecond = device_extension->Qos.bytes.rate;
+    info->DelayedRequests = device_extension->Qos.delayed;
+    info->DelayTime = device_extension->Qos.delay_ticks;
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ImScsiSetQos(
+__in            pHW_HBA_EXT                 pHBAExt,
+__in __deref    PSRB_IMSCSI_QOS             qos_data,
+__inout __deref PKIRQL                      LowestAssumedIrql
+)
+{
+    UCHAR status;
+    pHW_LU_EXTENSION device_extension;
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    status = ScsiGetLUExtension(
+        pHBAExt,
+        &device_extension,
+        qos_data->DeviceNumber.PathId,
+        qos_data->DeviceNumber.TargetId,
+        qos_data->DeviceNumber.Lun,
+        LowestAssumedIrql
+        );
+
+    if ((status != SRB_STATUS_SUCCESS) || (device_extension == NULL))
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    if (IMSCSI_PRIORITY(qos_data->Info.Priority) != qos_data->Info.Priority)
+        return STATUS_INVALID_PARAMETER;
+
+    ImScsiAcquireLock(&device_extension->QosLock, &lock_handle, *LowestAssumedIrql);
+
+    // Buckets start out full with new limits
+    ImScsiQosSetLimits(&device_extension->Qos,
+        qos_data->Info.MaxIops,
+        qos_data->Info.MaxBytesPerSecond,
+        KeQueryInterruptTime());
+
+    device_extension->Qos.priority_class =
+        ImScsiGetQosClass(qos_data->Info.Priority);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return STATUS_SUCCESS;
+}
+
+// Histograms are copied as they are from IMSCSI_STATS
+C_ASSERT(IMSCSI_LATENCY_BUCKETS == IMSCSI_STATS_LATENCY_BUCKETS);
+
+NTSTATUS
+ImScsiQueryStatistics(
+__in            pHW_HBA_EXT                 pHBAExt,
+__inout __deref PSRB_IMSCSI_STATISTICS      stats_data,
+__inout __deref PKIRQL                      LowestAssumedIrql
+)
+{
+    UCHAR status;
+    pHW_LU_EXTENSION device_extension;
+    PIMSCSI_DEVICE_STATISTICS info = &stats_data->Info;
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    status = ScsiGetLUExtension(
+        pHBAExt,
+        &device_extension,
+        stats_data->DeviceNumber.PathId,
+        stats_data->DeviceNumber.TargetId,
+        stats_data->DeviceNumber.Lun,
+        LowestAssumedIrql
+        );
+
+    if ((status != SRB_STATUS_SUCCESS) || (device_extension == NULL))
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    RtlZeroMemory(info, sizeof(*info));
+
+    ImScsiAcquireLock(&device_extension->StatsLock, &lock_handle, *LowestAssumedIrql);
+
+    info->ReadRequests = device_extension->Stats.requests[IMSCSI_STATS_READ];
+    info->WriteRequests = device_extension->Stats.requests[IMSCSI_STATS_WRITE];
+    info->UnmapRequests = device_extension->Stats.requests[IMSCSI_STATS_UNMAP];
+    info->OtherRequests = device_extension->Stats.requests[IMSCSI_STATS_OTHER];
+    info->BytesRead = device_extension->Stats.bytes[IMSCSI_STATS_READ];
+    info->BytesWritten = device_extension->Stats.bytes[IMSCSI_STATS_WRITE];
+    info->Errors = device_extension->Stats.errors;
+    info->QueueDepth = device_extension->Stats.queue_depth;
+    info->MaxQueueDepth = device_extension->Stats.max_queue_depth;
+
+    RtlCopyMemory(info->BackendLatency, device_extension->Stats.backend_latency,
+        sizeof(info->BackendLatency));
+    RtlCopyMemory(info->TotalLatency, device_extension->Stats.total_latency,
+        sizeof(info->TotalLatency));
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+ImScsiQueryTrace(
+__inout __deref PSRB_IMSCSI_TRACE           trace_data
+)
+{
+    PIMSCSI_TRACE_QUERY info = &trace_data->Info;
+    PIMSCSI_TRACE_RING rings = pMPDrvInfoGlobal->TraceRings;
+    ULONG room = (trace_data->SrbIoControl.Length -
+        (sizeof(SRB_IMSCSI_TRACE) - sizeof(SRB_IO_CONTROL))) /
+        sizeof(IMSCSI_TRACE_RECORD);
+
+    info->ProcessorCount = pMPDrvInfoGlobal->TraceRingCount;
+    info->Frequency = pMPDrvInfoGlobal->PerformanceFrequency;
+    info->RecordCount = 0;
+
+    if (rings == NULL)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (info->Processor >= info->ProcessorCount)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    info->RecordCount = ImScsiTraceRead(&rings[info->Processor],
+        &info->Position, (PIMSCSI_TRACE_RECORD)(trace_data + 1), room);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,285 @@
+/// ahead_test.cpp
+/// Tests for read-ahead stream tracking in imscsiahead.h, alone and driven
+/// together with the read cache in imscsicache.h the way LU worker threads
+/// do, with sequential, interleaved and random readers.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsiahead.h>
+
+#include <vector>
+
+#define AHEAD_TEST_DISK_SIZE    (1LL << 32)
+#define AHEAD_TEST_MAX_WINDOW   (2UL << 20)
+
+static void
+TestMaxWindow()
+{
+    // Limited by setting
+    IMTEST_CHECK(ImScsiAheadMaxWindow(1ULL << 30, 1UL << 20) == 1UL << 20);
+
+    // Limited to a share of half the cache, whole lines
+    IMTEST_CHECK(ImScsiAheadMaxWindow(4ULL << 20, 8UL << 20) ==
+        (4UL << 20) / (2 * IMSCSI_READ_AHEAD_STREAMS));
+    IMTEST_CHECK((ImScsiAheadMaxWindow(1000000, 8UL << 20) &
+        (IMSCSI_CACHE_LINE_SIZE - 1)) == 0);
+
+    // Cache too small for read-ahead, nothing is tracked
+    IMSCSI_READ_AHEAD_STREAM streams[IMSCSI_READ_AHEAD_STREAMS] = { };
+    ULONGLONG wasted = 0;
+
+    ULONG small = ImScsiAheadMaxWindow(IMSCSI_CACHE_LINE_SIZE, 8UL << 20);
+    IMTEST_CHECK(small < IMSCSI_CACHE_LINE_SIZE);
+    IMTEST_CHECK(!ImScsiAheadTrack(streams, 1, small, AHEAD_TEST_DISK_SIZE,
+        0, 0x10000, 0, &wasted));
+    IMTEST_CHECK(streams[0].SequentialCount == 0);
+}
+
+static void
+TestWindowGrowsAndShrinks()
+{
+    IMSCSI_READ_AHEAD_STREAM streams[IMSCSI_READ_AHEAD_STREAMS] = { };
+    ULONGLONG wasted = 0;
+    ULONG clock = 0;
+
+    // First read starts a stream, second one in sequence opens window
+    IMTEST_CHECK(!ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+        AHEAD_TEST_DISK_SIZE, 0x100000, 0x10000, 0, &wasted));
+    IMTEST_CHECK(streams[0].SequentialCount == 1 && streams[0].Window == 0);
+
+    IMTEST_CHECK(ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+        AHEAD_TEST_DISK_SIZE, 0x110000, 0x10000, 0, &wasted));
+    IMTEST_CHECK(streams[0].Window == IMSCSI_READ_AHEAD_MIN_WINDOW);
+    IMTEST_CHECK(streams[0].NextOffset == 0x120000);
+
+    // Read-ahead data used: window doubles, up to limit
+    streams[0].AheadOffset = streams[0].FilledOffset = 0x140000;
+
+    for (ULONG offset = 0x120000; offset < 0x140000; offset += 0x10000)
+    {
+        ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+            AHEAD_TEST_DISK_SIZE, offset, 0x10000, 1, &wasted);
+    }
+
+    IMTEST_CHECK(streams[0].Window == IMSCSI_READ_AHEAD_MIN_WINDOW << 2);
+
+    // Read-ahead data evicted before it was read: window halves and bytes
+    // are counted as wasted
+    streams[0].AheadOffset = streams[0].FilledOffset = 0x180000;
+
+    IMTEST_CHECK(ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+        AHEAD_TEST_DISK_SIZE, 0x140000, 0x10000, 0, &wasted));
+    IMTEST_CHECK(streams[0].Window == IMSCSI_READ_AHEAD_MIN_WINDOW << 1);
+    IMTEST_CHECK(wasted == 0x10000);
+
+    for (int i = 0; i < 20; i++)
+    {
+        streams[0].AheadOffset = streams[0].FilledOffset =
+            streams[0].NextOffset + 0x100000;
+
+        ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+            AHEAD_TEST_DISK_SIZE, streams[0].NextOffset, 0x10000, 1, &wasted);
+    }
+
+    IMTEST_CHECK(streams[0].Window == AHEAD_TEST_MAX_WINDOW);
+}
+
+static void
+TestLeastRecentlyUsedReplaced()
+{
+    IMSCSI_READ_AHEAD_STREAM streams[IMSCSI_READ_AHEAD_STREAMS] = { };
+    ULONGLONG wasted = 0;
+    ULONG clock = 0;
+
+    for (LONGLONG i = 0; i < IMSCSI_READ_AHEAD_STREAMS; i++)
+    {
+        ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+            AHEAD_TEST_DISK_SIZE, i << 28, 0x1000, 0, &wasted);
+    }
+
+    // Stream 0 is used again, stream 1 is now oldest and has data ahead
+    ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+        AHEAD_TEST_DISK_SIZE, 0x1000, 0x1000, 0, &wasted);
+
+    streams[1].FilledOffset = streams[1].NextOffset + 0x8000;
+    ULONG id = streams[1].Id;
+
+    ImScsiAheadTrack(streams, ++clock, AHEAD_TEST_MAX_WINDOW,
+        AHEAD_TEST_DISK_SIZE, 0x7f000000, 0x1000, 0, &wasted);
+
+    IMTEST_CHECK(streams[1].NextOffset == 0x7f001000);
+    IMTEST_CHECK(streams[1].Id == id + 1);
+    IMTEST_CHECK(streams[0].NextOffset == 0x2000);
+    IMTEST_CHECK(wasted == 0x8000);
+}
+
+static void
+TestNextChunk()
+{
+    std::vector<uint64_t> memory((size_t)ImScsiCacheMemorySize(64) / 8 + 1);
+    std::vector<UCHAR> line(IMSCSI_CACHE_LINE_SIZE);
+    IMSCSI_CACHE cache;
+    ImScsiCacheInitialize(&cache, memory.data(), 64);
+
+    IMSCSI_READ_AHEAD_STREAM streams[IMSCSI_READ_AHEAD_STREAMS] = { };
+    LONGLONG offset;
+    ULONG length;
+
+    IMTEST_CHECK(ImScsiAheadNext(streams, &cache, AHEAD_TEST_DISK_SIZE,
+        &offset, &length) == -1);
+
+    // Window from start of device: first line is left out, cached lines
+    // are skipped, chunk is limited
+    streams[3].SequentialCount = 2;
+    streams[3].NextOffset = streams[3].AheadOffset = 0x200;
+    streams[3].Window = 1UL << 20;
+
+    ImScsiCacheFill(&cache, cache.generation, IMSCSI_CACHE_LINE_SIZE,
+        IMSCSI_CACHE_LINE_SIZE, line.data());
+
+    IMTEST_CHECK(ImScsiAheadNext(streams, &cache, AHEAD_TEST_DISK_SIZE,
+        &offset, &length) == 3);
+    IMTEST_CHECK(offset == 2 * IMSCSI_CACHE_LINE_SIZE);
+    IMTEST_CHECK(length == IMSCSI_READ_AHEAD_CHUNK);
+    IMTEST_CHECK(streams[3].AheadOffset == offset + length);
+
+    // Rest of window, which ends at disk end
+    IMTEST_CHECK(ImScsiAheadNext(streams, &cache, 0x80000,
+        &offset, &length) == 3);
+    IMTEST_CHECK(offset == 2 * IMSCSI_CACHE_LINE_SIZE + IMSCSI_READ_AHEAD_CHUNK);
+    IMTEST_CHECK(offset + length == 0x80000);
+
+    // Nothing left, stream marked as filled to end of window
+    IMTEST_CHECK(ImScsiAheadNext(streams, &cache, 0x80000,
+        &offset, &length) == -1);
+    IMTEST_CHECK(streams[3].FilledOffset == 0x80000);
+}
+
+///
+/// LU with a read cache, served by one worker that reads ahead whenever
+/// it has nothing else to do. Counts reads served from cache.
+///
+struct AheadTestLu
+{
+    std::vector<uint64_t> memory;
+    IMSCSI_CACHE cache;
+    IMSCSI_READ_AHEAD_STREAM streams[IMSCSI_READ_AHEAD_STREAMS] = { };
+    ULONG clock = 0;
+    ULONG max_window;
+    ULONGLONG wasted = 0;
+    ULONGLONG ahead_bytes = 0;
+    unsigned reads = 0;
+    unsigned hits = 0;
+    std::vector<UCHAR> buffer;
+
+    explicit AheadTestLu(ULONG SetCount) :
+        memory((size_t)ImScsiCacheMemorySize(SetCount) / 8 + 1),
+        buffer(IMSCSI_READ_AHEAD_CHUNK)
+    {
+        ImScsiCacheInitialize(&cache, memory.data(), SetCount);
+
+        max_window = ImScsiAheadMaxWindow((ULONGLONG)SetCount *
+            IMSCSI_CACHE_WAYS * IMSCSI_CACHE_LINE_SIZE, AHEAD_TEST_MAX_WINDOW);
+    }
+
+    void
+    Read(LONGLONG Offset, ULONG Length)
+    {
+        int hit = ImScsiCacheRead(&cache, Offset, Length, buffer.data());
+
+        reads++;
+        hits += hit;
+
+        ImScsiAheadTrack(streams, ++clock, max_window, AHEAD_TEST_DISK_SIZE,
+            Offset, Length, hit, &wasted);
+
+        // Missed reads go to device, without filling cache
+        LONGLONG offset;
+        ULONG length;
+
+        for (int i = 0; i < 4; i++)
+        {
+            if (ImScsiAheadNext(streams, &cache, AHEAD_TEST_DISK_SIZE,
+                &offset, &length) < 0)
+            {
+                break;
+            }
+
+            ImScsiCacheFill(&cache, cache.generation, offset, length,
+                buffer.data());
+            ahead_bytes += length;
+        }
+    }
+};
+
+static void
+TestSequentialReaders()
+{
+    AheadTestLu lu(1024);
+
+    for (LONGLONG offset = 0; offset < 64LL << 20; offset += 0x10000)
+    {
+        lu.Read(offset, 0x10000);
+    }
+
+    printf("one stream: %u of %u reads from cache, %llu KB read ahead, "
+        "%llu KB wasted\n", lu.hits, lu.reads,
+        (unsigned long long)lu.ahead_bytes >> 10,
+        (unsigned long long)lu.wasted >> 10);
+
+    IMTEST_CHECK(lu.hits > lu.reads * 95 / 100);
+    IMTEST_CHECK(lu.wasted == 0);
+
+    // Interleaved readers in different places on device
+    AheadTestLu lu8(1024);
+
+    for (LONGLONG offset = 0; offset < 16LL << 20; offset += 0x8000)
+    {
+        for (LONGLONG stream = 0; stream < IMSCSI_READ_AHEAD_STREAMS; stream++)
+        {
+            lu8.Read((stream << 29) + offset, 0x8000);
+        }
+    }
+
+    printf("%u streams: %u of %u reads from cache, %llu KB wasted\n",
+        IMSCSI_READ_AHEAD_STREAMS, lu8.hits, lu8.reads,
+        (unsigned long long)lu8.wasted >> 10);
+
+    IMTEST_CHECK(lu8.hits > lu8.reads * 90 / 100);
+}
+
+static void
+TestRandomReaderNotReadAhead()
+{
+    AheadTestLu lu(1024);
+    uint64_t state = 5;
+
+    for (int i = 0; i < 20000; i++)
+    {
+        lu.Read((LONGLONG)(ImTestRandom(&state) % (1 << 20)) << 12, 0x1000);
+    }
+
+    IMTEST_CHECK(lu.ahead_bytes == 0);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestMaxWindow);
+    IMTEST_RUN(TestWindowGrowsAndShrinks);
+    IMTEST_RUN(TestLeastRecentlyUsedReplaced);
+    IMTEST_RUN(TestNextChunk);
+    IMTEST_RUN(TestSequentialReaders);
+    IMTEST_RUN(TestRandomReaderNotReadAhead);
+
+    return IMTEST_RESULT();
+}
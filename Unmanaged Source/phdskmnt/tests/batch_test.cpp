@@ -0,0 +1,330 @@
+/// batch_test.cpp
+/// Encode and decode tests for the IOCTL_DEVIODRV_EXCHANGE_IO_BATCH buffer
+/// layout in imdproxy.h, with the checks in imdbatch.h. Driver side is
+/// modelled on DevIoDrvFormatBatchEntry and
+/// DevIoDrvDispatchServerBatchRequest, server side on what a server does
+/// with each entry.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imdbatch.h>
+
+#include <vector>
+
+struct BatchTestRequest
+{
+    ULONGLONG request_code;
+    ULONGLONG offset;
+    ULONGLONG length;
+    ULONGLONG io_tag;
+    unsigned char fill;
+};
+
+static void
+BatchTestFill(unsigned char *Data, ULONGLONG Length, unsigned char Fill)
+{
+    for (ULONGLONG i = 0; i < Length; i++)
+    {
+        Data[i] = (unsigned char)(Fill + i);
+    }
+}
+
+static bool
+BatchTestCheckFill(const unsigned char *Data, ULONGLONG Length,
+    unsigned char Fill)
+{
+    for (ULONGLONG i = 0; i < Length; i++)
+    {
+        if (Data[i] != (unsigned char)(Fill + i))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+///
+/// Fills buffer with as many requests as fit, the way driver does. Returns
+/// number of requests formatted.
+///
+static ULONG
+BatchTestFormat(std::vector<unsigned char> &Buffer, ULONG MaxEntries,
+    const std::vector<BatchTestRequest> &Requests)
+{
+    PIMDPROXY_DEVIODRV_BATCH_HEADER batch =
+        (PIMDPROXY_DEVIODRV_BATCH_HEADER)Buffer.data();
+    PIMDPROXY_DEVIODRV_BATCH_ENTRY entries =
+        (PIMDPROXY_DEVIODRV_BATCH_ENTRY)(batch + 1);
+
+    ULONGLONG data_end = IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(MaxEntries);
+    ULONG count = 0;
+
+    for (const BatchTestRequest &request : Requests)
+    {
+        if (count == MaxEntries ||
+            !ImdBatchDataFits(data_end, request.length, Buffer.size()))
+        {
+            break;
+        }
+
+        if (request.request_code == IMDPROXY_REQ_WRITE)
+        {
+            BatchTestFill(Buffer.data() + data_end, request.length,
+                request.fill);
+        }
+
+        entries[count].request_code = request.request_code;
+        entries[count].io_tag = request.io_tag;
+        entries[count].offset = request.offset;
+        entries[count].length = request.length;
+        entries[count].errorno = 0;
+        entries[count].data_offset = data_end;
+
+        data_end = ImdBatchNextDataOffset(data_end, request.length,
+            Buffer.size());
+        count++;
+    }
+
+    batch->entry_count = count;
+    batch->data_size = data_end;
+
+    return count;
+}
+
+static void
+TestHeaderChecks()
+{
+    ULONGLONG size = IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(16);
+
+    IMTEST_CHECK(ImdBatchCheckHeader(16, 0, size));
+    IMTEST_CHECK(ImdBatchCheckHeader(16, 16, size));
+    IMTEST_CHECK(!ImdBatchCheckHeader(16, 17, size));
+    IMTEST_CHECK(!ImdBatchCheckHeader(0, 0, size));
+    IMTEST_CHECK(!ImdBatchCheckHeader(16, 0, size - 1));
+    IMTEST_CHECK(!ImdBatchCheckHeader(IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES + 1,
+        0, 1ULL << 32));
+    IMTEST_CHECK(!ImdBatchCheckHeader(0xFFFFFFFF, 0, ~0ULL));
+    IMTEST_CHECK(ImdBatchCheckHeader(IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES,
+        IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES,
+        IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES)));
+
+    // Smallest buffer driver takes holds header and one entry
+    IMTEST_CHECK(IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(1) <= IMDPROXY_HEADER_SIZE);
+}
+
+static void
+TestLayout()
+{
+    IMTEST_CHECK(sizeof(IMDPROXY_DEVIODRV_BATCH_HEADER) == 16);
+    IMTEST_CHECK(sizeof(IMDPROXY_DEVIODRV_BATCH_ENTRY) == 48);
+
+    for (ULONG n = 1; n <= IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES; n++)
+    {
+        ULONGLONG offset = IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(n);
+
+        IMTEST_CHECK(offset % IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT == 0);
+        IMTEST_CHECK(offset >= sizeof(IMDPROXY_DEVIODRV_BATCH_HEADER) +
+            n * sizeof(IMDPROXY_DEVIODRV_BATCH_ENTRY));
+        IMTEST_CHECK(offset < sizeof(IMDPROXY_DEVIODRV_BATCH_HEADER) +
+            n * sizeof(IMDPROXY_DEVIODRV_BATCH_ENTRY) +
+            IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT);
+    }
+}
+
+static void
+TestDataOffsets()
+{
+    IMTEST_CHECK(ImdBatchNextDataOffset(512, 0, 4096) == 512);
+    IMTEST_CHECK(ImdBatchNextDataOffset(512, 1, 4096) == 1024);
+    IMTEST_CHECK(ImdBatchNextDataOffset(512, 512, 4096) == 1024);
+    IMTEST_CHECK(ImdBatchNextDataOffset(512, 513, 4096) == 1536);
+
+    // Data area used, returned to server as transfer size, stays within
+    // buffers that are not a multiple of alignment
+    IMTEST_CHECK(ImdBatchNextDataOffset(512, 3500, 4000) == 4000);
+    IMTEST_CHECK(ImdBatchNextDataOffset(512, 3488, 4000) == 4000);
+    IMTEST_CHECK(ImdBatchDataFits(4000, 0, 4000));
+    IMTEST_CHECK(!ImdBatchDataFits(4000, 1, 4000));
+
+    IMTEST_CHECK(ImdBatchDataFits(512, 3584, 4096));
+    IMTEST_CHECK(!ImdBatchDataFits(512, 3585, 4096));
+    IMTEST_CHECK(ImdBatchDataFits(4096, 0, 4096));
+    IMTEST_CHECK(!ImdBatchDataFits(4608, 0, 4096));
+
+    // Lengths from client requests must not wrap around
+    IMTEST_CHECK(!ImdBatchDataFits(512, ~0ULL - 100, 4096));
+
+    IMTEST_CHECK(ImdBatchResponseDataSize(512, 4096) == 3584);
+    IMTEST_CHECK(ImdBatchResponseDataSize(4096, 4096) == 0);
+    IMTEST_CHECK(ImdBatchResponseDataSize(~0ULL, 4096) == 0);
+}
+
+///
+/// Driver formats requests, server answers in the same buffer, driver
+/// decodes responses. Checks that every request comes back to the right
+/// tag with its data and that no data overlaps entries or other data.
+///
+static void
+TestRoundTrip()
+{
+    uint64_t state = 9;
+
+    for (int round = 0; round < 2000; round++)
+    {
+        ULONG max_entries = 1 + ImTestRandom(&state) %
+            IMDPROXY_DEVIODRV_BATCH_MAX_ENTRIES;
+        size_t buffer_size = (size_t)IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(max_entries) +
+            ImTestRandom(&state) % (256 << 10);
+
+        std::vector<unsigned char> buffer(buffer_size);
+        std::vector<BatchTestRequest> requests;
+
+        PIMDPROXY_DEVIODRV_BATCH_HEADER batch =
+            (PIMDPROXY_DEVIODRV_BATCH_HEADER)buffer.data();
+        PIMDPROXY_DEVIODRV_BATCH_ENTRY entries =
+            (PIMDPROXY_DEVIODRV_BATCH_ENTRY)(batch + 1);
+
+        // Server sets up buffer
+        batch->max_entries = max_entries;
+        batch->entry_count = 0;
+        IMTEST_CHECK(ImdBatchCheckHeader(batch->max_entries,
+            batch->entry_count, buffer.size()));
+
+        unsigned count = ImTestRandom(&state) % (max_entries + 8);
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            BatchTestRequest request;
+            unsigned kind = ImTestRandom(&state) % 4;
+
+            request.request_code = kind == 0 ? IMDPROXY_REQ_WRITE :
+                kind == 1 ? IMDPROXY_REQ_ZERO : IMDPROXY_REQ_READ;
+            request.offset = (ULONGLONG)(ImTestRandom(&state) % 100000) * 512;
+            request.length = request.request_code == IMDPROXY_REQ_ZERO ? 16 :
+                1 + ImTestRandom(&state) % (32 << 10);
+            request.io_tag = ((ULONGLONG)(round + 1) << 32) | i;
+            request.fill = (unsigned char)ImTestRandom(&state);
+
+            requests.push_back(request);
+        }
+
+        ULONG sent = BatchTestFormat(buffer, max_entries, requests);
+
+        IMTEST_CHECK(sent <= max_entries);
+        IMTEST_CHECK(batch->data_size <= buffer.size());
+        IMTEST_CHECK(sent == requests.size() || sent == max_entries ||
+            !ImdBatchDataFits(batch->data_size, requests[sent].length,
+                buffer.size()));
+
+        // Server decodes requests, checks write data and answers reads in
+        // space reserved for them
+        ULONGLONG previous_end = IMDPROXY_DEVIODRV_BATCH_DATA_OFFSET(max_entries);
+
+        for (ULONG i = 0; i < batch->entry_count; i++)
+        {
+            IMDPROXY_DEVIODRV_BATCH_ENTRY entry = entries[i];
+
+            IMTEST_CHECK(entry.io_tag == requests[i].io_tag);
+            IMTEST_CHECK(entry.offset == requests[i].offset);
+            IMTEST_CHECK(entry.data_offset % IMDPROXY_DEVIODRV_BATCH_DATA_ALIGNMENT == 0);
+            IMTEST_CHECK(entry.data_offset >= previous_end);
+            IMTEST_CHECK(entry.data_offset + entry.length <= buffer.size());
+
+            previous_end = entry.data_offset + entry.length;
+
+            if (entry.request_code == IMDPROXY_REQ_WRITE)
+            {
+                IMTEST_CHECK(BatchTestCheckFill(buffer.data() + entry.data_offset,
+                    entry.length, requests[i].fill));
+            }
+            else if (entry.request_code == IMDPROXY_REQ_READ)
+            {
+                BatchTestFill(buffer.data() + entry.data_offset, entry.length,
+                    (unsigned char)~requests[i].fill);
+            }
+
+            entries[i].errorno = 0;
+        }
+
+        // Driver decodes responses
+        ULONG max_copy = batch->max_entries;
+        ULONG count_copy = batch->entry_count;
+
+        IMTEST_CHECK(ImdBatchCheckHeader(max_copy, count_copy, buffer.size()));
+
+        for (ULONG i = 0; i < count_copy; i++)
+        {
+            IMDPROXY_DEVIODRV_BATCH_ENTRY entry = entries[i];
+            ULONGLONG data_size = ImdBatchResponseDataSize(entry.data_offset,
+                buffer.size());
+
+            IMTEST_CHECK(data_size >= entry.length);
+
+            if (entry.request_code == IMDPROXY_REQ_READ)
+            {
+                IMTEST_CHECK(BatchTestCheckFill(buffer.data() + entry.data_offset,
+                    entry.length, (unsigned char)~requests[i].fill));
+            }
+        }
+    }
+}
+
+///
+/// Response entries come from server and may hold anything. Decoding them
+/// never gives data outside buffer.
+///
+static void
+TestHostileResponses()
+{
+    uint64_t state = 21;
+    const ULONGLONG buffer_size = 64 << 10;
+
+    for (int i = 0; i < 100000; i++)
+    {
+        ULONGLONG data_offset = ((ULONGLONG)ImTestRandom(&state) << 32) |
+            ImTestRandom(&state);
+
+        if (i % 2)
+        {
+            data_offset %= buffer_size + 1024;
+        }
+
+        ULONGLONG data_size = ImdBatchResponseDataSize(data_offset, buffer_size);
+
+        IMTEST_CHECK(data_size == 0 ||
+            (data_offset < buffer_size &&
+            data_offset + data_size == buffer_size));
+
+        ULONG max_entries = ImTestRandom(&state) % 1024;
+        ULONG entry_count = ImTestRandom(&state) % 1024;
+
+        if (ImdBatchCheckHeader(max_entries, entry_count, buffer_size))
+        {
+            IMTEST_CHECK(sizeof(IMDPROXY_DEVIODRV_BATCH_HEADER) +
+                (ULONGLONG)entry_count * sizeof(IMDPROXY_DEVIODRV_BATCH_ENTRY) <=
+                buffer_size);
+        }
+    }
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestHeaderChecks);
+    IMTEST_RUN(TestLayout);
+    IMTEST_RUN(TestDataOffsets);
+    IMTEST_RUN(TestRoundTrip);
+    IMTEST_RUN(TestHostileResponses);
+
+    return IMTEST_RESULT();
+}
@@ -0,0 +1,275 @@
+/// cache_bench.cpp
+/// Replays synthetic sector traces through the read cache in imscsicache.h
+/// at cache sizes 4, 16 and 64 MB, and reports read hit rate, time per
+/// request for cache work around each read and write, and time per lookup
+/// without data copy. The last I/O buffer that the cache replaced is
+/// replayed too, as one buffer holding data of the latest request.
+///
+/// Traces, all on a 1 GB device:
+///  skewed      Random 4 to 16 KB reads, 80 % of them within 64 MB, and
+///              10 % writes.
+///  1 reader    Reads a file in 64 KB requests, each followed by four 4 KB
+///              reads within the same 64 KB, which last I/O buffer was for.
+///  8 readers   Same for 8 files, interleaved request by request like
+///              separate processes.
+///  scan        Sequential 64 KB reads, nothing is read twice.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsicache.h>
+
+#include <vector>
+
+static const LONGLONG BenchDeviceSize = 1LL << 30;
+static const int BenchRequests = 200000;
+
+struct BenchRequest
+{
+    LONGLONG Offset;
+    ULONG Length;
+    bool Write;
+};
+
+static void
+BenchSkewed(std::vector<BenchRequest> *Trace)
+{
+    uint64_t state = 11;
+
+    for (int i = 0; i < BenchRequests; i++)
+    {
+        BenchRequest request;
+        LONGLONG area = ImTestRandom(&state) % 10 < 8 ? 64LL << 20 :
+            BenchDeviceSize;
+
+        request.Length = (1 + ImTestRandom(&state) % 4) << 12;
+        request.Offset = (LONGLONG)(ImTestRandom(&state) %
+            ((area - request.Length) >> 12)) << 12;
+        request.Write = ImTestRandom(&state) % 10 == 0;
+
+        Trace->push_back(request);
+    }
+}
+
+static void
+BenchReaders(std::vector<BenchRequest> *Trace, int Readers)
+{
+    std::vector<LONGLONG> position(Readers);
+    std::vector<int> step(Readers, 0);
+    uint64_t state = 17;
+
+    for (int r = 0; r < Readers; r++)
+    {
+        position[r] = (LONGLONG)(ImTestRandom(&state) %
+            (BenchDeviceSize >> 16)) << 16;
+    }
+
+    while ((int)Trace->size() < BenchRequests)
+    {
+        int r = (int)(ImTestRandom(&state) % Readers);
+        BenchRequest request;
+
+        request.Write = false;
+
+        if (step[r] == 0)
+        {
+            request.Offset = position[r];
+            request.Length = 65536;
+        }
+        else
+        {
+            request.Offset = position[r] +
+                ((LONGLONG)(ImTestRandom(&state) % 16) << 12);
+            request.Length = 4096;
+        }
+
+        Trace->push_back(request);
+
+        if (++step[r] == 5)
+        {
+            step[r] = 0;
+            position[r] = (position[r] + 65536) % BenchDeviceSize;
+        }
+    }
+}
+
+static void
+BenchOneReader(std::vector<BenchRequest> *Trace)
+{
+    BenchReaders(Trace, 1);
+}
+
+static void
+BenchEightReaders(std::vector<BenchRequest> *Trace)
+{
+    BenchReaders(Trace, 8);
+}
+
+static void
+BenchScan(std::vector<BenchRequest> *Trace)
+{
+    for (int i = 0; i < BenchRequests; i++)
+    {
+        BenchRequest request;
+
+        request.Length = 65536;
+        request.Offset = ((LONGLONG)i * request.Length) % BenchDeviceSize;
+        request.Write = false;
+
+        Trace->push_back(request);
+    }
+}
+
+///
+/// Returns share of reads that hit in one buffer with data of latest
+/// request, like LastIoBuffer.
+///
+static double
+BenchLastIo(const std::vector<BenchRequest> &Trace)
+{
+    LONGLONG last_offset = 0;
+    ULONG last_length = 0;
+    int reads = 0;
+    int hits = 0;
+
+    for (size_t i = 0; i < Trace.size(); i++)
+    {
+        const BenchRequest &request = Trace[i];
+
+        if (!request.Write)
+        {
+            reads++;
+
+            if (request.Offset >= last_offset &&
+                request.Offset + request.Length <= last_offset + last_length)
+            {
+                hits++;
+                continue;
+            }
+        }
+
+        last_offset = request.Offset;
+        last_length = request.Length;
+    }
+
+    return (double)hits / reads;
+}
+
+///
+/// Replays Trace as ImScsiDispatchWork does: reads are looked up first and
+/// fill cache on miss, writes update it. Returns read hit rate. RequestNs
+/// is set to cache time per request, LookupNs to time per read lookup in
+/// final cache state.
+///
+static double
+BenchCache(const std::vector<BenchRequest> &Trace, ULONGLONG CacheSize,
+    double *RequestNs, double *LookupNs)
+{
+    ULONG set_count = ImScsiCacheSetCountForSize(CacheSize);
+    std::vector<uint64_t> memory((size_t)(ImScsiCacheMemorySize(set_count) + 7) / 8);
+    std::vector<UCHAR> buffer(65536, 0x5A);
+    IMSCSI_CACHE cache;
+
+    ImScsiCacheInitialize(&cache, memory.data(), set_count);
+
+    double start = ImTestSeconds();
+
+    for (size_t i = 0; i < Trace.size(); i++)
+    {
+        const BenchRequest &request = Trace[i];
+
+        if (request.Write)
+        {
+            ImScsiCacheWrite(&cache, request.Offset, request.Length,
+                buffer.data());
+
+            continue;
+        }
+
+        ULONGLONG generation = cache.generation;
+
+        if (!ImScsiCacheRead(&cache, request.Offset, request.Length,
+            buffer.data()))
+        {
+            ImScsiCacheFill(&cache, generation, request.Offset,
+                request.Length, buffer.data());
+        }
+    }
+
+    *RequestNs = (ImTestSeconds() - start) * 1e9 / Trace.size();
+
+    int lookups = 0;
+    int found = 0;
+
+    start = ImTestSeconds();
+
+    for (size_t i = 0; i < Trace.size(); i++)
+    {
+        if (!Trace[i].Write)
+        {
+            found += ImScsiCacheContains(&cache, Trace[i].Offset,
+                Trace[i].Length);
+            lookups++;
+        }
+    }
+
+    *LookupNs = (ImTestSeconds() - start) * 1e9 / lookups;
+
+    // Keeps lookup loop from being optimized away
+    if (found > lookups)
+    {
+        printf("?\n");
+    }
+
+    return (double)cache.hits / (cache.hits + cache.misses);
+}
+
+int
+main()
+{
+    static const struct
+    {
+        const char *name;
+        void (*generate)(std::vector<BenchRequest>*);
+    } traces[] = {
+        { "skewed", BenchSkewed },
+        { "1 reader", BenchOneReader },
+        { "8 readers", BenchEightReaders },
+        { "scan", BenchScan },
+    };
+
+    printf("%-12s %8s %8s %12s %10s\n", "trace", "cache", "hit %",
+        "ns/request", "ns/lookup");
+
+    for (size_t t = 0; t < sizeof(traces) / sizeof(*traces); t++)
+    {
+        std::vector<BenchRequest> trace;
+
+        traces[t].generate(&trace);
+
+        printf("%-12s %8s %8.1f %12s %10s\n", traces[t].name, "last I/O",
+            BenchLastIo(trace) * 100, "-", "-");
+
+        for (ULONGLONG size = 4ULL << 20; size <= (64ULL << 20); size <<= 2)
+        {
+            double request_ns;
+            double lookup_ns;
+            double hit_rate = BenchCache(trace, size, &request_ns,
+                &lookup_ns);
+
+            printf("%-12s %6u M %8.1f %12.0f %10.1f\n", traces[t].name,
+                (unsigned)(size >> 20), hit_rate * 100, request_ns,
+                lookup_ns);
+        }
+    }
+
+    return 0;
+}
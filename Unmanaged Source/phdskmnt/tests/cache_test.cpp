@@ -0,0 +1,316 @@
+/// cache_test.cpp
+/// Tests for the set-associative read cache in imscsicache.h, including a
+/// random run against a model device where reads that fill the cache are
+/// interleaved with writes and invalidations, and every cache hit is
+/// compared with what the device holds at that time.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsicache.h>
+
+#include <vector>
+
+///
+/// Cache with its own memory.
+///
+struct CacheTestCache
+{
+    IMSCSI_CACHE cache;
+    std::vector<uint64_t> memory;
+
+    explicit CacheTestCache(ULONG SetCount) :
+        memory((size_t)(ImScsiCacheMemorySize(SetCount) + 7) / 8)
+    {
+        ImScsiCacheInitialize(&cache, memory.data(), SetCount);
+    }
+};
+
+static std::vector<UCHAR>
+CacheTestData(size_t Length, UCHAR Seed)
+{
+    std::vector<UCHAR> data(Length);
+
+    for (size_t i = 0; i < Length; i++)
+    {
+        data[i] = (UCHAR)(Seed + i * 7);
+    }
+
+    return data;
+}
+
+static void
+TestSizing()
+{
+    IMTEST_CHECK(ImScsiCacheSetCountForSize(ImScsiCacheMemorySize(1) - 1) == 0);
+    IMTEST_CHECK(ImScsiCacheSetCountForSize(ImScsiCacheMemorySize(1)) == 1);
+    IMTEST_CHECK(ImScsiCacheSetCountForSize(ImScsiCacheMemorySize(64)) == 64);
+    IMTEST_CHECK(ImScsiCacheSetCountForSize(ImScsiCacheMemorySize(64) - 1) == 32);
+
+    CacheTestCache disabled(0);
+    std::vector<UCHAR> buffer(IMSCSI_CACHE_LINE_SIZE);
+
+    IMTEST_CHECK(disabled.cache.set_count == 0);
+    ImScsiCacheFill(&disabled.cache, 0, 0, IMSCSI_CACHE_LINE_SIZE, buffer.data());
+    ImScsiCacheWrite(&disabled.cache, 0, IMSCSI_CACHE_LINE_SIZE, buffer.data());
+    IMTEST_CHECK(!ImScsiCacheRead(&disabled.cache, 0, 512, buffer.data()));
+}
+
+static void
+TestFillAndRead()
+{
+    CacheTestCache c(4);
+    std::vector<UCHAR> data = CacheTestData(3 * IMSCSI_CACHE_LINE_SIZE, 1);
+    std::vector<UCHAR> buffer(IMSCSI_CACHE_LINE_SIZE * 2);
+
+    // Only whole lines are stored: 0x800..0x3800 covers lines 1 and 2
+    ImScsiCacheFill(&c.cache, c.cache.generation, 0x800,
+        3 * IMSCSI_CACHE_LINE_SIZE, data.data());
+
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0, 512));
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 0x1000, 0x2000));
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0x1000, 0x2001));
+
+    // Read across line boundary
+    IMTEST_CHECK(ImScsiCacheRead(&c.cache, 0x1e00, 0x400, buffer.data()));
+    IMTEST_CHECK(memcmp(buffer.data(), data.data() + 0x1e00 - 0x800, 0x400) == 0);
+
+    IMTEST_CHECK(!ImScsiCacheRead(&c.cache, 0x2e00, 0x400, buffer.data()));
+    IMTEST_CHECK(c.cache.hits == 1 && c.cache.misses == 1);
+}
+
+static void
+TestClockReplacement()
+{
+    CacheTestCache c(4);
+    std::vector<UCHAR> data = CacheTestData(IMSCSI_CACHE_LINE_SIZE, 3);
+    std::vector<UCHAR> buffer(512);
+
+    // Lines set_count apart share a set
+    for (LONGLONG i = 0; i < IMSCSI_CACHE_WAYS; i++)
+    {
+        ImScsiCacheFill(&c.cache, c.cache.generation,
+            (i * 4) << IMSCSI_CACHE_LINE_SHIFT, IMSCSI_CACHE_LINE_SIZE,
+            data.data());
+    }
+
+    // Referenced line gets a second chance, first unreferenced is replaced
+    IMTEST_CHECK(ImScsiCacheRead(&c.cache, 0, 512, buffer.data()));
+
+    ImScsiCacheFill(&c.cache, c.cache.generation,
+        (LONGLONG)(IMSCSI_CACHE_WAYS * 4) << IMSCSI_CACHE_LINE_SHIFT,
+        IMSCSI_CACHE_LINE_SIZE, data.data());
+
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 0, 512));
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 4 << IMSCSI_CACHE_LINE_SHIFT, 512));
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 8 << IMSCSI_CACHE_LINE_SHIFT, 512));
+
+    // Other sets untouched
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 1 << IMSCSI_CACHE_LINE_SHIFT, 512));
+}
+
+static void
+TestWriteAndInvalidate()
+{
+    CacheTestCache c(16);
+    std::vector<UCHAR> data = CacheTestData(4 * IMSCSI_CACHE_LINE_SIZE, 5);
+    std::vector<UCHAR> patch = CacheTestData(0x200, 77);
+    std::vector<UCHAR> buffer(IMSCSI_CACHE_LINE_SIZE);
+
+    ImScsiCacheFill(&c.cache, c.cache.generation, 0,
+        2 * IMSCSI_CACHE_LINE_SIZE, data.data());
+
+    // Cached line is patched, uncached partial line is left out
+    ImScsiCacheWrite(&c.cache, 0x100, 0x200, patch.data());
+    ImScsiCacheWrite(&c.cache, 0x5100, 0x200, patch.data());
+
+    IMTEST_CHECK(ImScsiCacheRead(&c.cache, 0, 0x400, buffer.data()));
+    IMTEST_CHECK(memcmp(buffer.data(), data.data(), 0x100) == 0);
+    IMTEST_CHECK(memcmp(buffer.data() + 0x100, patch.data(), 0x200) == 0);
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0x5000, 0x200));
+
+    // Whole line written is stored
+    ImScsiCacheWrite(&c.cache, 0x6000, IMSCSI_CACHE_LINE_SIZE, data.data());
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 0x6000, IMSCSI_CACHE_LINE_SIZE));
+
+    ImScsiCacheInvalidate(&c.cache, 0x1ff, 2);
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0, 512));
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 0x1000, 512));
+
+    // Large range goes through all entries
+    ImScsiCacheInvalidate(&c.cache, 0, 1ULL << 32);
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0x1000, 512));
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0x6000, 512));
+}
+
+///
+/// Fill for data read before a write is skipped only for lines in sets the
+/// write touched.
+///
+static void
+TestFillAfterWriteElsewhere()
+{
+    CacheTestCache c(64);
+    std::vector<UCHAR> data = CacheTestData(4 * IMSCSI_CACHE_LINE_SIZE, 9);
+    std::vector<UCHAR> written = CacheTestData(512, 99);
+
+    ULONGLONG generation = c.cache.generation;
+
+    // Write to line 2 while lines 0-3 are being read
+    ImScsiCacheWrite(&c.cache, 0x2100, 512, written.data());
+    ImScsiCacheInvalidate(&c.cache, 0x45000, 0x1000);
+
+    ImScsiCacheFill(&c.cache, generation, 0, 4 * IMSCSI_CACHE_LINE_SIZE,
+        data.data());
+
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 0, 0x2000));
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0x2000, 512));
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 0x3000, 0x1000));
+
+    // Data read after write is stored
+    ImScsiCacheFill(&c.cache, c.cache.generation, 0x2000,
+        IMSCSI_CACHE_LINE_SIZE, data.data());
+    IMTEST_CHECK(ImScsiCacheContains(&c.cache, 0x2000, 512));
+
+    // Invalidation of everything blocks all fills started before it
+    generation = c.cache.generation;
+    ImScsiCacheInvalidate(&c.cache, 0, 1ULL << 40);
+
+    ImScsiCacheFill(&c.cache, generation, 0x10000, IMSCSI_CACHE_LINE_SIZE,
+        data.data());
+    IMTEST_CHECK(!ImScsiCacheContains(&c.cache, 0x10000, 512));
+}
+
+#define CACHE_TEST_DEVICE_LINES     256
+#define CACHE_TEST_FILLS            4
+
+///
+/// Fill in progress: data as it was on device when read started.
+///
+struct CacheTestFill
+{
+    ULONGLONG generation;
+    LONGLONG offset;
+    std::vector<UCHAR> data;
+};
+
+static void
+TestRandomAgainstDevice()
+{
+    CacheTestCache c(16);
+    std::vector<UCHAR> device(CACHE_TEST_DEVICE_LINES * IMSCSI_CACHE_LINE_SIZE);
+    std::vector<CacheTestFill> fills;
+    std::vector<UCHAR> buffer(8 * IMSCSI_CACHE_LINE_SIZE);
+    uint64_t state = 21;
+    unsigned stale = 0;
+    unsigned hits = 0;
+    unsigned filled = 0;
+
+    for (size_t i = 0; i < device.size(); i++)
+    {
+        device[i] = (UCHAR)ImTestRandom(&state);
+    }
+
+    for (int step = 0; step < 200000; step++)
+    {
+        unsigned op = ImTestRandom(&state) % 8;
+        ULONG length = (1 + ImTestRandom(&state) % 16) << 9;
+        LONGLONG offset = (LONGLONG)(ImTestRandom(&state) %
+            (((device.size() - length) >> 9) + 1)) << 9;
+
+        switch (op)
+        {
+        case 0:
+        case 1:
+        {
+            // Write goes to device and cache
+            for (ULONG i = 0; i < length; i++)
+            {
+                buffer[i] = (UCHAR)ImTestRandom(&state);
+            }
+
+            memcpy(&device[offset], buffer.data(), length);
+            ImScsiCacheWrite(&c.cache, offset, length, buffer.data());
+            break;
+        }
+
+        case 2:
+            if (ImTestRandom(&state) % 8 == 0)
+            {
+                memset(&device[offset], 0, length);
+                ImScsiCacheInvalidate(&c.cache, offset, length);
+            }
+            break;
+
+        case 3:
+        case 4:
+        {
+            // Start reading from device
+            if (fills.size() < CACHE_TEST_FILLS)
+            {
+                CacheTestFill fill;
+                fill.generation = c.cache.generation;
+                fill.offset = offset;
+                fill.data.assign(device.begin() + offset,
+                    device.begin() + offset + length);
+                fills.push_back(fill);
+            }
+            break;
+        }
+
+        case 5:
+            // Read completes, in any order
+            if (!fills.empty())
+            {
+                size_t index = ImTestRandom(&state) % fills.size();
+                CacheTestFill &fill = fills[index];
+
+                ImScsiCacheFill(&c.cache, fill.generation, fill.offset,
+                    (ULONG)fill.data.size(), fill.data.data());
+
+                fills[index] = fills.back();
+                fills.pop_back();
+                filled++;
+            }
+            break;
+
+        default:
+            if (ImScsiCacheRead(&c.cache, offset, length, buffer.data()))
+            {
+                hits++;
+
+                if (memcmp(buffer.data(), &device[offset], length) != 0)
+                {
+                    stale++;
+                }
+            }
+            break;
+        }
+    }
+
+    printf("%u fills, %u hits, %u stale\n", filled, hits, stale);
+
+    IMTEST_CHECK(stale == 0);
+    IMTEST_CHECK(hits > 1000);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestSizing);
+    IMTEST_RUN(TestFillAndRead);
+    IMTEST_RUN(TestClockReplacement);
+    IMTEST_RUN(TestWriteAndInvalidate);
+    IMTEST_RUN(TestFillAfterWriteElsewhere);
+    IMTEST_RUN(TestRandomAgainstDevice);
+
+    return IMTEST_RESULT();
+}
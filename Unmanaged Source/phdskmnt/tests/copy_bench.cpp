@@ -0,0 +1,125 @@
+/// copy_bench.cpp
+/// VM (RAM) disk read and write throughput at request sizes 4 KB to 4 MB,
+/// comparing the copy through a temporary buffer that VM disk requests used
+/// to take, a direct memcpy between request buffer and image, and the copy
+/// functions in imscsicopy.h. Requests are at random offsets in an image
+/// much larger than processor caches, request buffer is reused and stays in
+/// cache. Streaming stores only pay off when writing to the image.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsicopy.h>
+
+#include <stdlib.h>
+#include <vector>
+
+static const size_t BenchImageSize = 512UL << 20;
+static const size_t BenchBytes = 4UL << 30;
+
+enum BenchMethod
+{
+    BenchTemporaryBuffer,
+    BenchMemcpy,
+    BenchVMDiskCopy
+};
+
+static void
+BenchCopy(void *Destination, const void *Source, size_t Length,
+    BenchMethod Method, int ToImage)
+{
+    switch (Method)
+    {
+    case BenchTemporaryBuffer:
+    {
+        // Buffer allocated for each request, copied into and out of
+        void *buffer = malloc(Length);
+        memcpy(buffer, Source, Length);
+        memcpy(Destination, buffer, Length);
+        free(buffer);
+        break;
+    }
+
+    case BenchMemcpy:
+        memcpy(Destination, Source, Length);
+        break;
+
+    case BenchVMDiskCopy:
+        if (ToImage)
+        {
+            ImScsiCopyToVMDisk(Destination, Source, Length);
+        }
+        else
+        {
+            ImScsiCopyFromVMDisk(Destination, Source, Length);
+        }
+        break;
+    }
+}
+
+///
+/// Returns MB/s for requests of Length bytes, reads from image into request
+/// buffer if Write is zero, otherwise the other way.
+///
+static double
+BenchRun(BenchMethod Method, UCHAR *Image, UCHAR *Request, size_t Length,
+    int Write)
+{
+    uint64_t seed = Length;
+    size_t requests = BenchBytes / Length;
+    size_t slots = BenchImageSize / Length;
+
+    double start = ImTestSeconds();
+
+    for (size_t i = 0; i < requests; i++)
+    {
+        UCHAR *disk = Image + (ImTestRandom(&seed) % slots) * Length;
+
+        if (Write)
+        {
+            BenchCopy(disk, Request, Length, Method, 1);
+        }
+        else
+        {
+            BenchCopy(Request, disk, Length, Method, 0);
+        }
+    }
+
+    return BenchBytes / (ImTestSeconds() - start) / (1 << 20);
+}
+
+int
+main()
+{
+    std::vector<UCHAR> image(BenchImageSize, 0x5A);
+    std::vector<UCHAR> request(4UL << 20, 0xA5);
+
+    printf("%8s %6s %12s %12s %12s\n", "KB", "op", "temp MB/s",
+        "memcpy MB/s", "vmcopy MB/s");
+
+    for (size_t length = 4UL << 10; length <= (4UL << 20); length <<= 2)
+    {
+        for (int write = 0; write < 2; write++)
+        {
+            double temp = BenchRun(BenchTemporaryBuffer, image.data(),
+                request.data(), length, write);
+            double direct = BenchRun(BenchMemcpy, image.data(),
+                request.data(), length, write);
+            double vmcopy = BenchRun(BenchVMDiskCopy, image.data(),
+                request.data(), length, write);
+
+            printf("%8u %6s %12.0f %12.0f %12.0f\n", (unsigned)(length >> 10),
+                write ? "write" : "read", temp, direct, vmcopy);
+        }
+    }
+
+    return 0;
+}
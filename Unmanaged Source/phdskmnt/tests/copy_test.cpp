@@ -0,0 +1,152 @@
+/// copy_test.cpp
+/// Tests for VM disk memory copy in imscsicopy.h. Copies are checked for
+/// all alignments of source and destination, for lengths around the
+/// streaming store threshold and around the 64 byte loop, and for bytes
+/// just outside destination range being left alone.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsicopy.h>
+
+#include <vector>
+
+static const size_t CopyTestGuard = 64;
+
+///
+/// Copies Length bytes between buffers at given misalignments and returns
+/// false if copy is wrong or bytes around destination were changed.
+///
+static bool
+CopyTestOne(void (*Copy)(void*, const void*, size_t),
+    size_t DstAlign, size_t SrcAlign, size_t Length, uint64_t *State)
+{
+    std::vector<UCHAR> src(Length + 2 * CopyTestGuard);
+    std::vector<UCHAR> dst(Length + 2 * CopyTestGuard);
+
+    for (size_t i = 0; i < src.size(); i++)
+    {
+        src[i] = (UCHAR)ImTestRandom(State);
+        dst[i] = 0xCC;
+    }
+
+    // Vector data is 16 byte aligned, so offset picks alignment
+    UCHAR *to = dst.data() + CopyTestGuard / 2 + DstAlign;
+    const UCHAR *from = src.data() + CopyTestGuard / 2 + SrcAlign;
+
+    Copy(to, from, Length);
+
+    if (memcmp(to, from, Length) != 0)
+    {
+        return false;
+    }
+
+    for (UCHAR *p = dst.data(); p < to; p++)
+    {
+        if (*p != 0xCC)
+        {
+            return false;
+        }
+    }
+
+    for (UCHAR *p = to + Length; p < dst.data() + dst.size(); p++)
+    {
+        if (*p != 0xCC)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+TestSmallLengthsAllAlignments()
+{
+    uint64_t state = 3;
+    unsigned errors = 0;
+
+    for (size_t dst_align = 0; dst_align < 16; dst_align++)
+    {
+        for (size_t src_align = 0; src_align < 16; src_align++)
+        {
+            for (size_t length = 0; length <= 200; length++)
+            {
+                if (!CopyTestOne(ImScsiCopyFromVMDisk, dst_align,
+                    src_align, length, &state) ||
+                    !CopyTestOne(ImScsiCopyToVMDisk, dst_align,
+                    src_align, length, &state))
+                {
+                    errors++;
+                }
+
+#if defined(IMSCSI_COPY_STREAMING)
+                // Streaming copy itself, even below threshold
+                if (!CopyTestOne(ImScsiCopyStreaming, dst_align,
+                    src_align, length, &state))
+                {
+                    errors++;
+                }
+#endif
+            }
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+static void
+TestAroundThreshold()
+{
+    uint64_t state = 5;
+    unsigned errors = 0;
+
+    for (size_t dst_align = 0; dst_align < 16; dst_align += 3)
+    {
+        for (size_t src_align = 0; src_align < 16; src_align += 5)
+        {
+            for (size_t length = IMSCSI_NON_TEMPORAL_COPY_MIN - 65;
+                length <= IMSCSI_NON_TEMPORAL_COPY_MIN + 65;
+                length += 13)
+            {
+                if (!CopyTestOne(ImScsiCopyToVMDisk, dst_align,
+                    src_align, length, &state))
+                {
+                    errors++;
+                }
+            }
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+static void
+TestLargeRequests()
+{
+    uint64_t state = 7;
+
+    IMTEST_CHECK(CopyTestOne(ImScsiCopyFromVMDisk, 0, 0, 1UL << 20, &state));
+    IMTEST_CHECK(CopyTestOne(ImScsiCopyToVMDisk, 0, 0, 1UL << 20, &state));
+    IMTEST_CHECK(CopyTestOne(ImScsiCopyToVMDisk, 8, 0, 1UL << 20, &state));
+    IMTEST_CHECK(CopyTestOne(ImScsiCopyToVMDisk, 1, 15,
+        (4UL << 20) + 511, &state));
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestSmallLengthsAllAlignments);
+    IMTEST_RUN(TestAroundThreshold);
+    IMTEST_RUN(TestLargeRequests);
+
+    return IMTEST_RESULT();
+}
@@ -0,0 +1,67 @@
+/// imtest.h
+/// Minimal check and timing helpers for host tests of portable headers in
+/// ../inc. Each test is a separate program that returns non-zero if any
+/// check failed.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#ifndef _INC_IMTEST_
+#define _INC_IMTEST_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+int imtest_checks = 0;
+int imtest_failures = 0;
+
+#define IMTEST_CHECK(cond) \
+    do { \
+        imtest_checks++; \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            imtest_failures++; \
+        } \
+    } while (0)
+
+#define IMTEST_RUN(test) \
+    do { \
+        int failures_before = imtest_failures; \
+        test(); \
+        printf("%-40s %s\n", #test, imtest_failures == failures_before ? "ok" : "FAILED"); \
+    } while (0)
+
+#define IMTEST_RESULT() \
+    (printf("%d checks, %d failed\n", imtest_checks, imtest_failures), \
+    imtest_failures != 0)
+
+static inline double
+ImTestSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+///
+/// Small deterministic generator, so that failures can be reproduced.
+///
+static inline uint32_t
+ImTestRandom(uint64_t *State)
+{
+    *State = *State * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(*State >> 33);
+}
+
+#endif // _INC_IMTEST_
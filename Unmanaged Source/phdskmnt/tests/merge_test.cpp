@@ -0,0 +1,288 @@
+/// merge_test.cpp
+/// Tests for merging of queued requests in imscsimerge.h, including limits
+/// on merged length and request count, and splitting of short transfers.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsimerge.h>
+
+static void
+TestLengthLimit()
+{
+    IMSCSI_MERGE merge;
+    ImScsiMergeInit(&merge, 0, 0x3000, 0, 0x4000);
+
+    // Exactly up to limit, not a byte more
+    IMTEST_CHECK(ImScsiMergeCanAppend(&merge, 0x3000, 0x1000, 0));
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x3000, 0x1001, 0));
+
+    // Request larger than limit on its own, must not wrap around
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x3000, 0xFFFFF000, 0));
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x3000, 0x4001, 0));
+
+    // Empty requests are never merged
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x3000, 0, 0));
+
+    // Direction has to match for adjacent requests as well
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x3000, 0x200, 1));
+
+    ImScsiMergeAppend(&merge, 0x3000, 0x1000);
+
+    IMTEST_CHECK(merge.length == 0x4000);
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x4000, 0x200, 0));
+
+    // First request may already be larger than limit, nothing is appended
+    ImScsiMergeInit(&merge, 0, 0x8000, 1, 0x4000);
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x8000, 0x200, 1));
+}
+
+static void
+TestRequestCountLimit()
+{
+    IMSCSI_MERGE merge;
+    ImScsiMergeInit(&merge, 0, 0x200, 1, 0x100000);
+
+    for (ULONG i = 1; i < IMSCSI_MERGE_MAX_REQUESTS; i++)
+    {
+        IMTEST_CHECK(ImScsiMergeCanAppend(&merge, merge.end, 0x200, 1));
+        IMTEST_CHECK(ImScsiMergeAppend(&merge, merge.end, 0x200) == i);
+    }
+
+    IMTEST_CHECK(merge.count == IMSCSI_MERGE_MAX_REQUESTS);
+    IMTEST_CHECK(merge.extent_count == 1);
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, merge.end, 0x200, 1));
+}
+
+static void
+TestShortTransfer()
+{
+    IMSCSI_MERGE merge;
+    ImScsiMergeInit(&merge, 0x10000, 0x1000, 0, 0x100000);
+    ImScsiMergeAllowGaps(&merge, 0x10000);
+    ImScsiMergeAppend(&merge, 0x11000, 0x800);
+    ImScsiMergeAppend(&merge, 0x14000, 0x1000);
+
+    // Everything transferred
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 0, 0x2800) == 0x1000);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 1, 0x2800) == 0x800);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 2, 0x2800) == 0x1000);
+
+    // Nothing transferred
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 0, 0) == 0);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 2, 0) == 0);
+
+    // Ends exactly at a request boundary
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 0, 0x1000) == 0x1000);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 1, 0x1000) == 0);
+
+    // Ends within a request, which is cut, later ones get nothing
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 0, 0x1200) == 0x1000);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 1, 0x1200) == 0x200);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 2, 0x1200) == 0);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 1, 0x17FF) == 0x7FF);
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 2, 0x1801) == 1);
+
+    // More than merged length, as from a misbehaving proxy
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 2, 0xFFFFFFFF) == 0x1000);
+
+    // Index beyond merged requests
+    IMTEST_CHECK(ImScsiMergeGetTransferred(&merge, 3, 0x2800) == 0);
+    IMTEST_CHECK(ImScsiMergeGetPosition(&merge, 3) == 0x2800);
+    IMTEST_CHECK(ImScsiMergeGetPosition(&merge, 100) == 0x2800);
+}
+
+static void
+TestShortTransferSumsUp()
+{
+    uint64_t state = 5;
+
+    for (int round = 0; round < 10000; round++)
+    {
+        IMSCSI_MERGE merge;
+        ImScsiMergeInit(&merge, 0, 512 * (1 + ImTestRandom(&state) % 8), 0,
+            0x100000);
+
+        while (ImTestRandom(&state) % 8 != 0)
+        {
+            ULONG length = 512 * (1 + ImTestRandom(&state) % 8);
+
+            if (!ImScsiMergeCanAppend(&merge, merge.end, length, 0))
+            {
+                break;
+            }
+
+            ImScsiMergeAppend(&merge, merge.end, length);
+        }
+
+        ULONG done = (ULONG)(ImTestRandom(&state) % (merge.length + 1));
+        ULONG total = 0;
+        ULONG cut = 0;
+
+        for (ULONG i = 0; i < merge.count; i++)
+        {
+            ULONG transferred = ImScsiMergeGetTransferred(&merge, i, done);
+
+            if (transferred != 0 && transferred != merge.lengths[i])
+            {
+                cut++;
+            }
+
+            // Nothing after the request that was cut or left empty
+            IMTEST_CHECK(total == ImScsiMergeGetPosition(&merge, i) ||
+                transferred == 0);
+
+            total += transferred;
+        }
+
+        IMTEST_CHECK(total == done);
+        IMTEST_CHECK(cut <= 1);
+    }
+}
+
+static void
+TestGapsNotAllowedByDefault()
+{
+    IMSCSI_MERGE merge;
+    ImScsiMergeInit(&merge, 0x10000, 0x1000, 1, 0x100000);
+
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x12000, 0x1000, 1));
+    IMTEST_CHECK(ImScsiMergeCanAppend(&merge, 0x11000, 0x1000, 1));
+}
+
+static void
+TestGapsWithinSpan()
+{
+    IMSCSI_MERGE merge;
+    ImScsiMergeInit(&merge, 0x10000, 0x1000, 0, 0x100000);
+    ImScsiMergeAllowGaps(&merge, 0x8000);
+
+    // Overlapping or earlier requests are never appended
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x10800, 0x1000, 0));
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0xF000, 0x1000, 0));
+
+    // Last request that ends exactly at end of span
+    IMTEST_CHECK(ImScsiMergeCanAppend(&merge, 0x17000, 0x1000, 0));
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x17000, 0x1001, 0));
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x18000, 0x200, 0));
+
+    // Direction still has to match
+    IMTEST_CHECK(!ImScsiMergeCanAppend(&merge, 0x12000, 0x1000, 1));
+}
+
+static void
+TestExtents()
+{
+    IMSCSI_MERGE merge;
+    ImScsiMergeInit(&merge, 0x10000, 0x1000, 0, 0x100000);
+    ImScsiMergeAllowGaps(&merge, 0x10000);
+
+    IMTEST_CHECK(ImScsiMergeAppend(&merge, 0x11000, 0x1000) == 1);
+    IMTEST_CHECK(merge.extent_count == 1);
+
+    IMTEST_CHECK(ImScsiMergeCanAppend(&merge, 0x14000, 0x800, 0));
+    IMTEST_CHECK(ImScsiMergeAppend(&merge, 0x14000, 0x800) == 2);
+    IMTEST_CHECK(ImScsiMergeAppend(&merge, 0x14800, 0x800) == 3);
+    IMTEST_CHECK(ImScsiMergeAppend(&merge, 0x18000, 0x1000) == 4);
+
+    IMTEST_CHECK(merge.count == 5);
+    IMTEST_CHECK(merge.extent_count == 3);
+    IMTEST_CHECK(merge.end == 0x19000);
+    IMTEST_CHECK(merge.length == 0x4000);
+
+    IMDPROXY_EXTENT extents[IMSCSI_MERGE_MAX_REQUESTS];
+    IMTEST_CHECK(ImScsiMergeGetExtents(&merge, extents) == 3);
+
+    IMTEST_CHECK(extents[0].offset == 0x10000 && extents[0].length == 0x2000);
+    IMTEST_CHECK(extents[1].offset == 0x14000 && extents[1].length == 0x1000);
+    IMTEST_CHECK(extents[2].offset == 0x18000 && extents[2].length == 0x1000);
+
+    // Data is concatenated in merged buffer regardless of gaps
+    IMTEST_CHECK(ImScsiMergeGetPosition(&merge, 2) == 0x2000);
+    IMTEST_CHECK(ImScsiMergeGetPosition(&merge, 4) == 0x3000);
+}
+
+static void
+TestExtentsMatchRequests()
+{
+    uint64_t state = 3;
+
+    for (int round = 0; round < 10000; round++)
+    {
+        IMSCSI_MERGE merge;
+        ImScsiMergeInit(&merge, 0, 512 * (1 + ImTestRandom(&state) % 8), 1,
+            0x100000);
+        ImScsiMergeAllowGaps(&merge, 0x40000);
+
+        for (;;)
+        {
+            LONGLONG offset = merge.end +
+                512 * (ImTestRandom(&state) % 2 ? 0 : ImTestRandom(&state) % 16);
+            ULONG length = 512 * (1 + ImTestRandom(&state) % 8);
+
+            if (!ImScsiMergeCanAppend(&merge, offset, length, 1))
+            {
+                break;
+            }
+
+            ImScsiMergeAppend(&merge, offset, length);
+        }
+
+        IMDPROXY_EXTENT extents[IMSCSI_MERGE_MAX_REQUESTS];
+        ULONG count = ImScsiMergeGetExtents(&merge, extents);
+
+        IMTEST_CHECK(count == merge.extent_count);
+        IMTEST_CHECK(merge.end - merge.offset <= 0x40000 ||
+            merge.count == 1);
+
+        // Walking extents and buffer in step finds each request
+        ULONG request = 0;
+        ULONG position = 0;
+        ULONGLONG total = 0;
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            ULONGLONG offset = extents[i].offset;
+
+            while (request < merge.count &&
+                offset < extents[i].offset + extents[i].length)
+            {
+                IMTEST_CHECK((ULONGLONG)merge.offsets[request] == offset);
+                IMTEST_CHECK(ImScsiMergeGetPosition(&merge, request) == position);
+
+                offset += merge.lengths[request];
+                position += merge.lengths[request];
+                request++;
+            }
+
+            IMTEST_CHECK(offset == extents[i].offset + extents[i].length);
+            total += extents[i].length;
+        }
+
+        IMTEST_CHECK(request == merge.count);
+        IMTEST_CHECK(total == merge.length);
+    }
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestLengthLimit);
+    IMTEST_RUN(TestRequestCountLimit);
+    IMTEST_RUN(TestShortTransfer);
+    IMTEST_RUN(TestShortTransferSumsUp);
+    IMTEST_RUN(TestGapsNotAllowedByDefault);
+    IMTEST_RUN(TestGapsWithinSpan);
+    IMTEST_RUN(TestExtents);
+    IMTEST_RUN(TestExtentsMatchRequests);
+
+    return IMTEST_RESULT();
+}
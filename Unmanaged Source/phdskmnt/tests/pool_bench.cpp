@@ -0,0 +1,416 @@
+/// pool_bench.cpp
+/// Time and allocator calls per I/O for the work item and data buffer that
+/// each request needs, allocated with malloc and free for every I/O as the
+/// driver did before, or taken from free lists governed by imscsipool.h as
+/// ImScsiAllocateWorkItem and ImScsiAllocateBuffer do. Free lists have the
+/// capacity that ImScsiResizePools gives one LU, work items are allocated
+/// up front, buffers are kept as they are freed. A window of 1 to 64
+/// requests is kept in flight and the oldest one is completed before the
+/// next is started. One byte per page of each buffer is written, as data
+/// would be, so that page faults in fresh allocations are counted too.
+///
+/// Workloads:
+///  4K          4 KB requests only.
+///  64K         64 KB requests only.
+///  mixed       512 bytes to 1 MB, any multiple of 512 bytes, most of them
+///              small.
+///  2M          2 MB requests, above largest class, always from allocator.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsipool.h>
+
+#include <mutex>
+#include <vector>
+
+#ifndef MINLONG
+#define MINLONG ((LONG)0x80000000)
+#endif
+
+static const int BenchRequests = 200000;
+static const ULONG BenchWorkItemSize = 128;
+
+static size_t BenchAllocatorCalls;
+
+///
+/// Same as a pool class in driver, std::mutex in place of spin lock.
+///
+struct BenchEntry
+{
+    BenchEntry *Next;
+};
+
+struct BenchPoolClass
+{
+    std::mutex Lock;
+    BenchEntry *FreeList;
+    IMSCSI_POOL_STATE State;
+};
+
+struct BenchPools
+{
+    BenchPoolClass WorkItemPool;
+    BenchPoolClass BufferPool[IMSCSI_POOL_CLASSES];
+    BenchPoolClass LargeBufferPool;
+};
+
+static void *
+BenchAllocatorAllocate(size_t Size)
+{
+    BenchAllocatorCalls++;
+    return malloc(Size);
+}
+
+static void *
+BenchPoolAllocate(BenchPoolClass *PoolClass, size_t Size)
+{
+    BenchEntry *entry;
+
+    {
+        std::lock_guard<std::mutex> lock(PoolClass->Lock);
+
+        entry = PoolClass->FreeList;
+
+        if (entry != NULL)
+        {
+            PoolClass->FreeList = entry->Next;
+        }
+
+        ImScsiPoolCountAllocate(&PoolClass->State, entry != NULL);
+    }
+
+    if (entry != NULL)
+    {
+        return entry;
+    }
+
+    return BenchAllocatorAllocate(Size);
+}
+
+static void
+BenchPoolFree(BenchPoolClass *PoolClass, void *Entry)
+{
+    bool keep;
+
+    {
+        std::lock_guard<std::mutex> lock(PoolClass->Lock);
+
+        keep = ImScsiPoolCountFree(&PoolClass->State) != 0;
+
+        if (keep)
+        {
+            ((BenchEntry*)Entry)->Next = PoolClass->FreeList;
+            PoolClass->FreeList = (BenchEntry*)Entry;
+        }
+    }
+
+    if (!keep)
+    {
+        free(Entry);
+    }
+}
+
+static void
+BenchPoolSetCapacity(BenchPoolClass *PoolClass, LONG Change, bool Fill)
+{
+    ULONG missing;
+    ULONG excess = ImScsiPoolChangeCapacity(&PoolClass->State, Change,
+        &missing);
+
+    while (excess-- > 0)
+    {
+        BenchEntry *entry = PoolClass->FreeList;
+        PoolClass->FreeList = entry->Next;
+        free(entry);
+    }
+
+    while (Fill && missing-- > 0)
+    {
+        BenchEntry *entry = (BenchEntry*)malloc(PoolClass->State.Size);
+        entry->Next = PoolClass->FreeList;
+        PoolClass->FreeList = entry;
+        PoolClass->State.FreeCount++;
+    }
+}
+
+static BenchPoolClass *
+BenchBufferPoolClass(BenchPools *Pools, ULONG Size)
+{
+    ULONG index = ImScsiPoolClassIndex(Size);
+
+    if (index < IMSCSI_POOL_CLASSES)
+    {
+        return &Pools->BufferPool[index];
+    }
+
+    return &Pools->LargeBufferPool;
+}
+
+static void
+BenchPoolsInitialize(BenchPools *Pools)
+{
+    Pools->WorkItemPool.FreeList = NULL;
+    memset(&Pools->WorkItemPool.State, 0, sizeof(IMSCSI_POOL_STATE));
+    Pools->WorkItemPool.State.Size = BenchWorkItemSize;
+
+    for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        Pools->BufferPool[i].FreeList = NULL;
+        memset(&Pools->BufferPool[i].State, 0, sizeof(IMSCSI_POOL_STATE));
+        Pools->BufferPool[i].State.Size = ImScsiPoolClassSize(i);
+    }
+
+    Pools->LargeBufferPool.FreeList = NULL;
+    memset(&Pools->LargeBufferPool.State, 0, sizeof(IMSCSI_POOL_STATE));
+
+    // ImScsiResizePools(1) for one LU
+    BenchPoolSetCapacity(&Pools->WorkItemPool, IMSCSI_POOL_WORK_ITEMS_PER_LU,
+        true);
+
+    for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        BenchPoolSetCapacity(&Pools->BufferPool[i],
+            (LONG)ImScsiPoolBuffersPerLU(i), false);
+    }
+}
+
+static void
+BenchPoolsFree(BenchPools *Pools)
+{
+    BenchPoolSetCapacity(&Pools->WorkItemPool, MINLONG, false);
+
+    for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        BenchPoolSetCapacity(&Pools->BufferPool[i], MINLONG, false);
+    }
+}
+
+struct BenchIo
+{
+    void *WorkItem;
+    void *Buffer;
+    ULONG Size;
+};
+
+static void
+BenchTouch(void *Buffer, ULONG Size)
+{
+    volatile UCHAR *data = (volatile UCHAR*)Buffer;
+
+    for (ULONG i = 0; i < Size; i += 4096)
+    {
+        data[i] = (UCHAR)i;
+    }
+}
+
+static void
+BenchStart(BenchPools *Pools, BenchIo *Io, ULONG Size)
+{
+    Io->Size = Size;
+
+    if (Pools == NULL)
+    {
+        Io->WorkItem = BenchAllocatorAllocate(BenchWorkItemSize);
+        Io->Buffer = BenchAllocatorAllocate(Size);
+    }
+    else
+    {
+        BenchPoolClass *pool_class = BenchBufferPoolClass(Pools, Size);
+
+        Io->WorkItem = BenchPoolAllocate(&Pools->WorkItemPool,
+            BenchWorkItemSize);
+        Io->Buffer = BenchPoolAllocate(pool_class,
+            pool_class->State.Size != 0 ? pool_class->State.Size : Size);
+    }
+
+    BenchTouch(Io->WorkItem, BenchWorkItemSize);
+    BenchTouch(Io->Buffer, Size);
+}
+
+static void
+BenchComplete(BenchPools *Pools, BenchIo *Io)
+{
+    if (Pools == NULL)
+    {
+        free(Io->Buffer);
+        free(Io->WorkItem);
+    }
+    else
+    {
+        BenchPoolFree(BenchBufferPoolClass(Pools, Io->Size), Io->Buffer);
+        BenchPoolFree(&Pools->WorkItemPool, Io->WorkItem);
+    }
+}
+
+///
+/// Returns ns per I/O. Allocations is set to allocator calls per I/O, Hits
+/// to share of work item and buffer allocations served from free lists.
+///
+static double
+BenchRun(const std::vector<ULONG> &Sizes, int Depth, bool Pool,
+    double *Allocations, double *Hits)
+{
+    BenchPools pools;
+    BenchPools *pools_used = NULL;
+    std::vector<BenchIo> window(Depth);
+
+    if (Pool)
+    {
+        BenchPoolsInitialize(&pools);
+        pools_used = &pools;
+    }
+
+    for (int i = 0; i < Depth; i++)
+    {
+        BenchStart(pools_used, &window[i], Sizes[i]);
+    }
+
+    BenchAllocatorCalls = 0;
+
+    if (Pool)
+    {
+        pools.WorkItemPool.State.Allocations = 0;
+        pools.WorkItemPool.State.Hits = 0;
+
+        for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+        {
+            pools.BufferPool[i].State.Allocations = 0;
+            pools.BufferPool[i].State.Hits = 0;
+        }
+
+        pools.LargeBufferPool.State.Allocations = 0;
+    }
+
+    double start = ImTestSeconds();
+
+    for (size_t i = Depth; i < Sizes.size(); i++)
+    {
+        BenchIo *io = &window[i % Depth];
+
+        BenchComplete(pools_used, io);
+        BenchStart(pools_used, io, Sizes[i]);
+    }
+
+    double ns = (ImTestSeconds() - start) * 1e9 / (Sizes.size() - Depth);
+
+    *Allocations = (double)BenchAllocatorCalls / (Sizes.size() - Depth);
+    *Hits = 0;
+
+    if (Pool)
+    {
+        ULONGLONG allocations = pools.WorkItemPool.State.Allocations +
+            pools.LargeBufferPool.State.Allocations;
+        ULONGLONG hits = pools.WorkItemPool.State.Hits;
+
+        for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+        {
+            allocations += pools.BufferPool[i].State.Allocations;
+            hits += pools.BufferPool[i].State.Hits;
+        }
+
+        *Hits = (double)hits / allocations;
+    }
+
+    for (int i = 0; i < Depth; i++)
+    {
+        BenchComplete(pools_used, &window[i]);
+    }
+
+    if (Pool)
+    {
+        BenchPoolsFree(&pools);
+    }
+
+    return ns;
+}
+
+static ULONG
+BenchSize4K(uint64_t *State)
+{
+    (void)State;
+    return 4096;
+}
+
+static ULONG
+BenchSize64K(uint64_t *State)
+{
+    (void)State;
+    return 65536;
+}
+
+static ULONG
+BenchSizeMixed(uint64_t *State)
+{
+    // Power of two 512 bytes to 1 MB, lower ones more likely, then any
+    // multiple of 512 up to that
+    ULONG shift = 9;
+
+    while (shift < 20 && ImTestRandom(State) % 3 != 0)
+    {
+        shift++;
+    }
+
+    return (ULONG)(1 + ImTestRandom(State) % (1UL << (shift - 9))) << 9;
+}
+
+static ULONG
+BenchSize2M(uint64_t *State)
+{
+    (void)State;
+    return 2UL << 20;
+}
+
+int
+main()
+{
+    static const struct
+    {
+        const char *name;
+        ULONG (*size)(uint64_t*);
+    } workloads[] = {
+        { "4K", BenchSize4K },
+        { "64K", BenchSize64K },
+        { "mixed", BenchSizeMixed },
+        { "2M", BenchSize2M },
+    };
+
+    printf("%-8s %6s %12s %8s %12s %12s %8s %8s\n", "sizes", "depth",
+        "malloc ns", "allocs", "pool ns", "pool allocs", "hit %", "speedup");
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(*workloads); w++)
+    {
+        std::vector<ULONG> sizes(BenchRequests);
+        uint64_t state = 37;
+
+        for (int i = 0; i < BenchRequests; i++)
+        {
+            sizes[i] = workloads[w].size(&state);
+        }
+
+        for (int depth = 1; depth <= 64; depth *= 4)
+        {
+            double malloc_allocations, pool_allocations;
+            double hits;
+
+            double malloc_ns = BenchRun(sizes, depth, false,
+                &malloc_allocations, &hits);
+            double pool_ns = BenchRun(sizes, depth, true, &pool_allocations,
+                &hits);
+
+            printf("%-8s %6d %12.0f %8.2f %12.0f %12.2f %8.1f %7.2fx\n",
+                workloads[w].name, depth, malloc_ns, malloc_allocations,
+                pool_ns, pool_allocations, hits * 100, malloc_ns / pool_ns);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,330 @@
+/// pool_test.cpp
+/// Tests for size classes and free list accounting in imscsipool.h. Besides
+/// class boundaries and capacity changes, runs a random mix of allocations,
+/// frees and LU creation and removal through a model of the free lists in
+/// utils.cpp, with some allocations failing, and checks that counters agree
+/// with the lists and that nothing is leaked when pools are freed.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsipool.h>
+
+#include <vector>
+
+#ifndef MINLONG
+#define MINLONG ((LONG)0x80000000)
+#endif
+
+static void
+TestClassBoundaries()
+{
+    IMTEST_CHECK(ImScsiPoolClassIndex(0) == 0);
+    IMTEST_CHECK(ImScsiPoolClassIndex(512) == 0);
+    IMTEST_CHECK(ImScsiPoolClassIndex(4096) == 0);
+    IMTEST_CHECK(ImScsiPoolClassIndex(4097) == 1);
+    IMTEST_CHECK(ImScsiPoolClassIndex(8192) == 1);
+    IMTEST_CHECK(ImScsiPoolClassIndex(65536) == 4);
+    IMTEST_CHECK(ImScsiPoolClassIndex(1UL << 20) == IMSCSI_POOL_CLASSES - 1);
+    IMTEST_CHECK(ImScsiPoolClassIndex((1UL << 20) + 1) == IMSCSI_POOL_CLASSES);
+    IMTEST_CHECK(ImScsiPoolClassIndex(0xFFFFFFFFUL) == IMSCSI_POOL_CLASSES);
+
+    for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        ULONG size = ImScsiPoolClassSize(i);
+
+        IMTEST_CHECK(ImScsiPoolClassIndex(size) == i);
+        IMTEST_CHECK(ImScsiPoolClassIndex(size + 1) == i + 1);
+        IMTEST_CHECK(ImScsiPoolBuffersPerLU(i) >= IMSCSI_POOL_MIN_BUFFERS_PER_LU);
+        IMTEST_CHECK(ImScsiPoolBuffersPerLU(i) * size <= IMSCSI_POOL_BYTES_PER_LU ||
+            ImScsiPoolBuffersPerLU(i) == IMSCSI_POOL_MIN_BUFFERS_PER_LU);
+    }
+
+    IMTEST_CHECK(ImScsiPoolBuffersPerLU(0) == 64);
+    IMTEST_CHECK(ImScsiPoolBuffersPerLU(IMSCSI_POOL_CLASSES - 1) ==
+        IMSCSI_POOL_MIN_BUFFERS_PER_LU);
+}
+
+static void
+TestCapacity()
+{
+    IMSCSI_POOL_STATE state = { };
+    ULONG missing;
+
+    // First LU, work items are filled right away
+    IMTEST_CHECK(ImScsiPoolChangeCapacity(&state, 32, &missing) == 0);
+    IMTEST_CHECK(state.Capacity == 32 && missing == 32);
+
+    state.FreeCount = 32;
+
+    // Second LU removed before any were used, nothing to free
+    IMTEST_CHECK(ImScsiPoolChangeCapacity(&state, 32, &missing) == 0);
+    IMTEST_CHECK(missing == 32);
+
+    IMTEST_CHECK(ImScsiPoolChangeCapacity(&state, -32, &missing) == 0);
+    IMTEST_CHECK(state.Capacity == 32 && missing == 0);
+
+    // Shrinking below free count gives back the difference
+    IMTEST_CHECK(ImScsiPoolChangeCapacity(&state, -20, &missing) == 20);
+    IMTEST_CHECK(state.Capacity == 12 && state.FreeCount == 12 && missing == 0);
+
+    // Capacity never goes below zero, as when pools are freed with MINLONG
+    IMTEST_CHECK(ImScsiPoolChangeCapacity(&state, -100, &missing) == 12);
+    IMTEST_CHECK(state.Capacity == 0 && state.FreeCount == 0);
+
+    state.Capacity = 5;
+    IMTEST_CHECK(ImScsiPoolChangeCapacity(&state, MINLONG, &missing) == 0);
+    IMTEST_CHECK(state.Capacity == 0 && missing == 0);
+}
+
+static void
+TestCounters()
+{
+    IMSCSI_POOL_STATE state = { };
+    ULONG missing;
+
+    ImScsiPoolChangeCapacity(&state, 2, &missing);
+
+    // Empty free list, three new entries, one of them fails
+    ImScsiPoolCountAllocate(&state, 0);
+    ImScsiPoolCountAllocate(&state, 0);
+    ImScsiPoolCountAllocate(&state, 0);
+    ImScsiPoolCountFailure(&state);
+
+    IMTEST_CHECK(state.InUse == 2 && state.HighWater == 3);
+    IMTEST_CHECK(state.Allocations == 3 && state.Failures == 1);
+
+    // Both kept, third would go back to pool
+    IMTEST_CHECK(ImScsiPoolCountFree(&state));
+    IMTEST_CHECK(ImScsiPoolCountFree(&state));
+    IMTEST_CHECK(state.FreeCount == 2 && state.InUse == 0);
+
+    ImScsiPoolCountAllocate(&state, 1);
+    ImScsiPoolCountAllocate(&state, 1);
+    ImScsiPoolCountAllocate(&state, 0);
+
+    IMTEST_CHECK(state.FreeCount == 0 && state.Hits == 2);
+    IMTEST_CHECK(state.InUse == 3 && state.HighWater == 3);
+
+    IMTEST_CHECK(ImScsiPoolCountFree(&state));
+    IMTEST_CHECK(ImScsiPoolCountFree(&state));
+    IMTEST_CHECK(!ImScsiPoolCountFree(&state));
+    IMTEST_CHECK(state.FreeCount == 2 && state.InUse == 0);
+}
+
+///
+/// Same steps as ImScsiPoolAllocate, ImScsiPoolFree and
+/// ImScsiPoolSetCapacity, with a vector for free list and a counter of
+/// entries allocated from pool.
+///
+struct PoolTestClass
+{
+    IMSCSI_POOL_STATE state;
+    std::vector<unsigned> free_list;
+};
+
+static unsigned pool_test_live = 0;
+static unsigned pool_test_next = 0;
+
+static bool
+PoolTestAllocate(PoolTestClass *PoolClass, bool Fail, unsigned *Entry)
+{
+    bool from_free_list = !PoolClass->free_list.empty();
+
+    if (from_free_list)
+    {
+        *Entry = PoolClass->free_list.back();
+        PoolClass->free_list.pop_back();
+    }
+
+    ImScsiPoolCountAllocate(&PoolClass->state, from_free_list);
+
+    if (from_free_list)
+    {
+        return true;
+    }
+
+    if (Fail)
+    {
+        ImScsiPoolCountFailure(&PoolClass->state);
+        return false;
+    }
+
+    pool_test_live++;
+    *Entry = pool_test_next++;
+    return true;
+}
+
+static void
+PoolTestFree(PoolTestClass *PoolClass, unsigned Entry)
+{
+    if (ImScsiPoolCountFree(&PoolClass->state))
+    {
+        PoolClass->free_list.push_back(Entry);
+    }
+    else
+    {
+        pool_test_live--;
+    }
+}
+
+static void
+PoolTestSetCapacity(PoolTestClass *PoolClass, LONG Change, bool Fill)
+{
+    ULONG missing;
+    ULONG excess = ImScsiPoolChangeCapacity(&PoolClass->state, Change,
+        &missing);
+
+    while (excess-- > 0)
+    {
+        PoolClass->free_list.pop_back();
+        pool_test_live--;
+    }
+
+    if (!Fill)
+    {
+        missing = 0;
+    }
+
+    while (missing-- > 0)
+    {
+        PoolClass->free_list.push_back(pool_test_next++);
+        PoolClass->state.FreeCount++;
+        pool_test_live++;
+    }
+}
+
+struct PoolTestEntry
+{
+    ULONG pool_class;
+    unsigned entry;
+};
+
+static void
+TestRandomAgainstModel()
+{
+    PoolTestClass classes[IMSCSI_POOL_CLASSES + 1] = { };
+    std::vector<PoolTestEntry> in_use;
+    uint64_t state = 17;
+    unsigned lu_count = 0;
+    unsigned counter_errors = 0;
+    unsigned long long failures = 0;
+
+    for (ULONG i = 0; i <= IMSCSI_POOL_CLASSES; i++)
+    {
+        classes[i].state.Size = i < IMSCSI_POOL_CLASSES ?
+            ImScsiPoolClassSize(i) : 0;
+    }
+
+    for (int step = 0; step < 400000; step++)
+    {
+        unsigned op = ImTestRandom(&state) % 100;
+
+        if (op < 2 || (op < 4 && lu_count > 0))
+        {
+            LONG change = op < 2 ? 1 : -1;
+            lu_count += change;
+
+            for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+            {
+                PoolTestSetCapacity(&classes[i],
+                    change * (LONG)ImScsiPoolBuffersPerLU(i), false);
+            }
+        }
+        else if (op < 52 || in_use.empty())
+        {
+            ULONG size = (ULONG)(1 + ImTestRandom(&state) % (2UL << 20));
+            PoolTestEntry entry;
+
+            entry.pool_class = ImScsiPoolClassIndex(size);
+
+            if (PoolTestAllocate(&classes[entry.pool_class],
+                ImTestRandom(&state) % 50 == 0, &entry.entry))
+            {
+                in_use.push_back(entry);
+            }
+            else
+            {
+                failures++;
+            }
+        }
+        else
+        {
+            size_t index = ImTestRandom(&state) % in_use.size();
+            PoolTestFree(&classes[in_use[index].pool_class],
+                in_use[index].entry);
+            in_use[index] = in_use.back();
+            in_use.pop_back();
+        }
+
+        ULONG in_use_total = 0;
+
+        for (ULONG i = 0; i <= IMSCSI_POOL_CLASSES; i++)
+        {
+            const IMSCSI_POOL_STATE *s = &classes[i].state;
+
+            if (s->FreeCount != classes[i].free_list.size() ||
+                s->FreeCount > s->Capacity ||
+                s->InUse > s->HighWater ||
+                s->Hits > s->Allocations)
+            {
+                counter_errors++;
+            }
+
+            in_use_total += s->InUse;
+        }
+
+        if (in_use_total != in_use.size())
+        {
+            counter_errors++;
+        }
+    }
+
+    IMTEST_CHECK(counter_errors == 0);
+    IMTEST_CHECK(failures > 0);
+
+    // Larger buffers are never kept
+    IMTEST_CHECK(classes[IMSCSI_POOL_CLASSES].state.Hits == 0);
+    IMTEST_CHECK(classes[0].state.Hits > 0);
+
+    unsigned long long failures_counted = 0;
+
+    for (ULONG i = 0; i <= IMSCSI_POOL_CLASSES; i++)
+    {
+        failures_counted += classes[i].state.Failures;
+    }
+
+    IMTEST_CHECK(failures_counted == failures);
+
+    while (!in_use.empty())
+    {
+        PoolTestFree(&classes[in_use.back().pool_class], in_use.back().entry);
+        in_use.pop_back();
+    }
+
+    for (ULONG i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        PoolTestSetCapacity(&classes[i], MINLONG, false);
+    }
+
+    IMTEST_CHECK(pool_test_live == 0);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestClassBoundaries);
+    IMTEST_RUN(TestCapacity);
+    IMTEST_RUN(TestCounters);
+    IMTEST_RUN(TestRandomAgainstModel);
+
+    return IMTEST_RESULT();
+}
@@ -0,0 +1,292 @@
+/// qos_test.cpp
+/// Tests for request rate limits and priority classes in imscsiqos.h. Time
+/// is simulated in 100 ns ticks, as from KeQueryInterruptTime. Besides
+/// refill and wait arithmetic, runs a stream of requests that waits as long
+/// as ImScsiQosAdmit says and checks that admitted rate stays within limit
+/// plus one burst, and that waiting that long is always enough.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsiqos.h>
+
+static const ULONGLONG Second = IMSCSI_QOS_TICKS_PER_SECOND;
+
+static void
+TestBurst()
+{
+    IMSCSI_QOS_BUCKET bucket = { };
+
+    // 100 ms of tokens, bucket starts out full
+    ImScsiQosSetRate(&bucket, 1000, 5);
+    IMTEST_CHECK(bucket.burst == 100);
+    IMTEST_CHECK(bucket.tokens == 100);
+    IMTEST_CHECK(bucket.last == 5);
+
+    // Always room for at least one
+    ImScsiQosSetRate(&bucket, 3, 0);
+    IMTEST_CHECK(bucket.burst == 1);
+
+    // Rates are capped so that arithmetic stays in 64 bits
+    ImScsiQosSetRate(&bucket, ~0ULL, 0);
+    IMTEST_CHECK(bucket.rate == IMSCSI_QOS_MAX_RATE);
+    IMTEST_CHECK(bucket.burst == IMSCSI_QOS_MAX_RATE / 10);
+}
+
+static void
+TestRefill()
+{
+    IMSCSI_QOS_BUCKET bucket = { };
+
+    ImScsiQosSetRate(&bucket, 1000, 0);
+    bucket.tokens = 0;
+
+    // 1 ms is one token, a fraction of a token is not added yet
+    ImScsiQosRefill(&bucket, Second / 1000);
+    IMTEST_CHECK(bucket.tokens == 1);
+
+    ImScsiQosRefill(&bucket, Second / 1000 + Second / 2000);
+    IMTEST_CHECK(bucket.tokens == 1);
+
+    // Clock going backwards or standing still adds nothing
+    ImScsiQosRefill(&bucket, 0);
+    IMTEST_CHECK(bucket.tokens == 1);
+
+    // but the half token is kept for next refill
+    ImScsiQosRefill(&bucket, 2 * Second / 1000);
+    IMTEST_CHECK(bucket.tokens == 2);
+
+    // Full after 100 ms, never more than burst
+    ImScsiQosRefill(&bucket, 10 * Second);
+    IMTEST_CHECK(bucket.tokens == 100);
+
+    // Debt is paid back at rate
+    bucket.tokens = -500;
+    ImScsiQosRefill(&bucket, 10 * Second + Second / 2);
+    IMTEST_CHECK(bucket.tokens == 0);
+
+    // Long idle periods, as after system sleep, do not overflow
+    ImScsiQosSetRate(&bucket, IMSCSI_QOS_MAX_RATE, 0);
+    bucket.tokens = 0;
+    ImScsiQosRefill(&bucket, ~0ULL);
+    IMTEST_CHECK(bucket.tokens == (LONGLONG)bucket.burst);
+
+    // Whole seconds and remainder are added up without rounding loss
+    ImScsiQosSetRate(&bucket, 3, 0);
+    bucket.burst = 1000;
+    bucket.tokens = 0;
+    ImScsiQosRefill(&bucket, 7 * Second + Second / 3 + 1);
+    IMTEST_CHECK(bucket.tokens == 22);
+}
+
+static void
+TestWait()
+{
+    IMSCSI_QOS_BUCKET bucket = { };
+
+    // No limit
+    IMTEST_CHECK(ImScsiQosGetWait(&bucket, 1ULL << 40) == 0);
+
+    ImScsiQosSetRate(&bucket, 1000, 0);
+    IMTEST_CHECK(ImScsiQosGetWait(&bucket, 100) == 0);
+
+    bucket.tokens = 0;
+
+    // Waiting the returned time is always enough
+    ULONGLONG wait = ImScsiQosGetWait(&bucket, 3);
+    IMTEST_CHECK(wait == 3 * Second / 1000 + 1);
+
+    ImScsiQosRefill(&bucket, wait);
+    IMTEST_CHECK(ImScsiQosGetWait(&bucket, 3) == 0);
+
+    // Same with a rate that does not divide ticks evenly
+    ImScsiQosSetRate(&bucket, 3, 0);
+    bucket.tokens = 0;
+
+    wait = ImScsiQosGetWait(&bucket, 1);
+    IMTEST_CHECK(wait == Second / 3 + 1);
+
+    ImScsiQosRefill(&bucket, wait - 1);
+    IMTEST_CHECK(ImScsiQosGetWait(&bucket, 1) != 0);
+
+    ImScsiQosRefill(&bucket, wait);
+    IMTEST_CHECK(ImScsiQosGetWait(&bucket, 1) == 0);
+
+    // Larger than burst only needs a full bucket
+    ImScsiQosSetRate(&bucket, 1000, 0);
+    IMTEST_CHECK(ImScsiQosGetWait(&bucket, 1000000) == 0);
+
+    bucket.tokens = 99;
+    IMTEST_CHECK(ImScsiQosGetWait(&bucket, 1000000) != 0);
+}
+
+static void
+TestAdmit()
+{
+    IMSCSI_QOS qos = { };
+
+    // No limits
+    IMTEST_CHECK(ImScsiQosAdmit(&qos, 16, 1ULL << 30, 0) == 0);
+    IMTEST_CHECK(qos.requests.tokens == 0 && qos.bytes.tokens == 0);
+
+    ImScsiQosSetLimits(&qos, 100, 1 << 20, 0);
+
+    // Request larger than byte burst goes through on a full bucket and
+    // leaves it in debt
+    IMTEST_CHECK(ImScsiQosAdmit(&qos, 1, 1 << 20, 0) == 0);
+    IMTEST_CHECK(qos.bytes.tokens < 0);
+    IMTEST_CHECK(qos.requests.tokens == 9);
+
+    // Next one waits for byte debt, request bucket is left as it is
+    ULONGLONG wait = ImScsiQosAdmit(&qos, 1, 4096, 0);
+    IMTEST_CHECK(wait > Second * 9 / 10);
+    IMTEST_CHECK(qos.requests.tokens == 9);
+
+    IMTEST_CHECK(ImScsiQosAdmit(&qos, 1, 4096, wait) == 0);
+
+    // Merged requests are charged for each request
+    ImScsiQosSetLimits(&qos, 100, 0, 0);
+    IMTEST_CHECK(ImScsiQosAdmit(&qos, 8, 1 << 20, 0) == 0);
+    IMTEST_CHECK(qos.requests.tokens == 2);
+    IMTEST_CHECK(ImScsiQosAdmit(&qos, 8, 1 << 20, 0) != 0);
+}
+
+///
+/// A slow limit checked every millisecond still adds up to its rate.
+///
+static void
+TestFrequentChecks()
+{
+    IMSCSI_QOS qos = { };
+    ULONGLONG admitted = 0;
+
+    ImScsiQosSetLimits(&qos, 7, 0, 0);
+
+    for (ULONGLONG now = 0; now < 10 * Second; now += Second / 1000)
+    {
+        if (ImScsiQosAdmit(&qos, 1, 512, now) == 0)
+        {
+            admitted++;
+        }
+    }
+
+    // Burst of one and then 7 per second
+    IMTEST_CHECK(admitted >= 69 && admitted <= 71);
+}
+
+///
+/// Requests of random size, each retried after the wait it was given,
+/// during 20 simulated seconds.
+///
+static void
+TestRateOverTime()
+{
+    static const ULONGLONG MaxRequests = 2000;
+    static const ULONGLONG MaxBytes = 50ULL << 20;
+
+    IMSCSI_QOS qos = { };
+    uint64_t state = 23;
+    ULONGLONG now = 0;
+    ULONGLONG requests = 0;
+    ULONGLONG bytes = 0;
+    unsigned retries = 0;
+    unsigned late = 0;
+
+    ImScsiQosSetLimits(&qos, MaxRequests, MaxBytes, now);
+
+    while (now < 20 * Second)
+    {
+        ULONG length = (ULONG)(512 << (ImTestRandom(&state) % 10));
+        ULONGLONG wait = ImScsiQosAdmit(&qos, 1, length, now);
+
+        if (wait != 0)
+        {
+            now += wait;
+
+            // Waiting as long as told is enough
+            if (ImScsiQosAdmit(&qos, 1, length, now) != 0)
+            {
+                late++;
+                continue;
+            }
+
+            retries++;
+        }
+
+        requests++;
+        bytes += length;
+
+        // Some time between requests
+        now += ImTestRandom(&state) % (Second / 5000);
+    }
+
+    printf("%llu requests, %llu MB in 20 s, %u waits\n",
+        (unsigned long long)requests, (unsigned long long)(bytes >> 20),
+        retries);
+
+    IMTEST_CHECK(late == 0);
+    IMTEST_CHECK(retries > 0);
+
+    // Within limit plus initial burst, and not far below it on either
+    // limit, whichever one is reached first
+    IMTEST_CHECK(requests <= MaxRequests * 20 + MaxRequests / 10 + 1);
+    IMTEST_CHECK(bytes <= MaxBytes * 20 + MaxBytes / 10 + (256 << 10));
+    IMTEST_CHECK(requests >= MaxRequests * 19 ||
+        bytes >= MaxBytes * 19);
+}
+
+static void
+TestYield()
+{
+    LONG active[IMSCSI_QOS_CLASSES] = { };
+
+    // Nothing to yield to
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_LOW) == 0);
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_BACKGROUND) == 0);
+
+    // High and normal never yield
+    active[IMSCSI_QOS_CLASS_HIGH] = 1;
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_HIGH) == 0);
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_NORMAL) == 0);
+
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_LOW) ==
+        Second / 1000);
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_BACKGROUND) ==
+        4 * Second / 1000);
+
+    // Background yields to low, low does not yield to background
+    active[IMSCSI_QOS_CLASS_HIGH] = 0;
+    active[IMSCSI_QOS_CLASS_LOW] = 2;
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_BACKGROUND) != 0);
+
+    active[IMSCSI_QOS_CLASS_LOW] = 0;
+    active[IMSCSI_QOS_CLASS_BACKGROUND] = 5;
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASS_LOW) == 0);
+
+    // Unknown classes are left alone
+    active[IMSCSI_QOS_CLASS_HIGH] = 1;
+    IMTEST_CHECK(ImScsiQosGetYield(active, IMSCSI_QOS_CLASSES) == 0);
+    IMTEST_CHECK(ImScsiQosGetYield(active, -1) == 0);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestBurst);
+    IMTEST_RUN(TestRefill);
+    IMTEST_RUN(TestWait);
+    IMTEST_RUN(TestAdmit);
+    IMTEST_RUN(TestFrequentChecks);
+    IMTEST_RUN(TestRateOverTime);
+    IMTEST_RUN(TestYield);
+
+    return IMTEST_RESULT();
+}
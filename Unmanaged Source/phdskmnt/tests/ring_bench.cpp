@@ -0,0 +1,224 @@
+/// ring_bench.cpp
+/// Round trips per second through shared memory proxy rings in imdshmring.h
+/// between a client process and a server process, with 1 to 16 requests in
+/// flight. Both sides either sleep on a futex as soon as their ring is
+/// empty, poll for a while first as driver and devio do, or only poll.
+/// Also reports futex wake and wait calls per request. Requests carry no
+/// data, so this is the cost of the rings and wakeups alone.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imdshmring.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+static const ULONG BenchSlots = 16;
+static const double BenchSeconds = 0.5;
+
+// Polls without ever sleeping
+static const unsigned BenchPollOnly = UINT_MAX;
+
+///
+/// Futex calls on each side, server counters in shared memory.
+///
+struct BenchStats
+{
+    volatile ULONG wakes;
+    volatile ULONG waits;
+};
+
+struct BenchShared
+{
+    IMDPROXY_SHM_RING_HEADER header;
+    BenchStats server;
+};
+
+static void
+BenchPush(PIMDPROXY_SHM_RING Ring, BenchStats *Stats)
+{
+    ImdProxyShmRingPush(Ring, BenchSlots, 0);
+
+    if (ImdProxyShmRingNeedsWakeup(Ring))
+    {
+        syscall(SYS_futex, &Ring->tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        Stats->wakes++;
+    }
+}
+
+///
+/// Returns false if Stop is set while ring is empty.
+///
+static bool
+BenchPop(PIMDPROXY_SHM_RING Ring, unsigned Spin, volatile ULONG *Stop,
+    BenchStats *Stats)
+{
+    unsigned idle = 0;
+    ULONG slot;
+
+    while (!ImdProxyShmRingPop(Ring, BenchSlots, &slot))
+    {
+        if (*Stop)
+        {
+            return false;
+        }
+
+        if (Spin == BenchPollOnly || idle < Spin)
+        {
+            idle++;
+            ImdProxyShmPause();
+            continue;
+        }
+
+        if (ImdProxyShmRingPrepareSleep(Ring))
+        {
+            ImdProxyShmRingFinishSleep(Ring);
+            continue;
+        }
+
+        struct timespec timeout = { 0, 100000000 };
+
+        syscall(SYS_futex, &Ring->tail, FUTEX_WAIT, Ring->head, &timeout,
+            NULL, 0);
+        Stats->waits++;
+
+        ImdProxyShmRingFinishSleep(Ring);
+    }
+
+    return true;
+}
+
+///
+/// Returns round trips per second. Wakes and Waits are set to futex calls
+/// per request on both sides together.
+///
+static double
+BenchRun(unsigned Spin, ULONG Depth, double *Wakes, double *Waits)
+{
+    char name[64];
+    snprintf(name, sizeof name, "/ring_bench.%d", (int)getpid());
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+    {
+        return 0;
+    }
+
+    shm_unlink(name);
+
+    void *mem = MAP_FAILED;
+
+    if (ftruncate(fd, sizeof(BenchShared)) == 0)
+    {
+        mem = mmap(NULL, sizeof(BenchShared), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    BenchShared *shared = (BenchShared*)mem;
+    PIMDPROXY_SHM_RING_HEADER header = &shared->header;
+
+    header->slot_count = BenchSlots;
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        while (BenchPop(&header->submission, Spin, &header->closed,
+            &shared->server))
+        {
+            BenchPush(&header->completion, &shared->server);
+        }
+
+        _exit(0);
+    }
+
+    BenchStats client = { 0, 0 };
+    volatile ULONG never = 0;
+    ULONGLONG completed = 0;
+
+    for (ULONG i = 0; i < Depth; i++)
+    {
+        BenchPush(&header->submission, &client);
+    }
+
+    double start = ImTestSeconds();
+    double seconds;
+
+    do
+    {
+        BenchPop(&header->completion, Spin, &never, &client);
+        completed++;
+
+        BenchPush(&header->submission, &client);
+
+        seconds = ImTestSeconds() - start;
+
+    } while (seconds < BenchSeconds);
+
+    header->closed = 1;
+    ImdProxyShmFullBarrier();
+    syscall(SYS_futex, &header->submission.tail, FUTEX_WAKE, INT_MAX, NULL,
+        NULL, 0);
+
+    waitpid(pid, NULL, 0);
+
+    *Wakes = (double)(client.wakes + shared->server.wakes) / completed;
+    *Waits = (double)(client.waits + shared->server.waits) / completed;
+
+    munmap(mem, sizeof(BenchShared));
+
+    return completed / seconds;
+}
+
+int
+main()
+{
+    static const struct
+    {
+        const char *name;
+        unsigned spin;
+    } modes[] = {
+        { "sleep", 0 },
+        { "poll+sleep", 20000 },
+        { "poll only", BenchPollOnly },
+    };
+
+    printf("%-12s %6s %12s %10s %8s %8s\n", "mode", "depth", "trips/s",
+        "us/trip", "wakes", "waits");
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(*modes); m++)
+    {
+        for (ULONG depth = 1; depth <= BenchSlots; depth *= 4)
+        {
+            double wakes = 0, waits = 0;
+            double rate = BenchRun(modes[m].spin, depth, &wakes, &waits);
+
+            printf("%-12s %6u %12.0f %10.2f %8.2f %8.2f\n", modes[m].name,
+                (unsigned)depth, rate, rate > 0 ? 1e6 / rate : 0, wakes,
+                waits);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,457 @@
+/// ring_test.cpp
+/// Tests for shared memory proxy rings in imdshmring.h. Besides single ring
+/// operations, a client process and a server process exchange requests
+/// through a POSIX shared memory object with ring layout, the same way as
+/// driver and devio, with both sides sleeping on futexes, polling first and
+/// only polling.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imdshmring.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <vector>
+
+static const ULONG RingTestSlots = 16;
+static const ULONG RingTestSlotDataSize = 4096;
+static const size_t RingTestSlotSize = IMDPROXY_HEADER_SIZE + RingTestSlotDataSize;
+
+// Longer than any wait that has a reason to end
+static const long RingTestSleepMs = 2000;
+
+// Polls without ever sleeping
+static const unsigned RingTestPollOnly = UINT_MAX;
+
+///
+/// Counters from server process, in last page of shared memory.
+///
+struct RingTestStats
+{
+    volatile ULONG errors;
+    volatile ULONG timeouts;
+};
+
+struct RingTestMapping
+{
+    PIMDPROXY_SHM_RING_HEADER header;
+    size_t size;
+    RingTestStats *stats;
+
+    UCHAR *Slot(ULONG Slot) const
+    {
+        return (UCHAR*)header + IMDPROXY_HEADER_SIZE + Slot * RingTestSlotSize;
+    }
+};
+
+static void
+RingTestWake(volatile ULONG *Address)
+{
+    syscall(SYS_futex, Address, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+///
+/// Returns false if wait timed out.
+///
+static bool
+RingTestWait(volatile ULONG *Address, ULONG Value)
+{
+    struct timespec timeout;
+    timeout.tv_sec = RingTestSleepMs / 1000;
+    timeout.tv_nsec = (RingTestSleepMs % 1000) * 1000000;
+
+    return syscall(SYS_futex, Address, FUTEX_WAIT, Value, &timeout, NULL, 0) == 0 ||
+        errno != ETIMEDOUT;
+}
+
+///
+/// Pops next entry from Ring, polling up to Spin times before each sleep.
+/// Returns false if Stop is set while ring is empty. Timeouts counts
+/// sleeps that were not ended by a wakeup.
+///
+static bool
+RingTestPop(PIMDPROXY_SHM_RING Ring, unsigned Spin, volatile ULONG *Stop,
+    ULONG *Slot, ULONG *Timeouts)
+{
+    unsigned idle = 0;
+
+    while (!ImdProxyShmRingPop(Ring, RingTestSlots, Slot))
+    {
+        if (*Stop)
+        {
+            return false;
+        }
+
+        if (Spin == RingTestPollOnly || idle < Spin)
+        {
+            idle++;
+            ImdProxyShmPause();
+            continue;
+        }
+
+        if (ImdProxyShmRingPrepareSleep(Ring))
+        {
+            ImdProxyShmRingFinishSleep(Ring);
+            continue;
+        }
+
+        if (!RingTestWait(&Ring->tail, Ring->head) && Ring->head != Ring->tail)
+        {
+            ++*Timeouts;
+        }
+
+        ImdProxyShmRingFinishSleep(Ring);
+    }
+
+    return true;
+}
+
+static void
+RingTestPush(PIMDPROXY_SHM_RING Ring, ULONG Slot)
+{
+    ImdProxyShmRingPush(Ring, RingTestSlots, Slot);
+
+    if (ImdProxyShmRingNeedsWakeup(Ring))
+    {
+        RingTestWake(&Ring->tail);
+    }
+}
+
+static void
+RingTestFill(UCHAR *Data, ULONGLONG Seed)
+{
+    for (ULONG i = 0; i < RingTestSlotDataSize; i++)
+    {
+        Data[i] = (UCHAR)(Seed * 31 + i);
+    }
+}
+
+///
+/// Creates shared memory object with ring header as devio does, and removes
+/// the name again. Mapping stays shared with processes forked after this.
+///
+static bool
+RingTestCreate(RingTestMapping *Mapping)
+{
+    char name[64];
+    snprintf(name, sizeof name, "/ring_test.%d", (int)getpid());
+
+    Mapping->size = IMDPROXY_HEADER_SIZE + RingTestSlots * RingTestSlotSize +
+        IMDPROXY_HEADER_SIZE;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    shm_unlink(name);
+
+    void *mem = MAP_FAILED;
+
+    if (ftruncate(fd, (off_t)Mapping->size) == 0)
+    {
+        mem = mmap(NULL, Mapping->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    }
+
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        return false;
+    }
+
+    Mapping->header = (PIMDPROXY_SHM_RING_HEADER)mem;
+    Mapping->header->slot_count = RingTestSlots;
+    Mapping->header->slot_data_size = RingTestSlotDataSize;
+    Mapping->header->slot_size = RingTestSlotSize;
+    Mapping->header->version = IMDPROXY_SHM_RING_VERSION;
+    Mapping->header->signature = IMDPROXY_SHM_RING_SIGNATURE;
+    Mapping->stats = (RingTestStats*)((UCHAR*)mem + Mapping->size -
+        IMDPROXY_HEADER_SIZE);
+
+    return true;
+}
+
+///
+/// Server side. Checks request data, answers with sequence number plus one
+/// and inverted data, until client sets closed.
+///
+static void
+RingTestServer(RingTestMapping *Mapping, unsigned Spin)
+{
+    PIMDPROXY_SHM_RING_HEADER header = Mapping->header;
+    ULONG timeouts = 0;
+    ULONG slot;
+    std::vector<UCHAR> expected(RingTestSlotDataSize);
+
+    while (RingTestPop(&header->submission, Spin, &header->closed, &slot,
+        &timeouts))
+    {
+        if (slot >= RingTestSlots)
+        {
+            Mapping->stats->errors++;
+            continue;
+        }
+
+        UCHAR *ptr = Mapping->Slot(slot);
+        ULONGLONG sequence;
+
+        memcpy(&sequence, ptr, sizeof sequence);
+
+        RingTestFill(expected.data(), sequence);
+
+        if (memcmp(ptr + IMDPROXY_HEADER_SIZE, expected.data(),
+                RingTestSlotDataSize) != 0)
+        {
+            Mapping->stats->errors++;
+        }
+
+        for (ULONG i = 0; i < RingTestSlotDataSize; i++)
+        {
+            ptr[IMDPROXY_HEADER_SIZE + i] ^= 0xFF;
+        }
+
+        sequence++;
+        memcpy(ptr, &sequence, sizeof sequence);
+
+        RingTestPush(&header->completion, slot);
+    }
+
+    Mapping->stats->timeouts = timeouts;
+}
+
+///
+/// Runs Requests requests through a server process and checks responses.
+/// Completions must come back in submission order, as server has one
+/// thread.
+///
+static void
+RingTestExchange(unsigned Spin, ULONG Requests)
+{
+    RingTestMapping mapping;
+    bool created = RingTestCreate(&mapping);
+
+    IMTEST_CHECK(created);
+    if (!created)
+    {
+        return;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        RingTestServer(&mapping, Spin);
+        _exit(0);
+    }
+
+    IMTEST_CHECK(pid > 0);
+
+    PIMDPROXY_SHM_RING_HEADER header = mapping.header;
+    std::vector<UCHAR> expected(RingTestSlotDataSize);
+    ULONG free_slots[RingTestSlots];
+    ULONG free_count = RingTestSlots;
+    ULONG timeouts = 0;
+    ULONG errors = 0;
+    ULONGLONG submitted = 0;
+    ULONGLONG completed = 0;
+    volatile ULONG never = 0;
+
+    for (ULONG i = 0; i < RingTestSlots; i++)
+    {
+        free_slots[i] = i;
+    }
+
+    while (completed < Requests && pid > 0)
+    {
+        while (free_count > 0 && submitted < Requests)
+        {
+            ULONG slot = free_slots[--free_count];
+            UCHAR *ptr = mapping.Slot(slot);
+
+            memcpy(ptr, &submitted, sizeof submitted);
+            RingTestFill(ptr + IMDPROXY_HEADER_SIZE, submitted);
+
+            RingTestPush(&header->submission, slot);
+
+            submitted++;
+        }
+
+        ULONG slot;
+
+        RingTestPop(&header->completion, Spin, &never, &slot, &timeouts);
+
+        if (slot >= RingTestSlots)
+        {
+            errors++;
+            break;
+        }
+
+        UCHAR *ptr = mapping.Slot(slot);
+        ULONGLONG sequence;
+
+        memcpy(&sequence, ptr, sizeof sequence);
+
+        RingTestFill(expected.data(), completed);
+
+        for (ULONG i = 0; i < RingTestSlotDataSize; i++)
+        {
+            if ((ptr[IMDPROXY_HEADER_SIZE + i] ^ 0xFF) != expected[i])
+            {
+                errors++;
+                break;
+            }
+        }
+
+        if (sequence != completed + 1)
+        {
+            errors++;
+        }
+
+        completed++;
+        free_slots[free_count++] = slot;
+    }
+
+    header->closed = 1;
+    ImdProxyShmFullBarrier();
+    RingTestWake(&header->submission.tail);
+
+    int status = -1;
+    IMTEST_CHECK(waitpid(pid, &status, 0) == pid);
+    IMTEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    IMTEST_CHECK(completed == Requests);
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(timeouts == 0);
+    IMTEST_CHECK(mapping.stats->errors == 0);
+    IMTEST_CHECK(mapping.stats->timeouts == 0);
+
+    munmap(header, mapping.size);
+}
+
+static void
+TestEmptyRing()
+{
+    IMDPROXY_SHM_RING ring;
+    ULONG slot = 12345;
+
+    memset(&ring, 0, sizeof ring);
+
+    IMTEST_CHECK(!ImdProxyShmRingPop(&ring, RingTestSlots, &slot));
+    IMTEST_CHECK(slot == 12345);
+    IMTEST_CHECK(!ImdProxyShmRingNeedsWakeup(&ring));
+    IMTEST_CHECK(!ImdProxyShmRingPrepareSleep(&ring));
+    IMTEST_CHECK(ImdProxyShmRingNeedsWakeup(&ring));
+
+    ImdProxyShmRingFinishSleep(&ring);
+
+    IMTEST_CHECK(!ImdProxyShmRingNeedsWakeup(&ring));
+}
+
+///
+/// Head and tail are free running counters, so order must hold when they
+/// wrap around.
+///
+static void
+TestOrderAcrossWrap()
+{
+    IMDPROXY_SHM_RING ring;
+    ULONG next_push = 0;
+    ULONG next_pop = 0;
+    uint64_t state = 5;
+
+    memset(&ring, 0, sizeof ring);
+    ring.head = ring.tail = 0xFFFFFF00;
+
+    while (next_pop < 1000)
+    {
+        ULONG pushes = ImTestRandom(&state) % (RingTestSlots + 1);
+
+        for (ULONG i = 0; i < pushes &&
+            ring.tail - ring.head < RingTestSlots; i++)
+        {
+            ImdProxyShmRingPush(&ring, RingTestSlots,
+                next_push++ % RingTestSlots);
+        }
+
+        ULONG pops = ImTestRandom(&state) % (RingTestSlots + 1);
+        ULONG slot;
+
+        for (ULONG i = 0; i < pops && ImdProxyShmRingPop(&ring, RingTestSlots,
+            &slot); i++)
+        {
+            IMTEST_CHECK(slot == next_pop++ % RingTestSlots);
+        }
+    }
+
+    IMTEST_CHECK(ring.head < 0xFFFFFF00);
+}
+
+static void
+TestSleepSeesLateEntry()
+{
+    IMDPROXY_SHM_RING ring;
+
+    memset(&ring, 0, sizeof ring);
+
+    // Entry pushed after consumer found ring empty but before it sleeps
+    ImdProxyShmRingPush(&ring, RingTestSlots, 3);
+
+    IMTEST_CHECK(ImdProxyShmRingPrepareSleep(&ring));
+    IMTEST_CHECK(ImdProxyShmRingNeedsWakeup(&ring));
+
+    ImdProxyShmRingFinishSleep(&ring);
+
+    ULONG slot;
+    IMTEST_CHECK(ImdProxyShmRingPop(&ring, RingTestSlots, &slot));
+    IMTEST_CHECK(slot == 3);
+}
+
+static void
+TestExchangeSleeping()
+{
+    RingTestExchange(0, 20000);
+}
+
+static void
+TestExchangePollFirst()
+{
+    RingTestExchange(1000, 20000);
+}
+
+static void
+TestExchangePollOnly()
+{
+    RingTestExchange(RingTestPollOnly, 2000);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestEmptyRing);
+    IMTEST_RUN(TestOrderAcrossWrap);
+    IMTEST_RUN(TestSleepSeesLateEntry);
+    IMTEST_RUN(TestExchangeSleeping);
+    IMTEST_RUN(TestExchangePollFirst);
+    IMTEST_RUN(TestExchangePollOnly);
+
+    return IMTEST_RESULT();
+}
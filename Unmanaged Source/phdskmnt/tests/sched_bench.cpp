@@ -0,0 +1,211 @@
+/// sched_bench.cpp
+/// Requests per second for 1 to 16 worker threads serving the same LU with
+/// range conflict scheduling in imscsisched.h, as ImScsiServiceRequests
+/// does. Backend is simulated with a fixed latency per request, and any
+/// number of requests can be in progress, like on a tagged proxy
+/// connection. Queue holds 2000 requests, 64 KB reads and writes at random
+/// offsets, with a share of them in a small hot area where they conflict,
+/// and a few barriers such as flush requests.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsisched.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const int BenchRequests = 2000;
+static const LONGLONG BenchDeviceSize = 16LL << 30;
+static const LONGLONG BenchHotSize = 1 << 20;
+static const ULONG BenchRequestSize = 64 << 10;
+
+struct BenchLU
+{
+    std::mutex Lock;
+    std::condition_variable RequestEvent;
+    std::list<IMSCSI_SCHED_RANGE> RequestList;
+    IMSCSI_SCHED Sched;
+    int LatencyUs;
+    int Conflicts;
+};
+
+///
+/// Same scan as ImScsiSelectLUWork, without merging. Returns false if
+/// nothing can start now.
+///
+static bool
+BenchSelect(BenchLU *LU, IMSCSI_SCHED_RANGE *Range, int *Slot)
+{
+    IMSCSI_SCHED_RANGE queued[IMSCSI_SCHED_SCAN_DEPTH];
+    ULONG count = 0;
+
+    for (std::list<IMSCSI_SCHED_RANGE>::iterator it = LU->RequestList.begin();
+        it != LU->RequestList.end() && count < IMSCSI_SCHED_SCAN_DEPTH;
+        ++it, count++)
+    {
+        queued[count] = *it;
+
+        if (ImScsiSchedCanStart(&LU->Sched, queued, count))
+        {
+            // Checked again against everything in progress, as a model
+            for (ULONG slot = 0; slot < IMSCSI_SCHED_MAX_ACTIVE; slot++)
+            {
+                if ((LU->Sched.active_mask & (1UL << slot)) &&
+                    ImScsiSchedRangesConflict(&LU->Sched.active[slot], &*it))
+                {
+                    LU->Conflicts++;
+                }
+            }
+
+            *Range = *it;
+            *Slot = ImScsiSchedStart(&LU->Sched, &*it, count);
+            LU->RequestList.erase(it);
+            return true;
+        }
+
+        if (queued[count].barrier)
+        {
+            break;
+        }
+    }
+
+    return false;
+}
+
+static void
+BenchWorker(BenchLU *LU)
+{
+    std::unique_lock<std::mutex> lock(LU->Lock);
+
+    for (;;)
+    {
+        IMSCSI_SCHED_RANGE range;
+        int slot;
+
+        if (!BenchSelect(LU, &range, &slot))
+        {
+            if (LU->RequestList.empty())
+            {
+                return;
+            }
+
+            LU->RequestEvent.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+
+        std::this_thread::sleep_for(std::chrono::microseconds(LU->LatencyUs));
+
+        lock.lock();
+
+        ImScsiSchedFinish(&LU->Sched, slot);
+
+        // Queued requests that waited for this one, or the end of queue
+        LU->RequestEvent.notify_all();
+    }
+}
+
+///
+/// Returns requests per second. Passed is set to share of requests that
+/// started before an earlier queued one.
+///
+static double
+BenchRun(const std::vector<IMSCSI_SCHED_RANGE> &Trace, int Workers,
+    int LatencyUs, double *Passed, int *Conflicts)
+{
+    BenchLU lu;
+
+    memset(&lu.Sched, 0, sizeof(lu.Sched));
+    lu.LatencyUs = LatencyUs;
+    lu.Conflicts = 0;
+    lu.RequestList.assign(Trace.begin(), Trace.end());
+
+    double start = ImTestSeconds();
+
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < Workers; i++)
+    {
+        threads.push_back(std::thread(BenchWorker, &lu));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    double seconds = ImTestSeconds() - start;
+
+    *Passed = (double)lu.Sched.passed / Trace.size();
+    *Conflicts = lu.Conflicts;
+
+    return Trace.size() / seconds;
+}
+
+int
+main()
+{
+    printf("%8s %8s %8s %10s %8s %10s\n", "latency", "hot %", "workers",
+        "req/s", "speedup", "passed %");
+
+    for (int latency = 100; latency <= 1000; latency *= 10)
+    {
+        for (int hot_percent = 0; hot_percent <= 50; hot_percent += 25)
+        {
+            std::vector<IMSCSI_SCHED_RANGE> trace(BenchRequests);
+            uint64_t state = 29;
+
+            for (int i = 0; i < BenchRequests; i++)
+            {
+                if (ImTestRandom(&state) % 200 == 0)
+                {
+                    ImScsiSchedSetBarrier(&trace[i]);
+                    continue;
+                }
+
+                LONGLONG area = (int)(ImTestRandom(&state) % 100) <
+                    hot_percent ? BenchHotSize : BenchDeviceSize;
+
+                ImScsiSchedSetRange(&trace[i],
+                    (LONGLONG)(ImTestRandom(&state) % (area / 4096)) * 4096,
+                    BenchRequestSize, ImTestRandom(&state) % 3 == 0);
+            }
+
+            double base = 0;
+
+            for (int workers = 1; workers <= 16; workers *= 2)
+            {
+                double passed;
+                int conflicts;
+
+                double rate = BenchRun(trace, workers, latency, &passed,
+                    &conflicts);
+
+                if (workers == 1)
+                {
+                    base = rate;
+                }
+
+                printf("%6d us %8d %8d %10.0f %7.2fx %9.1f%s\n", latency,
+                    hot_percent, workers, rate, rate / base, passed * 100,
+                    conflicts == 0 ? "" : "  CONFLICT");
+            }
+        }
+    }
+
+    return 0;
+}
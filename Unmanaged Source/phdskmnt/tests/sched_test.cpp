@@ -0,0 +1,310 @@
+/// sched_test.cpp
+/// Tests for range conflict scheduling in imscsisched.h. Besides the
+/// conflict rules, runs a random mix of queued reads, writes and barriers
+/// against a model where requests finish in any order, as they do when
+/// they complete from proxy receive threads, and checks that conflicting
+/// requests are never in progress together and always start in the order
+/// they were queued.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsisched.h>
+
+#include <vector>
+
+static IMSCSI_SCHED_RANGE
+Range(LONGLONG Offset, ULONG Length, int Write)
+{
+    IMSCSI_SCHED_RANGE range;
+    ImScsiSchedSetRange(&range, Offset, Length, Write);
+    return range;
+}
+
+static IMSCSI_SCHED_RANGE
+Barrier()
+{
+    IMSCSI_SCHED_RANGE range;
+    ImScsiSchedSetBarrier(&range);
+    return range;
+}
+
+static void
+TestConflicts()
+{
+    IMSCSI_SCHED_RANGE read1 = Range(0x1000, 0x1000, 0);
+    IMSCSI_SCHED_RANGE read2 = Range(0x1800, 0x1000, 0);
+    IMSCSI_SCHED_RANGE write1 = Range(0x1800, 0x1000, 1);
+    IMSCSI_SCHED_RANGE adjacent = Range(0x2000, 0x1000, 1);
+    IMSCSI_SCHED_RANGE barrier = Barrier();
+
+    IMTEST_CHECK(!ImScsiSchedRangesConflict(&read1, &read2));
+    IMTEST_CHECK(ImScsiSchedRangesConflict(&read1, &write1));
+    IMTEST_CHECK(ImScsiSchedRangesConflict(&write1, &read1));
+    IMTEST_CHECK(!ImScsiSchedRangesConflict(&read1, &adjacent));
+    IMTEST_CHECK(ImScsiSchedRangesConflict(&write1, &adjacent));
+
+    // Barriers conflict with everything, even with nothing in range
+    IMTEST_CHECK(ImScsiSchedRangesConflict(&read1, &barrier));
+    IMTEST_CHECK(ImScsiSchedRangesConflict(&barrier, &barrier));
+}
+
+static void
+TestSelectPassesOnlyNonConflicting()
+{
+    IMSCSI_SCHED sched = { };
+
+    IMSCSI_SCHED_RANGE active = Range(0, 0x1000, 1);
+    IMTEST_CHECK(ImScsiSchedStart(&sched, &active, 0) == 0);
+
+    // Read of range being written waits, later read elsewhere passes it
+    IMSCSI_SCHED_RANGE queued[] =
+    {
+        Range(0x800, 0x1000, 0),
+        Range(0x10000, 0x1000, 0),
+    };
+
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 2) == 1);
+
+    // Later write overlapping the waiting read cannot pass it, even when
+    // it does not conflict with anything in progress
+    IMSCSI_SCHED_RANGE queued2[] =
+    {
+        Range(0x800, 0x1000, 0),
+        Range(0x1000, 0x1000, 1),
+    };
+
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued2, 2) == -1);
+
+    // Nothing passes a queued barrier
+    IMSCSI_SCHED_RANGE queued3[] =
+    {
+        Range(0x800, 0x1000, 0),
+        Barrier(),
+        Range(0x10000, 0x1000, 0),
+    };
+
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued3, 3) == -1);
+
+    ImScsiSchedFinish(&sched, 0);
+
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued3, 3) == 0);
+}
+
+static void
+TestSlotsAndCounters()
+{
+    IMSCSI_SCHED sched = { };
+    IMSCSI_SCHED_RANGE queued[1];
+
+    for (int i = 0; i < IMSCSI_SCHED_MAX_ACTIVE; i++)
+    {
+        queued[0] = Range((LONGLONG)i << 12, 0x1000, 1);
+        IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 1) == 0);
+        IMTEST_CHECK(ImScsiSchedStart(&sched, &queued[0], i & 1) == i);
+    }
+
+    IMTEST_CHECK(sched.active_count == IMSCSI_SCHED_MAX_ACTIVE);
+    IMTEST_CHECK(sched.started == IMSCSI_SCHED_MAX_ACTIVE);
+    IMTEST_CHECK(sched.passed == IMSCSI_SCHED_MAX_ACTIVE / 2);
+
+    // Full, even for requests that conflict with nothing
+    queued[0] = Range(1LL << 40, 0x1000, 0);
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 1) == -1);
+    IMTEST_CHECK(ImScsiSchedStart(&sched, &queued[0], 0) == IMSCSI_SCHED_NO_SLOT);
+
+    // Finished slot is reused, unknown and free slots are ignored
+    ImScsiSchedFinish(&sched, 7);
+    ImScsiSchedFinish(&sched, 7);
+    ImScsiSchedFinish(&sched, IMSCSI_SCHED_NO_SLOT);
+    ImScsiSchedFinish(&sched, IMSCSI_SCHED_MAX_ACTIVE);
+
+    IMTEST_CHECK(sched.active_count == IMSCSI_SCHED_MAX_ACTIVE - 1);
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 1) == 0);
+    IMTEST_CHECK(ImScsiSchedStart(&sched, &queued[0], 0) == 7);
+}
+
+///
+/// Request sent on a tagged connection keeps its slot while in flight, so
+/// an overlapping write queued after it is held back until it completes,
+/// while other requests go on.
+///
+static void
+TestInFlightHoldsConflicting()
+{
+    IMSCSI_SCHED sched = { };
+
+    IMSCSI_SCHED_RANGE sent = Range(0x4000, 0x2000, 1);
+    int slot = ImScsiSchedStart(&sched, &sent, 0);
+
+    IMSCSI_SCHED_RANGE queued[] =
+    {
+        Range(0x5000, 0x1000, 1),
+        Range(0x8000, 0x1000, 1),
+    };
+
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 2) == 1);
+    int other = ImScsiSchedStart(&sched, &queued[1], 1);
+
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 1) == -1);
+
+    // Completions come in any order
+    ImScsiSchedFinish(&sched, other);
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 1) == -1);
+
+    ImScsiSchedFinish(&sched, slot);
+    IMTEST_CHECK(ImScsiSchedSelect(&sched, queued, 1) == 0);
+}
+
+struct SchedTestRequest
+{
+    IMSCSI_SCHED_RANGE range;
+    unsigned id;
+    int slot;
+};
+
+static bool
+SchedTestConflictsWithAny(const std::vector<SchedTestRequest> &Requests,
+    size_t Count, const IMSCSI_SCHED_RANGE *Range)
+{
+    for (size_t i = 0; i < Count && i < Requests.size(); i++)
+    {
+        if (ImScsiSchedRangesConflict(&Requests[i].range, Range))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+TestRandomAgainstModel()
+{
+    IMSCSI_SCHED sched = { };
+    std::vector<SchedTestRequest> queue;
+    std::vector<SchedTestRequest> active;
+    uint64_t state = 13;
+    unsigned next_id = 0;
+    unsigned started = 0;
+    unsigned overlap_errors = 0;
+    unsigned order_errors = 0;
+    unsigned missed = 0;
+
+    for (int step = 0; step < 500000; step++)
+    {
+        unsigned op = ImTestRandom(&state) % 10;
+
+        if (op < 4 || step >= 490000)
+        {
+            // Drain at end: finish requests until none are left
+            if (step >= 490000 && active.empty())
+            {
+                if (queue.empty())
+                {
+                    break;
+                }
+            }
+            else if (!active.empty())
+            {
+                size_t index = ImTestRandom(&state) % active.size();
+                ImScsiSchedFinish(&sched, active[index].slot);
+                active[index] = active.back();
+                active.pop_back();
+            }
+        }
+        else if (op < 7 && step < 490000)
+        {
+            SchedTestRequest request;
+            request.id = next_id++;
+            request.slot = IMSCSI_SCHED_NO_SLOT;
+
+            unsigned kind = ImTestRandom(&state) % 64;
+
+            if (kind == 0)
+            {
+                ImScsiSchedSetBarrier(&request.range);
+            }
+            else
+            {
+                ImScsiSchedSetRange(&request.range,
+                    (LONGLONG)(ImTestRandom(&state) % 64) << 9,
+                    (1 + ImTestRandom(&state) % 8) << 9,
+                    kind < 24);
+            }
+
+            queue.push_back(request);
+            continue;
+        }
+
+        IMSCSI_SCHED_RANGE queued[IMSCSI_SCHED_SCAN_DEPTH];
+        ULONG count = 0;
+
+        for (; count < queue.size() && count < IMSCSI_SCHED_SCAN_DEPTH; count++)
+        {
+            queued[count] = queue[count].range;
+        }
+
+        int index = ImScsiSchedSelect(&sched, queued, count);
+
+        if (index < 0)
+        {
+            // Something can always start when nothing is in progress
+            if (active.empty() && !queue.empty())
+            {
+                missed++;
+            }
+
+            continue;
+        }
+
+        SchedTestRequest request = queue[index];
+
+        if (SchedTestConflictsWithAny(active, active.size(), &request.range))
+        {
+            overlap_errors++;
+        }
+
+        if (SchedTestConflictsWithAny(queue, index, &request.range))
+        {
+            order_errors++;
+        }
+
+        request.slot = ImScsiSchedStart(&sched, &request.range, index);
+        IMTEST_CHECK(request.slot != IMSCSI_SCHED_NO_SLOT);
+
+        queue.erase(queue.begin() + index);
+        active.push_back(request);
+        started++;
+    }
+
+    printf("%u requests started, %llu passed an earlier one\n",
+        started, (unsigned long long)sched.passed);
+
+    IMTEST_CHECK(overlap_errors == 0);
+    IMTEST_CHECK(order_errors == 0);
+    IMTEST_CHECK(missed == 0);
+    IMTEST_CHECK(queue.empty() && active.empty());
+    IMTEST_CHECK(sched.active_count == 0 && sched.active_mask == 0);
+    IMTEST_CHECK(sched.started == started && sched.passed > 0);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestConflicts);
+    IMTEST_RUN(TestSelectPassesOnlyNonConflicting);
+    IMTEST_RUN(TestSlotsAndCounters);
+    IMTEST_RUN(TestInFlightHoldsConflicting);
+    IMTEST_RUN(TestRandomAgainstModel);
+
+    return IMTEST_RESULT();
+}
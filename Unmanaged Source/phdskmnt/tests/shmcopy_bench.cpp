@@ -0,0 +1,204 @@
+/// shmcopy_bench.cpp
+/// Read and write throughput and copies per request through shared memory
+/// proxy ring slots at request sizes 4 KB to 1 MB, comparing the temporary
+/// buffer that ImScsiDispatchWork used for shared memory proxy LUs with
+/// copying directly between request buffer and slot. Client fills a slot
+/// for each of up to slot_count requests, pushes them to submission ring,
+/// server pops them and reads or writes image data in slot as devio does,
+/// client then drains completed slots. Both sides run in one thread here,
+/// so only copies are measured, not wakeups.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <sys/types.h>
+#include <imdshmring.h>
+
+#include <stdlib.h>
+#include <vector>
+
+static const size_t BenchImageSize = 512UL << 20;
+static const size_t BenchBytes = 2UL << 30;
+static const ULONG BenchSlotCount = 16;
+static const ULONG BenchSlotDataSize = 1UL << 20;
+
+static size_t BenchCopies;
+
+static void
+BenchCopy(void *Destination, const void *Source, size_t Length)
+{
+    memcpy(Destination, Source, Length);
+    ++BenchCopies;
+}
+
+struct BenchRing
+{
+    std::vector<UCHAR> Memory;
+    PIMDPROXY_SHM_RING_HEADER Header;
+    UCHAR *Slots;
+    size_t SlotSize;
+
+    BenchRing() : SlotSize(IMDPROXY_HEADER_SIZE + BenchSlotDataSize)
+    {
+        Memory.resize(IMDPROXY_HEADER_SIZE + BenchSlotCount * SlotSize +
+            IMDPROXY_HEADER_SIZE);
+
+        // Slot data areas page aligned, like in a real mapping
+        UCHAR *base = Memory.data() + IMDPROXY_HEADER_SIZE -
+            ((uintptr_t)Memory.data() & (IMDPROXY_HEADER_SIZE - 1));
+
+        Header = (PIMDPROXY_SHM_RING_HEADER)base;
+        memset(Header, 0, sizeof(*Header));
+        Header->slot_count = BenchSlotCount;
+        Header->slot_data_size = BenchSlotDataSize;
+        Header->slot_size = SlotSize;
+        Slots = base + IMDPROXY_HEADER_SIZE;
+    }
+
+    UCHAR *SlotData(ULONG Slot)
+    {
+        return Slots + Slot * SlotSize + IMDPROXY_HEADER_SIZE;
+    }
+};
+
+///
+/// Returns MB/s for requests of Length bytes. Reads from image into request
+/// buffer if Write is zero, otherwise the other way. Temporary selects
+/// copy through a buffer allocated for each request.
+///
+static double
+BenchRun(BenchRing *Ring, UCHAR *Image, UCHAR *Request, size_t Length,
+    int Write, int Temporary)
+{
+    uint64_t seed = Length;
+    size_t requests = BenchBytes / Length;
+    size_t image_slots = BenchImageSize / Length;
+    std::vector<UCHAR*> temp(BenchSlotCount);
+    std::vector<size_t> offsets(BenchSlotCount);
+
+    double start = ImTestSeconds();
+
+    for (size_t done = 0; done < requests; )
+    {
+        ULONG batch = BenchSlotCount;
+        ULONG slot;
+
+        if (requests - done < batch)
+        {
+            batch = (ULONG)(requests - done);
+        }
+
+        // Client side, ImScsiDispatchWork and ImScsiSendShmRingRequest
+        for (slot = 0; slot < batch; slot++)
+        {
+            UCHAR *source = Request;
+
+            offsets[slot] = (ImTestRandom(&seed) % image_slots) * Length;
+
+            if (Temporary)
+            {
+                temp[slot] = (UCHAR*)malloc(Length);
+
+                if (Write)
+                {
+                    BenchCopy(temp[slot], Request, Length);
+                }
+
+                source = temp[slot];
+            }
+
+            if (Write)
+            {
+                BenchCopy(Ring->SlotData(slot), source, Length);
+            }
+
+            ImdProxyShmRingPush(&Ring->Header->submission, BenchSlotCount,
+                slot);
+        }
+
+        // Server side, image data read or written in slot
+        while (ImdProxyShmRingPop(&Ring->Header->submission, BenchSlotCount,
+            &slot))
+        {
+            if (Write)
+            {
+                BenchCopy(Image + offsets[slot], Ring->SlotData(slot), Length);
+            }
+            else
+            {
+                BenchCopy(Ring->SlotData(slot), Image + offsets[slot], Length);
+            }
+
+            ImdProxyShmRingPush(&Ring->Header->completion, BenchSlotCount,
+                slot);
+        }
+
+        // Client side, ImScsiCompleteShmRingSlot
+        while (ImdProxyShmRingPop(&Ring->Header->completion, BenchSlotCount,
+            &slot))
+        {
+            if (!Write)
+            {
+                BenchCopy(Temporary ? temp[slot] : Request,
+                    Ring->SlotData(slot), Length);
+
+                if (Temporary)
+                {
+                    BenchCopy(Request, temp[slot], Length);
+                }
+            }
+
+            if (Temporary)
+            {
+                free(temp[slot]);
+            }
+        }
+
+        done += batch;
+    }
+
+    return requests * Length / (ImTestSeconds() - start) / (1 << 20);
+}
+
+int
+main()
+{
+    BenchRing ring;
+    std::vector<UCHAR> image(BenchImageSize, 0x5A);
+    std::vector<UCHAR> request(BenchSlotDataSize, 0xA5);
+
+    printf("%8s %6s %12s %12s %12s %12s\n", "KB", "op", "temp copies",
+        "temp MB/s", "slot copies", "slot MB/s");
+
+    for (size_t length = 4UL << 10; length <= BenchSlotDataSize; length <<= 2)
+    {
+        for (int write = 0; write < 2; write++)
+        {
+            size_t requests = BenchBytes / length;
+
+            BenchCopies = 0;
+            double temp = BenchRun(&ring, image.data(), request.data(), length,
+                write, 1);
+            double temp_copies = (double)BenchCopies / requests;
+
+            BenchCopies = 0;
+            double direct = BenchRun(&ring, image.data(), request.data(),
+                length, write, 0);
+            double direct_copies = (double)BenchCopies / requests;
+
+            printf("%8u %6s %12.1f %12.0f %12.1f %12.0f\n",
+                (unsigned)(length >> 10), write ? "write" : "read",
+                temp_copies, temp, direct_copies, direct);
+        }
+    }
+
+    return 0;
+}
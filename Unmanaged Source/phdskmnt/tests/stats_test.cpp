@@ -0,0 +1,149 @@
+/// stats_test.cpp
+/// Tests for request counters and latency histograms in imscsistats.h.
+/// Checks histogram bucket boundaries at each power of two microseconds,
+/// queue depth tracking, and which counters failed requests, unknown
+/// request kinds and requests that never reached image are counted in.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsistats.h>
+
+// 100 ns ticks
+static const ULONGLONG Microsecond = 10;
+
+static ULONGLONG
+StatsTestSum(const ULONGLONG *Buckets)
+{
+    ULONGLONG sum = 0;
+
+    for (int i = 0; i < IMSCSI_STATS_LATENCY_BUCKETS; i++)
+    {
+        sum += Buckets[i];
+    }
+
+    return sum;
+}
+
+static void
+TestBuckets()
+{
+    // Shorter than 2 us, including less than one
+    IMTEST_CHECK(ImScsiStatsGetBucket(0) == 0);
+    IMTEST_CHECK(ImScsiStatsGetBucket(Microsecond - 1) == 0);
+    IMTEST_CHECK(ImScsiStatsGetBucket(2 * Microsecond - 1) == 0);
+
+    // Bucket n starts at 2^n us
+    for (ULONG n = 1; n < IMSCSI_STATS_LATENCY_BUCKETS; n++)
+    {
+        ULONGLONG start = (1ULL << n) * Microsecond;
+
+        IMTEST_CHECK(ImScsiStatsGetBucket(start) == n);
+        IMTEST_CHECK(ImScsiStatsGetBucket(start - 1) == n - 1);
+    }
+
+    // Last bucket takes everything longer
+    IMTEST_CHECK(ImScsiStatsGetBucket(3600ULL * 10000000) ==
+        IMSCSI_STATS_LATENCY_BUCKETS - 1);
+    IMTEST_CHECK(ImScsiStatsGetBucket(~0ULL) ==
+        IMSCSI_STATS_LATENCY_BUCKETS - 1);
+}
+
+static void
+TestQueueDepth()
+{
+    IMSCSI_STATS stats = { };
+
+    for (int i = 0; i < 5; i++)
+    {
+        ImScsiStatsQueue(&stats);
+    }
+
+    IMTEST_CHECK(stats.queue_depth == 5);
+    IMTEST_CHECK(stats.max_queue_depth == 5);
+
+    for (int i = 0; i < 3; i++)
+    {
+        ImScsiStatsFinish(&stats, IMSCSI_STATS_READ, 512, 100, 50, 0, 1);
+    }
+
+    IMTEST_CHECK(stats.queue_depth == 2);
+    IMTEST_CHECK(stats.max_queue_depth == 5);
+
+    ImScsiStatsQueue(&stats);
+    IMTEST_CHECK(stats.queue_depth == 3);
+    IMTEST_CHECK(stats.max_queue_depth == 5);
+
+    // Requests never queued, such as cache hits, leave depth alone
+    ImScsiStatsFinish(&stats, IMSCSI_STATS_READ, 512, 100, 0, 0, 0);
+    IMTEST_CHECK(stats.queue_depth == 3);
+
+    // Never below zero
+    for (int i = 0; i < 5; i++)
+    {
+        ImScsiStatsFinish(&stats, IMSCSI_STATS_WRITE, 512, 100, 50, 0, 1);
+    }
+
+    IMTEST_CHECK(stats.queue_depth == 0);
+}
+
+static void
+TestCounters()
+{
+    IMSCSI_STATS stats = { };
+
+    ImScsiStatsFinish(&stats, IMSCSI_STATS_READ, 4096,
+        10 * Microsecond, 8 * Microsecond, 0, 0);
+    ImScsiStatsFinish(&stats, IMSCSI_STATS_WRITE, 65536,
+        300 * Microsecond, 250 * Microsecond, 0, 0);
+    ImScsiStatsFinish(&stats, IMSCSI_STATS_UNMAP, 1 << 20,
+        40 * Microsecond, 30 * Microsecond, 0, 0);
+
+    IMTEST_CHECK(stats.requests[IMSCSI_STATS_READ] == 1);
+    IMTEST_CHECK(stats.requests[IMSCSI_STATS_WRITE] == 1);
+    IMTEST_CHECK(stats.requests[IMSCSI_STATS_UNMAP] == 1);
+    IMTEST_CHECK(stats.bytes[IMSCSI_STATS_READ] == 4096);
+    IMTEST_CHECK(stats.bytes[IMSCSI_STATS_WRITE] == 65536);
+    IMTEST_CHECK(stats.bytes[IMSCSI_STATS_UNMAP] == 1 << 20);
+    IMTEST_CHECK(stats.total_latency[3] == 1);
+    IMTEST_CHECK(stats.backend_latency[3] == 1);
+    IMTEST_CHECK(stats.total_latency[8] == 1);
+    IMTEST_CHECK(stats.backend_latency[7] == 1);
+
+    // Failed requests count as requests and errors, not as bytes
+    ImScsiStatsFinish(&stats, IMSCSI_STATS_READ, 4096,
+        10 * Microsecond, 8 * Microsecond, 1, 0);
+    IMTEST_CHECK(stats.requests[IMSCSI_STATS_READ] == 2);
+    IMTEST_CHECK(stats.bytes[IMSCSI_STATS_READ] == 4096);
+    IMTEST_CHECK(stats.errors == 1);
+
+    // Requests that did not reach image only have total latency
+    ImScsiStatsFinish(&stats, IMSCSI_STATS_READ, 4096,
+        3 * Microsecond, 0, 0, 0);
+    IMTEST_CHECK(StatsTestSum(stats.total_latency) == 5);
+    IMTEST_CHECK(StatsTestSum(stats.backend_latency) == 4);
+
+    // Unknown kinds are counted as other
+    ImScsiStatsFinish(&stats, IMSCSI_STATS_KINDS, 0, 1, 0, 0, 0);
+    ImScsiStatsFinish(&stats, -1, 0, 1, 0, 0, 0);
+    IMTEST_CHECK(stats.requests[IMSCSI_STATS_OTHER] == 2);
+    IMTEST_CHECK(stats.requests[IMSCSI_STATS_READ] == 3);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestBuckets);
+    IMTEST_RUN(TestQueueDepth);
+    IMTEST_RUN(TestCounters);
+
+    return IMTEST_RESULT();
+}
@@ -0,0 +1,133 @@
+/// tagtab_bench.cpp
+/// Response matching cost at queue depths 1 to 1024, comparing the io_tag
+/// table in imdtagtab.h with a walk of a list of sent requests, which is how
+/// responses used to be matched. Responses complete in random order.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imdtagtab.h>
+
+#include <vector>
+
+struct BenchRequest
+{
+    BenchRequest *next;
+    BenchRequest *prev;
+    ULONGLONG tag;
+};
+
+static const int BenchCompletions = 2000000;
+
+///
+/// Doubly linked list with address of entry as tag, matched by walking list
+/// from head.
+///
+static double
+BenchList(ULONG Depth, uint64_t Seed)
+{
+    std::vector<BenchRequest> requests(Depth);
+    std::vector<ULONGLONG> in_flight(Depth);
+    BenchRequest head = { &head, &head, 0 };
+
+    for (ULONG i = 0; i < Depth; i++)
+    {
+        BenchRequest *r = &requests[i];
+        r->next = &head;
+        r->prev = head.prev;
+        head.prev->next = r;
+        head.prev = r;
+        in_flight[i] = (ULONGLONG)(uintptr_t)r;
+    }
+
+    double start = ImTestSeconds();
+
+    for (int i = 0; i < BenchCompletions; i++)
+    {
+        ULONG index = ImTestRandom(&Seed) % Depth;
+        ULONGLONG tag = in_flight[index];
+
+        BenchRequest *found = NULL;
+        for (BenchRequest *r = head.next; r != &head; r = r->next)
+        {
+            if ((ULONGLONG)(uintptr_t)r == tag)
+            {
+                found = r;
+                break;
+            }
+        }
+
+        found->prev->next = found->next;
+        found->next->prev = found->prev;
+
+        // Send next request using same memory.
+        found->next = &head;
+        found->prev = head.prev;
+        head.prev->next = found;
+        head.prev = found;
+    }
+
+    return (ImTestSeconds() - start) * 1e9 / BenchCompletions;
+}
+
+static double
+BenchTagTable(ULONG Depth, uint64_t Seed)
+{
+    std::vector<BenchRequest> requests(Depth);
+    std::vector<ULONGLONG> in_flight(Depth);
+    std::vector<IMD_TAG_SLOT> slots;
+    IMD_TAG_TABLE table;
+
+    ImdTagTableInitialize(&table);
+
+    for (ULONG i = 0; i < Depth; i++)
+    {
+        if (ImdTagTableIsFull(&table))
+        {
+            ULONG capacity = ImdTagTableNextCapacity(&table);
+            std::vector<IMD_TAG_SLOT> new_slots(capacity);
+            ImdTagTableGrow(&table, new_slots.data(), capacity);
+            slots.swap(new_slots);
+        }
+
+        in_flight[i] = ImdTagTableInsert(&table, &requests[i]);
+    }
+
+    double start = ImTestSeconds();
+
+    for (int i = 0; i < BenchCompletions; i++)
+    {
+        ULONG index = ImTestRandom(&Seed) % Depth;
+
+        BenchRequest *found = (BenchRequest*)
+            ImdTagTableRemove(&table, in_flight[index]);
+
+        in_flight[index] = ImdTagTableInsert(&table, found);
+    }
+
+    return (ImTestSeconds() - start) * 1e9 / BenchCompletions;
+}
+
+int
+main()
+{
+    printf("%8s %14s %14s\n", "depth", "list ns/resp", "table ns/resp");
+
+    for (ULONG depth = 1; depth <= 1024; depth <<= 1)
+    {
+        double list = BenchList(depth, depth);
+        double table = BenchTagTable(depth, depth);
+
+        printf("%8u %14.1f %14.1f\n", (unsigned)depth, list, table);
+    }
+
+    return 0;
+}
@@ -0,0 +1,299 @@
+/// tagtab_test.cpp
+/// Tests for io_tag table in imdtagtab.h.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imdtagtab.h>
+
+#include <iterator>
+#include <map>
+#include <vector>
+
+static void
+TagTableGrow(PIMD_TAG_TABLE Table)
+{
+    ULONG capacity = ImdTagTableNextCapacity(Table);
+    IMTEST_CHECK(capacity > Table->capacity);
+
+    PIMD_TAG_SLOT slots = (PIMD_TAG_SLOT)malloc(capacity * sizeof(IMD_TAG_SLOT));
+    free(ImdTagTableGrow(Table, slots, capacity));
+}
+
+static ULONGLONG
+TagTableInsert(PIMD_TAG_TABLE Table, void *Item)
+{
+    if (ImdTagTableIsFull(Table))
+    {
+        TagTableGrow(Table);
+    }
+
+    return ImdTagTableInsert(Table, Item);
+}
+
+static void
+TestInsertLookupRemove()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    IMTEST_CHECK(ImdTagTableIsFull(&table));
+    IMTEST_CHECK(ImdTagTableLookup(&table, 0) == NULL);
+
+    int items[3];
+    ULONGLONG tags[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        tags[i] = TagTableInsert(&table, items + i);
+        IMTEST_CHECK(tags[i] != 0);
+    }
+
+    IMTEST_CHECK(table.capacity == IMD_TAG_TABLE_INITIAL_CAPACITY);
+    IMTEST_CHECK(table.in_use == 3);
+
+    // Lowest slots are handed out first.
+    IMTEST_CHECK((ULONG)tags[0] == 0);
+    IMTEST_CHECK((ULONG)tags[1] == 1);
+    IMTEST_CHECK((ULONG)tags[2] == 2);
+
+    for (int i = 0; i < 3; i++)
+    {
+        IMTEST_CHECK(ImdTagTableLookup(&table, tags[i]) == items + i);
+    }
+
+    IMTEST_CHECK(ImdTagTableRemove(&table, tags[1]) == items + 1);
+    IMTEST_CHECK(ImdTagTableLookup(&table, tags[1]) == NULL);
+    IMTEST_CHECK(ImdTagTableRemove(&table, tags[1]) == NULL);
+    IMTEST_CHECK(table.in_use == 2);
+
+    IMTEST_CHECK(ImdTagTableLookup(&table, tags[0]) == items);
+    IMTEST_CHECK(ImdTagTableLookup(&table, tags[2]) == items + 2);
+
+    free(table.slots);
+}
+
+static void
+TestStaleTagRejected()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    int first, second;
+
+    ULONGLONG old_tag = TagTableInsert(&table, &first);
+    IMTEST_CHECK(ImdTagTableRemove(&table, old_tag) == &first);
+
+    // Freed slot is reused first, with a new generation.
+    ULONGLONG new_tag = TagTableInsert(&table, &second);
+    IMTEST_CHECK((ULONG)new_tag == (ULONG)old_tag);
+    IMTEST_CHECK(new_tag != old_tag);
+
+    // Late response for first request must not complete second one.
+    IMTEST_CHECK(ImdTagTableLookup(&table, old_tag) == NULL);
+    IMTEST_CHECK(ImdTagTableRemove(&table, old_tag) == NULL);
+    IMTEST_CHECK(ImdTagTableRemove(&table, new_tag) == &second);
+
+    free(table.slots);
+}
+
+static void
+TestReplaceKeepsTag()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    int request, tombstone, other;
+
+    ULONGLONG tag = TagTableInsert(&table, &request);
+    ULONGLONG other_tag = TagTableInsert(&table, &other);
+
+    IMTEST_CHECK(ImdTagTableReplace(&table, tag, &tombstone) == &request);
+    IMTEST_CHECK(ImdTagTableLookup(&table, tag) == &tombstone);
+    IMTEST_CHECK(ImdTagTableLookup(&table, other_tag) == &other);
+    IMTEST_CHECK(table.in_use == 2);
+
+    // Replaced item is removed with the same tag, after which neither
+    // replace nor lookup matches it.
+    IMTEST_CHECK(ImdTagTableRemove(&table, tag) == &tombstone);
+    IMTEST_CHECK(ImdTagTableReplace(&table, tag, &request) == NULL);
+    IMTEST_CHECK(ImdTagTableLookup(&table, tag) == NULL);
+
+    // Forged tags do not replace anything.
+    IMTEST_CHECK(ImdTagTableReplace(&table, other_tag + (1ULL << 32),
+        &request) == NULL);
+    IMTEST_CHECK(ImdTagTableReplace(&table, (ULONGLONG)table.capacity,
+        &request) == NULL);
+    IMTEST_CHECK(ImdTagTableLookup(&table, other_tag) == &other);
+
+    free(table.slots);
+}
+
+static void
+TestForgedTags()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    int item;
+    ULONGLONG tag = TagTableInsert(&table, &item);
+
+    IMTEST_CHECK(ImdTagTableLookup(&table, 0) == NULL);
+    IMTEST_CHECK(ImdTagTableLookup(&table, ~0ULL) == NULL);
+    IMTEST_CHECK(ImdTagTableLookup(&table, (ULONG)tag) == NULL);
+    IMTEST_CHECK(ImdTagTableLookup(&table, tag + 1) == NULL);
+    IMTEST_CHECK(ImdTagTableLookup(&table,
+        ImdTagTableMakeTag(table.capacity, 1)) == NULL);
+    IMTEST_CHECK(ImdTagTableLookup(&table,
+        ImdTagTableMakeTag(5, 1)) == NULL);
+
+    IMTEST_CHECK(table.in_use == 1);
+    IMTEST_CHECK(ImdTagTableRemove(&table, tag) == &item);
+
+    free(table.slots);
+}
+
+static void
+TestGrowKeepsTags()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    std::vector<int> items(1000);
+    std::vector<ULONGLONG> tags;
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        tags.push_back(TagTableInsert(&table, &items[i]));
+    }
+
+    IMTEST_CHECK(table.capacity == 1024);
+    IMTEST_CHECK(table.in_use == 1000);
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        IMTEST_CHECK(ImdTagTableLookup(&table, tags[i]) == &items[i]);
+    }
+
+    free(table.slots);
+}
+
+static void
+TestGenerationWrap()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    int item;
+    ULONGLONG tag = TagTableInsert(&table, &item);
+
+    table.slots[(ULONG)tag].generation = 0xFFFFFFFFUL;
+    tag = ImdTagTableMakeTag((ULONG)tag, 0xFFFFFFFFUL);
+
+    IMTEST_CHECK(ImdTagTableRemove(&table, tag) == &item);
+    IMTEST_CHECK(table.slots[(ULONG)tag].generation == 1);
+
+    tag = TagTableInsert(&table, &item);
+    IMTEST_CHECK(tag != 0);
+    IMTEST_CHECK((tag >> 32) == 1);
+
+    free(table.slots);
+}
+
+static void
+TestCapacityLimit()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    table.capacity = IMD_TAG_TABLE_MAX_CAPACITY;
+    IMTEST_CHECK(ImdTagTableNextCapacity(&table) == 0);
+
+    table.capacity = IMD_TAG_TABLE_MAX_CAPACITY >> 1;
+    IMTEST_CHECK(ImdTagTableNextCapacity(&table) == IMD_TAG_TABLE_MAX_CAPACITY);
+}
+
+///
+/// Random inserts, completions and stale or forged lookups, compared with a
+/// map of tags that should be valid.
+///
+static void
+TestRandomAgainstModel()
+{
+    IMD_TAG_TABLE table;
+    ImdTagTableInitialize(&table);
+
+    std::map<ULONGLONG, void*> model;
+    std::vector<ULONGLONG> stale;
+    uint64_t seed = 1;
+    static char items[4096];
+
+    for (int i = 0; i < 200000; i++)
+    {
+        uint32_t op = ImTestRandom(&seed) % 8;
+
+        if (op < 4 && model.size() < 3000)
+        {
+            void *item = items + ImTestRandom(&seed) % sizeof items;
+            ULONGLONG tag = TagTableInsert(&table, item);
+
+            IMTEST_CHECK(model.count(tag) == 0);
+            model[tag] = item;
+        }
+        else if (op < 7 && !model.empty())
+        {
+            auto it = model.begin();
+            std::advance(it, ImTestRandom(&seed) % model.size());
+
+            IMTEST_CHECK(ImdTagTableRemove(&table, it->first) == it->second);
+            stale.push_back(it->first);
+            model.erase(it);
+        }
+        else if (!stale.empty())
+        {
+            ULONGLONG tag = stale[ImTestRandom(&seed) % stale.size()];
+
+            if (model.count(tag) == 0)
+            {
+                IMTEST_CHECK(ImdTagTableLookup(&table, tag) == NULL);
+            }
+        }
+
+        if (imtest_failures != 0)
+        {
+            break;
+        }
+    }
+
+    IMTEST_CHECK(table.in_use == model.size());
+
+    for (auto &entry : model)
+    {
+        IMTEST_CHECK(ImdTagTableLookup(&table, entry.first) == entry.second);
+    }
+
+    free(table.slots);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestInsertLookupRemove);
+    IMTEST_RUN(TestStaleTagRejected);
+    IMTEST_RUN(TestReplaceKeepsTag);
+    IMTEST_RUN(TestForgedTags);
+    IMTEST_RUN(TestGrowKeepsTags);
+    IMTEST_RUN(TestGenerationWrap);
+    IMTEST_RUN(TestCapacityLimit);
+    IMTEST_RUN(TestRandomAgainstModel);
+
+    return IMTEST_RESULT();
+}
@@ -0,0 +1,393 @@
+/// trace_test.cpp
+/// Tests for per-processor request trace rings in imscsitrace.h. Checks that
+/// records are read oldest first, that a reader that fell behind continues
+/// at oldest record still in ring after ring wrapped, that reads can be
+/// split in parts and across 32 bit position wrap, and that records being
+/// written or left from a previous lap are skipped. Also runs writers on
+/// several threads to check that every reserved slot is written exactly
+/// once, and a reader against a writer lapping a small ring to check that
+/// no torn record is returned.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsitrace.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+///
+/// Writes a record with all fields derived from Request, so that a torn
+/// record can be recognized.
+///
+static void
+TraceTestWrite(PIMSCSI_TRACE_RING Ring, ULONGLONG Request)
+{
+    IMSCSI_TRACE_RECORD record = { };
+
+    record.timestamp = Request * 7;
+    record.request = Request;
+    record.offset = (LONGLONG)(Request << 9);
+    record.device = (ULONG)(Request >> 32);
+    record.length = (ULONG)Request ^ 0x5A5A5A5A;
+    record.stage = (UCHAR)(Request % IMSCSI_TRACE_STAGES);
+    record.opcode = (UCHAR)(Request >> 3);
+
+    ImScsiTraceWrite(Ring, &record);
+}
+
+static bool
+TraceTestConsistent(const IMSCSI_TRACE_RECORD *Record, ULONG Cpu)
+{
+    ULONGLONG request = Record->request;
+
+    return Record->timestamp == request * 7 &&
+        Record->offset == (LONGLONG)(request << 9) &&
+        Record->device == (ULONG)(request >> 32) &&
+        Record->length == ((ULONG)request ^ 0x5A5A5A5A) &&
+        Record->stage == (UCHAR)(request % IMSCSI_TRACE_STAGES) &&
+        Record->opcode == (UCHAR)(request >> 3) &&
+        Record->cpu == Cpu &&
+        Record->sequence != 0;
+}
+
+static void
+TestEmptyAndInOrder()
+{
+    IMSCSI_TRACE_RECORD records[8];
+    IMSCSI_TRACE_RECORD out[16];
+    IMSCSI_TRACE_RING ring;
+    ULONG position = 0;
+
+    ImScsiTraceInit(&ring, records, 8, 3);
+
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 0);
+    IMTEST_CHECK(position == 0);
+
+    for (ULONGLONG i = 0; i < 5; i++)
+    {
+        TraceTestWrite(&ring, i);
+    }
+
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 5);
+    IMTEST_CHECK(position == 5);
+
+    for (ULONG i = 0; i < 5; i++)
+    {
+        IMTEST_CHECK(out[i].request == i);
+        IMTEST_CHECK(out[i].sequence == i + 1);
+        IMTEST_CHECK(TraceTestConsistent(&out[i], 3));
+    }
+
+    // Nothing new
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 0);
+    IMTEST_CHECK(position == 5);
+
+    TraceTestWrite(&ring, 5);
+    TraceTestWrite(&ring, 6);
+
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 2);
+    IMTEST_CHECK(out[0].request == 5 && out[1].request == 6);
+    IMTEST_CHECK(position == 7);
+}
+
+static void
+TestWrap()
+{
+    IMSCSI_TRACE_RECORD records[8];
+    IMSCSI_TRACE_RECORD out[16];
+    IMSCSI_TRACE_RING ring;
+    ULONG position = 0;
+
+    ImScsiTraceInit(&ring, records, 8, 0);
+
+    for (ULONGLONG i = 0; i < 20; i++)
+    {
+        TraceTestWrite(&ring, i);
+    }
+
+    // Only last lap is left, oldest first
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 8);
+    IMTEST_CHECK(position == 20);
+
+    for (ULONG i = 0; i < 8; i++)
+    {
+        IMTEST_CHECK(out[i].request == 12 + i);
+        IMTEST_CHECK(TraceTestConsistent(&out[i], 0));
+    }
+}
+
+static void
+TestReaderBehind()
+{
+    IMSCSI_TRACE_RECORD records[8];
+    IMSCSI_TRACE_RECORD out[16];
+    IMSCSI_TRACE_RING ring;
+    ULONG position = 0;
+
+    ImScsiTraceInit(&ring, records, 8, 0);
+
+    for (ULONGLONG i = 0; i < 3; i++)
+    {
+        TraceTestWrite(&ring, i);
+    }
+
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 2) == 2);
+    IMTEST_CHECK(position == 2);
+
+    for (ULONGLONG i = 3; i < 13; i++)
+    {
+        TraceTestWrite(&ring, i);
+    }
+
+    // Records 2 to 4 were overwritten before reader got to them
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 8);
+    IMTEST_CHECK(out[0].request == 5 && out[7].request == 12);
+    IMTEST_CHECK(position == 13);
+
+    // Position ahead of ring, as from another ring, starts at oldest
+    position = 1000;
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 8);
+    IMTEST_CHECK(out[0].request == 5);
+    IMTEST_CHECK(position == 13);
+}
+
+static void
+TestPartialReads()
+{
+    IMSCSI_TRACE_RECORD records[16];
+    IMSCSI_TRACE_RECORD out[3];
+    IMSCSI_TRACE_RING ring;
+    ULONG position = 0;
+    ULONGLONG expected = 4;
+    ULONG copied;
+
+    ImScsiTraceInit(&ring, records, 16, 0);
+
+    for (ULONGLONG i = 0; i < 20; i++)
+    {
+        TraceTestWrite(&ring, i);
+    }
+
+    while ((copied = ImScsiTraceRead(&ring, &position, out, 3)) != 0)
+    {
+        for (ULONG i = 0; i < copied; i++)
+        {
+            IMTEST_CHECK(out[i].request == expected);
+            expected++;
+        }
+    }
+
+    IMTEST_CHECK(expected == 20);
+    IMTEST_CHECK(position == 20);
+}
+
+static void
+TestPositionWrap()
+{
+    IMSCSI_TRACE_RECORD records[8];
+    IMSCSI_TRACE_RECORD out[16];
+    IMSCSI_TRACE_RING ring;
+    ULONG position = 0xFFFFFFF0;
+
+    ImScsiTraceInit(&ring, records, 8, 0);
+
+    // As after four billion records
+    ring.position = 0xFFFFFFFA;
+
+    for (ULONGLONG i = 0; i < 10; i++)
+    {
+        TraceTestWrite(&ring, i);
+    }
+
+    IMTEST_CHECK(ring.position == 4);
+
+    // Sequence number is never zero, also for last position before wrap
+    IMTEST_CHECK(ImScsiTraceSequence(0xFFFFFFFF) != 0);
+    IMTEST_CHECK(records[7].sequence == ImScsiTraceSequence(0xFFFFFFFF));
+
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 8);
+    IMTEST_CHECK(position == 4);
+
+    for (ULONG i = 0; i < 8; i++)
+    {
+        IMTEST_CHECK(out[i].request == 2 + i);
+    }
+}
+
+static void
+TestSkipIncomplete()
+{
+    IMSCSI_TRACE_RECORD records[8];
+    IMSCSI_TRACE_RECORD out[16];
+    IMSCSI_TRACE_RING ring;
+    ULONG position = 0;
+
+    ImScsiTraceInit(&ring, records, 8, 0);
+
+    for (ULONGLONG i = 0; i < 6; i++)
+    {
+        TraceTestWrite(&ring, i);
+    }
+
+    // Being written
+    records[2].sequence = 0;
+
+    // Left from a lap before, as if a writer reserved slot and was
+    // interrupted before clearing it
+    records[4].sequence = ImScsiTraceSequence(4 - 8);
+
+    IMTEST_CHECK(ImScsiTraceRead(&ring, &position, out, 16) == 4);
+    IMTEST_CHECK(out[0].request == 0 && out[1].request == 1);
+    IMTEST_CHECK(out[2].request == 3 && out[3].request == 5);
+
+    // Skipped records are passed, not read again
+    IMTEST_CHECK(position == 6);
+}
+
+///
+/// Writers on several threads sharing a ring large enough for all records.
+/// Every record must be there once and in order for each writer.
+///
+static void
+TestConcurrentWriters()
+{
+    static const ULONG Writers = 4;
+    static const ULONG PerWriter = 50000;
+    static const ULONG Count = 1 << 18;
+
+    std::vector<IMSCSI_TRACE_RECORD> records(Count);
+    std::vector<IMSCSI_TRACE_RECORD> out(Count);
+    std::vector<std::thread> threads;
+    IMSCSI_TRACE_RING ring;
+    ULONG position = 0;
+    ULONG errors = 0;
+
+    ImScsiTraceInit(&ring, records.data(), Count, 1);
+
+    for (ULONG w = 0; w < Writers; w++)
+    {
+        threads.push_back(std::thread([&ring, w]()
+        {
+            for (ULONG n = 0; n < PerWriter; n++)
+            {
+                TraceTestWrite(&ring, ((ULONGLONG)w << 32) | n);
+            }
+        }));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    ULONG copied = ImScsiTraceRead(&ring, &position, out.data(), Count);
+
+    IMTEST_CHECK(copied == Writers * PerWriter);
+    IMTEST_CHECK(position == Writers * PerWriter);
+
+    std::vector<ULONG> next(Writers);
+
+    for (ULONG i = 0; i < copied; i++)
+    {
+        ULONG writer = (ULONG)(out[i].request >> 32);
+
+        if (!TraceTestConsistent(&out[i], 1) || writer >= Writers ||
+            (ULONG)out[i].request != next[writer])
+        {
+            errors++;
+            continue;
+        }
+
+        next[writer]++;
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+///
+/// Reader against a writer that keeps lapping a small ring. Records
+/// returned must be whole and in order, although many are missed.
+///
+static void
+TestReaderAgainstWriter()
+{
+    static const ULONGLONG Total = 4000000;
+
+    IMSCSI_TRACE_RECORD records[256];
+    IMSCSI_TRACE_RECORD out[64];
+    IMSCSI_TRACE_RING ring;
+    std::atomic<bool> done(false);
+    ULONG position = 0;
+    ULONGLONG last = 0;
+    ULONGLONG seen = 0;
+    ULONG errors = 0;
+
+    ImScsiTraceInit(&ring, records, 256, 2);
+
+    std::thread writer([&ring, &done]()
+    {
+        for (ULONGLONG n = 1; n <= Total; n++)
+        {
+            TraceTestWrite(&ring, n);
+        }
+
+        done = true;
+    });
+
+    for (;;)
+    {
+        bool finished = done;
+        ULONG copied = ImScsiTraceRead(&ring, &position, out, 64);
+
+        for (ULONG i = 0; i < copied; i++)
+        {
+            if (!TraceTestConsistent(&out[i], 2) || out[i].request <= last)
+            {
+                errors++;
+            }
+
+            last = out[i].request;
+        }
+
+        seen += copied;
+
+        if (finished && copied == 0)
+        {
+            break;
+        }
+    }
+
+    writer.join();
+
+    printf("%llu of %llu records read\n", (unsigned long long)seen,
+        (unsigned long long)Total);
+
+    IMTEST_CHECK(errors == 0);
+    IMTEST_CHECK(last == Total);
+    IMTEST_CHECK(position == (ULONG)Total);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestEmptyAndInOrder);
+    IMTEST_RUN(TestWrap);
+    IMTEST_RUN(TestReaderBehind);
+    IMTEST_RUN(TestPartialReads);
+    IMTEST_RUN(TestPositionWrap);
+    IMTEST_RUN(TestSkipIncomplete);
+    IMTEST_RUN(TestConcurrentWriters);
+    IMTEST_RUN(TestReaderAgainstWriter);
+
+    return IMTEST_RESULT();
+}
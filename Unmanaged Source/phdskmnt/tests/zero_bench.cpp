@@ -0,0 +1,126 @@
+/// zero_bench.cpp
+/// Zero scan throughput of each variant in imscsizero.h supported by the
+/// processor, for write sizes 512 bytes to 2 MB, with buffers that are all
+/// zeros and with a non-zero byte at start, in middle and at end. All-zero
+/// buffers are the case that matters when zeroed regions are written during
+/// imaging, the others show early exit on first non-zero line.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsizero.h>
+
+#include <vector>
+
+static const char *BenchLevelNames[] =
+{
+    "generic", "sse2", "avx2", "avx512", "neon"
+};
+
+static const char *BenchPlacementNames[] =
+{
+    "zero", "start", "middle", "end"
+};
+
+static const size_t BenchBytes = 2UL << 30;
+
+///
+/// Returns MB/s scanned, counting whole buffer even when scan stops early,
+/// as that is the amount of data written.
+///
+static double
+BenchScan(int Level, const UCHAR *Buffer, size_t Length)
+{
+    size_t count = BenchBytes / Length;
+    size_t zero = 0;
+
+    double start = ImTestSeconds();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        zero += ImScsiIsZero(Level, Buffer, Length);
+    }
+
+    double seconds = ImTestSeconds() - start;
+
+    // Keep result used
+    if (zero == 1)
+    {
+        printf("\n");
+    }
+
+    return BenchBytes / seconds / (1 << 20);
+}
+
+int
+main()
+{
+    std::vector<int> levels;
+    int best = ImScsiZeroScanLevel();
+
+    levels.push_back(IMSCSI_ZERO_GENERIC);
+
+    if (best == IMSCSI_ZERO_NEON)
+    {
+        levels.push_back(IMSCSI_ZERO_NEON);
+    }
+    else
+    {
+        for (int level = IMSCSI_ZERO_SSE2; level <= best; level++)
+        {
+            levels.push_back(level);
+        }
+    }
+
+    std::vector<UCHAR> buffer(4UL << 20);
+
+    printf("%8s %8s", "KB", "nonzero");
+
+    for (size_t level = 0; level < levels.size(); level++)
+    {
+        printf(" %9s MB/s", BenchLevelNames[levels[level]]);
+    }
+
+    printf("\n");
+
+    for (size_t length = 512; length <= buffer.size(); length <<= 2)
+    {
+        for (int placement = 0; placement < 4; placement++)
+        {
+            memset(buffer.data(), 0, buffer.size());
+
+            switch (placement)
+            {
+            case 1:
+                buffer[0] = 1;
+                break;
+            case 2:
+                buffer[length / 2] = 1;
+                break;
+            case 3:
+                buffer[length - 1] = 1;
+                break;
+            }
+
+            printf("%8.1f %8s", length / 1024.0, BenchPlacementNames[placement]);
+
+            for (size_t level = 0; level < levels.size(); level++)
+            {
+                printf(" %14.0f", BenchScan(levels[level], buffer.data(),
+                    length));
+            }
+
+            printf("\n");
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+/// zero_test.cpp
+/// Tests for zero scan variants in imscsizero.h. Each variant supported by
+/// the processor running the test is checked for all buffer alignments
+/// within a cache line, for lengths around line boundaries, with a single
+/// non-zero byte at every position, and with non-zero data just outside
+/// buffer, which should not be seen.
+///
+/// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
+/// This source code and API are available under the terms of the Affero General Public
+/// License v3.
+///
+/// Please see LICENSE.txt for full license terms, including the availability of
+/// proprietary exceptions.
+/// Questions, comments, or requests for clarification: http://ArsenalRecon.com/contact/
+///
+
+#include "imtest.h"
+
+#include <imscsizero.h>
+
+#include <vector>
+
+static const char *ZeroTestLevelNames[] =
+{
+    "generic", "sse2", "avx2", "avx512", "neon"
+};
+
+///
+/// Levels to test, generic and everything up to best supported one. NEON
+/// is the only variant on ARM64.
+///
+static std::vector<int>
+ZeroTestLevels()
+{
+    std::vector<int> levels;
+    int best = ImScsiZeroScanLevel();
+
+    levels.push_back(IMSCSI_ZERO_GENERIC);
+
+    if (best == IMSCSI_ZERO_NEON)
+    {
+        levels.push_back(IMSCSI_ZERO_NEON);
+        return levels;
+    }
+
+    for (int level = IMSCSI_ZERO_SSE2; level <= best; level++)
+    {
+        levels.push_back(level);
+    }
+
+    return levels;
+}
+
+static void
+TestLevel()
+{
+    int best = ImScsiZeroScanLevel();
+
+    printf("Best zero scan level %s\n", ZeroTestLevelNames[best]);
+
+    IMTEST_CHECK(best >= IMSCSI_ZERO_GENERIC && best <= IMSCSI_ZERO_NEON);
+
+#if defined(__x86_64__)
+    // SSE2 is part of x64
+    IMTEST_CHECK(best >= IMSCSI_ZERO_SSE2 && best != IMSCSI_ZERO_NEON);
+#elif defined(__aarch64__)
+    IMTEST_CHECK(best == IMSCSI_ZERO_NEON);
+#endif
+}
+
+static void
+TestSingleNonZeroByte()
+{
+    std::vector<int> levels = ZeroTestLevels();
+    std::vector<UCHAR> buffer(1024 + 3 * IMSCSI_ZERO_LINE_SIZE);
+    unsigned errors = 0;
+
+    for (size_t level = 0; level < levels.size(); level++)
+    {
+        for (size_t align = 0; align < IMSCSI_ZERO_LINE_SIZE; align++)
+        {
+            for (size_t length = 0; length <= 320; length++)
+            {
+                // Vector data is 16 byte aligned, round up to line
+                UCHAR *base = buffer.data() +
+                    ((IMSCSI_ZERO_LINE_SIZE -
+                    ((uintptr_t)buffer.data() & (IMSCSI_ZERO_LINE_SIZE - 1))) &
+                    (IMSCSI_ZERO_LINE_SIZE - 1));
+                UCHAR *ptr = base + IMSCSI_ZERO_LINE_SIZE + align;
+
+                memset(buffer.data(), 0xFF, buffer.size());
+                memset(ptr, 0, length);
+
+                // Non-zero data right before and after buffer
+                if (!ImScsiIsZero(levels[level], ptr, length))
+                {
+                    errors++;
+                }
+
+                for (size_t pos = 0; pos < length; pos++)
+                {
+                    ptr[pos] = (UCHAR)(1 << (pos & 7));
+
+                    if (ImScsiIsZero(levels[level], ptr, length))
+                    {
+                        errors++;
+                    }
+
+                    ptr[pos] = 0;
+                }
+            }
+        }
+
+        printf("%-8s checked\n", ZeroTestLevelNames[levels[level]]);
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+static void
+TestLargeBuffers()
+{
+    std::vector<int> levels = ZeroTestLevels();
+    std::vector<UCHAR> buffer((4UL << 20) + 64);
+    unsigned errors = 0;
+
+    for (size_t level = 0; level < levels.size(); level++)
+    {
+        for (size_t length = 16UL << 10; length <= (4UL << 20);
+            length <<= 2)
+        {
+            memset(buffer.data(), 0, buffer.size());
+
+            if (!ImScsiIsZero(levels[level], buffer.data() + 8, length))
+            {
+                errors++;
+            }
+
+            // Last byte, in the part after last whole line
+            buffer[8 + length - 1] = 0x80;
+
+            if (ImScsiIsZero(levels[level], buffer.data() + 8, length))
+            {
+                errors++;
+            }
+
+            buffer[8 + length - 1] = 0;
+            buffer[8 + length / 2] = 0x01;
+
+            if (ImScsiIsZero(levels[level], buffer.data() + 8, length))
+            {
+                errors++;
+            }
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+static void
+TestRandomAgainstGeneric()
+{
+    std::vector<int> levels = ZeroTestLevels();
+    std::vector<UCHAR> buffer(8192 + 64);
+    uint64_t state = 19;
+    unsigned errors = 0;
+
+    for (int i = 0; i < 200000; i++)
+    {
+        size_t offset = ImTestRandom(&state) % 64;
+        size_t length = ImTestRandom(&state) % 8192;
+        UCHAR *ptr = buffer.data() + offset;
+
+        memset(buffer.data(), 0, buffer.size());
+
+        // Mostly zero, with a few non-zero bytes anywhere near buffer
+        unsigned count = ImTestRandom(&state) % 3;
+
+        for (unsigned j = 0; j < count; j++)
+        {
+            buffer[ImTestRandom(&state) % buffer.size()] =
+                (UCHAR)(1 + ImTestRandom(&state) % 255);
+        }
+
+        int expected = ImScsiIsZeroGeneric(ptr, length);
+
+        for (size_t level = 1; level < levels.size(); level++)
+        {
+            if (!ImScsiIsZero(levels[level], ptr, length) != !expected)
+            {
+                errors++;
+            }
+        }
+    }
+
+    IMTEST_CHECK(errors == 0);
+}
+
+int
+main()
+{
+    IMTEST_RUN(TestLevel);
+    IMTEST_RUN(TestSingleNonZeroByte);
+    IMTEST_RUN(TestLargeBuffers);
+    IMTEST_RUN(TestRandomAgainstGeneric);
+
+    return IMTEST_RESULT();
+}
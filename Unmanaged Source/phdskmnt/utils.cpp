@@ -1,7 +1,8 @@
 
 /// utils.c
 /// Retrieves registry parameter values in a structure, and set default
-/// values on those fields not defined in registry.
+/// values on those fields not defined in registry. Also free lists for work
+/// items and data buffers used on I/O path.
 /// 
 /// Copyright (c) 2012-2025, Arsenal Consulting, Inc. (d/b/a Arsenal Recon) <http://www.ArsenalRecon.com>
 /// This source code and API are available under the terms of the Affero General Public
@@ -39,6 +40,12 @@ None
 
     defRegInfo.NumberOfBuses = DEFAULT_NUMBER_OF_BUSES;
     defRegInfo.InitiatorID = DEFAULT_INITIATOR_ID;
+    defRegInfo.ReadCacheSizePerLU = DEFAULT_READ_CACHE_SIZE_PER_LU;
+    defRegInfo.ReadCacheSizeTotal = DEFAULT_READ_CACHE_SIZE_TOTAL;
+    defRegInfo.ReadAheadMaxSize = DEFAULT_READ_AHEAD_MAX_SIZE;
+    defRegInfo.WorkerThreadsPerLU = DEFAULT_WORKER_THREADS_PER_LU;
+    defRegInfo.MergeMaxSize = DEFAULT_MERGE_MAX_SIZE;
+    defRegInfo.TraceBufferSize = DEFAULT_TRACE_BUFFER_SIZE;
 
     RtlInitUnicodeString(&defRegInfo.VendorId, VENDOR_ID);
     RtlInitUnicodeString(&defRegInfo.ProductId, PRODUCT_ID);
@@ -60,6 +67,12 @@ None
 
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"NumberOfBuses", &pRegInfo->NumberOfBuses, REG_DWORD, &defRegInfo.NumberOfBuses, sizeof(ULONG) },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"InitiatorID", &pRegInfo->InitiatorID, REG_DWORD, &defRegInfo.InitiatorID, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ReadCacheSizePerLU", &pRegInfo->ReadCacheSizePerLU, REG_DWORD, &defRegInfo.ReadCacheSizePerLU, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ReadCacheSizeTotal", &pRegInfo->ReadCacheSizeTotal, REG_DWORD, &defRegInfo.ReadCacheSizeTotal, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ReadAheadMaxSize", &pRegInfo->ReadAheadMaxSize, REG_DWORD, &defRegInfo.ReadAheadMaxSize, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"WorkerThreadsPerLU", &pRegInfo->WorkerThreadsPerLU, REG_DWORD, &defRegInfo.WorkerThreadsPerLU, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"MergeMaxSize", &pRegInfo->MergeMaxSize, REG_DWORD, &defRegInfo.MergeMaxSize, sizeof(ULONG) },
+            { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"TraceBufferSize", &pRegInfo->TraceBufferSize, REG_DWORD, &defRegInfo.TraceBufferSize, sizeof(ULONG) },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"VendorId", &pRegInfo->VendorId, REG_SZ, defRegInfo.VendorId.Buffer, 0 },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ProductId", &pRegInfo->ProductId, REG_SZ, defRegInfo.ProductId.Buffer, 0 },
             { NULL, RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_NOEXPAND, L"ProductRevision", &pRegInfo->ProductRevision, REG_SZ, defRegInfo.ProductRevision.Buffer, 0 },
@@ -81,6 +94,12 @@ None
         if (!NT_SUCCESS(status)) {                    // A problem?
             pRegInfo->NumberOfBuses = defRegInfo.NumberOfBuses;
             pRegInfo->InitiatorID = defRegInfo.InitiatorID;
+            pRegInfo->ReadCacheSizePerLU = defRegInfo.ReadCacheSizePerLU;
+            pRegInfo->ReadCacheSizeTotal = defRegInfo.ReadCacheSizeTotal;
+            pRegInfo->ReadAheadMaxSize = defRegInfo.ReadAheadMaxSize;
+            pRegInfo->WorkerThreadsPerLU = defRegInfo.WorkerThreadsPerLU;
+            pRegInfo->MergeMaxSize = defRegInfo.MergeMaxSize;
+            pRegInfo->TraceBufferSize = defRegInfo.TraceBufferSize;
             RtlCopyUnicodeString(&pRegInfo->VendorId, &defRegInfo.VendorId);
             RtlCopyUnicodeString(&pRegInfo->ProductId, &defRegInfo.ProductId);
             RtlCopyUnicodeString(&pRegInfo->ProductRevision, &defRegInfo.ProductRevision);
@@ -88,3 +107,576 @@ None
     }
 }                                                     // End MpQueryRegParameters().
 
+
+/**************************************************************************************************/
+/*                                                                                                */
+/* Free lists for work items and data buffers.                                                    */
+/*                                                                                                */
+/**************************************************************************************************/
+
+//
+// Work items and data buffers are allocated and freed for each request.
+// Size classes and free list accounting are in imscsipool.h, lists and
+// locks are here. All of this can be called at DISPATCH_LEVEL, like from
+// completion routines.
+//
+
+static VOID
+ImScsiInitializePoolClass(PIMSCSI_POOL_CLASS PoolClass, ULONG Size)
+{
+    RtlZeroMemory(PoolClass, sizeof(*PoolClass));
+
+    KeInitializeSpinLock(&PoolClass->Lock);
+
+    PoolClass->State.Size = Size;
+}
+
+static PVOID
+ImScsiPoolAllocate(PIMSCSI_POOL_CLASS PoolClass, SIZE_T Size)
+{
+    PSINGLE_LIST_ENTRY entry;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    ImScsiAcquireLock(&PoolClass->Lock, &lock_handle, lowest_assumed_irql);
+
+    entry = PopEntryList(&PoolClass->FreeList);
+
+    ImScsiPoolCountAllocate(&PoolClass->State, entry != NULL);
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (entry != NULL)
+    {
+        return entry;
+    }
+
+    entry = (PSINGLE_LIST_ENTRY)ExAllocatePoolWithTag(NonPagedPool, Size,
+        MP_TAG_GENERAL);
+
+    if (entry == NULL)
+    {
+        ImScsiAcquireLock(&PoolClass->Lock, &lock_handle, lowest_assumed_irql);
+
+        ImScsiPoolCountFailure(&PoolClass->State);
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+    }
+
+    return entry;
+}
+
+static VOID
+ImScsiPoolFree(PIMSCSI_POOL_CLASS PoolClass, PVOID Entry)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    BOOLEAN keep;
+
+    ImScsiAcquireLock(&PoolClass->Lock, &lock_handle, lowest_assumed_irql);
+
+    keep = (BOOLEAN)ImScsiPoolCountFree(&PoolClass->State);
+
+    if (keep)
+    {
+        PushEntryList(&PoolClass->FreeList, (PSINGLE_LIST_ENTRY)Entry);
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    if (!keep)
+    {
+        ExFreePoolWithTag(Entry, MP_TAG_GENERAL);
+    }
+}
+
+//
+// Changes capacity of a class and fills it up to new capacity if Fill is
+// set, otherwise frees entries above new capacity.
+//
+static VOID
+ImScsiPoolSetCapacity(PIMSCSI_POOL_CLASS PoolClass, LONG Change, BOOLEAN Fill)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    SINGLE_LIST_ENTRY excess = { NULL };
+    PSINGLE_LIST_ENTRY entry;
+    ULONG excess_count;
+    ULONG missing;
+
+    ImScsiAcquireLock(&PoolClass->Lock, &lock_handle, lowest_assumed_irql);
+
+    excess_count = ImScsiPoolChangeCapacity(&PoolClass->State, Change,
+        &missing);
+
+    while (excess_count-- > 0)
+    {
+        PushEntryList(&excess, PopEntryList(&PoolClass->FreeList));
+    }
+
+    if (!Fill)
+    {
+        missing = 0;
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+    while ((entry = PopEntryList(&excess)) != NULL)
+    {
+        ExFreePoolWithTag(entry, MP_TAG_GENERAL);
+    }
+
+    while (missing-- > 0)
+    {
+        entry = (PSINGLE_LIST_ENTRY)ExAllocatePoolWithTag(NonPagedPool,
+            PoolClass->State.Size, MP_TAG_GENERAL);
+
+        if (entry == NULL)
+        {
+            break;
+        }
+
+        ImScsiAcquireLock(&PoolClass->Lock, &lock_handle, lowest_assumed_irql);
+
+        PushEntryList(&PoolClass->FreeList, entry);
+        PoolClass->State.FreeCount++;
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+    }
+}
+
+static PIMSCSI_POOL_CLASS
+ImScsiBufferPoolClass(ULONG Size)
+{
+    ULONG index = ImScsiPoolClassIndex(Size);
+
+    if (index < IMSCSI_POOL_CLASSES)
+    {
+        return &pMPDrvInfoGlobal->BufferPool[index];
+    }
+
+    return &pMPDrvInfoGlobal->LargeBufferPool;
+}
+
+VOID
+ImScsiInitializePools()
+{
+    ULONG i;
+
+    ImScsiInitializePoolClass(&pMPDrvInfoGlobal->WorkItemPool,
+        sizeof(MP_WorkRtnParms));
+
+    for (i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        ImScsiInitializePoolClass(&pMPDrvInfoGlobal->BufferPool[i],
+            ImScsiPoolClassSize(i));
+    }
+
+    ImScsiInitializePoolClass(&pMPDrvInfoGlobal->LargeBufferPool, 0);
+}
+
+//
+// Called with +1 when an LU is created and -1 when it is freed. Work items
+// for a new LU are allocated right away, data buffers are kept as they are
+// freed after use.
+//
+VOID
+ImScsiResizePools(LONG LUCountChange)
+{
+    ULONG i;
+
+    ImScsiPoolSetCapacity(&pMPDrvInfoGlobal->WorkItemPool,
+        LUCountChange * IMSCSI_POOL_WORK_ITEMS_PER_LU,
+        (BOOLEAN)(LUCountChange > 0));
+
+    for (i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        ImScsiPoolSetCapacity(&pMPDrvInfoGlobal->BufferPool[i],
+            LUCountChange * (LONG)ImScsiPoolBuffersPerLU(i), FALSE);
+    }
+
+    KdPrint((__FUNCTION__ ": Work items in use %u, high-water %u, %I64u of %I64u allocations from free list.\n",
+        pMPDrvInfoGlobal->WorkItemPool.State.InUse,
+        pMPDrvInfoGlobal->WorkItemPool.State.HighWater,
+        pMPDrvInfoGlobal->WorkItemPool.State.Hits,
+        pMPDrvInfoGlobal->WorkItemPool.State.Allocations));
+
+    for (i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        KdPrint((__FUNCTION__ ": %u KB buffers in use %u, high-water %u, %I64u of %I64u allocations from free list.\n",
+            pMPDrvInfoGlobal->BufferPool[i].State.Size >> 10,
+            pMPDrvInfoGlobal->BufferPool[i].State.InUse,
+            pMPDrvInfoGlobal->BufferPool[i].State.HighWater,
+            pMPDrvInfoGlobal->BufferPool[i].State.Hits,
+            pMPDrvInfoGlobal->BufferPool[i].State.Allocations));
+    }
+
+    KdPrint((__FUNCTION__ ": Larger buffers in use %u, high-water %u, %I64u allocations.\n",
+        pMPDrvInfoGlobal->LargeBufferPool.State.InUse,
+        pMPDrvInfoGlobal->LargeBufferPool.State.HighWater,
+        pMPDrvInfoGlobal->LargeBufferPool.State.Allocations));
+}
+
+VOID
+ImScsiFreePools()
+{
+    ULONG i;
+
+    ImScsiPoolSetCapacity(&pMPDrvInfoGlobal->WorkItemPool, MINLONG, FALSE);
+
+    for (i = 0; i < IMSCSI_POOL_CLASSES; i++)
+    {
+        ImScsiPoolSetCapacity(&pMPDrvInfoGlobal->BufferPool[i], MINLONG, FALSE);
+    }
+}
+
+PVOID
+ImScsiAllocateBuffer(ULONG Size)
+{
+    PIMSCSI_POOL_CLASS pool_class = ImScsiBufferPoolClass(Size);
+
+    return ImScsiPoolAllocate(pool_class,
+        pool_class->State.Size != 0 ? pool_class->State.Size : Size);
+}
+
+//
+// Size needs to be the same as when buffer was allocated.
+//
+VOID
+ImScsiFreeBuffer(PVOID Buffer, ULONG Size)
+{
+    ImScsiPoolFree(ImScsiBufferPoolClass(Size), Buffer);
+}
+
+pMP_WorkRtnParms
+ImScsiAllocateWorkItem()
+{
+    return (pMP_WorkRtnParms)ImScsiPoolAllocate(
+        &pMPDrvInfoGlobal->WorkItemPool, sizeof(MP_WorkRtnParms));
+}
+
+VOID
+ImScsiFreeWorkItem(pMP_WorkRtnParms pWkRtnParms)
+{
+    ImScsiPoolFree(&pMPDrvInfoGlobal->WorkItemPool, pWkRtnParms);
+}
+
+//
+// Picks the variant used by ImScsiIsBufferZero. AVX-512 registers can only
+// be saved if headers used to build driver know about them.
+//
+VOID
+ImScsiInitializeZeroScan()
+{
+    int level = ImScsiZeroScanLevel();
+
+#if defined(_M_AMD64)
+#if !defined(XSTATE_MASK_AVX512)
+    if (level > IMSCSI_ZERO_AVX2)
+    {
+        level = IMSCSI_ZERO_AVX2;
+    }
+#endif
+#elif !defined(_M_ARM64)
+    // Floating point state needs to be saved to use SSE2 in x86 kernel mode
+    level = IMSCSI_ZERO_GENERIC;
+#endif
+
+    pMPDrvInfoGlobal->ZeroScanLevel = level;
+
+    KdPrint(("PhDskMnt::ImScsiInitializeZeroScan: Using zero scan level %i\n",
+        level));
+}
+
+//
+// Checks whether a buffer contains only zeros. SSE2 and NEON registers can
+// be used freely in 64 bit kernel mode, but AVX state needs to be saved,
+// which is only worth it for larger buffers.
+//
+BOOLEAN
+ImScsiIsBufferZero(PVOID Buffer, ULONG Length)
+{
+    int level = pMPDrvInfoGlobal->ZeroScanLevel;
+
+    if (Length < sizeof(ULONGLONG))
+    {
+        return FALSE;
+    }
+
+#if defined(_M_AMD64)
+    if (level >= IMSCSI_ZERO_AVX2)
+    {
+        if (Length >= IMSCSI_ZERO_SCAN_AVX_MIN)
+        {
+            XSTATE_SAVE xstate_save;
+            ULONG64 xstate_mask = XSTATE_MASK_AVX;
+            BOOLEAN result;
+
+#if defined(XSTATE_MASK_AVX512)
+            if (level == IMSCSI_ZERO_AVX512)
+            {
+                xstate_mask |= XSTATE_MASK_AVX512;
+            }
+#endif
+
+            if (NT_SUCCESS(KeSaveExtendedProcessorState(xstate_mask,
+                &xstate_save)))
+            {
+                result = (BOOLEAN)ImScsiIsZero(level, Buffer, Length);
+
+                KeRestoreExtendedProcessorState(&xstate_save);
+
+                return result;
+            }
+        }
+
+        level = IMSCSI_ZERO_SSE2;
+    }
+#endif
+
+    return (BOOLEAN)ImScsiIsZero(level, Buffer, Length);
+}
+
+//
+// Converts performance counter ticks to 100 ns units used by IMSCSI_STATS.
+//
+static ULONGLONG
+ImScsiStatsTicks(LONGLONG Ticks)
+{
+    ULONGLONG frequency = (ULONGLONG)pMPDrvInfoGlobal->PerformanceFrequency;
+
+    if ((Ticks <= 0) || (frequency == 0))
+    {
+        return 0;
+    }
+
+    return ((ULONGLONG)Ticks / frequency) * 10000000ULL +
+        ((ULONGLONG)Ticks % frequency) * 10000000ULL / frequency;
+}
+
+//
+// Counts a SCSI request on an LU as queued and starts timing it. Called when
+// request is handed over to a worker thread or to image I/O. Also adds it to
+// request trace.
+//
+VOID
+ImScsiStatsRequestQueued(pMP_WorkRtnParms pWkRtnParms,
+    PKIRQL LowestAssumedIrql)
+{
+    pHW_LU_EXTENSION pLUExt = pWkRtnParms->pLUExt;
+    KLOCK_QUEUE_HANDLE lock_handle;
+
+    if ((pLUExt == NULL) ||
+        (pWkRtnParms->pSrb == NULL) ||
+        (pWkRtnParms->pSrb->Function != SRB_FUNCTION_EXECUTE_SCSI) ||
+        (pWkRtnParms->StartTime != 0))
+    {
+        return;
+    }
+
+    pWkRtnParms->StartTime = ImScsiGetTimestamp();
+
+    ImScsiTraceRequest(pLUExt, pWkRtnParms->pSrb, IMSCSI_TRACE_QUEUED);
+
+    ImScsiAcquireLock(&pLUExt->StatsLock, &lock_handle, *LowestAssumedIrql);
+
+    ImScsiStatsQueue(&pLUExt->Stats);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+}
+
+//
+// Counts a finished SCSI request and adds it to request trace. Needs to be
+// called before SRB is completed, while its status and transfer length are
+// still valid. BackendTime is zero for requests that did not reach image.
+//
+VOID
+ImScsiStatsRequestDone(pHW_LU_EXTENSION pLUExt,
+    PSCSI_REQUEST_BLOCK pSrb, LONGLONG StartTime, LONGLONG BackendTime,
+    BOOLEAN Queued, PKIRQL LowestAssumedIrql)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    ULONGLONG total_time = ImScsiStatsTicks(ImScsiGetTimestamp() - StartTime);
+    ULONGLONG backend_time = ImScsiStatsTicks(BackendTime);
+    ULONGLONG bytes = 0;
+    int kind;
+
+    ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_COMPLETED);
+
+    switch (pSrb->Cdb[0])
+    {
+    case SCSIOP_READ:
+    case SCSIOP_READ16:
+        kind = IMSCSI_STATS_READ;
+        bytes = pSrb->DataTransferLength;
+        break;
+
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE16:
+        kind = IMSCSI_STATS_WRITE;
+        bytes = pSrb->DataTransferLength;
+        break;
+
+    case SCSIOP_UNMAP:
+        kind = IMSCSI_STATS_UNMAP;
+        break;
+
+    default:
+        kind = IMSCSI_STATS_OTHER;
+        break;
+    }
+
+    // Backend time of zero means request never reached image
+    if ((BackendTime > 0) && (backend_time == 0))
+    {
+        backend_time = 1;
+    }
+
+    ImScsiAcquireLock(&pLUExt->StatsLock, &lock_handle, *LowestAssumedIrql);
+
+    ImScsiStatsFinish(&pLUExt->Stats, kind, bytes, total_time, backend_time,
+        SRB_STATUS(pSrb->SrbStatus) != SRB_STATUS_SUCCESS, Queued);
+
+    ImScsiReleaseLock(&lock_handle, LowestAssumedIrql);
+}
+
+//
+// Counts a finished work item, if it was counted by ImScsiStatsRequestQueued.
+//
+VOID
+ImScsiStatsWorkDone(pMP_WorkRtnParms pWkRtnParms,
+    PKIRQL LowestAssumedIrql)
+{
+    if (pWkRtnParms->StartTime == 0)
+    {
+        return;
+    }
+
+    ImScsiStatsRequestDone(pWkRtnParms->pLUExt, pWkRtnParms->pSrb,
+        pWkRtnParms->StartTime, pWkRtnParms->BackendTime, TRUE,
+        LowestAssumedIrql);
+
+    pWkRtnParms->StartTime = 0;
+}
+
+//
+// Allocates trace rings for all processors, with TraceBufferSize KB of
+// records in each, rounded down to a power of two number of records.
+// Tracing stays disabled if that fails.
+//
+VOID
+ImScsiInitializeTrace()
+{
+    ULONGLONG buffer_size =
+        (ULONGLONG)pMPDrvInfoGlobal->MPRegInfo.TraceBufferSize << 10;
+    ULONG record_count = 1;
+    ULONG cpu_count;
+    PIMSCSI_TRACE_RING rings;
+    PIMSCSI_TRACE_RECORD records;
+    ULONG i;
+
+    if (buffer_size < sizeof(IMSCSI_TRACE_RECORD))
+    {
+        return;
+    }
+
+    while ((record_count < (1UL << 20)) &&
+        ((ULONGLONG)record_count * 2 * sizeof(IMSCSI_TRACE_RECORD) <= buffer_size))
+    {
+        record_count <<= 1;
+    }
+
+#if _NT_TARGET_VERSION >= 0x601
+    cpu_count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#else
+    cpu_count = KeQueryActiveProcessorCount(NULL);
+#endif
+
+    if (cpu_count == 0)
+    {
+        return;
+    }
+
+    rings = (PIMSCSI_TRACE_RING)ExAllocatePoolWithTag(NonPagedPool,
+        (SIZE_T)cpu_count * (sizeof(IMSCSI_TRACE_RING) +
+            record_count * sizeof(IMSCSI_TRACE_RECORD)),
+        MP_TAG_GENERAL);
+
+    if (rings == NULL)
+    {
+        DbgPrint(__FUNCTION__ ": Memory allocation failed, tracing disabled.\n");
+        return;
+    }
+
+    records = (PIMSCSI_TRACE_RECORD)(rings + cpu_count);
+
+    for (i = 0; i < cpu_count; i++)
+    {
+        ImScsiTraceInit(&rings[i], records + (SIZE_T)i * record_count,
+            record_count, i);
+    }
+
+    KdPrint((__FUNCTION__ ": %u trace records for each of %u processors.\n",
+        record_count, cpu_count));
+
+    pMPDrvInfoGlobal->TraceRingCount = cpu_count;
+    pMPDrvInfoGlobal->TraceRings = rings;
+}
+
+VOID
+ImScsiFreeTrace()
+{
+    PIMSCSI_TRACE_RING rings = pMPDrvInfoGlobal->TraceRings;
+
+    if (rings == NULL)
+    {
+        return;
+    }
+
+    pMPDrvInfoGlobal->TraceRings = NULL;
+    pMPDrvInfoGlobal->TraceRingCount = 0;
+
+    ExFreePoolWithTag(rings, MP_TAG_GENERAL);
+}
+
+VOID
+ImScsiTraceWriteRequest(pHW_LU_EXTENSION pLUExt,
+    PSCSI_REQUEST_BLOCK pSrb, UCHAR Stage)
+{
+    PCDB pCdb = (PCDB)pSrb->Cdb;
+    IMSCSI_TRACE_RECORD record;
+    LARGE_INTEGER starting_sector = { 0 };
+    ULONG cpu;
+
+#if _NT_TARGET_VERSION >= 0x601
+    cpu = KeGetCurrentProcessorNumberEx(NULL);
+#else
+    cpu = KeGetCurrentProcessorNumber();
+#endif
+
+    switch (pCdb->AsByte[0])
+    {
+    case SCSIOP_READ16:
+    case SCSIOP_WRITE16:
+        REVERSE_BYTES_QUAD(&starting_sector, pCdb->CDB16.LogicalBlock);
+        break;
+
+    case SCSIOP_READ:
+    case SCSIOP_WRITE:
+        REVERSE_BYTES(&starting_sector, &pCdb->CDB10.LogicalBlockByte0);
+        break;
+    }
+
+    record.timestamp = (ULONGLONG)ImScsiGetTimestamp();
+    record.request = (ULONGLONG)(ULONG_PTR)pSrb;
+    record.offset = starting_sector.QuadPart << pLUExt->BlockPower;
+    record.device = pLUExt->DeviceNumber.LongNumber;
+    record.length = pSrb->DataTransferLength;
+    record.stage = Stage;
+    record.opcode = pCdb->AsByte[0];
+
+    // Processors added after rings were allocated share rings with others
+    ImScsiTraceWrite(
+        &pMPDrvInfoGlobal->TraceRings[cpu % pMPDrvInfoGlobal->TraceRingCount],
+        &record);
+}
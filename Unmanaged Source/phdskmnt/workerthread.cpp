@@ -25,21 +25,533 @@
 /*                                                                                                */
 /**************************************************************************************************/
 
+/**************************************************************************************************/
+/*                                                                                                */
+/* Scheduling of requests between worker threads serving the same LU.                             */
+/*                                                                                                */
+/**************************************************************************************************/
+
+//
+// Byte range on device accessed by a queued request. Anything other than
+// reads and writes, like UNMAP, reservations and cache flushes, is served
+// alone.
+//
+static VOID
+ImScsiGetWorkRange(
+    __in pMP_WorkRtnParms pWkRtnParms,
+    __out PIMSCSI_SCHED_RANGE Range)
+{
+    PSCSI_REQUEST_BLOCK pSrb = pWkRtnParms->pSrb;
+    PCDB pCdb;
+    LARGE_INTEGER startingSector;
+
+    if ((pSrb == NULL) ||
+        (pSrb->Function != SRB_FUNCTION_EXECUTE_SCSI))
+    {
+        ImScsiSchedSetBarrier(Range);
+        return;
+    }
+
+    pCdb = (PCDB)pSrb->Cdb;
+
+    switch (pCdb->AsByte[0])
+    {
+    case SCSIOP_READ16:
+    case SCSIOP_WRITE16:
+        REVERSE_BYTES_QUAD(&startingSector, pCdb->CDB16.LogicalBlock);
+        break;
+
+    case SCSIOP_READ:
+    case SCSIOP_WRITE:
+        startingSector.QuadPart = 0;
+        REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
+        break;
+
+    default:
+        ImScsiSchedSetBarrier(Range);
+        return;
+    }
+
+    ImScsiSchedSetRange(Range,
+        startingSector.QuadPart << pWkRtnParms->pLUExt->BlockPower,
+        pSrb->DataTransferLength,
+        (pCdb->AsByte[0] == SCSIOP_WRITE) || (pCdb->AsByte[0] == SCSIOP_WRITE16));
+}
+
+//
+// Whether a read or write request can be served together with adjacent
+// requests. Requests that someone waits for, and anything that needs the
+// checks in ImScsiDispatchReadWrite, are served alone.
+//
+static BOOLEAN
+ImScsiCanMergeWork(
+    __in pMP_WorkRtnParms pWkRtnParms,
+    __in PIMSCSI_SCHED_RANGE Range)
+{
+    pHW_LU_EXTENSION pLUExt = pWkRtnParms->pLUExt;
+
+    return (BOOLEAN)(!Range->barrier &&
+        (Range->end > Range->offset) &&
+        (pWkRtnParms->pReqThread == NULL) &&
+        (pWkRtnParms->CallerWaitEvent == NULL) &&
+        (pLUExt->RegistrationKey == 0) &&
+        (pLUExt->ReservationKey == 0) &&
+        (pLUExt->FakeDiskSignature == 0));
+}
+
+//
+// Removes queued requests that continue where Range ends, in the same
+// direction, and links them to First through pMergedNext. If LU allows gaps
+// between merged requests, the closest request after Range end is taken
+// each time. Queued holds ranges for requests up to Index, First being at
+// Index. A request is only merged if it could have been started on its
+// own, so order towards conflicting requests is kept. Range is extended to
+// cover all merged requests, including gaps. Called with RequestListLock
+// held.
+//
+static VOID
+ImScsiMergeLUWork(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in PLIST_ENTRY First,
+    __inout PIMSCSI_SCHED_RANGE Queued,
+    __in ULONG Index,
+    __inout PIMSCSI_SCHED_RANGE Range)
+{
+    PLIST_ENTRY entries[IMSCSI_SCHED_SCAN_DEPTH] = { NULL };
+    pMP_WorkRtnParms last = CONTAINING_RECORD(First, MP_WorkRtnParms, RequestListEntry);
+    IMSCSI_MERGE merge;
+    PLIST_ENTRY entry;
+    BOOLEAN found;
+    ULONG count;
+    ULONG i;
+
+    ImScsiMergeInit(&merge, Range->offset, (ULONG)(Range->end - Range->offset),
+        Range->write, pLUExt->MergeMaxSize);
+
+    ImScsiMergeAllowGaps(&merge, pLUExt->MergeMaxSpan);
+
+    for (entry = First->Flink, count = Index + 1;
+        (entry != &pLUExt->RequestList) && (count < IMSCSI_SCHED_SCAN_DEPTH);
+        entry = entry->Flink, count++)
+    {
+        entries[count] = entry;
+
+        ImScsiGetWorkRange(
+            CONTAINING_RECORD(entry, MP_WorkRtnParms, RequestListEntry),
+            &Queued[count]);
+    }
+
+    // Start over after each merged request, since one queued earlier could
+    // continue where that one ends
+    do
+    {
+        ULONG best = 0;
+
+        found = FALSE;
+
+        for (i = Index + 1; i < count; i++)
+        {
+            pMP_WorkRtnParms next;
+
+            if ((entries[i] == NULL) ||
+                (found && (Queued[i].offset >= Queued[best].offset)))
+            {
+                continue;
+            }
+
+            next = CONTAINING_RECORD(entries[i], MP_WorkRtnParms, RequestListEntry);
+
+            if (!ImScsiCanMergeWork(next, &Queued[i]) ||
+                !ImScsiMergeCanAppend(&merge, Queued[i].offset,
+                    (ULONG)(Queued[i].end - Queued[i].offset), Queued[i].write) ||
+                !ImScsiSchedCanStart(&pLUExt->Sched, Queued, i))
+            {
+                continue;
+            }
+
+            best = i;
+            found = TRUE;
+
+            if (Queued[i].offset == merge.end)
+            {
+                break;
+            }
+        }
+
+        if (found)
+        {
+            pMP_WorkRtnParms next = CONTAINING_RECORD(entries[best],
+                MP_WorkRtnParms, RequestListEntry);
+
+            ImScsiMergeAppend(&merge, Queued[best].offset,
+                (ULONG)(Queued[best].end - Queued[best].offset));
+
+            RemoveEntryList(entries[best]);
+            entries[best] = NULL;
+
+            last->pMergedNext = next;
+            last = next;
+        }
+    } while (found);
+
+    Range->end = merge.end;
+}
+
+//
+// Removes first request in LU queue that does not conflict with requests in
+// progress or with requests queued before it. Called with RequestListLock
+// held. Returns NULL if all queued requests have to wait.
+//
+static PLIST_ENTRY
+ImScsiSelectLUWork(
+    __in pHW_LU_EXTENSION pLUExt,
+    __out int *Slot)
+{
+    IMSCSI_SCHED_RANGE queued[IMSCSI_SCHED_SCAN_DEPTH];
+    PLIST_ENTRY entry;
+    ULONG count;
+
+    for (entry = pLUExt->RequestList.Flink, count = 0;
+        (entry != &pLUExt->RequestList) && (count < IMSCSI_SCHED_SCAN_DEPTH);
+        entry = entry->Flink, count++)
+    {
+        pMP_WorkRtnParms pWkRtnParms =
+            CONTAINING_RECORD(entry, MP_WorkRtnParms, RequestListEntry);
+
+        ImScsiGetWorkRange(pWkRtnParms, &queued[count]);
+
+        if (ImScsiSchedCanStart(&pLUExt->Sched, queued, count))
+        {
+            IMSCSI_SCHED_RANGE range = queued[count];
+
+            if ((pLUExt->MergeMaxSize != 0) &&
+                ImScsiCanMergeWork(pWkRtnParms, &range))
+            {
+                ImScsiMergeLUWork(pLUExt, entry, queued, count, &range);
+            }
+
+            *Slot = ImScsiSchedStart(&pLUExt->Sched, &range, count);
+
+            if (*Slot != IMSCSI_SCHED_NO_SLOT)
+            {
+                KeClearEvent(&pLUExt->SchedIdle);
+            }
+
+            RemoveEntryList(entry);
+
+            return entry;
+        }
+
+        if (queued[count].barrier)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static VOID
+ImScsiFinishLUWork(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in int Slot)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    ImScsiAcquireLock(&pLUExt->RequestListLock, &lock_handle, lowest_assumed_irql);
+
+    ImScsiSchedFinish(&pLUExt->Sched, Slot);
+
+    if (pLUExt->Sched.active_count == 0)
+    {
+        KeSetEvent(&pLUExt->SchedIdle, (KPRIORITY)0, FALSE);
+    }
+
+    // Queued requests that waited for this one could be started by idle
+    // workers now
+    if ((pLUExt->IdleWorkers > 0) &&
+        !IsListEmpty(&pLUExt->RequestList))
+    {
+        KeSetEvent(&pLUExt->RequestEvent, (KPRIORITY)0, FALSE);
+    }
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+}
+
+//
+// Starts an extra worker thread for an LU. Caller has reserved Index in
+// ExtraWorkerThreads by incrementing WorkerCount. If thread could not be
+// started, WorkerCount is decremented again, or slot is left NULL if a
+// later one is already reserved. Kernel handles are kept rather than
+// referenced thread objects, so there is no way to end up with a running
+// thread that cannot be waited for.
+//
+static VOID
+ImScsiStartExtraWorker(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in ULONG Index)
+{
+    HANDLE thread_handle;
+    OBJECT_ATTRIBUTES object_attributes;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    NTSTATUS status;
+
+    InitializeObjectAttributes(&object_attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = PsCreateSystemThread(
+        &thread_handle,
+        (ACCESS_MASK)0L,
+        &object_attributes,
+        NULL,
+        NULL,
+        ImScsiExtraWorkerThread,
+        pLUExt);
+
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": Cannot create extra worker thread. (%#x)\n", status);
+
+        // Give slot back unless a later one has been reserved since. Then
+        // this one is left NULL, which ImScsiWaitForExtraWorkers skips.
+        ImScsiAcquireLock(&pLUExt->RequestListLock, &lock_handle, lowest_assumed_irql);
+
+        if (Index + 2 == pLUExt->WorkerCount)
+        {
+            pLUExt->WorkerCount--;
+        }
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+        return;
+    }
+
+    KdPrint((__FUNCTION__ ": Started worker thread %u for pLUExt = 0x%p\n",
+        Index + 2, pLUExt));
+
+    ImScsiAcquireLock(&pLUExt->RequestListLock, &lock_handle, lowest_assumed_irql);
+
+    pLUExt->ExtraWorkerThreads[Index] = thread_handle;
+
+    ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+}
+
+//
+// Called by first worker thread for an LU before it cleans up. Extra workers
+// are started by first worker or by extra workers with lower index, so once
+// those have exited, slot for next one is either filled in or left empty
+// because it failed to start.
+//
+static VOID
+ImScsiWaitForExtraWorkers(
+    __in pHW_LU_EXTENSION pLUExt)
+{
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    HANDLE thread_handle;
+    ULONG i;
+
+    for (i = 0; ; i++)
+    {
+        ImScsiAcquireLock(&pLUExt->RequestListLock, &lock_handle, lowest_assumed_irql);
+
+        if (i + 1 >= pLUExt->WorkerCount)
+        {
+            ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+            break;
+        }
+
+        thread_handle = pLUExt->ExtraWorkerThreads[i];
+        pLUExt->ExtraWorkerThreads[i] = NULL;
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+        if (thread_handle != NULL)
+        {
+            ZwWaitForSingleObject(thread_handle, FALSE, NULL);
+            ZwClose(thread_handle);
+        }
+    }
+}
+
+// Time to wait for responses to requests in flight on tagged connections or
+// shared memory ring when LU is removed, before they are failed
+#define IMSCSI_LU_DRAIN_TIMEOUT_MS              10000
+
+//
+// Called by first worker thread for an LU, after extra workers have exited
+// and before LU is cleaned up. Requests sent on tagged connections or on a
+// shared memory ring hold their scheduler slot until completed from receive
+// thread, and they use LU extension and proxy connection until then. If
+// server does not answer in time, they are failed by stopping receive
+// threads.
+//
+static VOID
+ImScsiWaitForLUWork(
+    __in pHW_LU_EXTENSION pLUExt)
+{
+    LARGE_INTEGER timeout;
+
+    timeout.QuadPart = -10000LL * IMSCSI_LU_DRAIN_TIMEOUT_MS;
+
+    if (KeWaitForSingleObject(&pLUExt->SchedIdle, Executive, KernelMode,
+        FALSE, &timeout) != STATUS_TIMEOUT)
+    {
+        return;
+    }
+
+    DbgPrint(__FUNCTION__ ": No response from server for %u requests, "
+        "failing them.\n", pLUExt->Sched.active_count);
+
+    if (pLUExt->UseProxy)
+    {
+        ImScsiFailPendingProxyRequests(&pLUExt->Proxy);
+    }
+
+    KeWaitForSingleObject(&pLUExt->SchedIdle, Executive, KernelMode,
+        FALSE, NULL);
+}
+
+//
+// Worker thread priority for LUs in a priority class.
+//
+static KPRIORITY
+ImScsiGetQosThreadPriority(
+    __in int QosClass)
+{
+    switch (QosClass)
+    {
+    case IMSCSI_QOS_CLASS_HIGH:
+        return LOW_REALTIME_PRIORITY + 1;
+    case IMSCSI_QOS_CLASS_LOW:
+        return LOW_REALTIME_PRIORITY - 4;
+    case IMSCSI_QOS_CLASS_BACKGROUND:
+        return LOW_REALTIME_PRIORITY - 8;
+    default:
+        return LOW_REALTIME_PRIORITY;
+    }
+}
+
+//
+// Delays a read or write request, and requests merged into it, until LU
+// request and byte rate limits let it through. Requests on LUs in low and
+// background priority classes first yield for a while if LUs in higher
+// classes have requests in progress. Also keeps worker thread priority in
+// line with LU priority class. Returns class that request is counted in,
+// caller decrements QosActive for that class when request is done.
+//
+static int
+ImScsiWaitForQos(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in pMP_WorkRtnParms pWkRtnParms,
+    __inout PKPRIORITY ThreadPriority)
+{
+    IMSCSI_SCHED_RANGE range;
+    pMP_WorkRtnParms work;
+    KLOCK_QUEUE_HANDLE lock_handle;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    KPRIORITY priority;
+    LARGE_INTEGER wait_time;
+    ULONGLONG bytes = 0;
+    ULONGLONG wait;
+    ULONGLONG started = KeQueryInterruptTime();
+    ULONG requests = 0;
+    BOOLEAN delayed = FALSE;
+    int qos_class = pLUExt->Qos.priority_class;
+
+    priority = ImScsiGetQosThreadPriority(qos_class);
+
+    if (priority != *ThreadPriority)
+    {
+        KeSetPriorityThread(KeGetCurrentThread(), priority);
+        *ThreadPriority = priority;
+    }
+
+    for (work = pWkRtnParms; work != NULL; work = work->pMergedNext)
+    {
+        ImScsiGetWorkRange(work, &range);
+
+        if (!range.barrier)
+        {
+            requests++;
+            bytes += (ULONGLONG)(range.end - range.offset);
+        }
+    }
+
+    // Other requests are never held back
+    if (requests == 0)
+    {
+        InterlockedIncrement(&pMPDrvInfoGlobal->QosActive[qos_class]);
+        return qos_class;
+    }
+
+    wait = ImScsiQosGetYield(pMPDrvInfoGlobal->QosActive, qos_class);
+
+    for (;;)
+    {
+        if (wait != 0)
+        {
+            delayed = TRUE;
+
+            // Limits could be changed while waiting
+            if (wait > IMSCSI_QOS_TICKS_PER_SECOND / 10)
+            {
+                wait = IMSCSI_QOS_TICKS_PER_SECOND / 10;
+            }
+
+            wait_time.QuadPart = -(LONGLONG)wait;
+
+            // No point in holding back requests to an LU that is going away
+            if (KeWaitForSingleObject(&pLUExt->StopThread, Executive,
+                KernelMode, FALSE, &wait_time) != STATUS_TIMEOUT)
+            {
+                break;
+            }
+        }
+
+        ImScsiAcquireLock(&pLUExt->QosLock, &lock_handle, lowest_assumed_irql);
+
+        wait = ImScsiQosAdmit(&pLUExt->Qos, requests, bytes,
+            KeQueryInterruptTime());
+
+        if ((wait == 0) && delayed)
+        {
+            pLUExt->Qos.delayed++;
+            pLUExt->Qos.delay_ticks += KeQueryInterruptTime() - started;
+        }
+
+        ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
+
+        if (wait == 0)
+        {
+            break;
+        }
+    }
+
+    InterlockedIncrement(&pMPDrvInfoGlobal->QosActive[qos_class]);
+
+    return qos_class;
+}
+
 /**************************************************************************************************/
 /*                                                                                                */
 /* This is the worker thread routine, which always runs in System process.                        */
 /*                                                                                                */
 /**************************************************************************************************/
-VOID
-ImScsiWorkerThread(__in PVOID Context)
+static VOID
+ImScsiServiceRequests(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in BOOLEAN ExtraWorker)
 {
-    pHW_LU_EXTENSION            pLUExt = (pHW_LU_EXTENSION)Context;
     pMP_WorkRtnParms            pWkRtnParms = NULL;
     PLIST_ENTRY                 request_list = NULL;
     PKSPIN_LOCK                 request_list_lock = NULL;
-    PKEVENT                     wait_objects[2] = { NULL };
+    PKEVENT                     wait_objects[3] = { NULL };
+    ULONG                       wait_count = 2;
+    KPRIORITY                   thread_priority = LOW_REALTIME_PRIORITY;
 
-    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+    KeSetPriorityThread(KeGetCurrentThread(), thread_priority);
 
     if (pLUExt != NULL)
     {
@@ -50,10 +562,15 @@ ImScsiWorkerThread(__in PVOID Context)
         request_list_lock = &pLUExt->RequestListLock;
         wait_objects[0] = &pLUExt->RequestEvent;
 
+        // Several workers wait for the same synchronization event, so each
+        // of them needs to be woken up by stop event as well.
+        wait_objects[2] = &pLUExt->StopThread;
+        wait_count = 3;
+
         // If this is a VM backed disk that should be pre-loaded with an image file
         // we have to load the contents of that file now before entering the service
-        // loop.
-        if (pLUExt->VMDisk && (pLUExt->ImageFile != NULL))
+        // loop. Extra workers are not started until after this.
+        if (!ExtraWorker && pLUExt->VMDisk && (pLUExt->ImageFile != NULL))
             if (!ImScsiFillMemoryDisk(pLUExt))
                 KeSetEvent(&pLUExt->StopThread, (KPRIORITY)0, FALSE);
     }
@@ -73,6 +590,11 @@ ImScsiWorkerThread(__in PVOID Context)
         PLIST_ENTRY                 request;
         KLOCK_QUEUE_HANDLE          lock_handle;
         KIRQL                       lowest_assumed_irql = PASSIVE_LEVEL;
+        int                         sched_slot = IMSCSI_SCHED_NO_SLOT;
+        int                         qos_class = IMSCSI_QOS_CLASS_NORMAL;
+        BOOLEAN                     list_empty;
+        BOOLEAN                     start_worker = FALSE;
+        ULONG                       worker_index = 0;
 
 #ifdef USE_SCSIPORT
 
@@ -93,143 +615,1106 @@ ImScsiWorkerThread(__in PVOID Context)
         {
             ImScsiAcquireLock(request_list_lock, &lock_handle, lowest_assumed_irql);
 
-            request = RemoveHeadList(request_list);
+            if (pLUExt != NULL)
+            {
+                request = ImScsiSelectLUWork(pLUExt, &sched_slot);
+
+                // More queued requests could be served in parallel, wake
+                // up an idle worker or start another one
+                if ((request != NULL) && !IsListEmpty(request_list))
+                {
+                    if (pLUExt->IdleWorkers > 0)
+                    {
+                        KeSetEvent(&pLUExt->RequestEvent, (KPRIORITY)0, FALSE);
+                    }
+                    else if ((pLUExt->WorkerCount < pLUExt->MaxWorkers) &&
+                        !KeReadStateEvent(&pLUExt->StopThread))
+                    {
+                        worker_index = pLUExt->WorkerCount - 1;
+                        pLUExt->WorkerCount++;
+                        start_worker = TRUE;
+                    }
+                }
+
+                // Counted as idle before lock is released, so that
+                // ImScsiFinishLUWork for a request finishing before we
+                // start waiting sets request event for us
+                if (request == NULL)
+                {
+                    InterlockedIncrement(&pLUExt->IdleWorkers);
+                }
+            }
+            else
+            {
+                request = RemoveHeadList(request_list);
+
+                if (request == request_list)
+                {
+                    request = NULL;
+                }
+            }
+
+            list_empty = IsListEmpty(request_list);
 
             ImScsiReleaseLock(&lock_handle, &lowest_assumed_irql);
 
-            if (request != request_list)
+            if (request != NULL)
             {
                 break;
             }
 
-            if (KeReadStateEvent(&pMPDrvInfoGlobal->StopWorker) ||
-                ((pLUExt != NULL) && (KeReadStateEvent(&pLUExt->StopThread))))
-            {
-                KdPrint(("PhDskMnt::ImScsiWorkerThread shutting down.\n"));
+            // Queued requests that wait for requests in progress are
+            // picked up when those finish
+            if (list_empty &&
+                (KeReadStateEvent(&pMPDrvInfoGlobal->StopWorker) ||
+                ((pLUExt != NULL) && (KeReadStateEvent(&pLUExt->StopThread)))))
+            {
+                KdPrint(("PhDskMnt::ImScsiWorkerThread shutting down.\n"));
+
+                if (pLUExt != NULL)
+                {
+                    InterlockedDecrement(&pLUExt->IdleWorkers);
+                }
+
+                if ((pLUExt != NULL) && !ExtraWorker)
+                {
+                    ImScsiWaitForExtraWorkers(pLUExt);
+
+                    ImScsiWaitForLUWork(pLUExt);
+
+                    ImScsiCleanupLU(pLUExt, &lowest_assumed_irql);
+                }
+
+#ifdef USE_SCSIPORT
+                // One last SMB_IMSCSI_CHECK call to flush response queue and free allocated IRP
+                if (irp != NULL)
+                {
+                    IoCallDriver(pMPDrvInfoGlobal->ControllerObject, irp);
+                }
+#endif
+
+                PsTerminateSystemThread(STATUS_SUCCESS);
+                return;
+            }
+
+            // Nothing to start, time to read ahead for sequential readers
+            if ((pLUExt != NULL) && ImScsiReadAhead(pLUExt))
+            {
+                InterlockedDecrement(&pLUExt->IdleWorkers);
+                continue;
+            }
+
+            KdPrint2(("PhDskMnt::ImScsiWorkerThread idle, waiting for request.\n"));
+
+            if (list_empty)
+            {
+                KeWaitForMultipleObjects(wait_count, (PVOID*)wait_objects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+            }
+            else
+            {
+                // Queued requests wait for requests in progress, on other
+                // workers or in flight on proxy connections. Stop events
+                // could be set already, so wait for request event only.
+                // ImScsiFinishLUWork sets it when each of those finishes.
+                KeWaitForSingleObject(wait_objects[0], Executive, KernelMode, FALSE, NULL);
+            }
+
+            if (pLUExt != NULL)
+            {
+                InterlockedDecrement(&pLUExt->IdleWorkers);
+            }
+        }
+
+        if (start_worker)
+        {
+            ImScsiStartExtraWorker(pLUExt, worker_index);
+        }
+
+        pWkRtnParms = CONTAINING_RECORD(request, MP_WorkRtnParms, RequestListEntry);
+
+        KdPrint2(("PhDskMnt::ImScsiWorkerThread got request. pWkRtnParms = 0x%p\n",
+            pWkRtnParms));
+
+        // Request to wait for LU worker thread to terminate
+        if (pWkRtnParms->pSrb == NULL)
+        {
+            KdPrint((__FUNCTION__ ": Request to wait for LU worker thread to exit. pLUExt=%p\n",
+                pWkRtnParms->pLUExt));
+
+            if (pWkRtnParms->pLUExt->WorkerThread != NULL)
+            {
+                KeWaitForSingleObject(
+                    pWkRtnParms->pLUExt->WorkerThread,
+                    Executive,
+                    KernelMode,
+                    FALSE,
+                    NULL);
+
+                ObDereferenceObject(pWkRtnParms->pLUExt->WorkerThread);
+                pWkRtnParms->pLUExt->WorkerThread = NULL;
+
+                KdPrint((__FUNCTION__ ": Worker thread exit. Ready to free LUExt.\n"));
+            }
+            else
+            {
+                KdPrint((__FUNCTION__ ": Worker not started. Ready to free LUExt.\n"));
+            }
+            
+            ExFreePoolWithTag(pWkRtnParms->pLUExt, MP_TAG_GENERAL);
+
+            ImScsiResizePools(-1);
+
+            ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+
+            continue;
+        }
+
+        if (pLUExt != NULL)
+        {
+            qos_class = ImScsiWaitForQos(pLUExt, pWkRtnParms, &thread_priority);
+        }
+
+        if (pMPDrvInfoGlobal->TraceRings != NULL)
+        {
+            for (pMP_WorkRtnParms work = pWkRtnParms; work != NULL; work = work->pMergedNext)
+            {
+                // Only requests counted as queued are traced
+                if (work->StartTime != 0)
+                {
+                    ImScsiTraceRequest(work->pLUExt, work->pSrb,
+                        IMSCSI_TRACE_DISPATCHED);
+                }
+            }
+        }
+
+        // Read and write requests on tagged proxy connections and shared
+        // memory rings complete asynchronously from proxy receive thread.
+        if ((pWkRtnParms->pMergedNext == NULL) &&
+            ImScsiDispatchTaggedProxyReadWrite(pWkRtnParms, sched_slot,
+                qos_class))
+        {
+            // Request is in flight. It keeps its scheduler slot and QoS
+            // count until completed from proxy receive thread, so that
+            // conflicting requests are not sent until it is done.
+#ifdef USE_SCSIPORT
+            if (irp != NULL)
+            {
+                ExFreePoolWithTag(irp->AssociatedIrp.SystemBuffer, MP_TAG_GENERAL);
+                IoFreeIrp(irp);
+            }
+#endif
+            continue;
+        }
+
+        if (pWkRtnParms->pMergedNext != NULL)
+        {
+            ImScsiDispatchMergedReadWrite(pWkRtnParms);
+        }
+        else
+        {
+            ImScsiDispatchWork(pWkRtnParms);
+        }
+
+        if (pLUExt != NULL)
+        {
+            InterlockedDecrement(&pMPDrvInfoGlobal->QosActive[qos_class]);
+
+            ImScsiFinishLUWork(pLUExt, sched_slot);
+        }
+
+        // Requests merged into this one are completed first, so that they
+        // are picked up by SMB_IMSCSI_CHECK call for this one
+        while (pWkRtnParms->pMergedNext != NULL)
+        {
+            pMP_WorkRtnParms merged = pWkRtnParms->pMergedNext;
+
+            pWkRtnParms->pMergedNext = merged->pMergedNext;
+
+            ImScsiStatsWorkDone(merged, &lowest_assumed_irql);
+
+#ifdef USE_SCSIPORT
+            ImScsiCallForCompletion(NULL, merged, &lowest_assumed_irql);
+#endif
+
+#ifdef USE_STORPORT
+            StorPortNotification(RequestComplete, merged->pHBAExt, merged->pSrb);
+
+            ImScsiFreeWorkItem(merged);
+#endif
+        }
+
+        ImScsiStatsWorkDone(pWkRtnParms, &lowest_assumed_irql);
+
+        if (pWkRtnParms->pReqThread != NULL)
+        {
+            ObDereferenceObject(pWkRtnParms->pReqThread);
+        }
+
+        if (pWkRtnParms->CallerWaitEvent != NULL)
+        {
+            KeSetEvent(pWkRtnParms->CallerWaitEvent, (KPRIORITY)0, FALSE);
+        }
+
+#ifdef USE_SCSIPORT
+
+        KdPrint2((__FUNCTION__ ": Calling SMB_IMSCSI_CHECK for work: 0x%p.\n", pWkRtnParms));
+
+        status = ImScsiCallForCompletion(irp, pWkRtnParms, &lowest_assumed_irql);
+
+        if (!NT_SUCCESS(status))
+            DbgPrint(__FUNCTION__ ": IoCallDriver failed: 0x%X for work 0x%p\n", status, pWkRtnParms);
+        else
+            KdPrint2((__FUNCTION__ ": Finished SMB_IMSCSI_CHECK for work: 0x%p.\n", pWkRtnParms));
+
+#endif
+
+#ifdef USE_STORPORT
+
+        KdPrint2((__FUNCTION__ ": Sending 'RequestComplete' to StorPort for work: 0x%p.\n", pWkRtnParms));
+
+        StorPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
+
+        ImScsiFreeWorkItem(pWkRtnParms);
+
+        KdPrint2((__FUNCTION__ ": Finished work: 0x%p.\n", pWkRtnParms));
+
+#endif
+
+    }
+}
+
+VOID
+ImScsiWorkerThread(__in PVOID Context)
+{
+    ImScsiServiceRequests((pHW_LU_EXTENSION)Context, FALSE);
+}
+
+//
+// Additional worker threads for an LU. These are started by other worker
+// threads for the same LU, when requests are queued faster than they are
+// served, up to MaxWorkers. They exit when LU stops and first worker thread
+// waits for them before it cleans up LU.
+//
+VOID
+ImScsiExtraWorkerThread(__in PVOID Context)
+{
+    ImScsiServiceRequests((pHW_LU_EXTENSION)Context, TRUE);
+}
+
+//
+// Translates a failed image I/O status to SRB status and sense data.
+//
+VOID
+ImScsiSetReadWriteError(
+    __in pHW_HBA_EXT pHBAExt,
+    __in pHW_LU_EXTENSION pLUExt,
+    __in PSCSI_REQUEST_BLOCK pSrb,
+    __in NTSTATUS status,
+    __inout __deref PKIRQL LowestAssumedIrql)
+{
+    switch (status)
+    {
+    case STATUS_INVALID_BUFFER_SIZE:
+    {
+        DbgPrint(__FUNCTION__ ": STATUS_INVALID_BUFFER_SIZE from image I/O. Reporting SCSI_SENSE_ILLEGAL_REQUEST/SCSI_ADSENSE_INVALID_CDB/0x00.\n");
+        
+        ScsiSetCheckCondition(
+            pSrb,
+            SRB_STATUS_ERROR,
+            SCSI_SENSE_ILLEGAL_REQUEST,
+            SCSI_ADSENSE_INVALID_CDB,
+            0);
+
+        return;
+    }
+
+    case STATUS_DEVICE_BUSY:
+    {
+        DbgPrint(__FUNCTION__ ": STATUS_DEVICE_BUSY from image I/O. Reporting SRB_STATUS_BUSY/SCSI_SENSE_NOT_READY/SCSI_ADSENSE_LUN_NOT_READY/SCSI_SENSEQ_BECOMING_READY.\n");
+        
+        ScsiSetCheckCondition(
+            pSrb,
+            SRB_STATUS_BUSY,
+            SCSI_SENSE_NOT_READY,
+            SCSI_ADSENSE_LUN_NOT_READY,
+            SCSI_SENSEQ_BECOMING_READY
+        );
+        
+        return;
+    }
+
+    case STATUS_CONNECTION_RESET:
+    case STATUS_DEVICE_REMOVED:
+    case STATUS_DEVICE_DOES_NOT_EXIST:
+    case STATUS_PIPE_BROKEN:
+    case STATUS_PIPE_DISCONNECTED:
+    case STATUS_PORT_DISCONNECTED:
+    case STATUS_REMOTE_DISCONNECT:
+    {
+        DbgPrint(__FUNCTION__ ": Underlying image disconnected. Reporting SRB_STATUS_ERROR/SCSI_SENSE_NOT_READY/SCSI_ADSENSE_LUN_NOT_READY/SCSI_SENSEQ_NOT_REACHABLE.\n");
+        
+        ImScsiRemoveDevice(pHBAExt, &pLUExt->DeviceNumber, LowestAssumedIrql);
+        
+        ScsiSetCheckCondition(
+            pSrb,
+            SRB_STATUS_BUSY,
+            SCSI_SENSE_NOT_READY,
+            SCSI_ADSENSE_LUN_COMMUNICATION,
+            SCSI_SENSEQ_NOT_REACHABLE
+        );
+
+        return;
+    }
+
+    default:
+    {
+        ScsiSetError(pSrb, SRB_STATUS_PARITY_ERROR);
+        return;
+    }
+    }
+}
+
+VOID
+ImScsiDispatchReadWrite(
+    __in pHW_HBA_EXT pHBAExt,
+    __in pHW_LU_EXTENSION pLUExt,
+    __in PSCSI_REQUEST_BLOCK pSrb,
+    __out PLONGLONG BackendTime)
+{
+    PCDB pCdb = (PCDB)pSrb->Cdb;
+    PVOID sysaddress;
+    PVOID buffer;
+    ULONG buffer_size;
+    LARGE_INTEGER startingSector;
+    LARGE_INTEGER startingOffset;
+    ULONGLONG cache_generation;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    if (((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16)) &&
+        (((pLUExt->RegistrationKey == 0) && (pLUExt->ReservationKey != 0)) ||
+        (pLUExt->RegistrationKey != 0) && (pLUExt->ReservationKey == 0)))
+    {
+        KdPrint(("PhDskMnt::ImScsiDispatchWork Write operation on unreserved LUN.\n"));
+
+        pSrb->SrbStatus = SRB_STATUS_ERROR;
+        pSrb->ScsiStatus = SCSISTAT_RESERVATION_CONFLICT;
+
+        return;
+    }
+
+    if ((pCdb->AsByte[0] == SCSIOP_READ16) ||
+        (pCdb->AsByte[0] == SCSIOP_WRITE16))
+    {
+        REVERSE_BYTES_QUAD(&startingSector, pCdb->CDB16.LogicalBlock);
+    }
+    else
+    {
+        startingSector.QuadPart = 0;
+        REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
+    }
+
+    startingOffset.QuadPart = startingSector.QuadPart << pLUExt->BlockPower;
+
+    KdPrint2((__FUNCTION__ ": starting sector: 0x%I64X\n", startingSector));
+
+    ULONG s_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
+
+    if ((s_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
+    {
+        DbgPrint(__FUNCTION__ ": StorPortGetSystemAddress failed: status=0x%X address=0x%p translated=0x%p\n",
+            s_status,
+            pSrb->DataBuffer,
+            sysaddress);
+
+        pSrb->SrbStatus = SRB_STATUS_ERROR;
+        pSrb->ScsiStatus = SCSISTAT_GOOD;
+
+        return;
+    }
+
+    // Transfer length could be changed by a short read
+    buffer_size = pSrb->DataTransferLength;
+
+    // VM disks are copied directly between request buffer and image buffer.
+    // They are not read cached, see ImScsiAllocateReadCache.
+    if (pLUExt->VMDisk)
+    {
+        buffer = sysaddress;
+    }
+    else
+    {
+        // Could have been read ahead while request was queued
+        if (((pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16)) &&
+            ImScsiReadCacheRead(pLUExt, startingOffset.QuadPart,
+                pSrb->DataTransferLength, sysaddress, TRUE, &lowest_assumed_irql))
+        {
+            ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+
+            return;
+        }
+
+        // Shared memory proxy copies directly between request buffer and
+        // ring slot, so that server reads or writes image data in slot and
+        // request data is only copied once by the driver.
+        if (pLUExt->UseProxy &&
+            pLUExt->Proxy.connection_type == PROXY_CONNECTION::PROXY_CONNECTION_SHM)
+        {
+            buffer = sysaddress;
+        }
+        else
+        {
+            buffer = ImScsiAllocateBuffer(buffer_size);
+        }
+
+        if (buffer == NULL)
+        {
+            DbgPrint(__FUNCTION__ ": Memory allocation failed.\n");
+
+            pSrb->SrbStatus = SRB_STATUS_ERROR;
+            pSrb->ScsiStatus = SCSISTAT_GOOD;
+
+            return;
+        }
+    }
+
+    NTSTATUS status = STATUS_NOT_IMPLEMENTED;
+    LONGLONG backend_start = 0;
+
+    if ((pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16))
+    {
+        cache_generation = ImScsiReadCacheGetGeneration(pLUExt,
+            &lowest_assumed_irql);
+
+        backend_start = ImScsiGetTimestamp();
+
+        ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_IO_START);
+
+        status = ImScsiReadDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
+    }
+    else if ((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16))
+    {
+        if (buffer != sysaddress)
+        {
+            RtlMoveMemory(buffer, sysaddress, pSrb->DataTransferLength);
+        }
+
+        backend_start = ImScsiGetTimestamp();
+
+        ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_IO_START);
+
+        status = ImScsiWriteDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
+    }
+
+    if (backend_start != 0)
+    {
+        *BackendTime = ImScsiGetTimestamp() - backend_start;
+
+        ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_IO_DONE);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        if (buffer != sysaddress)
+        {
+            ImScsiFreeBuffer(buffer, buffer_size);
+        }
+
+        DbgPrint(__FUNCTION__ ": I/O error status=0x%X\n", status);
+
+        ImScsiSetReadWriteError(pHBAExt, pLUExt, pSrb, status,
+            &lowest_assumed_irql);
+
+        return;
+    }
+
+    /// If "fake random disk signature" option is used.
+    /// Compatibility fix for mounting Windows Backup vhd files in read-only etc.
+    if ((pLUExt->FakeDiskSignature != 0) &&
+        ((pSrb->Cdb[0] == SCSIOP_READ) ||
+        (pSrb->Cdb[0] == SCSIOP_READ16)) &&
+            (startingSector.QuadPart == 0) &&
+        (pSrb->DataTransferLength >= 512))
+    {
+        PUCHAR mbr = (PUCHAR)buffer;
+
+        if ((*(PUSHORT)(mbr + 0x01FE) == 0xAA55) &&
+            (*(mbr + 0x01C2) != 0xEE) &&
+            ((*(mbr + 0x01BE) & 0x7F) == 0x00) &&
+            ((*(mbr + 0x01CE) & 0x7F) == 0x00) &&
+            ((*(mbr + 0x01DE) & 0x7F) == 0x00) &&
+            ((*(mbr + 0x01EE) & 0x7F) == 0x00))
+        {
+            DbgPrint(__FUNCTION__ ": Faking disk signature as %#X.\n", pLUExt->FakeDiskSignature);
+
+            *(PULONG)(mbr + 0x01B8) = pLUExt->FakeDiskSignature;
+        }
+        else
+        {
+            DbgPrint(__FUNCTION__ ": Present MBR data not compatible with fake disk signature option.\n");
+
+            pLUExt->FakeDiskSignature = 0;
+        }
+    }
+    /// Allow the fake disk signature to be overwritten.
+    else if ((pLUExt->FakeDiskSignature != 0) &&
+        ((pSrb->Cdb[0] == SCSIOP_WRITE) ||
+        (pSrb->Cdb[0] == SCSIOP_WRITE16)) &&
+            (startingSector.QuadPart == 0) &&
+        (pSrb->DataTransferLength >= 512))
+    {
+        pLUExt->FakeDiskSignature = 0;
+    }
+
+    /// For read operations, temporary buffer holds read data.
+    /// Copy that to system buffer.
+    if ((pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16))
+    {
+        if (buffer != sysaddress)
+        {
+            RtlMoveMemory(sysaddress, buffer, pSrb->DataTransferLength);
+        }
+
+        ImScsiReadCacheFill(pLUExt, cache_generation,
+            startingOffset.QuadPart, pSrb->DataTransferLength, buffer,
+            &lowest_assumed_irql);
+    }
+    else
+    {
+        ImScsiReadCacheWrite(pLUExt, startingOffset.QuadPart,
+            pSrb->DataTransferLength, buffer, &lowest_assumed_irql);
+    }
+
+    if (buffer != sysaddress)
+    {
+        ImScsiFreeBuffer(buffer, buffer_size);
+    }
+
+    ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+}
+
+//
+// Adds a stage to request trace for a request and all requests merged into
+// it.
+//
+static VOID
+ImScsiTraceMergedWork(
+    __in pMP_WorkRtnParms pWkRtnParms,
+    __in UCHAR Stage)
+{
+    if (pMPDrvInfoGlobal->TraceRings == NULL)
+    {
+        return;
+    }
+
+    for (pMP_WorkRtnParms work = pWkRtnParms; work != NULL; work = work->pMergedNext)
+    {
+        ImScsiTraceRequest(work->pLUExt, work->pSrb, Stage);
+    }
+}
+
+//
+// Reads or writes merged requests that have gaps between them as one
+// vectored request to proxy. Data for all extents is concatenated in
+// Buffer. On return, Length is number of bytes transferred.
+//
+static NTSTATUS
+ImScsiReadWriteMergedExtents(
+    __in pHW_LU_EXTENSION pLUExt,
+    __in PIMSCSI_MERGE Merge,
+    __in PUCHAR Buffer,
+    __out PULONG Length)
+{
+    IMDPROXY_EXTENT extents[IMSCSI_MERGE_MAX_REQUESTS];
+    IO_STATUS_BLOCK io_status = { 0 };
+    ULONG extent_count;
+    NTSTATUS status;
+
+    extent_count = ImScsiMergeGetExtents(Merge, extents);
+
+    for (ULONG i = 0; i < extent_count; i++)
+    {
+        extents[i].offset += pLUExt->ImageOffset.QuadPart;
+    }
+
+    if (Merge->write)
+    {
+        pLUExt->Modified = TRUE;
+
+        status = ImScsiWriteVProxy(&pLUExt->Proxy, &io_status,
+            &pLUExt->StopThread, Buffer, extents, extent_count);
+    }
+    else
+    {
+        status = ImScsiReadVProxy(&pLUExt->Proxy, &io_status,
+            &pLUExt->StopThread, Buffer, extents, extent_count);
+    }
+
+    *Length = NT_SUCCESS(status) ? (ULONG)io_status.Information : 0;
+
+    return status;
+}
+
+//
+// Serves a read or write request, together with requests merged into it by
+// ImScsiSelectLUWork, as one request to image. Data is gathered to or
+// scattered from one buffer and each SRB gets its own part of the result.
+// Requests with gaps between them are sent as one vectored proxy request.
+// Falls back to serving requests one at a time if that is not possible.
+//
+VOID
+ImScsiDispatchMergedReadWrite(
+    __in pMP_WorkRtnParms pWkRtnParms)
+{
+    pHW_HBA_EXT pHBAExt = pWkRtnParms->pHBAExt;
+    pHW_LU_EXTENSION pLUExt = pWkRtnParms->pLUExt;
+    PVOID sysaddresses[IMSCSI_MERGE_MAX_REQUESTS];
+    pMP_WorkRtnParms work;
+    IMSCSI_SCHED_RANGE range;
+    IMSCSI_MERGE merge;
+    LARGE_INTEGER startingOffset;
+    PUCHAR buffer = NULL;
+    ULONG length;
+    ULONGLONG cache_generation = 0;
+    ULONG i;
+    NTSTATUS status;
+    LONGLONG backend_start;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+
+    ImScsiGetWorkRange(pWkRtnParms, &range);
+
+    ImScsiMergeInit(&merge, range.offset, pWkRtnParms->pSrb->DataTransferLength,
+        range.write, MAXULONG);
+
+    for (work = pWkRtnParms->pMergedNext; work != NULL; work = work->pMergedNext)
+    {
+        IMSCSI_SCHED_RANGE work_range;
+
+        ImScsiGetWorkRange(work, &work_range);
+
+        ImScsiMergeAppend(&merge, work_range.offset,
+            work->pSrb->DataTransferLength);
+    }
+
+    for (work = pWkRtnParms, i = 0; work != NULL; work = work->pMergedNext, i++)
+    {
+        ULONG s_status = StoragePortGetSystemAddress(pHBAExt, work->pSrb,
+            &sysaddresses[i]);
+
+        if ((s_status != STORAGE_STATUS_SUCCESS) || (sysaddresses[i] == NULL))
+        {
+            break;
+        }
+    }
+
+    if (work == NULL)
+    {
+        buffer = (PUCHAR)ImScsiAllocateBuffer(merge.length);
+    }
+
+    if (buffer == NULL)
+    {
+        KdPrint((__FUNCTION__ ": Serving %u merged requests one at a time.\n",
+            merge.count));
+
+        for (work = pWkRtnParms; work != NULL; work = work->pMergedNext)
+        {
+            ImScsiDispatchWork(work);
+        }
+
+        return;
+    }
+
+    KdPrint2((__FUNCTION__ ": %u requests in %u extents, offset 0x%I64X, length 0x%X\n",
+        merge.count, merge.extent_count, merge.offset, merge.length));
+
+    startingOffset.QuadPart = merge.offset;
+    length = merge.length;
+
+    if (merge.write)
+    {
+        for (work = pWkRtnParms, i = 0; work != NULL; work = work->pMergedNext, i++)
+        {
+            RtlCopyMemory(buffer + ImScsiMergeGetPosition(&merge, i),
+                sysaddresses[i], merge.lengths[i]);
+        }
+
+        backend_start = ImScsiGetTimestamp();
+
+        ImScsiTraceMergedWork(pWkRtnParms, IMSCSI_TRACE_IO_START);
+
+        if (merge.extent_count > 1)
+        {
+            status = ImScsiReadWriteMergedExtents(pLUExt, &merge, buffer,
+                &length);
+        }
+        else
+        {
+            status = ImScsiWriteDevice(pLUExt, buffer, &startingOffset,
+                &length);
+        }
+    }
+    else
+    {
+        cache_generation = ImScsiReadCacheGetGeneration(pLUExt,
+            &lowest_assumed_irql);
+
+        backend_start = ImScsiGetTimestamp();
+
+        ImScsiTraceMergedWork(pWkRtnParms, IMSCSI_TRACE_IO_START);
+
+        if (merge.extent_count > 1)
+        {
+            status = ImScsiReadWriteMergedExtents(pLUExt, &merge, buffer,
+                &length);
+        }
+        else
+        {
+            status = ImScsiReadDevice(pLUExt, buffer, &startingOffset,
+                &length);
+        }
+    }
+
+    // Each merged request waited for the whole merged request to image
+    backend_start = ImScsiGetTimestamp() - backend_start;
+
+    for (work = pWkRtnParms; work != NULL; work = work->pMergedNext)
+    {
+        work->BackendTime = backend_start;
+    }
+
+    ImScsiTraceMergedWork(pWkRtnParms, IMSCSI_TRACE_IO_DONE);
+
+    if (!NT_SUCCESS(status))
+    {
+        ImScsiFreeBuffer(buffer, merge.length);
+
+        DbgPrint(__FUNCTION__ ": I/O error status=0x%X\n", status);
+
+        for (work = pWkRtnParms; work != NULL; work = work->pMergedNext)
+        {
+            ImScsiSetReadWriteError(pHBAExt, pLUExt, work->pSrb, status,
+                &lowest_assumed_irql);
+        }
+
+        return;
+    }
+
+    if (merge.write)
+    {
+        if (merge.extent_count > 1)
+        {
+            // Merged buffer does not map to one range on device
+            for (i = 0; i < merge.count; i++)
+            {
+                ImScsiReadCacheWrite(pLUExt, merge.offsets[i],
+                    ImScsiMergeGetTransferred(&merge, i, length),
+                    buffer + ImScsiMergeGetPosition(&merge, i),
+                    &lowest_assumed_irql);
+            }
+        }
+        else
+        {
+            ImScsiReadCacheWrite(pLUExt, merge.offset, length, buffer,
+                &lowest_assumed_irql);
+        }
+    }
+    else
+    {
+        for (work = pWkRtnParms, i = 0; work != NULL; work = work->pMergedNext, i++)
+        {
+            RtlCopyMemory(sysaddresses[i],
+                buffer + ImScsiMergeGetPosition(&merge, i),
+                ImScsiMergeGetTransferred(&merge, i, length));
+        }
+
+        if (merge.extent_count > 1)
+        {
+            for (i = 0; i < merge.count; i++)
+            {
+                ImScsiReadCacheFill(pLUExt, cache_generation,
+                    merge.offsets[i],
+                    ImScsiMergeGetTransferred(&merge, i, length),
+                    buffer + ImScsiMergeGetPosition(&merge, i),
+                    &lowest_assumed_irql);
+            }
+        }
+        else
+        {
+            ImScsiReadCacheFill(pLUExt, cache_generation, merge.offset,
+                length, buffer, &lowest_assumed_irql);
+        }
+    }
+
+    ImScsiFreeBuffer(buffer, merge.length);
+
+    for (work = pWkRtnParms, i = 0; work != NULL; work = work->pMergedNext, i++)
+    {
+        ScsiSetSuccess(work->pSrb, ImScsiMergeGetTransferred(&merge, i, length));
+    }
+}
+
+// Smallest part to split read and write requests in, when there are several
+// connections to proxy server. Requests are therefore only split from twice
+// this size, 128 KB.
+#define IMSCSI_TAGGED_PROXY_MIN_PART_SIZE       (64 << 10)
 
-                if (pLUExt != NULL)
-                {
-                    ImScsiCleanupLU(pLUExt, &lowest_assumed_irql);
-                }
+struct _IMSCSI_TAGGED_PROXY_IO;
 
-#ifdef USE_SCSIPORT
-                // One last SMB_IMSCSI_CHECK call to flush response queue and free allocated IRP
-                if (irp != NULL)
-                {
-                    IoCallDriver(pMPDrvInfoGlobal->ControllerObject, irp);
-                }
-#endif
+//
+// Part of a read or write request sent on a tagged proxy connection. There
+// is one part for each connection to server that the request is spread over.
+//
+typedef struct _IMSCSI_TAGGED_PROXY_PART
+{
+    PROXY_TAGGED_REQUEST request;
+    struct _IMSCSI_TAGGED_PROXY_IO *tagged_io;
+    ULONG offset;               // Byte offset within SRB data
+    ULONG length;
+    union
+    {
+        IMDPROXY_READ_RESP read_resp;
+        IMDPROXY_WRITE_RESP write_resp;
+    };
+} IMSCSI_TAGGED_PROXY_PART, *PIMSCSI_TAGGED_PROXY_PART;
+
+//
+// Read or write request sent on a tagged proxy connection. Completed from
+// proxy receive thread that completes the last part.
+//
+typedef struct _IMSCSI_TAGGED_PROXY_IO
+{
+    pMP_WorkRtnParms pWkRtnParms;
+    LONGLONG starting_sector;
+    PVOID buffer;               // SRB data, valid until SRB is completed
+    int sched_slot;             // Held in LU scheduler until completed
+    int qos_class;              // Counted in QosActive until completed
+    LONG pending_parts;
+    ULONG allocated_size;       // For ImScsiFreeBuffer
+    ULONG part_count;
+    IMSCSI_TAGGED_PROXY_PART parts[1];
+} IMSCSI_TAGGED_PROXY_IO, *PIMSCSI_TAGGED_PROXY_IO;
+
+C_ASSERT(FIELD_OFFSET(IMSCSI_TAGGED_PROXY_IO, parts) +
+    IMDPROXY_MAX_STREAMS * sizeof(IMSCSI_TAGGED_PROXY_PART) <=
+    (1UL << IMSCSI_POOL_MIN_SHIFT));
 
-                PsTerminateSystemThread(STATUS_SUCCESS);
-                return;
-            }
+VOID
+ImScsiCompleteTaggedProxyReadWrite(__in PIMSCSI_TAGGED_PROXY_IO tagged_io)
+{
+    pMP_WorkRtnParms pWkRtnParms = tagged_io->pWkRtnParms;
+    pHW_HBA_EXT pHBAExt = pWkRtnParms->pHBAExt;
+    pHW_LU_EXTENSION pLUExt = pWkRtnParms->pLUExt;
+    PSCSI_REQUEST_BLOCK pSrb = pWkRtnParms->pSrb;
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG read_length = 0;
+    BOOLEAN short_read = FALSE;
+    BOOLEAN is_write = (pSrb->Cdb[0] == SCSIOP_WRITE) ||
+        (pSrb->Cdb[0] == SCSIOP_WRITE16);
 
-            KdPrint2(("PhDskMnt::ImScsiWorkerThread idle, waiting for request.\n"));
+    pWkRtnParms->BackendTime = ImScsiGetTimestamp() - pWkRtnParms->BackendTime;
 
-            KeWaitForMultipleObjects(2, (PVOID*)wait_objects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
-        }
+    ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_IO_DONE);
 
-        pWkRtnParms = CONTAINING_RECORD(request, MP_WorkRtnParms, RequestListEntry);
+    for (ULONG i = 0; (i < tagged_io->part_count) && NT_SUCCESS(status); i++)
+    {
+        PIMSCSI_TAGGED_PROXY_PART part = &tagged_io->parts[i];
 
-        KdPrint2(("PhDskMnt::ImScsiWorkerThread got request. pWkRtnParms = 0x%p\n",
-            pWkRtnParms));
+        status = part->request.IoStatus.Status;
 
-        // Request to wait for LU worker thread to terminate
-        if (pWkRtnParms->pSrb == NULL)
+        if (!NT_SUCCESS(status))
         {
-            KdPrint((__FUNCTION__ ": Request to wait for LU worker thread to exit. pLUExt=%p\n",
-                pWkRtnParms->pLUExt));
+            break;
+        }
 
-            if (pWkRtnParms->pLUExt->WorkerThread != NULL)
+        if (is_write)
+        {
+            if (part->write_resp.errorno != 0)
             {
-                KeWaitForSingleObject(
-                    pWkRtnParms->pLUExt->WorkerThread,
-                    Executive,
-                    KernelMode,
-                    FALSE,
-                    NULL);
-
-                ObDereferenceObject(pWkRtnParms->pLUExt->WorkerThread);
-                pWkRtnParms->pLUExt->WorkerThread = NULL;
+                KdPrint((__FUNCTION__ ": Server returned error 0x%I64x.\n",
+                    part->write_resp.errorno));
 
-                KdPrint((__FUNCTION__ ": Worker thread exit. Ready to free LUExt.\n"));
+                status = STATUS_IO_DEVICE_ERROR;
             }
-            else
+            else if (part->write_resp.length != part->length)
             {
-                KdPrint((__FUNCTION__ ": Worker not started. Ready to free LUExt.\n"));
+                KdPrint((__FUNCTION__ ": IMDPROXY_REQ_WRITE %u bytes, "
+                    "IMDPROXY_RESP_WRITE %u bytes.\n",
+                    part->length,
+                    (ULONG)part->write_resp.length));
+
+                status = STATUS_IO_DEVICE_ERROR;
             }
-            
-            ExFreePoolWithTag(pWkRtnParms->pLUExt, MP_TAG_GENERAL);
+        }
+        else if (part->read_resp.errorno != 0)
+        {
+            KdPrint((__FUNCTION__ ": Server returned error %#I64x.\n",
+                part->read_resp.errorno));
 
-            ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+            status = STATUS_IO_DEVICE_ERROR;
+        }
+        else if (!short_read)
+        {
+            // Data after a short part is not valid even if later parts
+            // were read in full
+            read_length += (ULONG)part->read_resp.length;
 
-            continue;
+            if (part->read_resp.length < part->length)
+            {
+                short_read = TRUE;
+            }
         }
+    }
 
-        ImScsiDispatchWork(pWkRtnParms);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrint(__FUNCTION__ ": I/O error status=0x%X\n", status);
 
-        if (pWkRtnParms->pReqThread != NULL)
+        ImScsiSetReadWriteError(pHBAExt, pLUExt, pSrb, status,
+            &lowest_assumed_irql);
+    }
+    else
+    {
+        if (is_write)
         {
-            ObDereferenceObject(pWkRtnParms->pReqThread);
+            pLUExt->Modified = TRUE;
+
+            // SRB is not completed until below, so data sent from its
+            // buffer is still there to update cached lines with, same as
+            // on synchronous path.
+            ImScsiReadCacheWrite(pLUExt,
+                tagged_io->starting_sector << pLUExt->BlockPower,
+                pSrb->DataTransferLength, tagged_io->buffer,
+                &lowest_assumed_irql);
         }
-
-        if (pWkRtnParms->CallerWaitEvent != NULL)
+        else
         {
-            KeSetEvent(pWkRtnParms->CallerWaitEvent, (KPRIORITY)0, FALSE);
+            // Short read at end of image, same as synchronous path
+            pSrb->DataTransferLength = read_length;
         }
 
+        ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+    }
+
+    // Overlapping requests queued after this one were held back until now,
+    // so that server never has conflicting requests in flight
+    InterlockedDecrement(&pMPDrvInfoGlobal->QosActive[tagged_io->qos_class]);
+
+    ImScsiFinishLUWork(pLUExt, tagged_io->sched_slot);
+
+    ImScsiFreeBuffer(tagged_io, tagged_io->allocated_size);
+
+    ImScsiStatsWorkDone(pWkRtnParms, &lowest_assumed_irql);
+
 #ifdef USE_SCSIPORT
 
-        KdPrint2((__FUNCTION__ ": Calling SMB_IMSCSI_CHECK for work: 0x%p.\n", pWkRtnParms));
+    KdPrint2((__FUNCTION__ ": Calling SMB_IMSCSI_CHECK for work: 0x%p.\n", pWkRtnParms));
 
-        status = ImScsiCallForCompletion(irp, pWkRtnParms, &lowest_assumed_irql);
+    status = ImScsiCallForCompletion(ImScsiBuildCompletionIrp(), pWkRtnParms,
+        &lowest_assumed_irql);
 
-        if (!NT_SUCCESS(status))
-            DbgPrint(__FUNCTION__ ": IoCallDriver failed: 0x%X for work 0x%p\n", status, pWkRtnParms);
-        else
-            KdPrint2((__FUNCTION__ ": Finished SMB_IMSCSI_CHECK for work: 0x%p.\n", pWkRtnParms));
+    if (!NT_SUCCESS(status))
+        DbgPrint(__FUNCTION__ ": IoCallDriver failed: 0x%X for work 0x%p\n", status, pWkRtnParms);
 
 #endif
 
 #ifdef USE_STORPORT
 
-        KdPrint2((__FUNCTION__ ": Sending 'RequestComplete' to StorPort for work: 0x%p.\n", pWkRtnParms));
-
-        StorPortNotification(RequestComplete, pWkRtnParms->pHBAExt, pWkRtnParms->pSrb);
+    KdPrint2((__FUNCTION__ ": Sending 'RequestComplete' to StorPort for work: 0x%p.\n", pWkRtnParms));
 
-        ExFreePoolWithTag(pWkRtnParms, MP_TAG_GENERAL);
+    StorPortNotification(RequestComplete, pHBAExt, pSrb);
 
-        KdPrint2((__FUNCTION__ ": Finished work: 0x%p.\n", pWkRtnParms));
+    ImScsiFreeWorkItem(pWkRtnParms);
 
 #endif
+}
+
+VOID
+ImScsiTaggedProxyReadWriteCompletion(__in PPROXY_TAGGED_REQUEST Request)
+{
+    PIMSCSI_TAGGED_PROXY_PART part = (PIMSCSI_TAGGED_PROXY_PART)
+        Request->CompletionContext;
+    PIMSCSI_TAGGED_PROXY_IO tagged_io = part->tagged_io;
 
+    if (InterlockedDecrement(&tagged_io->pending_parts) == 0)
+    {
+        ImScsiCompleteTaggedProxyReadWrite(tagged_io);
     }
 }
 
-VOID
-ImScsiDispatchReadWrite(
-    __in pHW_HBA_EXT pHBAExt,
-    __in pHW_LU_EXTENSION pLUExt,
-    __in PSCSI_REQUEST_BLOCK pSrb)
+///
+/// Sends a read or write SRB on a tagged proxy connection or shared memory
+/// ring without waiting for the response, so that worker thread can go on
+/// with next request.
+/// Returns FALSE if request needs to go through ImScsiDispatchWork, for
+/// instance when it needs features only implemented on synchronous path.
+/// When TRUE is returned, SchedSlot and QosClass are released by
+/// completion instead of by caller.
+///
+BOOLEAN
+ImScsiDispatchTaggedProxyReadWrite(
+    __in pMP_WorkRtnParms pWkRtnParms,
+    __in int SchedSlot,
+    __in int QosClass)
 {
-    PCDB pCdb = (PCDB)pSrb->Cdb;
+    pHW_HBA_EXT pHBAExt = pWkRtnParms->pHBAExt;
+    pHW_LU_EXTENSION pLUExt = pWkRtnParms->pLUExt;
+    PSCSI_REQUEST_BLOCK pSrb = pWkRtnParms->pSrb;
+    PCDB pCdb;
+    PIMSCSI_TAGGED_PROXY_IO tagged_io;
     PVOID sysaddress;
-    PVOID buffer;
     LARGE_INTEGER startingSector;
-    LARGE_INTEGER startingOffset;
-    KLOCK_QUEUE_HANDLE LockHandle;
+    NTSTATUS status = STATUS_SUCCESS;
     KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
+    BOOLEAN is_write;
+    ULONG part_count = 1;
+    ULONG part_size;
+    ULONG sent_count;
+    ULONG allocated_size;
+
+    if ((pLUExt == NULL) ||
+        (pSrb == NULL) ||
+        (!pLUExt->UseProxy) ||
+        ((pLUExt->Proxy.tagged == NULL) && (pLUExt->Proxy.shm_ring == NULL)) ||
+        (pSrb->Function != SRB_FUNCTION_EXECUTE_SCSI) ||
+        (pWkRtnParms->pReqThread != NULL) ||
+        (pWkRtnParms->CallerWaitEvent != NULL))
+    {
+        return FALSE;
+    }
 
-    if (((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16)) &&
-        (((pLUExt->RegistrationKey == 0) && (pLUExt->ReservationKey != 0)) ||
-        (pLUExt->RegistrationKey != 0) && (pLUExt->ReservationKey == 0)))
+    pCdb = (PCDB)pSrb->Cdb;
+
+    switch (pSrb->Cdb[0])
     {
-        KdPrint(("PhDskMnt::ImScsiDispatchWork Write operation on unreserved LUN.\n"));
+    case SCSIOP_READ:
+    case SCSIOP_READ16:
+        is_write = FALSE;
+        break;
 
-        pSrb->SrbStatus = SRB_STATUS_ERROR;
-        pSrb->ScsiStatus = SCSISTAT_RESERVATION_CONFLICT;
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE16:
+        is_write = TRUE;
+        break;
 
-        return;
+    default:
+        return FALSE;
+    }
+
+    // Reservations and fake disk signature are handled on synchronous path
+    if ((pLUExt->RegistrationKey != 0) ||
+        (pLUExt->ReservationKey != 0) ||
+        (pLUExt->FakeDiskSignature != 0) ||
+        (pSrb->DataTransferLength == 0))
+    {
+        return FALSE;
+    }
+
+    ULONG s_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
+
+    if ((s_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
+    {
+        return FALSE;
     }
 
     if ((pCdb->AsByte[0] == SCSIOP_READ16) ||
@@ -243,182 +1728,167 @@ ImScsiDispatchReadWrite(
         REVERSE_BYTES(&startingSector, &pCdb->CDB10.LogicalBlockByte0);
     }
 
-    startingOffset.QuadPart = startingSector.QuadPart << pLUExt->BlockPower;
+    // Reads that were read ahead while queued are copied from cache on
+    // synchronous path
+    if (!is_write &&
+        ImScsiReadCacheContains(pLUExt,
+            startingSector.QuadPart << pLUExt->BlockPower,
+            pSrb->DataTransferLength, &lowest_assumed_irql))
+    {
+        return FALSE;
+    }
 
-    KdPrint2((__FUNCTION__ ": starting sector: 0x%I64X\n", startingSector));
+    // All-zero writes are turned into zero requests by ImScsiWriteDevice
+    if (is_write && pLUExt->SupportsZero &&
+        ImScsiIsBufferZero(sysaddress, pSrb->DataTransferLength))
+    {
+        return FALSE;
+    }
 
-    ULONG s_status = StoragePortGetSystemAddress(pHBAExt, pSrb, &sysaddress);
+    // Large requests are spread over all connections to server. Parts are
+    // whole blocks and received directly into their place in request buffer.
+    if (pLUExt->Proxy.tagged != NULL)
+    {
+        part_count = min(pLUExt->Proxy.extra_stream_count + 1,
+            pSrb->DataTransferLength / IMSCSI_TAGGED_PROXY_MIN_PART_SIZE);
+    }
 
-    if ((s_status != STORAGE_STATUS_SUCCESS) || (sysaddress == NULL))
+    if (part_count == 0)
     {
-        DbgPrint(__FUNCTION__ ": StorPortGetSystemAddress failed: status=0x%X address=0x%p translated=0x%p\n",
-            s_status,
-            pSrb->DataBuffer,
-            sysaddress);
+        part_count = 1;
+    }
 
-        pSrb->SrbStatus = SRB_STATUS_ERROR;
-        pSrb->ScsiStatus = SCSISTAT_GOOD;
+    part_size = pSrb->DataTransferLength / part_count;
+    part_size = (part_size + (1UL << pLUExt->BlockPower) - 1) &
+        ~((1UL << pLUExt->BlockPower) - 1);
 
-        return;
+    // Small enough for smallest data buffer class even with most parts, so
+    // it comes from a free list, like other allocations on I/O path
+    allocated_size = FIELD_OFFSET(IMSCSI_TAGGED_PROXY_IO, parts) +
+        part_count * sizeof(IMSCSI_TAGGED_PROXY_PART);
+
+    tagged_io = (PIMSCSI_TAGGED_PROXY_IO)ImScsiAllocateBuffer(allocated_size);
+
+    if (tagged_io == NULL)
+    {
+        return FALSE;
     }
 
-    buffer = ExAllocatePoolWithTag(NonPagedPool, pSrb->DataTransferLength, MP_TAG_GENERAL);
+    RtlZeroMemory(tagged_io, allocated_size);
 
-    if (buffer == NULL)
+    tagged_io->allocated_size = allocated_size;
+    tagged_io->pWkRtnParms = pWkRtnParms;
+    tagged_io->starting_sector = startingSector.QuadPart;
+    tagged_io->buffer = sysaddress;
+    tagged_io->sched_slot = SchedSlot;
+    tagged_io->qos_class = QosClass;
+
+    for (ULONG offset = 0; offset < pSrb->DataTransferLength;)
     {
-        DbgPrint(__FUNCTION__ ": Memory allocation failed.\n");
+        PIMSCSI_TAGGED_PROXY_PART part =
+            &tagged_io->parts[tagged_io->part_count++];
 
-        pSrb->SrbStatus = SRB_STATUS_ERROR;
-        pSrb->ScsiStatus = SCSISTAT_GOOD;
+        part->tagged_io = tagged_io;
+        part->offset = offset;
+        part->length = min(part_size, pSrb->DataTransferLength - offset);
+        part->request.CompletionRoutine = ImScsiTaggedProxyReadWriteCompletion;
+        part->request.CompletionContext = part;
 
-        return;
+        offset += part->length;
     }
 
-    NTSTATUS status = STATUS_NOT_IMPLEMENTED;
+    // Held until all parts are sent, so that request is not completed while
+    // still sending
+    tagged_io->pending_parts = (LONG)tagged_io->part_count + 1;
 
-    if ((pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16))
-    {
-        status = ImScsiReadDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
-    }
-    else if ((pSrb->Cdb[0] == SCSIOP_WRITE) || (pSrb->Cdb[0] == SCSIOP_WRITE16))
-    {
-        RtlMoveMemory(buffer, sysaddress, pSrb->DataTransferLength);
-        status = ImScsiWriteDevice(pLUExt, buffer, &startingOffset, &pSrb->DataTransferLength);
-    }
+    pWkRtnParms->BackendTime = ImScsiGetTimestamp();
 
-    if (!NT_SUCCESS(status))
-    {
-        ExFreePoolWithTag(buffer, MP_TAG_GENERAL);
+    ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_IO_START);
 
-        DbgPrint(__FUNCTION__ ": I/O error status=0x%X\n", status);
-        switch (status)
-        {
-        case STATUS_INVALID_BUFFER_SIZE:
-        {
-            DbgPrint(__FUNCTION__ ": STATUS_INVALID_BUFFER_SIZE from image I/O. Reporting SCSI_SENSE_ILLEGAL_REQUEST/SCSI_ADSENSE_INVALID_CDB/0x00.\n");
-            
-            ScsiSetCheckCondition(
-                pSrb,
-                SRB_STATUS_ERROR,
-                SCSI_SENSE_ILLEGAL_REQUEST,
-                SCSI_ADSENSE_INVALID_CDB,
-                0);
+    KdPrint2((__FUNCTION__ ": starting sector: 0x%I64X\n", startingSector));
 
-            return;
-        }
+    for (sent_count = 0; sent_count < tagged_io->part_count; sent_count++)
+    {
+        PIMSCSI_TAGGED_PROXY_PART part = &tagged_io->parts[sent_count];
+        LONGLONG offset = (startingSector.QuadPart << pLUExt->BlockPower) +
+            pLUExt->ImageOffset.QuadPart + part->offset;
 
-        case STATUS_DEVICE_BUSY:
+        if (is_write)
         {
-            DbgPrint(__FUNCTION__ ": STATUS_DEVICE_BUSY from image I/O. Reporting SRB_STATUS_BUSY/SCSI_SENSE_NOT_READY/SCSI_ADSENSE_LUN_NOT_READY/SCSI_SENSEQ_BECOMING_READY.\n");
-            
-            ScsiSetCheckCondition(
-                pSrb,
-                SRB_STATUS_BUSY,
-                SCSI_SENSE_NOT_READY,
-                SCSI_ADSENSE_LUN_NOT_READY,
-                SCSI_SENSEQ_BECOMING_READY
-            );
-            
-            return;
+            IMDPROXY_WRITE_REQ write_req = { 0 };
+
+            write_req.request_code = IMDPROXY_REQ_WRITE;
+            write_req.offset = offset;
+            write_req.length = part->length;
+
+            part->request.ResponseHeader = &part->write_resp;
+            part->request.ResponseHeaderSize = sizeof(part->write_resp);
+
+            status = ImScsiSendTaggedProxyRequest(&pLUExt->Proxy,
+                &part->request,
+                &pLUExt->StopThread,
+                &write_req,
+                sizeof(write_req),
+                (PUCHAR)sysaddress + part->offset,
+                part->length);
         }
-
-        case STATUS_CONNECTION_RESET:
-        case STATUS_DEVICE_REMOVED:
-        case STATUS_DEVICE_DOES_NOT_EXIST:
-        case STATUS_PIPE_BROKEN:
-        case STATUS_PIPE_DISCONNECTED:
-        case STATUS_PORT_DISCONNECTED:
-        case STATUS_REMOTE_DISCONNECT:
+        else
         {
-            DbgPrint(__FUNCTION__ ": Underlying image disconnected. Reporting SRB_STATUS_ERROR/SCSI_SENSE_NOT_READY/SCSI_ADSENSE_LUN_NOT_READY/SCSI_SENSEQ_NOT_REACHABLE.\n");
-            
-            ImScsiRemoveDevice(pHBAExt, &pLUExt->DeviceNumber, &lowest_assumed_irql);
-            
-            ScsiSetCheckCondition(
-                pSrb,
-                SRB_STATUS_BUSY,
-                SCSI_SENSE_NOT_READY,
-                SCSI_ADSENSE_LUN_COMMUNICATION,
-                SCSI_SENSEQ_NOT_REACHABLE
-            );
-
-            return;
+            IMDPROXY_READ_REQ read_req = { 0 };
+
+            read_req.request_code = IMDPROXY_REQ_READ;
+            read_req.offset = offset;
+            read_req.length = part->length;
+
+            // Data is received directly into request buffer
+            part->request.ResponseHeader = &part->read_resp;
+            part->request.ResponseHeaderSize = sizeof(part->read_resp);
+            part->request.ResponseData = (PUCHAR)sysaddress + part->offset;
+            part->request.ResponseDataBufferSize = part->length;
+            part->request.ResponseDataSize = &part->read_resp.length;
+
+            status = ImScsiSendTaggedProxyRequest(&pLUExt->Proxy,
+                &part->request,
+                &pLUExt->StopThread,
+                &read_req,
+                sizeof(read_req),
+                NULL,
+                0);
         }
 
-        default:
+        if (status != STATUS_PENDING)
         {
-            ScsiSetError(pSrb, SRB_STATUS_PARITY_ERROR);
-            return;
-        }
+            break;
         }
-
-        return;
     }
 
-    /// If "fake random disk signature" option is used.
-    /// Compatibility fix for mounting Windows Backup vhd files in read-only etc.
-    if ((pLUExt->FakeDiskSignature != 0) &&
-        ((pSrb->Cdb[0] == SCSIOP_READ) ||
-        (pSrb->Cdb[0] == SCSIOP_READ16)) &&
-            (startingSector.QuadPart == 0) &&
-        (pSrb->DataTransferLength >= 512))
+    if (sent_count == 0)
     {
-        PUCHAR mbr = (PUCHAR)buffer;
+        // Not sent. Let synchronous path report error or retry.
+        KdPrint((__FUNCTION__ ": Tagged request not sent (%#x).\n", status));
 
-        if ((*(PUSHORT)(mbr + 0x01FE) == 0xAA55) &&
-            (*(mbr + 0x01C2) != 0xEE) &&
-            ((*(mbr + 0x01BE) & 0x7F) == 0x00) &&
-            ((*(mbr + 0x01CE) & 0x7F) == 0x00) &&
-            ((*(mbr + 0x01DE) & 0x7F) == 0x00) &&
-            ((*(mbr + 0x01EE) & 0x7F) == 0x00))
-        {
-            DbgPrint(__FUNCTION__ ": Faking disk signature as %#X.\n", pLUExt->FakeDiskSignature);
+        ImScsiFreeBuffer(tagged_io, allocated_size);
 
-            *(PULONG)(mbr + 0x01B8) = pLUExt->FakeDiskSignature;
-        }
-        else
-        {
-            DbgPrint(__FUNCTION__ ": Present MBR data not compatible with fake disk signature option.\n");
+        pWkRtnParms->BackendTime = 0;
 
-            pLUExt->FakeDiskSignature = 0;
-        }
-    }
-    /// Allow the fake disk signature to be overwritten.
-    else if ((pLUExt->FakeDiskSignature != 0) &&
-        ((pSrb->Cdb[0] == SCSIOP_WRITE) ||
-        (pSrb->Cdb[0] == SCSIOP_WRITE16)) &&
-            (startingSector.QuadPart == 0) &&
-        (pSrb->DataTransferLength >= 512))
-    {
-        pLUExt->FakeDiskSignature = 0;
+        return FALSE;
     }
 
-    /// For read operations, temporary buffer holds read data.
-    /// Copy that to system buffer.
-    if ((pSrb->Cdb[0] == SCSIOP_READ) || (pSrb->Cdb[0] == SCSIOP_READ16))
+    // Some parts are already on their way, so request fails when the rest
+    // of them complete
+    for (ULONG i = sent_count; i < tagged_io->part_count; i++)
     {
-        RtlMoveMemory(sysaddress, buffer, pSrb->DataTransferLength);
+        tagged_io->parts[i].request.IoStatus.Status = STATUS_IO_DEVICE_ERROR;
     }
 
-    if (pLUExt->SharedImage)
+    if (InterlockedExchangeAdd(&tagged_io->pending_parts,
+        -(LONG)(tagged_io->part_count - sent_count + 1)) ==
+        (LONG)(tagged_io->part_count - sent_count + 1))
     {
-        ExFreePoolWithTag(buffer, MP_TAG_GENERAL);
-    }
-    else
-    {
-        ImScsiAcquireLock(&pLUExt->LastIoLock, &LockHandle, lowest_assumed_irql);
-
-        if (pLUExt->LastIoBuffer != NULL)
-            ExFreePoolWithTag(pLUExt->LastIoBuffer, MP_TAG_GENERAL);
-
-        pLUExt->LastIoStartSector = startingSector.QuadPart;
-        pLUExt->LastIoLength = pSrb->DataTransferLength;
-        pLUExt->LastIoBuffer = buffer;
-
-        ImScsiReleaseLock(&LockHandle, &lowest_assumed_irql);
+        ImScsiCompleteTaggedProxyReadWrite(tagged_io);
     }
 
-    ScsiSetSuccess(pSrb, pSrb->DataTransferLength);
+    return TRUE;
 }
 
 VOID
@@ -478,13 +1948,24 @@ __in pMP_WorkRtnParms        pWkRtnParms
         case SCSIOP_READ16:
         case SCSIOP_WRITE16:
             // Read/write?
-            ImScsiDispatchReadWrite(pHBAExt, pLUExt, pSrb);
+            ImScsiDispatchReadWrite(pHBAExt, pLUExt, pSrb,
+                &pWkRtnParms->BackendTime);
             break;
 
         case SCSIOP_UNMAP:
+        {
             // UNMAP/TRIM
+            LONGLONG backend_start = ImScsiGetTimestamp();
+
+            ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_IO_START);
+
             ImScsiDispatchUnmapDevice(pHBAExt, pLUExt, pSrb);
-            break;
+
+            pWkRtnParms->BackendTime = ImScsiGetTimestamp() - backend_start;
+
+            ImScsiTraceRequest(pLUExt, pSrb, IMSCSI_TRACE_IO_DONE);
+        }
+        break;
 
         default:
         {
@@ -510,6 +1991,7 @@ ImScsiDispatchUnmapDevice(
 {
     PUNMAP_LIST_HEADER list = (PUNMAP_LIST_HEADER)pSrb->DataBuffer;
     USHORT descrlength = RtlUshortByteSwap(*(PUSHORT)list->BlockDescrDataLength);
+    KIRQL lowest_assumed_irql = PASSIVE_LEVEL;
 
     UNREFERENCED_PARAMETER(pHBAExt);
     UNREFERENCED_PARAMETER(pLUExt);
@@ -619,6 +2101,19 @@ done:
 
     KdPrint((__FUNCTION__ ": Result: %#x\n", status));
 
+    // Unmapped blocks may read back as zeros, so drop them from read cache
+    // even if request failed half way.
+    for (USHORT i = 0; i < items; i++)
+    {
+        LONGLONG startingSector = RtlUlonglongByteSwap(*(PULONGLONG)list->Descriptors[i].StartingLba);
+        ULONG numBlocks = RtlUlongByteSwap(*(PULONG)list->Descriptors[i].LbaCount);
+
+        ImScsiReadCacheInvalidate(pLUExt,
+            startingSector << pLUExt->BlockPower,
+            (ULONGLONG)numBlocks << pLUExt->BlockPower,
+            &lowest_assumed_irql);
+    }
+
     ScsiSetSuccess(pSrb, 0);
 }
 
@@ -690,10 +2185,30 @@ ImScsiCreateLU(
     KeInitializeSpinLock(&pLUExt->RequestListLock);
     InitializeListHead(&pLUExt->RequestList);
     KeInitializeEvent(&pLUExt->RequestEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&pLUExt->SchedIdle, NotificationEvent, TRUE);
 
     KeInitializeEvent(&pLUExt->Initialized, NotificationEvent, FALSE);
 
-    KeInitializeSpinLock(&pLUExt->LastIoLock);
+    KeInitializeSpinLock(&pLUExt->ReadCacheLock);
+
+    KeInitializeSpinLock(&pLUExt->QosLock);
+    pLUExt->Qos.priority_class = ImScsiGetQosClass(new_device->Fields.Flags);
+
+    // Size of limits in request was checked in ScsiIoControl
+    if (IMSCSI_QOS_LIMITS(new_device->Fields.Flags))
+    {
+        IMSCSI_DEVICE_QOS_LIMITS qos_limits;
+
+        RtlCopyMemory(&qos_limits,
+            (PUCHAR)&new_device->Fields +
+            IMSCSI_QOS_LIMITS_OFFSET(&new_device->Fields),
+            sizeof(qos_limits));
+
+        ImScsiQosSetLimits(&pLUExt->Qos, qos_limits.MaxIops,
+            qos_limits.MaxBytesPerSecond, KeQueryInterruptTime());
+    }
+
+    KeInitializeSpinLock(&pLUExt->StatsLock);
 
     InsertHeadList(&pHBAExt->LUList, &pLUExt->List);
 
@@ -701,6 +2216,8 @@ ImScsiCreateLU(
 
     pLUExt->pHBAExt = pHBAExt;
 
+    ImScsiResizePools(1);
+
     ntstatus = ImScsiInitializeLU(pLUExt, new_device, pReqThread);
     if (!NT_SUCCESS(ntstatus))
     {